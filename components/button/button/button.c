@@ -23,11 +23,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/queue.h>
-#include <freertos/timers.h>
+#include <esp_attr.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <driver/gpio.h>
 #include <iot_button.h>
 
@@ -38,6 +38,24 @@
 #define ERR_ASSERT(tag, param)  IOT_CHECK(tag, (param) == ESP_OK, ESP_FAIL)
 #define POINT_ASSERT(tag, param, ret)    IOT_CHECK(tag, (param) != NULL, (ret))
 
+/*
+ * Every button is driven from one shared periodic esp_timer, the "tick wheel".
+ * Each tick samples every button, runs its debounce filter and advances its
+ * press/hold/tap counters, so no per-button or per-callback timers exist. The
+ * GPIO interrupts only wake the wheel up, and the wheel stops itself again once
+ * every button is idle, so there is no load at all while nothing is pressed.
+ *
+ * The interrupts are level triggered on the active level. Each one masks
+ * itself as soon as it fires, and the wheel unmasks them all once it goes idle,
+ * so a held or bouncing button can't storm the CPU. Being level triggered, the
+ * same pins can also wake the chip from light sleep when power management is
+ * enabled (the application still has to enable GPIO wakeup as a whole).
+ */
+#define BUTTON_TICK_MS                 CONFIG_IO_BUTTON_TICK_MS
+#define BUTTON_MS_TO_TICKS(ms)         (((ms) + BUTTON_TICK_MS - 1) / BUTTON_TICK_MS)
+#define BUTTON_GLITCH_FILTER_TICKS     BUTTON_MS_TO_TICKS(CONFIG_IO_GLITCH_FILTER_TIME_MS)
+#define BUTTON_DOUBLE_TAP_TICKS        BUTTON_MS_TO_TICKS(CONFIG_IO_BUTTON_DOUBLE_TAP_TIME_MS)
+
 typedef enum {
     BUTTON_STATE_IDLE = 0,
     BUTTON_STATE_PUSH,
@@ -48,11 +66,10 @@ typedef struct button_dev button_dev_t;
 typedef struct btn_cb button_cb_t;
 
 struct btn_cb{
-    TickType_t interval;
+    uint32_t interval;          /* In wheel ticks */
     button_cb cb;
     void* arg;
     uint8_t on_press;
-    TimerHandle_t tmr;
     button_dev_t *pbtn;
     button_cb_t *next_cb;
 };
@@ -60,148 +77,175 @@ struct btn_cb{
 struct button_dev{
     uint8_t io_num;
     uint8_t active_level;
-    uint32_t serial_thres_sec;
-    uint8_t taskq_on;
-    QueueHandle_t taskq;
-    QueueHandle_t argq;
     button_status_t state;
+    bool pressed;               /* Debounced level */
+    uint32_t filter_ticks;      /* Ticks the raw level has disagreed with pressed */
+    uint32_t hold_ticks;        /* Ticks since the debounced push */
+    uint32_t tap_wait_ticks;    /* Ticks left to wait for a second tap, 0 if none */
+    uint32_t serial_start_ticks;
     button_cb_t tap_short_cb;
     button_cb_t tap_psh_cb;
     button_cb_t tap_rls_cb;
     button_cb_t press_serial_cb;
+    button_cb_t double_tap_cb;
     button_cb_t* cb_head;
+    button_cb_t* release_cb;    /* Latest release callback reached while held */
+    button_dev_t* next;
 };
 
-#define BUTTON_GLITCH_FILTER_TIME_MS   CONFIG_IO_GLITCH_FILTER_TIME_MS
 static const char* TAG = "button";
 
-static void button_press_cb(TimerHandle_t tmr)
+static button_dev_t *s_button_head = NULL;
+static esp_timer_handle_t s_wheel = NULL;
+static bool s_wheel_running = false;
+static portMUX_TYPE s_wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void button_call(const button_cb_t *btn_cb)
 {
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    button_dev_t* btn = btn_cb->pbtn;
-    // low, then restart
-    if (btn->active_level == gpio_get_level(btn->io_num)) {
-        btn->state = BUTTON_STATE_PRESSED;
-        if (btn->taskq != NULL && btn->argq != NULL && btn->taskq_on && !btn_cb->on_press) {
-            void *tmp = btn_cb->cb;
-            xQueueOverwrite(btn->taskq, &tmp);
-            xQueueOverwrite(btn->argq, &btn_cb->arg);
-        } else if (btn_cb->cb) {
-            btn_cb->cb(btn_cb->arg);
-        }
+    if (btn_cb->cb) {
+        btn_cb->cb(btn_cb->arg);
     }
 }
 
-static void button_tap_psh_cb(TimerHandle_t tmr)
+static void button_on_push(button_dev_t *btn)
 {
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    button_dev_t* btn = btn_cb->pbtn;
-    xTimerStop(btn->tap_rls_cb.tmr, portMAX_DELAY);
-    int lv = gpio_get_level(btn->io_num);
-
-    if (btn->active_level == lv) {
-        // True implies key is pressed
-        btn->state = BUTTON_STATE_PUSH;
-        if (btn->press_serial_cb.tmr) {
-            xTimerChangePeriod(btn->press_serial_cb.tmr, btn->serial_thres_sec*1000 / portTICK_PERIOD_MS, portMAX_DELAY);
-            xTimerReset(btn->press_serial_cb.tmr, portMAX_DELAY);
-        }
-        if (btn->tap_psh_cb.cb) {
-            btn->tap_psh_cb.cb(btn->tap_psh_cb.arg);
-        }
-    } else {
-        // 50ms, check if this is a real key up
-        if (btn->tap_rls_cb.tmr) {
-            xTimerStop(btn->tap_rls_cb.tmr, portMAX_DELAY);
-            xTimerReset(btn->tap_rls_cb.tmr, portMAX_DELAY);
+    btn->state = BUTTON_STATE_PUSH;
+    btn->hold_ticks = 0;
+    btn->release_cb = NULL;
+    button_call(&btn->tap_psh_cb);
+}
+
+static void button_on_release(button_dev_t *btn)
+{
+    if (btn->release_cb && btn->state != BUTTON_STATE_IDLE) {
+        button_call(btn->release_cb);
+    }
+    if (btn->state == BUTTON_STATE_PUSH) {
+        if (btn->double_tap_cb.cb == NULL) {
+            button_call(&btn->tap_short_cb);
+        } else if (btn->tap_wait_ticks) {
+            // second tap inside the window
+            btn->tap_wait_ticks = 0;
+            button_call(&btn->double_tap_cb);
+        } else {
+            // hold the tap back until we know there's no second one
+            btn->tap_wait_ticks = BUTTON_DOUBLE_TAP_TICKS;
         }
     }
+    if (btn->state != BUTTON_STATE_IDLE) {
+        button_call(&btn->tap_rls_cb);
+    }
+    btn->state = BUTTON_STATE_IDLE;
+    btn->release_cb = NULL;
 }
 
-static void button_tap_rls_cb(TimerHandle_t tmr)
+static void button_on_hold(button_dev_t *btn)
 {
-    button_cb_t* btn_cb = (button_cb_t*) pvTimerGetTimerID(tmr);
-    button_dev_t* btn = btn_cb->pbtn;
-    xTimerStop(btn->tap_rls_cb.tmr, portMAX_DELAY);
-    if (btn->active_level == gpio_get_level(btn->io_num)) {
+    btn->hold_ticks++;
 
-    } else {
-        // high, then key is up
-        button_cb_t *pcb = btn->cb_head;
-        while (pcb != NULL) {
-            if (pcb->tmr != NULL) {
-                xTimerStop(pcb->tmr, portMAX_DELAY);
+    button_cb_t *pcb = btn->cb_head;
+    while (pcb != NULL) {
+        if (pcb->interval == btn->hold_ticks) {
+            btn->state = BUTTON_STATE_PRESSED;
+            if (pcb->on_press) {
+                button_call(pcb);
+            } else {
+                btn->release_cb = pcb;
             }
-            pcb = pcb->next_cb;
-        }
-        if (btn->taskq != NULL && btn->argq != NULL && btn->taskq_on && uxQueueMessagesWaiting(btn->taskq) != 0 && btn->state != BUTTON_STATE_IDLE) {
-            void (*task)(void*);
-            void *arg;
-            xQueueReceive(btn->taskq, &task, 0);
-            xQueueReceive(btn->argq, &arg, 0);
-            task(arg);
-        }
-        if (btn->press_serial_cb.tmr && btn->press_serial_cb.tmr != NULL) {
-            xTimerStop(btn->press_serial_cb.tmr, portMAX_DELAY);
         }
-        if (btn->tap_short_cb.cb && btn->state == BUTTON_STATE_PUSH) {
-            btn->tap_short_cb.cb(btn->tap_short_cb.arg);
-        }
-        if(btn->tap_rls_cb.cb && btn->state != BUTTON_STATE_IDLE) {
-            btn->tap_rls_cb.cb(btn->tap_rls_cb.arg);
-        }
-        btn->state = BUTTON_STATE_IDLE;
+        pcb = pcb->next_cb;
     }
-}
 
-static void button_press_serial_cb(TimerHandle_t tmr)
-{
-    button_dev_t* btn = (button_dev_t*) pvTimerGetTimerID(tmr);
-    if (btn->press_serial_cb.cb) {
-        btn->press_serial_cb.cb(btn->press_serial_cb.arg);
+    if (btn->press_serial_cb.cb && btn->hold_ticks >= btn->serial_start_ticks &&
+        (btn->hold_ticks - btn->serial_start_ticks) % btn->press_serial_cb.interval == 0) {
+        button_call(&btn->press_serial_cb);
     }
-    xTimerChangePeriod(btn->press_serial_cb.tmr, btn->press_serial_cb.interval, portMAX_DELAY);
-    xTimerReset(btn->press_serial_cb.tmr, portMAX_DELAY);
 }
 
-static void button_gpio_isr_handler(void* arg)
+/* Returns whether the button still needs the wheel running */
+static bool button_tick(button_dev_t *btn)
 {
-    button_dev_t* btn = (button_dev_t*) arg;
-    portBASE_TYPE HPTaskAwoken = pdFALSE;
-    int level = gpio_get_level(btn->io_num);
-    if (level == btn->active_level) {
-        if (btn->tap_psh_cb.tmr) {
-            xTimerStopFromISR(btn->tap_psh_cb.tmr, &HPTaskAwoken);
-            xTimerResetFromISR(btn->tap_psh_cb.tmr, &HPTaskAwoken);
-        }
+    bool raw = (btn->active_level == gpio_get_level(btn->io_num));
 
-        button_cb_t *pcb = btn->cb_head;
-        while (pcb != NULL) {
-            if (pcb->tmr != NULL) {
-                xTimerStopFromISR(pcb->tmr, &HPTaskAwoken);
-                xTimerResetFromISR(pcb->tmr, &HPTaskAwoken);
+    if (raw != btn->pressed) {
+        if (++btn->filter_ticks >= BUTTON_GLITCH_FILTER_TICKS) {
+            btn->filter_ticks = 0;
+            btn->pressed = raw;
+            if (raw) {
+                button_on_push(btn);
+            } else {
+                button_on_release(btn);
             }
-            pcb = pcb->next_cb;
         }
     } else {
-        // 50ms, check if this is a real key up
-        if (btn->tap_rls_cb.tmr) {
-            xTimerStopFromISR(btn->tap_rls_cb.tmr, &HPTaskAwoken);
-            xTimerResetFromISR(btn->tap_rls_cb.tmr, &HPTaskAwoken);
+        // level bounced back, not a real change
+        btn->filter_ticks = 0;
+    }
+
+    if (btn->pressed && btn->filter_ticks == 0) {
+        button_on_hold(btn);
+    }
+
+    if (!btn->pressed && btn->tap_wait_ticks && --btn->tap_wait_ticks == 0) {
+        // no second tap came, it was a single tap after all
+        button_call(&btn->tap_short_cb);
+    }
+
+    return btn->pressed || btn->filter_ticks || btn->tap_wait_ticks;
+}
+
+static void button_wheel_cb(void *arg)
+{
+    bool active = false;
+
+    for (button_dev_t *btn = s_button_head; btn != NULL; btn = btn->next) {
+        active |= button_tick(btn);
+    }
+
+    if (!active) {
+        portENTER_CRITICAL(&s_wheel_lock);
+        s_wheel_running = false;
+        esp_timer_stop(s_wheel);
+        portEXIT_CRITICAL(&s_wheel_lock);
+
+        // every button is back at its inactive level, listen for the next push
+        for (button_dev_t *btn = s_button_head; btn != NULL; btn = btn->next) {
+            gpio_intr_enable(btn->io_num);
         }
     }
-    if(HPTaskAwoken == pdTRUE) {
-        portYIELD_FROM_ISR();
+}
+
+static void IRAM_ATTR button_wheel_wake(void)
+{
+    portENTER_CRITICAL_SAFE(&s_wheel_lock);
+    if (!s_wheel_running && s_wheel) {
+        s_wheel_running = true;
+        esp_timer_start_periodic(s_wheel, BUTTON_TICK_MS * 1000);
     }
+    portEXIT_CRITICAL_SAFE(&s_wheel_lock);
+}
+
+static void IRAM_ATTR button_gpio_isr_handler(void* arg)
+{
+    button_dev_t *btn = (button_dev_t *) arg;
+
+    // level triggered, stay quiet until the wheel has dealt with this push
+    gpio_intr_disable(btn->io_num);
+    button_wheel_wake();
 }
 
-static void button_free_tmr(TimerHandle_t* tmr)
+static esp_err_t button_wheel_init(void)
 {
-    if (tmr && *tmr) {
-        xTimerStop(*tmr, portMAX_DELAY);
-        xTimerDelete(*tmr, portMAX_DELAY);
-        *tmr = NULL;
+    if (s_wheel) {
+        return ESP_OK;
     }
+    esp_timer_create_args_t wheel_args = {
+        .callback = button_wheel_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "btn_wheel",
+    };
+    return esp_timer_create(&wheel_args, &s_wheel);
 }
 
 esp_err_t iot_button_delete(button_handle_t btn_handle)
@@ -211,15 +255,19 @@ esp_err_t iot_button_delete(button_handle_t btn_handle)
     gpio_set_intr_type(btn->io_num, GPIO_INTR_DISABLE);
     gpio_isr_handler_remove(btn->io_num);
 
-    button_free_tmr(&btn->tap_rls_cb.tmr);
-    button_free_tmr(&btn->tap_psh_cb.tmr);
-    button_free_tmr(&btn->tap_short_cb.tmr);
-    button_free_tmr(&btn->press_serial_cb.tmr);
+    portENTER_CRITICAL(&s_wheel_lock);
+    button_dev_t **pprev = &s_button_head;
+    while (*pprev != NULL && *pprev != btn) {
+        pprev = &(*pprev)->next;
+    }
+    if (*pprev == btn) {
+        *pprev = btn->next;
+    }
+    portEXIT_CRITICAL(&s_wheel_lock);
 
     button_cb_t *pcb = btn->cb_head;
     while (pcb != NULL) {
         button_cb_t *cb_next = pcb->next_cb;
-        button_free_tmr(&pcb->tmr);
         free(pcb);
         pcb = cb_next;
     }
@@ -230,40 +278,43 @@ esp_err_t iot_button_delete(button_handle_t btn_handle)
 button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_level)
 {
     IOT_CHECK(TAG, gpio_num < GPIO_NUM_MAX, NULL);
+    IOT_CHECK(TAG, button_wheel_init() == ESP_OK, NULL);
     button_dev_t* btn = (button_dev_t*) calloc(1, sizeof(button_dev_t));
     POINT_ASSERT(TAG, btn, NULL);
     btn->active_level = active_level;
     btn->io_num = gpio_num;
     btn->state = BUTTON_STATE_IDLE;
-    btn->taskq_on = 0;
-    btn->taskq = xQueueCreate(1, sizeof(void*));
-    btn->argq = xQueueCreate(1, sizeof(void *));
-    btn->tap_rls_cb.arg = NULL;
-    btn->tap_rls_cb.cb = NULL;
-    btn->tap_rls_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
     btn->tap_rls_cb.pbtn = btn;
-    btn->tap_rls_cb.tmr = xTimerCreate("btn_rls_tmr", btn->tap_rls_cb.interval, pdFALSE,
-            &btn->tap_rls_cb, button_tap_rls_cb);
-    btn->tap_psh_cb.arg = NULL;
-    btn->tap_psh_cb.cb = NULL;
-    btn->tap_psh_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
     btn->tap_psh_cb.pbtn = btn;
-    btn->tap_psh_cb.tmr = xTimerCreate("btn_psh_tmr", btn->tap_psh_cb.interval, pdFALSE,
-            &btn->tap_psh_cb, button_tap_psh_cb);
+    btn->tap_short_cb.pbtn = btn;
+    btn->press_serial_cb.pbtn = btn;
+    btn->double_tap_cb.pbtn = btn;
     gpio_install_isr_service(0);
     gpio_config_t gpio_conf;
-    gpio_conf.intr_type = GPIO_INTR_ANYEDGE;
+    gpio_conf.intr_type = (active_level == BUTTON_ACTIVE_HIGH) ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
     gpio_conf.mode = GPIO_MODE_INPUT;
-    gpio_conf.pin_bit_mask = (1 << gpio_num);
-    gpio_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
-    gpio_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+    gpio_conf.pin_bit_mask = (1ULL << gpio_num);
+    // pull the pin towards its inactive level
+    gpio_conf.pull_down_en = (active_level == BUTTON_ACTIVE_HIGH) ? GPIO_PULLDOWN_ENABLE : GPIO_PULLDOWN_DISABLE;
+    gpio_conf.pull_up_en = (active_level == BUTTON_ACTIVE_HIGH) ? GPIO_PULLUP_DISABLE : GPIO_PULLUP_ENABLE;
     gpio_config(&gpio_conf);
+#if CONFIG_PM_ENABLE
+    // let a push wake the chip from light sleep too
+    gpio_wakeup_enable(gpio_num, gpio_conf.intr_type);
+#endif
+
+    portENTER_CRITICAL(&s_wheel_lock);
+    btn->next = s_button_head;
+    s_button_head = btn;
+    portEXIT_CRITICAL(&s_wheel_lock);
+
     gpio_isr_handler_add(gpio_num, button_gpio_isr_handler, btn);
     return (button_handle_t) btn;
 }
 
 esp_err_t iot_button_rm_cb(button_handle_t btn_handle, button_cb_type_t type)
 {
+    POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
     button_cb_t* btn_cb = NULL;
     if (type == BUTTON_CB_PUSH) {
@@ -274,27 +325,26 @@ esp_err_t iot_button_rm_cb(button_handle_t btn_handle, button_cb_type_t type)
         btn_cb = &btn->tap_short_cb;
     } else if (type == BUTTON_CB_SERIAL) {
         btn_cb = &btn->press_serial_cb;
+    } else if (type == BUTTON_CB_DOUBLE_TAP) {
+        btn_cb = &btn->double_tap_cb;
     }
+    POINT_ASSERT(TAG, btn_cb, ESP_ERR_INVALID_ARG);
     btn_cb->cb = NULL;
     btn_cb->arg = NULL;
     btn_cb->pbtn = btn;
-    button_free_tmr(&btn_cb->tmr);
     return ESP_OK;
 }
 
 esp_err_t iot_button_set_serial_cb(button_handle_t btn_handle, uint32_t start_after_sec, TickType_t interval_tick, button_cb cb, void* arg)
 {
+    POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
-    btn->serial_thres_sec = start_after_sec;
-    if (btn->press_serial_cb.tmr == NULL) {
-        btn->press_serial_cb.tmr = xTimerCreate("btn_serial_tmr", btn->serial_thres_sec*1000 / portTICK_PERIOD_MS,
-                            pdFALSE, btn, button_press_serial_cb);
-    }
+    uint32_t interval = BUTTON_MS_TO_TICKS(interval_tick * portTICK_PERIOD_MS);
+    btn->serial_start_ticks = BUTTON_MS_TO_TICKS(start_after_sec * 1000);
     btn->press_serial_cb.arg = arg;
-    btn->press_serial_cb.cb = cb;
-    btn->press_serial_cb.interval = interval_tick;
+    btn->press_serial_cb.interval = (interval) ? interval : 1;
     btn->press_serial_cb.pbtn = btn;
-    xTimerChangePeriod(btn->press_serial_cb.tmr, btn->serial_thres_sec*1000 / portTICK_PERIOD_MS, portMAX_DELAY);
+    btn->press_serial_cb.cb = cb;
     return ESP_OK;
 }
 
@@ -302,62 +352,50 @@ esp_err_t iot_button_set_evt_cb(button_handle_t btn_handle, button_cb_type_t typ
 {
     POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
+    button_cb_t* btn_cb = NULL;
     if (type == BUTTON_CB_PUSH) {
-        btn->tap_psh_cb.arg = arg;
-        btn->tap_psh_cb.cb = cb;
-        btn->tap_psh_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
-        btn->tap_psh_cb.pbtn = btn;
-        xTimerChangePeriod(btn->tap_psh_cb.tmr, btn->tap_psh_cb.interval, portMAX_DELAY);
+        btn_cb = &btn->tap_psh_cb;
     } else if (type == BUTTON_CB_RELEASE) {
-        btn->tap_rls_cb.arg = arg;
-        btn->tap_rls_cb.cb = cb;
-        btn->tap_rls_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
-        btn->tap_rls_cb.pbtn = btn;
-        xTimerChangePeriod(btn->tap_rls_cb.tmr, btn->tap_psh_cb.interval, portMAX_DELAY);
+        btn_cb = &btn->tap_rls_cb;
     } else if (type == BUTTON_CB_TAP) {
-        btn->tap_short_cb.arg = arg;
-        btn->tap_short_cb.cb = cb;
-        btn->tap_short_cb.interval = BUTTON_GLITCH_FILTER_TIME_MS / portTICK_PERIOD_MS;
-        btn->tap_short_cb.pbtn = btn;
+        btn_cb = &btn->tap_short_cb;
+    } else if (type == BUTTON_CB_DOUBLE_TAP) {
+        btn_cb = &btn->double_tap_cb;
     } else if (type == BUTTON_CB_SERIAL) {
-        iot_button_set_serial_cb(btn_handle, 1, 1000 / portTICK_PERIOD_MS, cb, arg);
+        return iot_button_set_serial_cb(btn_handle, 1, 1000 / portTICK_PERIOD_MS, cb, arg);
     }
+    POINT_ASSERT(TAG, btn_cb, ESP_ERR_INVALID_ARG);
+    btn_cb->arg = arg;
+    btn_cb->pbtn = btn;
+    btn_cb->cb = cb;
     return ESP_OK;
 }
 
-esp_err_t iot_button_add_on_press_cb(button_handle_t btn_handle, uint32_t press_sec, button_cb cb, void* arg)
+static esp_err_t button_add_hold_cb(button_handle_t btn_handle, uint32_t press_sec, uint8_t on_press, button_cb cb, void* arg)
 {
     POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
     IOT_CHECK(TAG, press_sec != 0, ESP_ERR_INVALID_ARG);
     button_dev_t* btn = (button_dev_t*) btn_handle;
     button_cb_t* cb_new = (button_cb_t*) calloc(1, sizeof(button_cb_t));
     POINT_ASSERT(TAG, cb_new, ESP_FAIL);
-    cb_new->on_press = 1;
+    cb_new->on_press = on_press;
     cb_new->arg = arg;
     cb_new->cb = cb;
-    cb_new->interval = press_sec * 1000 / portTICK_PERIOD_MS;
+    cb_new->interval = BUTTON_MS_TO_TICKS(press_sec * 1000);
     cb_new->pbtn = btn;
-    cb_new->tmr = xTimerCreate("btn_press_tmr", cb_new->interval, pdFALSE, cb_new, button_press_cb);
+    portENTER_CRITICAL(&s_wheel_lock);
     cb_new->next_cb = btn->cb_head;
     btn->cb_head = cb_new;
+    portEXIT_CRITICAL(&s_wheel_lock);
     return ESP_OK;
 }
 
-esp_err_t iot_button_add_on_release_cb(button_handle_t btn_handle, uint32_t press_sec, button_cb cb, void* arg)
+esp_err_t iot_button_add_on_press_cb(button_handle_t btn_handle, uint32_t press_sec, button_cb cb, void* arg)
 {
-    POINT_ASSERT(TAG, btn_handle, ESP_ERR_INVALID_ARG);
-    IOT_CHECK(TAG, press_sec != 0, ESP_ERR_INVALID_ARG);
-    button_dev_t* btn = (button_dev_t*) btn_handle;
-    button_cb_t* cb_new = (button_cb_t*) calloc(1, sizeof(button_cb_t));
-    POINT_ASSERT(TAG, cb_new, ESP_FAIL);
-    btn->taskq_on = 1;
-    cb_new->arg = arg;
-    cb_new->cb = cb;
-    cb_new->interval = press_sec * 1000 / portTICK_PERIOD_MS;
-    cb_new->pbtn = btn;
-    cb_new->tmr = xTimerCreate("btn_press_tmr", cb_new->interval, pdFALSE, cb_new, button_press_cb);
-    cb_new->next_cb = btn->cb_head;
-    btn->cb_head = cb_new;
-    return ESP_OK;
+    return button_add_hold_cb(btn_handle, press_sec, 1, cb, arg);
 }
 
+esp_err_t iot_button_add_on_release_cb(button_handle_t btn_handle, uint32_t press_sec, button_cb cb, void* arg)
+{
+    return button_add_hold_cb(btn_handle, press_sec, 0, cb, arg);
+}
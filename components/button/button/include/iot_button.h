@@ -44,6 +44,7 @@ typedef enum {
     BUTTON_CB_RELEASE,    /*!<button release callback event */
     BUTTON_CB_TAP,        /*!<button quick tap callback event(will not trigger if there already is a "PRESS" event) */
     BUTTON_CB_SERIAL,     /*!<button serial trigger callback event */
+    BUTTON_CB_DOUBLE_TAP, /*!<button double tap callback event (delays "TAP" until the double tap window has passed) */
 } button_cb_type_t;
 
 /**
@@ -66,7 +67,7 @@ button_handle_t iot_button_create(gpio_num_t gpio_num, button_active_t active_le
  * @param cb callback function for "TAP" action.
  * @param arg Parameter for callback function
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the esp_timer task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -84,7 +85,7 @@ esp_err_t iot_button_set_serial_cb(button_handle_t btn_handle, uint32_t start_af
  * @param cb callback function for "TAP" action.
  * @param arg Parameter for callback function
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the esp_timer task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -104,7 +105,7 @@ esp_err_t iot_button_set_evt_cb(button_handle_t btn_handle, button_cb_type_t typ
  * @param arg Parameter for callback function
  *
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the esp_timer task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -124,7 +125,7 @@ esp_err_t iot_button_add_on_press_cb(button_handle_t btn_handle, uint32_t press_
  * @param arg Parameter for callback function
  * 
  * @note
- *        Button callback functions execute in the context of the timer service task.
+ *        Button callback functions execute in the context of the esp_timer task.
  *        It is therefore essential that button callback functions never attempt to block.
  *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
  *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -200,7 +201,7 @@ public:
      * @param cb callback function for "TAP" action.
      * @param arg Parameter for callback function
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the esp_timer task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -219,7 +220,7 @@ public:
      * @param cb callback function for "TAP" action.
      * @param arg Parameter for callback function
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the esp_timer task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -237,7 +238,7 @@ public:
      * @param arg Parameter for callback function
      *
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the esp_timer task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
@@ -255,7 +256,7 @@ public:
      * @param arg Parameter for callback function
      *
      * @note
-     *        Button callback functions execute in the context of the timer service task.
+     *        Button callback functions execute in the context of the esp_timer task.
      *        It is therefore essential that button callback functions never attempt to block.
      *        For example, a button callback function must not call vTaskDelay(), vTaskDelayUntil(),
      *        or specify a non zero block time when accessing a queue or a semaphore.
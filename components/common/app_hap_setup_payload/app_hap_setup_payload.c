@@ -5,25 +5,124 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <stdlib.h>
+#include <string.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <hap.h>
 #include <qrcode.h>
+#include <nvs.h>
+#include <hap_platform_keystore.h>
 
 static const char *TAG = "app_hap_setup_payload";
 
 #define QRCODE_BASE_URL     "https://espressif.github.io/esp-homekit-sdk/qrcode.html"
 
+#define SETUP_QR_NVS_NAMESPACE  "hap_setup_qr"
+#define SETUP_QR_NVS_PAYLOAD    "payload"
+#define SETUP_QR_NVS_QRCODE     "qrcode"
+#define SETUP_QR_NVS_PARTITION  "nvs"
+
+#ifdef CONFIG_APP_HAP_SETUP_PAYLOAD_CACHE
+
+/* Reads the QR Code cached for the given payload from an NVS partition.
+ * Returns the length of the QR Code, 0 if there is none for this payload.
+ */
+static size_t setup_qr_cache_get(const char *part_name, const char *setup_payload, uint8_t *qrcode)
+{
+    nvs_handle_t handle;
+    char cached_payload[24];
+    size_t payload_len = sizeof(cached_payload);
+    size_t qrcode_len = QRCODE_BUFFER_LEN;
+
+    if (nvs_open_from_partition(part_name, SETUP_QR_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return 0;
+    }
+    if ((nvs_get_str(handle, SETUP_QR_NVS_PAYLOAD, cached_payload, &payload_len) != ESP_OK)
+            || strcmp(cached_payload, setup_payload)
+            || (nvs_get_blob(handle, SETUP_QR_NVS_QRCODE, qrcode, &qrcode_len) != ESP_OK)) {
+        qrcode_len = 0;
+    }
+    nvs_close(handle);
+    return qrcode_len;
+}
+
+static void setup_qr_cache_set(const char *setup_payload, const uint8_t *qrcode, size_t qrcode_len)
+{
+    nvs_handle_t handle;
+
+    if (nvs_open_from_partition(SETUP_QR_NVS_PARTITION, SETUP_QR_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if ((nvs_set_str(handle, SETUP_QR_NVS_PAYLOAD, setup_payload) != ESP_OK)
+            || (nvs_set_blob(handle, SETUP_QR_NVS_QRCODE, qrcode, qrcode_len) != ESP_OK)
+            || (nvs_commit(handle) != ESP_OK)) {
+        ESP_LOGW(TAG, "Failed to cache the setup QR code");
+    }
+    nvs_close(handle);
+}
+
+/* Displays the QR Code for the payload, encoding it only if no valid copy is cached */
+static esp_err_t setup_qr_display(const char *setup_payload)
+{
+    uint8_t qrcode[QRCODE_BUFFER_LEN];
+    size_t qrcode_len = setup_qr_cache_get(hap_platform_keystore_get_factory_nvs_partition_name(),
+            setup_payload, qrcode);
+    if (!qrcode_len) {
+        qrcode_len = setup_qr_cache_get(SETUP_QR_NVS_PARTITION, setup_payload, qrcode);
+    }
+    if (qrcode_len && (qrcode_display_encoded(qrcode, qrcode_len) == ESP_OK)) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = qrcode_encode(setup_payload, qrcode, &qrcode_len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    setup_qr_cache_set(setup_payload, qrcode, qrcode_len);
+    return qrcode_display_encoded(qrcode, qrcode_len);
+}
+#else
+static esp_err_t setup_qr_display(const char *setup_payload)
+{
+    return qrcode_display(setup_payload);
+}
+#endif /* CONFIG_APP_HAP_SETUP_PAYLOAD_CACHE */
+
+static void setup_payload_show(const char *setup_payload)
+{
+    ESP_LOGI(TAG, "-----QR Code for HomeKit-----");
+    ESP_LOGI(TAG, "Scan this QR code from the Home app on iOS");
+    setup_qr_display(setup_payload);
+    ESP_LOGI(TAG, "If QR code is not visible, copy paste the below URL in a browser.\n%s?data=%s", QRCODE_BASE_URL, setup_payload);
+}
+
 esp_err_t app_hap_setup_payload(char *setup_code, char *setup_id, bool wac_support, hap_cid_t cid)
 {
     char *setup_payload =  esp_hap_get_setup_payload(setup_code, setup_id, wac_support, cid);
     if (setup_payload) {
-        ESP_LOGI(TAG, "-----QR Code for HomeKit-----");
-        ESP_LOGI(TAG, "Scan this QR code from the Home app on iOS");
-        qrcode_display(setup_payload);
-        ESP_LOGI(TAG, "If QR code is not visible, copy paste the below URL in a browser.\n%s?data=%s", QRCODE_BASE_URL, setup_payload);
+        setup_payload_show(setup_payload);
         free(setup_payload);
         return ESP_OK;
     }
     return ESP_FAIL;
 }
+
+esp_err_t app_hap_setup_payload_provisioned(void)
+{
+    nvs_handle_t handle;
+    char setup_payload[24];
+    size_t payload_len = sizeof(setup_payload);
+    esp_err_t err = nvs_open_from_partition(hap_platform_keystore_get_factory_nvs_partition_name(),
+            SETUP_QR_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_OK) {
+        err = nvs_get_str(handle, SETUP_QR_NVS_PAYLOAD, setup_payload, &payload_len);
+        nvs_close(handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No setup payload in the factory NVS partition");
+        return ESP_ERR_NOT_FOUND;
+    }
+    setup_payload_show(setup_payload);
+    return ESP_OK;
+}
@@ -22,3 +22,14 @@
  * @return ESP_FAIL on failure.
  */
 esp_err_t app_hap_setup_payload(char *setup_code, char *setup_id, bool wac_support, hap_cid_t cid);
+
+/** Show the HAP Setup payload provisioned in the factory NVS partition
+ *
+ * For accessories that hold only the setup info, not the setup code. The payload,
+ * and optionally its encoded QR code, are put in the factory NVS partition along
+ * with the setup info by the factory provisioning tool.
+ *
+ * @return ESP_OK on success.
+ * @return ESP_ERR_NOT_FOUND if no payload was provisioned.
+ */
+esp_err_t app_hap_setup_payload_provisioned(void);
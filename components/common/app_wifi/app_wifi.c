@@ -29,6 +29,7 @@
 #include <esp_wifi.h>
 #include <esp_event.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <esp_idf_version.h>
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 1, 0)
 // Features supported in 4.1+
@@ -72,12 +73,273 @@
 
 #include <nvs.h>
 #include <nvs_flash.h>
+#ifdef CONFIG_APP_WIFI_ROAMING
+#include <esp_wnm.h>
+#endif
 #include "app_wifi.h"
 
 static const char *TAG = "app_wifi";
 static const int WIFI_CONNECTED_EVENT = BIT0;
 static EventGroupHandle_t wifi_event_group;
 
+/* Start of the current connection attempt, for the time-to-IP metric */
+static int64_t connect_start_us;
+static app_wifi_stats_t wifi_stats;
+
+/* Current power save profile and when it was entered, for the residency stats */
+static app_wifi_ps_profile_t ps_profile = APP_WIFI_PS_MIN_MODEM;
+static int64_t ps_profile_start_us;
+static uint64_t ps_residency_us[APP_WIFI_PS_PROFILE_MAX];
+static portMUX_TYPE ps_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const wifi_ps_type_t ps_types[APP_WIFI_PS_PROFILE_MAX] = {
+    [APP_WIFI_PS_NONE] = WIFI_PS_NONE,
+    [APP_WIFI_PS_MIN_MODEM] = WIFI_PS_MIN_MODEM,
+    [APP_WIFI_PS_MAX_MODEM] = WIFI_PS_MAX_MODEM,
+};
+
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+/* The AP last connected to. The first attempt after a boot or a disconnect
+ * goes straight to it, without a scan across all channels. The PMK is cached
+ * by the Wi-Fi driver itself along with the config, so the association also
+ * skips the PBKDF2 derivation.
+ */
+#define FAST_RECONNECT_NVS_NAMESPACE   "app_wifi"
+#define FAST_RECONNECT_NVS_KEY         "last_ap"
+
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+} app_wifi_last_ap_t;
+
+static app_wifi_last_ap_t last_ap;
+static bool last_ap_valid;
+static bool fast_connect_active;
+static bool sta_was_connected;
+
+static void fast_reconnect_load(void)
+{
+    nvs_handle_t handle;
+    if (nvs_open(FAST_RECONNECT_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(last_ap);
+    last_ap_valid = (nvs_get_blob(handle, FAST_RECONNECT_NVS_KEY, &last_ap, &len) == ESP_OK) &&
+            (len == sizeof(last_ap));
+    nvs_close(handle);
+}
+
+/* Only written when the AP changed, to spare the flash */
+static void fast_reconnect_save(const uint8_t *bssid, uint8_t channel)
+{
+    if (last_ap_valid && !memcmp(last_ap.bssid, bssid, sizeof(last_ap.bssid)) &&
+            (last_ap.channel == channel)) {
+        return;
+    }
+    memcpy(last_ap.bssid, bssid, sizeof(last_ap.bssid));
+    last_ap.channel = channel;
+    last_ap_valid = true;
+    nvs_handle_t handle;
+    if (nvs_open(FAST_RECONNECT_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(handle, FAST_RECONNECT_NVS_KEY, &last_ap, sizeof(last_ap)) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/* Pins the station config to the last AP, or releases it for a full scan */
+static void fast_reconnect_apply(bool fast)
+{
+    wifi_config_t wifi_cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_cfg) != ESP_OK) {
+        return;
+    }
+    fast = fast && last_ap_valid;
+    if (!fast && !wifi_cfg.sta.bssid_set && !wifi_cfg.sta.channel) {
+        fast_connect_active = false;
+        return;
+    }
+    if (fast) {
+        memcpy(wifi_cfg.sta.bssid, last_ap.bssid, sizeof(wifi_cfg.sta.bssid));
+        wifi_cfg.sta.bssid_set = true;
+        wifi_cfg.sta.channel = last_ap.channel;
+    } else {
+        wifi_cfg.sta.bssid_set = false;
+        wifi_cfg.sta.channel = 0;
+    }
+    fast_connect_active = (esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg) == ESP_OK) && fast;
+}
+
+static void fast_reconnect_connected(void)
+{
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        fast_reconnect_save(ap_info.bssid, ap_info.primary);
+    }
+    if (fast_connect_active) {
+        wifi_stats.fast_connects++;
+    }
+}
+
+/* A failed attempt on the last AP falls back to a full scan. Otherwise, a
+ * drop from a working connection, like a router reboot, tries it first.
+ */
+static void fast_reconnect_disconnected(void)
+{
+    if (fast_connect_active) {
+        ESP_LOGI(TAG, "Last AP not reachable, falling back to a full scan");
+        fast_reconnect_apply(false);
+    } else if (sta_was_connected) {
+        fast_reconnect_apply(true);
+    }
+    sta_was_connected = false;
+}
+#endif /* CONFIG_APP_WIFI_FAST_RECONNECT */
+
+#ifdef CONFIG_APP_WIFI_ROAMING
+/* Roaming between the APs of a mesh network. The station advertises 802.11k/v
+ * (and r) support when associating. Once the signal drops below the threshold,
+ * it sends a BSS transition management query, and the AP answers with the
+ * candidates it knows of from its own neighbor reports. The supplicant then
+ * moves over, with FT if the network has it. The IP address stays the same,
+ * so lwIP keeps the TCP connections of the HomeKit sessions open through it.
+ *
+ * The RSSI threshold event only fires once, so it is armed again on every
+ * connection, and after the backoff following an attempt.
+ */
+static esp_timer_handle_t roam_timer;
+static bool roam_pending;
+static uint8_t roam_from_bssid[6];
+
+static void roam_arm(void)
+{
+    esp_wifi_set_rssi_threshold(CONFIG_APP_WIFI_ROAM_RSSI_THRESHOLD);
+}
+
+static void roam_timer_cb(void *arg)
+{
+    roam_pending = false;
+    roam_arm();
+}
+
+static void roam_rssi_low(int32_t rssi)
+{
+    wifi_ap_record_t ap_info;
+    if (!esp_wnm_is_btm_supported_connection()) {
+        ESP_LOGI(TAG, "RSSI %d dBm, but the AP does not support BSS transitions", (int)rssi);
+    } else if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        ESP_LOGI(TAG, "RSSI %d dBm, asking the AP for a better one", (int)rssi);
+        memcpy(roam_from_bssid, ap_info.bssid, sizeof(roam_from_bssid));
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+        /* A BSSID pinned for the fast reconnect would keep the station on this AP */
+        fast_reconnect_apply(false);
+#endif
+        roam_pending = (esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, NULL, 0) == 0);
+        wifi_stats.roam_queries++;
+    }
+    esp_timer_start_once(roam_timer, CONFIG_APP_WIFI_ROAM_BACKOFF_S * 1000000ULL);
+}
+
+static void roam_connected(void)
+{
+    wifi_ap_record_t ap_info;
+    if (roam_pending && (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) &&
+            memcmp(ap_info.bssid, roam_from_bssid, sizeof(roam_from_bssid))) {
+        ESP_LOGI(TAG, "Roamed to " MACSTR " on channel %d", MAC2STR(ap_info.bssid), ap_info.primary);
+        wifi_stats.roams++;
+    }
+    roam_pending = false;
+    if (!esp_timer_is_active(roam_timer)) {
+        roam_arm();
+    }
+}
+
+static void roam_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback = roam_timer_cb,
+        .name = "app_wifi_roam",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &roam_timer));
+}
+#endif /* CONFIG_APP_WIFI_ROAMING */
+
+static void app_wifi_connect(void)
+{
+    connect_start_us = esp_timer_get_time();
+    esp_wifi_connect();
+}
+
+void app_wifi_get_stats(app_wifi_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&ps_lock);
+    *stats = wifi_stats;
+    for (int i = 0; i < APP_WIFI_PS_PROFILE_MAX; i++) {
+        uint64_t us = ps_residency_us[i];
+        if (i == (int)ps_profile) {
+            us += now - ps_profile_start_us;
+        }
+        stats->ps_residency_ms[i] = us / 1000;
+    }
+    portEXIT_CRITICAL(&ps_lock);
+}
+
+esp_err_t app_wifi_set_ps_profile(app_wifi_ps_profile_t profile)
+{
+    if (profile >= APP_WIFI_PS_PROFILE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (profile == ps_profile) {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_wifi_set_ps(ps_types[profile]);
+    if (err != ESP_OK) {
+        return err;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&ps_lock);
+    ps_residency_us[ps_profile] += now - ps_profile_start_us;
+    ps_profile_start_us = now;
+    ps_profile = profile;
+    wifi_stats.ps_switches++;
+    portEXIT_CRITICAL(&ps_lock);
+    return ESP_OK;
+}
+
+app_wifi_ps_profile_t app_wifi_get_ps_profile(void)
+{
+    return ps_profile;
+}
+
+/* Station options which have to be in place before associating. The listen
+ * interval only has an effect with APP_WIFI_PS_MAX_MODEM.
+ */
+static void app_wifi_set_sta_options(void)
+{
+    wifi_config_t wifi_cfg;
+    if (esp_wifi_get_config(WIFI_IF_STA, &wifi_cfg) != ESP_OK) {
+        return;
+    }
+    wifi_sta_config_t orig = wifi_cfg.sta;
+    wifi_cfg.sta.listen_interval = CONFIG_APP_WIFI_LISTEN_INTERVAL;
+#ifdef CONFIG_APP_WIFI_ROAMING
+    wifi_cfg.sta.rm_enabled = 1;
+    wifi_cfg.sta.btm_enabled = 1;
+#ifdef CONFIG_ESP_WIFI_11R_SUPPORT
+    wifi_cfg.sta.ft_enabled = 1;
+#endif
+#endif /* CONFIG_APP_WIFI_ROAMING */
+    if (memcmp(&orig, &wifi_cfg.sta, sizeof(orig))) {
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg);
+    }
+}
+
 
 #ifdef USE_UNIFIED_PROVISIONING
 #define PROV_QR_VERSION "v1"
@@ -163,8 +425,18 @@ static void event_handler(void* arg, esp_event_base_t event_base,
                           int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        app_wifi_set_sta_options();
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+        fast_reconnect_apply(true);
+#endif
+        app_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+        sta_was_connected = true;
+#endif
+#ifdef CONFIG_APP_WIFI_ROAMING
+        roam_connected();
+#endif
 #ifdef ESP_NETIF_SUPPORTED
         esp_netif_create_ip6_linklocal((esp_netif_t *)arg);
 #else
@@ -173,14 +445,31 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Connected with IP Address:" IPSTR, IP2STR(&event->ip_info.ip));
+        wifi_stats.time_to_ip_ms = (esp_timer_get_time() - connect_start_us) / 1000;
+        wifi_stats.connects++;
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+        fast_reconnect_connected();
+#endif
+        ESP_LOGI(TAG, "Time to IP: %u ms", (unsigned)wifi_stats.time_to_ip_ms);
         /* Signal main application to continue execution */
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_EVENT);
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_GOT_IP6) {
         ip_event_got_ip6_t *event = (ip_event_got_ip6_t *)event_data;
         ESP_LOGI(TAG, "Connected with IPv6 Address:" IPV6STR, IPV62STR(event->ip6_info.ip));
+#ifdef CONFIG_APP_WIFI_ROAMING
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_BSS_RSSI_LOW) {
+        roam_rssi_low(((wifi_event_bss_rssi_low_t *)event_data)->rssi);
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED &&
+            ((wifi_event_sta_disconnected_t *)event_data)->reason == WIFI_REASON_ROAMING) {
+        /* The supplicant is moving over to the new AP itself */
+        ESP_LOGI(TAG, "Roaming to another AP");
+#endif
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         ESP_LOGI(TAG, "Disconnected. Connecting to the AP again...");
-        esp_wifi_connect();
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+        fast_reconnect_disconnected();
+#endif
+        app_wifi_connect();
 #ifdef USE_UNIFIED_PROVISIONING
     } else if (event_base == WIFI_PROV_EVENT) {
         switch (event_id) {
@@ -239,6 +528,12 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     }
 }
 
+esp_err_t app_wifi_wait_connected(TickType_t ticks_to_wait)
+{
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_EVENT, false, true, ticks_to_wait);
+    return (bits & WIFI_CONNECTED_EVENT) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
 void app_wifi_init(void)
 {
     /* Initialize TCP/IP */
@@ -268,6 +563,14 @@ void app_wifi_init(void)
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    /* The driver starts in minimum modem sleep */
+    ps_profile_start_us = esp_timer_get_time();
+#ifdef CONFIG_APP_WIFI_FAST_RECONNECT
+    fast_reconnect_load();
+#endif
+#ifdef CONFIG_APP_WIFI_ROAMING
+    roam_init();
+#endif
 }
 
 #ifdef CONFIG_APP_WIFI_USE_HARDCODED
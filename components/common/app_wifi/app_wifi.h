@@ -6,7 +6,73 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #pragma once
+#include <stdint.h>
 #include <esp_err.h>
+#include <freertos/FreeRTOS.h>
 
 void app_wifi_init(void);
 esp_err_t app_wifi_start(TickType_t ticks_to_wait);
+
+/** Wait for the Wi-Fi station to get an IP address
+ *
+ * This can be used after app_wifi_start() was called with a short (or zero)
+ * timeout, so that the caller can carry on with other initialisation while
+ * Wi-Fi comes up in the background.
+ *
+ * @param[in] ticks_to_wait Maximum number of ticks to wait
+ *
+ * @return ESP_OK if connected
+ * @return ESP_ERR_TIMEOUT if not connected within ticks_to_wait
+ */
+esp_err_t app_wifi_wait_connected(TickType_t ticks_to_wait);
+
+/** Wi-Fi power save profiles, trading idle current against how quickly
+ * a request from a controller reaches the accessory
+ */
+typedef enum {
+    /** Radio always on. Lowest latency, highest current */
+    APP_WIFI_PS_NONE = 0,
+    /** Radio wakes for every DTIM beacon. This is the default */
+    APP_WIFI_PS_MIN_MODEM,
+    /** Radio wakes every CONFIG_APP_WIFI_LISTEN_INTERVAL beacons. Lowest current */
+    APP_WIFI_PS_MAX_MODEM,
+    APP_WIFI_PS_PROFILE_MAX,
+} app_wifi_ps_profile_t;
+
+/** Switch the Wi-Fi power save profile
+ *
+ * Can be called any time after app_wifi_init().
+ *
+ * @param[in] profile The profile to switch to
+ *
+ * @return ESP_OK on success
+ * @return error from esp_wifi_set_ps() otherwise
+ */
+esp_err_t app_wifi_set_ps_profile(app_wifi_ps_profile_t profile);
+
+/** Get the current Wi-Fi power save profile */
+app_wifi_ps_profile_t app_wifi_get_ps_profile(void);
+
+/** Wi-Fi connection statistics */
+typedef struct {
+    /** Time from the start of the last connection attempt to getting an IP */
+    uint32_t time_to_ip_ms;
+    /** Number of times an IP address was obtained */
+    uint32_t connects;
+    /** How many of those went straight to the cached AP, without a full scan */
+    uint32_t fast_connects;
+    /** Time spent in each power save profile since app_wifi_init() */
+    uint32_t ps_residency_ms[APP_WIFI_PS_PROFILE_MAX];
+    /** Number of power save profile changes */
+    uint32_t ps_switches;
+    /** Number of times the signal got weak enough to ask the AP for a better one */
+    uint32_t roam_queries;
+    /** Number of times the station moved to another AP of the same network */
+    uint32_t roams;
+} app_wifi_stats_t;
+
+/** Get the Wi-Fi connection statistics
+ *
+ * @param[out] stats Filled with the current statistics
+ */
+void app_wifi_get_stats(app_wifi_stats_t *stats);
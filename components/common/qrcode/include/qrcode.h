@@ -13,6 +13,8 @@
 // limitations under the License.
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <esp_err.h>
 
 #ifdef __cplusplus
@@ -35,6 +37,40 @@ extern "C" {
   */
 esp_err_t qrcode_display(const char *text);
 
+/** Highest QR Code version generated by qrcode_encode() */
+#define QRCODE_MAX_VERSION  5
+
+/** Size of an encoded QR Code of up to \ref QRCODE_MAX_VERSION */
+#define QRCODE_BUFFER_LEN   (((QRCODE_MAX_VERSION * 4 + 17) * (QRCODE_MAX_VERSION * 4 + 17) + 7) / 8 + 1)
+
+/**
+  * @brief  Encode a string into a QR Code, without displaying it
+  *         The result can be stored and shown later with qrcode_display_encoded(),
+  *         which skips the encoding
+  *
+  * @param  text    string to encode into a QR Code.
+  * @param  qrcode  buffer of \ref QRCODE_BUFFER_LEN bytes for the QR Code
+  * @param  len     filled with the number of bytes of the buffer which were used
+  *
+  * @return
+  *    - ESP_OK: succeed
+  *    - ESP_FAIL: Failed to encode string into a QR Code
+  *    - ESP_ERR_NO_MEM: Failed to allocate the temporary buffer
+  */
+esp_err_t qrcode_encode(const char *text, uint8_t qrcode[QRCODE_BUFFER_LEN], size_t *len);
+
+/**
+  * @brief  Display a QR Code encoded by qrcode_encode() on the console
+  *
+  * @param  qrcode  encoded QR Code
+  * @param  len     length of the encoded QR Code
+  *
+  * @return
+  *    - ESP_OK: succeed
+  *    - ESP_ERR_INVALID_ARG: The buffer does not hold a valid QR Code
+  */
+esp_err_t qrcode_display_encoded(const uint8_t *qrcode, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
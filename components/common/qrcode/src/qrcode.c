@@ -16,9 +16,16 @@
 #include <esp_err.h>
 #include <stdlib.h>
 
+#include "qrcode.h"
 #include "qrcodegen.h"
 
-#define MAX_QRCODE_VERSION 5
+#define MAX_QRCODE_VERSION QRCODE_MAX_VERSION
+
+#ifdef CONFIG_QRCODE_MASK
+#define QRCODE_MASK ((enum qrcodegen_Mask)CONFIG_QRCODE_MASK)
+#else
+#define QRCODE_MASK qrcodegen_Mask_AUTO
+#endif
 
 static const char *lt[] = {
     /* 0 */ "  ",
@@ -90,7 +97,7 @@ esp_err_t qrcode_display(const char *text)
 
 	// Make and print the QR Code symbol
 	bool ok = qrcodegen_encodeText(text, tempBuffer, qrcode, errCorLvl,
-		qrcodegen_VERSION_MIN, MAX_QRCODE_VERSION, qrcodegen_Mask_AUTO, true);
+		qrcodegen_VERSION_MIN, MAX_QRCODE_VERSION, QRCODE_MASK, true);
 	if (ok) {
 		printQr(qrcode);
         err = ESP_OK;
@@ -100,3 +107,36 @@ esp_err_t qrcode_display(const char *text)
     free(tempBuffer);
     return err;
 }
+
+esp_err_t qrcode_encode(const char *text, uint8_t qrcode[QRCODE_BUFFER_LEN], size_t *len)
+{
+    uint8_t *tempBuffer = calloc(1, QRCODE_BUFFER_LEN);
+    if (!tempBuffer) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    bool ok = qrcodegen_encodeText(text, tempBuffer, qrcode, qrcodegen_Ecc_LOW,
+        qrcodegen_VERSION_MIN, MAX_QRCODE_VERSION, QRCODE_MASK, true);
+    free(tempBuffer);
+    if (!ok) {
+        return ESP_FAIL;
+    }
+    int size = qrcodegen_getSize(qrcode);
+    *len = (size * size + 7) / 8 + 1;
+    return ESP_OK;
+}
+
+esp_err_t qrcode_display_encoded(const uint8_t *qrcode, size_t len)
+{
+    /* The first byte is the side length, which also gives the length of the rest */
+    if (!qrcode || len < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    int size = qrcode[0];
+    if (size < qrcodegen_VERSION_MIN * 4 + 17 || size > MAX_QRCODE_VERSION * 4 + 17
+            || (size - 17) % 4 != 0 || len < (size_t)((size * size + 7) / 8 + 1)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    printQr(qrcode);
+    return ESP_OK;
+}
@@ -72,6 +72,10 @@ static void fillRectangle(int left, int top, int width, int height, uint8_t qrco
 static void drawCodewords(const uint8_t data[], int dataLen, uint8_t qrcode[]);
 static void applyMask(const uint8_t functionModules[], uint8_t qrcode[], enum qrcodegen_Mask mask);
 static long getPenaltyScore(const uint8_t qrcode[]);
+static long getPenaltyScoreByModule(const uint8_t qrcode[]);
+static long getPenaltyScorePacked(const uint8_t qrcode[]);
+static long getLinePenalty(uint64_t line, int qrsize);
+static uint64_t getPackedRow(const uint8_t qrcode[], int y);
 static int finderPenaltyCountPatterns(const int runHistory[7], int qrsize);
 static int finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, int runHistory[7], int qrsize);
 static void finderPenaltyAddHistory(int currentRunLength, int runHistory[7]);
@@ -634,6 +638,15 @@ static void applyMask(const uint8_t functionModules[], uint8_t qrcode[], enum qr
 // Calculates and returns the penalty score based on state of the given QR Code's current modules.
 // This is used by the automatic mask choice algorithm to find the mask pattern that yields the lowest score.
 static long getPenaltyScore(const uint8_t qrcode[]) {
+	// Symbols up to version 11 have rows that fit in a 64-bit word
+	if (qrcodegen_getSize(qrcode) <= 64)
+		return getPenaltyScorePacked(qrcode);
+	return getPenaltyScoreByModule(qrcode);
+}
+
+
+// Same as getPenaltyScorePacked(), one module at a time, for symbols of any size.
+static long getPenaltyScoreByModule(const uint8_t qrcode[]) {
 	int qrsize = qrcodegen_getSize(qrcode);
 	long result = 0;
 
@@ -713,6 +726,97 @@ static long getPenaltyScore(const uint8_t qrcode[]) {
 }
 
 
+// Scores the symbol with each row and column held as a bit mask, bit x being module x.
+// Runs are then found a run (rather than a module) at a time, and the 2*2 blocks and
+// the balance are counted a word at a time. Gives the same score as getPenaltyScoreByModule().
+static long getPenaltyScorePacked(const uint8_t qrcode[]) {
+	int qrsize = qrcodegen_getSize(qrcode);
+	assert(qrsize <= 64);
+	uint64_t rows[64];
+	uint64_t cols[64] = {0};
+	long result = 0;
+
+	for (int y = 0; y < qrsize; y++) {
+		rows[y] = getPackedRow(qrcode, y);
+		for (uint64_t bits = rows[y]; bits != 0; bits &= bits - 1)
+			cols[__builtin_ctzll(bits)] |= (uint64_t)1 << y;
+	}
+
+	// Adjacent modules in row/column having same color, and finder-like patterns
+	for (int i = 0; i < qrsize; i++)
+		result += getLinePenalty(rows[i], qrsize) + getLinePenalty(cols[i], qrsize);
+
+	// 2*2 blocks of modules having same color. Bit x is set where modules x and x+1
+	// of a row agree, and where the modules x of two rows agree.
+	uint64_t blockMask = ((uint64_t)1 << (qrsize - 1)) - 1;
+	for (int y = 0; y < qrsize - 1; y++) {
+		uint64_t vert = ~(rows[y] ^ rows[y + 1]);
+		uint64_t horz = ~(rows[y] ^ (rows[y] >> 1));
+		uint64_t blocks = vert & (vert >> 1) & horz & blockMask;
+		result += __builtin_popcountll(blocks) * PENALTY_N2;
+	}
+
+	// Balance of black and white modules
+	int black = 0;
+	for (int y = 0; y < qrsize; y++)
+		black += __builtin_popcountll(rows[y]);
+	int total = qrsize * qrsize;  // Note that size is odd, so black/total != 1/2
+	// Compute the smallest integer k >= 0 such that (45-5k)% <= black/total <= (55+5k)%
+	int k = (int)((labs(black * 20L - total * 10L) + total - 1) / total) - 1;
+	result += k * PENALTY_N4;
+	return result;
+}
+
+
+// Returns the run length and finder-like pattern penalties of one row or column,
+// given as a bit mask. A helper function for getPenaltyScorePacked().
+static long getLinePenalty(uint64_t line, int qrsize) {
+	uint64_t lineMask = (qrsize == 64) ? ~(uint64_t)0 : (((uint64_t)1 << qrsize) - 1);
+	long result = 0;
+	bool runColor = false;
+	int runLen = 0;
+	int runHistory[7] = {0};
+	int padRun = qrsize;  // Add white border to initial run
+	for (int pos = 0; pos < qrsize; ) {
+		bool color = (line >> pos) & 1;
+		// Modules of the other color from here on, the first of which ends the run
+		uint64_t other = ((color ? ~line : line) & lineMask) >> pos;
+		int len = other ? __builtin_ctzll(other) : qrsize - pos;
+		if (len >= 5)
+			result += PENALTY_N1 + (len - 5);
+		if (color == runColor) {  // Only for a white run at the start
+			runLen += len;
+		} else {
+			finderPenaltyAddHistory(runLen + padRun, runHistory);
+			padRun = 0;
+			if (!runColor)
+				result += finderPenaltyCountPatterns(runHistory, qrsize) * PENALTY_N3;
+			runColor = color;
+			runLen = len;
+		}
+		pos += len;
+	}
+	result += finderPenaltyTerminateAndCount(runColor, runLen + padRun, runHistory, qrsize) * PENALTY_N3;
+	return result;
+}
+
+
+// Returns row y of the symbol as a bit mask, bit x being module x. Modules are stored
+// row after row, low bit first, so this is a copy of qrsize consecutive bits.
+static uint64_t getPackedRow(const uint8_t qrcode[], int y) {
+	int qrsize = qrcode[0];
+	int index = y * qrsize;
+	const uint8_t *bytes = &qrcode[(index >> 3) + 1];
+	int have = 8 - (index & 7);
+	uint64_t result = bytes[0] >> (index & 7);
+	for (int i = 1; have < qrsize; i++, have += 8)
+		result |= (uint64_t)bytes[i] << have;
+	if (qrsize < 64)
+		result &= ((uint64_t)1 << qrsize) - 1;
+	return result;
+}
+
+
 // Can only be called immediately after a white run is added, and
 // returns either 0, 1, or 2. A helper function for getPenaltyScore().
 static int finderPenaltyCountPatterns(const int runHistory[7], int qrsize) {
@@ -55,6 +55,12 @@ typedef enum {
      * To enable both Wi-Fi and Ethernet, use (HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET) for hap_init()
      */
     HAP_TRANSPORT_ETHERNET         = 0x02,
+    /** HAP over Bluetooth LE. Needs CONFIG_HAP_BLE_ENABLE. Can be combined with the IP transports */
+    HAP_TRANSPORT_BLE              = 0x04,
+    /** HAP over IP on a Thread network, with the service registered over SRP instead of mDNS.
+     * Needs CONFIG_HAP_THREAD_ENABLE. The application brings up OpenThread before hap_start()
+     */
+    HAP_TRANSPORT_THREAD           = 0x08,
 } hap_transport_t;
 
 /**
@@ -118,6 +124,49 @@ typedef union {
     hap_tlv8_val_t t;
 } hap_val_t;
 
+/** Constraint flags of \ref hap_char_desc_t */
+#define HAP_CHAR_MIN_FLAG		(1 << 0)
+#define HAP_CHAR_MAX_FLAG		(1 << 1)
+#define HAP_CHAR_STEP_FLAG		(1 << 2)
+#define HAP_CHAR_MAXLEN_FLAG		(1 << 3)
+#define HAP_CHAR_MAXDATALEN_FLAG	(1 << 4)
+#define HAP_CHAR_VALID_RANGE_FLAG	(1 << 5)
+
+/** Characteristic Descriptor
+ *
+ * The static part of a characteristic. A descriptor declared as a const (so that it stays
+ * in flash) can be shared by any number of characteristics created with
+ * hap_char_create_from_desc(). Each of them then keeps only its value and runtime state in RAM.
+ * Calling one of the hap_char_*_set_constraints(), hap_char_add_*() APIs on such a
+ * characteristic moves it to a private copy of the descriptor.
+ */
+typedef struct {
+    /** UUID for the characteristic as per the HAP Specs */
+    const char *type_uuid;
+    /** Unit, NULL if none */
+    const char *unit;
+    /** Manufacturer defined description, NULL if none */
+    const char *description;
+    /** Valid values, NULL if none */
+    const uint8_t *valid_vals;
+    /** Minimum value, if HAP_CHAR_MIN_FLAG is set */
+    hap_val_t min;
+    /** Maximum value, maximum length or maximum data length, as per the flags */
+    hap_val_t max;
+    /** Step value, if HAP_CHAR_STEP_FLAG is set */
+    hap_val_t step;
+    /** Logically OR of the various permissions supported by the characteristic */
+    uint16_t permission;
+    /** Format of the value */
+    uint8_t format;
+    /** Logically OR of the HAP_CHAR_*_FLAG values */
+    uint8_t constraint_flags;
+    /** Number of entries in valid_vals */
+    uint8_t valid_vals_cnt;
+    /** Start and end values, if HAP_CHAR_VALID_RANGE_FLAG is set */
+    uint8_t valid_vals_range[2];
+} hap_char_desc_t;
+
 /** Information about the Provisioned Network to which the accessory will connect */
 typedef struct {
     /** SSID for the network */
@@ -350,6 +399,25 @@ typedef struct {
      * to increment c#. Note thar c# will still increment on a firmware upgrade though.
      */
     bool disable_config_num_update;
+    /** Time (in milliseconds) to hold back event notifications after a value changes, so that
+     * further changes in that window go out together. Each characteristic is only ever notified
+     * once per batch, with its latest value. Default is 0, which sends notifications straight away.
+     */
+    uint16_t notif_coalesce_ms;
+    /** Maximum number of simultaneous pair verified controller sessions, 1 to 32. Default is 8.
+     * Each active session takes sizeof(hap_secure_session_t), about 1.1KB, in the HomeKit core,
+     * besides the memory of its socket, so CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS and CONFIG_LWIP_MAX_SOCKETS
+     * have to allow for it too. If a controller gets verified while all sessions are in use, the
+     * session which has been idle the longest gets closed to make room.
+     */
+    uint8_t max_sessions;
+    /** Time (in milliseconds) to hold back the notification of a value written by a controller,
+     * so that writes by several controllers to the same characteristic in quick succession are
+     * merged. The last write wins, and its value is notified once, to every subscribed controller
+     * other than its writer, which stops apps from echoing each other's changes back and forth.
+     * Default is 0, which notifies every write straight away.
+     */
+    uint16_t write_merge_ms;
 } hap_cfg_t;
 
 /** Get HomeKit Configuration
@@ -745,6 +813,23 @@ hap_char_t *hap_char_float_create(char *type_uuid, uint16_t perms, float val);
  */
 hap_char_t *hap_char_string_create(char *type_uuid, uint16_t perms, char *val);
 
+/**
+ * @brief Create a String Characteristic Object without copying the value
+ *
+ * Like hap_char_string_create(), but the characteristic just points at val,
+ * which must hence stay valid and unchanged for as long as the characteristic
+ * exists (or until its value is updated). Strings in flash, like literals, are
+ * never copied anyway, by either function.
+ *
+ * @param[in] type_uuid UUID for the characteristic as per the HAP Specs
+ * @param[in] perms Logically OR of the various permissions supported by the characteristic
+ * @param[in] val Initial value of the characteristic
+ *
+ * @return Handle for the characteristic object created
+ * @return NULL on error
+ */
+hap_char_t *hap_char_string_create_static(char *type_uuid, uint16_t perms, const char *val);
+
 /**
  * @brief Create a Data Characteristic Object
  *
@@ -769,6 +854,19 @@ hap_char_t *hap_char_data_create(char *type_uuid, uint16_t perms, hap_data_val_t
  */
 hap_char_t *hap_char_tlv8_create(char *type_uuid, uint16_t perms, hap_tlv8_val_t *val);
 
+/**
+ * @brief Create a Characteristic Object from a descriptor
+ *
+ * @param[in] desc Descriptor of the characteristic. It is referenced, not copied, and so
+ * should stay valid for the lifetime of the characteristic (typically, a const).
+ * @param[in] val Initial value of the characteristic, of the format given in the descriptor.
+ * A string value is copied, a data/TLV8 buffer is referenced as in hap_char_data_create().
+ *
+ * @return Handle for the characteristic object created
+ * @return NULL on error
+ */
+hap_char_t *hap_char_create_from_desc(const hap_char_desc_t *desc, hap_val_t val);
+
 /**
  * @brief Delete a characteristic object
  *
@@ -857,6 +955,20 @@ hap_char_t *hap_serv_get_first_char(hap_serv_t *hs);
  */
 uint32_t hap_char_get_iid(hap_char_t *hc);
 
+/**
+ * @brief Check if any controller is subscribed to a characteristic
+ *
+ * Accessories that serve reads through a read callback can use this to skip
+ * hap_char_update_val() for characteristics that nobody gets notified about,
+ * since the next read fetches the value anyway.
+ *
+ * @param[in] hc HAP Characteristic Object handle
+ *
+ * @return true if at least one controller has enabled events for it
+ * @return false otherwise
+ */
+bool hap_char_has_subscribers(hap_char_t *hc);
+
 /**
  * @brief Get the type UUID for the given characteristic
  *
@@ -866,6 +978,38 @@ uint32_t hap_char_get_iid(hap_char_t *hc);
  */
 const char * hap_char_get_type_uuid(hap_char_t *hc);
 
+/** Type ID for UUIDs that have no short form, like custom 128-bit ones */
+#define HAP_UUID_FULL   0
+
+/**
+ * @brief Get the short form of a type UUID
+ *
+ * The UUIDs defined by Apple are all derived from the base UUID
+ * 00000000-0000-1000-8000-0026BB765291, and so can be represented by the
+ * first 32 bits alone, like "25" for 00000025-0000-1000-8000-0026BB765291.
+ * Either form is accepted here.
+ *
+ * @param[in] uuid Type UUID string
+ *
+ * @return Short ID of the UUID
+ * @return HAP_UUID_FULL if the UUID is not derived from the Apple base UUID
+ * (or its short ID does not fit in 16 bits)
+ */
+uint16_t hap_uuid_get_short_id(const char *uuid);
+
+/**
+ * @brief Get the short type ID for the given characteristic
+ *
+ * This allows telling characteristics apart with a single integer
+ * compare, against hap_uuid_get_short_id() of the expected UUID.
+ *
+ * @param[in] hc HAP Characteristic Object handle
+ *
+ * @return Short ID of the type UUID
+ * @return HAP_UUID_FULL if it is a custom UUID
+ */
+uint16_t hap_char_get_type_id(hap_char_t *hc);
+
 
 /**
  * @brief Get the Permissions for the given characteristic
@@ -904,6 +1048,16 @@ uint32_t hap_serv_get_iid(hap_serv_t *hs);
  * @return Type UUID for the service
  */
 char *hap_serv_get_type_uuid(hap_serv_t *hs);
+
+/**
+ * @brief Get the short type ID for the given service
+ *
+ * @param[in] hs HAP Service Object handle
+ *
+ * @return Short ID of the type UUID
+ * @return HAP_UUID_FULL if it is a custom UUID
+ */
+uint16_t hap_serv_get_type_id(hap_serv_t *hs);
 /**
  * @brief Get parent Service for given Characteristic
  *
@@ -946,6 +1100,53 @@ void hap_char_int_set_constraints(hap_char_t *hc, int min, int max, int step);
  */
 void hap_char_float_set_constraints(hap_char_t *hc, float min, float max, float step);
 
+/**
+ * @brief Quantize the values of a Float characteristic to its step
+ *
+ * Values written by controllers, as well as those given to hap_char_update_val(), are snapped
+ * to the nearest step between the minimum and maximum, instead of being rejected for not
+ * being on a step. The constraints must have been set with hap_char_float_set_constraints()
+ * and a non zero step.
+ *
+ * With a hysteresis, a value stays on the step of the current value unless it is further than
+ * half a step plus the hysteresis from it, so that a value hovering around the middle of two
+ * steps does not flip between them.
+ *
+ * @param[in] hc HAP Characteristic Object handle
+ * @param[in] hysteresis Hysteresis, as a fraction of the step (0 to 0.5). Negative to disable
+ * quantization.
+ */
+void hap_char_float_set_quantization(hap_char_t *hc, float hysteresis);
+
+/** Notification rate policy of a characteristic, see hap_char_set_notif_policy() */
+typedef struct {
+    /** Minimum time between two notifications, in milliseconds. 0 for no limit */
+    uint32_t min_interval_ms;
+    /** For numeric formats, changes smaller than this from the last notified value
+     * are not notified. 0 to notify every change
+     */
+    float deadband;
+    /** Changes within min_interval_ms are held back and the latest value is notified
+     * once the interval ends. Otherwise they are not notified at all
+     */
+    bool latest_only;
+} hap_char_notif_policy_t;
+
+/**
+ * @brief Limit the rate of notifications for a characteristic
+ *
+ * Meant for values that can change much more often than controllers need to hear
+ * about, like sensor readings or a ramping speed. The value itself is always updated,
+ * so reads get the current one, only the notifications are limited.
+ *
+ * @param[in] hc HAP Characteristic Object handle
+ * @param[in] policy Policy to apply, copied. NULL to remove any earlier one.
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on error
+ */
+int hap_char_set_notif_policy(hap_char_t *hc, const hap_char_notif_policy_t *policy);
+
 /**
  * @brief Add String characteristic constraints
  *
@@ -1547,12 +1748,89 @@ typedef void (*hap_event_handler_t) (hap_event_t event, void *data);
  *
  * If applications are interested in HomeKit specific events, they can
  * write their own event handler and register with HomeKit core using
- * this API.
+ * this API. Only one handler can be registered, and it is called on the
+ * thread reporting the event. See \ref hap_event_subscribe() for several
+ * listeners, filtering, or deferred calls.
  *
  * @param[in] handler Application specific HomeKit event handler.
  */
 void hap_register_event_handler(hap_event_handler_t handler);
 
+/** Event mask bit for a \ref hap_event_t, for \ref hap_event_subscribe() */
+#define HAP_EVENT_MASK(event)   (1UL << (event))
+/** Event mask matching every \ref hap_event_t */
+#define HAP_EVENT_MASK_ALL      0xFFFFFFFFUL
+
+/** How a subscriber gets its HomeKit events */
+typedef enum {
+    /** Called on the thread reporting the event, before the HomeKit core carries on.
+     * Data is the core's own, only valid during the call. Keep these short, they
+     * add to the latency of the HAP request that raised the event.
+     */
+    HAP_EVENT_DISPATCH_INLINE = 0,
+    /** Called later from the HomeKit event bus task, with a copy of the data
+     * (truncated to 64 bytes). Events are queued without blocking, and dropped
+     * (see \ref hap_event_bus_stats_t) if the queue is full.
+     */
+    HAP_EVENT_DISPATCH_DEFERRED,
+} hap_event_dispatch_t;
+
+/** Prototype for a HomeKit event subscriber
+ *
+ * @param[in] event The event id of type \ref hap_event_t
+ * @param[in] data Data associated with the event (if applicable), see \ref hap_event_t
+ * @param[in] data_size Size of the data
+ * @param[in] priv The private data passed to \ref hap_event_subscribe()
+ */
+typedef void (*hap_event_subscriber_t) (hap_event_t event, const void *data, size_t data_size, void *priv);
+
+/** Subscribe to HomeKit events
+ *
+ * Unlike \ref hap_register_event_handler(), any number of subscribers (up to
+ * CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS) can listen, each only to the events it
+ * asks for, and each can choose to be called inline or deferred. Can be called
+ * before hap_init().
+ *
+ * @param[in] event_mask Events to get, HAP_EVENT_MASK() of each ORed together, or HAP_EVENT_MASK_ALL
+ * @param[in] dispatch How the subscriber is called
+ * @param[in] subscriber The subscriber
+ * @param[in] priv Private data passed to the subscriber
+ *
+ * @return Subscription id (zero or more) on success
+ * @return HAP_FAIL if there is no room or the task for deferred events could not be started
+ */
+int hap_event_subscribe(uint32_t event_mask, hap_event_dispatch_t dispatch,
+        hap_event_subscriber_t subscriber, void *priv);
+
+/** Unsubscribe from HomeKit events
+ *
+ * A deferred subscriber may still be called once for an event queued before this.
+ *
+ * @param[in] id Subscription id returned by \ref hap_event_subscribe()
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if there is no such subscription
+ */
+int hap_event_unsubscribe(int id);
+
+/** HomeKit event bus counters */
+typedef struct {
+    /** Events reported by the HomeKit core */
+    uint32_t reported;
+    /** Events queued for deferred subscribers */
+    uint32_t deferred;
+    /** Events dropped because the deferred queue was full */
+    uint32_t dropped;
+    /** Most events waiting in the deferred queue at once */
+    uint32_t max_queued;
+} hap_event_bus_stats_t;
+
+/** Get the HomeKit event bus counters
+ *
+ * @param[out] stats Counters since boot
+ */
+void hap_event_bus_get_stats(hap_event_bus_stats_t *stats);
+
 /** Get Paired controller count
  *
  * This API can be used to get a count of number of paired controllers.
@@ -1562,6 +1840,66 @@ void hap_register_event_handler(hap_event_handler_t handler);
  */
 int hap_get_paired_controller_count();
 
+/** Pair Setup admission counters */
+typedef struct {
+    /** Pair Setup attempts let through to SRP */
+    uint32_t admitted;
+    /** Attempts turned away with a Backoff error, for a client out of tokens */
+    uint32_t rate_limited;
+    /** Attempts turned away with a Busy error, for another Pair Setup in progress */
+    uint32_t busy;
+} hap_pair_setup_stats_t;
+
+/** Get the Pair Setup admission counters
+ *
+ * The counters start at 0 on boot. rate_limited stays 0 without
+ * CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE.
+ *
+ * @param[out] stats Current values of the counters
+ */
+void hap_pair_setup_get_stats(hap_pair_setup_stats_t *stats);
+
+/** Length of a signature from hap_acc_sign() */
+#define HAP_ACC_SIGN_LEN    64
+/** Length of a key from hap_ctrl_derive_key() */
+#define HAP_CTRL_KEY_LEN    32
+
+/** Sign data with the accessory long-term key
+ *
+ * Signs data with the Ed25519 long-term secret key of the accessory (AccessoryLTSK),
+ * the same key that signs Pair Setup and Pair Verify. Paired controllers can check
+ * the signature with the AccessoryLTPK they got during Pair Setup.
+ * This can be used only after hap_init().
+ *
+ * @param[in] data Data to sign
+ * @param[in] len Length of the data
+ * @param[out] sig Signature, HAP_ACC_SIGN_LEN bytes
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL on failure
+ */
+int hap_acc_sign(const uint8_t *data, size_t len, uint8_t *sig);
+
+/** Derive a key shared with a paired controller
+ *
+ * Derives a HAP_CTRL_KEY_LEN byte key from the long-term keys of the accessory and of
+ * the controller, by X25519 on the Curve25519 forms of the AccessoryLTSK and the
+ * iOSDeviceLTPK, followed by HKDF-SHA-512 with the given salt and info. The controller
+ * derives the same key from its own LTSK and the AccessoryLTPK, so applications can
+ * authenticate controllers outside of a HAP session without provisioning any other
+ * secret. The key changes if the controller is paired again with a new key.
+ * This can be used only after hap_init().
+ *
+ * @param[in] ctrl_id NULL terminated pairing identifier of the controller
+ * @param[in] salt NULL terminated HKDF salt
+ * @param[in] info NULL terminated HKDF info
+ * @param[out] key Derived key, HAP_CTRL_KEY_LEN bytes
+ *
+ * @return HAP_SUCCESS on success
+ * @return HAP_FAIL if the controller is not paired, or on failure
+ */
+int hap_ctrl_derive_key(const char *ctrl_id, const char *salt, const char *info, uint8_t *key);
+
 /*
  * Enable Simple HTTP Debugging
  *
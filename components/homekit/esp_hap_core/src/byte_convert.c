@@ -13,50 +13,7 @@
 // limitations under the License.
 #include <stdint.h>
 #include <ctype.h>
-
-/* Functions to convert Little Endian byte stream to
- * uint16, uint32 and uint64
- */
-uint16_t get_u16_le(const void *val_ptr)
-{
-	const uint8_t *p = (const uint8_t *)val_ptr;
-	uint16_t val;
-
-	val  = (uint16_t)p[0];
-	val |= (uint16_t)p[1] << 8;
-
-	return val;
-}
-
-uint32_t get_u32_le(const void *val_ptr)
-{
-	const uint8_t *p = (const uint8_t *)val_ptr;
-	uint32_t val;
-
-	val  = (uint32_t)p[0];
-	val |= (uint32_t)p[1] << 8;
-	val |= (uint32_t)p[2] << 16;
-	val |= (uint32_t)p[3] << 24;
-
-	return val;
-}
-
-uint64_t get_u64_le(const void *val_ptr)
-{
-	const uint8_t *p = (const uint8_t *)val_ptr;
-	uint64_t val;
-
-	val  = (uint64_t)p[0];
-	val |= (uint64_t)p[1] << 8;
-	val |= (uint64_t)p[2] << 16;
-	val |= (uint64_t)p[3] << 24;
-	val |= (uint64_t)p[4] << 32;
-	val |= (uint64_t)p[5] << 40;
-	val |= (uint64_t)p[6] << 48;
-	val |= (uint64_t)p[7] << 56;
-
-	return val;
-}
+#include <byte_convert.h>
 
 /* Functions to convert Big Endian byte stream to
  * uint16, uint32 and uint64
@@ -102,41 +59,6 @@ uint64_t get_u64_be(const void *val_ptr)
 	return val;
 }
 
-/* Functions to convert uint16, uint32 and uint64
- * to Little Endian
- */
-void put_u16_le(void *val_ptr, const uint16_t val)
-{
-	uint8_t *p = (uint8_t *)val_ptr;
-
-	p[0] = (uint8_t)val & 0xff;
-	p[1] = (uint8_t)(val >> 8) & 0xff;
-}
-
-void put_u32_le(void *val_ptr, const uint32_t val)
-{
-	uint8_t *p = (uint8_t *)val_ptr;
-
-	p[0] = (uint8_t)val & 0xff;
-	p[1] = (uint8_t)(val >> 8) & 0xff;
-	p[2] = (uint8_t)(val >> 16) & 0xff;
-	p[3] = (uint8_t)(val >> 24) & 0xff;
-}
-
-void put_u64_le(void *val_ptr, const uint64_t val)
-{
-	uint8_t *p = (uint8_t *)val_ptr;
-
-	p[0] = (uint8_t)val & 0xff;
-	p[1] = (uint8_t)(val >> 8) & 0xff;
-	p[2] = (uint8_t)(val >> 16) & 0xff;
-	p[3] = (uint8_t)(val >> 24) & 0xff;
-	p[4] = (uint8_t)(val >> 32) & 0xff;
-	p[5] = (uint8_t)(val >> 40) & 0xff;
-	p[6] = (uint8_t)(val >> 48) & 0xff;
-	p[7] = (uint8_t)(val >> 56) & 0xff;
-}
-
 /* Functions to convert uint16, uint32 and uint64
  * to Big Endian
  */
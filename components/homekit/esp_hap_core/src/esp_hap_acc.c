@@ -22,8 +22,10 @@
  *
  */
 #include <string.h>
+#include <strings.h>
 #include <esp_wifi.h>
 #include <hap_platform_memory.h>
+#include <esp_hap_db_arena.h>
 #include <esp_hap_acc.h>
 #include <esp_mfi_debug.h>
 #include <esp_mfi_debug.h>
@@ -33,6 +35,7 @@
 #include <esp_hap_database.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_main.h>
+#include <esp_hap_ip_services.h>
 
 /* Primary Accessory Pointer */
 static __hap_acc_t *primary_acc;
@@ -58,9 +61,10 @@ static int hap_acc_info_write(hap_write_data_t write_data[], int count,
 {
 	int i;
     __hap_char_t *_hc;
+    uint16_t identify_id = hap_uuid_get_short_id(HAP_CHAR_UUID_IDENTIFY);
 	for (i = 0; i < count; i++) {
         _hc = (__hap_char_t *)write_data[i].hc;
-		if (!strcmp(_hc->type_uuid, HAP_CHAR_UUID_IDENTIFY)) {
+		if (_hc->type_id == identify_id) {
             __hap_acc_t *_ha = (__hap_acc_t *)serv_priv;
             if (_ha) {
                 _ha->identify_routine((hap_acc_t *)_ha);
@@ -80,7 +84,7 @@ hap_acc_t *hap_acc_create(hap_acc_cfg_t *acc_cfg)
 {
     static bool first = true;
     int ret = 0;
-    __hap_acc_t *_ha = hap_platform_memory_calloc(1, sizeof(__hap_acc_t));
+    __hap_acc_t *_ha = hap_db_calloc(1, sizeof(__hap_acc_t));
     if (!_ha) {
         return NULL;
     }
@@ -234,10 +238,17 @@ hap_serv_t *hap_acc_get_serv_by_uuid(hap_acc_t *ha, const char *uuid)
     if (!ha)
         return NULL;
 
+    /* Same as hap_serv_get_char_by_uuid() */
+    uint16_t type_id = hap_uuid_get_short_id(uuid);
     hap_serv_t *hs;
     for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
-        if (!strcmp(((__hap_serv_t *)hs)->type_uuid, uuid))
+        __hap_serv_t *_hs = (__hap_serv_t *)hs;
+        if (type_id != HAP_UUID_FULL) {
+            if (_hs->type_id == type_id)
+                return hs;
+        } else if ((_hs->type_id == HAP_UUID_FULL) && !strcasecmp(_hs->type_uuid, uuid)) {
             return hs;
+        }
     }
     return NULL;
 }
@@ -353,6 +364,211 @@ static void hap_remove_acc_from_list(__hap_acc_t *primary, __hap_acc_t *old)
     cur->next = cur->next->next;
 }
 
+/* (aid, iid) -> characteristic index for the /characteristics handlers,
+ * which look up every element of a request. It uses open addressing with
+ * linear probing and is kept at most half full. It is built by hap_start()
+ * and then kept in sync by hap_add_bridged_accessory() and
+ * hap_remove_bridged_accessory().
+ */
+typedef struct {
+    uint32_t aid;
+    uint32_t iid;
+    hap_char_t *hc;     /* NULL for an empty slot */
+} hap_char_index_entry_t;
+
+#define HAP_CHAR_INDEX_MIN_SIZE     16
+
+static hap_char_index_entry_t *hap_char_index;
+static uint32_t hap_char_index_size;    /* Power of 2. 0 until the index is built */
+static uint32_t hap_char_index_cnt;
+static portMUX_TYPE hap_char_index_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t hap_char_index_hash(uint32_t aid, uint32_t iid)
+{
+    uint32_t h = (aid * 0x9E3779B1) ^ iid;
+    h ^= h >> 15;
+    h *= 0x85EBCA6B;
+    h ^= h >> 13;
+    return h;
+}
+
+static uint32_t hap_acc_get_char_cnt(__hap_acc_t *ha)
+{
+    uint32_t cnt = 0;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
+        for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+/* Returns true if a new entry was added, false if an existing one was replaced */
+static bool hap_char_index_insert(hap_char_index_entry_t *table, uint32_t size,
+        uint32_t aid, hap_char_t *hc)
+{
+    uint32_t iid = ((__hap_char_t *)hc)->iid;
+    uint32_t mask = size - 1;
+    uint32_t i = hap_char_index_hash(aid, iid) & mask;
+    while (table[i].hc) {
+        if ((table[i].aid == aid) && (table[i].iid == iid)) {
+            table[i].hc = hc;
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    table[i].aid = aid;
+    table[i].iid = iid;
+    table[i].hc = hc;
+    return true;
+}
+
+static uint32_t hap_char_index_insert_acc(hap_char_index_entry_t *table, uint32_t size,
+        __hap_acc_t *ha)
+{
+    uint32_t cnt = 0;
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
+        for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+            if (hap_char_index_insert(table, size, ha->aid, hc)) {
+                cnt++;
+            }
+        }
+    }
+    return cnt;
+}
+
+/* Entries are removed by shifting the rest of the probe sequence back into
+ * the hole, so no tombstones are needed.
+ */
+static void hap_char_index_erase(uint32_t aid, uint32_t iid)
+{
+    hap_char_index_entry_t *table = hap_char_index;
+    uint32_t mask = hap_char_index_size - 1;
+    uint32_t i = hap_char_index_hash(aid, iid) & mask;
+    while (table[i].hc) {
+        if ((table[i].aid == aid) && (table[i].iid == iid)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    if (!table[i].hc) {
+        return;
+    }
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!table[j].hc) {
+            break;
+        }
+        uint32_t home = hap_char_index_hash(table[j].aid, table[j].iid) & mask;
+        /* The entry can move to the hole only if its home slot is not
+         * cyclically within (i, j]
+         */
+        bool in_range = (i <= j) ? ((home > i) && (home <= j)) : ((home > i) || (home <= j));
+        if (!in_range) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].hc = NULL;
+    hap_char_index_cnt--;
+}
+
+static int hap_char_index_build(void)
+{
+    uint32_t cnt = 0;
+    hap_acc_t *ha;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        cnt += hap_acc_get_char_cnt((__hap_acc_t *)ha);
+    }
+    uint32_t size = HAP_CHAR_INDEX_MIN_SIZE;
+    while (size < (cnt * 2)) {
+        size <<= 1;
+    }
+    hap_char_index_entry_t *table = hap_platform_memory_calloc(size, sizeof(hap_char_index_entry_t));
+    if (!table) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate characteristic index");
+        return HAP_FAIL;
+    }
+    cnt = 0;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        cnt += hap_char_index_insert_acc(table, size, (__hap_acc_t *)ha);
+    }
+
+    portENTER_CRITICAL(&hap_char_index_lock);
+    hap_char_index_entry_t *old_table = hap_char_index;
+    hap_char_index = table;
+    hap_char_index_size = size;
+    hap_char_index_cnt = cnt;
+    portEXIT_CRITICAL(&hap_char_index_lock);
+
+    if (old_table) {
+        hap_platform_memory_free(old_table);
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Characteristic index: %d entries, %d slots",
+            (int)cnt, (int)size);
+    return HAP_SUCCESS;
+}
+
+static void hap_char_index_free(void)
+{
+    portENTER_CRITICAL(&hap_char_index_lock);
+    hap_char_index_entry_t *old_table = hap_char_index;
+    hap_char_index = NULL;
+    hap_char_index_size = 0;
+    hap_char_index_cnt = 0;
+    portEXIT_CRITICAL(&hap_char_index_lock);
+
+    if (old_table) {
+        hap_platform_memory_free(old_table);
+    }
+}
+
+/* Called after the accessory has been added to the list */
+static void hap_char_index_add_acc(__hap_acc_t *ha)
+{
+    if (!hap_char_index_size) {
+        /* Not built yet. hap_start() will pick up the accessory */
+        return;
+    }
+    uint32_t cnt = hap_acc_get_char_cnt(ha);
+    if (((hap_char_index_cnt + cnt) * 2) > hap_char_index_size) {
+        if (hap_char_index_build() != HAP_SUCCESS) {
+            /* Lookups fall back to walking the accessory list */
+            hap_char_index_free();
+        }
+        return;
+    }
+    portENTER_CRITICAL(&hap_char_index_lock);
+    hap_char_index_cnt += hap_char_index_insert_acc(hap_char_index, hap_char_index_size, ha);
+    portEXIT_CRITICAL(&hap_char_index_lock);
+}
+
+static void hap_char_index_remove_acc(__hap_acc_t *ha)
+{
+    if (!hap_char_index_size) {
+        return;
+    }
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    portENTER_CRITICAL(&hap_char_index_lock);
+    for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
+        for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+            hap_char_index_erase(ha->aid, ((__hap_char_t *)hc)->iid);
+        }
+    }
+    portEXIT_CRITICAL(&hap_char_index_lock);
+}
+
+int hap_acc_index_init(void)
+{
+    return hap_char_index_build();
+}
+
 #define HAP_BRIDGE_KEYSTORE     "hap_bridge"
 
 int hap_get_unique_aid(const char *id)
@@ -395,8 +611,7 @@ void hap_add_accessory(hap_acc_t *ha)
         hap_char_t *hc = hap_serv_get_char_by_uuid(hs, HAP_CHAR_UUID_NAME);
         snprintf(name, sizeof(name), "%s-%02X%02X%02X", ((__hap_char_t *)hc)->val.s,
                 eth_mac[3], eth_mac[4], eth_mac[5]);
-        hap_platform_memory_free(((__hap_char_t *)hc)->val.s);
-        ((__hap_char_t *)hc)->val.s = strdup(name);
+        hap_char_set_str((__hap_char_t *)hc, name, false);
     }
     hap_acc_get_info(&hap_priv.primary_acc);
 }
@@ -414,6 +629,8 @@ void hap_add_bridged_accessory(hap_acc_t *ha, int aid)
     }
 
     hap_add_acc_to_list(primary_acc, _ha);
+    hap_char_index_add_acc(_ha);
+    hap_http_invalidate_acc_db();
     if (!hap_priv.cfg.disable_config_num_update) {
         hap_update_config_number();
     }
@@ -426,6 +643,8 @@ void hap_remove_bridged_accessory(hap_acc_t *ha)
     } else {
         if (ha) {
             hap_remove_acc_from_list(primary_acc, (__hap_acc_t *)ha);
+            hap_char_index_remove_acc((__hap_acc_t *)ha);
+            hap_http_invalidate_acc_db();
             if (!hap_priv.cfg.disable_config_num_update) {
                 hap_update_config_number();
             }
@@ -450,7 +669,7 @@ void hap_acc_delete(hap_acc_t *ha)
 		hap_serv_delete((hap_serv_t *)_hs);
 		_hs = (__hap_serv_t *)_ha->servs;
 	}
-    hap_platform_memory_free(_ha);
+    hap_db_free(_ha);
 }
 
 /**
@@ -470,11 +689,13 @@ uint32_t hap_acc_get_aid(hap_acc_t *ha)
 void hap_delete_all_accessories(void)
 {
     __hap_acc_t *next, *ha = primary_acc;
+    hap_char_index_free();
     while (ha) {
         next = ha->next;
         hap_acc_delete((hap_acc_t *)ha);
         ha = next;
     }
+    hap_db_arena_free();
 }
 /**
  * @brief get target accessory by AID
@@ -489,3 +710,27 @@ hap_acc_t *hap_acc_get_by_aid(int32_t aid)
     }
     return NULL;
 }
+
+/**
+ * @brief get target characteristic by AID and IID
+ */
+hap_char_t *hap_get_char_by_aid_iid(int32_t aid, int32_t iid)
+{
+    hap_char_t *hc = NULL;
+    portENTER_CRITICAL(&hap_char_index_lock);
+    if (!hap_char_index_size) {
+        portEXIT_CRITICAL(&hap_char_index_lock);
+        return hap_acc_get_char_by_iid(hap_acc_get_by_aid(aid), iid);
+    }
+    uint32_t mask = hap_char_index_size - 1;
+    uint32_t i = hap_char_index_hash(aid, iid) & mask;
+    while (hap_char_index[i].hc) {
+        if ((hap_char_index[i].aid == (uint32_t)aid) && (hap_char_index[i].iid == (uint32_t)iid)) {
+            hc = hap_char_index[i].hc;
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    portEXIT_CRITICAL(&hap_char_index_lock);
+    return hc;
+}
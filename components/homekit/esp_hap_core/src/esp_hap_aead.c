@@ -0,0 +1,148 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <sodium/crypto_aead_chacha20poly1305.h>
+#include <sodium/randombytes.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_aead.h>
+
+#ifdef CONFIG_HAP_AEAD_KERNEL
+
+#define HAP_AEAD_SELF_TEST_LEN  300
+
+static bool hap_aead_kernel_ok;
+
+/* RFC 8439, section 2.8.2 */
+static const uint8_t rfc_key[HAP_AEAD_KEY_LEN] = {
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+};
+static const uint8_t rfc_nonce[HAP_AEAD_NONCE_LEN] = {
+    0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+};
+static const uint8_t rfc_ad[] = {
+    0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+};
+static const char rfc_plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer "
+        "you only one tip for the future, sunscreen would be it.";
+static const uint8_t rfc_ciphertext[sizeof(rfc_plaintext) - 1] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+    0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+    0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+    0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+    0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+    0x61, 0x16,
+};
+static const uint8_t rfc_tag[HAP_AEAD_TAG_LEN] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91,
+};
+
+/* The known answer from the RFC, and then a random key, nonce and message
+ * through both the kernel and libsodium. The odd offset also covers the
+ * unaligned path.
+ */
+static bool hap_aead_kernel_check(void)
+{
+    static uint8_t buf[HAP_AEAD_SELF_TEST_LEN + 1];
+    static uint8_t ref[HAP_AEAD_SELF_TEST_LEN];
+    uint8_t key[HAP_AEAD_KEY_LEN], nonce[HAP_AEAD_NONCE_LEN], ad[7];
+    uint8_t tag[HAP_AEAD_TAG_LEN], ref_tag[HAP_AEAD_TAG_LEN];
+    unsigned long long tag_len;
+    size_t len = sizeof(rfc_ciphertext);
+
+    hap_aead_kernel_encrypt_detached(buf, tag, (const uint8_t *)rfc_plaintext, len,
+            rfc_ad, sizeof(rfc_ad), rfc_nonce, rfc_key);
+    if (memcmp(buf, rfc_ciphertext, len) || memcmp(tag, rfc_tag, sizeof(tag))) {
+        return false;
+    }
+    if (hap_aead_kernel_decrypt_detached(buf, buf, len, tag, rfc_ad, sizeof(rfc_ad), rfc_nonce, rfc_key) ||
+            memcmp(buf, rfc_plaintext, len)) {
+        return false;
+    }
+
+    randombytes_buf(key, sizeof(key));
+    randombytes_buf(nonce, sizeof(nonce));
+    randombytes_buf(ad, sizeof(ad));
+    randombytes_buf(ref, sizeof(ref));
+    hap_aead_kernel_encrypt_detached(buf + 1, tag, ref, sizeof(ref), ad, sizeof(ad), nonce, key);
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(ref, ref_tag, &tag_len, ref, sizeof(ref),
+            ad, sizeof(ad), NULL, nonce, key);
+    if (memcmp(buf + 1, ref, sizeof(ref)) || memcmp(tag, ref_tag, sizeof(tag))) {
+        return false;
+    }
+    /* A corrupted tag must be refused */
+    tag[0] ^= 0x01;
+    return hap_aead_kernel_decrypt_detached(buf + 1, buf + 1, sizeof(ref), tag, ad, sizeof(ad), nonce, key) == -1;
+}
+
+void hap_aead_init(void)
+{
+    if (hap_aead_kernel_ok) {
+        return;
+    }
+    hap_aead_kernel_ok = hap_aead_kernel_check();
+    if (hap_aead_kernel_ok) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Using the optimised ChaCha20-Poly1305 kernel");
+    } else {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "ChaCha20-Poly1305 kernel failed its self test. Using libsodium");
+    }
+}
+
+#else
+
+void hap_aead_init(void)
+{
+}
+
+#endif /* CONFIG_HAP_AEAD_KERNEL */
+
+int hap_aead_encrypt_detached(uint8_t *c, uint8_t *mac, const uint8_t *m, size_t mlen,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k)
+{
+#ifdef CONFIG_HAP_AEAD_KERNEL
+    if (hap_aead_kernel_ok) {
+        return hap_aead_kernel_encrypt_detached(c, mac, m, mlen, ad, adlen, npub, k);
+    }
+#endif
+    unsigned long long mac_len;
+    return crypto_aead_chacha20poly1305_ietf_encrypt_detached(c, mac, &mac_len, m, mlen,
+            ad, adlen, NULL, npub, k);
+}
+
+int hap_aead_decrypt_detached(uint8_t *m, const uint8_t *c, size_t clen, const uint8_t *mac,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k)
+{
+#ifdef CONFIG_HAP_AEAD_KERNEL
+    if (hap_aead_kernel_ok) {
+        return hap_aead_kernel_decrypt_detached(m, c, clen, mac, ad, adlen, npub, k);
+    }
+#endif
+    return crypto_aead_chacha20poly1305_ietf_decrypt_detached(m, NULL, c, clen, mac,
+            ad, adlen, npub, k);
+}
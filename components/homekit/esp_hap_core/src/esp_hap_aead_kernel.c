@@ -0,0 +1,360 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* ChaCha20-Poly1305 for the RV32IMC cores (ESP32-C3 and friends) and the
+ * ESP32-S3.
+ *
+ * The generic libsodium code keeps the ChaCha20 state in memory between
+ * rounds and runs ChaCha20 and Poly1305 as two passes over the data. Here:
+ * - The 16 state words of a block are locals, which the 31 general purpose
+ *   registers of RV32 can hold for the whole 20 rounds without spilling.
+ * - The keystream is made 4 blocks (256 bytes) at a time, so a full 1024
+ *   byte HAP frame takes 4 batches, each XORed and authenticated in one go.
+ * - Poly1305 uses 26 bit limbs, so that each product is one mul/mulhu pair
+ *   and the sums of five products fit in 64 bits without carries between.
+ * - Encryption authenticates each batch right after producing it, while it
+ *   is still in the cache.
+ * - Word aligned buffers are XORed a word at a time. Neither core does
+ *   misaligned accesses, so anything else goes byte by byte.
+ *
+ * The S3 vector (PIE) unit only has saturating 32 bit adds, while ChaCha20
+ * needs them to wrap, so the batches are computed with scalar code there too.
+ *
+ * There are no 64 bit shifts with variable amounts, table lookups or
+ * branches on secret data.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <sodium/utils.h>
+#include <esp_hap_aead.h>
+
+#define CHACHA20_BLOCK_LEN  64
+#define CHACHA20_BATCH      4
+#define CHACHA20_BATCH_LEN  (CHACHA20_BATCH * CHACHA20_BLOCK_LEN)
+#define POLY1305_BLOCK_LEN  16
+#define POLY1305_MASK26     0x3ffffff
+
+#define ROTL32(v, n)    (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+	do { \
+		a += b; d ^= a; d = ROTL32(d, 16); \
+		c += d; b ^= c; b = ROTL32(b, 12); \
+		a += b; d ^= a; d = ROTL32(d, 8); \
+		c += d; b ^= c; b = ROTL32(b, 7); \
+	} while (0)
+
+typedef struct {
+	uint32_t r0, r1, r2, r3, r4;
+	/* r1..r4 multiplied by 5, for the reduction modulo 2^130 - 5 */
+	uint32_t s1, s2, s3, s4;
+	uint32_t h0, h1, h2, h3, h4;
+	uint32_t pad[4];
+} poly1305_state_t;
+
+static inline uint32_t load32_le(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)v;
+	p[1] = (uint8_t)(v >> 8);
+	p[2] = (uint8_t)(v >> 16);
+	p[3] = (uint8_t)(v >> 24);
+}
+
+static void chacha20_init(uint32_t state[16], const uint8_t *k, const uint8_t *npub, uint32_t counter)
+{
+	int i;
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (i = 0; i < 8; i++) {
+		state[4 + i] = load32_le(k + 4 * i);
+	}
+	state[12] = counter;
+	state[13] = load32_le(npub);
+	state[14] = load32_le(npub + 4);
+	state[15] = load32_le(npub + 8);
+}
+
+static void chacha20_block(const uint32_t in[16], uint32_t out[16])
+{
+	uint32_t x0 = in[0], x1 = in[1], x2 = in[2], x3 = in[3];
+	uint32_t x4 = in[4], x5 = in[5], x6 = in[6], x7 = in[7];
+	uint32_t x8 = in[8], x9 = in[9], x10 = in[10], x11 = in[11];
+	uint32_t x12 = in[12], x13 = in[13], x14 = in[14], x15 = in[15];
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		QUARTER_ROUND(x0, x4, x8, x12);
+		QUARTER_ROUND(x1, x5, x9, x13);
+		QUARTER_ROUND(x2, x6, x10, x14);
+		QUARTER_ROUND(x3, x7, x11, x15);
+		QUARTER_ROUND(x0, x5, x10, x15);
+		QUARTER_ROUND(x1, x6, x11, x12);
+		QUARTER_ROUND(x2, x7, x8, x13);
+		QUARTER_ROUND(x3, x4, x9, x14);
+	}
+	out[0] = x0 + in[0];
+	out[1] = x1 + in[1];
+	out[2] = x2 + in[2];
+	out[3] = x3 + in[3];
+	out[4] = x4 + in[4];
+	out[5] = x5 + in[5];
+	out[6] = x6 + in[6];
+	out[7] = x7 + in[7];
+	out[8] = x8 + in[8];
+	out[9] = x9 + in[9];
+	out[10] = x10 + in[10];
+	out[11] = x11 + in[11];
+	out[12] = x12 + in[12];
+	out[13] = x13 + in[13];
+	out[14] = x14 + in[14];
+	out[15] = x15 + in[15];
+}
+
+/* XORs up to one batch of keystream into out, and moves past the blocks used */
+static void chacha20_xor_batch(uint8_t *out, const uint8_t *in, size_t len, uint32_t state[16])
+{
+	uint32_t ks[CHACHA20_BATCH * 16];
+	size_t blocks = (len + CHACHA20_BLOCK_LEN - 1) / CHACHA20_BLOCK_LEN;
+	size_t i;
+
+	for (i = 0; i < blocks; i++) {
+		chacha20_block(state, &ks[i * 16]);
+		state[12]++;
+	}
+	i = 0;
+	if (!(((uintptr_t)out | (uintptr_t)in) & 3)) {
+		/* Little endian, so the keystream words apply as they are */
+		for (; i + 4 <= len; i += 4) {
+			*(uint32_t *)(out + i) = *(const uint32_t *)(in + i) ^ ks[i / 4];
+		}
+	}
+	const uint8_t *ks8 = (const uint8_t *)ks;
+	for (; i < len; i++) {
+		out[i] = in[i] ^ ks8[i];
+	}
+	sodium_memzero(ks, blocks * CHACHA20_BLOCK_LEN);
+}
+
+static void poly1305_init(poly1305_state_t *st, const uint8_t key[32])
+{
+	/* Clamped r, split into 26 bit limbs */
+	st->r0 = load32_le(key) & 0x3ffffff;
+	st->r1 = (load32_le(key + 3) >> 2) & 0x3ffff03;
+	st->r2 = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+	st->r3 = (load32_le(key + 9) >> 6) & 0x3f03fff;
+	st->r4 = (load32_le(key + 12) >> 8) & 0x00fffff;
+	st->s1 = st->r1 * 5;
+	st->s2 = st->r2 * 5;
+	st->s3 = st->r3 * 5;
+	st->s4 = st->r4 * 5;
+	st->h0 = st->h1 = st->h2 = st->h3 = st->h4 = 0;
+	st->pad[0] = load32_le(key + 16);
+	st->pad[1] = load32_le(key + 20);
+	st->pad[2] = load32_le(key + 24);
+	st->pad[3] = load32_le(key + 28);
+}
+
+/* Full 16 byte blocks only. In the AEAD construction every block is full,
+ * as the data is zero padded, so the 2^128 bit is always set.
+ */
+static void poly1305_blocks(poly1305_state_t *st, const uint8_t *m, size_t len)
+{
+	const uint32_t r0 = st->r0, r1 = st->r1, r2 = st->r2, r3 = st->r3, r4 = st->r4;
+	const uint32_t s1 = st->s1, s2 = st->s2, s3 = st->s3, s4 = st->s4;
+	uint32_t h0 = st->h0, h1 = st->h1, h2 = st->h2, h3 = st->h3, h4 = st->h4;
+
+	while (len >= POLY1305_BLOCK_LEN) {
+		h0 += load32_le(m) & POLY1305_MASK26;
+		h1 += (load32_le(m + 3) >> 2) & POLY1305_MASK26;
+		h2 += (load32_le(m + 6) >> 4) & POLY1305_MASK26;
+		h3 += (load32_le(m + 9) >> 6) & POLY1305_MASK26;
+		h4 += (load32_le(m + 12) >> 8) | (1 << 24);
+
+		uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+		uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+		uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+		uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+		uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+		/* Partial carry propagation, h stays below 2^26 + a little */
+		uint32_t c = (uint32_t)(d0 >> 26);
+		h0 = (uint32_t)d0 & POLY1305_MASK26;
+		d1 += c;
+		c = (uint32_t)(d1 >> 26);
+		h1 = (uint32_t)d1 & POLY1305_MASK26;
+		d2 += c;
+		c = (uint32_t)(d2 >> 26);
+		h2 = (uint32_t)d2 & POLY1305_MASK26;
+		d3 += c;
+		c = (uint32_t)(d3 >> 26);
+		h3 = (uint32_t)d3 & POLY1305_MASK26;
+		d4 += c;
+		c = (uint32_t)(d4 >> 26);
+		h4 = (uint32_t)d4 & POLY1305_MASK26;
+		h0 += c * 5;
+		c = h0 >> 26;
+		h0 &= POLY1305_MASK26;
+		h1 += c;
+
+		m += POLY1305_BLOCK_LEN;
+		len -= POLY1305_BLOCK_LEN;
+	}
+	st->h0 = h0;
+	st->h1 = h1;
+	st->h2 = h2;
+	st->h3 = h3;
+	st->h4 = h4;
+}
+
+/* Authenticates data zero padded to a multiple of 16 bytes */
+static void poly1305_update_padded(poly1305_state_t *st, const uint8_t *m, size_t len)
+{
+	size_t full = len & ~(size_t)(POLY1305_BLOCK_LEN - 1);
+	poly1305_blocks(st, m, full);
+	if (len > full) {
+		uint8_t block[POLY1305_BLOCK_LEN] = {0};
+		memcpy(block, m + full, len - full);
+		poly1305_blocks(st, block, sizeof(block));
+	}
+}
+
+static void poly1305_finish(poly1305_state_t *st, size_t adlen, size_t clen, uint8_t mac[16])
+{
+	uint8_t lengths[POLY1305_BLOCK_LEN];
+	store32_le(lengths, (uint32_t)adlen);
+	store32_le(lengths + 4, (uint32_t)((uint64_t)adlen >> 32));
+	store32_le(lengths + 8, (uint32_t)clen);
+	store32_le(lengths + 12, (uint32_t)((uint64_t)clen >> 32));
+	poly1305_blocks(st, lengths, sizeof(lengths));
+
+	uint32_t h0 = st->h0, h1 = st->h1, h2 = st->h2, h3 = st->h3, h4 = st->h4;
+	uint32_t c, g0, g1, g2, g3, g4, mask;
+
+	/* Full carry */
+	c = h1 >> 26; h1 &= POLY1305_MASK26;
+	h2 += c; c = h2 >> 26; h2 &= POLY1305_MASK26;
+	h3 += c; c = h3 >> 26; h3 &= POLY1305_MASK26;
+	h4 += c; c = h4 >> 26; h4 &= POLY1305_MASK26;
+	h0 += c * 5; c = h0 >> 26; h0 &= POLY1305_MASK26;
+	h1 += c;
+
+	/* h - p, picked in constant time if h >= p */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= POLY1305_MASK26;
+	g1 = h1 + c; c = g1 >> 26; g1 &= POLY1305_MASK26;
+	g2 = h2 + c; c = g2 >> 26; g2 &= POLY1305_MASK26;
+	g3 = h3 + c; c = g3 >> 26; g3 &= POLY1305_MASK26;
+	g4 = h4 + c - (1UL << 26);
+
+	mask = (g4 >> 31) - 1;
+	g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+	h3 = (h3 & mask) | g3;
+	h4 = (h4 & mask) | g4;
+
+	/* Back to 32 bit words, and add the pad modulo 2^128 */
+	h0 = (h0 | (h1 << 26));
+	h1 = ((h1 >> 6) | (h2 << 20));
+	h2 = ((h2 >> 12) | (h3 << 14));
+	h3 = ((h3 >> 18) | (h4 << 8));
+
+	uint64_t f;
+	f = (uint64_t)h0 + st->pad[0];
+	store32_le(mac, (uint32_t)f);
+	f = (uint64_t)h1 + st->pad[1] + (f >> 32);
+	store32_le(mac + 4, (uint32_t)f);
+	f = (uint64_t)h2 + st->pad[2] + (f >> 32);
+	store32_le(mac + 8, (uint32_t)f);
+	f = (uint64_t)h3 + st->pad[3] + (f >> 32);
+	store32_le(mac + 12, (uint32_t)f);
+
+	sodium_memzero(st, sizeof(*st));
+}
+
+/* Block 0 of the keystream keys Poly1305, the data starts at block 1 */
+static void hap_aead_kernel_setup(uint32_t state[16], poly1305_state_t *st, const uint8_t *npub,
+		const uint8_t *k)
+{
+	uint32_t block0[16];
+	chacha20_init(state, k, npub, 0);
+	chacha20_block(state, block0);
+	poly1305_init(st, (const uint8_t *)block0);
+	sodium_memzero(block0, sizeof(block0));
+	state[12] = 1;
+}
+
+int hap_aead_kernel_encrypt_detached(uint8_t *c, uint8_t *mac, const uint8_t *m, size_t mlen,
+		const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k)
+{
+	uint32_t state[16];
+	poly1305_state_t st;
+	size_t off;
+
+	hap_aead_kernel_setup(state, &st, npub, k);
+	poly1305_update_padded(&st, ad, adlen);
+	for (off = 0; off < mlen; off += CHACHA20_BATCH_LEN) {
+		size_t len = (mlen - off) < CHACHA20_BATCH_LEN ? (mlen - off) : CHACHA20_BATCH_LEN;
+		chacha20_xor_batch(c + off, m + off, len, state);
+		poly1305_update_padded(&st, c + off, len);
+	}
+	poly1305_finish(&st, adlen, mlen, mac);
+	sodium_memzero(state, sizeof(state));
+	return 0;
+}
+
+int hap_aead_kernel_decrypt_detached(uint8_t *m, const uint8_t *c, size_t clen, const uint8_t *mac,
+		const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k)
+{
+	uint32_t state[16];
+	poly1305_state_t st;
+	uint8_t computed[HAP_AEAD_TAG_LEN];
+	size_t off;
+
+	/* The tag is checked before anything is written out */
+	hap_aead_kernel_setup(state, &st, npub, k);
+	poly1305_update_padded(&st, ad, adlen);
+	poly1305_update_padded(&st, c, clen);
+	poly1305_finish(&st, adlen, clen, computed);
+	if (sodium_memcmp(computed, mac, sizeof(computed)) != 0) {
+		sodium_memzero(state, sizeof(state));
+		return -1;
+	}
+	for (off = 0; off < clen; off += CHACHA20_BATCH_LEN) {
+		size_t len = (clen - off) < CHACHA20_BATCH_LEN ? (clen - off) : CHACHA20_BATCH_LEN;
+		chacha20_xor_batch(m + off, c + off, len, state);
+	}
+	sodium_memzero(state, sizeof(state));
+	return 0;
+}
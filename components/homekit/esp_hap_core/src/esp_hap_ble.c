@@ -0,0 +1,1516 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* HAP over Bluetooth LE, on top of NimBLE.
+ *
+ * Every service of the primary accessory becomes a GATT service with a Service
+ * Instance ID characteristic, and every characteristic gets a Characteristic
+ * Instance ID descriptor. A Pairing service with the Pair Setup, Pair Verify,
+ * Pairing Features and Pairings characteristics is added at the end. Bridges
+ * are not supported over BLE, so bridged accessories are left out.
+ *
+ * Controllers run HAP procedures by writing a request PDU to a characteristic
+ * and reading the response PDU back from it. Both can be spread over several
+ * GATT writes/reads as fragments. Pair Setup and Pair Verify run the same code
+ * as over IP. Once verified, every GATT value is sealed with the session keys,
+ * fragment by fragment, with the same nonces as HAP over IP but no AAD.
+ *
+ * Only one connection is served at a time. Events go out as empty indications
+ * while a controller is connected. Otherwise, the Global State Number (GSN) in
+ * the advertisement is bumped once per disconnected period, which is what lets
+ * controllers notice changes without keeping a connection open. It is the same
+ * number as the state number of HAP over IP. Right after a bump, advertising
+ * runs at 20 ms for a few seconds, then drops back to the configured interval.
+ *
+ * Broadcast notifications and the Characteristic/Protocol Configuration
+ * procedures are not supported, and are answered with Unsupported PDU.
+ */
+
+#include <string.h>
+#include <sdkconfig.h>
+
+#ifdef CONFIG_HAP_BLE_ENABLE
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+#include <esp_hap_aead.h>
+
+#include <host/ble_hs.h>
+#include <host/ble_uuid.h>
+#include <nimble/nimble_port.h>
+#include <nimble/nimble_port_freertos.h>
+#include <services/gap/ble_svc_gap.h>
+#include <services/gatt/ble_svc_gatt.h>
+
+#include <hap.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <byte_convert.h>
+#include <esp_hap_main.h>
+#include <esp_hap_acc.h>
+#include <esp_hap_serv.h>
+#include <esp_hap_char.h>
+#include <esp_hap_database.h>
+#include <esp_hap_controllers.h>
+#include <esp_hap_pair_common.h>
+#include <esp_hap_pair_setup.h>
+#include <esp_hap_pair_verify.h>
+#include <esp_hap_pairings.h>
+#include <esp_hap_ble.h>
+
+/* HAP-BLE PDU control field */
+#define HAP_BLE_CTRL_CONTINUATION   0x80
+#define HAP_BLE_CTRL_TYPE_MASK      0x0e
+#define HAP_BLE_CTRL_TYPE_REQ       0x00
+#define HAP_BLE_CTRL_TYPE_RSP       0x02
+
+/* Request header: control, opcode, TID, IID. Body length and body are optional */
+#define HAP_BLE_REQ_HDR_LEN         5
+#define HAP_BLE_REQ_BODY_OFF        7
+/* Response header: control, TID, status, body length */
+#define HAP_BLE_RSP_HDR_LEN         5
+/* Continuation fragments: control, TID */
+#define HAP_BLE_CONT_HDR_LEN        2
+
+/* HAP-BLE opcodes */
+#define HAP_BLE_OP_CHAR_SIG_READ    0x01
+#define HAP_BLE_OP_CHAR_WRITE       0x02
+#define HAP_BLE_OP_CHAR_READ        0x03
+#define HAP_BLE_OP_CHAR_TIMED_WRITE 0x04
+#define HAP_BLE_OP_CHAR_EXEC_WRITE  0x05
+#define HAP_BLE_OP_SERV_SIG_READ    0x06
+
+/* HAP-BLE status codes */
+#define HAP_BLE_STATUS_SUCCESS      0x00
+#define HAP_BLE_STATUS_UNSUPPORTED  0x01
+#define HAP_BLE_STATUS_MAX_PROC     0x02
+#define HAP_BLE_STATUS_NO_AUTHZ     0x03
+#define HAP_BLE_STATUS_INVALID_IID  0x04
+#define HAP_BLE_STATUS_NO_AUTHN     0x05
+#define HAP_BLE_STATUS_INVALID_REQ  0x06
+
+/* HAP-Param types of the PDU bodies */
+#define HAP_BLE_PARAM_VALUE         0x01
+#define HAP_BLE_PARAM_AUTH_DATA     0x02
+#define HAP_BLE_PARAM_ORIGIN        0x03
+#define HAP_BLE_PARAM_CHAR_TYPE     0x04
+#define HAP_BLE_PARAM_CHAR_IID      0x05
+#define HAP_BLE_PARAM_SERV_TYPE     0x06
+#define HAP_BLE_PARAM_SERV_IID      0x07
+#define HAP_BLE_PARAM_TTL           0x08
+#define HAP_BLE_PARAM_RETURN_RSP    0x09
+#define HAP_BLE_PARAM_PROPERTIES    0x0a
+#define HAP_BLE_PARAM_USER_DESC     0x0b
+#define HAP_BLE_PARAM_PRES_FORMAT   0x0c
+#define HAP_BLE_PARAM_VALID_RANGE   0x0d
+#define HAP_BLE_PARAM_STEP          0x0e
+#define HAP_BLE_PARAM_SERV_PROPS    0x0f
+#define HAP_BLE_PARAM_LINKED_SERVS  0x10
+#define HAP_BLE_PARAM_VALID_VALS    0x11
+#define HAP_BLE_PARAM_VALID_RANGES  0x12
+
+/* HAP characteristic properties, as reported in signature reads */
+#define HAP_BLE_PROP_READ           0x0001
+#define HAP_BLE_PROP_WRITE          0x0002
+#define HAP_BLE_PROP_AA             0x0004
+#define HAP_BLE_PROP_TW             0x0008
+#define HAP_BLE_PROP_SECURE_READ    0x0010
+#define HAP_BLE_PROP_SECURE_WRITE   0x0020
+#define HAP_BLE_PROP_HIDDEN         0x0040
+#define HAP_BLE_PROP_EV_CONNECTED   0x0080
+#define HAP_BLE_PROP_EV_DISCONNECTED 0x0100
+
+/* HAP service properties */
+#define HAP_BLE_SERV_PROP_PRIMARY   0x0001
+#define HAP_BLE_SERV_PROP_HIDDEN    0x0002
+
+/* Pairing service and its characteristics */
+#define HAP_BLE_PAIRING_SERV_UUID   0x55
+#define HAP_BLE_PAIR_SETUP_UUID     0x4c
+#define HAP_BLE_PAIR_VERIFY_UUID    0x4e
+#define HAP_BLE_PAIR_FEATURES_UUID  0x4f
+#define HAP_BLE_PAIRINGS_UUID       0x50
+
+typedef enum {
+    HAP_BLE_PAIR_NONE = 0,
+    HAP_BLE_PAIR_SETUP,
+    HAP_BLE_PAIR_VERIFY,
+    HAP_BLE_PAIR_FEATURES,
+    HAP_BLE_PAIRINGS,
+} hap_ble_pair_op_t;
+
+/* Advertising runs at this interval (in ms) for a while after the GSN changes */
+#define HAP_BLE_ADV_FAST_MS         20
+#define HAP_BLE_ADV_FAST_PERIOD_MS  3000
+/* Units of 0.625 ms */
+#define HAP_BLE_ADV_ITVL(ms)        (((ms) * 8) / 5)
+
+/* Apple, Inc. */
+#define HAP_BLE_COMPANY_ID          0x004c
+#define HAP_BLE_ADV_TYPE            0x06
+/* Subtype 1, 17 bytes following */
+#define HAP_BLE_ADV_STL             0x31
+#define HAP_BLE_ADV_CV              0x02
+#define HAP_BLE_ADV_SF_UNPAIRED     0x01
+
+/* Timed writes wait at most this long for the execute write, whatever the TTL says */
+#define HAP_BLE_TTL_UNIT_MS         100
+
+#define HAP_BLE_CONN_NONE           BLE_HS_CONN_HANDLE_NONE
+
+/* Pending notifications are taken off the list this many at a time */
+#define HAP_BLE_NOTIF_BATCH         8
+
+/* Custom UUIDs of the instance ID attributes */
+static const ble_uuid128_t hap_ble_serv_iid_uuid = BLE_UUID128_INIT(
+        0xd1, 0xa0, 0x83, 0x50, 0x00, 0xaa, 0xd3, 0x87, 0x17, 0x48, 0x59, 0xa7, 0x5d, 0xe9, 0x04, 0xe6);
+static const ble_uuid128_t hap_ble_char_iid_uuid = BLE_UUID128_INIT(
+        0x9a, 0x93, 0x96, 0xd7, 0xbd, 0x6a, 0xd9, 0xb5, 0x16, 0x46, 0xd2, 0x81, 0xfe, 0xf0, 0x46, 0xdc);
+
+typedef struct {
+    ble_uuid128_t uuid;
+    uint16_t iid;
+    uint16_t props;
+    hap_serv_t *hs;                     /* NULL for the Pairing service */
+} hap_ble_serv_t;
+
+typedef struct {
+    ble_uuid128_t uuid;
+    uint16_t iid;
+    uint16_t val_handle;
+    hap_char_t *hc;                     /* NULL for the Pairing service characteristics */
+    hap_ble_pair_op_t pair_op;
+    hap_ble_serv_t *serv;
+    bool subscribed;                    /* Indications enabled by the connected controller */
+} hap_ble_char_t;
+
+typedef struct {
+    uint16_t handle;
+    uint16_t mtu;
+    /* Pair Setup or Pair Verify in progress, and which of the two */
+    void *pair_ctx;
+    hap_ble_pair_op_t pair_op;
+    hap_secure_session_t *session;
+    /* GSN already bumped for a change during this connection */
+    bool gsn_bumped;
+    /* Request being reassembled */
+    hap_ble_char_t *req_chr;
+    uint8_t req_tid;
+    int req_len;
+    int req_expected;
+    /* Response being read out */
+    hap_ble_char_t *rsp_chr;
+    int rsp_len;
+    int rsp_off;
+    /* Timed write waiting for its execute write */
+    hap_ble_char_t *tw_chr;
+    uint8_t *tw_body;
+    int tw_len;
+    int64_t tw_expiry_us;
+    uint8_t *req;
+    uint8_t *rsp;
+} hap_ble_conn_t;
+
+static hap_ble_serv_t *hap_ble_servs;
+static hap_ble_char_t *hap_ble_chars;
+static int hap_ble_num_chars;
+static struct ble_gatt_svc_def *hap_ble_gatt_svcs;
+static struct ble_gatt_chr_def *hap_ble_gatt_chrs;
+static struct ble_gatt_dsc_def *hap_ble_gatt_dscs;
+
+static hap_ble_conn_t hap_ble_conn = {
+    .handle = HAP_BLE_CONN_NONE,
+};
+static SemaphoreHandle_t hap_ble_lock;
+static uint8_t hap_ble_own_addr_type;
+static bool hap_ble_synced;
+static bool hap_ble_fast_adv;
+static esp_timer_handle_t hap_ble_fast_adv_timer;
+static esp_timer_handle_t hap_ble_idle_timer;
+/* GSN in the advertisement currently running */
+static uint16_t hap_ble_adv_gsn;
+
+static void hap_ble_adv_start(void);
+
+/* UUIDs derived from the Apple base UUID have a short form, the rest are spelt out */
+static void hap_ble_uuid_from_str(const char *str, ble_uuid128_t *uuid)
+{
+    static const uint8_t base[16] = {
+        0x91, 0x52, 0x76, 0xbb, 0x26, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    uuid->u.type = BLE_UUID_TYPE_128;
+    memcpy(uuid->value, base, sizeof(base));
+    uint16_t short_id = hap_uuid_get_short_id(str);
+    if (short_id != HAP_UUID_FULL) {
+        put_u16_le(&uuid->value[12], short_id);
+        return;
+    }
+    /* Most significant digit first, while the BLE form is little endian */
+    int pos = 15;
+    bool high = true;
+    for (; *str && pos >= 0; str++) {
+        int nibble;
+        if (*str >= '0' && *str <= '9') {
+            nibble = *str - '0';
+        } else if (*str >= 'a' && *str <= 'f') {
+            nibble = *str - 'a' + 10;
+        } else if (*str >= 'A' && *str <= 'F') {
+            nibble = *str - 'A' + 10;
+        } else {
+            continue;
+        }
+        if (high) {
+            uuid->value[pos] = nibble << 4;
+        } else {
+            uuid->value[pos--] |= nibble;
+        }
+        high = !high;
+    }
+}
+
+static void hap_ble_uuid_from_short(uint16_t short_id, ble_uuid128_t *uuid)
+{
+    char str[5];
+    snprintf(str, sizeof(str), "%X", short_id);
+    hap_ble_uuid_from_str(str, uuid);
+}
+
+static uint16_t hap_ble_char_props(__hap_char_t *hc)
+{
+    uint16_t perm = hc->desc->permission;
+    uint16_t props = 0;
+    if (perm & HAP_CHAR_PERM_PR) {
+        props |= HAP_BLE_PROP_READ | HAP_BLE_PROP_SECURE_READ;
+    }
+    if (perm & HAP_CHAR_PERM_PW) {
+        props |= HAP_BLE_PROP_WRITE | HAP_BLE_PROP_SECURE_WRITE;
+    }
+    if (perm & HAP_CHAR_PERM_AA) {
+        props |= HAP_BLE_PROP_AA;
+    }
+    if (perm & HAP_CHAR_PERM_TW) {
+        props |= HAP_BLE_PROP_TW;
+    }
+    if (perm & HAP_CHAR_PERM_HD) {
+        props |= HAP_BLE_PROP_HIDDEN;
+    }
+    if (perm & HAP_CHAR_PERM_EV) {
+        props |= HAP_BLE_PROP_EV_CONNECTED | HAP_BLE_PROP_EV_DISCONNECTED;
+    }
+    return props;
+}
+
+/* Bluetooth SIG format of a HAP value format */
+static uint8_t hap_ble_sig_format(uint8_t format)
+{
+    switch (format) {
+        case HAP_CHAR_FORMAT_BOOL:   return 0x01;
+        case HAP_CHAR_FORMAT_UINT8:  return 0x04;
+        case HAP_CHAR_FORMAT_UINT16: return 0x06;
+        case HAP_CHAR_FORMAT_UINT32: return 0x08;
+        case HAP_CHAR_FORMAT_UINT64: return 0x0a;
+        case HAP_CHAR_FORMAT_INT:    return 0x10;
+        case HAP_CHAR_FORMAT_FLOAT:  return 0x14;
+        case HAP_CHAR_FORMAT_STRING: return 0x19;
+        default:                     return 0x1b;
+    }
+}
+
+/* Bluetooth SIG unit of a HAP unit */
+static uint16_t hap_ble_sig_unit(const char *unit)
+{
+    if (!unit) {
+        return 0x2700;
+    } else if (!strcmp(unit, HAP_CHAR_UNIT_CELSIUS)) {
+        return 0x272f;
+    } else if (!strcmp(unit, HAP_CHAR_UNIT_PERCENTAGE)) {
+        return 0x27ad;
+    } else if (!strcmp(unit, HAP_CHAR_UNIT_ARCDEGREES)) {
+        return 0x2763;
+    } else if (!strcmp(unit, HAP_CHAR_UNIT_LUX)) {
+        return 0x2731;
+    } else if (!strcmp(unit, HAP_CHAR_UNIT_SECONDS)) {
+        return 0x2703;
+    }
+    return 0x2700;
+}
+
+/* Little endian form of a value. Returns its length, or -1 if it does not fit.
+ * With a NULL buf, only the length is returned.
+ */
+static int hap_ble_val_encode(uint8_t format, const hap_val_t *val, uint8_t *buf, int buf_size)
+{
+    int len;
+    const void *src = NULL;
+    switch (format) {
+        case HAP_CHAR_FORMAT_BOOL:
+        case HAP_CHAR_FORMAT_UINT8:
+            len = 1;
+            break;
+        case HAP_CHAR_FORMAT_UINT16:
+            len = 2;
+            break;
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_INT:
+        case HAP_CHAR_FORMAT_FLOAT:
+            len = 4;
+            break;
+        case HAP_CHAR_FORMAT_UINT64:
+            len = 8;
+            break;
+        case HAP_CHAR_FORMAT_STRING:
+            src = val->s;
+            len = val->s ? strlen(val->s) : 0;
+            break;
+        case HAP_CHAR_FORMAT_TLV8:
+        case HAP_CHAR_FORMAT_DATA:
+            src = val->d.buf;
+            len = val->d.buflen;
+            break;
+        default:
+            return -1;
+    }
+    if (!buf) {
+        return len;
+    }
+    if (len > buf_size) {
+        return -1;
+    }
+    switch (format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            buf[0] = val->b ? 1 : 0;
+            break;
+        case HAP_CHAR_FORMAT_UINT8:
+            buf[0] = val->u;
+            break;
+        case HAP_CHAR_FORMAT_UINT16:
+            put_u16_le(buf, val->u);
+            break;
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_INT:
+            put_u32_le(buf, val->u);
+            break;
+        case HAP_CHAR_FORMAT_FLOAT:
+            memcpy(buf, &val->f, sizeof(val->f));
+            break;
+        case HAP_CHAR_FORMAT_UINT64:
+            put_u64_le(buf, val->i64);
+            break;
+        default:
+            if (len) {
+                memcpy(buf, src, len);
+            }
+            break;
+    }
+    return len;
+}
+
+/* Value written by a controller. Strings and data get their own buffer, to be
+ * freed with hap_ble_val_free(), just like the values of HAP over IP writes
+ */
+static int hap_ble_val_decode(uint8_t format, const uint8_t *buf, int len, hap_val_t *val)
+{
+    memset(val, 0, sizeof(*val));
+    switch (format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            if (len != 1 || buf[0] > 1) {
+                return HAP_FAIL;
+            }
+            val->b = buf[0];
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_UINT8:
+            if (len != 1) {
+                return HAP_FAIL;
+            }
+            val->u = buf[0];
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_UINT16:
+            if (len != 2) {
+                return HAP_FAIL;
+            }
+            val->u = get_u16_le(buf);
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_INT:
+            if (len != 4) {
+                return HAP_FAIL;
+            }
+            val->u = get_u32_le(buf);
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_FLOAT:
+            if (len != 4) {
+                return HAP_FAIL;
+            }
+            memcpy(&val->f, buf, sizeof(val->f));
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_UINT64:
+            if (len != 8) {
+                return HAP_FAIL;
+            }
+            val->i64 = get_u64_le(buf);
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_STRING:
+            val->s = hap_platform_memory_malloc(len + 1);
+            if (!val->s) {
+                return HAP_FAIL;
+            }
+            memcpy(val->s, buf, len);
+            val->s[len] = '\0';
+            return HAP_SUCCESS;
+        case HAP_CHAR_FORMAT_TLV8:
+        case HAP_CHAR_FORMAT_DATA:
+            val->d.buf = hap_platform_memory_malloc(len ? len : 1);
+            if (!val->d.buf) {
+                return HAP_FAIL;
+            }
+            memcpy(val->d.buf, buf, len);
+            val->d.buflen = len;
+            return HAP_SUCCESS;
+        default:
+            return HAP_FAIL;
+    }
+}
+
+static void hap_ble_val_free(uint8_t format, hap_val_t *val)
+{
+    if (format == HAP_CHAR_FORMAT_STRING) {
+        hap_platform_memory_free(val->s);
+    } else if ((format == HAP_CHAR_FORMAT_TLV8) || (format == HAP_CHAR_FORMAT_DATA)) {
+        hap_platform_memory_free(val->d.buf);
+    }
+}
+
+/* Seals len bytes of buf in place and appends the tag. Returns the new length */
+static int hap_ble_encrypt(hap_secure_session_t *session, uint8_t *buf, int len)
+{
+    uint8_t nonce[12] = {0};
+    put_u64_le(nonce + 4, session->encrypt_nonce++);
+    hap_aead_encrypt_detached(buf, buf + len, buf, len, NULL, 0, nonce, session->encrypt_key);
+    return len + AUTH_TAG_LEN;
+}
+
+/* Opens len bytes of buf in place. Returns the plaintext length, or -1 */
+static int hap_ble_decrypt(hap_secure_session_t *session, uint8_t *buf, int len)
+{
+    uint8_t nonce[12] = {0};
+    if (len < AUTH_TAG_LEN) {
+        return -1;
+    }
+    len -= AUTH_TAG_LEN;
+    put_u64_le(nonce + 4, session->decrypt_nonce);
+    if (hap_aead_decrypt_detached(buf, buf, len, buf + len, NULL, 0, nonce,
+                session->decrypt_key) != 0) {
+        return -1;
+    }
+    session->decrypt_nonce++;
+    return len;
+}
+
+static bool hap_ble_conn_secure(hap_ble_conn_t *conn)
+{
+    return conn->session && (conn->session->state == STATE_VERIFIED);
+}
+
+/* Applies the subscriptions made before the session got verified */
+static void hap_ble_apply_subscriptions(hap_ble_conn_t *conn)
+{
+    int index = hap_get_ctrl_session_index(conn->session);
+    int i;
+    for (i = 0; i < hap_ble_num_chars; i++) {
+        hap_ble_char_t *chr = &hap_ble_chars[i];
+        if (chr->hc && chr->subscribed) {
+            hap_char_manage_notification(chr->hc, index, true);
+        }
+    }
+}
+
+static void hap_ble_pair_ctx_free(hap_ble_conn_t *conn)
+{
+    if (conn->pair_op == HAP_BLE_PAIR_SETUP) {
+        hap_pair_setup_ctx_clean(conn->pair_ctx);
+    } else if (conn->pair_op == HAP_BLE_PAIR_VERIFY) {
+        hap_platform_memory_free(conn->pair_ctx);
+    }
+    conn->pair_ctx = NULL;
+    conn->pair_op = HAP_BLE_PAIR_NONE;
+}
+
+/* Takes over a session verified by Pair Verify (or by Pair Setup, for software token auth) */
+static void hap_ble_session_verified(hap_ble_conn_t *conn, hap_secure_session_t *session)
+{
+    conn->pair_ctx = NULL;
+    conn->pair_op = HAP_BLE_PAIR_NONE;
+    if (conn->session) {
+        hap_free_session(conn->session);
+    }
+    session->conn_identifier = HAP_BLE_CONN_ID_BASE + conn->handle;
+    conn->session = session;
+    hap_ble_apply_subscriptions(conn);
+}
+
+/* Runs a Pair Setup, Pair Verify or Pairings message. The message comes in buf,
+ * and the response goes out in it. Returns the response length
+ */
+static int hap_ble_pair_process(hap_ble_conn_t *conn, hap_ble_pair_op_t op, uint8_t *buf,
+        int inlen, int bufsize)
+{
+    int outlen = 0;
+    int ret;
+    if (op == HAP_BLE_PAIRINGS) {
+        hap_pairings_process(conn->session, buf, inlen, bufsize, &outlen);
+        return outlen;
+    }
+    /* Switching between Pair Setup and Pair Verify starts over */
+    if (conn->pair_ctx && (conn->pair_op != op)) {
+        hap_ble_pair_ctx_free(conn);
+    }
+    if (!conn->pair_ctx) {
+        if (op == HAP_BLE_PAIR_SETUP) {
+            ret = hap_pair_setup_context_init(HAP_BLE_CONN_ID_BASE + conn->handle,
+                    &conn->pair_ctx, buf, bufsize, &outlen);
+        } else {
+            ret = hap_pair_verify_context_init(&conn->pair_ctx, buf, bufsize, &outlen);
+        }
+        if (ret != HAP_SUCCESS) {
+            conn->pair_ctx = NULL;
+            return outlen;
+        }
+        conn->pair_op = op;
+    }
+    if (op == HAP_BLE_PAIR_SETUP) {
+        ret = hap_pair_setup_process(&conn->pair_ctx, buf, inlen, bufsize, &outlen);
+    } else {
+        ret = hap_pair_verify_process(&conn->pair_ctx, buf, inlen, bufsize, &outlen);
+    }
+    if (ret != HAP_SUCCESS) {
+        hap_ble_pair_ctx_free(conn);
+    } else if (!conn->pair_ctx) {
+        /* Pair Setup done and its context cleaned up */
+        conn->pair_op = HAP_BLE_PAIR_NONE;
+    } else if (hap_pair_verify_get_state(conn->pair_ctx) == STATE_VERIFIED) {
+        hap_ble_session_verified(conn, conn->pair_ctx);
+    }
+    return outlen;
+}
+
+static int hap_ble_add_u16(hap_tlv_data_t *tlv, uint8_t type, uint16_t val)
+{
+    uint8_t buf[2];
+    put_u16_le(buf, val);
+    return add_tlv(tlv, type, sizeof(buf), buf);
+}
+
+static int hap_ble_add_pres_format(hap_tlv_data_t *tlv, uint8_t format, const char *unit)
+{
+    uint8_t pf[7] = {0};
+    pf[0] = hap_ble_sig_format(format);
+    put_u16_le(&pf[2], hap_ble_sig_unit(unit));
+    pf[4] = 0x01;   /* Bluetooth SIG namespace */
+    return add_tlv(tlv, HAP_BLE_PARAM_PRES_FORMAT, sizeof(pf), pf);
+}
+
+static bool hap_ble_format_numeric(uint8_t format)
+{
+    return (format >= HAP_CHAR_FORMAT_UINT8) && (format <= HAP_CHAR_FORMAT_FLOAT);
+}
+
+/* HAP-Characteristic-Signature-Read response body */
+static int hap_ble_char_signature(hap_ble_char_t *chr, hap_tlv_data_t *tlv)
+{
+    add_tlv(tlv, HAP_BLE_PARAM_CHAR_TYPE, sizeof(chr->uuid.value), chr->uuid.value);
+    hap_ble_add_u16(tlv, HAP_BLE_PARAM_SERV_IID, chr->serv->iid);
+    add_tlv(tlv, HAP_BLE_PARAM_SERV_TYPE, sizeof(chr->serv->uuid.value), chr->serv->uuid.value);
+    if (!chr->hc) {
+        uint16_t props = (chr->pair_op == HAP_BLE_PAIR_FEATURES) ? HAP_BLE_PROP_READ :
+                (chr->pair_op == HAP_BLE_PAIRINGS) ? (HAP_BLE_PROP_SECURE_READ | HAP_BLE_PROP_SECURE_WRITE) :
+                (HAP_BLE_PROP_READ | HAP_BLE_PROP_WRITE);
+        hap_ble_add_u16(tlv, HAP_BLE_PARAM_PROPERTIES, props);
+        hap_ble_add_pres_format(tlv, (chr->pair_op == HAP_BLE_PAIR_FEATURES) ?
+                HAP_CHAR_FORMAT_UINT8 : HAP_CHAR_FORMAT_TLV8, NULL);
+        return tlv->curlen;
+    }
+    __hap_char_t *hc = (__hap_char_t *)chr->hc;
+    const hap_char_desc_t *desc = hc->desc;
+    hap_ble_add_u16(tlv, HAP_BLE_PARAM_PROPERTIES, hap_ble_char_props(hc));
+    if (desc->description) {
+        add_tlv(tlv, HAP_BLE_PARAM_USER_DESC, strlen(desc->description), (void *)desc->description);
+    }
+    hap_ble_add_pres_format(tlv, desc->format, desc->unit);
+    if (hap_ble_format_numeric(desc->format) &&
+            ((desc->constraint_flags & (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG)) ==
+             (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG))) {
+        uint8_t range[16];
+        int len = hap_ble_val_encode(desc->format, &desc->min, range, sizeof(range) / 2);
+        if (len > 0) {
+            hap_ble_val_encode(desc->format, &desc->max, range + len, sizeof(range) / 2);
+            add_tlv(tlv, HAP_BLE_PARAM_VALID_RANGE, 2 * len, range);
+        }
+    }
+    if (hap_ble_format_numeric(desc->format) && (desc->constraint_flags & HAP_CHAR_STEP_FLAG)) {
+        uint8_t step[8];
+        int len = hap_ble_val_encode(desc->format, &desc->step, step, sizeof(step));
+        if (len > 0) {
+            add_tlv(tlv, HAP_BLE_PARAM_STEP, len, step);
+        }
+    }
+    if (desc->valid_vals && desc->valid_vals_cnt) {
+        add_tlv(tlv, HAP_BLE_PARAM_VALID_VALS, desc->valid_vals_cnt, (void *)desc->valid_vals);
+    }
+    if (desc->constraint_flags & HAP_CHAR_VALID_RANGE_FLAG) {
+        add_tlv(tlv, HAP_BLE_PARAM_VALID_RANGES, 2, (void *)desc->valid_vals_range);
+    }
+    return tlv->curlen;
+}
+
+/* HAP-Service-Signature-Read response body */
+static int hap_ble_serv_signature(hap_ble_serv_t *serv, hap_tlv_data_t *tlv)
+{
+    hap_ble_add_u16(tlv, HAP_BLE_PARAM_SERV_PROPS, serv->props);
+    uint8_t linked[2 * 8];
+    int len = 0;
+    if (serv->hs) {
+        hap_linked_serv_t *ls;
+        for (ls = ((__hap_serv_t *)serv->hs)->linked_servs; ls && (len < (int)sizeof(linked)); ls = ls->next) {
+            put_u16_le(&linked[len], hap_serv_get_iid(ls->hs));
+            len += 2;
+        }
+    }
+    add_tlv(tlv, HAP_BLE_PARAM_LINKED_SERVS, len, linked);
+    return tlv->curlen;
+}
+
+/* HAP-Characteristic-Read response body */
+static int hap_ble_char_read(hap_ble_conn_t *conn, hap_ble_char_t *chr, hap_tlv_data_t *tlv, uint8_t *status)
+{
+    uint8_t *val;
+    int len;
+    if (!chr->hc) {
+        if (chr->pair_op != HAP_BLE_PAIR_FEATURES) {
+            *status = HAP_BLE_STATUS_INVALID_REQ;
+            return 0;
+        }
+        return add_tlv(tlv, HAP_BLE_PARAM_VALUE, 1, &hap_priv.features);
+    }
+    __hap_char_t *hc = (__hap_char_t *)chr->hc;
+    if (!(hc->desc->permission & HAP_CHAR_PERM_PR)) {
+        *status = HAP_BLE_STATUS_INVALID_REQ;
+        return 0;
+    }
+    __hap_serv_t *hs = (__hap_serv_t *)hap_char_get_parent(chr->hc);
+    hap_status_t read_status = HAP_STATUS_SUCCESS;
+    hap_read_data_t read_data = {
+        .hc = chr->hc,
+        .status = &read_status,
+    };
+    hap_char_set_owner_ctrl(chr->hc, hap_get_ctrl_session_index(conn->session));
+    if ((hs->bulk_read(&read_data, 1, hs->priv, conn->session) != HAP_SUCCESS) ||
+            (read_status != HAP_STATUS_SUCCESS)) {
+        *status = HAP_BLE_STATUS_INVALID_REQ;
+        return 0;
+    }
+    len = hap_ble_val_encode(hc->desc->format, &hc->val, NULL, 0);
+    if ((len < 0) || !(val = hap_tlv_reserve(tlv, len))) {
+        *status = HAP_BLE_STATUS_INVALID_REQ;
+        return 0;
+    }
+    hap_ble_val_encode(hc->desc->format, &hc->val, val, len);
+    return hap_tlv_commit(tlv, HAP_BLE_PARAM_VALUE, len);
+}
+
+/* Writes a value to a characteristic through its service write routine */
+static uint8_t hap_ble_char_write_val(hap_ble_conn_t *conn, hap_ble_char_t *chr, hap_tlv_index_t *idx,
+        hap_tlv_data_t *tlv)
+{
+    __hap_char_t *hc = (__hap_char_t *)chr->hc;
+    __hap_serv_t *hs = (__hap_serv_t *)hap_char_get_parent(chr->hc);
+    uint8_t *buf;
+    int len = hap_tlv_get(idx, HAP_BLE_PARAM_VALUE, &buf);
+    if ((len < 0) || !(hc->desc->permission & HAP_CHAR_PERM_PW) || !hs->write_cb) {
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    hap_write_data_t write_data = {
+        .hc = chr->hc,
+    };
+    if (hap_ble_val_decode(hc->desc->format, buf, len, &write_data.val) != HAP_SUCCESS) {
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    hap_char_quantize_val(hc, &write_data.val);
+    if (hap_char_check_val_constraints(hc, &write_data.val) != HAP_SUCCESS) {
+        hap_ble_val_free(hc->desc->format, &write_data.val);
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    int auth_len = hap_tlv_get(idx, HAP_BLE_PARAM_AUTH_DATA, &buf);
+    if (hc->desc->permission & HAP_CHAR_PERM_AA) {
+        if (auth_len < 0) {
+            hap_ble_val_free(hc->desc->format, &write_data.val);
+            return HAP_BLE_STATUS_NO_AUTHZ;
+        }
+        write_data.auth_data.data = buf;
+        write_data.auth_data.len = auth_len;
+    }
+    uint8_t origin = 0;
+    if (hap_tlv_get_u8(idx, HAP_BLE_PARAM_ORIGIN, &origin) == 1) {
+        write_data.remote = (origin == 1);
+    }
+    uint8_t return_rsp = 0;
+    hap_tlv_get_u8(idx, HAP_BLE_PARAM_RETURN_RSP, &return_rsp);
+    write_data.write_response = (return_rsp == 1) && (hc->desc->permission & HAP_CHAR_PERM_WR);
+
+    hap_status_t write_status = HAP_STATUS_SUCCESS;
+    write_data.status = &write_status;
+    hap_char_note_write(chr->hc, hap_get_ctrl_session_index(conn->session));
+    int ret = hs->write_cb(&write_data, 1, hs->priv, conn->session);
+    hap_ble_val_free(hc->desc->format, &write_data.val);
+    if ((ret != HAP_SUCCESS) || (write_status != HAP_STATUS_SUCCESS)) {
+        return (write_status == HAP_STATUS_INSUFFICIENT_AUTH) ? HAP_BLE_STATUS_NO_AUTHZ :
+                HAP_BLE_STATUS_INVALID_REQ;
+    }
+    if (write_data.write_response) {
+        uint8_t status = HAP_BLE_STATUS_SUCCESS;
+        hap_ble_char_read(conn, chr, tlv, &status);
+        return status;
+    }
+    return HAP_BLE_STATUS_SUCCESS;
+}
+
+/* HAP-Characteristic-Write, with the response body going to tlv */
+static uint8_t hap_ble_char_write(hap_ble_conn_t *conn, hap_ble_char_t *chr, uint8_t *body, int body_len,
+        hap_tlv_data_t *tlv)
+{
+    hap_tlv_index_t idx;
+    if (hap_tlv_index_build(&idx, body, body_len) < 0) {
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    if (chr->hc) {
+        return hap_ble_char_write_val(conn, chr, &idx, tlv);
+    }
+    if (chr->pair_op == HAP_BLE_PAIR_FEATURES) {
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    /* Pairing messages are processed in place, in the response buffer */
+    uint8_t *msg;
+    int msg_len = hap_tlv_get(&idx, HAP_BLE_PARAM_VALUE, &msg);
+    int out_size = CONFIG_HAP_BLE_PDU_BUF_SIZE / 2;
+    uint8_t *out = hap_tlv_reserve(tlv, out_size);
+    if ((msg_len < 0) || (msg_len > out_size) || !out) {
+        return HAP_BLE_STATUS_INVALID_REQ;
+    }
+    memcpy(out, msg, msg_len);
+    int out_len = hap_ble_pair_process(conn, chr->pair_op, out, msg_len, out_size);
+    /* A shorter response may need fewer item headers, so it starts a bit earlier */
+    memmove(hap_tlv_reserve(tlv, out_len), out, out_len);
+    hap_tlv_commit(tlv, HAP_BLE_PARAM_VALUE, out_len);
+    return HAP_BLE_STATUS_SUCCESS;
+}
+
+static hap_ble_serv_t *hap_ble_get_serv_by_iid(uint16_t iid)
+{
+    int i;
+    for (i = 0; i < hap_ble_num_chars; i++) {
+        if (hap_ble_chars[i].serv->iid == iid) {
+            return hap_ble_chars[i].serv;
+        }
+    }
+    return NULL;
+}
+
+static void hap_ble_tw_clear(hap_ble_conn_t *conn)
+{
+    hap_platform_memory_free(conn->tw_body);
+    conn->tw_body = NULL;
+    conn->tw_chr = NULL;
+    conn->tw_len = 0;
+}
+
+/* Runs a complete request and leaves the response PDU in conn->rsp */
+static void hap_ble_handle_request(hap_ble_conn_t *conn, hap_ble_char_t *chr)
+{
+    uint8_t opcode = conn->req[1];
+    uint8_t tid = conn->req[2];
+    uint16_t iid = get_u16_le(&conn->req[3]);
+    uint8_t *body = conn->req + HAP_BLE_REQ_BODY_OFF;
+    int body_len = (conn->req_len > HAP_BLE_REQ_HDR_LEN) ? conn->req_len - HAP_BLE_REQ_BODY_OFF : 0;
+    uint8_t status = HAP_BLE_STATUS_SUCCESS;
+    hap_tlv_data_t tlv;
+    hap_tlv_data_init(&tlv, conn->rsp + HAP_BLE_RSP_HDR_LEN, CONFIG_HAP_BLE_PDU_BUF_SIZE - HAP_BLE_RSP_HDR_LEN);
+
+    /* Before a session, only pairing and the discovery of the database are allowed */
+    bool unsecured_ok = (opcode == HAP_BLE_OP_CHAR_SIG_READ) || (opcode == HAP_BLE_OP_SERV_SIG_READ) ||
+        ((chr->pair_op != HAP_BLE_PAIR_NONE) && (chr->pair_op != HAP_BLE_PAIRINGS));
+
+    if ((opcode != HAP_BLE_OP_SERV_SIG_READ) && (iid != chr->iid)) {
+        status = HAP_BLE_STATUS_INVALID_IID;
+    } else if (!unsecured_ok && !hap_ble_conn_secure(conn)) {
+        status = HAP_BLE_STATUS_NO_AUTHN;
+    } else {
+        switch (opcode) {
+            case HAP_BLE_OP_CHAR_SIG_READ:
+                hap_ble_char_signature(chr, &tlv);
+                break;
+            case HAP_BLE_OP_SERV_SIG_READ: {
+                hap_ble_serv_t *serv = hap_ble_get_serv_by_iid(iid);
+                if (serv) {
+                    hap_ble_serv_signature(serv, &tlv);
+                } else {
+                    status = HAP_BLE_STATUS_INVALID_IID;
+                }
+                break;
+            }
+            case HAP_BLE_OP_CHAR_READ:
+                hap_ble_char_read(conn, chr, &tlv, &status);
+                break;
+            case HAP_BLE_OP_CHAR_WRITE:
+                if (chr->hc && (((__hap_char_t *)chr->hc)->desc->permission & HAP_CHAR_PERM_TW)) {
+                    /* Has to go through a timed write */
+                    status = HAP_BLE_STATUS_INVALID_REQ;
+                } else {
+                    status = hap_ble_char_write(conn, chr, body, body_len, &tlv);
+                }
+                break;
+            case HAP_BLE_OP_CHAR_TIMED_WRITE: {
+                hap_tlv_index_t idx;
+                uint8_t ttl;
+                /* The index joins fragments in place, so keep the body as it came */
+                hap_ble_tw_clear(conn);
+                conn->tw_body = hap_platform_memory_malloc(body_len ? body_len : 1);
+                if (!conn->tw_body) {
+                    status = HAP_BLE_STATUS_MAX_PROC;
+                    break;
+                }
+                memcpy(conn->tw_body, body, body_len);
+                if (!chr->hc || (hap_tlv_index_build(&idx, body, body_len) < 0) ||
+                        (hap_tlv_get_u8(&idx, HAP_BLE_PARAM_TTL, &ttl) != 1)) {
+                    hap_ble_tw_clear(conn);
+                    status = HAP_BLE_STATUS_INVALID_REQ;
+                    break;
+                }
+                conn->tw_chr = chr;
+                conn->tw_len = body_len;
+                conn->tw_expiry_us = esp_timer_get_time() + (int64_t)ttl * HAP_BLE_TTL_UNIT_MS * 1000;
+                break;
+            }
+            case HAP_BLE_OP_CHAR_EXEC_WRITE:
+                if ((conn->tw_chr != chr) || (esp_timer_get_time() > conn->tw_expiry_us)) {
+                    status = HAP_BLE_STATUS_INVALID_REQ;
+                } else {
+                    status = hap_ble_char_write(conn, chr, conn->tw_body, conn->tw_len, &tlv);
+                }
+                hap_ble_tw_clear(conn);
+                break;
+            default:
+                status = HAP_BLE_STATUS_UNSUPPORTED;
+                break;
+        }
+    }
+    if (status != HAP_BLE_STATUS_SUCCESS) {
+        tlv.curlen = 0;
+    }
+    conn->rsp[0] = HAP_BLE_CTRL_TYPE_RSP;
+    conn->rsp[1] = tid;
+    conn->rsp[2] = status;
+    put_u16_le(&conn->rsp[3], tlv.curlen);
+    /* A response without a body can leave out the body length */
+    conn->rsp_len = tlv.curlen ? HAP_BLE_RSP_HDR_LEN + tlv.curlen : 3;
+    conn->rsp_off = 0;
+    conn->rsp_chr = chr;
+}
+
+/* Plaintext space in a GATT value, after the ATT header and the auth tag */
+static int hap_ble_frag_max(hap_ble_conn_t *conn)
+{
+    return conn->mtu - 3 - (hap_ble_conn_secure(conn) ? AUTH_TAG_LEN : 0);
+}
+
+static int hap_ble_chr_write(hap_ble_conn_t *conn, hap_ble_char_t *chr, struct os_mbuf *om)
+{
+    uint8_t frag[BLE_ATT_ATTR_MAX_LEN];
+    uint16_t len = 0;
+    if (ble_hs_mbuf_to_flat(om, frag, sizeof(frag), &len) != 0) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    if (hap_ble_conn_secure(conn)) {
+        int plain_len = hap_ble_decrypt(conn->session, frag, len);
+        if (plain_len < 0) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "HAP-BLE decryption failure. Disconnecting");
+            ble_gap_terminate(conn->handle, BLE_ERR_AUTH_FAIL);
+            return BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+        }
+        len = plain_len;
+    }
+    if (len < 2) {
+        return BLE_ATT_ERR_INVALID_PDU;
+    }
+    /* Anything written makes any response not read yet stale */
+    conn->rsp_chr = NULL;
+    if (frag[0] & HAP_BLE_CTRL_CONTINUATION) {
+        if ((conn->req_chr != chr) || (frag[1] != conn->req_tid) ||
+                ((conn->req_len + len - HAP_BLE_CONT_HDR_LEN) > conn->req_expected)) {
+            conn->req_chr = NULL;
+            return BLE_ATT_ERR_INVALID_PDU;
+        }
+        memcpy(conn->req + conn->req_len, frag + HAP_BLE_CONT_HDR_LEN, len - HAP_BLE_CONT_HDR_LEN);
+        conn->req_len += len - HAP_BLE_CONT_HDR_LEN;
+    } else {
+        if (((frag[0] & HAP_BLE_CTRL_TYPE_MASK) != HAP_BLE_CTRL_TYPE_REQ) || (len < HAP_BLE_REQ_HDR_LEN)) {
+            conn->req_chr = NULL;
+            return BLE_ATT_ERR_INVALID_PDU;
+        }
+        conn->req_expected = HAP_BLE_REQ_HDR_LEN;
+        if (len >= HAP_BLE_REQ_BODY_OFF) {
+            conn->req_expected = HAP_BLE_REQ_BODY_OFF + get_u16_le(&frag[HAP_BLE_REQ_HDR_LEN]);
+        }
+        if ((conn->req_expected > CONFIG_HAP_BLE_PDU_BUF_SIZE) || (len > conn->req_expected)) {
+            conn->req_chr = NULL;
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        memcpy(conn->req, frag, len);
+        conn->req_len = len;
+        conn->req_tid = frag[2];
+        conn->req_chr = chr;
+    }
+    if (conn->req_len == conn->req_expected) {
+        conn->req_chr = NULL;
+        hap_ble_handle_request(conn, chr);
+    }
+    return 0;
+}
+
+static int hap_ble_chr_read(hap_ble_conn_t *conn, hap_ble_char_t *chr, struct os_mbuf *om)
+{
+    uint8_t frag[BLE_ATT_ATTR_MAX_LEN];
+    int len;
+    if ((conn->rsp_chr != chr) || (conn->rsp_off >= conn->rsp_len)) {
+        /* Nothing to read */
+        return 0;
+    }
+    int frag_max = hap_ble_frag_max(conn);
+    if (frag_max > (int)sizeof(frag) - AUTH_TAG_LEN) {
+        frag_max = sizeof(frag) - AUTH_TAG_LEN;
+    }
+    if (conn->rsp_off == 0) {
+        len = conn->rsp_len < frag_max ? conn->rsp_len : frag_max;
+        memcpy(frag, conn->rsp, len);
+        conn->rsp_off = len;
+    } else {
+        int data_len = conn->rsp_len - conn->rsp_off;
+        if (data_len > frag_max - HAP_BLE_CONT_HDR_LEN) {
+            data_len = frag_max - HAP_BLE_CONT_HDR_LEN;
+        }
+        frag[0] = HAP_BLE_CTRL_CONTINUATION | HAP_BLE_CTRL_TYPE_RSP;
+        frag[1] = conn->rsp[1];
+        memcpy(frag + HAP_BLE_CONT_HDR_LEN, conn->rsp + conn->rsp_off, data_len);
+        conn->rsp_off += data_len;
+        len = HAP_BLE_CONT_HDR_LEN + data_len;
+    }
+    if (hap_ble_conn_secure(conn)) {
+        len = hap_ble_encrypt(conn->session, frag, len);
+    }
+    return (os_mbuf_append(om, frag, len) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static int hap_ble_chr_access(uint16_t conn_handle, uint16_t attr_handle,
+        struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    hap_ble_char_t *chr = (hap_ble_char_t *)arg;
+    hap_ble_conn_t *conn = &hap_ble_conn;
+    int ret = BLE_ATT_ERR_UNLIKELY;
+    xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+    if (conn->handle == conn_handle) {
+        if (hap_ble_idle_timer) {
+            esp_timer_stop(hap_ble_idle_timer);
+            esp_timer_start_once(hap_ble_idle_timer, CONFIG_HAP_BLE_IDLE_TIMEOUT_S * 1000000ULL);
+        }
+        if (ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR) {
+            ret = hap_ble_chr_write(conn, chr, ctxt->om);
+        } else if (ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR) {
+            ret = hap_ble_chr_read(conn, chr, ctxt->om);
+        }
+        if (conn->session) {
+            hap_session_touch(conn->session);
+        }
+    }
+    xSemaphoreGive(hap_ble_lock);
+    return ret;
+}
+
+static int hap_ble_iid_access(uint16_t conn_handle, uint16_t attr_handle,
+        struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    uint8_t iid[2];
+    put_u16_le(iid, *(const uint16_t *)arg);
+    return (os_mbuf_append(ctxt->om, iid, sizeof(iid)) == 0) ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+static hap_ble_char_t *hap_ble_get_char_by_handle(uint16_t val_handle)
+{
+    int i;
+    for (i = 0; i < hap_ble_num_chars; i++) {
+        if (hap_ble_chars[i].val_handle == val_handle) {
+            return &hap_ble_chars[i];
+        }
+    }
+    return NULL;
+}
+
+static void hap_ble_conn_reset(hap_ble_conn_t *conn)
+{
+    int i;
+    hap_ble_pair_ctx_free(conn);
+    if (conn->session) {
+        hap_free_session(conn->session);
+        conn->session = NULL;
+    }
+    hap_ble_tw_clear(conn);
+    for (i = 0; i < hap_ble_num_chars; i++) {
+        hap_ble_chars[i].subscribed = false;
+    }
+    conn->handle = HAP_BLE_CONN_NONE;
+    conn->gsn_bumped = false;
+    conn->req_chr = NULL;
+    conn->rsp_chr = NULL;
+}
+
+static int hap_ble_gap_event(struct ble_gap_event *event, void *arg)
+{
+    hap_ble_conn_t *conn = &hap_ble_conn;
+    switch (event->type) {
+        case BLE_GAP_EVENT_CONNECT:
+            if (event->connect.status != 0) {
+                hap_ble_adv_start();
+                break;
+            }
+            xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+            conn->handle = event->connect.conn_handle;
+            conn->mtu = BLE_ATT_MTU_DFLT;
+            xSemaphoreGive(hap_ble_lock);
+            esp_timer_start_once(hap_ble_idle_timer, CONFIG_HAP_BLE_IDLE_TIMEOUT_S * 1000000ULL);
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP-BLE controller connected");
+            break;
+        case BLE_GAP_EVENT_DISCONNECT:
+            esp_timer_stop(hap_ble_idle_timer);
+            xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+            hap_ble_conn_reset(conn);
+            xSemaphoreGive(hap_ble_lock);
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP-BLE controller disconnected");
+            hap_ble_adv_start();
+            break;
+        case BLE_GAP_EVENT_MTU:
+            xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+            if (event->mtu.conn_handle == conn->handle) {
+                conn->mtu = event->mtu.value;
+            }
+            xSemaphoreGive(hap_ble_lock);
+            break;
+        case BLE_GAP_EVENT_SUBSCRIBE: {
+            xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+            hap_ble_char_t *chr = hap_ble_get_char_by_handle(event->subscribe.attr_handle);
+            if (chr && chr->hc && (event->subscribe.conn_handle == conn->handle)) {
+                chr->subscribed = event->subscribe.cur_indicate;
+                if (hap_ble_conn_secure(conn)) {
+                    hap_char_manage_notification(chr->hc, hap_get_ctrl_session_index(conn->session),
+                            chr->subscribed);
+                }
+            }
+            xSemaphoreGive(hap_ble_lock);
+            break;
+        }
+        case BLE_GAP_EVENT_ADV_COMPLETE:
+            if (conn->handle == HAP_BLE_CONN_NONE) {
+                hap_ble_adv_start();
+            }
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static void hap_ble_adv_start(void)
+{
+    if (!hap_ble_synced) {
+        return;
+    }
+    uint8_t mfg[4 + 17];
+    put_u16_le(&mfg[0], HAP_BLE_COMPANY_ID);
+    mfg[2] = HAP_BLE_ADV_TYPE;
+    mfg[3] = HAP_BLE_ADV_STL;
+    mfg[4] = is_accessory_paired() ? 0 : HAP_BLE_ADV_SF_UNPAIRED;
+    memcpy(&mfg[5], hap_priv.raw_acc_id, sizeof(hap_priv.raw_acc_id));
+    put_u16_le(&mfg[11], hap_priv.cid);
+    hap_ble_adv_gsn = hap_priv.state_num;
+    put_u16_le(&mfg[13], hap_ble_adv_gsn);
+    /* The configuration number wraps around at 255 here, and skips 0 */
+    mfg[15] = ((hap_priv.config_num - 1) % 255) + 1;
+    mfg[16] = HAP_BLE_ADV_CV;
+    memcpy(&mfg[17], hap_priv.setup_hash, SETUP_HASH_LEN);
+
+    struct ble_hs_adv_fields fields = {0};
+    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    fields.mfg_data = mfg;
+    fields.mfg_data_len = sizeof(mfg);
+
+    /* The name goes in the scan response, shortened if need be */
+    struct ble_hs_adv_fields rsp_fields = {0};
+    const char *name = ble_svc_gap_device_name();
+    int name_len = strlen(name);
+    rsp_fields.name = (uint8_t *)name;
+    rsp_fields.name_is_complete = (name_len <= BLE_HS_ADV_MAX_FIELD_SZ);
+    rsp_fields.name_len = rsp_fields.name_is_complete ? name_len : BLE_HS_ADV_MAX_FIELD_SZ;
+
+    struct ble_gap_adv_params params = {
+        .conn_mode = BLE_GAP_CONN_MODE_UND,
+        .disc_mode = BLE_GAP_DISC_MODE_GEN,
+    };
+    int itvl_ms = hap_ble_fast_adv ? HAP_BLE_ADV_FAST_MS : CONFIG_HAP_BLE_ADV_INTERVAL_MS;
+    params.itvl_min = params.itvl_max = HAP_BLE_ADV_ITVL(itvl_ms);
+
+    if (ble_gap_adv_active()) {
+        ble_gap_adv_stop();
+    }
+    if ((ble_gap_adv_set_fields(&fields) != 0) || (ble_gap_adv_rsp_set_fields(&rsp_fields) != 0)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to set the HAP-BLE advertisement");
+        return;
+    }
+    if (ble_gap_adv_start(hap_ble_own_addr_type, NULL, BLE_HS_FOREVER, &params,
+                hap_ble_gap_event, NULL) != 0) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to start HAP-BLE advertising");
+    }
+}
+
+void hap_ble_adv_refresh(void)
+{
+    if (hap_ble_lock && (hap_ble_conn.handle == HAP_BLE_CONN_NONE)) {
+        hap_ble_adv_start();
+    }
+}
+
+static void hap_ble_fast_adv_end(void *arg)
+{
+    hap_ble_fast_adv = false;
+    if (hap_ble_conn.handle == HAP_BLE_CONN_NONE) {
+        hap_ble_adv_start();
+    }
+}
+
+static void hap_ble_idle_timeout(void *arg)
+{
+    uint16_t handle = hap_ble_conn.handle;
+    if (handle != HAP_BLE_CONN_NONE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP-BLE connection idle. Disconnecting");
+        ble_gap_terminate(handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+}
+
+/* Advertises a new GSN quickly for a while */
+static void hap_ble_gsn_advertise(void)
+{
+    hap_ble_adv_gsn = hap_priv.state_num;
+    hap_ble_fast_adv = true;
+    esp_timer_stop(hap_ble_fast_adv_timer);
+    esp_timer_start_once(hap_ble_fast_adv_timer, HAP_BLE_ADV_FAST_PERIOD_MS * 1000ULL);
+    hap_ble_adv_start();
+}
+
+void hap_ble_notify_chars(hap_char_t **chars, int cnt)
+{
+    hap_ble_conn_t *conn = &hap_ble_conn;
+    int i;
+    xSemaphoreTake(hap_ble_lock, portMAX_DELAY);
+    if (conn->handle == HAP_BLE_CONN_NONE) {
+        xSemaphoreGive(hap_ble_lock);
+        /* Once per disconnected period, like the state number of HAP over IP. With
+         * IP enabled too, the mDNS re-announcement has already taken care of it.
+         */
+        if (!(hap_priv.transport & (HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET | HAP_TRANSPORT_THREAD)) &&
+                !hap_priv.disconnected_event_sent) {
+            hap_priv.disconnected_event_sent = true;
+            hap_increment_and_save_state_num();
+        }
+        if (hap_priv.state_num != hap_ble_adv_gsn) {
+            hap_ble_gsn_advertise();
+        }
+        return;
+    }
+    bool bump = !conn->gsn_bumped;
+    conn->gsn_bumped = true;
+    int index = hap_ble_conn_secure(conn) ? hap_get_ctrl_session_index(conn->session) : -1;
+    for (i = 0; (index >= 0) && (i < cnt); i++) {
+        hap_ble_char_t *chr;
+        if (hap_char_is_ctrl_owner(chars[i], index)) {
+            ((__hap_char_t *)chars[i])->owner_ctrl = 0;
+            continue;
+        }
+        if (!hap_char_is_ctrl_subscribed(chars[i], index)) {
+            continue;
+        }
+        for (chr = hap_ble_chars; chr < hap_ble_chars + hap_ble_num_chars; chr++) {
+            if (chr->hc == chars[i]) {
+                break;
+            }
+        }
+        if (chr == hap_ble_chars + hap_ble_num_chars) {
+            continue;
+        }
+        /* HAP-BLE events carry no value, the controller reads it back */
+        struct os_mbuf *om = ble_hs_mbuf_att_pkt();
+        if (om && (ble_gatts_indicate_custom(conn->handle, chr->val_handle, om) != 0)) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "HAP-BLE indication failed for iid %d", chr->iid);
+        }
+    }
+    xSemaphoreGive(hap_ble_lock);
+    /* The GSN moves once per connection as well */
+    if (bump) {
+        hap_increment_and_save_state_num();
+    }
+}
+
+void hap_ble_send_notif(void)
+{
+    hap_char_t *chars[HAP_BLE_NOTIF_BATCH];
+    int cnt;
+    do {
+        for (cnt = 0; cnt < HAP_BLE_NOTIF_BATCH; cnt++) {
+            chars[cnt] = hap_get_pending_notif_char();
+            if (!chars[cnt]) {
+                break;
+            }
+        }
+        if (cnt) {
+            hap_ble_notify_chars(chars, cnt);
+        }
+    } while (cnt == HAP_BLE_NOTIF_BATCH);
+}
+
+/* Can be called from within a request (e.g. when the controller removes its own
+ * pairing), so this does not take hap_ble_lock. The session goes away with the
+ * disconnect event.
+ */
+void hap_ble_conn_close(int conn_identifier)
+{
+    uint16_t handle = conn_identifier - HAP_BLE_CONN_ID_BASE;
+    if (hap_ble_conn.handle == handle) {
+        ble_gap_terminate(handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+}
+
+static void hap_ble_on_sync(void)
+{
+    if (ble_hs_id_infer_auto(0, &hap_ble_own_addr_type) != 0) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No BLE address to advertise with");
+        return;
+    }
+    hap_ble_synced = true;
+    hap_ble_adv_start();
+}
+
+static void hap_ble_on_reset(int reason)
+{
+    hap_ble_synced = false;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "BLE host reset, reason %d", reason);
+}
+
+static void hap_ble_host_task(void *param)
+{
+    nimble_port_run();
+    nimble_port_freertos_deinit();
+}
+
+/* Builds the GATT database out of the primary accessory, plus the Pairing service */
+static int hap_ble_gatt_build(void)
+{
+    hap_acc_t *ha = hap_get_first_acc();
+    hap_serv_t *hs;
+    hap_char_t *hc;
+    int num_servs = 1, num_chars = 4;
+    for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+        num_servs++;
+        for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+            num_chars++;
+        }
+    }
+    hap_ble_servs = hap_platform_memory_calloc(num_servs, sizeof(*hap_ble_servs));
+    hap_ble_chars = hap_platform_memory_calloc(num_chars, sizeof(*hap_ble_chars));
+    hap_ble_gatt_svcs = hap_platform_memory_calloc(num_servs + 1, sizeof(*hap_ble_gatt_svcs));
+    /* Every service has its Service Instance ID characteristic and a terminator */
+    hap_ble_gatt_chrs = hap_platform_memory_calloc(num_chars + 2 * num_servs, sizeof(*hap_ble_gatt_chrs));
+    /* Every characteristic has its Characteristic Instance ID descriptor and a terminator */
+    hap_ble_gatt_dscs = hap_platform_memory_calloc(2 * num_chars, sizeof(*hap_ble_gatt_dscs));
+    if (!hap_ble_servs || !hap_ble_chars || !hap_ble_gatt_svcs || !hap_ble_gatt_chrs || !hap_ble_gatt_dscs) {
+        return HAP_FAIL;
+    }
+
+    struct ble_gatt_chr_def *gchr = hap_ble_gatt_chrs;
+    struct ble_gatt_dsc_def *gdsc = hap_ble_gatt_dscs;
+    hap_ble_char_t *chr = hap_ble_chars;
+    int s = 0;
+    hs = hap_acc_get_first_serv(ha);
+    for (s = 0; s < num_servs; s++) {
+        hap_ble_serv_t *serv = &hap_ble_servs[s];
+        serv->hs = hs;
+        if (hs) {
+            hap_ble_uuid_from_str(hap_serv_get_type_uuid(hs), &serv->uuid);
+            serv->iid = hap_serv_get_iid(hs);
+            serv->props = (hap_serv_get_primary(hs) ? HAP_BLE_SERV_PROP_PRIMARY : 0) |
+                    (hap_serv_get_hidden(hs) ? HAP_BLE_SERV_PROP_HIDDEN : 0);
+        } else {
+            /* The Pairing service takes the instance IDs after the accessory's own */
+            hap_ble_uuid_from_short(HAP_BLE_PAIRING_SERV_UUID, &serv->uuid);
+            serv->iid = ((__hap_acc_t *)ha)->next_iid;
+        }
+        hap_ble_gatt_svcs[s].type = BLE_GATT_SVC_TYPE_PRIMARY;
+        hap_ble_gatt_svcs[s].uuid = &serv->uuid.u;
+        hap_ble_gatt_svcs[s].characteristics = gchr;
+
+        gchr->uuid = &hap_ble_serv_iid_uuid.u;
+        gchr->access_cb = hap_ble_iid_access;
+        gchr->arg = &serv->iid;
+        gchr->flags = BLE_GATT_CHR_F_READ;
+        gchr++;
+
+        static const struct {
+            uint16_t uuid;
+            hap_ble_pair_op_t op;
+        } pairing_chars[] = {
+            { HAP_BLE_PAIR_SETUP_UUID, HAP_BLE_PAIR_SETUP },
+            { HAP_BLE_PAIR_VERIFY_UUID, HAP_BLE_PAIR_VERIFY },
+            { HAP_BLE_PAIR_FEATURES_UUID, HAP_BLE_PAIR_FEATURES },
+            { HAP_BLE_PAIRINGS_UUID, HAP_BLE_PAIRINGS },
+        };
+        int c = 0;
+        hc = hs ? hap_serv_get_first_char(hs) : NULL;
+        while (hs ? (hc != NULL) : (c < 4)) {
+            chr->serv = serv;
+            chr->hc = hc;
+            if (hc) {
+                hap_ble_uuid_from_str(hap_char_get_type_uuid(hc), &chr->uuid);
+                chr->iid = hap_char_get_iid(hc);
+            } else {
+                hap_ble_uuid_from_short(pairing_chars[c].uuid, &chr->uuid);
+                chr->iid = serv->iid + 1 + c;
+                chr->pair_op = pairing_chars[c].op;
+            }
+            gchr->uuid = &chr->uuid.u;
+            gchr->access_cb = hap_ble_chr_access;
+            gchr->arg = chr;
+            gchr->flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE;
+            if (hc && (hap_char_get_perm(hc) & HAP_CHAR_PERM_EV)) {
+                gchr->flags |= BLE_GATT_CHR_F_INDICATE;
+            }
+            gchr->val_handle = &chr->val_handle;
+            gchr->descriptors = gdsc;
+            gdsc->uuid = &hap_ble_char_iid_uuid.u;
+            gdsc->att_flags = BLE_ATT_F_READ;
+            gdsc->access_cb = hap_ble_iid_access;
+            gdsc->arg = &chr->iid;
+            gdsc += 2;
+            gchr++;
+            chr++;
+            c++;
+            hc = hc ? hap_char_get_next(hc) : NULL;
+        }
+        /* Terminator */
+        gchr++;
+        hs = hs ? hap_serv_get_next(hs) : NULL;
+    }
+    hap_ble_num_chars = chr - hap_ble_chars;
+    return HAP_SUCCESS;
+}
+
+int hap_ble_start(void)
+{
+    if (hap_ble_lock) {
+        return HAP_SUCCESS;
+    }
+    hap_ble_lock = xSemaphoreCreateMutex();
+    hap_ble_conn.req = hap_platform_memory_malloc_caps(CONFIG_HAP_BLE_PDU_BUF_SIZE, HAP_MEM_CAPS_BULK);
+    hap_ble_conn.rsp = hap_platform_memory_malloc_caps(CONFIG_HAP_BLE_PDU_BUF_SIZE, HAP_MEM_CAPS_BULK);
+    if (!hap_ble_lock || !hap_ble_conn.req || !hap_ble_conn.rsp || (hap_ble_gatt_build() != HAP_SUCCESS)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate the HAP-BLE database");
+        return HAP_FAIL;
+    }
+    esp_timer_create_args_t fast_adv_args = {
+        .callback = hap_ble_fast_adv_end,
+        .name = "hap_ble_adv",
+    };
+    esp_timer_create_args_t idle_args = {
+        .callback = hap_ble_idle_timeout,
+        .name = "hap_ble_idle",
+    };
+    if ((esp_timer_create(&fast_adv_args, &hap_ble_fast_adv_timer) != ESP_OK) ||
+            (esp_timer_create(&idle_args, &hap_ble_idle_timer) != ESP_OK)) {
+        return HAP_FAIL;
+    }
+
+    if (nimble_port_init() != ESP_OK) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "NimBLE init failed");
+        return HAP_FAIL;
+    }
+    ble_hs_cfg.sync_cb = hap_ble_on_sync;
+    ble_hs_cfg.reset_cb = hap_ble_on_reset;
+    ble_svc_gap_init();
+    ble_svc_gatt_init();
+    ble_svc_gap_device_name_set(hap_priv.primary_acc.name);
+    if ((ble_gatts_count_cfg(hap_ble_gatt_svcs) != 0) || (ble_gatts_add_svcs(hap_ble_gatt_svcs) != 0)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to register the HAP-BLE GATT database");
+        return HAP_FAIL;
+    }
+    nimble_port_freertos_init(hap_ble_host_task);
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP-BLE started with %d characteristics", hap_ble_num_chars);
+    return HAP_SUCCESS;
+}
+
+void hap_ble_stop(void)
+{
+    if (!hap_ble_lock) {
+        return;
+    }
+    if (hap_ble_conn.handle != HAP_BLE_CONN_NONE) {
+        ble_gap_terminate(hap_ble_conn.handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+    ble_gap_adv_stop();
+    hap_ble_synced = false;
+    nimble_port_stop();
+    nimble_port_deinit();
+    esp_timer_delete(hap_ble_fast_adv_timer);
+    esp_timer_delete(hap_ble_idle_timer);
+    hap_ble_fast_adv_timer = NULL;
+    hap_ble_idle_timer = NULL;
+    hap_ble_conn_reset(&hap_ble_conn);
+    hap_platform_memory_free(hap_ble_conn.req);
+    hap_platform_memory_free(hap_ble_conn.rsp);
+    hap_platform_memory_free(hap_ble_servs);
+    hap_platform_memory_free(hap_ble_chars);
+    hap_platform_memory_free(hap_ble_gatt_svcs);
+    hap_platform_memory_free(hap_ble_gatt_chrs);
+    hap_platform_memory_free(hap_ble_gatt_dscs);
+    hap_ble_conn.req = hap_ble_conn.rsp = NULL;
+    hap_ble_servs = NULL;
+    hap_ble_chars = NULL;
+    hap_ble_num_chars = 0;
+    vSemaphoreDelete(hap_ble_lock);
+    hap_ble_lock = NULL;
+}
+
+#endif /* CONFIG_HAP_BLE_ENABLE */
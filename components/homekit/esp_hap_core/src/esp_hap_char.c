@@ -23,8 +23,14 @@
  */
 
 #include <hap_platform_memory.h>
+#include <esp_hap_db_arena.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <esp_timer.h>
+#include <esp_memory_utils.h>
+#include <esp_rom_crc.h>
+#include <hap_platform_trace.h>
 #include "esp_mfi_debug.h"
 
 #include <esp_hap_main.h>
@@ -33,7 +39,27 @@
 #include <esp_hap_ip_services.h>
 #include <esp_hap_database.h>
 
-static QueueHandle_t hap_event_queue;
+/* Characteristics waiting to be notified, in the order they first changed.
+ * A characteristic is in here at most once, so this can never overflow, and
+ * whatever value it has by the time notifications go out is the one sent.
+ */
+static hap_char_t *hap_pending_head;
+static hap_char_t *hap_pending_tail;
+static portMUX_TYPE hap_pending_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool hap_event_queue_ready;
+
+/* Timer holding back notifications for the coalescing window */
+static esp_timer_handle_t hap_coalesce_timer;
+
+/* Characteristics holding back a change, for their minimum notification interval
+ * or a write merge window, and the timer releasing them, armed for the earliest
+ * one. Under hap_pending_lock
+ */
+static hap_char_t *hap_held_head;
+static esp_timer_handle_t hap_rate_timer;
+static int64_t hap_rate_timer_due;
+
+static int hap_rate_timer_create();
 
 /**
  * @brief get characteristics's value
@@ -48,137 +74,519 @@ hap_val_t *esp_mfi_characteristics_get_value(__hap_char_t *_hc)
  */
 bool hap_char_has_permission(__hap_char_t *_hc, uint16_t permission)
 {
-    return _hc->permission & permission ? true : false;
+    return _hc->desc->permission & permission ? true : false;
 }
 
-/**
- * @brief compute the mod of a and b: a % b
- */
-static double esp_mfi_fmod(double a, double b)
+static void hap_coalesce_timer_cb(void *arg)
 {
-    if (a < 1e-06 || b < 1e-06)
-        return 0;
-
-    while (!((long long)a) || !((long long)b)) {
-        a *= 10.0;
-        b *= 10.0;
-    }
-
-    return fmod(a, b);
+    hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
 }
 
 int hap_event_queue_init()
 {
-    hap_event_queue = xQueueCreate( hap_priv.cfg.max_event_notif_chars,
-                    sizeof(hap_char_t *) );
-    if (hap_event_queue) {
-        return HAP_SUCCESS;
-    } else {
+    if (hap_priv.cfg.notif_coalesce_ms && !hap_coalesce_timer) {
+        esp_timer_create_args_t timer_args = {
+            .callback = hap_coalesce_timer_cb,
+            .arg = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "hap_coalesce",
+        };
+        if (esp_timer_create(&timer_args, &hap_coalesce_timer) != ESP_OK) {
+            return HAP_FAIL;
+        }
+    }
+    if (hap_priv.cfg.write_merge_ms && (hap_rate_timer_create() != HAP_SUCCESS)) {
         return HAP_FAIL;
     }
+    hap_pending_head = hap_pending_tail = NULL;
+    hap_event_queue_ready = true;
+    return HAP_SUCCESS;
 }
 
 int hap_event_queue_deinit()
 {
-    if (hap_event_queue) {
-        vQueueDelete(hap_event_queue);
-        hap_event_queue = NULL;
+    hap_event_queue_ready = false;
+    if (hap_rate_timer) {
+        esp_timer_stop(hap_rate_timer);
+    }
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    while (hap_held_head) {
+        __hap_char_t *_hc = (__hap_char_t *)hap_held_head;
+        hap_held_head = _hc->next_held;
+        _hc->next_held = NULL;
+        _hc->held = false;
     }
+    hap_rate_timer_due = 0;
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (hap_coalesce_timer) {
+        esp_timer_stop(hap_coalesce_timer);
+        esp_timer_delete(hap_coalesce_timer);
+        hap_coalesce_timer = NULL;
+    }
+    while (hap_get_pending_notif_char())
+        ;
     return HAP_SUCCESS;
 }
 
 hap_char_t * hap_get_pending_notif_char()
 {
-    hap_char_t *hc;
-    if (xQueueReceive(hap_event_queue, &hc, 0) != pdTRUE) {
-        return NULL;
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_char_t *hc = hap_pending_head;
+    if (hc) {
+        __hap_char_t *_hc = (__hap_char_t *)hc;
+        hap_pending_head = _hc->next_pending;
+        if (!hap_pending_head) {
+            hap_pending_tail = NULL;
+        }
+        _hc->next_pending = NULL;
+        _hc->notif_pending = false;
     }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
     return hc;
 }
 
-static int hap_queue_event(hap_char_t *hc)
+static void hap_remove_pending_notif_char(hap_char_t *hc)
 {
-    int ret;
-    if (!hap_event_queue) {
-        return HAP_FAIL;
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_char_t *prev = NULL;
+    hap_char_t *cur = hap_pending_head;
+    while (cur && cur != hc) {
+        prev = cur;
+        cur = ((__hap_char_t *)cur)->next_pending;
     }
-    if (xPortInIsrContext() == pdTRUE) {
-        ret = xQueueSendFromISR(hap_event_queue, &hc, NULL);
-    } else {
-        ret = xQueueSend(hap_event_queue, &hc, 0);
+    if (cur) {
+        hap_char_t *next = ((__hap_char_t *)cur)->next_pending;
+        if (prev) {
+            ((__hap_char_t *)prev)->next_pending = next;
+        } else {
+            hap_pending_head = next;
+        }
+        if (hap_pending_tail == cur) {
+            hap_pending_tail = prev;
+        }
+        ((__hap_char_t *)cur)->notif_pending = false;
     }
-    if (ret == pdTRUE) {
-        hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
-        return HAP_SUCCESS;
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+}
+
+/* Records a release due at the given time, unless the timer already fires earlier.
+ * Called with hap_pending_lock held. Returns true if the timer has to be (re)started,
+ * which hap_rate_timer_start() then does outside of the lock.
+ */
+static bool hap_rate_timer_set_due(int64_t due)
+{
+    if (hap_rate_timer_due && (hap_rate_timer_due <= due)) {
+        return false;
     }
-    return HAP_FAIL;
+    hap_rate_timer_due = due;
+    return true;
 }
 
+static void hap_rate_timer_start(int64_t due, int64_t now)
+{
+    esp_timer_stop(hap_rate_timer);
+    esp_timer_start_once(hap_rate_timer, (due > now) ? (due - now) : 1);
+}
 
-/**
- * @brief check if characteristics value is at the range
+/* Holds back the notification of a characteristic until the given time, or later
+ * if it is already held for longer. Called with hap_pending_lock held, returns
+ * true if the timer has to be started as per hap_rate_timer_set_due().
  */
-int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val)
+static bool hap_char_hold(__hap_char_t *_hc, int64_t until)
 {
-    if (!_hc->constraint_flags)
+    if (!_hc->held) {
+        _hc->held = true;
+        _hc->held_until = until;
+        _hc->next_held = hap_held_head;
+        hap_held_head = (hap_char_t *)_hc;
+    } else if (_hc->held_until < until) {
+        _hc->held_until = until;
+    }
+    return hap_rate_timer_set_due(_hc->held_until);
+}
+
+/* Checks a change against the minimum interval of the characteristic. If it can be
+ * notified now, that is recorded as the last notification. Otherwise, with
+ * latest_only, the characteristic is held back until the interval ends.
+ */
+static bool hap_char_rate_allows(__hap_char_t *_hc)
+{
+    hap_char_notif_rate_t *rate = _hc->rate;
+    int64_t now = esp_timer_get_time();
+    int64_t due = rate->last_notif_us + rate->policy.min_interval_ms * 1000LL;
+    bool allowed = false;
+    bool start_timer = false;
+
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    if (!rate->policy.min_interval_ms || !rate->last_notif_us || (now >= due)) {
+        rate->last_notif_us = now;
+        rate->last_val = _hc->val;
+        allowed = true;
+    } else if (rate->policy.latest_only) {
+        start_timer = hap_char_hold(_hc, due);
+    }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (start_timer) {
+        hap_rate_timer_start(due, now);
+    }
+    return allowed;
+}
+
+static int hap_queue_event(hap_char_t *hc);
+
+/* Queues the held characteristics whose time has come, and re-arms the timer
+ * for the rest
+ */
+static void hap_rate_timer_cb(void *arg)
+{
+    hap_char_t *due_list = NULL;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_rate_timer_due = 0;
+    hap_char_t **link = &hap_held_head;
+    int64_t next_due = 0;
+    while (*link) {
+        __hap_char_t *_hc = (__hap_char_t *)*link;
+        if (_hc->held_until <= now) {
+            *link = _hc->next_held;
+            _hc->held = false;
+            _hc->next_held = due_list;
+            due_list = (hap_char_t *)_hc;
+        } else {
+            if (!next_due || (_hc->held_until < next_due)) {
+                next_due = _hc->held_until;
+            }
+            link = &_hc->next_held;
+        }
+    }
+    bool start_timer = next_due && hap_rate_timer_set_due(next_due);
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (start_timer) {
+        hap_rate_timer_start(next_due, now);
+    }
+
+    while (due_list) {
+        hap_char_t *hc = due_list;
+        due_list = ((__hap_char_t *)hc)->next_held;
+        ((__hap_char_t *)hc)->next_held = NULL;
+        hap_queue_event(hc);
+    }
+}
+
+static int hap_rate_timer_create()
+{
+    if (hap_rate_timer) {
         return HAP_SUCCESS;
+    }
+    esp_timer_create_args_t timer_args = {
+        .callback = hap_rate_timer_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "hap_notif_rate",
+    };
+    if (esp_timer_create(&timer_args, &hap_rate_timer) != ESP_OK) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to create the notification rate timer");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
 
-    if (_hc->format == HAP_CHAR_FORMAT_INT) {
-        int value = val->i;
-        int remainder;
+/* Holds back the notification while the last controller write is being merged with
+ * any that follow it
+ */
+static bool hap_char_merge_holds(__hap_char_t *_hc)
+{
+    int64_t now = esp_timer_get_time();
+    bool holds = false;
+    bool start_timer = false;
+
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    if (_hc->merge_until > now) {
+        start_timer = hap_char_hold(_hc, _hc->merge_until);
+        holds = true;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    if (start_timer) {
+        hap_rate_timer_start(_hc->held_until, now);
+    }
+    return holds;
+}
 
-        if (value > _hc->max.i
-            || value < _hc->min.i)
-            return HAP_FAIL;
+/* Called for every controller write, before the service write routine runs. The
+ * writer becomes the owner, so that it is the only controller not notified, and the
+ * merge window starts over. With several controllers writing within the window,
+ * the last one wins, and the others hear about its value once the window ends.
+ */
+void hap_char_note_write(hap_char_t *hc, int index)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    hap_char_set_owner_ctrl(hc, index);
+    if (hap_priv.cfg.write_merge_ms && hap_rate_timer) {
+        _hc->merge_until = esp_timer_get_time() + hap_priv.cfg.write_merge_ms * 1000LL;
+    }
+}
 
-        if (!_hc->step.i)
-            return HAP_SUCCESS;
+static void hap_remove_held_char(hap_char_t *hc)
+{
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    hap_char_t **link = &hap_held_head;
+    while (*link && (*link != hc)) {
+        link = &((__hap_char_t *)*link)->next_held;
+    }
+    if (*link) {
+        *link = ((__hap_char_t *)hc)->next_held;
+        ((__hap_char_t *)hc)->next_held = NULL;
+        ((__hap_char_t *)hc)->held = false;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+}
 
-        remainder = (value - _hc->min.i) % _hc->step.i;
-        if (remainder)
-            return HAP_FAIL;
-    } else if (_hc->format == HAP_CHAR_FORMAT_FLOAT) {
-        float value = val->f;
+/* Whether the value is within the deadband of the last notified one */
+static bool hap_char_in_deadband(__hap_char_t *_hc)
+{
+    hap_char_notif_rate_t *rate = _hc->rate;
+    if (!rate || (rate->policy.deadband <= 0.0f) || !rate->last_notif_us) {
+        return false;
+    }
+    double diff;
+    switch (_hc->desc->format) {
+        case HAP_CHAR_FORMAT_FLOAT:
+            diff = (double)_hc->val.f - rate->last_val.f;
+            break;
+        case HAP_CHAR_FORMAT_INT:
+            diff = (double)_hc->val.i - rate->last_val.i;
+            break;
+        case HAP_CHAR_FORMAT_UINT8:
+        case HAP_CHAR_FORMAT_UINT16:
+        case HAP_CHAR_FORMAT_UINT32:
+            diff = (double)_hc->val.u - rate->last_val.u;
+            break;
+        case HAP_CHAR_FORMAT_UINT64:
+            diff = (double)_hc->val.i64 - (double)rate->last_val.i64;
+            break;
+        default:
+            return false;
+    }
+    return fabs(diff) < rate->policy.deadband;
+}
 
-        if (value > _hc->max.f
-            || value < _hc->min.f)
+int hap_char_set_notif_policy(hap_char_t *hc, const hap_char_notif_policy_t *policy)
+{
+    if (!hc) {
+        return HAP_FAIL;
+    }
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    if (!policy) {
+        /* A change held back meanwhile still goes out when due */
+        hap_platform_memory_free(_hc->rate);
+        _hc->rate = NULL;
+        return HAP_SUCCESS;
+    }
+    if (policy->latest_only && policy->min_interval_ms && (hap_rate_timer_create() != HAP_SUCCESS)) {
+        return HAP_FAIL;
+    }
+    if (!_hc->rate) {
+        _hc->rate = hap_platform_memory_calloc(1, sizeof(hap_char_notif_rate_t));
+        if (!_hc->rate) {
             return HAP_FAIL;
-# if 0
-        /* Check for step value for floats has a high chance of failure,
-         * because of precision issues. Hence, better to skip it.
-         */
-        double remainder;
-        if (_hc->step.f == 0.0)
-            return HAP_SUCCESS;
+        }
+    }
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    _hc->rate->policy = *policy;
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+    return HAP_SUCCESS;
+}
 
-        remainder = esp_mfi_fmod(value - _hc->min.f, _hc->step.f);
-        if (remainder != 0.0)
-            return HAP_FAIL;
+static int hap_queue_event(hap_char_t *hc)
+{
+    __hap_char_t *_hc = (__hap_char_t *)hc;
+    HAP_TRACE_MARK(HAP_TRACE_QUEUE_EVENT, _hc->iid);
+    if (!hap_event_queue_ready) {
+        return HAP_FAIL;
+    }
+    /* Controller writes still being merged, the final value goes out later */
+    if (_hc->merge_until && !_hc->notif_pending && hap_char_merge_holds(_hc)) {
+        return HAP_SUCCESS;
+    }
+    /* Over the rate limit, the change is either dropped or held back for later */
+    if (_hc->rate && !_hc->notif_pending && !hap_char_rate_allows(_hc)) {
+        return HAP_SUCCESS;
+    }
+
+    portENTER_CRITICAL_SAFE(&hap_pending_lock);
+    bool newly_pending = !_hc->notif_pending;
+    if (newly_pending) {
+        _hc->notif_pending = true;
+        _hc->next_pending = NULL;
+        if (hap_pending_tail) {
+            ((__hap_char_t *)hap_pending_tail)->next_pending = hc;
+        } else {
+            hap_pending_head = hc;
+        }
+        hap_pending_tail = hc;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_pending_lock);
+
+    /* Already waiting, the latest value goes out when it gets notified */
+    if (!newly_pending) {
+        return HAP_SUCCESS;
+    }
+
+    if (hap_coalesce_timer) {
+        /* Only the first change starts the window, later ones ride along */
+        esp_timer_start_once(hap_coalesce_timer, hap_priv.cfg.notif_coalesce_ms * 1000ULL);
+    } else {
+        hap_send_event(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
+    }
+    return HAP_SUCCESS;
+}
+
+
+#ifdef CONFIG_HAP_CHAR_FLOAT_STEP_TOLERANCE
+#define HAP_CHAR_FLOAT_STEP_TOLERANCE   (CONFIG_HAP_CHAR_FLOAT_STEP_TOLERANCE / 100.0f)
+#else
+#define HAP_CHAR_FLOAT_STEP_TOLERANCE   0.01f
 #endif
-    } else if (_hc->format == HAP_CHAR_FORMAT_UINT8
-               || _hc->format == HAP_CHAR_FORMAT_UINT16
-               || _hc->format == HAP_CHAR_FORMAT_UINT32) {
-        uint32_t value = val->u;
-        uint32_t remainder;
 
+/* Validators, picked when the constraints are set, so that a value check
+ * does not have to look at the format and flags every time
+ */
+static int hap_char_validate_int_range(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->i > _hc->desc->max.i || val->i < _hc->desc->min.i)
+        return HAP_FAIL;
+    return HAP_SUCCESS;
+}
 
-        if (value > _hc->max.u
-            || value < _hc->min.u)
-            return HAP_FAIL;
+static int hap_char_validate_int_step(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->i > _hc->desc->max.i || val->i < _hc->desc->min.i)
+        return HAP_FAIL;
+    /* value >= min here, so the difference fits in an unsigned */
+    uint32_t diff = (uint32_t)val->i - (uint32_t)_hc->desc->min.i;
+    uint32_t remainder = _hc->step_mask ? (diff & _hc->step_mask) : (diff % (uint32_t)abs(_hc->desc->step.i));
+    return remainder ? HAP_FAIL : HAP_SUCCESS;
+}
 
-        if (!_hc->step.u)
-            return HAP_SUCCESS;
+static int hap_char_validate_uint_range(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->u > _hc->desc->max.u || val->u < _hc->desc->min.u)
+        return HAP_FAIL;
+    return HAP_SUCCESS;
+}
 
-        remainder = (value - _hc->min.u) % _hc->step.u;
-        if (remainder)
-            return HAP_FAIL;
-    } else if (_hc->format == HAP_CHAR_FORMAT_UINT64) {
-        /* TODO: Add support. Currently, there is no particular 64-bit characteristic */
-    }
+static int hap_char_validate_uint_step(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->u > _hc->desc->max.u || val->u < _hc->desc->min.u)
+        return HAP_FAIL;
+    uint32_t diff = val->u - _hc->desc->min.u;
+    uint32_t remainder = _hc->step_mask ? (diff & _hc->step_mask) : (diff % _hc->desc->step.u);
+    return remainder ? HAP_FAIL : HAP_SUCCESS;
+}
 
+static int hap_char_validate_float_range(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->f > _hc->desc->max.f || val->f < _hc->desc->min.f)
+        return HAP_FAIL;
     return HAP_SUCCESS;
 }
 
+static int hap_char_validate_float_step(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (val->f > _hc->desc->max.f || val->f < _hc->desc->min.f)
+        return HAP_FAIL;
+    /* Number of steps from the minimum. A value is accepted if it is within
+     * the tolerance (a fraction of the step) of a whole number of steps, which
+     * absorbs the rounding of values like 0.1 that cannot be exact in a float.
+     */
+    float steps = (val->f - _hc->desc->min.f) * _hc->step_inv;
+    if (fabsf(steps - roundf(steps)) > HAP_CHAR_FLOAT_STEP_TOLERANCE)
+        return HAP_FAIL;
+    return HAP_SUCCESS;
+}
+
+static void hap_char_set_validator(__hap_char_t *_hc)
+{
+    bool has_step = _hc->desc->constraint_flags & HAP_CHAR_STEP_FLAG;
+    _hc->step_mask = 0;
+    switch (_hc->desc->format) {
+        case HAP_CHAR_FORMAT_INT:
+        case HAP_CHAR_FORMAT_UINT8:
+        case HAP_CHAR_FORMAT_UINT16:
+        case HAP_CHAR_FORMAT_UINT32: {
+            bool is_signed = (_hc->desc->format == HAP_CHAR_FORMAT_INT);
+            uint32_t step = is_signed ? (uint32_t)abs(_hc->desc->step.i) : _hc->desc->step.u;
+            /* A step of 1 is the same as no step */
+            if (!has_step || step <= 1) {
+                _hc->validate = is_signed ? hap_char_validate_int_range : hap_char_validate_uint_range;
+                break;
+            }
+            if (!(step & (step - 1))) {
+                _hc->step_mask = step - 1;
+            }
+            _hc->validate = is_signed ? hap_char_validate_int_step : hap_char_validate_uint_step;
+            break;
+        }
+        case HAP_CHAR_FORMAT_FLOAT:
+            if (has_step && _hc->desc->step.f > 0.0f) {
+                _hc->step_inv = 1.0f / _hc->desc->step.f;
+                _hc->validate = hap_char_validate_float_step;
+            } else {
+                _hc->validate = hap_char_validate_float_range;
+            }
+            break;
+        default:
+            /* TODO: Add support for UINT64. Currently, there is no particular 64-bit characteristic */
+            _hc->validate = NULL;
+            break;
+    }
+}
+
+/**
+ * @brief check if characteristics value is at the range
+ */
+int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (!_hc->validate)
+        return HAP_SUCCESS;
+    return _hc->validate(_hc, val);
+}
+
+/**
+ * @brief snap a float value to the step of a quantized characteristic
+ */
+void hap_char_quantize_val(__hap_char_t *_hc, hap_val_t *val)
+{
+    if (!_hc->quantize || _hc->validate != hap_char_validate_float_step)
+        return;
+    /* Out of range values are left for the validator to reject */
+    if (val->f > _hc->desc->max.f || val->f < _hc->desc->min.f)
+        return;
+    float steps = (val->f - _hc->desc->min.f) * _hc->step_inv;
+    float n = roundf(steps);
+    if (_hc->quant_hyst > 0.0f) {
+        /* Stay on the current step while within the hysteresis band around it */
+        float cur = roundf((_hc->val.f - _hc->desc->min.f) * _hc->step_inv);
+        if (n != cur && fabsf(steps - cur) < (0.5f + _hc->quant_hyst))
+            n = cur;
+    }
+    float last = floorf((_hc->desc->max.f - _hc->desc->min.f) * _hc->step_inv + HAP_CHAR_FLOAT_STEP_TOLERANCE);
+    if (n > last)
+        n = last;
+    if (n < 0.0f)
+        n = 0.0f;
+    val->f = _hc->desc->min.f + n * _hc->desc->step.f;
+}
+
+static uint32_t hap_char_data_crc(const hap_data_val_t *d)
+{
+    if (!d->buf || !d->buflen) {
+        return 0;
+    }
+    return esp_rom_crc32_le(0, d->buf, d->buflen);
+}
+
 /**
  * @brief user update characteristics value, preparing for notification
  */
@@ -189,6 +597,7 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
     }
     __hap_char_t *_hc = (__hap_char_t *)hc;
     _hc->update_called = true;
+    hap_char_quantize_val(_hc, val);
     if (hap_char_check_val_constraints(_hc, val) != HAP_SUCCESS) {
         return HAP_FAIL;
     }
@@ -199,7 +608,7 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
 	 */
 	bool value_changed = false;
 
-	switch (_hc->format) {
+	switch (_hc->desc->format) {
 		case HAP_CHAR_FORMAT_BOOL:
 			if (_hc->val.b != val->b) {
 				_hc->val.b = val->b;
@@ -222,41 +631,41 @@ int hap_char_update_val(hap_char_t *hc, hap_val_t *val)
 			}
 			break;
 		case HAP_CHAR_FORMAT_STRING:
-			/* Not checking all combinations to find if value has changed,
-			 * since generally we do not expect dynamic string values
-			 *
-			 * Eg.
-			 * Both (old and new) values being NULL
-			 * Old value NULL, New non-NULL
-			 * Old value non-NULL, new NULL
-			 */
-			if (_hc->val.s && val->s && !strcmp(_hc->val.s, val->s))
+			if (_hc->val.s == val->s)
+				value_changed = false;
+			else if (_hc->val.s && val->s && !strcmp(_hc->val.s, val->s))
 				value_changed = false;
 			else
 				value_changed = true;
 
-			if (_hc->val.s) {
-				hap_platform_memory_free(_hc->val.s);
-                _hc->val.s = NULL;
-            }
-
-			if (val->s) {
-				_hc->val.s = strdup(val->s);
-				if (!_hc->val.s)
-					return HAP_FAIL;
-			}
+			/* An unchanged value is not stored again, and a changed one goes
+			 * into the existing buffer if it fits
+			 */
+			if (value_changed && (hap_char_set_str(_hc, val->s, false) != HAP_SUCCESS))
+				return HAP_FAIL;
 			break;
         case HAP_CHAR_FORMAT_DATA:
         case HAP_CHAR_FORMAT_TLV8: {
+            /* The buffer belongs to the application, which may well have rewritten
+             * it in place, so the new contents are compared with a CRC of the old ones
+             */
+            uint32_t crc = hap_char_data_crc(&val->d);
+            if ((_hc->val.d.buflen != val->d.buflen) || (_hc->data_crc != crc)
+                    || (!_hc->val.d.buf != !val->d.buf)) {
+                value_changed = true;
+            }
             _hc->val.d.buf = val->d.buf;
             _hc->val.d.buflen = val->d.buflen;
-            value_changed = true;
+            _hc->data_crc = crc;
             }
             break;
 		default:
 			break;
 	}
-	if (value_changed || (_hc->permission & HAP_CHAR_PERM_SPECIAL_READ)) {
+	/* Too small a change to be worth notifying, as per the rate policy */
+	if (value_changed && hap_char_in_deadband(_hc))
+		value_changed = false;
+	if (value_changed || (_hc->desc->permission & HAP_CHAR_PERM_SPECIAL_READ)) {
 		ESP_MFI_DEBUG_INTR(ESP_MFI_DEBUG_INFO, "Value Changed");
         hap_queue_event(hc);
 	} else {
@@ -283,8 +692,8 @@ const hap_val_t *hap_char_get_val(hap_char_t *hc)
 const hap_val_t *hap_char_get_min_val(hap_char_t *hc)
 {
     if (hc) {
-        if(((__hap_char_t *)hc)->constraint_flags & HAP_CHAR_MIN_FLAG) {
-            return &((__hap_char_t *)hc)->min;
+        if(((__hap_char_t *)hc)->desc->constraint_flags & HAP_CHAR_MIN_FLAG) {
+            return &((__hap_char_t *)hc)->desc->min;
         }
     }
     return NULL;
@@ -296,8 +705,8 @@ const hap_val_t *hap_char_get_min_val(hap_char_t *hc)
 const hap_val_t *hap_char_get_max_val(hap_char_t *hc)
 {
     if (hc) {
-        if(((__hap_char_t *)hc)->constraint_flags & HAP_CHAR_MAX_FLAG || ((__hap_char_t *)hc)->constraint_flags & HAP_CHAR_MAXLEN_FLAG) {
-            return &((__hap_char_t *)hc)->max;
+        if(((__hap_char_t *)hc)->desc->constraint_flags & HAP_CHAR_MAX_FLAG || ((__hap_char_t *)hc)->desc->constraint_flags & HAP_CHAR_MAXLEN_FLAG) {
+            return &((__hap_char_t *)hc)->desc->max;
         }
     }
     return NULL;
@@ -309,40 +718,193 @@ const hap_val_t *hap_char_get_max_val(hap_char_t *hc)
 const hap_val_t *hap_char_get_step_val(hap_char_t *hc)
 {
     if (hc) {
-        if (((__hap_char_t *)hc)->constraint_flags & HAP_CHAR_STEP_FLAG) {
-            return &((__hap_char_t *)hc)->step;
+        if (((__hap_char_t *)hc)->desc->constraint_flags & HAP_CHAR_STEP_FLAG) {
+            return &((__hap_char_t *)hc)->desc->step;
         }
     }
     return NULL;
 }
 
-/**
- * @brief HAP create a characteristics
+/* Parses up to max_len hex digits. Returns the number of digits parsed */
+static int hap_uuid_parse_hex(const char *str, int max_len, uint32_t *val)
+{
+    int i;
+    *val = 0;
+    for (i = 0; i < max_len; i++) {
+        char c = str[i];
+        if (c >= '0' && c <= '9') {
+            c -= '0';
+        } else if (c >= 'A' && c <= 'F') {
+            c -= 'A' - 10;
+        } else if (c >= 'a' && c <= 'f') {
+            c -= 'a' - 10;
+        } else {
+            break;
+        }
+        *val = (*val << 4) | c;
+    }
+    return i;
+}
+
+uint16_t hap_uuid_get_short_id(const char *uuid)
+{
+    if (!uuid) {
+        return HAP_UUID_FULL;
+    }
+    uint32_t id;
+    int len = hap_uuid_parse_hex(uuid, 8, &id);
+    if (len == 0) {
+        return HAP_UUID_FULL;
+    }
+    if (uuid[len] != '\0') {
+        /* Full form. Only the Apple base UUID has a short form */
+        if ((len != 8) || strcasecmp(&uuid[len], "-0000-1000-8000-0026BB765291")) {
+            return HAP_UUID_FULL;
+        }
+    }
+    if (id > UINT16_MAX) {
+        return HAP_UUID_FULL;
+    }
+    return (uint16_t)id;
+}
+
+/* String storage granularity. The database arena rounds allocations up to 8 bytes
+ * anyway, and the extra room lets slightly longer values be stored in place.
  */
-static hap_char_t *hap_char_create(char *type_uuid, uint32_t permission, hap_char_format_t format, hap_val_t val)
+#define HAP_CHAR_STR_ALIGN  8
+
+static void hap_char_free_str(__hap_char_t *_hc)
 {
-    __hap_char_t *new_ch;
+    if (!(_hc->desc_flags & HAP_CHAR_STR_STATIC)) {
+        hap_db_free(_hc->val.s);
+    }
+    _hc->val.s = NULL;
+    _hc->str_cap = 0;
+    _hc->desc_flags &= ~HAP_CHAR_STR_STATIC;
+}
 
-    ESP_MFI_ASSERT(type_uuid);
+/* Stores a string value. Strings in flash (and, with is_static, any string the caller
+ * keeps alive) are just pointed at. Others are copied into the characteristic's own
+ * buffer, which is reused for as long as the new values fit in it.
+ */
+int hap_char_set_str(__hap_char_t *_hc, const char *s, bool is_static)
+{
+    if (!s) {
+        hap_char_free_str(_hc);
+        return HAP_SUCCESS;
+    }
+    if (is_static || esp_ptr_in_drom(s)) {
+        hap_char_free_str(_hc);
+        _hc->val.s = (char *)s;
+        _hc->desc_flags |= HAP_CHAR_STR_STATIC;
+        return HAP_SUCCESS;
+    }
+    size_t len = strlen(s);
+    if (_hc->val.s && !(_hc->desc_flags & HAP_CHAR_STR_STATIC) && (len <= _hc->str_cap)) {
+        memmove(_hc->val.s, s, len + 1);
+        return HAP_SUCCESS;
+    }
+    size_t size = (len + HAP_CHAR_STR_ALIGN) & ~(size_t)(HAP_CHAR_STR_ALIGN - 1);
+    char *str = hap_db_calloc(1, size);
+    if (!str) {
+        return HAP_FAIL;
+    }
+    memcpy(str, s, len + 1);
+    hap_char_free_str(_hc);
+    _hc->val.s = str;
+    _hc->str_cap = size - 1;
+    return HAP_SUCCESS;
+}
 
-    if (HAP_CHAR_FORMAT_STRING == format && val.s) {
+/* Characteristic on top of a descriptor. With HAP_CHAR_DESC_OWNED in desc_flags,
+ * the descriptor gets freed along with the characteristic. A string value is
+ * stored as per hap_char_set_str()
+ */
+static hap_char_t *hap_char_create_with_desc(const hap_char_desc_t *desc, uint8_t desc_flags,
+        hap_val_t val, bool str_static)
+{
+    __hap_char_t *new_ch;
+
+    if (HAP_CHAR_FORMAT_STRING == desc->format && val.s) {
         if (strlen(val.s) > HAP_CHAR_STRING_MAX_LEN)
             return NULL;
     }
 
-    new_ch = hap_platform_memory_calloc(1, sizeof(__hap_char_t));
+    new_ch = hap_db_calloc(1, sizeof(__hap_char_t));
     if (!new_ch) {
         return NULL;
     }
 
-    new_ch->val = val;
-    new_ch->type_uuid = type_uuid;
-    new_ch->format = format;
-    new_ch->permission = permission;
+    new_ch->desc = desc;
+    new_ch->desc_flags = desc_flags;
+    if (HAP_CHAR_FORMAT_STRING == desc->format) {
+        if (hap_char_set_str(new_ch, val.s, str_static) != HAP_SUCCESS) {
+            hap_db_free(new_ch);
+            return NULL;
+        }
+    } else {
+        new_ch->val = val;
+        if ((HAP_CHAR_FORMAT_DATA == desc->format) || (HAP_CHAR_FORMAT_TLV8 == desc->format)) {
+            new_ch->data_crc = hap_char_data_crc(&val.d);
+        }
+    }
+    new_ch->type_id = hap_uuid_get_short_id(desc->type_uuid);
+    hap_char_set_validator(new_ch);
 
     return (hap_char_t *) new_ch;
 }
 
+/**
+ * @brief HAP create a characteristics
+ */
+static hap_char_t *hap_char_create_ext(char *type_uuid, uint32_t permission, hap_char_format_t format,
+        hap_val_t val, bool str_static)
+{
+    ESP_MFI_ASSERT(type_uuid);
+
+    hap_char_desc_t *desc = hap_db_calloc(1, sizeof(hap_char_desc_t));
+    if (!desc) {
+        return NULL;
+    }
+    desc->type_uuid = type_uuid;
+    desc->format = format;
+    desc->permission = permission;
+
+    hap_char_t *hc = hap_char_create_with_desc(desc, HAP_CHAR_DESC_OWNED, val, str_static);
+    if (!hc) {
+        hap_db_free(desc);
+    }
+    return hc;
+}
+
+static hap_char_t *hap_char_create(char *type_uuid, uint32_t permission, hap_char_format_t format, hap_val_t val)
+{
+    return hap_char_create_ext(type_uuid, permission, format, val, false);
+}
+
+hap_char_t *hap_char_create_from_desc(const hap_char_desc_t *desc, hap_val_t val)
+{
+    ESP_MFI_ASSERT(desc && desc->type_uuid);
+
+    return hap_char_create_with_desc(desc, 0, val, false);
+}
+
+/* Descriptor that can be modified, copying a shared one on the first change */
+static hap_char_desc_t *hap_char_get_desc_for_update(__hap_char_t *_hc)
+{
+    if (!(_hc->desc_flags & HAP_CHAR_DESC_OWNED)) {
+        hap_char_desc_t *desc = hap_db_calloc(1, sizeof(hap_char_desc_t));
+        if (!desc) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate characteristic descriptor");
+            return NULL;
+        }
+        *desc = *_hc->desc;
+        _hc->desc = desc;
+        _hc->desc_flags |= HAP_CHAR_DESC_OWNED;
+    }
+    return (hap_char_desc_t *)_hc->desc;
+}
+
 hap_char_t *hap_char_bool_create(char *type_uuid, uint16_t perms, bool b)
 {
     hap_val_t val = {.b = b};
@@ -380,13 +942,14 @@ hap_char_t *hap_char_float_create(char *type_uuid, uint16_t perms, float f)
 }
 hap_char_t *hap_char_string_create(char *type_uuid, uint16_t perms, char *s)
 {
-    hap_val_t val;
-    if (s)
-        val.s = strdup(s);
-    else
-        val.s = NULL;
+    hap_val_t val = {.s = s};
     return hap_char_create(type_uuid, perms, HAP_CHAR_FORMAT_STRING, val);
 }
+hap_char_t *hap_char_string_create_static(char *type_uuid, uint16_t perms, const char *s)
+{
+    hap_val_t val = {.s = (char *)s};
+    return hap_char_create_ext(type_uuid, perms, HAP_CHAR_FORMAT_STRING, val, true);
+}
 
 hap_char_t *hap_char_data_create(char *type_uuid, uint16_t perms, hap_data_val_t *d)
 {
@@ -425,7 +988,15 @@ const char * hap_char_get_type_uuid(hap_char_t *hc)
     ESP_MFI_ASSERT(hc);
     __hap_char_t *tmp = (__hap_char_t *)hc;
 
-    return tmp->type_uuid;
+    return tmp->desc->type_uuid;
+}
+
+uint16_t hap_char_get_type_id(hap_char_t *hc)
+{
+    ESP_MFI_ASSERT(hc);
+    __hap_char_t *tmp = (__hap_char_t *)hc;
+
+    return tmp->type_id;
 }
 
 uint16_t hap_char_get_perm(hap_char_t *hc)
@@ -434,7 +1005,7 @@ uint16_t hap_char_get_perm(hap_char_t *hc)
         return 0;
 
     __hap_char_t *tmp = (__hap_char_t *)hc;
-    return tmp->permission;
+    return tmp->desc->permission;
 }
 
 hap_char_format_t hap_char_get_format(hap_char_t *hc)
@@ -443,7 +1014,71 @@ hap_char_format_t hap_char_get_format(hap_char_t *hc)
         return 0;
 
     __hap_char_t *tmp = (__hap_char_t *)hc;
-    return tmp->format;
+    return tmp->desc->format;
+}
+
+#define set_bit(val, index)	((val) |= ((uint32_t)1 << (index)))
+#define reset_bit(val, index)	((val) &= ~((uint32_t)1 << (index)))
+/* Session index from hap_get_ctrl_session_index(), which is -1 for sessions not in the table */
+#define session_index_valid(index)	(((index) >= 0) && ((index) < HAP_MAX_SESSIONS_LIMIT))
+
+/* Reverse index of the subscriptions. For each session index, the characteristics having
+ * its bit set in ev_ctrls, so that a session going away clears just its own subscriptions
+ * instead of walking the whole database, which adds up on bridges. A session index is only
+ * used by the task serving that session, the same as its ev_ctrls bits.
+ * If a list cannot grow, the session falls back to the full walk on teardown.
+ */
+#define HAP_CHAR_SUBS_MIN_SIZE	8
+typedef struct {
+	hap_char_t **chars;
+	uint16_t cnt;
+	uint16_t size;
+	bool incomplete;
+} hap_char_subs_t;
+static hap_char_subs_t hap_char_subs[HAP_MAX_SESSIONS_LIMIT];
+
+static void hap_char_subs_add(int index, hap_char_t *hc)
+{
+	hap_char_subs_t *subs = &hap_char_subs[index];
+	if (subs->cnt == subs->size) {
+		uint16_t new_size = subs->size ? subs->size * 2 : HAP_CHAR_SUBS_MIN_SIZE;
+		hap_char_t **chars = NULL;
+		if (new_size > subs->size) {
+			chars = hap_platform_memory_malloc(new_size * sizeof(hap_char_t *));
+		}
+		if (!chars) {
+			subs->incomplete = true;
+			return;
+		}
+		if (subs->chars) {
+			memcpy(chars, subs->chars, subs->cnt * sizeof(hap_char_t *));
+			hap_platform_memory_free(subs->chars);
+		}
+		subs->chars = chars;
+		subs->size = new_size;
+	}
+	subs->chars[subs->cnt++] = hc;
+}
+
+static void hap_char_subs_remove(int index, hap_char_t *hc)
+{
+	hap_char_subs_t *subs = &hap_char_subs[index];
+	int i;
+	for (i = 0; i < subs->cnt; i++) {
+		if (subs->chars[i] == hc) {
+			/* The order does not matter, so the last one fills the gap */
+			subs->chars[i] = subs->chars[--subs->cnt];
+			return;
+		}
+	}
+}
+
+int hap_char_get_subs_cnt(int index)
+{
+	if (!session_index_valid(index))
+		return 0;
+	/* An incomplete list may have missed some, so it cannot say there are none */
+	return hap_char_subs[index].incomplete ? INT32_MAX : hap_char_subs[index].cnt;
 }
 
 /**
@@ -453,18 +1088,31 @@ void hap_char_delete(hap_char_t *hc)
 {
     ESP_MFI_ASSERT(hc);
     __hap_char_t *_hc = (__hap_char_t *)hc;
-    if (_hc->format == HAP_CHAR_FORMAT_STRING) {
-        if (_hc->val.s) {
-            hap_platform_memory_free(_hc->val.s);
+    if (_hc->notif_pending) {
+        hap_remove_pending_notif_char(hc);
+    }
+    hap_char_set_notif_policy(hc, NULL);
+    if (_hc->held) {
+        hap_remove_held_char(hc);
+    }
+    /* Drop it from the subscription lists, so that no teardown touches it later */
+    int i;
+    for (i = 0; _hc->ev_ctrls && (i < HAP_MAX_SESSIONS_LIMIT); i++) {
+        if (_hc->ev_ctrls & ((uint32_t)1 << i)) {
+            reset_bit(_hc->ev_ctrls, i);
+            hap_char_subs_remove(i, hc);
         }
     }
-    if (_hc->valid_vals) {
-        hap_platform_memory_free(_hc->valid_vals);
+    if (_hc->desc->format == HAP_CHAR_FORMAT_STRING) {
+        hap_char_free_str(_hc);
+    }
+    if (_hc->desc_flags & HAP_CHAR_VALID_VALS_OWNED) {
+        hap_db_free((void *)_hc->desc->valid_vals);
     }
-    if (_hc->valid_vals_range) {
-        hap_platform_memory_free(_hc->valid_vals_range);
+    if (_hc->desc_flags & HAP_CHAR_DESC_OWNED) {
+        hap_db_free((void *)_hc->desc);
     }
-    hap_platform_memory_free(_hc);
+    hap_db_free(_hc);
 }
 
 /**
@@ -474,26 +1122,48 @@ void hap_char_int_set_constraints(hap_char_t *hc, int min, int max, int step)
 {
     ESP_MFI_ASSERT(hc);
     __hap_char_t *tmp = (__hap_char_t *)hc;
-    tmp->min.i = min;
-    tmp->max.i = max;
-    tmp->step.i = step;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update(tmp);
+    if (!desc)
+        return;
+    desc->min.i = min;
+    desc->max.i = max;
+    desc->step.i = step;
     if (step) {
-        tmp->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG | HAP_CHAR_STEP_FLAG);
+        desc->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG | HAP_CHAR_STEP_FLAG);
     } else {
-        tmp->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG);
+        desc->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG);
     }
+    hap_char_set_validator(tmp);
 }
 void hap_char_float_set_constraints(hap_char_t *hc, float min, float max, float step)
 {
     ESP_MFI_ASSERT(hc);
     __hap_char_t *tmp = (__hap_char_t *)hc;
-    tmp->min.f = min;
-    tmp->max.f = max;
-    tmp->step.f = step;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update(tmp);
+    if (!desc)
+        return;
+    desc->min.f = min;
+    desc->max.f = max;
+    desc->step.f = step;
     if (step) {
-        tmp->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG | HAP_CHAR_STEP_FLAG);
+        desc->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG | HAP_CHAR_STEP_FLAG);
     } else {
-        tmp->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG);
+        desc->constraint_flags |= (HAP_CHAR_MIN_FLAG | HAP_CHAR_MAX_FLAG);
+    }
+    hap_char_set_validator(tmp);
+}
+
+void hap_char_float_set_quantization(hap_char_t *hc, float hysteresis)
+{
+    ESP_MFI_ASSERT(hc);
+    __hap_char_t *tmp = (__hap_char_t *)hc;
+    if (hysteresis > 0.5f) {
+        hysteresis = 0.5f;
+    }
+    tmp->quantize = (hysteresis >= 0.0f);
+    tmp->quant_hyst = tmp->quantize ? hysteresis : 0.0f;
+    if (tmp->quantize && tmp->validate != hap_char_validate_float_step) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Quantization needs a float characteristic with a step.");
     }
 }
 
@@ -505,21 +1175,26 @@ void hap_char_string_set_maxlen(hap_char_t *hc, int maxlen)
         maxlen = HAP_CHAR_STRING_MAX_LEN;
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Characteristic string length larger than maximum value(%d), falling back to the maximum value.", HAP_CHAR_STRING_MAX_LEN);
     }
-    tmp->max.i = maxlen;
-    tmp->constraint_flags |= HAP_CHAR_MAXLEN_FLAG;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update(tmp);
+    if (!desc)
+        return;
+    desc->max.i = maxlen;
+    desc->constraint_flags |= HAP_CHAR_MAXLEN_FLAG;
 }
 
 void hap_char_add_description(hap_char_t *hc, const char *description)
 {
     ESP_MFI_ASSERT(hc);
-    __hap_char_t *tmp = (__hap_char_t *)hc;
-    tmp->description = (char *)description;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update((__hap_char_t *)hc);
+    if (desc)
+        desc->description = description;
 }
 void hap_char_add_unit(hap_char_t *hc, const char *unit)
 {
     ESP_MFI_ASSERT(hc);
-    __hap_char_t *tmp = (__hap_char_t *)hc;
-    tmp->unit = (char *)unit;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update((__hap_char_t *)hc);
+    if (desc)
+        desc->unit = unit;
 }
 hap_char_t *hap_char_get_next(hap_char_t *hc)
 {
@@ -532,34 +1207,51 @@ hap_serv_t *hap_char_get_parent(hap_char_t *hc)
 
 }
 
-#define set_bit(val, index)	((val) |= (1 << index))
-#define reset_bit(val, index)	((val) &= ~(1 << index))
 void hap_char_manage_notification(hap_char_t *hc, int index, bool ev)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
-	if (ev)
+	if (!session_index_valid(index))
+		return;
+	bool subscribed = hap_char_is_ctrl_subscribed(hc, index);
+	if (ev && !subscribed) {
 		set_bit(_hc->ev_ctrls, index);
-	else
+		/* A leftover owner bit from an earlier session at this index would hide the next change */
+		reset_bit(_hc->owner_ctrl, index);
+		hap_char_subs_add(index, hc);
+	} else if (!ev && subscribed) {
 		reset_bit(_hc->ev_ctrls, index);
+		hap_char_subs_remove(index, hc);
+	}
+}
+
+bool hap_char_has_subscribers(hap_char_t *hc)
+{
+	ESP_MFI_ASSERT(hc);
+	return ((__hap_char_t *)hc)->ev_ctrls ? true : false;
 }
 
 bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
-	return (_hc->ev_ctrls & (1 << index)) ? true : false;
+	if (!session_index_valid(index))
+		return false;
+	return (_hc->ev_ctrls & ((uint32_t)1 << index)) ? true : false;
 }
 
 void hap_char_set_owner_ctrl(hap_char_t *hc, int index)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
     _hc->owner_ctrl = 0;
-    set_bit(_hc->owner_ctrl, index);
+	if (session_index_valid(index))
+		set_bit(_hc->owner_ctrl, index);
 }
 
 bool hap_char_is_ctrl_owner(hap_char_t *hc, int index)
 {
 	__hap_char_t *_hc = (__hap_char_t *)hc;
-	return (_hc->owner_ctrl & (1 << index)) ? true : false;
+	if (!session_index_valid(index))
+		return false;
+	return (_hc->owner_ctrl & ((uint32_t)1 << index)) ? true : false;
 }
 
 void hap_char_set_iid(hap_char_t *hc, int32_t iid)
@@ -571,19 +1263,33 @@ void hap_char_set_iid(hap_char_t *hc, int32_t iid)
 
 void hap_disable_all_char_notif(int index)
 {
-    /* Just loop through all characteristic objects and reset the
-     * bit indicating event notifications. This is the simplest way
-     */
     hap_acc_t *ha;
     hap_serv_t *hs;
     hap_char_t *hc;
-    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
-        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
-            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
-                reset_bit(((__hap_char_t *)hc)->ev_ctrls, index);
+    if (!session_index_valid(index))
+        return;
+    hap_char_subs_t *subs = &hap_char_subs[index];
+    if (!subs->incomplete) {
+        int i;
+        for (i = 0; i < subs->cnt; i++) {
+            reset_bit(((__hap_char_t *)subs->chars[i])->ev_ctrls, index);
+            /* The index goes to another session next */
+            reset_bit(((__hap_char_t *)subs->chars[i])->owner_ctrl, index);
+        }
+    } else {
+        /* The list missed some. Loop through all characteristic objects instead */
+        for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+            for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+                for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                    reset_bit(((__hap_char_t *)hc)->ev_ctrls, index);
+                    reset_bit(((__hap_char_t *)hc)->owner_ctrl, index);
+                }
             }
         }
     }
+    /* The storage is kept for the next session at this index */
+    subs->cnt = 0;
+    subs->incomplete = false;
 }
 
 void hap_char_add_valid_vals(hap_char_t *hc, const uint8_t *valid_vals, size_t valid_val_cnt)
@@ -591,10 +1297,18 @@ void hap_char_add_valid_vals(hap_char_t *hc, const uint8_t *valid_vals, size_t v
     if (!hc)
         return;
     __hap_char_t *_hc = (__hap_char_t *)hc;
-    _hc->valid_vals = hap_platform_memory_malloc(valid_val_cnt);
-    if (_hc->valid_vals) {
-        memcpy(_hc->valid_vals, valid_vals, valid_val_cnt);
-        _hc->valid_vals_cnt = valid_val_cnt;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update(_hc);
+    if (!desc || (valid_val_cnt > UINT8_MAX))
+        return;
+    uint8_t *vals = hap_db_calloc(1, valid_val_cnt);
+    if (vals) {
+        memcpy(vals, valid_vals, valid_val_cnt);
+        if (_hc->desc_flags & HAP_CHAR_VALID_VALS_OWNED) {
+            hap_db_free((void *)desc->valid_vals);
+        }
+        desc->valid_vals = vals;
+        desc->valid_vals_cnt = valid_val_cnt;
+        _hc->desc_flags |= HAP_CHAR_VALID_VALS_OWNED;
     }
 }
 
@@ -602,10 +1316,10 @@ void hap_char_add_valid_vals_range(hap_char_t *hc, uint8_t start_val, uint8_t en
 {
     if (!hc)
         return;
-    __hap_char_t *_hc = (__hap_char_t *)hc;
-    _hc->valid_vals_range = hap_platform_memory_malloc(sizeof(uint8_t));
-    if (_hc->valid_vals_range) {
-        _hc->valid_vals_range[0] = start_val;
-        _hc->valid_vals_range[1] = end_val;
+    hap_char_desc_t *desc = hap_char_get_desc_for_update((__hap_char_t *)hc);
+    if (desc) {
+        desc->valid_vals_range[0] = start_val;
+        desc->valid_vals_range[1] = end_val;
+        desc->constraint_flags |= HAP_CHAR_VALID_RANGE_FLAG;
     }
 }
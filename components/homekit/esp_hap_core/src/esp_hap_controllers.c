@@ -31,27 +31,69 @@
 #include <esp_hap_controllers.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_pair_setup.h>
+#include <sodium/crypto_sign_ed25519.h>
+#include <sodium/crypto_scalarmult_curve25519.h>
+#include <sodium/crypto_hash_sha512.h>
+#include <sodium/utils.h>
+#ifdef CONFIG_HAP_ED25519_PRECOMPUTE
+#include <sodium/private/ed25519_ref10.h>
+#endif
+#include <hkdf-sha.h>
 
 #define HAP_KEYSTORE_NAMESPACE_CTRL "hap_ctrl"
 
-int hap_controllers_init()
+/* The controller table is read from the keystore only once, in hap_controllers_init().
+ * All lookups (including the one in Pair Verify) are served from hap_priv.controllers
+ * and the keystore is touched only when the table is modified.
+ */
+static uint32_t hap_ctrl_id_hash(const char *id)
+{
+    /* 32-bit FNV-1a */
+    uint32_t hash = 2166136261U;
+    while (*id) {
+        hash ^= (uint8_t)*id++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* Fills the controller table. If the database snapshot was loaded, the table comes from
+ * its copy (valid_map having a bit set for every valid entry). Otherwise all the entries
+ * are read from the keystore in one batch.
+ */
+int hap_controllers_init(const hap_ctrl_info_t *snapshot, uint32_t valid_map)
 {
 	memset(hap_priv.controllers, 0, sizeof(hap_priv.controllers));
-    char index_str[4];
+    char index_str[HAP_MAX_CONTROLLERS][4];
+    hap_platform_keystore_item_t items[HAP_MAX_CONTROLLERS];
     uint8_t i;
-    size_t info_size;
     bool acc_paired = false;
+    if (!snapshot) {
+        for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+            snprintf(index_str[i], sizeof(index_str[i]), "%d", i);
+            items[i].key = index_str[i];
+            items[i].val = (uint8_t *)&hap_priv.controllers[i].info;
+            items[i].val_size = sizeof(hap_ctrl_info_t);
+        }
+        hap_keystore_get_multi(HAP_KEYSTORE_NAMESPACE_CTRL, items, HAP_MAX_CONTROLLERS);
+    }
 	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
-        snprintf(index_str, sizeof(index_str), "%d", i);
-        info_size = sizeof(hap_ctrl_info_t);
-        if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_CTRL, index_str,
-                    (uint8_t *)&hap_priv.controllers[i].info, &info_size) == HAP_SUCCESS) {
-            if (info_size == sizeof(hap_ctrl_info_t)) {
-                hap_priv.controllers[i].index = i;
-                hap_priv.controllers[i].valid = true;
-                acc_paired = true;
+        if (snapshot) {
+            if (!(valid_map & (1UL << i))) {
+                continue;
+            }
+            hap_priv.controllers[i].info = snapshot[i];
+        } else {
+            if ((items[i].status != 0) || (items[i].val_size != sizeof(hap_ctrl_info_t))) {
+                memset(&hap_priv.controllers[i].info, 0, sizeof(hap_ctrl_info_t));
+                continue;
             }
         }
+        hap_priv.controllers[i].info.id[HAP_CTRL_ID_LEN - 1] = 0;
+        hap_priv.controllers[i].index = i;
+        hap_priv.controllers[i].id_hash = hap_ctrl_id_hash(hap_priv.controllers[i].info.id);
+        hap_priv.controllers[i].valid = true;
+        acc_paired = true;
     }
     if (acc_paired) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory is Paired with atleast one controller");
@@ -108,8 +150,10 @@ bool is_admin_paired()
 int hap_controller_save(hap_ctrl_data_t *ctrl_data)
 {
 	ctrl_data->valid = true;
+    ctrl_data->id_hash = hap_ctrl_id_hash(ctrl_data->info.id);
     char index_str[4];
     snprintf(index_str, sizeof(index_str), "%d", ctrl_data->index);
+    hap_db_snapshot_invalidate();
     int ret = hap_keystore_set(HAP_KEYSTORE_NAMESPACE_CTRL, index_str,
             (const uint8_t *)&ctrl_data->info, (size_t)sizeof(hap_ctrl_info_t));
 
@@ -117,6 +161,7 @@ int hap_controller_save(hap_ctrl_data_t *ctrl_data)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to store controller %d", ctrl_data->index);
         return HAP_FAIL;
     }
+    hap_db_snapshot_save();
     hap_report_event(HAP_EVENT_CTRL_PAIRED, ctrl_data->info.id, sizeof(ctrl_data->info.id));
     return HAP_SUCCESS;
 }
@@ -129,16 +174,39 @@ void hap_controller_remove(hap_ctrl_data_t *ctrl_data)
     snprintf(index_str, sizeof(index_str), "%d", ctrl_data->index);
     char id[HAP_CTRL_ID_LEN];
     strncpy(id, ctrl_data->info.id, sizeof(id));
+    hap_db_snapshot_invalidate();
     hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_CTRL, index_str);
     memset(ctrl_data, 0, sizeof(hap_ctrl_data_t));
+    hap_db_snapshot_save();
     hap_report_event(HAP_EVENT_CTRL_UNPAIRED, id, sizeof(id));
 }
 
+/* Removes all controllers with a single keystore operation, instead of
+ * deleting the entries one by one.
+ */
+void hap_controller_remove_all()
+{
+    int i;
+    char id[HAP_CTRL_ID_LEN];
+    hap_db_snapshot_invalidate();
+    hap_keystore_delete_namespace(HAP_KEYSTORE_NAMESPACE_CTRL);
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hap_priv.controllers[i].valid) {
+            strncpy(id, hap_priv.controllers[i].info.id, sizeof(id));
+            memset(&hap_priv.controllers[i], 0, sizeof(hap_ctrl_data_t));
+            hap_report_event(HAP_EVENT_CTRL_UNPAIRED, id, sizeof(id));
+        }
+    }
+    hap_db_snapshot_save();
+}
+
 hap_ctrl_data_t *hap_get_controller(char *ctrl_id)
 {
 	int i;
+    uint32_t hash = hap_ctrl_id_hash(ctrl_id);
 	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
 		if (hap_priv.controllers[i].valid
+                && (hap_priv.controllers[i].id_hash == hash)
 				&& (!strcmp(hap_priv.controllers[i].info.id, ctrl_id)))
 			return &hap_priv.controllers[i];
 	}
@@ -147,5 +215,127 @@ hap_ctrl_data_t *hap_get_controller(char *ctrl_id)
 
 void hap_erase_controller_info()
 {
+    /* The snapshot has a copy of the controllers too, and must not bring them back */
+    hap_db_snapshot_disable();
     hap_keystore_delete_namespace(HAP_KEYSTORE_NAMESPACE_CTRL);
 }
+
+#ifdef CONFIG_HAP_ED25519_PRECOMPUTE
+/* The halves of SHA-512(AccessoryLTSK), which libsodium would otherwise
+ * recompute for every signature: the clamped secret scalar, and the prefix
+ * the per signature nonce is derived from.
+ */
+static struct {
+    bool valid;
+    uint8_t scalar[32];
+    uint8_t prefix[32];
+} hap_acc_sign_key;
+
+void hap_acc_sign_key_init(void)
+{
+    uint8_t az[crypto_hash_sha512_BYTES];
+
+    crypto_hash_sha512(az, hap_priv.ltska, sizeof(hap_priv.ltska));
+    az[0] &= 248;
+    az[31] &= 127;
+    az[31] |= 64;
+    memcpy(hap_acc_sign_key.scalar, az, sizeof(hap_acc_sign_key.scalar));
+    memcpy(hap_acc_sign_key.prefix, az + 32, sizeof(hap_acc_sign_key.prefix));
+    sodium_memzero(az, sizeof(az));
+    hap_acc_sign_key.valid = true;
+}
+
+void hap_acc_sign_key_wipe(void)
+{
+    sodium_memzero(&hap_acc_sign_key, sizeof(hap_acc_sign_key));
+}
+
+/* Same steps, and so the same signature, as crypto_sign_ed25519_detached(),
+ * minus the hashing of the secret key. R is computed from libsodium's
+ * precomputed multiples of the base point.
+ */
+static void hap_acc_sign_precomputed(const uint8_t *data, size_t len, uint8_t *sig)
+{
+    crypto_hash_sha512_state hs;
+    uint8_t nonce[crypto_hash_sha512_BYTES];
+    uint8_t hram[crypto_hash_sha512_BYTES];
+    ge25519_p3 R;
+
+    crypto_hash_sha512_init(&hs);
+    crypto_hash_sha512_update(&hs, hap_acc_sign_key.prefix, sizeof(hap_acc_sign_key.prefix));
+    crypto_hash_sha512_update(&hs, data, len);
+    crypto_hash_sha512_final(&hs, nonce);
+    sc25519_reduce(nonce);
+    ge25519_scalarmult_base(&R, nonce);
+    ge25519_p3_tobytes(sig, &R);
+
+    crypto_hash_sha512_init(&hs);
+    crypto_hash_sha512_update(&hs, sig, 32);
+    crypto_hash_sha512_update(&hs, hap_priv.ltpka, sizeof(hap_priv.ltpka));
+    crypto_hash_sha512_update(&hs, data, len);
+    crypto_hash_sha512_final(&hs, hram);
+    sc25519_reduce(hram);
+    sc25519_muladd(sig + 32, hram, hap_acc_sign_key.scalar, nonce);
+
+    sodium_memzero(nonce, sizeof(nonce));
+    sodium_memzero(&hs, sizeof(hs));
+}
+#else
+void hap_acc_sign_key_init(void)
+{
+}
+
+void hap_acc_sign_key_wipe(void)
+{
+}
+#endif /* CONFIG_HAP_ED25519_PRECOMPUTE */
+
+int hap_acc_sign(const uint8_t *data, size_t len, uint8_t *sig)
+{
+    unsigned long long sig_len = 0;
+
+    if (!data || !sig) {
+        return HAP_FAIL;
+    }
+#ifdef CONFIG_HAP_ED25519_PRECOMPUTE
+    if (hap_acc_sign_key.valid) {
+        hap_acc_sign_precomputed(data, len, sig);
+        return HAP_SUCCESS;
+    }
+#endif
+    /* hap_priv.ltska is followed by hap_priv.ltpka, which make up the full Ed25519 secret key */
+    if (crypto_sign_ed25519_detached(sig, &sig_len, data, len, hap_priv.ltska) != 0) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_ctrl_derive_key(const char *ctrl_id, const char *salt, const char *info, uint8_t *key)
+{
+    uint8_t curve_sk[crypto_scalarmult_curve25519_BYTES];
+    uint8_t curve_pk[crypto_scalarmult_curve25519_BYTES];
+    uint8_t shared[crypto_scalarmult_curve25519_BYTES];
+    int ret = HAP_FAIL;
+
+    if (!ctrl_id || !salt || !info || !key) {
+        return HAP_FAIL;
+    }
+    hap_ctrl_data_t *ctrl = hap_get_controller((char *)ctrl_id);
+    if (!ctrl) {
+        return HAP_FAIL;
+    }
+
+    if ((crypto_sign_ed25519_sk_to_curve25519(curve_sk, hap_priv.ltska) == 0) &&
+            (crypto_sign_ed25519_pk_to_curve25519(curve_pk, ctrl->info.ltpk) == 0) &&
+            (crypto_scalarmult_curve25519(shared, curve_sk, curve_pk) == 0)) {
+        hkdf(SHA512, (const unsigned char *)salt, strlen(salt), shared, sizeof(shared),
+                (const unsigned char *)info, strlen(info), key, HAP_CTRL_KEY_LEN);
+        ret = HAP_SUCCESS;
+    } else {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to derive a key for %s", ctrl_id);
+    }
+
+    memset(curve_sk, 0, sizeof(curve_sk));
+    memset(shared, 0, sizeof(shared));
+    return ret;
+}
@@ -23,9 +23,12 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <sodium/crypto_sign_ed25519.h>
 #include <string.h>
 #include <hap_platform_memory.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
 
 #include <esp_mfi_rand.h>
 #include <esp_mfi_sha.h>
@@ -33,9 +36,14 @@
 
 #include <esp_hap_main.h>
 #include <esp_hap_keystore.h>
+#include <esp_hap_acc.h>
+#include <esp_hap_serv.h>
+#include <esp_hap_char.h>
 #include <esp_hap_database.h>
 #include <esp_hap_controllers.h>
 #include <esp_hap_pair_setup.h>
+#include <esp_hap_pair_verify.h>
+#include <esp_hap_ip_services.h>
 
 #include <esp_mfi_base64.h>
 
@@ -44,8 +52,10 @@
 #define HAP_KEY_LTPKA                   "ltpka"
 #define HAP_KEY_CONFIG_NUM              "config_num"
 #define HAP_KEY_FW_REV                  "fw_rev"
+#define HAP_KEY_DB_HASH                 "db_hash"
 #define HAP_KEY_CUR_AID                 "cur_aid"
 #define HAP_KEY_STATE_NUM              "state_num"
+#define HAP_KEY_DB_SNAPSHOT             "db_snap"
 
 #define HAP_KEY_SETUP_ID                "setup_id"
 #define HAP_KEY_SETUP_SALT              "setup_salt"
@@ -57,6 +67,8 @@
 #define HAP_SOCK_RECV_TIMEOUT       10
 #define HAP_SOCK_SEND_TIMEOUT       10
 
+#define HAP_FW_REV_MAX_LEN          64
+
 hap_priv_t hap_priv = {
     .cfg = {
         .task_stack_size = HAP_LOOP_STACK,
@@ -66,13 +78,128 @@ hap_priv_t hap_priv = {
         .recv_timeout = HAP_SOCK_RECV_TIMEOUT,
         .send_timeout = HAP_SOCK_SEND_TIMEOUT,
         .sw_token_max_len = HAP_SW_TOKEN_MAX_LEN,
+        .max_sessions = HAP_MAX_SESSIONS,
     }
 };
 
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+/* Snapshot of the persistent accessory database, as a single keystore blob.
+ *
+ * hap_database_init() otherwise reads the accessory ID, its key pair, the current AID,
+ * every controller slot, the firmware revision and the database fingerprint one key at a time. The snapshot has
+ * all of them, so that a normal boot needs one read. The state and configuration numbers
+ * are not part of it, as they change often and are already batched by the deferred
+ * keystore writes.
+ *
+ * The per key entries remain the primary copy, and a missing or bad snapshot just means
+ * falling back to them. To never let the snapshot hold older data than them, it is deleted
+ * before a per key entry in it gets written, and saved again right after.
+ */
+#define HAP_DB_SNAPSHOT_MAGIC       0x50414e53 /* "SNAP" */
+#define HAP_DB_SNAPSHOT_VERSION     2
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t len;
+    uint8_t raw_acc_id[6];
+    uint8_t ltska[ED_KEY_LEN];
+    uint8_t ltpka[ED_KEY_LEN];
+    uint32_t cur_aid;
+    char fw_rev[HAP_FW_REV_MAX_LEN];
+    uint32_t db_hash;
+    uint32_t ctrl_valid_map;
+    hap_ctrl_info_t controllers[HAP_MAX_CONTROLLERS];
+    uint32_t crc; /* Over everything above */
+} __attribute__((packed)) hap_db_snapshot_t;
+
+_Static_assert(HAP_MAX_CONTROLLERS <= 32, "Controller map of the snapshot is too small");
+
+/* Firmware revision as last stored, so that a snapshot saved before hap_check_fw_version()
+ * does not hide a firmware update from it.
+ */
+static char hap_db_snapshot_fw_rev[HAP_FW_REV_MAX_LEN];
+/* Accessory database fingerprint as last stored, 0 if none was */
+static uint32_t hap_db_snapshot_db_hash;
+/* Whether hap_db_snapshot_fw_rev is known, which a save needs */
+static bool hap_db_snapshot_ready;
+/* Set once the stored data is being erased. Nothing is saved until the next boot */
+static bool hap_db_snapshot_disabled;
+
+static int hap_db_snapshot_load(hap_db_snapshot_t *snap)
+{
+    size_t len = sizeof(*snap);
+    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_SNAPSHOT,
+                (uint8_t *)snap, &len) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    if ((len != sizeof(*snap)) || (snap->magic != HAP_DB_SNAPSHOT_MAGIC)
+            || (snap->version != HAP_DB_SNAPSHOT_VERSION) || (snap->len != sizeof(*snap))
+            || (snap->crc != esp_rom_crc32_le(0, (const uint8_t *)snap, offsetof(hap_db_snapshot_t, crc)))) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Ignoring invalid database snapshot");
+        return HAP_FAIL;
+    }
+    snap->fw_rev[sizeof(snap->fw_rev) - 1] = 0;
+    strcpy(hap_db_snapshot_fw_rev, snap->fw_rev);
+    hap_db_snapshot_db_hash = snap->db_hash;
+    hap_db_snapshot_ready = true;
+    return HAP_SUCCESS;
+}
+
+void hap_db_snapshot_save()
+{
+    if (!hap_db_snapshot_ready || hap_db_snapshot_disabled) {
+        return;
+    }
+    hap_db_snapshot_t *snap = hap_platform_memory_calloc(1, sizeof(hap_db_snapshot_t));
+    if (!snap) {
+        /* The per key entries are still there, so this just costs the next boot some time */
+        return;
+    }
+    int i;
+    snap->magic = HAP_DB_SNAPSHOT_MAGIC;
+    snap->version = HAP_DB_SNAPSHOT_VERSION;
+    snap->len = sizeof(*snap);
+    memcpy(snap->raw_acc_id, hap_priv.raw_acc_id, sizeof(snap->raw_acc_id));
+    memcpy(snap->ltska, hap_priv.ltska, sizeof(snap->ltska));
+    memcpy(snap->ltpka, hap_priv.ltpka, sizeof(snap->ltpka));
+    snap->cur_aid = hap_priv.cur_aid;
+    strcpy(snap->fw_rev, hap_db_snapshot_fw_rev);
+    snap->db_hash = hap_db_snapshot_db_hash;
+    for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
+        if (hap_priv.controllers[i].valid) {
+            snap->ctrl_valid_map |= (1UL << i);
+            snap->controllers[i] = hap_priv.controllers[i].info;
+        }
+    }
+    snap->crc = esp_rom_crc32_le(0, (const uint8_t *)snap, offsetof(hap_db_snapshot_t, crc));
+    if (hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_SNAPSHOT,
+                (uint8_t *)snap, sizeof(*snap)) != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to save database snapshot");
+    }
+    hap_platform_memory_free(snap);
+}
+
+void hap_db_snapshot_invalidate()
+{
+    hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_SNAPSHOT);
+}
+
+void hap_db_snapshot_disable()
+{
+    hap_db_snapshot_disabled = true;
+    hap_db_snapshot_invalidate();
+}
+#else
+void hap_db_snapshot_save() {}
+void hap_db_snapshot_invalidate() {}
+void hap_db_snapshot_disable() {}
+#endif /* CONFIG_HAP_DB_SNAPSHOT_ENABLE */
+
 static void hap_save_config_number()
 {
 
-    hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CONFIG_NUM,
+    hap_keystore_set_deferred(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CONFIG_NUM,
             (uint8_t *)&hap_priv.config_num, sizeof(hap_priv.config_num));
 }
 
@@ -97,12 +224,14 @@ void hap_increment_and_save_config_num()
         hap_priv.config_num = 1;
     }
     hap_save_config_number();
+    /* The accessory database has changed. Drop its cached serialization */
+    hap_http_invalidate_acc_db();
 }
 
 
 static void hap_save_state_number()
 {
-    hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_STATE_NUM,
+    hap_keystore_set_deferred(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_STATE_NUM,
             (uint8_t *)&hap_priv.state_num, sizeof(hap_priv.state_num));
 }
 
@@ -137,8 +266,10 @@ static void hap_init_state_number()
 
 static void hap_save_cur_aid()
 {
+    hap_db_snapshot_invalidate();
     hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_CUR_AID,
             (uint8_t *)&hap_priv.cur_aid, sizeof(hap_priv.cur_aid));
+    hap_db_snapshot_save();
 }
 
 static void hap_get_cur_aid()
@@ -197,30 +328,139 @@ static int hap_get_setup_info()
     return HAP_SUCCESS;
 }
 
+static uint32_t hap_hash_str(uint32_t hash, const char *str)
+{
+    /* The terminator goes in too, so that "ab","c" and "a","bc" differ */
+    return str ? esp_rom_crc32_le(hash, (const uint8_t *)str, strlen(str) + 1) : hash;
+}
+
+#define hap_hash_val(hash, val) esp_rom_crc32_le(hash, (const uint8_t *)&(val), sizeof(val))
+
+/* Fingerprint of what /accessories describes, other than the values: the accessories,
+ * services and characteristics, with their IDs, types, links, permissions, formats and
+ * constraints. It is stable across boots, as nothing in it depends on memory addresses
+ * or allocation order, and it never comes out as 0, which stands for "none stored".
+ */
+static uint32_t hap_acc_db_hash(void)
+{
+    uint32_t hash = 0;
+    hap_acc_t *ha;
+    for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        uint32_t aid = ((__hap_acc_t *)ha)->aid;
+        hash = hap_hash_val(hash, aid);
+        hap_serv_t *hs;
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            __hap_serv_t *_hs = (__hap_serv_t *)hs;
+            uint8_t flags = (_hs->hidden ? 1 : 0) | (_hs->primary ? 2 : 0);
+            hash = hap_hash_val(hash, _hs->iid);
+            hash = hap_hash_str(hash, _hs->type_uuid);
+            hash = hap_hash_val(hash, flags);
+            hap_linked_serv_t *link;
+            for (link = _hs->linked_servs; link; link = link->next) {
+                hash = hap_hash_val(hash, ((__hap_serv_t *)link->hs)->iid);
+            }
+            hap_char_t *hc;
+            for (hc = hap_serv_get_first_char(hs); hc; hc = hap_char_get_next(hc)) {
+                __hap_char_t *_hc = (__hap_char_t *)hc;
+                const hap_char_desc_t *desc = _hc->desc;
+                hash = hap_hash_val(hash, _hc->iid);
+                hash = hap_hash_str(hash, desc->type_uuid);
+                hash = hap_hash_str(hash, desc->unit);
+                hash = hap_hash_str(hash, desc->description);
+                hash = hap_hash_val(hash, desc->permission);
+                hash = hap_hash_val(hash, desc->format);
+                hash = hap_hash_val(hash, desc->constraint_flags);
+                /* Only the members that the format uses, as the rest of the unions may be stale */
+                if (desc->format == HAP_CHAR_FORMAT_UINT64) {
+                    hash = hap_hash_val(hash, desc->min.i64);
+                    hash = hap_hash_val(hash, desc->max.i64);
+                    hash = hap_hash_val(hash, desc->step.i64);
+                } else {
+                    hash = hap_hash_val(hash, desc->min.u);
+                    hash = hap_hash_val(hash, desc->max.u);
+                    hash = hap_hash_val(hash, desc->step.u);
+                }
+                if (desc->valid_vals) {
+                    hash = esp_rom_crc32_le(hash, desc->valid_vals, desc->valid_vals_cnt);
+                }
+                hash = hap_hash_val(hash, desc->valid_vals_range);
+            }
+        }
+    }
+    return hash ? hash : 1;
+}
+
+/* Decides whether the accessory database changed since the last boot, and bumps the
+ * config number if so, which makes every controller fetch /accessories again.
+ * A firmware update alone does not count, unless CONFIG_HAP_CONFIG_NUM_DB_HASH is off.
+ */
 static void hap_check_fw_version()
 {
-    char fw_rev[64] = {0};
+    char fw_rev[HAP_FW_REV_MAX_LEN] = {0};
     size_t fw_rev_len = sizeof(fw_rev);
-    /* Check if the firmware revision is stored in NVS */
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
-                (uint8_t *)fw_rev, &fw_rev_len) == HAP_SUCCESS) {
-        /* If the firmware revision is found, compare with the current revision.
-         * If it is the same, no need to do anything. So, just return
-         */
-        if (strncmp(fw_rev, hap_priv.primary_acc.fw_rev, sizeof(fw_rev)) == 0) {
-            return;
-        } else {
-            /* If there is a version mismatch, it means that the firmware was upgraded.
-             * Update config number in that case
-             */
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "FW Update detected. Incrementing config number");
-            hap_increment_and_save_config_num();
+    uint32_t stored_hash = 0;
+    size_t hash_len = sizeof(stored_hash);
+    bool found;
+    uint32_t db_hash = hap_acc_db_hash();
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+    /* If the snapshot was loaded, it has the stored revision and fingerprint already */
+    bool from_snapshot = hap_db_snapshot_ready;
+    if (from_snapshot) {
+        strcpy(fw_rev, hap_db_snapshot_fw_rev);
+        stored_hash = hap_db_snapshot_db_hash;
+        found = true;
+    } else
+#endif
+    {
+        /* Check if the firmware revision is stored in NVS */
+        found = (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
+                    (uint8_t *)fw_rev, &fw_rev_len) == HAP_SUCCESS);
+        if (found && ((hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_HASH,
+                    (uint8_t *)&stored_hash, &hash_len) != HAP_SUCCESS) || (hash_len != sizeof(stored_hash)))) {
+            stored_hash = 0;
+        }
+    }
+    bool fw_changed = found && (strncmp(fw_rev, hap_priv.primary_acc.fw_rev, sizeof(fw_rev)) != 0);
+    /* Without a stored fingerprint (first boot after the update that added it), a new
+     * firmware is assumed to have changed the database, as it used to be
+     */
+    bool db_changed = stored_hash ? (stored_hash != db_hash) : fw_changed;
+#ifndef CONFIG_HAP_CONFIG_NUM_DB_HASH
+    db_changed = db_changed || fw_changed;
+#endif
+    if (found && !fw_changed && (stored_hash == db_hash)) {
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+        if (!from_snapshot) {
+            /* The per key path was taken. Create the snapshot for the next boot */
+            strcpy(hap_db_snapshot_fw_rev, fw_rev);
+            hap_db_snapshot_db_hash = db_hash;
+            hap_db_snapshot_ready = true;
+            hap_db_snapshot_save();
         }
+#endif
+        return;
     }
-    /* Save the new firmare revision to NVS */
+    if (db_changed) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory database changed%s. Incrementing config number",
+                fw_changed ? " with the FW Update" : "");
+        hap_increment_and_save_config_num();
+    } else if (fw_changed) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "FW Update detected, with the same accessory database. Keeping config number %d",
+                (int)hap_priv.config_num);
+    }
+    /* Save the new firmare revision and database fingerprint to NVS */
+    hap_db_snapshot_invalidate();
     hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_FW_REV,
             (uint8_t *)hap_priv.primary_acc.fw_rev,
             strlen(hap_priv.primary_acc.fw_rev));
+    hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_DB_HASH,
+            (uint8_t *)&db_hash, sizeof(db_hash));
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+    snprintf(hap_db_snapshot_fw_rev, sizeof(hap_db_snapshot_fw_rev), "%s", hap_priv.primary_acc.fw_rev);
+    hap_db_snapshot_db_hash = db_hash;
+    hap_db_snapshot_ready = true;
+#endif
+    hap_db_snapshot_save();
 }
 
 int hap_acc_setup_init()
@@ -265,13 +505,28 @@ int hap_acc_setup_init()
 int hap_database_init(void)
 {
     uint8_t id[6];
-    size_t val_size = sizeof(id);
-    if (hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_ACC_ID, id, &val_size) == HAP_SUCCESS) {
-        val_size = sizeof(hap_priv.ltska);
-        hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTSKA, hap_priv.ltska, &val_size);
-        val_size = sizeof(hap_priv.ltpka);
-        hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTPKA, hap_priv.ltpka, &val_size);
-    } else {
+    /* The accessory identity is read in one go, under a single namespace handle */
+    hap_platform_keystore_item_t identity[] = {
+        { .key = HAP_KEY_ACC_ID, .val = id, .val_size = sizeof(id) },
+        { .key = HAP_KEY_LTSKA, .val = hap_priv.ltska, .val_size = sizeof(hap_priv.ltska) },
+        { .key = HAP_KEY_LTPKA, .val = hap_priv.ltpka, .val_size = sizeof(hap_priv.ltpka) },
+    };
+    const hap_ctrl_info_t *ctrl_snapshot = NULL;
+    uint32_t ctrl_valid_map = 0;
+    int64_t start_time = esp_timer_get_time();
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+    hap_db_snapshot_t *snap = hap_platform_memory_calloc(1, sizeof(hap_db_snapshot_t));
+    if (snap && (hap_db_snapshot_load(snap) == HAP_SUCCESS)) {
+        memcpy(id, snap->raw_acc_id, sizeof(id));
+        memcpy(hap_priv.ltska, snap->ltska, sizeof(hap_priv.ltska));
+        memcpy(hap_priv.ltpka, snap->ltpka, sizeof(hap_priv.ltpka));
+        hap_priv.cur_aid = snap->cur_aid;
+        ctrl_snapshot = snap->controllers;
+        ctrl_valid_map = snap->ctrl_valid_map;
+    } else
+#endif
+    if ((hap_keystore_get_multi(HAP_KEYSTORE_NAMESPACE_HAPMAIN, identity,
+                    sizeof(identity) / sizeof(identity[0])) <= 0) || (identity[0].status != 0)) {
         /* If the accessory ID is not found in keystore, create and store a new random ID */
 	    esp_mfi_get_random(id, sizeof(id));
         hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_ACC_ID, id, sizeof(id));
@@ -282,15 +537,29 @@ int hap_database_init(void)
         hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_LTPKA, hap_priv.ltpka, sizeof(hap_priv.ltpka));
     }
 
+    hap_acc_sign_key_init();
+
     memcpy(hap_priv.raw_acc_id, id, sizeof(hap_priv.raw_acc_id));
 	snprintf(hap_priv.acc_id, sizeof(hap_priv.acc_id), "%02X:%02X:%02X:%02X:%02X:%02X",
 			id[0], id[1], id[2], id[3], id[4], id[5]);
 
-	hap_controllers_init();
-    hap_get_config_number();
-    hap_get_cur_aid();
-    hap_init_state_number();
-    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Database initialised. Accessory Device ID: %s", hap_priv.acc_id);
+    int ret = hap_sessions_init();
+    if (ret == HAP_SUCCESS) {
+        hap_controllers_init(ctrl_snapshot, ctrl_valid_map);
+        hap_get_config_number();
+        if (!ctrl_snapshot) {
+            hap_get_cur_aid();
+        }
+        hap_init_state_number();
+    }
+#ifdef CONFIG_HAP_DB_SNAPSHOT_ENABLE
+    hap_platform_memory_free(snap);
+#endif
+    if (ret != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Database initialised %sin %d us. Accessory Device ID: %s",
+            ctrl_snapshot ? "from snapshot " : "", (int)(esp_timer_get_time() - start_time), hap_priv.acc_id);
 	return HAP_SUCCESS;
 }
 
@@ -308,6 +577,8 @@ int hap_get_next_aid(char *id)
 
 void hap_erase_accessory_info()
 {
+    hap_acc_sign_key_wipe();
+    hap_db_snapshot_disable();
     hap_keystore_delete_namespace(HAP_KEYSTORE_NAMESPACE_HAPMAIN);
 }
 
@@ -330,6 +601,15 @@ int hap_set_config(const hap_cfg_t *cfg)
     if (!cfg) {
         return HAP_FAIL;
     }
+    if ((cfg->max_sessions == 0) || (cfg->max_sessions > HAP_MAX_SESSIONS_LIMIT)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "max_sessions should be between 1 and %d", HAP_MAX_SESSIONS_LIMIT);
+        return HAP_FAIL;
+    }
+    /* The session table gets allocated at hap_init() and cannot be resized after that */
+    if (hap_priv.sessions && (cfg->max_sessions != hap_priv.cfg.max_sessions)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "max_sessions cannot be changed after hap_init()");
+        return HAP_FAIL;
+    }
     hap_priv.cfg = *cfg;
     return HAP_SUCCESS;
 }
@@ -0,0 +1,154 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_db_arena.h>
+
+#ifdef CONFIG_HAP_DB_ARENA_ENABLE
+
+#define HAP_DB_ARENA_ALIGN	8
+
+typedef struct hap_db_chunk {
+	struct hap_db_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(HAP_DB_ARENA_ALIGN)));
+} hap_db_chunk_t;
+
+static hap_db_chunk_t *hap_db_chunks;
+static bool hap_db_sealed;
+
+static bool hap_db_arena_owns(const void *ptr)
+{
+	hap_db_chunk_t *chunk;
+	for (chunk = hap_db_chunks; chunk; chunk = chunk->next) {
+		if (((const uint8_t *)ptr >= chunk->data) &&
+				((const uint8_t *)ptr < (chunk->data + chunk->size)))
+			return true;
+	}
+	return false;
+}
+
+static void *hap_db_arena_alloc(size_t size)
+{
+	size = (size + HAP_DB_ARENA_ALIGN - 1) & ~(size_t)(HAP_DB_ARENA_ALIGN - 1);
+	/* Large objects would waste most of a chunk, so they go to the heap */
+	if (hap_db_sealed || (size > (CONFIG_HAP_DB_ARENA_CHUNK_SIZE / 4)))
+		return NULL;
+	hap_db_chunk_t *chunk = hap_db_chunks;
+	if (!chunk || ((chunk->size - chunk->used) < size)) {
+		chunk = hap_platform_memory_malloc(sizeof(hap_db_chunk_t) + CONFIG_HAP_DB_ARENA_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		chunk->size = CONFIG_HAP_DB_ARENA_CHUNK_SIZE;
+		chunk->used = 0;
+		chunk->next = hap_db_chunks;
+		hap_db_chunks = chunk;
+	}
+	void *ptr = &chunk->data[chunk->used];
+	chunk->used += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void *hap_db_calloc(size_t count, size_t size)
+{
+	void *ptr = hap_db_arena_alloc(count * size);
+	if (ptr)
+		return ptr;
+	return hap_platform_memory_calloc(count, size);
+}
+
+char *hap_db_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *str = hap_db_arena_alloc(len);
+	if (!str)
+		return strdup(s);
+	memcpy(str, s, len);
+	return str;
+}
+
+void hap_db_free(void *ptr)
+{
+	if (ptr && !hap_db_arena_owns(ptr))
+		hap_platform_memory_free(ptr);
+}
+
+void hap_db_arena_seal(void)
+{
+	hap_db_chunk_t *chunk;
+	int cnt = 0;
+	size_t used = 0;
+	for (chunk = hap_db_chunks; chunk; chunk = chunk->next) {
+		cnt++;
+		used += chunk->used;
+	}
+	hap_db_sealed = true;
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Accessory database: %d bytes in %d arena chunk(s)", (int)used, cnt);
+}
+
+void hap_db_arena_free(void)
+{
+	hap_db_chunk_t *chunk = hap_db_chunks;
+	while (chunk) {
+		hap_db_chunk_t *next = chunk->next;
+		hap_platform_memory_free(chunk);
+		chunk = next;
+	}
+	hap_db_chunks = NULL;
+	hap_db_sealed = false;
+}
+
+#else
+
+void *hap_db_calloc(size_t count, size_t size)
+{
+	return hap_platform_memory_calloc(count, size);
+}
+
+char *hap_db_strdup(const char *s)
+{
+	return strdup(s);
+}
+
+void hap_db_free(void *ptr)
+{
+	if (ptr)
+		hap_platform_memory_free(ptr);
+}
+
+void hap_db_arena_seal(void)
+{
+}
+
+void hap_db_arena_free(void)
+{
+}
+
+#endif /* CONFIG_HAP_DB_ARENA_ENABLE */
@@ -0,0 +1,246 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* Multi-subscriber HomeKit event bus.
+ *
+ * Inline subscribers are called right away on the reporting thread. Deferred
+ * subscribers get a copy of the event through a bounded queue, drained by a
+ * low priority task that is only started once the first of them subscribes.
+ * Queueing never blocks: when the queue is full the event is dropped and
+ * counted, so a slow subscriber can't hold up the HAP request that raised it.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <hap.h>
+#include <hap_platform_os.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_event_bus.h>
+
+#define HAP_EVENT_BUS_TASK_NAME     "hap-event-bus"
+/* Below the pairing worker and the HTTP Server */
+#define HAP_EVENT_BUS_TASK_PRIORITY (tskIDLE_PRIORITY + 2)
+/* Room for a controller id, the largest data any event carries */
+#define HAP_EVENT_BUS_DATA_SIZE     64
+
+typedef struct {
+    hap_event_subscriber_t subscriber;
+    void *priv;
+    uint32_t event_mask;
+    hap_event_dispatch_t dispatch;
+} hap_event_sub_t;
+
+typedef struct {
+    hap_event_t event;
+    size_t data_size;
+    char data[HAP_EVENT_BUS_DATA_SIZE];
+} hap_event_item_t;
+
+static hap_event_sub_t hap_event_subs[CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS];
+/* Union of the masks of every inline/deferred subscriber, to skip events nobody wants */
+static uint32_t hap_event_inline_mask;
+static uint32_t hap_event_deferred_mask;
+static portMUX_TYPE hap_event_bus_lock = portMUX_INITIALIZER_UNLOCKED;
+static hap_event_bus_stats_t hap_event_bus_stats;
+
+static QueueHandle_t hap_event_bus_queue;
+static StaticQueue_t hap_event_bus_queue_buf;
+static uint8_t hap_event_bus_queue_storage[CONFIG_HAP_EVENT_BUS_QUEUE_LEN * sizeof(hap_event_item_t)];
+static StaticTask_t hap_event_bus_tcb;
+static StackType_t hap_event_bus_stack[CONFIG_HAP_EVENT_BUS_STACK_SIZE / sizeof(StackType_t)];
+
+/* Recompute the subscriber masks. Call with hap_event_bus_lock held */
+static void hap_event_bus_update_masks(void)
+{
+    hap_event_inline_mask = 0;
+    hap_event_deferred_mask = 0;
+    for (int i = 0; i < CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS; i++) {
+        if (!hap_event_subs[i].subscriber) {
+            continue;
+        }
+        if (hap_event_subs[i].dispatch == HAP_EVENT_DISPATCH_DEFERRED) {
+            hap_event_deferred_mask |= hap_event_subs[i].event_mask;
+        } else {
+            hap_event_inline_mask |= hap_event_subs[i].event_mask;
+        }
+    }
+}
+
+/* Call every subscriber of one kind that wants an event, outside the lock */
+static void hap_event_bus_dispatch(hap_event_dispatch_t dispatch, hap_event_t event,
+        const void *data, size_t data_size)
+{
+    hap_event_sub_t subs[CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS];
+    int num_subs = 0;
+
+    portENTER_CRITICAL(&hap_event_bus_lock);
+    for (int i = 0; i < CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS; i++) {
+        if (hap_event_subs[i].subscriber && hap_event_subs[i].dispatch == dispatch &&
+                (hap_event_subs[i].event_mask & HAP_EVENT_MASK(event))) {
+            subs[num_subs++] = hap_event_subs[i];
+        }
+    }
+    portEXIT_CRITICAL(&hap_event_bus_lock);
+
+    for (int i = 0; i < num_subs; i++) {
+        subs[i].subscriber(event, data, data_size, subs[i].priv);
+    }
+}
+
+static void hap_event_bus_task(void *arg)
+{
+    hap_event_item_t item;
+    while (1) {
+        if (xQueueReceive(hap_event_bus_queue, &item, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        hap_event_bus_dispatch(HAP_EVENT_DISPATCH_DEFERRED, item.event,
+                item.data_size ? item.data : NULL, item.data_size);
+    }
+}
+
+/* Start the task for deferred subscribers, the first time one subscribes */
+static int hap_event_bus_start(void)
+{
+    if (hap_event_bus_queue) {
+        return HAP_SUCCESS;
+    }
+    QueueHandle_t queue = xQueueCreateStatic(CONFIG_HAP_EVENT_BUS_QUEUE_LEN, sizeof(hap_event_item_t),
+            hap_event_bus_queue_storage, &hap_event_bus_queue_buf);
+    if (!queue) {
+        return HAP_FAIL;
+    }
+    hap_event_bus_queue = queue;
+    if (!xTaskCreateStaticPinnedToCore(hap_event_bus_task, HAP_EVENT_BUS_TASK_NAME,
+                sizeof(hap_event_bus_stack), NULL, HAP_EVENT_BUS_TASK_PRIORITY, hap_event_bus_stack,
+                &hap_event_bus_tcb, HAP_PLATFORM_TASK_CORE_ID)) {
+        vQueueDelete(queue);
+        hap_event_bus_queue = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+void hap_event_bus_report(hap_event_t event, const void *data, size_t data_size)
+{
+    uint32_t bit = HAP_EVENT_MASK(event);
+
+    __atomic_fetch_add(&hap_event_bus_stats.reported, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&hap_event_inline_mask, __ATOMIC_RELAXED) & bit) {
+        hap_event_bus_dispatch(HAP_EVENT_DISPATCH_INLINE, event, data, data_size);
+    }
+    if (!(__atomic_load_n(&hap_event_deferred_mask, __ATOMIC_RELAXED) & bit) || !hap_event_bus_queue) {
+        return;
+    }
+
+    hap_event_item_t item = {
+        .event = event,
+        .data_size = (data && data_size) ? data_size : 0,
+    };
+    if (item.data_size > sizeof(item.data)) {
+        /* Event data is a string, keep it terminated */
+        item.data_size = sizeof(item.data);
+        item.data[sizeof(item.data) - 1] = '\0';
+        memcpy(item.data, data, sizeof(item.data) - 1);
+    } else if (item.data_size) {
+        memcpy(item.data, data, item.data_size);
+    }
+
+    if (xQueueSend(hap_event_bus_queue, &item, 0) != pdTRUE) {
+        __atomic_fetch_add(&hap_event_bus_stats.dropped, 1, __ATOMIC_RELAXED);
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Event bus queue full, dropped event %d", event);
+        return;
+    }
+    __atomic_fetch_add(&hap_event_bus_stats.deferred, 1, __ATOMIC_RELAXED);
+
+    uint32_t queued = (uint32_t)uxQueueMessagesWaiting(hap_event_bus_queue);
+    portENTER_CRITICAL(&hap_event_bus_lock);
+    if (queued > hap_event_bus_stats.max_queued) {
+        hap_event_bus_stats.max_queued = queued;
+    }
+    portEXIT_CRITICAL(&hap_event_bus_lock);
+}
+
+int hap_event_subscribe(uint32_t event_mask, hap_event_dispatch_t dispatch,
+        hap_event_subscriber_t subscriber, void *priv)
+{
+    if (!subscriber || !event_mask) {
+        return HAP_FAIL;
+    }
+    if (dispatch == HAP_EVENT_DISPATCH_DEFERRED && hap_event_bus_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to start the event bus task");
+        return HAP_FAIL;
+    }
+
+    int id = HAP_FAIL;
+    portENTER_CRITICAL(&hap_event_bus_lock);
+    for (int i = 0; i < CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS; i++) {
+        if (!hap_event_subs[i].subscriber) {
+            hap_event_subs[i] = (hap_event_sub_t) {
+                .subscriber = subscriber,
+                .priv = priv,
+                .event_mask = event_mask,
+                .dispatch = dispatch,
+            };
+            hap_event_bus_update_masks();
+            id = i;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&hap_event_bus_lock);
+
+    if (id == HAP_FAIL) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No room for another event subscriber");
+    }
+    return id;
+}
+
+int hap_event_unsubscribe(int id)
+{
+    if (id < 0 || id >= CONFIG_HAP_EVENT_BUS_MAX_SUBSCRIBERS) {
+        return HAP_FAIL;
+    }
+
+    int ret = HAP_FAIL;
+    portENTER_CRITICAL(&hap_event_bus_lock);
+    if (hap_event_subs[id].subscriber) {
+        memset(&hap_event_subs[id], 0, sizeof(hap_event_subs[id]));
+        hap_event_bus_update_masks();
+        ret = HAP_SUCCESS;
+    }
+    portEXIT_CRITICAL(&hap_event_bus_lock);
+    return ret;
+}
+
+void hap_event_bus_get_stats(hap_event_bus_stats_t *stats)
+{
+    portENTER_CRITICAL(&hap_event_bus_lock);
+    *stats = hap_event_bus_stats;
+    portEXIT_CRITICAL(&hap_event_bus_lock);
+}
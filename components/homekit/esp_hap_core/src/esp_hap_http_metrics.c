@@ -0,0 +1,229 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sdkconfig.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_http_server.h>
+#include <esp_hap_http_metrics.h>
+#include <esp_hap_timed_write.h>
+
+#ifdef CONFIG_HAP_HTTP_METRICS_ENABLE
+
+/* Bucket i counts handler latencies below 2^(i+1) microseconds, the last one everything above */
+#define HAP_HTTP_METRICS_BUCKETS	20
+#define HAP_HTTP_METRICS_LINE_SIZE	192
+
+typedef struct {
+	const char *uri;
+	const char *method;
+	esp_err_t (*handler)(httpd_req_t *req);
+	uint32_t requests;
+	uint32_t errors;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t max_us;
+	uint32_t buckets[HAP_HTTP_METRICS_BUCKETS];
+} hap_http_ep_metrics_t;
+
+static const char *TAG = "hap_http";
+static hap_http_ep_metrics_t hap_http_metrics[HAP_HTTP_EP_MAX];
+/* Endpoint whose handler is running. All handlers run in the single HTTP task */
+static hap_http_ep_metrics_t *hap_http_cur_ep;
+static esp_timer_handle_t hap_http_metrics_timer;
+
+static esp_err_t hap_http_metrics_handler(httpd_req_t *req)
+{
+	hap_http_ep_metrics_t *m = (hap_http_ep_metrics_t *)req->user_ctx;
+	int64_t start = esp_timer_get_time();
+
+	hap_http_cur_ep = m;
+	esp_err_t ret = m->handler(req);
+	hap_http_cur_ep = NULL;
+
+	uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+	int bucket = us ? (31 - __builtin_clz(us)) : 0;
+	if (bucket >= HAP_HTTP_METRICS_BUCKETS)
+		bucket = HAP_HTTP_METRICS_BUCKETS - 1;
+	__atomic_fetch_add(&m->requests, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->bytes_in, req->content_len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->buckets[bucket], 1, __ATOMIC_RELAXED);
+	if (ret != ESP_OK)
+		__atomic_fetch_add(&m->errors, 1, __ATOMIC_RELAXED);
+	/* Only the HTTP task writes max_us, so a plain compare is enough */
+	if (us > __atomic_load_n(&m->max_us, __ATOMIC_RELAXED))
+		__atomic_store_n(&m->max_us, us, __ATOMIC_RELAXED);
+	return ret;
+}
+
+static const char *hap_http_method_str(httpd_method_t method)
+{
+	switch (method) {
+		case HTTP_GET: return "GET";
+		case HTTP_PUT: return "PUT";
+		case HTTP_POST: return "POST";
+		default: return "?";
+	}
+}
+
+void hap_http_metrics_wrap(struct httpd_uri *uri, hap_http_ep_t ep)
+{
+	if ((ep >= HAP_HTTP_EP_MAX) || (uri->handler == hap_http_metrics_handler))
+		return;
+	hap_http_ep_metrics_t *m = &hap_http_metrics[ep];
+	m->uri = uri->uri;
+	m->method = hap_http_method_str(uri->method);
+	m->handler = uri->handler;
+	uri->handler = hap_http_metrics_handler;
+	uri->user_ctx = m;
+}
+
+void hap_http_metrics_add_bytes_out(int len)
+{
+	hap_http_ep_metrics_t *m = hap_http_cur_ep;
+	if (m && (len > 0))
+		__atomic_fetch_add(&m->bytes_out, len, __ATOMIC_RELAXED);
+}
+
+/* Upper bound of the bucket holding the given fraction (in percent) of requests */
+static uint32_t hap_http_metrics_percentile(const uint32_t *buckets, uint32_t count, int percent)
+{
+	uint32_t target = ((uint64_t)count * percent + 99) / 100;
+	uint32_t seen = 0;
+	int i;
+	for (i = 0; i < HAP_HTTP_METRICS_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen >= target)
+			break;
+	}
+	return 1U << (i + 1);
+}
+
+static int hap_http_metrics_format(const hap_http_ep_metrics_t *m, char *buf, size_t buf_size)
+{
+	uint32_t buckets[HAP_HTTP_METRICS_BUCKETS];
+	uint32_t count = 0;
+	for (int i = 0; i < HAP_HTTP_METRICS_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+	int len = snprintf(buf, buf_size, "%s %s: %u req, %u err, %u B in, %u B out",
+			m->method, m->uri,
+			(unsigned)__atomic_load_n(&m->requests, __ATOMIC_RELAXED),
+			(unsigned)__atomic_load_n(&m->errors, __ATOMIC_RELAXED),
+			(unsigned)__atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED),
+			(unsigned)__atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED));
+	if (count && (len < (int)buf_size)) {
+		len += snprintf(buf + len, buf_size - len, ", p50 <%u us, p99 <%u us, max %u us",
+				(unsigned)hap_http_metrics_percentile(buckets, count, 50),
+				(unsigned)hap_http_metrics_percentile(buckets, count, 99),
+				(unsigned)__atomic_load_n(&m->max_us, __ATOMIC_RELAXED));
+	}
+	return (len < (int)buf_size) ? len : (int)buf_size - 1;
+}
+
+#ifdef CONFIG_HAP_HTTP_METRICS_HTTP_ENDPOINT
+static esp_err_t hap_http_metrics_get(httpd_req_t *req)
+{
+	char line[HAP_HTTP_METRICS_LINE_SIZE];
+
+	httpd_resp_set_type(req, "text/plain");
+	for (int ep = 0; ep < HAP_HTTP_EP_MAX; ep++) {
+		const hap_http_ep_metrics_t *m = &hap_http_metrics[ep];
+		if (!m->uri)
+			continue;
+		int len = hap_http_metrics_format(m, line, sizeof(line) - 1);
+		line[len++] = '\n';
+		httpd_resp_send_chunk(req, line, len);
+		/* Latency histogram, one count per bucket */
+		len = snprintf(line, sizeof(line), "  buckets:");
+		for (int i = 0; (i < HAP_HTTP_METRICS_BUCKETS) && (len < (int)sizeof(line) - 12); i++) {
+			len += snprintf(line + len, sizeof(line) - len, " %u",
+					(unsigned)__atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED));
+		}
+		line[len++] = '\n';
+		httpd_resp_send_chunk(req, line, len);
+	}
+	hap_tw_stats_t tw;
+	hap_tw_get_stats(&tw);
+	int len = snprintf(line, sizeof(line),
+			"timed writes: %u pending, %u armed, %u expired, %u completed, %u rejected\n",
+			(unsigned)tw.pending, (unsigned)tw.armed, (unsigned)tw.expired,
+			(unsigned)tw.completed, (unsigned)tw.rejected);
+	httpd_resp_send_chunk(req, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static struct httpd_uri hap_http_metrics_uri = {
+	.uri = "/debug/http",
+	.method = HTTP_GET,
+	.handler = hap_http_metrics_get,
+};
+#endif /* CONFIG_HAP_HTTP_METRICS_HTTP_ENDPOINT */
+
+static void hap_http_metrics_log(void *arg)
+{
+	char line[HAP_HTTP_METRICS_LINE_SIZE];
+	for (int ep = 0; ep < HAP_HTTP_EP_MAX; ep++) {
+		const hap_http_ep_metrics_t *m = &hap_http_metrics[ep];
+		if (!m->uri || !__atomic_load_n(&m->requests, __ATOMIC_RELAXED))
+			continue;
+		hap_http_metrics_format(m, line, sizeof(line));
+		ESP_LOGI(TAG, "%s", line);
+	}
+}
+
+void hap_http_metrics_start(httpd_handle_t server)
+{
+#ifdef CONFIG_HAP_HTTP_METRICS_HTTP_ENDPOINT
+	httpd_register_uri_handler(server, &hap_http_metrics_uri);
+#endif
+	if ((CONFIG_HAP_HTTP_METRICS_LOG_PERIOD_S > 0) && !hap_http_metrics_timer) {
+		esp_timer_create_args_t args = {
+			.callback = hap_http_metrics_log,
+			.dispatch_method = ESP_TIMER_TASK,
+			.name = "hap_http_metrics",
+		};
+		if (esp_timer_create(&args, &hap_http_metrics_timer) == ESP_OK) {
+			esp_timer_start_periodic(hap_http_metrics_timer,
+					CONFIG_HAP_HTTP_METRICS_LOG_PERIOD_S * 1000000ULL);
+		}
+	}
+}
+
+void hap_http_metrics_stop(httpd_handle_t server)
+{
+#ifdef CONFIG_HAP_HTTP_METRICS_HTTP_ENDPOINT
+	httpd_unregister_uri_handler(server, "/debug/http", HTTP_GET);
+#endif
+	if (hap_http_metrics_timer) {
+		esp_timer_stop(hap_http_metrics_timer);
+		esp_timer_delete(hap_http_metrics_timer);
+		hap_http_metrics_timer = NULL;
+	}
+}
+
+#endif /* CONFIG_HAP_HTTP_METRICS_ENABLE */
@@ -29,6 +29,7 @@
 #include <esp_hap_main.h>
 #include <esp_hap_pair_setup.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_ble.h>
 #include <esp_hap_pairings.h>
 #include <esp_hap_network_io.h>
 #include <esp_hap_secure_message.h>
@@ -43,22 +44,60 @@
 #include <esp_timer.h>
 #include <hexdump.h>
 #include <lwip/sockets.h>
+#include <esp_idf_version.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
 #include <esp_http_server.h>
 #include <hap_platform_httpd.h>
 #include <hap_platform_os.h>
+#include <hap_platform_trace.h>
 #include <esp_hap_ip_services.h>
+#include <esp_hap_http_metrics.h>
+#include <esp_hap_timed_write.h>
+#include <esp_hap_scratch.h>
 
-#ifdef ESP_MFI_DEBUG_ENABLE
+/* The HTTP dumps are information level, and are built in only along with the other information */
+#if defined(CONFIG_HAP_DEBUG_PLAIN_INTERVAL_MS) && CONFIG_HAP_DEBUG_PLAIN_INTERVAL_MS > 0
+#define HAP_HTTP_DEBUG_SAMPLING
+#endif
+
+#if defined(ESP_MFI_DEBUG_ENABLE) && ESP_MFI_DEBUG_BUILT_IN(ESP_MFI_DEBUG_INFO)
+#ifdef HAP_HTTP_DEBUG_SAMPLING
+/* Each call site dumps at most once per interval, so busy sessions don't flood the console */
 #define ESP_MFI_DEBUG_PLAIN(fmt, ...)   \
-    if (http_debug) {                   \
-        printf("\e[1;35m" fmt "\e[0m", ##__VA_ARGS__); \
-    }
+    do {                                \
+        static int64_t __last_us;       \
+        if (http_debug && hap_http_debug_sample(&__last_us)) { \
+            printf("\e[1;35m" fmt "\e[0m", ##__VA_ARGS__); \
+        }                               \
+    } while (0)
+#else
+#define ESP_MFI_DEBUG_PLAIN(fmt, ...)   \
+    do {                                \
+        if (http_debug) {               \
+            printf("\e[1;35m" fmt "\e[0m", ##__VA_ARGS__); \
+        }                               \
+    } while (0)
+#endif /* HAP_HTTP_DEBUG_SAMPLING */
 #else /* ESP_MFI_DEBUG_ENABLE */
 #define ESP_MFI_DEBUG_PLAIN(fmt, ...)
 #endif /* ESP_MFI_DEBUG_ENABLE */
 
 static bool http_debug;
 
+#ifdef HAP_HTTP_DEBUG_SAMPLING
+static bool hap_http_debug_sample(int64_t *last_us)
+{
+    int64_t now = esp_timer_get_time();
+    if (*last_us && (now - *last_us) < (int64_t)CONFIG_HAP_DEBUG_PLAIN_INTERVAL_MS * 1000) {
+        return false;
+    }
+    *last_us = now;
+    return true;
+}
+#endif
+
 int hap_http_session_not_authorized(httpd_req_t *req)
 {
     char buf[50];
@@ -83,24 +122,193 @@ int hap_httpd_get_data(httpd_req_t *req, char *buffer, int len)
     return read_len;
 }
 
-static int hap_http_pair_setup_handler(httpd_req_t *req)
+#if defined(CONFIG_HAP_ASYNC_PAIRING_ENABLE) && (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0))
+#define HAP_ASYNC_PAIRING
+#endif
+
+#define HAP_PAIR_SETUP_BUF_SIZE     1200
+#define HAP_PAIR_VERIFY_BUF_SIZE    512
+
+/* Processes a pairing request whose body is already in buf. async is true if this
+ * is running on the pairing worker, after the handler has returned.
+ */
+typedef int (*hap_pair_process_t)(httpd_req_t *req, uint8_t *buf, int data_len, int bufsize, bool async);
+
+#ifdef HAP_ASYNC_PAIRING
+#define HAP_PAIR_WORKER_TASK_NAME   "hap-pair-worker"
+
+typedef struct {
+    httpd_req_t *req;
+    hap_pair_process_t process;
+    int data_len;
+    int bufsize;
+    uint8_t buf[0];
+} hap_pair_job_t;
+
+static QueueHandle_t hap_pair_worker_queue;
+static TaskHandle_t hap_pair_worker_stopper;
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+/* A static task cannot be made again until the idle task is done with the old
+ * one, so the worker and its queue are made on the first start and then kept
+ * across server restarts, idling while the server is down.
+ */
+static StackType_t hap_pair_worker_stack[CONFIG_HAP_ASYNC_PAIRING_STACK_SIZE];
+static StaticTask_t hap_pair_worker_tcb;
+static uint8_t hap_pair_worker_queue_storage[CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS * sizeof(hap_pair_job_t *)];
+static StaticQueue_t hap_pair_worker_queue_buf;
+static QueueHandle_t hap_pair_worker_static_queue;
+#endif /* CONFIG_HAP_STATIC_ALLOCATION */
+
+static void hap_pair_keep_ctx(void *ctx)
+{
+    /* The pairing code frees its own contexts */
+}
+#endif /* HAP_ASYNC_PAIRING */
+
+/* Sets the session context for a pairing request. Once the handler has returned,
+ * the context in req is not copied to the session anymore, so for requests on the
+ * pairing worker it is set on the session directly, without letting httpd free the
+ * earlier one, just like ignore_sess_ctx_changes does for the synchronous case.
+ */
+static void hap_pair_set_sess_ctx(httpd_req_t *req, bool async, void *ctx, httpd_free_ctx_fn_t free_ctx)
+{
+    hap_platform_httpd_set_sess_ctx(req, ctx, free_ctx, true);
+#ifdef HAP_ASYNC_PAIRING
+    if (async) {
+        int fd = httpd_req_to_sockfd(req);
+        httpd_sess_set_ctx(hap_priv.server, fd, httpd_sess_get_ctx(hap_priv.server, fd), hap_pair_keep_ctx);
+        httpd_sess_set_ctx(hap_priv.server, fd, ctx, free_ctx);
+    }
+#endif /* HAP_ASYNC_PAIRING */
+}
+
+#ifdef HAP_ASYNC_PAIRING
+static void hap_pair_worker_task(void *arg)
+{
+    QueueHandle_t queue = (QueueHandle_t)arg;
+    hap_pair_job_t *job;
+    while (1) {
+        if (xQueueReceive(queue, &job, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        if (!job) {
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+            xTaskNotifyGive(hap_pair_worker_stopper);
+            continue;
+#else
+            break;
+#endif
+        }
+        job->process(job->req, job->buf, job->data_len, job->bufsize, true);
+        httpd_req_async_handler_complete(job->req);
+        hap_platform_memory_free(job);
+    }
+    xTaskNotifyGive(hap_pair_worker_stopper);
+    vTaskDelete(NULL);
+}
+
+static int hap_pair_worker_start(void)
+{
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+    if (!hap_pair_worker_static_queue) {
+        QueueHandle_t queue = xQueueCreateStatic(CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS, sizeof(hap_pair_job_t *),
+                hap_pair_worker_queue_storage, &hap_pair_worker_queue_buf);
+        /* Below the HTTP Server, so that it can serve other sessions while the crypto is on */
+        if (!xTaskCreateStaticPinnedToCore(hap_pair_worker_task, HAP_PAIR_WORKER_TASK_NAME,
+                    sizeof(hap_pair_worker_stack), queue, tskIDLE_PRIORITY + 4, hap_pair_worker_stack,
+                    &hap_pair_worker_tcb, HAP_PLATFORM_TASK_CORE_ID)) {
+            vQueueDelete(queue);
+            return HAP_FAIL;
+        }
+        hap_pair_worker_static_queue = queue;
+    }
+    hap_pair_worker_queue = hap_pair_worker_static_queue;
+    return HAP_SUCCESS;
+#else
+    QueueHandle_t queue = xQueueCreate(CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS, sizeof(hap_pair_job_t *));
+    if (!queue) {
+        return HAP_FAIL;
+    }
+    /* Below the HTTP Server, so that it can serve other sessions while the crypto is on */
+    if (xTaskCreatePinnedToCore(hap_pair_worker_task, HAP_PAIR_WORKER_TASK_NAME, CONFIG_HAP_ASYNC_PAIRING_STACK_SIZE,
+                queue, tskIDLE_PRIORITY + 4, NULL, HAP_PLATFORM_TASK_CORE_ID) != pdPASS) {
+        vQueueDelete(queue);
+        return HAP_FAIL;
+    }
+    hap_pair_worker_queue = queue;
+    return HAP_SUCCESS;
+#endif /* CONFIG_HAP_STATIC_ALLOCATION */
+}
+
+static void hap_pair_worker_stop(void)
+{
+    QueueHandle_t queue = hap_pair_worker_queue;
+    if (!queue) {
+        return;
+    }
+    /* Handlers process requests themselves from here on. The worker finishes
+     * the jobs already queued before the one asking it to stop.
+     */
+    hap_pair_worker_queue = NULL;
+    hap_pair_job_t *job = NULL;
+    hap_pair_worker_stopper = xTaskGetCurrentTaskHandle();
+    xQueueSend(queue, &job, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#ifndef CONFIG_HAP_STATIC_ALLOCATION
+    vQueueDelete(queue);
+#endif
+}
+#endif /* HAP_ASYNC_PAIRING */
+
+/* Hands the request over to the pairing worker. Returns false if the request body has
+ * not been read, in which case the caller has to process it synchronously. Else, *ret
+ * is the value for the handler to return.
+ */
+static bool hap_pair_worker_submit(httpd_req_t *req, hap_pair_process_t process, int bufsize, int *ret)
+{
+#ifdef HAP_ASYNC_PAIRING
+    QueueHandle_t queue = hap_pair_worker_queue;
+    if (!queue) {
+        return false;
+    }
+    hap_pair_job_t *job = hap_platform_memory_calloc(1, sizeof(hap_pair_job_t) + bufsize);
+    if (!job) {
+        return false;
+    }
+    job->process = process;
+    job->bufsize = bufsize;
+    job->data_len = httpd_req_recv(req, (char *)job->buf, bufsize);
+    if (httpd_req_async_handler_begin(req, &job->req) == ESP_OK) {
+        if (xQueueSend(queue, &job, 0) == pdTRUE) {
+            *ret = ESP_OK;
+            return true;
+        }
+        httpd_req_async_handler_complete(job->req);
+    }
+    /* Could not hand it over, so process it right here */
+    *ret = process(req, job->buf, job->data_len, bufsize, false);
+    hap_platform_memory_free(job);
+    return true;
+#else
+    return false;
+#endif /* HAP_ASYNC_PAIRING */
+}
+
+static int hap_http_pair_setup_process(httpd_req_t *req, uint8_t *buf, int data_len, int bufsize, bool async)
 {
-	uint8_t buf[1200];
 	int ret, ret1, outlen;
 	void *ctx = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
     int fd = httpd_req_to_sockfd(req);
-    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
 	if (!ctx) {
-		if (hap_pair_setup_context_init(fd, &ctx, buf, sizeof(buf), &outlen) == HAP_SUCCESS) {
-            hap_platform_httpd_set_sess_ctx(req, ctx, hap_pair_setup_ctx_clean, true);
+		if (hap_pair_setup_context_init(fd, &ctx, buf, bufsize, &outlen) == HAP_SUCCESS) {
+            hap_pair_set_sess_ctx(req, async, ctx, hap_pair_setup_ctx_clean);
 		} else {
 			httpd_resp_set_type(req, "application/pairing+tlv8");
 			httpd_resp_send(req, (char *)buf, outlen);
 			return HAP_SUCCESS;
 		}
 	}
-	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
-	ret = hap_pair_setup_process(&ctx, buf, data_len, sizeof(buf), &outlen);
+	ret = hap_pair_setup_process(&ctx, buf, data_len, bufsize, &outlen);
 	httpd_resp_set_type(req, "application/pairing+tlv8");
 	ret1 = httpd_resp_send(req, (char *)buf, outlen);
 	if (ret != HAP_SUCCESS) {
@@ -116,7 +324,7 @@ static int hap_http_pair_setup_handler(httpd_req_t *req)
 			 * event notifications.
 			 */
 			((hap_secure_session_t *)ctx)->conn_identifier = fd;
-            hap_platform_httpd_set_sess_ctx(req, ctx, hap_free_session, true);
+            hap_pair_set_sess_ctx(req, async, ctx, hap_free_session);
             httpd_sess_set_send_override(hap_priv.server, fd, hap_httpd_send);
             httpd_sess_set_recv_override(hap_priv.server, fd, hap_httpd_recv);
 		}
@@ -126,29 +334,38 @@ static int hap_http_pair_setup_handler(httpd_req_t *req)
 	 * For both the cases, we will set the sess_ctx and free_ctx to NULL
 	 */
 	if (!ctx) {
-        hap_platform_httpd_set_sess_ctx(req, NULL, NULL, true);
+        hap_pair_set_sess_ctx(req, async, NULL, NULL);
 	}
 	return ret1;
 }
+
+static int hap_http_pair_setup_handler(httpd_req_t *req)
+{
+    int ret;
+    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
+    if (hap_pair_worker_submit(req, hap_http_pair_setup_process, HAP_PAIR_SETUP_BUF_SIZE, &ret)) {
+        return ret;
+    }
+	uint8_t buf[HAP_PAIR_SETUP_BUF_SIZE];
+	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
+	return hap_http_pair_setup_process(req, buf, data_len, sizeof(buf), false);
+}
 static struct httpd_uri hap_pair_setup = {
 	.uri = "/pair-setup",
     .method = HTTP_POST,
     .handler = hap_http_pair_setup_handler,
 };
 
-static int hap_http_pair_verify_handler(httpd_req_t *req)
+static int hap_http_pair_verify_process(httpd_req_t *req, uint8_t *buf, int data_len, int bufsize, bool async)
 {
-	uint8_t buf[512];
 	int ret, outlen;
 	void *ctx = hap_platform_httpd_get_sess_ctx(req);
-    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
 	if (!ctx) {
-		if (hap_pair_verify_context_init(&ctx, buf, sizeof(buf), &outlen) == HAP_SUCCESS) {
-            hap_platform_httpd_set_sess_ctx(req, ctx, NULL, true);
+		if (hap_pair_verify_context_init(&ctx, buf, bufsize, &outlen) == HAP_SUCCESS) {
+            hap_pair_set_sess_ctx(req, async, ctx, hap_platform_memory_free);
 		}
 	}
-	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
-	ret = hap_pair_verify_process(&ctx, buf, data_len, sizeof(buf), &outlen);
+	ret = hap_pair_verify_process(&ctx, buf, data_len, bufsize, &outlen);
 	httpd_resp_set_type(req, "application/pairing+tlv8");
 	int ret1 = httpd_resp_send(req, (char *)buf, outlen);
 	if (ret == HAP_SUCCESS) {
@@ -180,22 +397,22 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
                  ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for SO_KEEPALIVE");
             }
 
-            const int idle = 180; /* 180 sec idle before start sending probes */
+            const int idle = CONFIG_HAP_SESSION_KEEP_ALIVE_IDLE; /* Idle time before start sending probes */
             if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0) {
                  ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPIDLE");
             }
 
-            const int interval = 30; /* 30 sec between probes */
+            const int interval = CONFIG_HAP_SESSION_KEEP_ALIVE_INTERVAL; /* Time between probes */
             if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0) {
                  ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPINTVL");
             }
 
-            const int maxpkt = 4; /* Drop connection after 4 probes without response */
+            const int maxpkt = CONFIG_HAP_SESSION_KEEP_ALIVE_COUNT; /* Drop connection after these many probes without response */
             if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &maxpkt, sizeof(maxpkt)) < 0) {
                  ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "setsockopt on pair verified socket failed for TCP_KEEPCNT");
             }
 #endif
-            hap_platform_httpd_set_sess_ctx(req, ctx, hap_free_session, true);
+            hap_pair_set_sess_ctx(req, async, ctx, hap_free_session);
             httpd_sess_set_send_override(hap_priv.server, fd, hap_httpd_send);
             httpd_sess_set_recv_override(hap_priv.server, fd, hap_httpd_recv);
 		}
@@ -204,14 +421,26 @@ static int hap_http_pair_verify_handler(httpd_req_t *req)
             if (req->free_ctx) {
                 req->free_ctx(req->sess_ctx);
             } else {
-                free(req->sess_ctx);
+                hap_platform_memory_free(req->sess_ctx);
             }
         }
-        hap_platform_httpd_set_sess_ctx(req, NULL, NULL, true);
+        hap_pair_set_sess_ctx(req, async, NULL, NULL);
     }
 	return ret1;
 }
 
+static int hap_http_pair_verify_handler(httpd_req_t *req)
+{
+    int ret;
+    ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
+    if (hap_pair_worker_submit(req, hap_http_pair_verify_process, HAP_PAIR_VERIFY_BUF_SIZE, &ret)) {
+        return ret;
+    }
+	uint8_t buf[HAP_PAIR_VERIFY_BUF_SIZE];
+	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
+	return hap_http_pair_verify_process(req, buf, data_len, sizeof(buf), false);
+}
+
 static struct httpd_uri hap_pair_verify = {
 	.uri = "/pair-verify",
     .method = HTTP_POST,
@@ -219,7 +448,7 @@ static struct httpd_uri hap_pair_verify = {
 };
 
 static int hap_add_char_val_json(hap_char_format_t format, char *key,
-		hap_val_t *val, json_gen_str_t *jptr)
+		const hap_val_t *val, json_gen_str_t *jptr)
 {
 	switch (format) {
 		case HAP_CHAR_FORMAT_BOOL : {
@@ -262,8 +491,7 @@ static int hap_add_char_val_json(hap_char_format_t format, char *key,
                         esp_mfi_base64_encode((char *)buf, buflen, tmp, tmp_len, &tmp_len);
                         buflen -= buflen;
                     }
-                    tmp[tmp_len] = 0;
-                    json_gen_add_to_long_string(jptr, tmp);
+                    json_gen_add_to_long_string_len(jptr, tmp, tmp_len);
                 }
                 json_gen_end_long_string(jptr);
             } else {
@@ -279,7 +507,7 @@ static int hap_add_char_val_json(hap_char_format_t format, char *key,
 
 static int hap_add_char_format_json(__hap_char_t *hc, json_gen_str_t *jptr)
 {
-	switch (hc->format) {
+	switch (hc->desc->format) {
 		case HAP_CHAR_FORMAT_UINT8:
 			return json_gen_obj_set_string(jptr, "format", "uint8");
 		case HAP_CHAR_FORMAT_UINT16:
@@ -306,33 +534,33 @@ static int hap_add_char_format_json(__hap_char_t *hc, json_gen_str_t *jptr)
 
 static int hap_add_char_type(__hap_char_t *hc, json_gen_str_t *jptr)
 {
-	return json_gen_obj_set_string(jptr, "type", (char *)hc->type_uuid);
+	return json_gen_obj_set_string(jptr, "type", (char *)hc->desc->type_uuid);
 }
 
 static int hap_add_char_meta(__hap_char_t *hc, json_gen_str_t *jptr)
 {
 	hap_add_char_format_json(hc, jptr);
 
-	if (hc->constraint_flags & HAP_CHAR_MIN_FLAG)
-		hap_add_char_val_json(hc->format, "minValue", &hc->min, jptr);
-	if (hc->constraint_flags & HAP_CHAR_MAX_FLAG)
-		hap_add_char_val_json(hc->format, "maxValue", &hc->max, jptr);
-	if (hc->constraint_flags & HAP_CHAR_STEP_FLAG)
-		hap_add_char_val_json(hc->format, "minStep", &hc->step, jptr);
+	if (hc->desc->constraint_flags & HAP_CHAR_MIN_FLAG)
+		hap_add_char_val_json(hc->desc->format, "minValue", &hc->desc->min, jptr);
+	if (hc->desc->constraint_flags & HAP_CHAR_MAX_FLAG)
+		hap_add_char_val_json(hc->desc->format, "maxValue", &hc->desc->max, jptr);
+	if (hc->desc->constraint_flags & HAP_CHAR_STEP_FLAG)
+		hap_add_char_val_json(hc->desc->format, "minStep", &hc->desc->step, jptr);
 
 	/* maxLen and maxDataLen are constraints for "string" and "data" format
 	 * of characteristics, respectively. However, the constraints themselves
 	 * are integers. So, we pass the format as HAP_CHAR_FORMAT_INT
 	 */
-	if (hc->constraint_flags & HAP_CHAR_MAXLEN_FLAG)
-		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxLen", &hc->max, jptr);
-	if (hc->constraint_flags & HAP_CHAR_MAXDATALEN_FLAG)
-		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxDataLen", &hc->max, jptr);
+	if (hc->desc->constraint_flags & HAP_CHAR_MAXLEN_FLAG)
+		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxLen", &hc->desc->max, jptr);
+	if (hc->desc->constraint_flags & HAP_CHAR_MAXDATALEN_FLAG)
+		hap_add_char_val_json(HAP_CHAR_FORMAT_INT, "maxDataLen", &hc->desc->max, jptr);
 
-	if (hc->description)
-		json_gen_obj_set_string(jptr, "description", hc->description);
-	if (hc->unit)
-		json_gen_obj_set_string(jptr, "unit", hc->unit);
+	if (hc->desc->description)
+		json_gen_obj_set_string(jptr, "description", (char *)hc->desc->description);
+	if (hc->desc->unit)
+		json_gen_obj_set_string(jptr, "unit", (char *)hc->desc->unit);
 
 	return HAP_SUCCESS;
 }
@@ -340,19 +568,19 @@ static int hap_add_char_meta(__hap_char_t *hc, json_gen_str_t *jptr)
 static int hap_add_char_perms(__hap_char_t *hc, json_gen_str_t *jptr)
 {
 	json_gen_push_array(jptr, "perms");
-	if (hc->permission & HAP_CHAR_PERM_PR)
+	if (hc->desc->permission & HAP_CHAR_PERM_PR)
 		json_gen_arr_set_string(jptr, "pr");
-	if (hc->permission & HAP_CHAR_PERM_PW)
+	if (hc->desc->permission & HAP_CHAR_PERM_PW)
 		json_gen_arr_set_string(jptr, "pw");
-	if (hc->permission & HAP_CHAR_PERM_EV)
+	if (hc->desc->permission & HAP_CHAR_PERM_EV)
 		json_gen_arr_set_string(jptr, "ev");
-	if (hc->permission & HAP_CHAR_PERM_AA)
+	if (hc->desc->permission & HAP_CHAR_PERM_AA)
 		json_gen_arr_set_string(jptr, "aa");
-	if (hc->permission & HAP_CHAR_PERM_TW)
+	if (hc->desc->permission & HAP_CHAR_PERM_TW)
 		json_gen_arr_set_string(jptr, "tw");
-	if (hc->permission & HAP_CHAR_PERM_HD)
+	if (hc->desc->permission & HAP_CHAR_PERM_HD)
 		json_gen_arr_set_string(jptr, "hd");
-	if (hc->permission & HAP_CHAR_PERM_WR)
+	if (hc->desc->permission & HAP_CHAR_PERM_WR)
 		json_gen_arr_set_string(jptr, "wr");
 	json_gen_pop_array(jptr);
 	return HAP_SUCCESS;
@@ -369,65 +597,97 @@ static int hap_add_char_ev(__hap_char_t *hc, json_gen_str_t *jptr, uint8_t sessi
 
 static int hap_add_char_valid_vals(__hap_char_t *hc, json_gen_str_t *jptr)
 {
-    if (hc->valid_vals) {
+    if (hc->desc->valid_vals) {
         json_gen_push_array(jptr, "valid-values");
         int i;
-        for (i = 0; i < hc->valid_vals_cnt; i++) {
-            json_gen_arr_set_int(jptr, hc->valid_vals[i]);
+        for (i = 0; i < hc->desc->valid_vals_cnt; i++) {
+            json_gen_arr_set_int(jptr, hc->desc->valid_vals[i]);
         }
         json_gen_pop_array(jptr);
     }
-    if (hc->valid_vals_range) {
+    if (hc->desc->constraint_flags & HAP_CHAR_VALID_RANGE_FLAG) {
         json_gen_push_array(jptr, "valid-values-range");
-        json_gen_arr_set_int(jptr, hc->valid_vals_range[0]);
-        json_gen_arr_set_int(jptr, hc->valid_vals_range[1]);
+        json_gen_arr_set_int(jptr, hc->desc->valid_vals_range[0]);
+        json_gen_arr_set_int(jptr, hc->desc->valid_vals_range[1]);
         json_gen_pop_array(jptr);
     }
     return HAP_SUCCESS;
 }
 
-static int hap_prepare_char_db(__hap_char_t *hc, json_gen_str_t *jptr, int session_index)
+/* The static part of the /accessories database (everything except the
+ * characteristic values and the per-session "ev" flags) is serialized once
+ * and cached until the config number changes. The text is split right before
+ * the live keys of every characteristic object, and the live fragment for
+ * that characteristic is spliced in at the split while sending.
+ */
+typedef struct {
+    int offset;
+    __hap_char_t *hc;
+    /* Snapshot of the live keys, taken for each request */
+    hap_val_t val;
+    bool ev;
+} hap_db_split_t;
+
+typedef struct {
+    char *text;
+    int len;
+    hap_db_split_t *splits;
+    int split_cnt;
+    uint32_t config_num;
+} hap_db_cache_t;
+
+static hap_db_cache_t hap_db_cache;
+static volatile bool hap_db_cache_stale = true;
+
+#define HAP_DB_GEN_BUF_SIZE     256
+
+/* Both passes of the cache generation go through this. The first one only
+ * counts (text and splits are NULL), the second one fills the allocated buffers.
+ */
+static void hap_db_cache_flush(char *data, void *priv)
 {
-	json_gen_start_object(jptr);
-
-	json_gen_obj_set_int(jptr, "iid", hc->iid);
+    hap_db_cache_t *cache = (hap_db_cache_t *)priv;
+    int len = strlen(data);
+    if (cache->text) {
+        memcpy(cache->text + cache->len, data, len);
+    }
+    cache->len += len;
+}
 
-    /* If the Update API has not been called from the service read routine,
-     * reset the owner controller value.
-     * Else, the controller will  miss the next notification.
-     */
-    if (!hc->update_called)   {
-        hc->owner_ctrl = 0;
+static void hap_db_cache_add_split(hap_db_cache_t *cache, __hap_char_t *hc)
+{
+    /* The live fragment is generated without a leading comma */
+    hap_db_cache_flush(",", cache);
+    if (cache->splits) {
+        cache->splits[cache->split_cnt].offset = cache->len;
+        cache->splits[cache->split_cnt].hc = hc;
     }
-    hc->update_called = false;
+    cache->split_cnt++;
+}
 
-	if (hc->permission & HAP_CHAR_PERM_PR) {
-        if (hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
-            json_gen_obj_set_null(jptr, "value");
-        } else if (hc->permission & HAP_CHAR_PERM_WR) {
-            /* TODO: Check what to do for bool/int/float types of control
-             * characteristics with "Write Response" permission.
-             * Ideally, a NULL should have been acceptable as it is independent
-             * of actual datatype, but HAT does not accept it for Wi-Fi
-             * configuration.
-             */
-            json_gen_obj_set_string(jptr, "value", "");
-        } else {
-            hap_add_char_val_json(hc->format, "value", &hc->val, jptr);
-        }
-	}
+static void hap_prepare_char_static_db(__hap_char_t *hc, json_gen_str_t *jptr,
+        char *buf, int bufsize, hap_db_cache_t *cache)
+{
+	json_gen_start_object(jptr);
+	json_gen_obj_set_int(jptr, "iid", hc->iid);
 	hap_add_char_type(hc, jptr);
 	hap_add_char_perms(hc, jptr);
-	hap_add_char_ev(hc, jptr, session_index);
 	hap_add_char_meta(hc, jptr);
     hap_add_char_valid_vals(hc, jptr);
 
-	json_gen_end_object(jptr);
+    /* Flush everything generated so far and leave the object open for the
+     * live fragment. Restarting the generator is fine, since the next thing
+     * added is the end of the object, which does not need a comma.
+     */
+    json_gen_str_end(jptr);
+    hap_db_cache_add_split(cache, hc);
+    json_gen_str_start(jptr, buf, bufsize, hap_db_cache_flush, cache);
 
-	return HAP_SUCCESS;
+	json_gen_end_object(jptr);
 }
 
-static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, int session_index)
+static void hap_prepare_serv_static_db(__hap_serv_t *hs, json_gen_str_t *jptr,
+        char *buf, int bufsize, hap_db_cache_t *cache)
 {
 	json_gen_start_object(jptr);
 	json_gen_obj_set_int(jptr, "iid", hs->iid);
@@ -447,86 +707,90 @@ static int hap_prepare_serv_db(__hap_serv_t *hs, json_gen_str_t *jptr, int sessi
     }
 
 	json_gen_push_array(jptr, "characteristics");
-    int char_cnt = 0;
 	hap_char_t *hc;
     for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-        if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
-            char_cnt++;
-        }
-    }
-    if (char_cnt) {
-        hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
-        if (!read_arr) {
-            return HAP_FAIL;
-        }
-
-        hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
-        if (!status_codes) {
-            hap_platform_memory_free(read_arr);
-            return HAP_FAIL;
-        }
-
-        /* Create an array of characteristics to read, and then read them in one go */
-        char_cnt = 0;
-        for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-            if (((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR) {
-                hap_char_set_owner_ctrl(hc, session_index);
-                ((__hap_char_t *)hc)->update_called = false;
-                read_arr[char_cnt].hc = hc;
-                status_codes[char_cnt] = HAP_STATUS_SUCCESS;
-                read_arr[char_cnt].status = &status_codes[char_cnt];
-                char_cnt++;
-            }
-        }
-
-        hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL);
-        hap_platform_memory_free(read_arr);
-        hap_platform_memory_free(status_codes);
-    }
-    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
-		hap_prepare_char_db((__hap_char_t *)hc, jptr, session_index);
+		hap_prepare_char_static_db((__hap_char_t *)hc, jptr, buf, bufsize, cache);
 	}
-
 	json_gen_pop_array(jptr);
 	json_gen_end_object(jptr);
-	return HAP_SUCCESS;
 }
 
-static int hap_prepare_acc_db(__hap_acc_t *ha, json_gen_str_t *jptr, int session_index)
+static void hap_prepare_acc_static_db(__hap_acc_t *ha, json_gen_str_t *jptr,
+        char *buf, int bufsize, hap_db_cache_t *cache)
 {
 	json_gen_start_object(jptr);
 	json_gen_obj_set_int(jptr, "aid", ha->aid);
 	json_gen_push_array(jptr, "services");
 	hap_serv_t *hs;
 	for (hs = hap_acc_get_first_serv((hap_acc_t *)ha); hs; hs = hap_serv_get_next(hs)) {
-		hap_prepare_serv_db((__hap_serv_t *)hs, jptr, session_index);
+		hap_prepare_serv_static_db((__hap_serv_t *)hs, jptr, buf, bufsize, cache);
 	}
 	json_gen_pop_array(jptr);
 	json_gen_end_object(jptr);
-	return HAP_SUCCESS;
 }
 
-static int hap_prepare_json_database(char *buf, int bufsize, json_gen_flush_cb_t flush_cb, httpd_req_t *req)
+static void hap_db_cache_generate(hap_db_cache_t *cache)
 {
-    if (!req) {
-        return HAP_FAIL;
-    }
-    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
-    if (!session) {
-        return HAP_FAIL;
-    }
+    char buf[HAP_DB_GEN_BUF_SIZE];
 	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, buf, bufsize, flush_cb, req);
+    cache->len = 0;
+    cache->split_cnt = 0;
+	json_gen_str_start(&jstr, buf, sizeof(buf), hap_db_cache_flush, cache);
 	json_gen_start_object(&jstr);
 	json_gen_push_array(&jstr, "accessories");
 	hap_acc_t *ha;
 	for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
-		hap_prepare_acc_db((__hap_acc_t *)ha, &jstr, hap_get_ctrl_session_index(session));
+		hap_prepare_acc_static_db((__hap_acc_t *)ha, &jstr, buf, sizeof(buf), cache);
 	}
 	json_gen_pop_array(&jstr);
 	json_gen_end_object(&jstr);
 	json_gen_str_end(&jstr);
-	return HAP_SUCCESS;
+}
+
+static void hap_db_cache_free(hap_db_cache_t *cache)
+{
+    if (cache->text) {
+        hap_platform_memory_free(cache->text);
+    }
+    if (cache->splits) {
+        hap_platform_memory_free(cache->splits);
+    }
+    memset(cache, 0, sizeof(hap_db_cache_t));
+}
+
+static int hap_db_cache_build(hap_db_cache_t *cache)
+{
+    hap_db_cache_free(cache);
+    /* Clear the flag before reading the database, so that an invalidation
+     * racing with the generation causes another rebuild on the next request.
+     */
+    hap_db_cache_stale = false;
+    uint32_t config_num = hap_priv.config_num;
+
+    /* Sizing pass */
+    hap_db_cache_generate(cache);
+    int len = cache->len;
+    int split_cnt = cache->split_cnt;
+    cache->text = hap_platform_memory_malloc_caps(len, HAP_MEM_CAPS_BULK);
+    if (split_cnt) {
+        cache->splits = hap_platform_memory_calloc(split_cnt, sizeof(hap_db_split_t));
+    }
+    if (!cache->text || (split_cnt && !cache->splits)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate accessory database cache");
+        hap_db_cache_free(cache);
+        hap_db_cache_stale = true;
+        return HAP_FAIL;
+    }
+    hap_db_cache_generate(cache);
+    cache->config_num = config_num;
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Cached accessory database: %d bytes, %d characteristics",
+            cache->len, cache->split_cnt);
+    return HAP_SUCCESS;
+}
+
+void hap_http_invalidate_acc_db()
+{
+    hap_db_cache_stale = true;
 }
 
 static void hap_http_json_flush_chunk(char *data, void *priv)
@@ -535,20 +799,344 @@ static void hap_http_json_flush_chunk(char *data, void *priv)
 	httpd_resp_send_chunk((httpd_req_t *)priv, data, strlen(data));
 }
 
+/* Constant header prefixes for hap+json responses. Only the Content-Length
+ * value is filled in per response.
+ */
+#define HAP_HDR_HAP_JSON_TAIL   "Content-Type: application/hap+json\r\n"   \
+        "Content-Length: "
+#define HAP_EVENT_200_HDR       "EVENT/1.0 " HTTPD_200 "\r\n" HAP_HDR_HAP_JSON_TAIL
+#define HAP_HTTP_200_HDR        "HTTP/1.1 " HTTPD_200 "\r\n" HAP_HDR_HAP_JSON_TAIL
+#define HAP_HTTP_207_HDR        "HTTP/1.1 " HTTPD_207 "\r\n" HAP_HDR_HAP_JSON_TAIL
+#define HAP_HTTP_204_RESP       "HTTP/1.1 " HTTPD_204 "\r\n\r\n"
+/* Room to leave in front of a body for any of the above, with up to 10 length
+ * digits and the blank line
+ */
+#define HAP_RESP_HDR_MAX        (sizeof(HAP_HTTP_207_HDR) - 1 + 10 + 4)
+
+/* Writes the header backwards from the start of the body, so that both end up
+ * contiguous in the same buffer. Returns the start of the header.
+ */
+static char *hap_resp_hdr_prepend(char *body, const char *prefix, int prefix_len, int body_len)
+{
+    char *p = body - 4;
+    memcpy(p, "\r\n\r\n", 4);
+    unsigned int len = body_len;
+    do {
+        *--p = '0' + (len % 10);
+        len /= 10;
+    } while (len);
+    p -= prefix_len;
+    memcpy(p, prefix, prefix_len);
+    return p;
+}
+#define HAP_RESP_HDR_PREPEND(body, prefix, body_len) \
+    hap_resp_hdr_prepend(body, prefix, sizeof(prefix) - 1, body_len)
+
+/* For responses which normally fit in one JSON buffer. Those go out as
+ * header and body in a single send, with chunked encoding used only after
+ * the buffer had to be flushed once.
+ */
+typedef struct {
+    httpd_req_t *req;
+    bool chunked;
+    bool ending;
+} hap_json_resp_t;
+
+static void hap_http_json_flush_deferred(char *data, void *priv)
+{
+    hap_json_resp_t *resp = (hap_json_resp_t *)priv;
+    if (resp->ending && !resp->chunked) {
+        /* Everything fit. Leave it in the buffer for hap_json_resp_send() */
+        return;
+    }
+    resp->chunked = true;
+    hap_http_json_flush_chunk(data, resp->req);
+}
+
+/* Ends the JSON string and sends out whatever is left of the response */
+static void hap_json_resp_end(hap_json_resp_t *resp, json_gen_str_t *jstr, bool status_200)
+{
+    char *body = jstr->buf;
+    int body_len = jstr->free_ptr - jstr->buf;
+    resp->ending = true;
+    json_gen_str_end(jstr);
+    if (resp->chunked) {
+        /* This indicates the last chunk */
+        httpd_resp_send_chunk(resp->req, NULL, 0);
+        return;
+    }
+    ESP_MFI_DEBUG_PLAIN("%.*s", body_len, body);
+    char *hdr = status_200 ? HAP_RESP_HDR_PREPEND(body, HAP_HTTP_200_HDR, body_len) :
+            HAP_RESP_HDR_PREPEND(body, HAP_HTTP_207_HDR, body_len);
+    httpd_send(resp->req, hdr, body + body_len - hdr);
+}
+
+/* Runs the service read routines, so that the values spliced into the
+ * cached database are fresh.
+ */
+static int hap_serv_read_db_chars(__hap_serv_t *hs, int session_index)
+{
+    int char_cnt = 0;
+	hap_char_t *hc;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
+        if (((__hap_char_t *)hc)->desc->permission & HAP_CHAR_PERM_PR) {
+            char_cnt++;
+        }
+    }
+    if (!char_cnt) {
+        return HAP_SUCCESS;
+    }
+    hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
+    if (!read_arr) {
+        return HAP_FAIL;
+    }
+
+    hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
+    if (!status_codes) {
+        hap_platform_memory_free(read_arr);
+        return HAP_FAIL;
+    }
+
+    /* Create an array of characteristics to read, and then read them in one go */
+    char_cnt = 0;
+    for (hc = hap_serv_get_first_char((hap_serv_t *)hs); hc; hc = hap_char_get_next(hc)) {
+        if (((__hap_char_t *)hc)->desc->permission & HAP_CHAR_PERM_PR) {
+            hap_char_set_owner_ctrl(hc, session_index);
+            ((__hap_char_t *)hc)->update_called = false;
+            read_arr[char_cnt].hc = hc;
+            status_codes[char_cnt] = HAP_STATUS_SUCCESS;
+            read_arr[char_cnt].status = &status_codes[char_cnt];
+            char_cnt++;
+        }
+    }
+
+    hs->bulk_read(&read_arr[0], char_cnt, hs->priv, NULL);
+    hap_platform_memory_free(read_arr);
+    hap_platform_memory_free(status_codes);
+    return HAP_SUCCESS;
+}
+
+/* Response writer. The buffer holds exactly one HAP network frame, so every
+ * send except the last one hands a full frame to hap_httpd_send() for
+ * encryption. Without a request, it only counts the bytes, which is used
+ * for sizing the Content-Length.
+ */
+typedef struct {
+    httpd_req_t *req;
+    int total;
+    int len;
+    char *buf;
+} hap_db_writer_t;
+
+#define HAP_DB_WRITE_LITERAL(writer, str)   hap_db_write(writer, str, sizeof(str) - 1)
+
+static void hap_db_writer_flush(hap_db_writer_t *writer)
+{
+    if (writer->len) {
+        ESP_MFI_DEBUG_PLAIN("%.*s", writer->len, writer->buf);
+        httpd_send(writer->req, writer->buf, writer->len);
+        writer->len = 0;
+    }
+}
+
+static void hap_db_write(hap_db_writer_t *writer, const char *data, int len)
+{
+    writer->total += len;
+    if (!writer->req) {
+        return;
+    }
+    while (len) {
+        int copy_len = HAP_MAX_NW_FRAME_SIZE - writer->len;
+        if (copy_len > len) {
+            copy_len = len;
+        }
+        memcpy(writer->buf + writer->len, data, copy_len);
+        writer->len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+        if (writer->len == HAP_MAX_NW_FRAME_SIZE) {
+            hap_db_writer_flush(writer);
+        }
+    }
+}
+
+/* Same output as hap_add_char_val_json(), but written straight into the frame */
+static void hap_db_write_val(hap_db_writer_t *writer, hap_char_format_t format, hap_val_t *val)
+{
+    char tmp[100];
+    int len;
+	switch (format) {
+		case HAP_CHAR_FORMAT_BOOL : {
+            if (val->b) {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":true");
+            } else {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":false");
+            }
+			break;
+		}
+		case HAP_CHAR_FORMAT_UINT8:
+		case HAP_CHAR_FORMAT_UINT16:
+		case HAP_CHAR_FORMAT_UINT32:
+		case HAP_CHAR_FORMAT_INT: {
+            len = snprintf(tmp, sizeof(tmp), ",\"value\":%d", val->i);
+            hap_db_write(writer, tmp, len);
+			break;
+		}
+		case HAP_CHAR_FORMAT_FLOAT : {
+            len = snprintf(tmp, sizeof(tmp), ",\"value\":%.*f", JSON_FLOAT_PRECISION, val->f);
+            hap_db_write(writer, tmp, len);
+			break;
+		}
+		case HAP_CHAR_FORMAT_STRING : {
+            if (val->s) {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":\"");
+                hap_db_write(writer, val->s, strlen(val->s));
+                HAP_DB_WRITE_LITERAL(writer, "\"");
+            } else {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":null");
+            }
+			break;
+		}
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8: {
+            if (val->d.buf) {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":\"");
+                uint8_t *buf = val->d.buf;
+                uint32_t buflen = val->d.buflen;
+                while (buflen) {
+                    int chunk_len = buflen > 60 ? 60 : buflen;
+                    len = sizeof(tmp);
+                    esp_mfi_base64_encode((char *)buf, chunk_len, tmp, len, &len);
+                    hap_db_write(writer, tmp, len);
+                    buflen -= chunk_len;
+                    buf += chunk_len;
+                }
+                HAP_DB_WRITE_LITERAL(writer, "\"");
+            } else {
+                HAP_DB_WRITE_LITERAL(writer, ",\"value\":null");
+            }
+            break;
+        }
+		default :
+			break;
+	}
+}
+
+/* Takes a snapshot of the live keys, so that the sizing and the sending pass
+ * see the same values even if the application updates them in between.
+ */
+static void hap_db_snapshot_live(hap_db_split_t *split, int session_index)
+{
+    __hap_char_t *hc = split->hc;
+    /* If the Update API has not been called from the service read routine,
+     * reset the owner controller value.
+     * Else, the controller will  miss the next notification.
+     */
+    if (!hc->update_called)   {
+        hc->owner_ctrl = 0;
+    }
+    hc->update_called = false;
+    split->ev = hap_char_is_ctrl_subscribed((hap_char_t *)hc, session_index);
+    split->val = hc->val;
+}
+
+static void hap_db_write_live(hap_db_writer_t *writer, hap_db_split_t *split)
+{
+    __hap_char_t *hc = split->hc;
+    if (split->ev) {
+        HAP_DB_WRITE_LITERAL(writer, "\"ev\":true");
+    } else {
+        HAP_DB_WRITE_LITERAL(writer, "\"ev\":false");
+    }
+	if (hc->desc->permission & HAP_CHAR_PERM_PR) {
+        if (hc->desc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
+            HAP_DB_WRITE_LITERAL(writer, ",\"value\":null");
+        } else if (hc->desc->permission & HAP_CHAR_PERM_WR) {
+            /* TODO: Check what to do for bool/int/float types of control
+             * characteristics with "Write Response" permission.
+             * Ideally, a NULL should have been acceptable as it is independent
+             * of actual datatype, but HAT does not accept it for Wi-Fi
+             * configuration.
+             */
+            HAP_DB_WRITE_LITERAL(writer, ",\"value\":\"\"");
+        } else {
+            hap_db_write_val(writer, hc->desc->format, &split->val);
+        }
+	}
+}
+
+static void hap_db_write_body(hap_db_writer_t *writer, hap_db_cache_t *cache)
+{
+    int offset = 0;
+    int i;
+    for (i = 0; i < cache->split_cnt; i++) {
+        hap_db_write(writer, cache->text + offset, cache->splits[i].offset - offset);
+        hap_db_write_live(writer, &cache->splits[i]);
+        offset = cache->splits[i].offset;
+    }
+    hap_db_write(writer, cache->text + offset, cache->len - offset);
+}
+
+/* The response is not chunked. Its length is known up front from a sizing
+ * pass, and the headers and the body are packed into the same frames.
+ */
+static int hap_prepare_json_database(httpd_req_t *req)
+{
+    if (!req) {
+        return HAP_FAIL;
+    }
+    hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
+    if (!session) {
+        return HAP_FAIL;
+    }
+    hap_db_cache_t *cache = &hap_db_cache;
+    if (hap_db_cache_stale || !cache->text || (cache->config_num != hap_priv.config_num)) {
+        if (hap_db_cache_build(cache) != HAP_SUCCESS) {
+            return HAP_FAIL;
+        }
+    }
+    int session_index = hap_get_ctrl_session_index(session);
+	hap_acc_t *ha;
+	for (ha = hap_get_first_acc(); ha; ha = hap_acc_get_next(ha)) {
+        hap_serv_t *hs;
+        for (hs = hap_acc_get_first_serv(ha); hs; hs = hap_serv_get_next(hs)) {
+            hap_serv_read_db_chars((__hap_serv_t *)hs, session_index);
+        }
+	}
+    int i;
+    for (i = 0; i < cache->split_cnt; i++) {
+        hap_db_snapshot_live(&cache->splits[i], session_index);
+    }
+
+    hap_db_writer_t writer = {0};
+    hap_db_write_body(&writer, cache);
+    char hdr[HAP_RESP_HDR_MAX];
+    char *hdr_start = HAP_RESP_HDR_PREPEND(hdr + sizeof(hdr), HAP_HTTP_200_HDR, writer.total);
+
+    writer.buf = hap_scratch_alloc(HAP_MAX_NW_FRAME_SIZE);
+    if (!writer.buf) {
+        return HAP_FAIL;
+    }
+    writer.req = req;
+    writer.total = 0;
+    hap_db_write(&writer, hdr_start, hdr + sizeof(hdr) - hdr_start);
+    hap_db_write_body(&writer, cache);
+    hap_db_writer_flush(&writer);
+	return HAP_SUCCESS;
+}
+
 static int hap_http_get_accessories(httpd_req_t *req)
 {
-	char buf[1000];
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
     hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
     if (!hap_is_req_secure(session)) {
         return hap_http_session_not_authorized(req);
     }
-	httpd_resp_set_type(req, "application/hap+json");
     ESP_MFI_DEBUG_PLAIN("Generating HTTP Response\n");
-    /* Using chunked encoding since the response can be large, especially for bridges */
-	hap_prepare_json_database(buf, sizeof(buf), hap_http_json_flush_chunk, req);
-    /* This indicates the last chunk */
-    httpd_resp_send_chunk(req, NULL, 0);
+	if (hap_prepare_json_database(req) != HAP_SUCCESS) {
+        httpd_resp_send_500(req);
+    }
+    hap_scratch_reset();
     ESP_MFI_DEBUG_PLAIN("\n");
 
     hap_report_event(HAP_EVENT_GET_ACC_COMPLETED, NULL, 0);
@@ -587,273 +1175,161 @@ static void hap_set_char_report_write_response(bool *include_status, json_gen_st
     json_gen_obj_set_int(jstr, "aid", aid);
     json_gen_obj_set_int(jstr, "iid", iid);
     json_gen_obj_set_int(jstr, "status", 0);
-    hap_add_char_val_json(hc->format, "value", &hc->val, jstr);
+    hap_add_char_val_json(hc->desc->format, "value", &hc->val, jstr);
     json_gen_end_object(jstr);
 }
 
-static void remove_escape_char(char *data, uint32_t *buf_len)
+/* PUT /characteristics is parsed as it is received (see json_stream_feed()),
+ * and the writes are handed to the service write routines in batches of
+ * consecutive characteristics of the same service. Only the characteristic
+ * object being received has to be in memory, not the whole body.
+ */
+#define HAP_SET_CHAR_BATCH_CNT      8
+/* The successful writes are remembered until the first error (or write
+ * response), since a multi-status response has to include them as well.
+ * Beyond this count, they are remembered on the heap.
+ */
+#define HAP_SET_CHAR_DONE_CNT       32
+#define HAP_SET_CHAR_REST_SIZE      128
+/* Room for 32 tokens, which is plenty for a single characteristic object */
+#define HAP_SET_CHAR_TOK_BUF_SIZE   (32 * 5 * sizeof(int))
+
+typedef struct {
+    httpd_req_t *req;
+    hap_secure_session_t *session;
+    json_gen_str_t jstr;
+    /* Set once the multi-status response has been started */
+    bool include_status;
+    /* Set once every characteristic has to get a status in the response */
+    bool report_all;
+    /* A prepare came first, so the writes wait until the pid has been seen */
+    bool timed;
+    bool req_tw;
+    bool valid_tw;
+    int elem_cnt;
+    /* Timed write taken over from the preceding prepare, if any */
+    hap_tw_state_t tw_state;
+    uint64_t tw_pid;
+    int64_t tw_deadline_us;
+    int batch_cnt;
+    hap_write_data_t batch[HAP_SET_CHAR_BATCH_CNT];
+    hap_status_t batch_status[HAP_SET_CHAR_BATCH_CNT];
+    int done_cnt;
+    int done_size;
+    hap_char_t **done;
+    hap_char_t *done_buf[HAP_SET_CHAR_DONE_CNT];
+} hap_set_char_ctx_t;
+
+static int hap_char_get_aid(hap_char_t *hc)
 {
-    char *target_data = data;
-    uint32_t len = *buf_len;
-    while (len--) {
-        if (*data == '\\') {
-            data++;
-            (*buf_len)--;
-            len--;
-        }
-        *target_data++ = *data++;
-    }
+    return ((__hap_acc_t *)hap_serv_get_parent(hap_char_get_parent(hc)))->aid;
 }
 
-static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_size,
-		httpd_req_t *req)
+static void hap_set_char_free_done(hap_set_char_ctx_t *ctx)
 {
-	int cnt = 0, char_cnt = 0, i;
-	bool include_status = false;
-    uint64_t pid;
-    bool valid_tw = false;
-    bool req_tw = false;
-	hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
-    if (!session)
-        return HAP_FAIL;
+    if (ctx->done != ctx->done_buf) {
+        hap_platform_memory_free(ctx->done);
+    }
+    ctx->done = ctx->done_buf;
+    ctx->done_size = HAP_SET_CHAR_DONE_CNT;
+    ctx->done_cnt = 0;
+}
 
-    int64_t cur_time = esp_timer_get_time() / 1000;
-    int64_t prepare_time = session->prepare_time;
-    if (prepare_time) {
-        /* If prepare time is non zero, it means that a prepare was received
-         * before this request, and so this write needs to be timed write
-         */
-        req_tw = true;
-        /* Reset prepare_time to 0, since a prepare is valid only for the immediate
-         * following write
-         */
-        session->prepare_time = 0;
+/* Switches to reporting a status for every characteristic, starting with
+ * the ones already written successfully
+ */
+static void hap_set_char_start_report_all(hap_set_char_ctx_t *ctx)
+{
+    if (ctx->report_all) {
+        return;
     }
-    if (json_obj_get_int64(jctx, "pid", (int64_t *)&pid) == OS_SUCCESS) {
-        /* If the pid value is present, this must be a timed write.
-         * However, if there was no preceding prepare, the check below will
-         * fail (as ttl will be 0) and appropriate error will be reported subsequently
-         */
-        req_tw = true;
-        if ((pid == session->pid) && ((cur_time - prepare_time) <= session->ttl)) {
-            valid_tw = true;
-        }
+    ctx->report_all = true;
+    int i;
+    for (i = 0; i < ctx->done_cnt; i++) {
+        hap_set_char_report_status(&ctx->include_status, &ctx->jstr,
+                hap_char_get_aid(ctx->done[i]), ((__hap_char_t *)ctx->done[i])->iid,
+                HAP_STATUS_SUCCESS);
     }
-    /* Resetting the values so that the session is ready for next prepare or write */
-    session->pid = 0;
-    session->ttl = 0;
+    hap_set_char_free_done(ctx);
+}
 
-	json_obj_get_array(jctx, "characteristics", &cnt);
-	if (cnt <= 0)
-		return HAP_FAIL;
+static void hap_set_char_error(hap_set_char_ctx_t *ctx, int aid, int iid, int status)
+{
+    hap_set_char_start_report_all(ctx);
+    hap_set_char_report_status(&ctx->include_status, &ctx->jstr, aid, iid, status);
+}
 
-    hap_write_data_t *write_arr = hap_platform_memory_calloc(cnt, sizeof(hap_write_data_t));
-	hap_status_t *status_arr = hap_platform_memory_calloc(cnt, sizeof(hap_status_t));
-	if (!write_arr || !status_arr)
-		goto set_char_end;
+static void hap_set_char_remember(hap_set_char_ctx_t *ctx, hap_char_t *hc)
+{
+    if (ctx->done_cnt == ctx->done_size) {
+        int new_size = ctx->done_size * 2;
+        hap_char_t **done = hap_platform_memory_calloc(new_size, sizeof(hap_char_t *));
+        if (!done) {
+            /* Not being able to remember them only costs the 204 response */
+            hap_set_char_start_report_all(ctx);
+            return;
+        }
+        memcpy(done, ctx->done, ctx->done_cnt * sizeof(hap_char_t *));
+        if (ctx->done != ctx->done_buf) {
+            hap_platform_memory_free(ctx->done);
+        }
+        ctx->done = done;
+        ctx->done_size = new_size;
+    }
+    ctx->done[ctx->done_cnt++] = hc;
+}
 
-	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, outbuf, buf_size, hap_http_json_flush_chunk, req);
-    /* Dummy get, so that the loop can start by leaving the previous
-     * object and getting newer one
-     */
-    json_arr_get_object(jctx, 0);
-	/* Loop through all characteristic objects {aid,iid,value}, handle
-	 * errors if any, and if there are no errors, put the characteristic
-	 * pointer and value in an array (with char_cnt)
-	 */
-	for (i = 0; i < cnt; i++) {
-        /* Leave the previous object and get a newer one from the array */
-        json_arr_leave_object(jctx);
-		int aid = 0, iid = 0;
-		json_arr_get_object(jctx, i);
-		json_obj_get_int(jctx, "aid", &aid);
-		json_obj_get_int(jctx, "iid", &iid);
-		hap_acc_t *ha = hap_acc_get_by_aid(aid);
-		__hap_char_t *hc = (__hap_char_t *)hap_acc_get_char_by_iid(ha, iid);
-		if (!ha || !hc) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_RES_ABSENT);
-			continue;
-		}
+static void hap_write_data_free(hap_write_data_t *write_data)
+{
+    __hap_char_t *hc = (__hap_char_t *)write_data->hc;
+    if (hc->desc->format == HAP_CHAR_FORMAT_STRING) {
+        if (write_data->val.s) {
+            hap_platform_memory_free(write_data->val.s);
+        }
+    } else if ((hc->desc->format == HAP_CHAR_FORMAT_DATA) || (hc->desc->format == HAP_CHAR_FORMAT_TLV8)) {
+        hap_platform_memory_free(write_data->val.d.buf);
+    }
+    if (write_data->auth_data.data) {
+        hap_platform_memory_free(write_data->auth_data.data);
+    }
+}
 
-        /* Check if this write is just to enable/disable event notifications.
-         * This is valid even for read-only characteristics that support event
-         * notifications (like sensor readings), so we do not check the HAP_CHAR_PERM_PW
-         * here.
-         */
-		bool ev;
-		if (json_obj_get_bool(jctx, "ev", &ev) == HAP_SUCCESS) {
-            if (hc->permission & HAP_CHAR_PERM_EV) {
-                int index = hap_get_ctrl_session_index(session);
-                hap_char_manage_notification((hap_char_t *)hc, index, ev);
-                ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Events %s for aid=%d iid=%d",
-                        ev ? "Enabled" : "Disabled", aid, iid);
-            } else {
-				hap_set_char_report_status(&include_status, &jstr,
-						aid, iid, HAP_STATUS_NO_NOTIF);
-			}
-			continue;
-		}
+static void hap_set_char_drop_batch(hap_set_char_ctx_t *ctx)
+{
+    int i;
+    for (i = 0; i < ctx->batch_cnt; i++) {
+        hap_write_data_free(&ctx->batch[i]);
+    }
+    ctx->batch_cnt = 0;
+}
 
+/* Runs the timed write checks and hands the batched writes to the write routines */
+static void hap_set_char_flush(hap_set_char_ctx_t *ctx)
+{
+    hap_write_data_t *write_arr = ctx->batch;
+    int char_cnt = 0, i;
+    for (i = 0; i < ctx->batch_cnt; i++) {
+        __hap_char_t *hc = (__hap_char_t *)write_arr[i].hc;
         /* If the previous request was a prepare, but the current
          * one was not a valid timed write, report error.
-         */
-        if (req_tw == true && valid_tw == false) {
-            hap_set_char_report_status(&include_status, &jstr,
-                    aid, iid, HAP_STATUS_VAL_INVALID);
-            continue;
-        }
-
-        /* For characteristic that require a Mandatory Timed Write, return
+         * For characteristic that require a Mandatory Timed Write, return
          * error if this write is not a valid timed write
          */
-        if (hc->permission & HAP_CHAR_PERM_TW) {
-            if (valid_tw == false) {
-                hap_set_char_report_status(&include_status, &jstr,
-                        aid, iid, HAP_STATUS_VAL_INVALID);
-                continue;
-            }
-        }
-
-        /* Check if the characteristic has write permission */
-		if (!(hc->permission & HAP_CHAR_PERM_PW)) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_WR_ON_RDONLY);
-			continue;
-		}
-
-        /* Check if the characteristic needs Authorization Data.
-         * Actual authData value will be read later.
-         */
-        if (hc->permission & HAP_CHAR_PERM_AA) {
-            int tmp_len;
-            if (json_obj_get_strlen(jctx, "authData", &tmp_len) != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_INSUFFICIENT_AUTH);
-			continue;
-            }
-        }
-        /* If there is no write routine registered, there is no point of having
-         * this write request. Return an error.
-         */
-		if (!((__hap_serv_t *)(hap_char_get_parent((hap_char_t *)hc)))->write_cb) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_VAL_INVALID);
-			continue;
-		}
-
-        hap_auth_data_t auth_data = {
-            .data = NULL,
-            .len = 0,
-        };
-		hap_val_t val = {0};
-		int json_ret = HAP_FAIL;
-		switch (hc->format) {
-			case HAP_CHAR_FORMAT_BOOL:
-				json_ret = json_obj_get_bool(jctx, "value", &val.b);
-				break;
-			case HAP_CHAR_FORMAT_UINT8:
-			case HAP_CHAR_FORMAT_UINT16:
-			case HAP_CHAR_FORMAT_UINT32:
-			case HAP_CHAR_FORMAT_INT:
-				json_ret = json_obj_get_int(jctx, "value", &val.i);
-                /* For some characteristics, like Target Lock State, which is an enum
-                 * (mapped to uint8), it was seen that controlling via Siri sends true/false
-                 * as values, instead of 1/0. This additional code is for handling such
-                 * cases.
-                 */
-                if ((json_ret != HAP_SUCCESS) && (hc->format == HAP_CHAR_FORMAT_UINT8)) {
-                    json_ret = json_obj_get_bool(jctx, "value", &val.b);
-                }
-				break;
-			case HAP_CHAR_FORMAT_FLOAT:
-				json_ret = json_obj_get_float(jctx, "value", &val.f);
-				break;
-			case HAP_CHAR_FORMAT_STRING: {
-				int str_len = 0;
-				json_ret = json_obj_get_strlen(jctx, "value", &str_len);
-				if (json_ret == HAP_SUCCESS) {
-                    /* Increment string length, for NULL termination byte */
-                    str_len++;
-                    val.s = hap_platform_memory_calloc(str_len, 1);
-                    if (!val.s) {
-                        hap_set_char_report_status(&include_status, &jstr,
-                                aid, iid, HAP_STATUS_OO_RES);
-                        continue;
-                    }
-                    json_obj_get_string(jctx, "value", val.s, str_len);
-				}
-				break;
-			}
-            case HAP_CHAR_FORMAT_DATA:
-            case HAP_CHAR_FORMAT_TLV8: {
-				int str_len = 0;
-				json_ret = json_obj_get_strlen(jctx, "value", &str_len);
-				if (json_ret == HAP_SUCCESS) {
-					val.d.buf = hap_platform_memory_calloc(1, str_len + 1);
-                    if (!val.d.buf) {
-                        hap_set_char_report_status(&include_status, &jstr,
-                                aid, iid, HAP_STATUS_OO_RES);
-                        continue;
-                    }
-                    val.d.buflen = str_len + 1;
-					json_obj_get_string(jctx, "value", (char *)val.d.buf, val.d.buflen);
-                    remove_escape_char((char *)val.d.buf, &val.d.buflen);
-                    if (esp_mfi_base64_decode((const char *)val.d.buf, strlen((char *)val.d.buf),
-                                (char *)val.d.buf, val.d.buflen, (int *)&val.d.buflen) != 0) {
-                        hap_platform_memory_free(val.d.buf);
-                        hap_set_char_report_status(&include_status, &jstr,
-                                aid, iid, HAP_STATUS_VAL_INVALID);
-                        continue;
-                    }
-				}
-				break;
-			}
-			default:
-				json_ret = HAP_FAIL;
-		}
-		if (json_ret != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_VAL_INVALID);
-			continue;
-		}
-
-        /* Check if the value is within constraints */
-        if (hap_char_check_val_constraints(hc, &val) != HAP_SUCCESS) {
-			hap_set_char_report_status(&include_status, &jstr,
-					aid, iid, HAP_STATUS_VAL_INVALID);
-			continue;
-        }
-
-        if (json_obj_get_strlen(jctx, "authData", &auth_data.len) == HAP_SUCCESS) {
-            auth_data.data = hap_platform_memory_calloc(1, auth_data.len + 1);
-            json_obj_get_string(jctx, "authData", (char *)auth_data.data, auth_data.len + 1);
-            esp_mfi_base64_decode((const char *)auth_data.data, auth_data.len, (char *)auth_data.data, auth_data.len + 1, &auth_data.len);
-        }
-        bool remote = false;
-        json_obj_get_bool(jctx, "remote", &remote);
-
-        bool response = false;
-        if (hc->permission & HAP_CHAR_PERM_WR) {
-            json_obj_get_bool(jctx, "r", &response);
+        if ((ctx->req_tw || (hc->desc->permission & HAP_CHAR_PERM_TW)) && !ctx->valid_tw) {
+            hap_set_char_error(ctx, hap_char_get_aid((hap_char_t *)hc), hc->iid,
+                    HAP_STATUS_VAL_INVALID);
+            hap_write_data_free(&write_arr[i]);
+            continue;
         }
-
-        int index = hap_get_ctrl_session_index(session);
-        hap_char_set_owner_ctrl((hap_char_t *)hc, index);
-		/* No errors in the object data itself. Save the characteristic
-		 * pointer and value, to be used later
-		 */
-		write_arr[char_cnt].hc = (hap_char_t *)hc;
-		write_arr[char_cnt].val = val;
-        write_arr[char_cnt].auth_data = auth_data;
-        write_arr[char_cnt].remote = remote;
-        write_arr[char_cnt].write_response = response;
-        write_arr[char_cnt].status = &status_arr[char_cnt];
-		char_cnt++;
-	}
-	if (!char_cnt)
-		goto set_char_end;
+        write_arr[char_cnt] = write_arr[i];
+        ctx->batch_status[char_cnt] = HAP_STATUS_SUCCESS;
+        write_arr[char_cnt].status = &ctx->batch_status[char_cnt];
+        char_cnt++;
+    }
+    ctx->batch_cnt = 0;
+    if (!char_cnt) {
+        return;
+    }
 
 	/* The logic here is to loop through all the saved characteristic
 	 * pointers, and invoke a single write callback for all consecutive
@@ -890,7 +1366,7 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 			 * i - hs_index
 			 */
 			if (hs->write_cb(&write_arr[hs_index], i - hs_index,
-					hs->priv, hap_platform_httpd_get_sess_ctx(req)) != HAP_SUCCESS)
+					hs->priv, ctx->session) != HAP_SUCCESS)
 				write_err = true;
 			if (i < char_cnt) {
 				hs = (__hap_serv_t *)hap_char_get_parent(write_arr[i].hc);
@@ -898,58 +1374,259 @@ static int hap_http_handle_set_char(jparse_ctx_t *jctx, char *outbuf, int buf_si
 			}
 		}
 	}
-	if (write_err || include_status || write_response) {
-		for (i = 0; i < char_cnt; i++) {
-            /* TODO: The code to get aid looks complex. Simplify */
-            if (write_arr[i].write_response && (*write_arr[i].status == HAP_STATUS_SUCCESS)) {
-                hap_set_char_report_write_response(&include_status, &jstr,
-                        ((__hap_acc_t *)hap_serv_get_parent(hap_char_get_parent(write_arr[i].hc)))->aid,
-                        ((__hap_char_t *)(write_arr[i].hc))->iid, (__hap_char_t *)(write_arr[i].hc));
-                continue;
-            }
-            hap_set_char_report_status(&include_status, &jstr,
-                    ((__hap_acc_t *)hap_serv_get_parent(hap_char_get_parent(write_arr[i].hc)))->aid,
-                    ((__hap_char_t *)(write_arr[i].hc))->iid, *write_arr[i].status);
-		}
+    for (i = 0; i < char_cnt; i++) {
+        if (*write_arr[i].status != HAP_STATUS_SUCCESS) {
+            write_err = true;
+        }
+    }
+	if (write_err || write_response) {
+        hap_set_char_start_report_all(ctx);
+    }
+	for (i = 0; i < char_cnt; i++) {
+        hap_char_t *hc = write_arr[i].hc;
+        if (!ctx->report_all) {
+            hap_set_char_remember(ctx, hc);
+        } else if (write_arr[i].write_response && (*write_arr[i].status == HAP_STATUS_SUCCESS)) {
+            hap_set_char_report_write_response(&ctx->include_status, &ctx->jstr,
+                    hap_char_get_aid(hc), ((__hap_char_t *)hc)->iid, (__hap_char_t *)hc);
+        } else {
+            hap_set_char_report_status(&ctx->include_status, &ctx->jstr,
+                    hap_char_get_aid(hc), ((__hap_char_t *)hc)->iid, *write_arr[i].status);
+        }
+        hap_write_data_free(&write_arr[i]);
 	}
+}
 
-	int ret = HAP_SUCCESS;
-set_char_end:
-	if (include_status) {
-		json_gen_pop_array(&jstr);
-		json_gen_end_object(&jstr);
-		json_gen_str_end(&jstr);
-		ret = HAP_FAIL;
-	}
+/* Handles one {aid,iid,value} object of the "characteristics" array.
+ * Errors are reported in the response right away, and valid writes are
+ * added to the batch
+ */
+static int hap_http_set_one_char(jparse_ctx_t *jctx, void *priv)
+{
+    hap_set_char_ctx_t *ctx = (hap_set_char_ctx_t *)priv;
+    hap_secure_session_t *session = ctx->session;
+    ctx->elem_cnt++;
+
+    int aid = 0, iid = 0;
+    json_obj_get_int(jctx, "aid", &aid);
+    json_obj_get_int(jctx, "iid", &iid);
+    __hap_char_t *hc = (__hap_char_t *)hap_get_char_by_aid_iid(aid, iid);
+    if (!hc) {
+        hap_set_char_error(ctx, aid, iid, HAP_STATUS_RES_ABSENT);
+        return HAP_SUCCESS;
+    }
+
+    /* Check if this write is just to enable/disable event notifications.
+     * This is valid even for read-only characteristics that support event
+     * notifications (like sensor readings), so we do not check the HAP_CHAR_PERM_PW
+     * here.
+     */
+    bool ev;
+    if (json_obj_get_bool(jctx, "ev", &ev) == HAP_SUCCESS) {
+        if (hc->desc->permission & HAP_CHAR_PERM_EV) {
+            int index = hap_get_ctrl_session_index(session);
+            hap_char_manage_notification((hap_char_t *)hc, index, ev);
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Events %s for aid=%d iid=%d",
+                    ev ? "Enabled" : "Disabled", aid, iid);
+        } else {
+            hap_set_char_error(ctx, aid, iid, HAP_STATUS_NO_NOTIF);
+        }
+        return HAP_SUCCESS;
+    }
+
+    /* Check if the characteristic has write permission */
+    if (!(hc->desc->permission & HAP_CHAR_PERM_PW)) {
+        hap_set_char_error(ctx, aid, iid, HAP_STATUS_WR_ON_RDONLY);
+        return HAP_SUCCESS;
+    }
+
+    /* Check if the characteristic needs Authorization Data.
+     * Actual authData value will be read later.
+     */
+    if (hc->desc->permission & HAP_CHAR_PERM_AA) {
+        int tmp_len;
+        if (json_obj_get_strlen(jctx, "authData", &tmp_len) != HAP_SUCCESS) {
+            hap_set_char_error(ctx, aid, iid, HAP_STATUS_INSUFFICIENT_AUTH);
+            return HAP_SUCCESS;
+        }
+    }
+    /* If there is no write routine registered, there is no point of having
+     * this write request. Return an error.
+     */
+    if (!((__hap_serv_t *)(hap_char_get_parent((hap_char_t *)hc)))->write_cb) {
+        hap_set_char_error(ctx, aid, iid, HAP_STATUS_VAL_INVALID);
+        return HAP_SUCCESS;
+    }
+
+    /* Writes are batched per service, so hand over what is pending on a
+     * change of service. Timed writes are held until the end, since
+     * the pid usually comes after the characteristics.
+     */
+    if (ctx->batch_cnt) {
+        if (ctx->timed) {
+            if (ctx->batch_cnt == HAP_SET_CHAR_BATCH_CNT) {
+                hap_set_char_error(ctx, aid, iid, HAP_STATUS_OO_RES);
+                return HAP_SUCCESS;
+            }
+        } else if ((ctx->batch_cnt == HAP_SET_CHAR_BATCH_CNT) ||
+                (hap_char_get_parent(ctx->batch[0].hc) != hap_char_get_parent((hap_char_t *)hc))) {
+            hap_set_char_flush(ctx);
+        }
+    }
+
+    hap_auth_data_t auth_data = {
+        .data = NULL,
+        .len = 0,
+    };
+    hap_val_t val = {0};
+    int json_ret = HAP_FAIL;
+    switch (hc->desc->format) {
+        case HAP_CHAR_FORMAT_BOOL:
+            json_ret = json_obj_get_bool(jctx, "value", &val.b);
+            break;
+        case HAP_CHAR_FORMAT_UINT8:
+        case HAP_CHAR_FORMAT_UINT16:
+        case HAP_CHAR_FORMAT_UINT32:
+        case HAP_CHAR_FORMAT_INT:
+            json_ret = json_obj_get_int(jctx, "value", &val.i);
+            /* For some characteristics, like Target Lock State, which is an enum
+             * (mapped to uint8), it was seen that controlling via Siri sends true/false
+             * as values, instead of 1/0. This additional code is for handling such
+             * cases.
+             */
+            if ((json_ret != HAP_SUCCESS) && (hc->desc->format == HAP_CHAR_FORMAT_UINT8)) {
+                json_ret = json_obj_get_bool(jctx, "value", &val.b);
+            }
+            break;
+        case HAP_CHAR_FORMAT_FLOAT:
+            json_ret = json_obj_get_float(jctx, "value", &val.f);
+            break;
+        case HAP_CHAR_FORMAT_STRING: {
+            int str_len = 0;
+            json_ret = json_obj_get_strlen(jctx, "value", &str_len);
+            if (json_ret == HAP_SUCCESS) {
+                /* Increment string length, for NULL termination byte */
+                str_len++;
+                val.s = hap_platform_memory_calloc(str_len, 1);
+                if (!val.s) {
+                    hap_set_char_error(ctx, aid, iid, HAP_STATUS_OO_RES);
+                    return HAP_SUCCESS;
+                }
+                json_obj_get_string(jctx, "value", val.s, str_len);
+            }
+            break;
+        }
+        case HAP_CHAR_FORMAT_DATA:
+        case HAP_CHAR_FORMAT_TLV8: {
+            int str_len = 0;
+            json_ret = json_obj_get_strlen(jctx, "value", &str_len);
+            if (json_ret == HAP_SUCCESS) {
+                val.d.buf = hap_platform_memory_calloc(1, str_len + 1);
+                if (!val.d.buf) {
+                    hap_set_char_error(ctx, aid, iid, HAP_STATUS_OO_RES);
+                    return HAP_SUCCESS;
+                }
+                val.d.buflen = str_len + 1;
+                /* Comes out unescaped, so a base64 "\/" is already a "/" here */
+                json_obj_get_string(jctx, "value", (char *)val.d.buf, val.d.buflen);
+                if (esp_mfi_base64_decode_inplace((char *)val.d.buf, strlen((char *)val.d.buf),
+                            (int *)&val.d.buflen) != 0) {
+                    hap_platform_memory_free(val.d.buf);
+                    hap_set_char_error(ctx, aid, iid, HAP_STATUS_VAL_INVALID);
+                    return HAP_SUCCESS;
+                }
+            }
+            break;
+        }
+        default:
+            json_ret = HAP_FAIL;
+    }
+    if (json_ret != HAP_SUCCESS) {
+        hap_set_char_error(ctx, aid, iid, HAP_STATUS_VAL_INVALID);
+        return HAP_SUCCESS;
+    }
+
+    /* Snap to the step where asked to, then check if the value is within constraints */
+    hap_char_quantize_val(hc, &val);
+    if (hap_char_check_val_constraints(hc, &val) != HAP_SUCCESS) {
+        hap_write_data_t tmp = { .hc = (hap_char_t *)hc, .val = val };
+        hap_write_data_free(&tmp);
+        hap_set_char_error(ctx, aid, iid, HAP_STATUS_VAL_INVALID);
+        return HAP_SUCCESS;
+    }
+
+    if (json_obj_get_strlen(jctx, "authData", &auth_data.len) == HAP_SUCCESS) {
+        auth_data.data = hap_platform_memory_calloc(1, auth_data.len + 1);
+        if (!auth_data.data) {
+            hap_write_data_t tmp = { .hc = (hap_char_t *)hc, .val = val };
+            hap_write_data_free(&tmp);
+            hap_set_char_error(ctx, aid, iid, HAP_STATUS_OO_RES);
+            return HAP_SUCCESS;
+        }
+        /* Comes out unescaped, so decode only up to the unescaped length */
+        json_obj_get_string(jctx, "authData", (char *)auth_data.data, auth_data.len + 1);
+        if (esp_mfi_base64_decode_inplace((char *)auth_data.data, strlen((char *)auth_data.data),
+                    &auth_data.len) != 0) {
+            hap_write_data_t tmp = { .hc = (hap_char_t *)hc, .val = val, .auth_data = auth_data };
+            hap_write_data_free(&tmp);
+            hap_set_char_error(ctx, aid, iid, HAP_STATUS_VAL_INVALID);
+            return HAP_SUCCESS;
+        }
+    }
+    bool remote = false;
+    json_obj_get_bool(jctx, "remote", &remote);
+
+    bool response = false;
+    if (hc->desc->permission & HAP_CHAR_PERM_WR) {
+        json_obj_get_bool(jctx, "r", &response);
+    }
+
+    int index = hap_get_ctrl_session_index(session);
+    hap_char_note_write((hap_char_t *)hc, index);
+    /* No errors in the object data itself. Save the characteristic
+     * pointer and value, to be used later
+     */
+    hap_write_data_t *write_data = &ctx->batch[ctx->batch_cnt++];
+    write_data->hc = (hap_char_t *)hc;
+    write_data->val = val;
+    write_data->auth_data = auth_data;
+    write_data->remote = remote;
+    write_data->write_response = response;
+    write_data->status = NULL;
+    return HAP_SUCCESS;
+}
+
+static int hap_http_handle_set_char(jparse_ctx_t *jctx, void *priv)
+{
+    /* The element's index in the request, since the iid is only known once parsed */
+    uint16_t elem = ((hap_set_char_ctx_t *)priv)->elem_cnt;
+    HAP_TRACE_BEGIN(HAP_TRACE_SET_CHAR, elem);
+    int ret = hap_http_set_one_char(jctx, priv);
+    HAP_TRACE_END(HAP_TRACE_SET_CHAR, elem);
+    return ret;
+}
 
-	if (write_arr) {
-		for (i = 0; i < char_cnt; i++) {
-			if (((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_STRING) {
-				if (write_arr[i].val.s) {
-                    hap_platform_memory_free(write_arr[i].val.s);
-                }
-			} else if ((((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_DATA) ||
-                    (((__hap_char_t *)write_arr[i].hc)->format == HAP_CHAR_FORMAT_TLV8)) {
-                    hap_platform_memory_free(write_arr[i].val.d.buf);
-            }
-            if (write_arr[i].auth_data.data) {
-                hap_platform_memory_free(write_arr[i].auth_data.data);
-            }
-		}
-	}
-	if (write_arr)
-		hap_platform_memory_free(write_arr);
-	if (status_arr)
-		hap_platform_memory_free(status_arr);
-	return ret;
+/* Picks up the pid, if any, from everything in the body apart from the
+ * characteristics
+ */
+static void hap_set_char_check_pid(hap_set_char_ctx_t *ctx, jparse_ctx_t *jctx)
+{
+    uint64_t pid;
+    if (json_obj_get_int64(jctx, "pid", (int64_t *)&pid) == OS_SUCCESS) {
+        /* If the pid value is present, this must be a timed write.
+         * However, if there was no preceding prepare, the check below will
+         * fail and appropriate error will be reported subsequently
+         */
+        ctx->req_tw = true;
+        ctx->valid_tw = hap_tw_check(ctx->tw_state, ctx->tw_pid, ctx->tw_deadline_us, pid);
+    }
 }
 
+#define HAP_SET_CHAR_INBUF_SIZE     512
+#define HAP_SET_CHAR_OUTBUF_SIZE    512
+
 static int hap_http_put_characteristics(httpd_req_t *req)
 {
-    char stack_inbuf[512] = {0};
-    char outbuf[512] = {0};
-    char *heap_inbuf = NULL;
-    char *inbuf = stack_inbuf;
 
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
     hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
@@ -957,43 +1634,33 @@ static int hap_http_put_characteristics(httpd_req_t *req)
         return hap_http_session_not_authorized(req);
     }
 
-    /* If received content is larger than the buffer on stack, allocate one from heap.
-     * This will mostly be required only in case of bridges, wherein there could be a request to
-     * control all/many accessories at once.
-     */
-    int content_len = hap_platform_httpd_get_content_len(req);
-    if (content_len > sizeof(stack_inbuf)) {
-        heap_inbuf = hap_platform_memory_calloc(content_len + 1, 1); /* Allocating an extra byte for NULL termination */
-        if (!heap_inbuf) {
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
-            httpd_resp_set_status(req, HTTPD_500);
-            return httpd_resp_send(req, NULL, 0);
+    hap_set_char_ctx_t *ctx = hap_platform_memory_calloc(1, sizeof(hap_set_char_ctx_t));
+    /* The working buffers come from the scratch arena, not the stack */
+    char *inbuf = hap_scratch_alloc(HAP_SET_CHAR_INBUF_SIZE);
+    char *outbuf = hap_scratch_alloc(HAP_SET_CHAR_OUTBUF_SIZE);
+    char *rest = hap_scratch_alloc(HAP_SET_CHAR_REST_SIZE);
+    void *tok_buf = hap_scratch_alloc(HAP_SET_CHAR_TOK_BUF_SIZE);
+    if (!ctx || !inbuf || !outbuf || !rest || !tok_buf) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate PUT context");
+        if (ctx) {
+            hap_platform_memory_free(ctx);
         }
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Allocated buffer of size %d for the large PUT",
-                    content_len + 1)
-        inbuf = heap_inbuf;
+        hap_scratch_reset();
+        return httpd_resp_send_500(req);
+    }
+    ctx->req = req;
+    ctx->session = session;
+    ctx->done = ctx->done_buf;
+    ctx->done_size = HAP_SET_CHAR_DONE_CNT;
+    ctx->tw_state = hap_tw_take(hap_get_ctrl_session_index(session), &ctx->tw_pid,
+            &ctx->tw_deadline_us);
+    if (ctx->tw_state != HAP_TW_NONE) {
+        /* A prepare was received before this request (even if it has expired
+         * since), and so this write needs to be timed write
+         */
+        ctx->timed = true;
+        ctx->req_tw = true;
     }
-	int data_len = hap_httpd_get_data(req, inbuf, content_len);
-	if (data_len < 0) {
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
-		httpd_resp_set_status(req, HTTPD_500);
-        if (heap_inbuf) {
-            hap_platform_memory_free(heap_inbuf);
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
-        }
-		return httpd_resp_send(req, NULL, 0);
-	}
-    ESP_MFI_DEBUG_PLAIN("Data Received: %s\n", inbuf);
-	jparse_ctx_t jctx;
-	if (json_parse_start(&jctx, inbuf, data_len) != HAP_SUCCESS) {
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to parse HTTPD JSON Data");
-		httpd_resp_set_status(req, HTTPD_500);
-        if (heap_inbuf) {
-            hap_platform_memory_free(heap_inbuf);
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
-        }
-		return httpd_resp_send(req, NULL, 0);
-	}
 
 	httpd_resp_set_type(req, "application/hap+json");
 	/* Setting response type to indicate error.
@@ -1002,45 +1669,240 @@ static int hap_http_put_characteristics(httpd_req_t *req)
 	 * Else, the response type will be set to 204
 	 */
 	httpd_resp_set_status(req, HTTPD_207);
-	if (hap_http_handle_set_char(&jctx, outbuf, sizeof(outbuf), req) == HAP_SUCCESS)
-	{
-		snprintf(outbuf, sizeof(outbuf), "HTTP/1.1 %s\r\n\r\n", HTTPD_204);
-		httpd_send(req, outbuf, strlen(outbuf));
-	} else {
-        /* If a failure was encountered, it would mean that a response has been generated,
-         * which will be chunk encoded. So, sending the last chunk here and also printing
-         * a new line to end the prints of the error string.
+	json_gen_str_start(&ctx->jstr, outbuf, HAP_SET_CHAR_OUTBUF_SIZE, hap_http_json_flush_chunk, req);
+
+    json_stream_t stream;
+    json_stream_start(&stream, "characteristics", inbuf, HAP_SET_CHAR_INBUF_SIZE,
+            rest, HAP_SET_CHAR_REST_SIZE, tok_buf, HAP_SET_CHAR_TOK_BUF_SIZE,
+            hap_http_handle_set_char, ctx);
+    int ret = HAP_SUCCESS;
+    int remaining = hap_platform_httpd_get_content_len(req);
+    while (remaining > 0) {
+        char *ptr;
+        int space = json_stream_get_buf(&stream, &ptr);
+        if (space == 0) {
+            /* A single characteristic object larger than the buffer, like a
+             * long TLV8 value. Only the rest of the body is needed on top.
+             * The old buffer stays in the arena until the reset below.
+             */
+            int new_size = stream.len + remaining;
+            char *new_buf = hap_scratch_alloc(new_size);
+            if (!new_buf) {
+                ret = HAP_FAIL;
+                break;
+            }
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Allocated buffer of size %d for the large PUT",
+                    new_size);
+            json_stream_set_buf(&stream, new_buf, new_size);
+            continue;
+        }
+        int read_len = hap_httpd_get_data(req, ptr, space < remaining ? space : remaining);
+        if (read_len <= 0) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
+            ret = HAP_FAIL;
+            break;
+        }
+        ESP_MFI_DEBUG_PLAIN("Data Received: %.*s\n", read_len, ptr);
+        remaining -= read_len;
+        if (json_stream_feed(&stream, read_len) != OS_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to parse HTTPD JSON Data");
+            ret = HAP_FAIL;
+            break;
+        }
+    }
+	jparse_ctx_t jctx;
+    if (ret == HAP_SUCCESS) {
+        if (json_stream_end(&stream, &jctx) == OS_SUCCESS) {
+            hap_set_char_check_pid(ctx, &jctx);
+        } else {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to parse HTTPD JSON Data");
+            ret = HAP_FAIL;
+        }
+    }
+    if (ret == HAP_SUCCESS) {
+        hap_set_char_flush(ctx);
+    } else {
+        hap_set_char_drop_batch(ctx);
+    }
+
+    if (ctx->include_status) {
+        /* Whatever has been reported so far has already gone out as chunks,
+         * so the response has to be completed even after an error.
+         */
+		json_gen_pop_array(&ctx->jstr);
+		json_gen_end_object(&ctx->jstr);
+		json_gen_str_end(&ctx->jstr);
+        /* Sending the last chunk here and also printing a new line to end
+         * the prints of the error string.
          */
         httpd_resp_send_chunk(req, NULL, 0);
         ESP_MFI_DEBUG_PLAIN("\n");
+    } else if (ret != HAP_SUCCESS) {
+		httpd_resp_set_status(req, HTTPD_500);
+		httpd_resp_send(req, NULL, 0);
+    } else if (!ctx->elem_cnt) {
+        httpd_resp_set_status(req, HTTPD_400);
+        snprintf(outbuf, HAP_SET_CHAR_OUTBUF_SIZE, "{\"status\":%d}", HAP_STATUS_VAL_INVALID);
+        httpd_resp_send(req, outbuf, strlen(outbuf));
+    } else {
+		httpd_send(req, HAP_HTTP_204_RESP, sizeof(HAP_HTTP_204_RESP) - 1);
     }
-    json_parse_end(&jctx);
-
-    if (heap_inbuf) {
-        hap_platform_memory_free(heap_inbuf);
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for PUT");
-    }
+    hap_set_char_free_done(ctx);
+    hap_platform_memory_free(ctx);
+    hap_scratch_reset();
 
     hap_report_event(HAP_EVENT_SET_CHAR_COMPLETED, NULL, 0);
     return HAP_SUCCESS;
 }
 
-static bool hap_get_bool_url_param(char *query_str, char *key)
+/* Query parameters of GET /characteristics. The "id" list is left in place
+ * in the request URI, so it is not NUL terminated.
+ */
+typedef struct {
+    const char *id;
+    int id_len;
+    bool meta;
+    bool perms;
+    bool type;
+    bool ev;
+} hap_get_char_query_t;
+
+static bool hap_get_bool_url_param(const char *val, int len)
 {
-	char val[6]; /* Max string will be "false" */
-	if (httpd_query_key_value(query_str, key, val, sizeof(val)) == HAP_SUCCESS) {
-		if (!strcmp(val, "true") || !strcmp(val, "1"))
-			return true;
-	}
-	return false;
+    return ((len == 4) && !strncmp(val, "true", 4)) || ((len == 1) && (val[0] == '1'));
+}
+
+/* Single pass over the query string. Returns HAP_FAIL if there is no "id" */
+static int hap_parse_get_char_query(const char *query, hap_get_char_query_t *q)
+{
+    memset(q, 0, sizeof(hap_get_char_query_t));
+    if (!query) {
+        return HAP_FAIL;
+    }
+    const char *seg = query;
+    const char *eq = NULL;
+    const char *p;
+    for (p = query; ; p++) {
+        if ((*p == '=') && !eq) {
+            eq = p;
+        } else if ((*p == '&') || (*p == '\0')) {
+            if (eq) {
+                int key_len = eq - seg;
+                const char *val = eq + 1;
+                int val_len = p - val;
+#define HAP_QUERY_KEY_IS(key)   ((key_len == sizeof(key) - 1) && !strncmp(seg, key, key_len))
+                if (HAP_QUERY_KEY_IS("id")) {
+                    q->id = val;
+                    q->id_len = val_len;
+                } else if (HAP_QUERY_KEY_IS("meta")) {
+                    q->meta = hap_get_bool_url_param(val, val_len);
+                } else if (HAP_QUERY_KEY_IS("perms")) {
+                    q->perms = hap_get_bool_url_param(val, val_len);
+                } else if (HAP_QUERY_KEY_IS("type")) {
+                    q->type = hap_get_bool_url_param(val, val_len);
+                } else if (HAP_QUERY_KEY_IS("ev")) {
+                    q->ev = hap_get_bool_url_param(val, val_len);
+                }
+#undef HAP_QUERY_KEY_IS
+            }
+            if (*p == '\0') {
+                break;
+            }
+            seg = p + 1;
+            eq = NULL;
+        }
+    }
+    return (q->id && q->id_len) ? HAP_SUCCESS : HAP_FAIL;
+}
+
+/* Parses a decimal number like atoi() would, stopping at the first non-digit */
+static int hap_parse_id_num(const char **p, const char *end)
+{
+    int val = 0;
+    while ((*p < end) && (**p >= '0') && (**p <= '9')) {
+        val = (val * 10) + (**p - '0');
+        (*p)++;
+    }
+    return val;
+}
+
+/* Parses the next "<aid>.<iid>" element of the "id" list and moves past it */
+static bool hap_parse_next_id(const char **p, const char *end, int *aid, int *iid)
+{
+    if (*p >= end) {
+        return false;
+    }
+    *aid = hap_parse_id_num(p, end);
+    *iid = 0;
+    if ((*p < end) && (**p == '.')) {
+        (*p)++;
+        *iid = hap_parse_id_num(p, end);
+    }
+    /* Skip anything unexpected up to the next element */
+    while ((*p < end) && (**p != ',')) {
+        (*p)++;
+    }
+    if (*p < end) {
+        (*p)++;
+    }
+    return true;
+}
+
+/* Number of characteristics a GET /characteristics reads from stack buffers.
+ * Larger requests, which only bridges make, use a pool that grows as needed
+ * and is kept for later requests, so polling does not allocate.
+ */
+#define HAP_GET_CHAR_STACK_CNT  16
+#define HAP_GET_CHAR_JSON_SIZE  512
+
+typedef struct {
+    hap_read_data_t *read_arr;
+    hap_status_t *status_codes;     /* Shares the read_arr allocation */
+    int size;
+} hap_read_pool_t;
+
+/* Only used from the httpd task */
+static hap_read_pool_t hap_get_char_pool;
+
+/* Makes room for entry cnt in read_arr, moving the entries to the pool if
+ * the current buffer is full. Only the hc members are valid at this point.
+ * Returns NULL if the pool could not grow.
+ */
+static hap_read_data_t *hap_get_char_reserve(hap_read_data_t *read_arr, int *size, int cnt)
+{
+    if (cnt < *size) {
+        return read_arr;
+    }
+    hap_read_pool_t *pool = &hap_get_char_pool;
+    if (pool->size <= cnt) {
+        int new_size = pool->size ? pool->size : HAP_GET_CHAR_STACK_CNT;
+        while (new_size <= cnt) {
+            new_size *= 2;
+        }
+        hap_read_data_t *new_arr = hap_platform_memory_calloc(new_size,
+                sizeof(hap_read_data_t) + sizeof(hap_status_t));
+        if (!new_arr) {
+            return NULL;
+        }
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Grew GET characteristics pool to %d entries", new_size);
+        memcpy(new_arr, read_arr, cnt * sizeof(hap_read_data_t));
+        if (pool->read_arr) {
+            hap_platform_memory_free(pool->read_arr);
+        }
+        pool->read_arr = new_arr;
+        pool->status_codes = (hap_status_t *)&new_arr[new_size];
+        pool->size = new_size;
+    } else if (read_arr != pool->read_arr) {
+        memcpy(pool->read_arr, read_arr, cnt * sizeof(hap_read_data_t));
+    }
+    *size = pool->size;
+    return pool->read_arr;
 }
 
 static int hap_http_get_characteristics(httpd_req_t *req)
 {
-    char outbuf[512];
-    char stack_val_buf[512] = {0};
-    char *heap_val_buf = NULL;
-    char *val = stack_val_buf;
+    hap_read_data_t stack_read_arr[HAP_GET_CHAR_STACK_CNT];
+    hap_status_t stack_status_codes[HAP_GET_CHAR_STACK_CNT];
 
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
 
@@ -1048,61 +1910,27 @@ static int hap_http_get_characteristics(httpd_req_t *req)
     if (!hap_is_req_secure(session)) {
         return hap_http_session_not_authorized(req);
     }
-    const char *uri = hap_platform_httpd_get_req_uri(req);
-    /* Allocate on heap, if URI is longer */
-    if (strlen(uri) > sizeof(stack_val_buf)) {
-        heap_val_buf = hap_platform_memory_calloc(strlen(uri) + 1, 1); /* Allocating an extra byte for NULL termination */
-        if (!heap_val_buf) {
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read URL");
-            httpd_resp_set_status(req, HTTPD_500);
-            return httpd_resp_send(req, NULL, 0);
-        }
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Allocated buffer of size %d for the large GET",
-                    strlen(uri) + 1)
-        val = heap_val_buf;
-    }
-    size_t url_query_str_len = httpd_req_get_url_query_len(req);
-    char * url_query_str = hap_platform_memory_calloc(1, url_query_str_len + 1);
-    if (!url_query_str) {
-		httpd_resp_set_status(req, HTTPD_400);
-		httpd_resp_set_type(req, "application/hap+json");
-		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70409}");
-		httpd_resp_send(req, outbuf, strlen(outbuf));
-        goto get_char_return;
+    /* The JSON goes after room for the response header */
+    size_t outbuf_size = HAP_RESP_HDR_MAX + HAP_GET_CHAR_JSON_SIZE;
+    char *outbuf = hap_scratch_alloc(outbuf_size);
+    if (!outbuf) {
+        hap_scratch_reset();
+        return httpd_resp_send_500(req);
     }
-    httpd_req_get_url_query_str(req, url_query_str, url_query_str_len + 1);
-	/* Check for all the optional URL query paramaters */
-	bool meta = hap_get_bool_url_param(url_query_str, "meta");
-	bool perms = hap_get_bool_url_param(url_query_str, "perms");
-	bool type = hap_get_bool_url_param(url_query_str, "type");
-	bool ev = hap_get_bool_url_param(url_query_str, "ev");
-
-	/* Check for the mandatory "id" URL query parameter.
-	 * If not found, return success
+    char *json_buf = outbuf + HAP_RESP_HDR_MAX;
+	/* Check for the mandatory "id" URL query parameter, and all the
+	 * optional ones, directly in the URI.
 	 */
-	if (httpd_query_key_value(url_query_str, "id", val, strlen(uri) + 1) != HAP_SUCCESS) {
+    const char *query = strchr(hap_platform_httpd_get_req_uri(req), '?');
+    hap_get_char_query_t q;
+	if (hap_parse_get_char_query(query ? query + 1 : NULL, &q) != HAP_SUCCESS) {
 		httpd_resp_set_status(req, HTTPD_400);
 		httpd_resp_set_type(req, "application/hap+json");
-		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70409}");
+		snprintf(outbuf, outbuf_size, "{\"status\":-70409}");
 		httpd_resp_send(req, outbuf, strlen(outbuf));
         goto get_char_return;
     }
 
-	/* Get the total count of characteristics in the request. This will be
-	 * required to decide the size of the characteristic pointers' array
-	 */
-	int char_cnt = 0;
-	char *val_ptr = val;
-	/* We do not do any error checking here and just assume that the id
-	 * tag has a characteristic list which is a comma separated list
-	 * of <aid>.<iid> elements
-	 */
-	char *p = strsep(&val_ptr, ",");
-	while (p) {
-		char_cnt++;
-		p = strsep(&val_ptr, ",");
-	}
-
 	/* Normally, it would have been fine to just go on parsing the
 	 * characteristics in the URL, fetch their values and prepare
 	 * the response. However, if there is error for any characteristic
@@ -1111,72 +1939,67 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 	 * So, it is better to maintain a list of characteristics pointers,
 	 * read all the values, and only then create the response
 	 */
-	hap_read_data_t *read_arr = hap_platform_memory_calloc(char_cnt, sizeof(hap_read_data_t));
-    if (!read_arr) {
-		httpd_resp_set_status(req, HTTPD_500);
-		httpd_resp_set_type(req, "application/hap+json");
-		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70407}");
-		httpd_resp_send(req, outbuf, strlen(outbuf));
-        goto get_char_return;
-    }
-    hap_status_t *status_codes = hap_platform_memory_calloc(char_cnt, sizeof(hap_status_t));
-    if (!status_codes) {
-        hap_platform_memory_free(read_arr);
-		httpd_resp_set_status(req, HTTPD_500);
-		httpd_resp_set_type(req, "application/hap+json");
-		snprintf(outbuf, sizeof(outbuf),"{\"status\":-70407}");
-		httpd_resp_send(req, outbuf, strlen(outbuf));
-        goto get_char_return;
-    }
+	hap_read_data_t *read_arr = stack_read_arr;
+    hap_status_t *status_codes = stack_status_codes;
+    int read_arr_size = HAP_GET_CHAR_STACK_CNT;
 
     ESP_MFI_DEBUG_PLAIN("Generating HTTP Response\n");
 	/* Generate the JSON response */
 	bool include_status = 0;
+    bool status_200 = false;
 	httpd_resp_set_status(req, HTTPD_207);
 	httpd_resp_set_type(req, "application/hap+json");
+    hap_json_resp_t resp = {
+        .req = req,
+    };
 	json_gen_str_t jstr;
-	json_gen_str_start(&jstr, outbuf, sizeof(outbuf), hap_http_json_flush_chunk, req);
+	json_gen_str_start(&jstr, json_buf, HAP_GET_CHAR_JSON_SIZE, hap_http_json_flush_deferred, &resp);
 
-	/* Get the ids once again. Not checking for success since that
-	 * would be redundant
-	 */
-	httpd_query_key_value(url_query_str, "id", val, strlen(uri) + 1);
-    char_cnt = 0;
+    int char_cnt = 0;
 	int aid, iid;
-	val_ptr = val;
+    const char *id_ptr = q.id;
+    const char *id_end = q.id + q.id_len;
 	/* Parse the AIDs and IIDs in the "id" field and fetch the
 	 * characteristic pointer for each
 	 */
-	p = strsep(&val_ptr, ".");
-	while (p) {
-		aid = atoi(p);
-		p = strsep(&val_ptr, ",");
-		iid = atoi(p);
-		p = strsep(&val_ptr, ".");
-		hap_char_t *hc = hap_acc_get_char_by_iid(hap_acc_get_by_aid(aid), iid);
+	while (hap_parse_next_id(&id_ptr, id_end, &aid, &iid)) {
+		hap_char_t *hc = hap_get_char_by_aid_iid(aid, iid);
 		if (!hc) {
 			hap_set_char_report_status(&include_status, &jstr,
 					aid, iid, HAP_STATUS_RES_ABSENT);
 			continue;
 		}
-		if (!(((__hap_char_t *)hc)->permission & HAP_CHAR_PERM_PR)) {
+		if (!(((__hap_char_t *)hc)->desc->permission & HAP_CHAR_PERM_PR)) {
 			hap_set_char_report_status(&include_status, &jstr,
 					aid, iid, HAP_STATUS_RD_ON_WRONLY);
 			continue;
 		}
+        hap_read_data_t *arr = hap_get_char_reserve(read_arr, &read_arr_size, char_cnt);
+        if (!arr) {
+			hap_set_char_report_status(&include_status, &jstr,
+					aid, iid, HAP_STATUS_OO_RES);
+			continue;
+        }
+        if (arr != read_arr) {
+            read_arr = arr;
+            status_codes = hap_get_char_pool.status_codes;
+        }
         hap_char_set_owner_ctrl(hc, hap_get_ctrl_session_index(session));
         ((__hap_char_t *)hc)->update_called = false;
         /* Add the characteristic to the read array */
 		read_arr[char_cnt].hc = hc;
-        status_codes[char_cnt] = HAP_STATUS_SUCCESS;
-        read_arr[char_cnt].status = &status_codes[char_cnt];
 		char_cnt++;
 	}
 
     if (!char_cnt) {
         goto get_char_end;
     }
-
+    /* The array may have moved while parsing, so the status pointers are set only now */
+    int i;
+    for (i = 0; i < char_cnt; i++) {
+        status_codes[i] = HAP_STATUS_SUCCESS;
+        read_arr[i].status = &status_codes[i];
+    }
 
 	int hs_index = 0;
 	bool read_err = false;
@@ -1184,7 +2007,6 @@ static int hap_http_get_characteristics(httpd_req_t *req)
     /* Read all the values first, before preparing the response, so that it
      * would be known in advance, if any read error is encountered
      */
-    int i;
 	/* The counter here will go till char_cnt instead of char_cnt - 1.
 	 * When i == char_cnt, it will mean that all elements in the array
 	 * have been looped through.
@@ -1215,6 +2037,7 @@ static int hap_http_get_characteristics(httpd_req_t *req)
              * So, set response type to 200 OK
              */
             httpd_resp_set_status(req, HTTPD_200);
+            status_200 = true;
         }
         json_gen_start_object(&jstr);
         json_gen_push_array(&jstr, "characteristics");
@@ -1237,12 +2060,12 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 		json_gen_obj_set_int(&jstr, "aid", ha->aid);
 		json_gen_obj_set_int(&jstr, "iid", hc->iid);
 
-        if (hc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
+        if (hc->desc->permission & HAP_CHAR_PERM_SPECIAL_READ) {
             json_gen_obj_set_null(&jstr, "value");
         } else {
             /* Include "value" only if status is SUCCESS */
             if (*read_arr[i].status == HAP_STATUS_SUCCESS) {
-                hap_add_char_val_json(hc->format, "value", &hc->val, &jstr);
+                hap_add_char_val_json(hc->desc->format, "value", &hc->val, &jstr);
             }
         }
 		/* Include status only if it was already included because of
@@ -1252,38 +2075,24 @@ static int hap_http_get_characteristics(httpd_req_t *req)
 		if (include_status || read_err) {
 			json_gen_obj_set_int(&jstr, "status", *read_arr[i].status);
 		}
-		if (type)
+		if (q.type)
 			hap_add_char_type(hc, &jstr);
-		if (perms)
+		if (q.perms)
 			hap_add_char_perms(hc, &jstr);
-		if (ev) {
+		if (q.ev) {
 			hap_add_char_ev(hc, &jstr, hap_get_ctrl_session_index(session));
         }
-		if (meta)
+		if (q.meta)
 			hap_add_char_meta(hc, &jstr);
 		json_gen_end_object(&jstr);
 	}
 get_char_end:
 	json_gen_pop_array(&jstr);
 	json_gen_end_object(&jstr);
-	json_gen_str_end(&jstr);
-
-	hap_platform_memory_free(read_arr);
-    hap_platform_memory_free(status_codes);
-
-    /* This indicates the last chunk */
-    httpd_resp_send_chunk(req, NULL, 0);
+    hap_json_resp_end(&resp, &jstr, status_200);
     ESP_MFI_DEBUG_PLAIN("\n");
 get_char_return:
-    if (heap_val_buf) {
-        hap_platform_memory_free(heap_val_buf);
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Freed allocated buffer for GET");
-    }
-
-    if (url_query_str) {
-        hap_platform_memory_free(url_query_str);
-    }
-
+    hap_scratch_reset();
     hap_report_event(HAP_EVENT_GET_CHAR_COMPLETED, NULL, 0);
 	return HAP_SUCCESS;
 }
@@ -1298,13 +2107,52 @@ static struct httpd_uri hap_characteristics_put = {
     .handler = hap_http_put_characteristics,
 };
 
+#define HAP_HTTP_PAIRING_TLV_200_HDR    "HTTP/1.1 " HTTPD_200 "\r\n"    \
+        "Content-Type: application/pairing+tlv8\r\n"                   \
+        "Content-Length: %d\r\n\r\n"
+
+static int hap_http_tlv_stream_send(const uint8_t *data, int len, void *priv)
+{
+    return httpd_send((httpd_req_t *)priv, (const char *)data, len);
+}
+
+/* The pairings list can have up to HAP_MAX_CONTROLLERS entries. Rather than
+ * building all of it in one buffer, it is sent out in full network frames as
+ * the entries get written, after a counting pass for the Content-Length.
+ */
+static int hap_http_pairings_list_send(httpd_req_t *req, uint8_t *buf, int bufsize)
+{
+    hap_tlv_stream_t stream;
+    char hdr[sizeof(HAP_HTTP_PAIRING_TLV_200_HDR) + 10];
+
+    hap_tlv_stream_init(&stream, NULL, 0, NULL, NULL);
+    if (hap_pairings_list_write(&stream) != HAP_SUCCESS) {
+        return HAP_FAIL;
+    }
+    int hdr_len = snprintf(hdr, sizeof(hdr), HAP_HTTP_PAIRING_TLV_200_HDR, stream.total);
+
+    hap_tlv_stream_init(&stream, buf, bufsize, hap_http_tlv_stream_send, req);
+    if ((hap_tlv_stream_write(&stream, hdr, hdr_len) < 0) ||
+            (hap_pairings_list_write(&stream) != HAP_SUCCESS) ||
+            (hap_tlv_stream_flush(&stream) < 0)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to send the pairings list");
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
 static int hap_http_pairings_handler(httpd_req_t *req)
 {
-	uint8_t buf[2048]; /* Large buffer to accommodate 16 pairings list */
+	/* Requests are small, and the List Pairings response is streamed */
+	uint8_t buf[HAP_MAX_NW_FRAME_SIZE];
 	void *ctx = hap_platform_httpd_get_sess_ctx(req);
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
 	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
 	int outlen;
+    if (hap_pairings_is_list_req(ctx, buf, data_len)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "List Pairings received");
+        return hap_http_pairings_list_send(req, buf, sizeof(buf));
+    }
     hap_secure_session_t *session = (hap_secure_session_t *)ctx;
     if (!hap_is_req_secure(session)) {
         /* Only setting the HTTP status here. Actual error TLV will be added
@@ -1347,24 +2195,40 @@ static struct httpd_uri hap_identify = {
     .handler = hap_http_post_identify,
 };
 
+/* {"ttl":<val>,"pid":<val>} with room to spare. The prepare bodies are read into
+ * a single buffer shared by all sessions, as all requests are handled by the one
+ * HTTP task.
+ */
+#define HAP_PREPARE_BODY_MAX    128
+static char hap_prepare_body[HAP_PREPARE_BODY_MAX];
+
 static int hap_http_put_prepare(httpd_req_t *req)
 {
-    char buf[512] = {0};
+    static const char *status_ok = "{\"status\":0}";
+    static const char *status_invalid = "{\"status\":-70410}";
+    /* {"ttl":<val>,"pid":<val>} needs just 5 tokens */
+    uint32_t tok_buf[8 * 5 * sizeof(int) / sizeof(uint32_t)];
 
     ESP_MFI_DEBUG_PLAIN("Socket fd: %d; HTTP Request %s %s\n", httpd_req_to_sockfd(req), hap_platform_httpd_get_req_method(req), hap_platform_httpd_get_req_uri(req));
     hap_secure_session_t *session = (hap_secure_session_t *)hap_platform_httpd_get_sess_ctx(req);
     if (!hap_is_req_secure(session)) {
         return hap_http_session_not_authorized(req);
     }
-	int data_len = httpd_req_recv(req, (char *)buf, sizeof(buf));
+    if (hap_platform_httpd_get_content_len(req) >= sizeof(hap_prepare_body)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Prepare body too long");
+		httpd_resp_set_status(req, HTTPD_400);
+		return httpd_resp_send(req, NULL, 0);
+    }
+	int data_len = httpd_req_recv(req, hap_prepare_body, sizeof(hap_prepare_body) - 1);
 	if (data_len < 0) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to read HTTPD Data");
 		httpd_resp_set_status(req, HTTPD_500);
 		return httpd_resp_send(req, NULL, 0);
 	}
-    ESP_MFI_DEBUG_PLAIN("Data Received: %s\n", buf);
+    hap_prepare_body[data_len] = 0;
+    ESP_MFI_DEBUG_PLAIN("Data Received: %s\n", hap_prepare_body);
 	jparse_ctx_t jctx;
-	if (json_parse_start(&jctx, buf, data_len) != HAP_SUCCESS) {
+	if (json_parse_start_static(&jctx, hap_prepare_body, data_len, tok_buf, sizeof(tok_buf)) != HAP_SUCCESS) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to parse HTTPD JSON Data");
 		httpd_resp_set_status(req, HTTPD_500);
 		return httpd_resp_send(req, NULL, 0);
@@ -1373,17 +2237,13 @@ static int hap_http_put_prepare(httpd_req_t *req)
 	httpd_resp_set_type(req, "application/hap+json");
     uint64_t pid;
     int64_t ttl;
-    if ((json_obj_get_int64(&jctx, "pid", (int64_t *)&pid) != OS_SUCCESS) ||
-        (json_obj_get_int64(&jctx, "ttl", &ttl) != OS_SUCCESS)) {
-		snprintf(buf, sizeof(buf),"{\"status\":-70410}");
-    } else {
-        session->pid = pid;
-        session->ttl = ttl;
-        session->prepare_time = esp_timer_get_time() / 1000; /* Set current time in msec */
-        snprintf(buf, sizeof(buf),"{\"status\":0}");
+    const char *status = status_invalid;
+    if ((json_obj_get_int64(&jctx, "pid", (int64_t *)&pid) == OS_SUCCESS) &&
+        (json_obj_get_int64(&jctx, "ttl", &ttl) == OS_SUCCESS) &&
+        (hap_tw_arm(hap_get_ctrl_session_index(session), pid, ttl) == HAP_SUCCESS)) {
+        status = status_ok;
     }
-    json_parse_end(&jctx);
-    httpd_resp_send(req, buf, strlen(buf));
+    httpd_resp_send(req, status, strlen(status));
     return HAP_SUCCESS;
 }
 
@@ -1393,15 +2253,63 @@ static struct httpd_uri hap_prepare = {
     .handler = hap_http_put_prepare,
 };
 
+/* Words needed for a bit per characteristic in a notification batch */
+#define HAP_NOTIF_MASK_WORDS    ((UINT8_MAX + 31) / 32)
+#define HAP_NOTIF_JSON_SIZE     1024
+
+/* Working set of the notification drain. It is sized from the config on
+ * first use and then kept, so that a trigger does not allocate anything.
+ * Only used from the httpd task.
+ */
+typedef struct {
+    hap_char_t **char_arr;
+    hap_secure_session_t **sessions;
+    uint32_t (*masks)[HAP_NOTIF_MASK_WORDS];
+    int *group_leader;
+    int8_t *group_of;
+} hap_notif_scratch_t;
+
+static hap_notif_scratch_t hap_notif_scratch;
+
+static hap_notif_scratch_t *hap_notif_scratch_get(void)
+{
+    hap_notif_scratch_t *scratch = &hap_notif_scratch;
+    if (scratch->char_arr) {
+        return scratch;
+    }
+    int num_char = hap_priv.cfg.max_event_notif_chars;
+    int max_sessions = hap_priv.cfg.max_sessions;
+    /* A single block, laid out in decreasing order of alignment */
+    size_t size = num_char * sizeof(hap_char_t *)
+            + max_sessions * (sizeof(hap_secure_session_t *) + sizeof(*scratch->masks)
+                    + sizeof(int) + sizeof(int8_t));
+    uint8_t *block = hap_platform_memory_calloc(1, size);
+    if (!block) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate memory for notifications");
+        return NULL;
+    }
+    scratch->char_arr = (hap_char_t **)block;
+    block += num_char * sizeof(hap_char_t *);
+    scratch->sessions = (hap_secure_session_t **)block;
+    block += max_sessions * sizeof(hap_secure_session_t *);
+    scratch->masks = (uint32_t (*)[HAP_NOTIF_MASK_WORDS])block;
+    block += max_sessions * sizeof(*scratch->masks);
+    scratch->group_leader = (int *)block;
+    block += max_sessions * sizeof(int);
+    scratch->group_of = (int8_t *)block;
+    return scratch;
+}
+
 static void hap_send_notification(void *arg)
 {
     int num_char = hap_priv.cfg.max_event_notif_chars;
     hap_char_t *hc;
-    hap_char_t **char_arr = hap_platform_memory_calloc(num_char, sizeof(hap_char_t *));
+    hap_notif_scratch_t *scratch = hap_notif_scratch_get();
 
-    if (!char_arr) {
+    if (!scratch) {
         return;
     }
+    hap_char_t **char_arr = scratch->char_arr;
 
     int i, num_notif_chars;
     for (i = 0; i < num_char; i++) {
@@ -1412,75 +2320,132 @@ static void hap_send_notification(void *arg)
             break;
         }
     }
-    /* If no characteristic notifications are pending, free char_arr and exit */ 
+    /* If no characteristic notifications are pending, just exit */
     if (i == 0) {
-	hap_platform_memory_free(char_arr); 
         return;
     }
+    /* A full batch may have left more pending, pick those up in another pass */
+    if (i == num_char) {
+        hap_http_send_notif();
+    }
     num_notif_chars = i;
+    HAP_TRACE_BEGIN(HAP_TRACE_SEND_NOTIFICATION, num_notif_chars);
 	hap_secure_session_t *session;
     /* Flag to indicate if any controller was connected */
     bool ctrl_connected = false;
-	char buf[250];
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		session = hap_priv.sessions[i];
-		if (!session)
+
+    /* Work out which of the characteristics each controller needs to hear about.
+     * Controllers normally subscribe to the same set, so they are grouped by
+     * that set and the JSON is only built once per group.
+     */
+    int max_sessions = hap_priv.cfg.max_sessions;
+    uint32_t (*masks)[HAP_NOTIF_MASK_WORDS] = scratch->masks;
+    int8_t *group_of = scratch->group_of;
+    int *group_leader = scratch->group_leader;
+    /* Sessions as at the start, since a new session can take over an index meanwhile */
+    hap_secure_session_t **sessions = scratch->sessions;
+    memset(masks, 0, max_sessions * sizeof(*masks));
+    int num_groups = 0;
+    int num_words = (num_notif_chars + 31) / 32;
+	for (i = 0; i < max_sessions; i++) {
+        group_of[i] = -1;
+		session = sessions[i] = hap_priv.sessions[i];
+		/* HAP-BLE sessions hear about the changes from hap_ble_notify_chars() */
+		if (!session || hap_conn_is_ble(session->conn_identifier))
 			continue;
         ctrl_connected = true;
-		int fd = session->conn_identifier;
-#define HTTPD_HDR_STR      "EVENT/1.0 200 OK\r\n"                   \
-		"Content-Type: application/hap+json\r\n"           \
-		"Content-Length: %d\r\n"
-		char notif_json[1024];
-		json_gen_str_t jstr;
-		json_gen_str_start(&jstr, notif_json, sizeof(notif_json), NULL, NULL);
-		json_gen_start_object(&jstr);
-		json_gen_push_array(&jstr, "characteristics");
+        /* Nothing to look up for a controller without subscriptions */
+        if (!hap_char_get_subs_cnt(i))
+            continue;
 
         int j;
         bool notif_to_send = false;
         for (j = 0; j < num_notif_chars; j++) {
             hc = char_arr[j];
-            __hap_char_t *_hc = ( __hap_char_t *)hc;
             /* If the controller is the owner, dont send notification to it */
             if (hap_char_is_ctrl_owner(hc, i)) {
                 /* Since there can be only one owner, which we are anyways skipping,
                  * we can reset owner value to 0
                  */
-                _hc->owner_ctrl = 0;
+                ((__hap_char_t *)hc)->owner_ctrl = 0;
                 continue;
             }
             if (!hap_char_is_ctrl_subscribed(hc, i))
                 continue;
+            masks[i][j / 32] |= 1U << (j % 32);
+            notif_to_send = true;
+        }
+        if (!notif_to_send) {
+            /* No notification required for this controller. Just continue */
+            continue;
+        }
+
+        /* Join the group with the same set of characteristics, if there is one */
+        int g;
+        for (g = 0; g < num_groups; g++) {
+            if (!memcmp(masks[group_leader[g]], masks[i], num_words * sizeof(uint32_t)))
+                break;
+        }
+        if (g == num_groups)
+            group_leader[num_groups++] = i;
+        group_of[i] = g;
+	}
+
+    /* The header is prepended in place, so that it goes out with the body */
+    char *buf = hap_scratch_alloc(HAP_RESP_HDR_MAX + HAP_NOTIF_JSON_SIZE);
+    char *notif_json = buf ? buf + HAP_RESP_HDR_MAX : NULL;
+    if (!notif_json) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate memory for notifications");
+        num_groups = 0;
+    }
+	for (int g = 0; g < num_groups; g++) {
+        uint32_t *mask = masks[group_leader[g]];
+		json_gen_str_t jstr;
+		json_gen_str_start(&jstr, notif_json, HAP_NOTIF_JSON_SIZE, NULL, NULL);
+		json_gen_start_object(&jstr);
+		json_gen_push_array(&jstr, "characteristics");
 
+        int j;
+        for (j = 0; j < num_notif_chars; j++) {
+            if (!(mask[j / 32] & (1U << (j % 32))))
+                continue;
+            hc = char_arr[j];
+            __hap_char_t *_hc = ( __hap_char_t *)hc;
             json_gen_start_object(&jstr);
             hap_acc_t *ha = hap_serv_get_parent(hap_char_get_parent(hc));
             int aid = ((__hap_acc_t *)ha)->aid;
             json_gen_obj_set_int(&jstr, "aid", aid);
             json_gen_obj_set_int(&jstr, "iid", _hc->iid);
-            hap_add_char_val_json(_hc->format, "value", &_hc->val, &jstr);
+            hap_add_char_val_json(_hc->desc->format, "value", &_hc->val, &jstr);
             json_gen_end_object(&jstr);
-            notif_to_send = true;
-        }
-        if (!notif_to_send) {
-            /* No notification required for this controller. Just continue */
-            continue;
         }
 
         json_gen_pop_array(&jstr);
 		json_gen_end_object(&jstr);
+        int json_len = jstr.free_ptr - jstr.buf;
 		json_gen_str_end(&jstr);
 
-		snprintf(buf, sizeof(buf), HTTPD_HDR_STR,
-				strlen(notif_json));
-		hap_httpd_send(hap_priv.server, fd, buf, strlen(buf), 0);
-		/* Space for sending additional headers based on set_header */
-		hap_httpd_send(hap_priv.server, fd, "\r\n", strlen("\r\n"), 0);
-		hap_httpd_send(hap_priv.server, fd, notif_json, strlen(notif_json), 0);
-        httpd_sess_update_lru_counter(hap_priv.server, fd);
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
-        ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd, notif_json);
+        char *msg = HAP_RESP_HDR_PREPEND(notif_json, HAP_EVENT_200_HDR, json_len);
+        int msg_len = notif_json + json_len - msg;
+
+        /* The same plaintext goes to every controller in the group, each
+         * session encrypts it with its own keys
+         */
+        for (i = 0; i < max_sessions; i++) {
+            if (group_of[i] != g)
+                continue;
+            session = sessions[i];
+            if (hap_get_ctrl_session_index(session) != i)
+                continue;
+            int fd = session->conn_identifier;
+            /* Header and body are contiguous, and go out as a single frame */
+            hap_httpd_send(hap_priv.server, fd, msg, msg_len, 0);
+            hap_session_touch(session);
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Notification Sent");
+            ESP_MFI_DEBUG_PLAIN("Socket fd: %d; Event message: %s\n", fd, notif_json);
+        }
 	}
+    hap_scratch_reset();
     /* If no controller was connected and no disconnected event was sent,
      * reannaounce mDNS. That will increment state number as required
      * by HAP Spec R15.
@@ -1489,7 +2454,10 @@ static void hap_send_notification(void *arg)
         hap_mdns_announce(false);
         hap_priv.disconnected_event_sent = true;
     }
-    hap_platform_memory_free(char_arr);
+    if (hap_priv.transport & HAP_TRANSPORT_BLE) {
+        hap_ble_notify_chars(char_arr, num_notif_chars);
+    }
+    HAP_TRACE_END(HAP_TRACE_SEND_NOTIFICATION, num_notif_chars);
 }
 
 void hap_http_debug_enable()
@@ -1512,6 +2480,14 @@ int hap_register_http_handlers()
 {
     if (!hap_http_registered) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Registering HomeKit web handlers");
+        hap_http_metrics_wrap(&hap_pair_setup, HAP_HTTP_EP_PAIR_SETUP);
+        hap_http_metrics_wrap(&hap_pair_verify, HAP_HTTP_EP_PAIR_VERIFY);
+        hap_http_metrics_wrap(&hap_pairings, HAP_HTTP_EP_PAIRINGS);
+        hap_http_metrics_wrap(&hap_accessories, HAP_HTTP_EP_ACCESSORIES);
+        hap_http_metrics_wrap(&hap_characteristics_get, HAP_HTTP_EP_CHARACTERISTICS_GET);
+        hap_http_metrics_wrap(&hap_characteristics_put, HAP_HTTP_EP_CHARACTERISTICS_PUT);
+        hap_http_metrics_wrap(&hap_identify, HAP_HTTP_EP_IDENTIFY);
+        hap_http_metrics_wrap(&hap_prepare, HAP_HTTP_EP_PREPARE);
         httpd_register_uri_handler(hap_priv.server, &hap_pair_setup);
         httpd_register_uri_handler(hap_priv.server, &hap_pair_verify);
         httpd_register_uri_handler(hap_priv.server, &hap_pairings);
@@ -1523,6 +2499,7 @@ int hap_register_http_handlers()
         if (hap_priv.features & HAP_FF_SW_TOKEN_AUTH) {
             hap_register_secure_message_handler(hap_priv.server);
         }
+        hap_http_metrics_start(hap_priv.server);
     }
     hap_http_registered = true;
     return HAP_SUCCESS;
@@ -1543,6 +2520,7 @@ int hap_unregister_http_handlers()
         if (hap_priv.features & HAP_FF_SW_TOKEN_AUTH) {
             hap_unregister_secure_message_handler(hap_priv.server);
         }
+        hap_http_metrics_stop(hap_priv.server);
     }
     hap_http_registered = false;
     return HAP_SUCCESS;
@@ -1550,10 +2528,15 @@ int hap_unregister_http_handlers()
 
 int hap_httpd_start(void)
 {
-    if (hap_platform_httpd_start(&hap_priv.server) == ESP_OK) {
-        return HAP_SUCCESS;
+    if (hap_platform_httpd_start(&hap_priv.server) != ESP_OK) {
+        return HAP_FAIL;
+    }
+#ifdef HAP_ASYNC_PAIRING
+    if (hap_pair_worker_start() != HAP_SUCCESS) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Pairing worker start failed. Pairing requests will be processed in the handlers");
     }
-    return HAP_FAIL;
+#endif /* HAP_ASYNC_PAIRING */
+    return HAP_SUCCESS;
 }
 
 httpd_handle_t * hap_httpd_get_handle()
@@ -1563,15 +2546,74 @@ httpd_handle_t * hap_httpd_get_handle()
 
 int hap_httpd_stop(void)
 {
+#ifdef HAP_ASYNC_PAIRING
+    hap_pair_worker_stop();
+#endif /* HAP_ASYNC_PAIRING */
     hap_platform_httpd_stop(&hap_priv.server);
     return HAP_SUCCESS;
 }
 
 static bool first_announce_done;
 
+#ifdef CONFIG_HAP_MDNS_ANNOUNCE_WINDOW_MS
+#define HAP_MDNS_ANNOUNCE_WINDOW_MS     CONFIG_HAP_MDNS_ANNOUNCE_WINDOW_MS
+#else
+#define HAP_MDNS_ANNOUNCE_WINDOW_MS     1000
+#endif
+
+/* Re-announcements are rate limited. The first one in a quiet period goes out
+ * immediately, the ones that follow within the window are merged into a single
+ * re-announcement at the end of the window.
+ */
+static esp_timer_handle_t hap_mdns_announce_timer;
+static portMUX_TYPE hap_mdns_announce_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool hap_mdns_announce_pending;
+static int64_t hap_mdns_last_announce_ms;
+
+static void hap_mdns_announce_timer_cb(void *arg)
+{
+    if (hap_send_event(HAP_INTERNAL_EVENT_MDNS_ANNOUNCE) != HAP_SUCCESS) {
+        hap_mdns_announce_flush();
+    }
+}
+
+static int hap_mdns_announce_timer_init()
+{
+    if (!HAP_MDNS_ANNOUNCE_WINDOW_MS || hap_mdns_announce_timer) {
+        return HAP_SUCCESS;
+    }
+    esp_timer_create_args_t timer_args = {
+        .callback = hap_mdns_announce_timer_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "hap_mdns",
+    };
+    if (esp_timer_create(&timer_args, &hap_mdns_announce_timer) != ESP_OK) {
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+static void hap_mdns_announce_timer_deinit()
+{
+    if (hap_mdns_announce_timer) {
+        esp_timer_stop(hap_mdns_announce_timer);
+        esp_timer_delete(hap_mdns_announce_timer);
+        hap_mdns_announce_timer = NULL;
+    }
+    hap_mdns_announce_pending = false;
+}
+
 int hap_mdns_deannounce(void)
 {
     int ret = HAP_SUCCESS;
+    /* A pending re-announcement is of no use once the service goes away */
+    if (hap_mdns_announce_timer) {
+        esp_timer_stop(hap_mdns_announce_timer);
+    }
+    portENTER_CRITICAL(&hap_mdns_announce_lock);
+    hap_mdns_announce_pending = false;
+    portEXIT_CRITICAL(&hap_mdns_announce_lock);
     if (first_announce_done) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Deannouncing _hap._tcp mDNS service");
         ret = hap_mdns_serv_stop(&hap_priv.hap_mdns_handle);
@@ -1584,7 +2626,7 @@ int hap_mdns_deannounce(void)
     return ret;
 }
 
-int hap_mdns_announce(bool first)
+static int hap_mdns_do_announce(bool first)
 {
     /* If the API is called with the "first" argument as true, Force announce the service,
      * rather than just sending a re-announce packet
@@ -1685,12 +2727,68 @@ int hap_mdns_announce(bool first)
     return HAP_SUCCESS;
 }
 
+int hap_mdns_announce_flush(void)
+{
+    portENTER_CRITICAL(&hap_mdns_announce_lock);
+    bool pending = hap_mdns_announce_pending;
+    hap_mdns_announce_pending = false;
+    if (pending) {
+        hap_mdns_last_announce_ms = esp_timer_get_time() / 1000;
+    }
+    portEXIT_CRITICAL(&hap_mdns_announce_lock);
+    if (!pending) {
+        return HAP_SUCCESS;
+    }
+    return hap_mdns_do_announce(false);
+}
+
+int hap_mdns_announce(bool first)
+{
+    /* The first announcement (adding the service) is never delayed */
+    if (first || !first_announce_done || !hap_mdns_announce_timer) {
+        hap_mdns_last_announce_ms = esp_timer_get_time() / 1000;
+        return hap_mdns_do_announce(first);
+    }
+    int64_t now = esp_timer_get_time() / 1000;
+    int64_t wait_ms = 0;
+    portENTER_CRITICAL(&hap_mdns_announce_lock);
+    if (!hap_mdns_announce_pending) {
+        int64_t elapsed = now - hap_mdns_last_announce_ms;
+        if (elapsed >= HAP_MDNS_ANNOUNCE_WINDOW_MS) {
+            hap_mdns_last_announce_ms = now;
+        } else {
+            hap_mdns_announce_pending = true;
+            wait_ms = HAP_MDNS_ANNOUNCE_WINDOW_MS - elapsed;
+        }
+    } else {
+        /* Already waiting. This one rides along */
+        portEXIT_CRITICAL(&hap_mdns_announce_lock);
+        return HAP_SUCCESS;
+    }
+    portEXIT_CRITICAL(&hap_mdns_announce_lock);
+
+    if (wait_ms) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Deferring mDNS re-announcement by %d ms", (int)wait_ms);
+        esp_timer_start_once(hap_mdns_announce_timer, wait_ms * 1000ULL);
+        return HAP_SUCCESS;
+    }
+    return hap_mdns_do_announce(false);
+}
+
 static bool hap_ip_services_started;
 int hap_ip_services_start()
 {
     if (hap_ip_services_started) {
         return HAP_SUCCESS;
     }
+    if (hap_mdns_announce_timer_init() != HAP_SUCCESS) {
+        /* Not fatal. Re-announcements just go out right away */
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "mDNS re-announcement timer creation failed");
+    }
+    if (hap_tw_init() != HAP_SUCCESS) {
+        /* Not fatal either. Prepares just get rejected */
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Timed write timer creation failed");
+    }
     hap_register_http_handlers();
     if (hap_mdns_announce(false) != HAP_SUCCESS) {
         hap_unregister_http_handlers();
@@ -1704,7 +2802,9 @@ int hap_ip_services_stop()
 {
     if (hap_ip_services_started) {
         hap_mdns_deannounce();
+        hap_mdns_announce_timer_deinit();
         hap_unregister_http_handlers();
+        hap_tw_deinit();
         hap_ip_services_started = false;
     }
     return HAP_SUCCESS;
@@ -21,14 +21,92 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  */
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include <hap.h>
 #include <esp_mfi_debug.h>
 #include <hap_platform_keystore.h>
+#include <esp_hap_main.h>
+#include <esp_hap_keystore.h>
 
 static bool keystore_init_done;
 static char *hap_platform_nvs_partition;
 static char *hap_platform_factory_nvs_partition;
 
+#ifdef CONFIG_HAP_KEYSTORE_COMMIT_DELAY_MS
+#define HAP_KEYSTORE_COMMIT_DELAY_MS    CONFIG_HAP_KEYSTORE_COMMIT_DELAY_MS
+#else
+#define HAP_KEYSTORE_COMMIT_DELAY_MS    3000
+#endif
+
+/* Small, frequently updated values (like the state and config numbers) are
+ * kept in a RAM shadow and written to NVS once the commit delay expires,
+ * so that a burst of updates costs a single flash write.
+ */
+#define HAP_KEYSTORE_SHADOW_ENTRIES     4
+#define HAP_KEYSTORE_SHADOW_VAL_LEN     8
+#define HAP_KEYSTORE_NAME_LEN           16  /* NVS_KEY_NAME_MAX_SIZE */
+
+typedef struct {
+    char name_space[HAP_KEYSTORE_NAME_LEN];
+    char key[HAP_KEYSTORE_NAME_LEN];
+    uint8_t val[HAP_KEYSTORE_SHADOW_VAL_LEN];
+    uint8_t val_len;
+    bool used;
+    bool dirty;
+} hap_keystore_shadow_t;
+
+static hap_keystore_shadow_t hap_keystore_shadow[HAP_KEYSTORE_SHADOW_ENTRIES];
+static SemaphoreHandle_t hap_keystore_shadow_lock;
+static esp_timer_handle_t hap_keystore_commit_timer;
+
+static void hap_keystore_commit_timer_cb(void *arg)
+{
+    /* Let the HAP loop do the flash write. If it is not running, do it here */
+    if (hap_send_event(HAP_INTERNAL_EVENT_KEYSTORE_COMMIT) != HAP_SUCCESS) {
+        hap_keystore_commit();
+    }
+}
+
+static int hap_keystore_shadow_init()
+{
+    if (!HAP_KEYSTORE_COMMIT_DELAY_MS) {
+        return HAP_SUCCESS;
+    }
+    hap_keystore_shadow_lock = xSemaphoreCreateMutex();
+    if (!hap_keystore_shadow_lock) {
+        return HAP_FAIL;
+    }
+    esp_timer_create_args_t timer_args = {
+        .callback = hap_keystore_commit_timer_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "hap_ks_commit",
+    };
+    if (esp_timer_create(&timer_args, &hap_keystore_commit_timer) != ESP_OK) {
+        vSemaphoreDelete(hap_keystore_shadow_lock);
+        hap_keystore_shadow_lock = NULL;
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+/* Must be called with hap_keystore_shadow_lock held */
+static hap_keystore_shadow_t *hap_keystore_shadow_find(const char *name_space, const char *key)
+{
+    int i;
+    for (i = 0; i < HAP_KEYSTORE_SHADOW_ENTRIES; i++) {
+        if (hap_keystore_shadow[i].used
+                && !strcmp(hap_keystore_shadow[i].key, key)
+                && !strcmp(hap_keystore_shadow[i].name_space, name_space)) {
+            return &hap_keystore_shadow[i];
+        }
+    }
+    return NULL;
+}
+
 int hap_keystore_init()
 {
     if (keystore_init_done) {
@@ -45,6 +123,10 @@ int hap_keystore_init()
     hap_platform_factory_nvs_partition = hap_platform_keystore_get_factory_nvs_partition_name();
     hap_platform_keystore_init_partition(hap_platform_factory_nvs_partition, true);
 
+    if (hap_keystore_shadow_init() != HAP_SUCCESS) {
+        /* Not fatal. All writes will just go to NVS directly */
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Keystore write batching unavailable");
+    }
     keystore_init_done = true;
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Keystore initialised");
     return HAP_SUCCESS;
@@ -64,9 +146,60 @@ int __hap_keystore_get(const char *part_name, const char *name_space, const char
 }
 int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size)
 {
-
+    if (hap_keystore_shadow_lock) {
+        int ret = HAP_FAIL;
+        bool found = false;
+        xSemaphoreTake(hap_keystore_shadow_lock, portMAX_DELAY);
+        hap_keystore_shadow_t *entry = hap_keystore_shadow_find(name_space, key);
+        if (entry) {
+            found = true;
+            if (*val_size >= entry->val_len) {
+                memcpy(val, entry->val, entry->val_len);
+                ret = HAP_SUCCESS;
+            }
+            *val_size = entry->val_len;
+        }
+        xSemaphoreGive(hap_keystore_shadow_lock);
+        if (found) {
+            return ret;
+        }
+    }
     return __hap_keystore_get(hap_platform_nvs_partition, name_space, key, val, val_size);
 }
+/* Reads several keys of a namespace through one handle. Values still waiting
+ * in the shadow replace what is in NVS. Returns the number of values read.
+ */
+int hap_keystore_get_multi(const char *name_space, hap_platform_keystore_item_t *items, int count)
+{
+    if (!keystore_init_done) {
+        return 0;
+    }
+    int found = hap_platform_keystore_get_multi(hap_platform_nvs_partition, name_space, items, count);
+    if (!hap_keystore_shadow_lock) {
+        return found;
+    }
+    int i;
+    found = 0;
+    xSemaphoreTake(hap_keystore_shadow_lock, portMAX_DELAY);
+    for (i = 0; i < count; i++) {
+        hap_keystore_shadow_t *entry = hap_keystore_shadow_find(name_space, items[i].key);
+        if (entry) {
+            /* The buffer size given is gone by now if NVS had a value too */
+            items[i].status = -1;
+            if (items[i].val_size >= entry->val_len) {
+                memcpy(items[i].val, entry->val, entry->val_len);
+                items[i].status = 0;
+            }
+            items[i].val_size = entry->val_len;
+        }
+        if (items[i].status == 0) {
+            found++;
+        }
+    }
+    xSemaphoreGive(hap_keystore_shadow_lock);
+    return found;
+}
+
 int hap_factory_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size)
 {
     return __hap_keystore_get(hap_platform_factory_nvs_partition, name_space, key, val, val_size);
@@ -91,6 +224,101 @@ int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val
     return __hap_keystore_set(hap_platform_nvs_partition, name_space, key, val, val_len);
 }
 
+int hap_keystore_set_deferred(const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
+{
+    if (!keystore_init_done) {
+        return HAP_FAIL;
+    }
+    if (!hap_keystore_shadow_lock || (val_len > HAP_KEYSTORE_SHADOW_VAL_LEN)
+            || (strlen(name_space) >= HAP_KEYSTORE_NAME_LEN)
+            || (strlen(key) >= HAP_KEYSTORE_NAME_LEN)) {
+        return hap_keystore_set(name_space, key, val, val_len);
+    }
+
+    xSemaphoreTake(hap_keystore_shadow_lock, portMAX_DELAY);
+    hap_keystore_shadow_t *entry = hap_keystore_shadow_find(name_space, key);
+    if (!entry) {
+        int i;
+        for (i = 0; i < HAP_KEYSTORE_SHADOW_ENTRIES; i++) {
+            if (!hap_keystore_shadow[i].used) {
+                entry = &hap_keystore_shadow[i];
+                strcpy(entry->name_space, name_space);
+                strcpy(entry->key, key);
+                entry->used = true;
+                break;
+            }
+        }
+    }
+    if (!entry) {
+        xSemaphoreGive(hap_keystore_shadow_lock);
+        /* No room in the shadow. Just write through */
+        return hap_keystore_set(name_space, key, val, val_len);
+    }
+    bool changed = (entry->val_len != val_len) || memcmp(entry->val, val, val_len);
+    memcpy(entry->val, val, val_len);
+    entry->val_len = val_len;
+    if (changed) {
+        entry->dirty = true;
+    }
+    xSemaphoreGive(hap_keystore_shadow_lock);
+
+    /* The first pending write starts the commit window, later ones ride along */
+    if (changed && !esp_timer_is_active(hap_keystore_commit_timer)) {
+        esp_timer_start_once(hap_keystore_commit_timer, HAP_KEYSTORE_COMMIT_DELAY_MS * 1000ULL);
+    }
+    return HAP_SUCCESS;
+}
+
+int hap_keystore_commit()
+{
+    if (!hap_keystore_shadow_lock) {
+        return HAP_SUCCESS;
+    }
+    int ret = HAP_SUCCESS;
+    int i;
+    hap_keystore_shadow_t pending;
+    esp_timer_stop(hap_keystore_commit_timer);
+    for (i = 0; i < HAP_KEYSTORE_SHADOW_ENTRIES; i++) {
+        /* Take a copy, so that the flash write happens without holding the lock */
+        xSemaphoreTake(hap_keystore_shadow_lock, portMAX_DELAY);
+        pending = hap_keystore_shadow[i];
+        hap_keystore_shadow[i].dirty = false;
+        xSemaphoreGive(hap_keystore_shadow_lock);
+        if (!pending.used || !pending.dirty) {
+            continue;
+        }
+        if (hap_keystore_set(pending.name_space, pending.key, pending.val, pending.val_len) != HAP_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to commit %s:%s", pending.name_space, pending.key);
+            ret = HAP_FAIL;
+        }
+    }
+    return ret;
+}
+
+void hap_keystore_flush()
+{
+    hap_platform_keystore_flush();
+}
+
+static void hap_keystore_shadow_drop(const char *name_space, const char *key)
+{
+    if (!hap_keystore_shadow_lock) {
+        return;
+    }
+    int i;
+    xSemaphoreTake(hap_keystore_shadow_lock, portMAX_DELAY);
+    for (i = 0; i < HAP_KEYSTORE_SHADOW_ENTRIES; i++) {
+        if (!hap_keystore_shadow[i].used) {
+            continue;
+        }
+        if ((!name_space || !strcmp(hap_keystore_shadow[i].name_space, name_space))
+                && (!key || !strcmp(hap_keystore_shadow[i].key, key))) {
+            memset(&hap_keystore_shadow[i], 0, sizeof(hap_keystore_shadow[i]));
+        }
+    }
+    xSemaphoreGive(hap_keystore_shadow_lock);
+}
+
 int hap_factory_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
 {
     return __hap_keystore_set(hap_platform_factory_nvs_partition, name_space, key, val, val_len);
@@ -101,6 +329,7 @@ int hap_keystore_delete(const char *name_space, const char *key)
     if (!keystore_init_done) {
         return HAP_FAIL;
     }
+    hap_keystore_shadow_drop(name_space, key);
 
     int err = hap_platform_keystore_delete(hap_platform_nvs_partition, name_space, key);
     if (err != 0) {
@@ -114,6 +343,7 @@ int hap_keystore_delete_namespace(const char *name_space)
     if (!keystore_init_done) {
         return HAP_FAIL;
     }
+    hap_keystore_shadow_drop(name_space, NULL);
 
     int err = hap_platform_keystore_delete_namespace(hap_platform_nvs_partition, name_space);
     if (err != 0) {
@@ -124,5 +354,6 @@ int hap_keystore_delete_namespace(const char *name_space)
 
 void hap_keystore_erase_all_data()
 {
+    hap_keystore_shadow_drop(NULL, NULL);
     hap_platfrom_keystore_erase_partition(hap_platform_nvs_partition);
 }
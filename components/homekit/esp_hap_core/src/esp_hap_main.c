@@ -35,32 +35,83 @@
 #include <esp_hap_ip_services.h>
 #include <esp_hap_wifi.h>
 #include <esp_hap_mdns.h>
+#include <esp_hap_ble.h>
 #include <esp_hap_keystore.h>
 #include <esp_hap_main.h>
 #include <esp_hap_wac.h>
 #include <esp_hap_bct_priv.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_pair_setup.h>
 #include <hap_platform_os.h>
+#include <esp_hap_db_arena.h>
+#include <esp_hap_scratch.h>
+#include <esp_hap_aead.h>
+#include <esp_hap_event_bus.h>
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+#include <esp_task_wdt.h>
+#include <esp_timer.h>
+#endif
 
+/* The HAP loop has two lanes. Notification triggers only set a flag, which the
+ * loop checks before every event from the bulk queue, so notifications never
+ * wait behind more than one slow (mDNS, network, reset) event and any number of
+ * triggers collapses into a single notification pass.
+ */
+#define HAP_LOOP_QUEUE_SIZE     10
 static QueueHandle_t xQueue;
+static TaskHandle_t hap_loop_task_handle;
+static bool hap_notif_pending;
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+/* hap-loop is started once and never restarted, so its stack, TCB and queue
+ * can be reserved up front and reused by nothing else.
+ */
+static StackType_t hap_loop_stack[CONFIG_HAP_STATIC_LOOP_STACK_SIZE];
+static StaticTask_t hap_loop_tcb;
+static uint8_t hap_loop_queue_storage[HAP_LOOP_QUEUE_SIZE * sizeof(hap_event_ctx_t)];
+static StaticQueue_t hap_loop_queue_buf;
+#endif /* CONFIG_HAP_STATIC_ALLOCATION */
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+/* Idle waits are cut to this, so that hap-loop checks in with the task watchdog */
+#define HAP_LOOP_WAIT_TICKS     pdMS_TO_TICKS(1000)
+static bool hap_loop_wdt_subscribed;
+#else
+#define HAP_LOOP_WAIT_TICKS     portMAX_DELAY
+#endif /* CONFIG_HAP_LOOP_WATCHDOG */
 ESP_EVENT_DEFINE_BASE(HAP_EVENT);
 
 const char * hap_get_version(void)
 {
     return MFI_VER;
 }
+static bool hap_transport_is_ip(void)
+{
+    return hap_priv.transport & (HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET | HAP_TRANSPORT_THREAD);
+}
+
+/* Lets controllers know about a change of the pairing status or config number */
+static void hap_announce(void)
+{
+    if (hap_transport_is_ip()) {
+        hap_mdns_announce(false);
+    }
+    if (hap_priv.transport & HAP_TRANSPORT_BLE) {
+        hap_ble_adv_refresh();
+    }
+}
+
 static void hap_nw_configured_sm(hap_internal_event_t event, hap_state_t *state)
 {
     switch (event) {
         case HAP_INTERNAL_EVENT_ACC_PAIRED:
-            hap_mdns_announce(false);
+            hap_announce();
             break;
         case HAP_INTERNAL_EVENT_ACC_UNPAIRED:
-            hap_mdns_announce(false);
+            hap_announce();
+            hap_pair_setup_srp_precompute();
             break;
         case HAP_INTERNAL_EVENT_CONFIG_NUM_UPDATED:
             hap_increment_and_save_config_num();
-            hap_mdns_announce(false);
+            hap_announce();
             break;
         case HAP_INTERNAL_EVENT_BCT_CHANGE_NAME:
             /* Waiting for sometime to allow the response to reach the host */
@@ -101,6 +152,8 @@ static void hap_common_sm(hap_internal_event_t event)
             vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
             hap_close_all_sessions();
             hap_mdns_deannounce();
+            hap_acc_sign_key_wipe();
+            hap_db_snapshot_disable();
             hap_keystore_erase_all_data();
             reboot_reason = HAP_REBOOT_REASON_RESET_TO_FACTORY;
             break;
@@ -123,6 +176,10 @@ static void hap_common_sm(hap_internal_event_t event)
              */
             hap_close_all_sessions();
             hap_mdns_deannounce();
+#ifdef CONFIG_HAP_PAIR_RESUME_PERSIST
+            /* Let the controllers resume their sessions once back up */
+            hap_pair_resume_persist();
+#endif
             reboot_reason = HAP_REBOOT_REASON_REBOOT_ACC;
             break;
         case HAP_INTERNAL_EVENT_RESET_NETWORK:
@@ -137,9 +194,18 @@ static void hap_common_sm(hap_internal_event_t event)
             reboot_reason = HAP_REBOOT_REASON_RESET_NETWORK;
             break;
         case HAP_INTERNAL_EVENT_TRIGGER_NOTIF:
-/* TODO: Avoid direct http function. Notification could be even for iCloud or BLE.
- */
-            hap_http_send_notif();
+            /* The IP pass hands the characteristics over to BLE as well */
+            if (hap_transport_is_ip()) {
+                hap_http_send_notif();
+            } else {
+                hap_ble_send_notif();
+            }
+            return;
+        case HAP_INTERNAL_EVENT_KEYSTORE_COMMIT:
+            hap_keystore_commit();
+            return;
+        case HAP_INTERNAL_EVENT_MDNS_ANNOUNCE:
+            hap_mdns_announce_flush();
             return;
         case HAP_INTERNAL_EVENT_NETWORK_SWITCH:
             ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Taking the network down");
@@ -170,30 +236,100 @@ static void hap_common_sm(hap_internal_event_t event)
     /* Wait for some time after peeforming the operations and then reboot */
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Rebooting...");
     hap_report_event(HAP_EVENT_ACC_REBOOTING, reboot_reason, strlen(reboot_reason) + 1);
+    /* Flush the deferred keystore writes before going down */
+    hap_keystore_commit();
+    hap_keystore_flush();
     vTaskDelay(1000 / hap_platform_os_get_msec_per_tick());
     esp_restart();
 }
 
+/* Heartbeat for the task watchdog */
+static inline void hap_loop_checkin(void)
+{
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+    if (hap_loop_wdt_subscribed) {
+        esp_task_wdt_reset();
+    }
+#endif
+}
+
+/* Returns the time an event started being handled, to pass to hap_loop_event_end() */
+static inline int64_t hap_loop_event_begin(void)
+{
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+    return esp_timer_get_time();
+#else
+    return 0;
+#endif
+}
+
+/* Logs the event if it ran over the budget, and checks in with the task watchdog */
+static inline void hap_loop_event_end(int64_t start_us, hap_internal_event_t event)
+{
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+    int64_t took_us = esp_timer_get_time() - start_us;
+    if (took_us > (int64_t)CONFIG_HAP_LOOP_BUDGET_MS * 1000) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "hap-loop stalled for %d ms on event %d (budget %d ms)",
+                (int)(took_us / 1000), event, CONFIG_HAP_LOOP_BUDGET_MS);
+    }
+#endif
+    hap_loop_checkin();
+}
+
 static void hap_loop_task(void *param)
 {
     hap_state_t cur_state = HAP_STATE_NONE;
-    xQueue = xQueueCreate( 10, sizeof(hap_event_ctx_t) );
+    hap_loop_task_handle = xTaskGetCurrentTaskHandle();
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+    xQueue = xQueueCreateStatic(HAP_LOOP_QUEUE_SIZE, sizeof(hap_event_ctx_t),
+                    hap_loop_queue_storage, &hap_loop_queue_buf);
+#else
+    xQueue = xQueueCreate(HAP_LOOP_QUEUE_SIZE, sizeof(hap_event_ctx_t));
+#endif
     hap_event_ctx_t hap_event;
     bool loop_continue = true;
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Main Loop Started");
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+    hap_loop_wdt_subscribed = (esp_task_wdt_add(NULL) == ESP_OK);
+    if (!hap_loop_wdt_subscribed) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Task watchdog not running, hap-loop stalls are only logged");
+    }
+#endif
     while (loop_continue) {
-        if (xQueueReceive(xQueue, &hap_event, portMAX_DELAY) != pdTRUE) {
-            continue;
-        }
-        if (hap_event.event == HAP_INTERNAL_EVENT_LOOP_STOP) {
-            loop_continue = false;
-            continue;
+        ulTaskNotifyTake(pdTRUE, HAP_LOOP_WAIT_TICKS);
+        hap_loop_checkin();
+        while (loop_continue) {
+            int64_t start_us;
+            /* Latency critical lane first */
+            if (__atomic_exchange_n(&hap_notif_pending, false, __ATOMIC_SEQ_CST)) {
+                start_us = hap_loop_event_begin();
+                hap_common_sm(HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
+                hap_loop_event_end(start_us, HAP_INTERNAL_EVENT_TRIGGER_NOTIF);
+            }
+            if (xQueueReceive(xQueue, &hap_event, 0) != pdTRUE) {
+                break;
+            }
+            if (hap_event.event == HAP_INTERNAL_EVENT_LOOP_STOP) {
+                loop_continue = false;
+                continue;
+            }
+            start_us = hap_loop_event_begin();
+            hap_common_sm(hap_event.event);
+            hap_nw_configured_sm(hap_event.event, &cur_state);
+            hap_loop_event_end(start_us, hap_event.event);
         }
-        hap_common_sm(hap_event.event);
-        hap_nw_configured_sm(hap_event.event, &cur_state);
     }
-    vQueueDelete(xQueue);
+#ifdef CONFIG_HAP_LOOP_WATCHDOG
+    if (hap_loop_wdt_subscribed) {
+        esp_task_wdt_delete(NULL);
+        hap_loop_wdt_subscribed = false;
+    }
+#endif
+    QueueHandle_t queue = xQueue;
     xQueue = NULL;
+    hap_loop_task_handle = NULL;
+    hap_notif_pending = false;
+    vQueueDelete(queue);
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Main Loop Stopped");
     vTaskDelete(NULL);
 }
@@ -203,8 +339,17 @@ int hap_loop_start()
 {
     if (!loop_started) {
         loop_started = true;
-        xTaskCreate(hap_loop_task, "hap-loop", hap_priv.cfg.task_stack_size, NULL,
-                        hap_priv.cfg.task_priority, NULL);
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+        if (hap_priv.cfg.task_stack_size <= sizeof(hap_loop_stack)) {
+            xTaskCreateStaticPinnedToCore(hap_loop_task, "hap-loop", sizeof(hap_loop_stack), NULL,
+                            hap_priv.cfg.task_priority, hap_loop_stack, &hap_loop_tcb, HAP_PLATFORM_TASK_CORE_ID);
+            return HAP_SUCCESS;
+        }
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "hap-loop stack of %u bytes exceeds the static one, using the heap",
+                        (unsigned)hap_priv.cfg.task_stack_size);
+#endif /* CONFIG_HAP_STATIC_ALLOCATION */
+        xTaskCreatePinnedToCore(hap_loop_task, "hap-loop", hap_priv.cfg.task_stack_size, NULL,
+                        hap_priv.cfg.task_priority, NULL, HAP_PLATFORM_TASK_CORE_ID);
     }
     return HAP_SUCCESS;
 }
@@ -218,22 +363,39 @@ int hap_send_event(hap_internal_event_t event)
     if (!is_hap_loop_started()) {
         return HAP_FAIL;
     }
-    if (!xQueue) {
+    TaskHandle_t loop_task = hap_loop_task_handle;
+    if (!xQueue || !loop_task) {
         return HAP_FAIL;
     }
-    hap_event_ctx_t hap_event = {
-        .event = event,
-    };
-    BaseType_t ret;
-    if (xPortInIsrContext() == pdTRUE) {
-        ret = xQueueSendFromISR(xQueue, &hap_event, NULL);
+    bool in_isr = (xPortInIsrContext() == pdTRUE);
+    if (event == HAP_INTERNAL_EVENT_TRIGGER_NOTIF) {
+        /* Already pending triggers need not wake the loop again */
+        if (__atomic_exchange_n(&hap_notif_pending, true, __ATOMIC_SEQ_CST)) {
+            return HAP_SUCCESS;
+        }
     } else {
-        ret = xQueueSend(xQueue, &hap_event, 0);
+        hap_event_ctx_t hap_event = {
+            .event = event,
+        };
+        BaseType_t ret;
+        if (in_isr) {
+            ret = xQueueSendFromISR(xQueue, &hap_event, NULL);
+        } else {
+            ret = xQueueSend(xQueue, &hap_event, 0);
+        }
+        if (ret != pdTRUE) {
+            if (!in_isr) {
+                ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "HAP loop queue full, dropping event %d", event);
+            }
+            return HAP_FAIL;
+        }
     }
-    if (ret == pdTRUE) {
-        return HAP_SUCCESS;
+    if (in_isr) {
+        vTaskNotifyGiveFromISR(loop_task, NULL);
+    } else {
+        xTaskNotifyGive(loop_task);
     }
-    return HAP_FAIL;
+    return HAP_SUCCESS;
 }
 
 int hap_update_config_number()
@@ -259,12 +421,20 @@ static void hap_network_event_handler(void* arg, esp_event_base_t event_base,
 int hap_init(hap_transport_t method)
 {
     int ret = HAP_SUCCESS;
-    if (!(method & (HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET))) {
+    hap_transport_t supported = HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET;
+#ifdef CONFIG_HAP_BLE_ENABLE
+    supported |= HAP_TRANSPORT_BLE;
+#endif
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    supported |= HAP_TRANSPORT_THREAD;
+#endif
+    if (!(method & supported) || (method & ~supported)) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid Transport");
         return HAP_FAIL;
     }
 
     hap_priv.transport = method;
+    hap_aead_init();
 
     ret = hap_keystore_init();
     if (ret != 0 ) {
@@ -356,12 +526,38 @@ int hap_start(void)
          return ret;
     }
 
-    ret = hap_httpd_start();
+    ret = hap_acc_index_init();
+    if (ret != HAP_SUCCESS) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Characteristic index init failed");
+         return ret;
+    }
+    /* The database built so far stays as is, objects added from now on come from the heap */
+    hap_db_arena_seal();
+
+#ifdef CONFIG_HAP_PAIR_RESUME_PERSIST
+    hap_pair_resume_restore();
+#endif
+
+    ret = hap_curve_key_pool_start();
+    if (ret != HAP_SUCCESS) {
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 key pool start failed");
+         return ret;
+    }
+
+    ret = hap_pair_setup_srp_start();
     if (ret != HAP_SUCCESS) {
-         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HTTPD START Failed [%d]", ret);
+         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP precompute start failed");
          return ret;
     }
 
+    if (hap_transport_is_ip()) {
+        ret = hap_httpd_start();
+        if (ret != HAP_SUCCESS) {
+             ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HTTPD START Failed [%d]", ret);
+             return ret;
+        }
+    }
+
     ret = hap_event_queue_init();
     if (ret != HAP_SUCCESS) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Queue Initialisation for Event Notifications Failed");
@@ -373,16 +569,26 @@ int hap_start(void)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP Loop Failed: [%d]", ret);
         return ret;
     }
-    ret = hap_mdns_init();
-    if (ret != 0 ) {
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP mDNS Init failed");
-        return ret;
+    if (hap_transport_is_ip()) {
+        ret = hap_mdns_init();
+        if (ret != 0 ) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP mDNS Init failed");
+            return ret;
+        }
+
+        ret = hap_ip_services_start();
+        if (ret != 0) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP IP Services Start Failed [%d]", ret);
+            return ret;
+        }
     }
 
-    ret = hap_ip_services_start();
-    if (ret != 0) {
-        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP IP Services Start Failed [%d]", ret);
-        return ret;
+    if (hap_priv.transport & HAP_TRANSPORT_BLE) {
+        ret = hap_ble_start();
+        if (ret != 0) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "HAP BLE Start Failed [%d]", ret);
+            return ret;
+        }
     }
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Started");
     hap_started = true;
@@ -396,11 +602,27 @@ int hap_stop(void)
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "HAP is already stopped");
         return ret;
     }
-    hap_ip_services_stop();
-    hap_mdns_deinit();
+    if (hap_priv.transport & HAP_TRANSPORT_BLE) {
+        hap_ble_stop();
+    }
+    if (hap_transport_is_ip()) {
+        hap_ip_services_stop();
+        hap_mdns_deinit();
+    }
     hap_loop_stop();
     hap_event_queue_deinit();
-    hap_httpd_stop();
+    if (hap_transport_is_ip()) {
+        hap_httpd_stop();
+    }
+    hap_curve_key_pool_stop();
+    hap_pair_setup_srp_stop();
+    /* All the tasks using scratch memory are gone by now */
+    hap_scratch_deinit();
+#ifdef CONFIG_HAP_PAIR_RESUME_PERSIST
+    hap_pair_resume_persist();
+#endif
+    hap_keystore_commit();
+    hap_keystore_flush();
     hap_started = false;
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HAP Stopped");
     return ret;
@@ -411,6 +633,7 @@ void hap_report_event(hap_event_t event, void *data, size_t data_size)
     if (hap_priv.hap_event_handler) {
         hap_priv.hap_event_handler(event, data);
     }
+    hap_event_bus_report(event, data, data_size);
     esp_event_post(HAP_EVENT, event, data, data_size, portMAX_DELAY);
 }
 
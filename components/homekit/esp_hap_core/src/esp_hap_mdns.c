@@ -24,30 +24,103 @@
 #include <string.h>
 #include <esp_hap_mdns.h>
 #include <esp_mfi_debug.h>
+#include <esp_hap_database.h>
+#include <esp_hap_thread.h>
 
 static bool mdns_init_done;
 
+static void hap_mdns_txt_cache_update(hap_mdns_handle_t *handle, mdns_txt_item_t *txt_records, size_t num_txt)
+{
+    size_t i;
+    handle->txt_cached = false;
+    if (num_txt > HAP_MDNS_MAX_TXT) {
+        return;
+    }
+    for (i = 0; i < num_txt; i++) {
+        /* Records which do not fit are never cached, so that they always get pushed */
+        if ((strlen(txt_records[i].key) >= HAP_MDNS_TXT_KEY_LEN)
+                || (strlen(txt_records[i].value) >= HAP_MDNS_TXT_VAL_LEN)) {
+            return;
+        }
+        strcpy(handle->txt[i].key, txt_records[i].key);
+        strcpy(handle->txt[i].value, txt_records[i].value);
+    }
+    handle->num_txt = num_txt;
+    handle->txt_cached = true;
+}
+
 int hap_mdns_serv_start(hap_mdns_handle_t *handle, const char *name, const char *type,
         const char *protocol, int port, mdns_txt_item_t *txt_records, size_t num_txt)
 {
     strcpy(handle->type, type);
     strcpy(handle->proto, protocol);
+    handle->txt_cached = false;
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    /* Over Thread, services are registered with the Border Router's SRP server instead */
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_serv_start(name, type, protocol, port, txt_records, num_txt);
+    }
+#endif
     if (mdns_service_add(name, type, protocol, port, txt_records, num_txt) != 0) {
         return HAP_FAIL;
     }
+    hap_mdns_txt_cache_update(handle, txt_records, num_txt);
     return HAP_SUCCESS;
 }
 
 int hap_mdns_serv_update_txt(hap_mdns_handle_t *handle, mdns_txt_item_t *txt_records, size_t num_txt)
 {
+    size_t i, num_changed = 0, changed_index = 0;
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        /* Every SRP update carries the whole service anyway */
+        return hap_thread_serv_update_txt(txt_records, num_txt);
+    }
+#endif
+    if (handle->txt_cached && (handle->num_txt == num_txt)) {
+        for (i = 0; i < num_txt; i++) {
+            if (strcmp(handle->txt[i].key, txt_records[i].key)) {
+                /* Different set of records. Push all of them */
+                num_changed = num_txt + 1;
+                break;
+            }
+            if (strcmp(handle->txt[i].value, txt_records[i].value)) {
+                num_changed++;
+                changed_index = i;
+            }
+        }
+        if (num_changed == 0) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "mDNS TXT records unchanged");
+            return HAP_SUCCESS;
+        }
+        /* A single changed record can be updated in place. For more, one full update
+         * is cheaper than several individual ones, as each of them triggers an announcement.
+         */
+        if (num_changed == 1) {
+            if (mdns_service_txt_item_set(handle->type, handle->proto,
+                        txt_records[changed_index].key, txt_records[changed_index].value) != 0) {
+                handle->txt_cached = false;
+                return HAP_FAIL;
+            }
+            strcpy(handle->txt[changed_index].value, txt_records[changed_index].value);
+            return HAP_SUCCESS;
+        }
+    }
     if (mdns_service_txt_set(handle->type, handle->proto, txt_records, num_txt) != 0) {
+        handle->txt_cached = false;
         return HAP_FAIL;
     }
+    hap_mdns_txt_cache_update(handle, txt_records, num_txt);
     return HAP_SUCCESS;
 }
 
 int hap_mdns_serv_name_change(hap_mdns_handle_t *handle, const char * instance_name)
 {
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_serv_name_change(instance_name);
+    }
+#endif
     if (mdns_service_instance_name_set(handle->type, handle->proto, instance_name) == ESP_OK) {
         return HAP_SUCCESS;
     }
@@ -56,7 +129,13 @@ int hap_mdns_serv_name_change(hap_mdns_handle_t *handle, const char * instance_n
 
 int hap_mdns_serv_stop(hap_mdns_handle_t *handle)
 {
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_serv_stop();
+    }
+#endif
     if (mdns_service_remove(handle->type, handle->proto) == ESP_OK) {
+        handle->txt_cached = false;
         return HAP_SUCCESS;
     }
     return HAP_FAIL;
@@ -65,6 +144,11 @@ int hap_mdns_serv_stop(hap_mdns_handle_t *handle)
 int hap_mdns_init()
 {
     int ret = HAP_SUCCESS;
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_srp_init();
+    }
+#endif
     if (!mdns_init_done) {
         ret = mdns_init();
         if (ret == ESP_OK) {
@@ -79,6 +163,11 @@ int hap_mdns_init()
 
 int hap_mdns_deinit()
 {
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_srp_deinit();
+    }
+#endif
     mdns_free();
     mdns_init_done = false;
     return HAP_SUCCESS;
@@ -22,36 +22,25 @@
  *
  */
 #include <stdint.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-#include <sodium/crypto_aead_chacha20poly1305.h>
 #include <byte_convert.h>
 
 #include <esp_mfi_debug.h>
+#include <hap_platform_memory.h>
+#include <hap_platform_trace.h>
 #include <hap.h>
 #include <esp_hap_database.h>
 #include <esp_hap_pair_common.h>
 #include <esp_hap_pair_verify.h>
+#include <esp_hap_http_metrics.h>
+#include <esp_hap_aead.h>
 
-#define HAP_MAX_NW_FRAME_SIZE	1024 /* As per HAP Specifications */
-#define AUTH_TAG_LEN            16
-typedef struct {
-	uint8_t pkt_size[2];
-	uint8_t data[HAP_MAX_NW_FRAME_SIZE];
-	/* The Poly auth tag buffer will get used only if the data length is
-	 * greater than HAP_MAX_NW_FRAME_SIZE - 16.
-	 * Else, the auth tag would be included in the data buffer itself
-	 */
-	uint8_t poly_auth_tag[AUTH_TAG_LEN];
-} hap_encrypt_frame_t;
-
-typedef struct {
-	uint16_t pkt_size;
-	uint16_t bytes_read;
-	uint8_t data[HAP_MAX_NW_FRAME_SIZE + AUTH_TAG_LEN];
-	hap_secure_session_t *session;
-} hap_decrypt_frame_t;
+/* Bytes each frame adds around its data, the length AAD and the authTag */
+#define HAP_NW_FRAME_OVERHEAD   (2 + AUTH_TAG_LEN)
 
 typedef int (*hap_decrypt_read_fn_t) (uint8_t *buf, int buf_size, void *context);
 static int min(int val1, int val2)
@@ -63,35 +52,40 @@ static int min(int val1, int val2)
 static int hap_httpd_raw_recv(uint8_t *buf, int buf_size, void *context)
 {
 	int sock = *((int *)context);
-	return recv(sock, buf, buf_size, 0);
+	HAP_TRACE_BEGIN(HAP_TRACE_HTTPD_RECV, buf_size);
+	int ret = recv(sock, buf, buf_size, 0);
+	HAP_TRACE_END(HAP_TRACE_HTTPD_RECV, ret > 0 ? ret : 0);
+	return ret;
 }
 
 /* Frame format as per HAP Specifications:
  * <2: AAD for Little Endian length of encrypted data (n) in bytes>
  * <n: Encrypted data according to AEAD algorithm, upto 1024 bytes>
  * <16: authTag according to AEAD algorithm>
+ *
+ * The plaintext is expected to already sit at frame + 2, and is encrypted in
+ * place, so the frame needs HAP_NW_FRAME_OVERHEAD bytes on top of buflen.
  */
-int hap_encrypt_data(hap_encrypt_frame_t *frame, hap_secure_session_t *session,
-		uint8_t *buf, int buflen)
+static int hap_encrypt_data(uint8_t *frame, hap_secure_session_t *session, int buflen)
 {
 	if (!session)
 		return HAP_FAIL;
-	put_u16_le(frame->pkt_size, buflen);
-	/* Encrypt the received data as per Chacha20-Poly1305 AEAD algorithm.
+	put_u16_le(frame, buflen);
+	/* Encrypt the data as per Chacha20-Poly1305 AEAD algorithm.
 	 * The authTag will be appended at the end of data. Hence, pointer given as
-	 * frame->data + nlen
+	 * data + buflen
 	 */
-    unsigned long long mlen = 16;
+    uint8_t *data = frame + 2;
     uint8_t newnonce[12];
     memset(newnonce, 0, sizeof newnonce);
-    memcpy(newnonce+4, session->encrypt_nonce, 8);
-    crypto_aead_chacha20poly1305_ietf_encrypt_detached(frame->data, frame->data + buflen, &mlen,
-                buf, buflen, frame->pkt_size, 2, NULL, newnonce, session->encrypt_key);
+    put_u64_le(newnonce+4, session->encrypt_nonce);
+    HAP_TRACE_BEGIN(HAP_TRACE_ENCRYPT, buflen);
+    hap_aead_encrypt_detached(data, data + buflen, data, buflen, frame, 2,
+                newnonce, session->encrypt_key);
+    HAP_TRACE_END(HAP_TRACE_ENCRYPT, buflen);
 
 	/* Increment nonce after every frame */
-	uint64_t int_nonce = get_u64_le(session->encrypt_nonce);
-	int_nonce++;
-	put_u64_le(session->encrypt_nonce, int_nonce);
+	session->encrypt_nonce++;
 	return 2 + buflen + 16; /* Total length of the encrypted data */
 }
 
@@ -105,48 +99,79 @@ static int hap_session_error(hap_secure_session_t *session)
 	return HAP_FAIL;
 }
 
-int hap_decrypt_data(hap_decrypt_frame_t *frame, hap_secure_session_t *session,
-	void *buf, int buf_size, hap_decrypt_read_fn_t read_fn, void *context)
+static int hap_read_all(uint8_t *buf, int len, hap_decrypt_read_fn_t read_fn, void *context)
 {
-	if (!frame || !session)
-		return -1;
-	if (frame->session != session) {
-		memset(frame, 0, sizeof(hap_decrypt_frame_t));
-		frame->session = session;
+	while (len) {
+		int num_bytes = read_fn(buf, len, context);
+		if (num_bytes <= 0)
+			return HAP_FAIL;
+		buf += num_bytes;
+		len -= num_bytes;
 	}
+	return HAP_SUCCESS;
+}
+
+/* If the caller's buffer can hold the whole frame, it is read and decrypted in
+ * place there, so that the plaintext is not copied again. Otherwise, the frame is
+ * decrypted into the session's frame buffer and handed out over multiple calls.
+ */
+int hap_decrypt_data(hap_secure_session_t *session, void *buf, int buf_size,
+		hap_decrypt_read_fn_t read_fn, void *context)
+{
+	if (!session)
+		return -1;
+	/* The frame lives in the session, so sessions can be read in any order */
+	hap_decrypt_frame_t *frame = &session->decrypt_frame;
 	if ((frame->pkt_size - frame->bytes_read) == 0) {
-		if (read_fn(frame->data, 2, context) < 2)
+		uint8_t aad[2];
+		uint8_t auth_tag[AUTH_TAG_LEN];
+		if (read_fn(aad, 2, context) < 2)
 			return hap_session_error(session);
 
-		frame->pkt_size = get_u16_le(frame->data);
+		/* Packet size is the AAD for AEAD */
+		frame->pkt_size = get_u16_le(aad);
 		frame->bytes_read = 0;
-		uint16_t bytes_to_read = frame->pkt_size + AUTH_TAG_LEN; /* +AUTH_TAG_LEN as the receivedd packet will also have the auth Tag */
-		while (bytes_to_read) {
-			int num_bytes = read_fn(&frame->data[frame->bytes_read],
-					bytes_to_read, context);
-			if (num_bytes <= 0)
+		if (frame->pkt_size > HAP_MAX_NW_FRAME_SIZE) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Frame too long");
+			frame->pkt_size = 0;
+			return hap_session_error(session);
+		}
+		bool direct = (buf_size >= frame->pkt_size);
+		if (!direct && !frame->data) {
+			frame->data = hap_platform_memory_malloc_caps(HAP_MAX_NW_FRAME_SIZE, HAP_MEM_CAPS_BULK);
+			if (!frame->data) {
+				ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate frame buffer");
+				frame->pkt_size = 0;
 				return hap_session_error(session);
-			bytes_to_read -= num_bytes;
-			frame->bytes_read += num_bytes;
+			}
+		}
+		uint8_t *data = direct ? (uint8_t *)buf : frame->data;
+		/* The authTag follows the encrypted data */
+		if ((hap_read_all(data, frame->pkt_size, read_fn, context) != HAP_SUCCESS) ||
+				(hap_read_all(auth_tag, sizeof(auth_tag), read_fn, context) != HAP_SUCCESS)) {
+			frame->pkt_size = 0;
+			return hap_session_error(session);
 		}
-		frame->bytes_read -= AUTH_TAG_LEN; /* -AUTH_TAG_LEN to get only the data length */
-		uint8_t aad[2];
         int ret;
-		put_u16_le(aad, frame->pkt_size); /* Packet size is the AAD for AEAD */
         uint8_t newnonce[12];
         memset(newnonce, 0, sizeof newnonce);
-        memcpy(newnonce+4, session->decrypt_nonce, 8);
-        ret = crypto_aead_chacha20poly1305_ietf_decrypt_detached(frame->data, NULL, frame->data, frame->pkt_size,
-                    &frame->data[frame->bytes_read], aad, 2, newnonce, session->decrypt_key);
-        if (ret != 0) { 
+        put_u64_le(newnonce+4, session->decrypt_nonce);
+        HAP_TRACE_BEGIN(HAP_TRACE_DECRYPT, frame->pkt_size);
+        ret = hap_aead_decrypt_detached(data, data, frame->pkt_size,
+                    auth_tag, aad, 2, newnonce, session->decrypt_key);
+        HAP_TRACE_END(HAP_TRACE_DECRYPT, frame->pkt_size);
+        if (ret != 0) {
 			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "AEAD decryption failure");
+			frame->pkt_size = 0;
 			return hap_session_error(session);
 		}
-		frame->bytes_read = 0;
 		/* Increment nonce after every frame */
-		int64_t int_nonce = get_u64_le(session->decrypt_nonce);
-		int_nonce++;
-		put_u64_le(session->decrypt_nonce, int_nonce);
+		session->decrypt_nonce++;
+		if (direct) {
+			int bytes = frame->pkt_size;
+			frame->pkt_size = 0;
+			return bytes;
+		}
 	}
 	int bytes = min(frame->pkt_size - frame->bytes_read, buf_size);
 	memcpy(buf, &frame->data[frame->bytes_read], bytes);
@@ -154,36 +179,87 @@ int hap_decrypt_data(hap_decrypt_frame_t *frame, hap_secure_session_t *session,
 	return bytes;
 }
 
-int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags)
+static int hap_send_all(int sockfd, const uint8_t *buf, int buf_len, int flags)
 {
+	while (buf_len) {
+		int sent = send(sockfd, buf, buf_len, flags);
+		if (sent <= 0)
+			return HAP_FAIL;
+		buf += sent;
+		buf_len -= sent;
+	}
+	return HAP_SUCCESS;
+}
+
+int hap_httpd_sendv(httpd_handle_t hd, int sockfd, const struct iovec *iov, int iovcnt, int flags)
+{
+	int total_len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		total_len += iov[i].iov_len;
+	hap_http_metrics_add_bytes_out(total_len);
+
 	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
-	if (session && (session->state == STATE_VERIFIED)) {
-		uint8_t *buf_ptr = (uint8_t *)buf;
-		int tmp_buf_len = buf_len;
-		while (tmp_buf_len) {
-			hap_encrypt_frame_t encrypt_frame;
-			memset(&encrypt_frame, 0, sizeof(encrypt_frame));
-			int len = min(tmp_buf_len, HAP_MAX_NW_FRAME_SIZE);
-			int send_len = hap_encrypt_data(&encrypt_frame, session, buf_ptr, len);
-			if (send(sockfd, (uint8_t *)&encrypt_frame, send_len, flags) <= 0)
-				return HAP_FAIL;
-			tmp_buf_len -= len;
-			buf_ptr += len;
+	if (!session || (session->state != STATE_VERIFIED)) {
+		struct msghdr msg = {
+			.msg_iov = (struct iovec *)iov,
+			.msg_iovlen = iovcnt,
+		};
+		return sendmsg(sockfd, &msg, flags);
+	}
+	if (total_len == 0)
+		return 0;
+
+	/* Lay out every frame back to back, so they all go out in one send() */
+	int num_frames = (total_len + HAP_MAX_NW_FRAME_SIZE - 1) / HAP_MAX_NW_FRAME_SIZE;
+	int out_len = total_len + (num_frames * HAP_NW_FRAME_OVERHEAD);
+	uint8_t *out = hap_platform_memory_malloc(out_len);
+	if (!out)
+		return HAP_FAIL;
+
+	uint8_t *frame = out;
+	int iov_idx = 0;
+	int iov_off = 0;
+	int remaining = total_len;
+	while (remaining) {
+		/* Gather the next frame's worth of plaintext, then encrypt it in place */
+		int len = min(remaining, HAP_MAX_NW_FRAME_SIZE);
+		int copied = 0;
+		while (copied < len) {
+			int chunk = min(iov[iov_idx].iov_len - iov_off, len - copied);
+			memcpy(frame + 2 + copied, (uint8_t *)iov[iov_idx].iov_base + iov_off, chunk);
+			copied += chunk;
+			iov_off += chunk;
+			if (iov_off == iov[iov_idx].iov_len) {
+				iov_idx++;
+				iov_off = 0;
+			}
 		}
-		/* Return the total length at the end since this API expects so
-		 */
-		return buf_len;
+		frame += hap_encrypt_data(frame, session, len);
+		remaining -= len;
 	}
-	return send(sockfd, buf, buf_len, flags);
+
+	int ret = hap_send_all(sockfd, out, out_len, flags);
+	hap_platform_memory_free(out);
+	/* Return the total plaintext length since this API expects so */
+	return (ret == HAP_SUCCESS) ? total_len : HAP_FAIL;
+}
+
+int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = buf_len,
+	};
+	return hap_httpd_sendv(hd, sockfd, &iov, 1, flags);
 }
 
 int hap_httpd_recv(httpd_handle_t hd, int sockfd, char *buf, unsigned buf_len, int flags)
 {
-	static hap_decrypt_frame_t decrypt_frame;
 	hap_secure_session_t *session = httpd_sess_get_ctx(hap_priv.server, sockfd);
 	if (session) {
 		if (session->state == STATE_VERIFIED) {
-			return hap_decrypt_data(&decrypt_frame, session, buf, buf_len,
+			hap_session_touch(session);
+			return hap_decrypt_data(session, buf, buf_len,
 					hap_httpd_raw_recv, &sockfd);
 		} else {
 			/* If the session state is invalid, we return an error.
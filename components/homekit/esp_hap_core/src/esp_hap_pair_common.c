@@ -111,6 +111,178 @@ int add_tlv(hap_tlv_data_t *tlv_data, uint8_t type, int len, void *val)
 	} while (len);
 	return tlv_data->curlen - orig_len;
 }
+
+/* Index all the items in buf in a single pass.
+ * Fragmented items (255 byte chunks of the same type, followed by the remainder)
+ * are joined in place, by moving each chunk over the header of the next one, so
+ * that every value can be returned as one contiguous view. The buffer hence no
+ * longer is a valid TLV8 encoding afterwards and must not be passed to
+ * get_value_from_tlv().
+ *
+ * Returns the number of items indexed, or -1 on a malformed buffer.
+ */
+int hap_tlv_index_build(hap_tlv_index_t *idx, uint8_t *buf, int buflen)
+{
+	if (!idx || !buf)
+		return -1;
+	idx->buf = buf;
+	idx->cnt = 0;
+	hap_tlv_item_t *item = NULL;
+	uint8_t prev_len = 0;
+	int curlen = 0;
+	while (curlen < buflen) {
+		if ((buflen - curlen) < 2)
+			return -1;
+		uint8_t type = buf[curlen];
+		uint8_t len = buf[curlen + 1];
+		if ((buflen - curlen - 2) < len)
+			return -1;
+		if (item && (item->type == type) && (prev_len == 255)) {
+			memmove(&buf[item->offset + item->len], &buf[curlen + 2], len);
+			item->len += len;
+		} else {
+			if (idx->cnt == HAP_TLV_INDEX_MAX)
+				return -1;
+			item = &idx->items[idx->cnt++];
+			item->type = type;
+			item->offset = curlen + 2;
+			item->len = len;
+		}
+		prev_len = len;
+		curlen += (2 + len);
+	}
+	return idx->cnt;
+}
+
+/* Get a view of the first item of the given type. Returns its length, or -1 if absent */
+int hap_tlv_get(const hap_tlv_index_t *idx, uint8_t type, uint8_t **val)
+{
+	int i;
+	for (i = 0; i < idx->cnt; i++) {
+		if (idx->items[i].type == type) {
+			if (val)
+				*val = idx->buf + idx->items[i].offset;
+			return idx->items[i].len;
+		}
+	}
+	return -1;
+}
+
+int hap_tlv_get_u8(const hap_tlv_index_t *idx, uint8_t type, uint8_t *val)
+{
+	uint8_t *ptr;
+	if (hap_tlv_get(idx, type, &ptr) != 1)
+		return -1;
+	*val = *ptr;
+	return 1;
+}
+
+static int hap_tlv_frag_cnt(int len)
+{
+	return len ? (len + 254) / 255 : 1;
+}
+
+/* Reserve space for an item of len bytes and return where its value should be
+ * written, so that it can be generated directly in the output buffer (e.g. as AEAD
+ * output) instead of being copied in by add_tlv(). hap_tlv_commit() then adds the
+ * item header(s). Returns NULL if there is no space.
+ */
+uint8_t *hap_tlv_reserve(hap_tlv_data_t *tlv_data, int len)
+{
+	int hdr_len = 2 * hap_tlv_frag_cnt(len);
+	if (!tlv_data->bufptr || ((len + hdr_len) > (tlv_data->bufsize - tlv_data->curlen)))
+		return NULL;
+	return &tlv_data->bufptr[tlv_data->curlen + hdr_len];
+}
+
+/* Commit an item whose value was written at the location given by hap_tlv_reserve()
+ * for the same len. Values above 255 bytes are spread into fragments by moving each
+ * chunk back, in order, to just after its own header. A chunk never moves past the
+ * start of the next one, so nothing is overwritten before it is moved.
+ */
+int hap_tlv_commit(hap_tlv_data_t *tlv_data, uint8_t type, int len)
+{
+	uint8_t *val = hap_tlv_reserve(tlv_data, len);
+	if (!val)
+		return -1;
+	int orig_len = tlv_data->curlen;
+	do {
+		int tmp_len = (len > 255) ? 255 : len;
+		tlv_data->bufptr[tlv_data->curlen++] = type;
+		tlv_data->bufptr[tlv_data->curlen++] = tmp_len;
+		if (val != &tlv_data->bufptr[tlv_data->curlen])
+			memmove(&tlv_data->bufptr[tlv_data->curlen], val, tmp_len);
+		tlv_data->curlen += tmp_len;
+		val += tmp_len;
+		len -= tmp_len;
+	} while (len);
+	return tlv_data->curlen - orig_len;
+}
+
+void hap_tlv_stream_init(hap_tlv_stream_t *stream, uint8_t *buf, int buf_size,
+		hap_tlv_stream_flush_t flush, void *priv)
+{
+	stream->buf = buf;
+	stream->bufsize = buf_size;
+	stream->curlen = 0;
+	stream->total = 0;
+	stream->flush = flush;
+	stream->priv = priv;
+}
+
+/* Append raw bytes to the stream, e.g. a response header ahead of the items.
+ * Fails only if the buffer fills up and there is no flush callback to empty it.
+ */
+int hap_tlv_stream_write(hap_tlv_stream_t *stream, const void *data, int len)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	stream->total += len;
+	if (!stream->buf)
+		return len;
+	int orig_len = len;
+	while (len) {
+		int copy_len = stream->bufsize - stream->curlen;
+		if (copy_len > len)
+			copy_len = len;
+		memcpy(&stream->buf[stream->curlen], ptr, copy_len);
+		stream->curlen += copy_len;
+		ptr += copy_len;
+		len -= copy_len;
+		if (len && (hap_tlv_stream_flush(stream) < 0))
+			return -1;
+	}
+	return orig_len;
+}
+
+/* Same encoding as add_tlv(), fragments included */
+int hap_tlv_stream_add(hap_tlv_stream_t *stream, uint8_t type, int len, const void *val)
+{
+	const uint8_t *val_ptr = (const uint8_t *)val;
+	int orig_total = stream->total;
+	do {
+		int tmp_len = (len > 255) ? 255 : len;
+		uint8_t hdr[2] = {type, tmp_len};
+		if ((hap_tlv_stream_write(stream, hdr, sizeof(hdr)) < 0) ||
+				(hap_tlv_stream_write(stream, val_ptr, tmp_len) < 0))
+			return -1;
+		val_ptr += tmp_len;
+		len -= tmp_len;
+	} while (len);
+	return stream->total - orig_total;
+}
+
+/* Hand whatever is in the buffer to the flush callback */
+int hap_tlv_stream_flush(hap_tlv_stream_t *stream)
+{
+	if (!stream->buf || !stream->curlen)
+		return 0;
+	if (!stream->flush)
+		return -1;
+	int ret = stream->flush(stream->buf, stream->curlen, stream->priv);
+	stream->curlen = 0;
+	return ret;
+}
+
 void hap_prepare_error_tlv(uint8_t state, uint8_t error, void *buf, int bufsize, int *outlen)
 {
 	hap_tlv_data_t tlv_data;
@@ -27,6 +27,9 @@
 #include <inttypes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <lwip/sockets.h>
 #include <mu_srp.h>
 #include <sodium/crypto_aead_chacha20poly1305.h>
 #include <hkdf-sha.h>
@@ -37,6 +40,7 @@
 #include <esp_hap_ip_services.h>
 #include <esp_hap_pair_common.h>
 #include <esp_hap_pair_setup.h>
+#include <esp_hap_pair_verify.h>
 #include <esp_hap_database.h>
 #include <esp_hap_main.h>
 #include <esp_hap_acc.h>
@@ -63,6 +67,202 @@
 #define HAP_PAIRING_MODE_TIMEOUT_IN_MINS    10
 #define HAP_PAIRING_MODE_TIMEOUT_IN_TICKS   ((60 * HAP_PAIRING_MODE_TIMEOUT_IN_MINS * 1000) / hap_platform_os_get_msec_per_tick())
 
+#ifdef CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE
+/* Number of clients whose token buckets are tracked. The least recently refilled
+ * one makes way for a new client.
+ */
+#define HAP_PAIR_SETUP_ADMIT_PEERS      8
+#define HAP_PAIR_SETUP_ADMIT_INTERVAL_IN_TICKS \
+    ((CONFIG_HAP_PAIR_SETUP_ADMISSION_INTERVAL * 1000) / hap_platform_os_get_msec_per_tick())
+#define HAP_PAIR_SETUP_ADMIT_GLOBAL_INTERVAL_IN_TICKS \
+    ((CONFIG_HAP_PAIR_SETUP_ADMISSION_GLOBAL_INTERVAL * 1000) / hap_platform_os_get_msec_per_tick())
+#endif /* CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE */
+
+#ifdef CONFIG_HAP_SRP_PRECOMPUTE_ENABLE
+#define SRP_PRECOMPUTE_TASK_NAME	"hap-srp-precompute"
+#define SRP_PRECOMPUTE_STACKSIZE	4096
+#endif /* CONFIG_HAP_SRP_PRECOMPUTE_ENABLE */
+
+/* Salt and verifier derived from hap_priv.setup_code, so that v = g^x % N, a full
+ * 3072 bit exponentiation, is done once per setup code rather than on every M1.
+ */
+static hap_setup_info_t *srp_code_info;
+/* SRP handle for the next M1, with b and B = kv + g^b already computed by
+ * a low priority task while the accessory is unpaired. It is used only once.
+ */
+static mu_srp_handle_t srp_next;
+static bool srp_precompute_enabled;
+static bool srp_precompute_pending;
+/* Protects the above and hap_priv.setup_code/setup_info from the time hap_start() creates it */
+static SemaphoreHandle_t srp_lock;
+
+static hap_pair_setup_stats_t pair_setup_stats;
+
+#ifdef CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE
+typedef struct {
+    uint8_t addr[16];   /* IPv4 addresses take the first 4 bytes */
+    uint8_t tokens;
+    bool in_use;
+    TickType_t refilled;
+} hap_admit_peer_t;
+
+static hap_admit_peer_t admit_peers[HAP_PAIR_SETUP_ADMIT_PEERS];
+/* Shared by all clients, so that evicting a client's own bucket by switching
+ * addresses does not buy it any more attempts
+ */
+static hap_admit_peer_t admit_global = {
+    .tokens = CONFIG_HAP_PAIR_SETUP_ADMISSION_GLOBAL_BURST,
+};
+static portMUX_TYPE admit_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif /* CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE */
+
+static void hap_srp_lock(void)
+{
+    if (srp_lock) {
+        xSemaphoreTake(srp_lock, portMAX_DELAY);
+    }
+}
+
+static void hap_srp_unlock(void)
+{
+    if (srp_lock) {
+        xSemaphoreGive(srp_lock);
+    }
+}
+
+/* Called with srp_lock held */
+static void hap_srp_invalidate(void)
+{
+    if (srp_code_info) {
+        memset(srp_code_info, 0, sizeof(hap_setup_info_t));
+        hap_platform_memory_free(srp_code_info);
+        srp_code_info = NULL;
+    }
+    mu_srp_free(&srp_next);
+}
+
+/* Gets the salt and verifier, deriving them from the setup code if that is what
+ * has been set. Called with srp_lock held.
+ */
+static const hap_setup_info_t *hap_srp_get_setup_info(mu_srp_handle_t *hd)
+{
+    if (!hap_priv.setup_code) {
+        return hap_priv.setup_info;
+    }
+    if (!srp_code_info) {
+        hap_setup_info_t *info = hap_platform_memory_calloc(1, sizeof(hap_setup_info_t));
+        if (!info) {
+            return NULL;
+        }
+        if (mu_srp_gen_salt_verifier(hd, "Pair-Setup", hap_priv.setup_code, strlen(hap_priv.setup_code),
+                    (char *)info->salt, sizeof(info->salt),
+                    (char *)info->verifier, sizeof(info->verifier)) < 0) {
+            hap_platform_memory_free(info);
+            return NULL;
+        }
+        srp_code_info = info;
+    }
+    return srp_code_info;
+}
+
+/* Initialises hd with the salt and verifier and generates the accessory's
+ * SRP key pair. Called with srp_lock held.
+ */
+static int hap_srp_prepare(mu_srp_handle_t *hd)
+{
+    char *bytes_B = NULL;
+    int len_B = 0;
+    if (mu_srp_init(hd, MU_NG_3072) < 0) {
+        return HAP_FAIL;
+    }
+    const hap_setup_info_t *info = hap_srp_get_setup_info(hd);
+    if (!info || (mu_srp_set_salt_verifier(hd, (char *)info->salt, sizeof(info->salt),
+                    (char *)info->verifier, sizeof(info->verifier)) < 0) ||
+            (mu_srp_srv_pubkey_from_salt_verifier(hd, &bytes_B, &len_B) < 0) || !bytes_B) {
+        mu_srp_free(hd);
+        return HAP_FAIL;
+    }
+    return HAP_SUCCESS;
+}
+
+/* Gets the SRP handle for M1, taking the precomputed one if it is ready */
+static int hap_srp_get(mu_srp_handle_t *hd)
+{
+    int ret = HAP_SUCCESS;
+    hap_srp_lock();
+    if (srp_next.allocated) {
+        *hd = srp_next;
+        memset(&srp_next, 0, sizeof(srp_next));
+    } else {
+        ret = hap_srp_prepare(hd);
+    }
+    hap_srp_unlock();
+    return ret;
+}
+
+#ifdef CONFIG_HAP_SRP_PRECOMPUTE_ENABLE
+static void hap_srp_precompute_task(void *arg)
+{
+    hap_srp_lock();
+    if (srp_precompute_enabled && !srp_next.allocated && !is_accessory_paired()) {
+        if (hap_srp_prepare(&srp_next) != HAP_SUCCESS) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP-6a Key Precompute Failed");
+        }
+    }
+    srp_precompute_pending = false;
+    hap_srp_unlock();
+    vTaskDelete(NULL);
+}
+#endif /* CONFIG_HAP_SRP_PRECOMPUTE_ENABLE */
+
+void hap_pair_setup_srp_precompute(void)
+{
+#ifdef CONFIG_HAP_SRP_PRECOMPUTE_ENABLE
+    if (!srp_lock || is_accessory_paired()) {
+        return;
+    }
+    hap_srp_lock();
+    bool start = srp_precompute_enabled && !srp_precompute_pending && !srp_next.allocated;
+    if (start) {
+        srp_precompute_pending = true;
+    }
+    hap_srp_unlock();
+    if (start && (xTaskCreatePinnedToCore(hap_srp_precompute_task, SRP_PRECOMPUTE_TASK_NAME, SRP_PRECOMPUTE_STACKSIZE,
+                    NULL, tskIDLE_PRIORITY + 1, NULL, HAP_PLATFORM_TASK_CORE_ID) != pdPASS)) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Failed to create SRP precompute task");
+        hap_srp_lock();
+        srp_precompute_pending = false;
+        hap_srp_unlock();
+    }
+#endif /* CONFIG_HAP_SRP_PRECOMPUTE_ENABLE */
+}
+
+int hap_pair_setup_srp_start(void)
+{
+    if (!srp_lock) {
+        srp_lock = xSemaphoreCreateMutex();
+        if (!srp_lock) {
+            return HAP_FAIL;
+        }
+    }
+    hap_srp_lock();
+    srp_precompute_enabled = true;
+    hap_srp_unlock();
+    hap_pair_setup_srp_precompute();
+    return HAP_SUCCESS;
+}
+
+void hap_pair_setup_srp_stop(void)
+{
+    /* Any precompute in progress finishes before the lock is available. The lock
+     * itself is kept, since a task that has not run yet may still be waiting on it.
+     */
+    hap_srp_lock();
+    srp_precompute_enabled = false;
+    mu_srp_free(&srp_next);
+    hap_srp_unlock();
+}
+
 static void hap_pairing_mode_timeout(TimerHandle_t handle)
 {
     /* De-announce the mDNS service if the pairing mode has timer out */
@@ -162,35 +362,16 @@ static int hap_pair_setup_process_srp_start(pair_setup_ctx_t *ps_ctx, uint8_t *b
     }
     hap_priv.pairing_flags = ps_ctx->pairing_flags;
 
-	int len_B = 0;
-	char *bytes_B;
-
-	/* Create SRP Salt and Verifier for the provided pairing PIN */
-    mu_srp_init(&ps_ctx->srp_hd, MU_NG_3072);
-
-    /* If a setup code is explicitly set, use it */
-    if (hap_priv.setup_code) {
-        ps_ctx->len_s = 16;
-        mu_srp_srv_pubkey(&ps_ctx->srp_hd, "Pair-Setup", (const char*)hap_priv.setup_code, strlen(hap_priv.setup_code),
-                ps_ctx->len_s, &bytes_B, &len_B, &ps_ctx->bytes_s);
-    } else {
-        /* Else, use the salt and verifier for SRP. This should be the default production case
-         */
-        if (mu_srp_set_salt_verifier(&ps_ctx->srp_hd, (char *)hap_priv.setup_info->salt, sizeof(hap_priv.setup_info->salt),
-                    (char *)hap_priv.setup_info->verifier, sizeof(hap_priv.setup_info->verifier)) < 0) {
-            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP-6a Salt-Verifier Init Failed");
-            hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
-            return HAP_FAIL;
-        }
-        ps_ctx->bytes_s = (char *)hap_priv.setup_info->salt;
-        ps_ctx->len_s = sizeof(hap_priv.setup_info->salt);
-        mu_srp_srv_pubkey_from_salt_verifier(&ps_ctx->srp_hd, &bytes_B, &len_B);
-    }
-	if (!ps_ctx->bytes_s || !bytes_B) {
+	/* Get the SRP handle with the Salt and Verifier for the pairing PIN, and our public key */
+    if (hap_srp_get(&ps_ctx->srp_hd) != HAP_SUCCESS) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP-6a Verifier Creation Failed");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+    ps_ctx->bytes_s = ps_ctx->srp_hd.bytes_s;
+    ps_ctx->len_s = ps_ctx->srp_hd.len_s;
+	char *bytes_B = ps_ctx->srp_hd.bytes_B;
+	int len_B = ps_ctx->srp_hd.len_B;
 
 	hex_dbg_with_name("salt", (uint8_t *)ps_ctx->bytes_s, ps_ctx->len_s);
 	hex_dbg_with_name("acc_srp_public_key", (uint8_t *)bytes_B, len_B);
@@ -225,16 +406,19 @@ static int hap_pair_setup_process_srp_verify(pair_setup_ctx_t *ps_ctx, uint8_t *
 		int bufsize, int *outlen)
 {
 	uint8_t state;
-	char ctrl_public_key[384];
+	hap_tlv_index_t tlv_idx;
+	uint8_t *ctrl_public_key;
 	int ctrl_public_key_len;
-	char ctrl_proof[64];
+	uint8_t *ctrl_proof;
 	int ctrl_proof_len;
 
-	if ((get_value_from_tlv(buf, inlen, kTLVType_State, &state, sizeof(state)) < 0) ||
-		((ctrl_public_key_len = get_value_from_tlv(buf, inlen, kTLVType_PublicKey,
-				ctrl_public_key, sizeof(ctrl_public_key))) < 0) ||
-		((ctrl_proof_len = get_value_from_tlv(buf, inlen, kTLVType_Proof,
-				ctrl_proof, sizeof(ctrl_proof))) < 0)) {
+	/* The 384 byte public key arrives in two fragments, which the index joins in place */
+	if ((hap_tlv_index_build(&tlv_idx, buf, inlen) < 0) ||
+		(hap_tlv_get_u8(&tlv_idx, kTLVType_State, &state) < 0) ||
+		((ctrl_public_key_len = hap_tlv_get(&tlv_idx, kTLVType_PublicKey,
+				&ctrl_public_key)) < 0) ||
+		((ctrl_proof_len = hap_tlv_get(&tlv_idx, kTLVType_Proof,
+				&ctrl_proof)) != SHA512HashSize)) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid TLVs received");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -246,11 +430,11 @@ static int hap_pair_setup_process_srp_verify(pair_setup_ctx_t *ps_ctx, uint8_t *
 	}
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Setup M3 Received");
 
-	hex_dbg_with_name("ctrl_srp_public_key", (uint8_t *)ctrl_public_key, ctrl_public_key_len);
-	hex_dbg_with_name("ctrl_proof", (uint8_t *)ctrl_proof, ctrl_proof_len);
-    mu_srp_get_session_key(&ps_ctx->srp_hd, ctrl_public_key, ctrl_public_key_len, &ps_ctx->shared_secret, &ps_ctx->secret_len);
+	hex_dbg_with_name("ctrl_srp_public_key", ctrl_public_key, ctrl_public_key_len);
+	hex_dbg_with_name("ctrl_proof", ctrl_proof, ctrl_proof_len);
+    mu_srp_get_session_key(&ps_ctx->srp_hd, (char *)ctrl_public_key, ctrl_public_key_len, &ps_ctx->shared_secret, &ps_ctx->secret_len);
     char host_proof[SHA512HashSize];
-    int ret = mu_srp_exchange_proofs(&ps_ctx->srp_hd, "Pair-Setup", ctrl_proof, host_proof);
+    int ret = mu_srp_exchange_proofs(&ps_ctx->srp_hd, "Pair-Setup", (char *)ctrl_proof, host_proof);
     if (ret != 1) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP Verify: Controller Authentication failed");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Authentication, buf, bufsize, outlen);
@@ -291,13 +475,15 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 		int bufsize, int *outlen)
 {
 	uint8_t state;
-	uint8_t edata[220];
+	hap_tlv_index_t tlv_idx;
+	uint8_t *edata;
 	int edata_len;
     int ret;
 
-	if ((get_value_from_tlv(buf, inlen, kTLVType_State, &state, sizeof(state)) < 0) ||
-		((edata_len = get_value_from_tlv(buf, inlen, kTLVType_EncryptedData,
-				edata, sizeof(edata))) < 0))  {
+	if ((hap_tlv_index_build(&tlv_idx, buf, inlen) < 0) ||
+		(hap_tlv_get_u8(&tlv_idx, kTLVType_State, &state) < 0) ||
+		((edata_len = hap_tlv_get(&tlv_idx, kTLVType_EncryptedData,
+				&edata)) < POLY_AUTHTAG_LEN))  {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid TLVs received");
 		hap_prepare_error_tlv(STATE_M6, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -310,6 +496,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
     }
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Setup M5 Received");
     edata_len -= 16; /* 16 bytes for the authTag */
+    /* Decrypt in place, in the receive buffer */
     uint8_t newnonce[12];
     memset(newnonce, 0, sizeof newnonce);
     memcpy(newnonce+4, (uint8_t *)PS_NONCE2, 8);
@@ -321,23 +508,25 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 		return HAP_FAIL;
 	}
 	hex_dbg_with_name("subtlv", edata, edata_len);
+	hap_tlv_index_t subtlv_idx;
+	uint8_t *ctrl_id, *ltpkc, *ctrl_sign;
 	int ctrl_id_len;
 	unsigned char ed_sign[64];
-    unsigned long long ed_sign_len;
-	if (((ctrl_id_len = get_value_from_tlv(edata, edata_len, kTLVType_Identifier,
-					ps_ctx->ctrl->info.id, sizeof(ps_ctx->ctrl->info.id))) < 0) ||
-			(get_value_from_tlv(edata, edata_len, kTLVType_PublicKey,
-					    ps_ctx->ctrl->info.ltpk, ED_KEY_LEN) != ED_KEY_LEN) ||
-			(get_value_from_tlv(edata, edata_len, kTLVType_Signature,
-					    ed_sign, sizeof(ed_sign)) != sizeof(ed_sign))) {
+	if ((hap_tlv_index_build(&subtlv_idx, edata, edata_len) < 0) ||
+			((ctrl_id_len = hap_tlv_get(&subtlv_idx, kTLVType_Identifier, &ctrl_id)) < 0) ||
+			(ctrl_id_len >= (int)sizeof(ps_ctx->ctrl->info.id)) ||
+			(hap_tlv_get(&subtlv_idx, kTLVType_PublicKey, &ltpkc) != ED_KEY_LEN) ||
+			(hap_tlv_get(&subtlv_idx, kTLVType_Signature, &ctrl_sign) != ED_SIGN_LEN)) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid subTLV received");
 		hap_prepare_error_tlv(STATE_M6, kTLVError_Authentication, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+	memcpy(ps_ctx->ctrl->info.id, ctrl_id, ctrl_id_len);
 	ps_ctx->ctrl->info.id[ctrl_id_len] = 0; /* NULL termination */
+	memcpy(ps_ctx->ctrl->info.ltpk, ltpkc, ED_KEY_LEN);
 	hex_dbg_with_name("ctrl_id", (uint8_t *)ps_ctx->ctrl->info.id, ctrl_id_len);
 	hex_dbg_with_name("ltpkc", ps_ctx->ctrl->info.ltpk, ED_KEY_LEN);
-	hex_dbg_with_name("ctrl_sign", ed_sign, sizeof(ed_sign));
+	hex_dbg_with_name("ctrl_sign", ctrl_sign, ED_SIGN_LEN);
 
 	/* Derive iOSDeviceX from SRP shared secret using HKDF-SHA512 */
 	uint8_t ios_device_x[32];
@@ -361,7 +550,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 	memcpy(&ios_dev_info[ios_dev_info_len], ps_ctx->ctrl->info.ltpk, ED_KEY_LEN);
 	ios_dev_info_len += ED_KEY_LEN;
 
-    ret = crypto_sign_ed25519_verify_detached(ed_sign, ios_dev_info, ios_dev_info_len, ps_ctx->ctrl->info.ltpk);
+    ret = crypto_sign_ed25519_verify_detached(ctrl_sign, ios_dev_info, ios_dev_info_len, ps_ctx->ctrl->info.ltpk);
 	/* Verify Signature of constructed iOSDeviceInfo using the iOSDeviceLTPK */
     if (ret != 0) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid Signature");
@@ -394,7 +583,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 
 	/* Generate AccessorySignature by signing AccessoryInfo with AccessoryLTSK
 	 */
-    crypto_sign_ed25519_detached(ed_sign, &ed_sign_len, acc_info, acc_info_len, hap_priv.ltska);
+    hap_acc_sign(acc_info, acc_info_len, ed_sign);
 	hex_dbg_with_name("acc_sign", ed_sign, sizeof(ed_sign));
 
 	/* Create subTLV with:
@@ -403,7 +592,7 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 	 * kTLVType_Signature : AccessorySignature
 	 */
 
-	uint8_t subtlv[6 + HAP_ACC_ID_LEN + ED_KEY_LEN + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
+	uint8_t subtlv[6 + HAP_ACC_ID_LEN + ED_KEY_LEN + ED_SIGN_LEN];
 
 	hap_tlv_data_t tlv_data;
 	tlv_data.bufptr = subtlv;
@@ -415,26 +604,26 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
 	int subtlv_len = tlv_data.curlen;
 	hex_dbg_with_name("subtlv", subtlv, subtlv_len);
 
-	/* Encrypt the subTLV using the session key */
-
-    unsigned long long mlen = 16;
-    memset(newnonce, 0, sizeof newnonce);
-    memcpy(newnonce+4, (uint8_t *) PS_NONCE3, 8);
-    crypto_aead_chacha20poly1305_ietf_encrypt_detached(subtlv, &subtlv[subtlv_len], &mlen, subtlv,
-                subtlv_len, NULL, 0, NULL, newnonce, ps_ctx->session_key); 
-	hex_dbg_with_name("send_encrypt_data", subtlv, subtlv_len + 16);
-
-	/* Construct the response M6 */
+	/* Construct the response M6, encrypting the subTLV using the session key
+	 * straight into its place in the response
+	 */
 	tlv_data.bufptr = buf;
 	tlv_data.bufsize = bufsize;
 	tlv_data.curlen = 0;
 	state = STATE_M6;
+	uint8_t *enc_data;
 	if ((add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) ||
-			(add_tlv(&tlv_data, kTLVType_EncryptedData, subtlv_len + 16,
-				 subtlv) < 0)) {
-		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
+			((enc_data = hap_tlv_reserve(&tlv_data, subtlv_len + POLY_AUTHTAG_LEN)) == NULL)) {
+		hap_prepare_error_tlv(STATE_M6, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+    unsigned long long mlen = 16;
+    memset(newnonce, 0, sizeof newnonce);
+    memcpy(newnonce+4, (uint8_t *) PS_NONCE3, 8);
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(enc_data, &enc_data[subtlv_len], &mlen, subtlv,
+                subtlv_len, NULL, 0, NULL, newnonce, ps_ctx->session_key);
+	hex_dbg_with_name("send_encrypt_data", enc_data, subtlv_len + 16);
+	hap_tlv_commit(&tlv_data, kTLVType_EncryptedData, subtlv_len + POLY_AUTHTAG_LEN);
 	*outlen = tlv_data.curlen;
 	ps_ctx->state = state;
 	ps_ctx->ctrl->info.perms = 1; /* Controller added using pair setup is always an admin */
@@ -442,6 +631,10 @@ static int hap_pair_setup_process_exchange(pair_setup_ctx_t *ps_ctx, uint8_t *bu
     /* Reset the Pairing Attempts count */
 	hap_priv.pair_attempts = 0;
     hap_controller_save(ps_ctx->ctrl);
+    /* A precomputed SRP key is of no use until the accessory gets unpaired */
+    hap_srp_lock();
+    mu_srp_free(&srp_next);
+    hap_srp_unlock();
     hap_send_event(HAP_INTERNAL_EVENT_ACC_PAIRED);
     /* Stop the pairing mode timer, since pairing is already done */
     hap_stop_pairing_mode_timer();
@@ -459,7 +652,7 @@ static void hap_pair_setup_timeout(TimerHandle_t handle)
     ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Clearing Pair Setup Context due to inactivity");
     pair_setup_ctx_t *ps_ctx = pvTimerGetTimerID(handle);
     if (ps_ctx) {
-        httpd_sess_trigger_close(hap_priv.server, ps_ctx->sock_fd);
+        hap_conn_trigger_close(ps_ctx->sock_fd);
         hap_report_event(HAP_EVENT_PAIRING_ABORTED, NULL, 0);
     }
 }
@@ -502,6 +695,8 @@ static pair_setup_ctx_t *hap_pair_setup_ctx_action(int action)
             }
             mu_srp_free(&ps_ctx->srp_hd);
 			hap_platform_memory_free(ps_ctx);
+            /* Get the SRP key ready for the controller's next attempt */
+            hap_pair_setup_srp_precompute();
 		}
 		ps_ctx = NULL;
 	}
@@ -509,6 +704,106 @@ static pair_setup_ctx_t *hap_pair_setup_ctx_action(int action)
 }
 
 
+#ifdef CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE
+/* Adds the tokens earned since the bucket was last refilled, up to burst.
+ * Returns 0 if the bucket has a token, else the ticks until it gets one.
+ * Called with admit_lock held.
+ */
+static TickType_t hap_admit_refill(hap_admit_peer_t *bucket, TickType_t now,
+        TickType_t interval, uint8_t burst)
+{
+    TickType_t refills = (now - bucket->refilled) / interval;
+    if (bucket->tokens + refills >= burst) {
+        bucket->tokens = burst;
+        bucket->refilled = now;
+    } else if (refills) {
+        bucket->tokens += refills;
+        bucket->refilled += refills * interval;
+    }
+    return bucket->tokens ? 0 : interval - (now - bucket->refilled);
+}
+
+/* Takes a token from the bucket of the client on the other end of sock_fd,
+ * and one from the bucket shared by all clients. Returns 0 if it got both,
+ * else the number of seconds until it would. Clients whose address cannot
+ * be found only draw from the shared bucket.
+ */
+static uint16_t hap_pair_setup_admit(int sock_fd)
+{
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    uint8_t addr[16] = {0};
+    bool has_addr = false;
+
+    if (getpeername(sock_fd, (struct sockaddr *)&peer, &peer_len) == 0) {
+        if (peer.ss_family == AF_INET) {
+            memcpy(addr, &((struct sockaddr_in *)&peer)->sin_addr, 4);
+            has_addr = true;
+#ifdef CONFIG_LWIP_IPV6
+        } else if (peer.ss_family == AF_INET6) {
+            memcpy(addr, &((struct sockaddr_in6 *)&peer)->sin6_addr, 16);
+            has_addr = true;
+#endif
+        }
+    }
+
+    TickType_t now = xTaskGetTickCount();
+    TickType_t interval = HAP_PAIR_SETUP_ADMIT_INTERVAL_IN_TICKS;
+    TickType_t wait = 0, global_wait;
+
+    portENTER_CRITICAL(&admit_lock);
+    hap_admit_peer_t *bucket = NULL;
+    if (has_addr) {
+        hap_admit_peer_t *oldest = &admit_peers[0];
+        int i;
+        for (i = 0; i < HAP_PAIR_SETUP_ADMIT_PEERS; i++) {
+            hap_admit_peer_t *p = &admit_peers[i];
+            if (p->in_use && !memcmp(p->addr, addr, sizeof(addr))) {
+                bucket = p;
+                break;
+            }
+            if (!p->in_use || (oldest->in_use && (now - p->refilled) > (now - oldest->refilled))) {
+                oldest = p;
+            }
+        }
+        if (!bucket) {
+            bucket = oldest;
+            memcpy(bucket->addr, addr, sizeof(addr));
+            bucket->tokens = CONFIG_HAP_PAIR_SETUP_ADMISSION_BURST;
+            bucket->in_use = true;
+            bucket->refilled = now;
+        } else {
+            wait = hap_admit_refill(bucket, now, interval, CONFIG_HAP_PAIR_SETUP_ADMISSION_BURST);
+        }
+    }
+    if (!admit_global.in_use) {
+        /* First attempt since boot, the bucket starts out full */
+        admit_global.in_use = true;
+        admit_global.refilled = now;
+    }
+    global_wait = hap_admit_refill(&admit_global, now, HAP_PAIR_SETUP_ADMIT_GLOBAL_INTERVAL_IN_TICKS,
+            CONFIG_HAP_PAIR_SETUP_ADMISSION_GLOBAL_BURST);
+    /* Only take a token when both buckets have one */
+    if (!wait && !global_wait) {
+        if (bucket) {
+            bucket->tokens--;
+        }
+        admit_global.tokens--;
+    } else if (global_wait > wait) {
+        wait = global_wait;
+    }
+    portEXIT_CRITICAL(&admit_lock);
+    return wait ? (wait * hap_platform_os_get_msec_per_tick() + 999) / 1000 : 0;
+}
+#endif /* CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE */
+
+void hap_pair_setup_get_stats(hap_pair_setup_stats_t *stats)
+{
+    if (stats) {
+        *stats = pair_setup_stats;
+    }
+}
+
 void hap_pair_setup_ctx_clean(void *sess_ctx)
 {
 	if (sess_ctx) {
@@ -517,15 +812,38 @@ void hap_pair_setup_ctx_clean(void *sess_ctx)
     }
 }
 
+/* Admission control comes first, so that a rejected attempt costs no bignum work
+ * and neither takes nor restarts the single Pair Setup context.
+ */
 int hap_pair_setup_context_init(int sock_fd, void **ctx, uint8_t *buf, int bufsize, int *outlen)
 {
+#ifdef CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE
+    uint16_t retry_delay = hap_pair_setup_admit(sock_fd);
+    if (retry_delay) {
+        pair_setup_stats.rate_limited++;
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Pair Setup rate limited, retry in %u secs (%" PRIu32 " rejected)",
+                retry_delay, pair_setup_stats.rate_limited);
+        hap_prepare_error_tlv(STATE_M2, kTLVError_Backoff, buf, bufsize, outlen);
+        hap_tlv_data_t tlv_data = {
+            .bufptr = buf,
+            .bufsize = bufsize,
+            .curlen = *outlen,
+        };
+        add_tlv(&tlv_data, kTLVType_RetryDelay, sizeof(retry_delay), &retry_delay);
+        *outlen = tlv_data.curlen;
+        return HAP_FAIL;
+    }
+#endif /* CONFIG_HAP_PAIR_SETUP_ADMISSION_ENABLE */
+
 	pair_setup_ctx_t *ps_ctx = hap_pair_setup_ctx_action(PS_CTX_INIT);
 
 	if (!ps_ctx) {
+        pair_setup_stats.busy++;
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR,"######## Aborted! Pair Setup in Progress with another controller ########");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Busy, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+    pair_setup_stats.admitted++;
     ps_ctx->sock_fd = sock_fd;
 	*ctx = ps_ctx;
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "######## Starting Pair Setup ########");
@@ -580,21 +898,30 @@ int hap_pair_setup_process(void **ctx, uint8_t *buf, int inlen, int bufsize, int
 
 void hap_set_setup_code(const char *setup_code)
 {
+    hap_srp_lock();
+    hap_srp_invalidate();
     if (hap_priv.setup_code)
         hap_platform_memory_free(hap_priv.setup_code);
     hap_priv.setup_code = strdup(setup_code);
+    hap_srp_unlock();
+    hap_pair_setup_srp_precompute();
 }
 
 int hap_set_setup_info(const hap_setup_info_t *setup_info)
 {
     if (!setup_info)
         return HAP_FAIL;
+    hap_srp_lock();
+    hap_srp_invalidate();
     if (hap_priv.setup_info)
         hap_platform_memory_free(hap_priv.setup_info);
     hap_priv.setup_info = hap_platform_memory_calloc(1, sizeof(hap_setup_info_t));
+    if (hap_priv.setup_info)
+        memcpy(hap_priv.setup_info, setup_info, sizeof(hap_setup_info_t));
+    hap_srp_unlock();
     if (!hap_priv.setup_info)
         return HAP_FAIL;
-    memcpy(hap_priv.setup_info, setup_info, sizeof(hap_setup_info_t));
+    hap_pair_setup_srp_precompute();
     return HAP_SUCCESS;
 }
 
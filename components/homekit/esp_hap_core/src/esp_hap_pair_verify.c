@@ -24,20 +24,27 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <sodium/crypto_scalarmult_curve25519.h>
 #include <sodium/crypto_sign_ed25519.h>
 #include <hkdf-sha.h>
 #include <sodium/crypto_aead_chacha20poly1305.h>
 #include <esp_http_server.h>
 #include <hap_platform_memory.h>
+#include <hap_platform_os.h>
 
 #include <esp_hap_main.h>
 #include <esp_hap_pair_common.h>
 #include <esp_hap_database.h>
+#include <esp_hap_timed_write.h>
 #include <esp_hap_char.h>
 #include <hexdump.h>
 #include <esp_mfi_debug.h>
 #include <esp_mfi_rand.h>
+#include <esp_hap_ble.h>
+#include <esp_hap_keystore.h>
 
 #define PAIR_VERIFY_ENCRYPT_SALT	"Pair-Verify-Encrypt-Salt"
 #define PAIR_VERIFY_ENCRYPT_INFO	"Pair-Verify-Encrypt-Info"
@@ -46,6 +53,18 @@
 #define CONTROL_SALT			"Control-Salt"
 #define CONTROL_READ_INFO		"Control-Read-Encryption-Key"
 #define CONTROL_WRITE_INFO		"Control-Write-Encryption-Key"
+#define PAIR_RESUME_SESSION_ID_SALT	"Pair-Verify-ResumeSessionID-Salt"
+#define PAIR_RESUME_SESSION_ID_INFO	"Pair-Verify-ResumeSessionID-Info"
+#define PAIR_RESUME_REQUEST_INFO	"Pair-Resume-Request-Info"
+#define PAIR_RESUME_RESPONSE_INFO	"Pair-Resume-Response-Info"
+#define PAIR_RESUME_SHARED_SECRET_INFO	"Pair-Resume-Shared-Secret-Info"
+#define PR_NONCE1			"PR-Msg01"
+#define PR_NONCE2			"PR-Msg02"
+#define PAIR_RESUME_SESSION_ID_LEN	8
+#define PAIR_RESUME_TICKET_SALT		"Pair-Resume-Ticket-Salt"
+#define PAIR_RESUME_TICKET_INFO		"Pair-Resume-Ticket-Key"
+#define HAP_KEY_RESUME_TICKETS		"resume_tkt"
+#define TICKET_NONCE_LEN		12
 
 typedef struct {
 	/* It is important that "state" should be the first element of the structure.
@@ -61,20 +80,362 @@ typedef struct {
 	hap_secure_session_t *session;
 } pair_verify_ctx_t;
 
+#if CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0
+/* Ephemeral Curve25519 key pairs for M2, generated ahead of time by a low
+ * priority task, so that the controller does not wait for the scalar
+ * multiplication. Each key pair is used once and wiped right away.
+ */
+#define CURVE_KEY_POOL_TASK_NAME	"hap-curve-pool"
+#define CURVE_KEY_POOL_STACKSIZE	3072
+
+typedef struct {
+	uint8_t sk[CURVE_KEY_LEN];
+	uint8_t pk[CURVE_KEY_LEN];
+} curve_keypair_t;
+
+static curve_keypair_t curve_key_pool[CONFIG_HAP_CURVE_KEY_POOL_SIZE];
+static int curve_key_pool_cnt;
+static portMUX_TYPE curve_key_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t curve_key_pool_task;
+#endif /* CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0 */
+
+#ifdef CONFIG_HAP_PAIR_RESUME_ENABLE
+/* Shared secrets of earlier sessions, so that a controller coming back can
+ * skip the Curve25519 and Ed25519 operations using Pair Resume.
+ * Each entry can be used only once, and a resumed session gets a new one.
+ */
+#define PAIR_RESUME_CACHE_SIZE		HAP_MAX_SESSIONS
+
+typedef struct {
+	uint8_t session_id[PAIR_RESUME_SESSION_ID_LEN];
+	uint8_t shared_secret[CURVE_KEY_LEN];
+	hap_ctrl_data_t *ctrl;
+	/* Time in msec after which the entry cannot be used. 0 for unused entries */
+	int64_t expiry;
+} pair_resume_entry_t;
+
+static pair_resume_entry_t pair_resume_cache[PAIR_RESUME_CACHE_SIZE];
+static portMUX_TYPE pair_resume_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void hap_pair_resume_save(const uint8_t *session_id, const uint8_t *shared_secret,
+		hap_ctrl_data_t *ctrl, int64_t lifetime_ms)
+{
+	int64_t cur_time = esp_timer_get_time() / 1000;
+	int i, index = 0;
+	portENTER_CRITICAL(&pair_resume_lock);
+	/* Use a free or expired entry, else replace the one expiring first */
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		if (pair_resume_cache[i].expiry <= cur_time) {
+			index = i;
+			break;
+		}
+		if (pair_resume_cache[i].expiry < pair_resume_cache[index].expiry)
+			index = i;
+	}
+	pair_resume_entry_t *entry = &pair_resume_cache[index];
+	memcpy(entry->session_id, session_id, PAIR_RESUME_SESSION_ID_LEN);
+	memcpy(entry->shared_secret, shared_secret, CURVE_KEY_LEN);
+	entry->ctrl = ctrl;
+	entry->expiry = cur_time + lifetime_ms;
+	portEXIT_CRITICAL(&pair_resume_lock);
+}
+
+/* Looks up the entry for the given session ID and copies out its shared
+ * secret. The entry stays in the cache until hap_pair_resume_remove(), so that
+ * an M1 with a bad authTag cannot evict it.
+ */
+static hap_ctrl_data_t *hap_pair_resume_find(const uint8_t *session_id, uint8_t *shared_secret)
+{
+	int64_t cur_time = esp_timer_get_time() / 1000;
+	hap_ctrl_data_t *ctrl = NULL;
+	int i;
+	portENTER_CRITICAL(&pair_resume_lock);
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		pair_resume_entry_t *entry = &pair_resume_cache[i];
+		if (entry->expiry &&
+				!memcmp(entry->session_id, session_id, PAIR_RESUME_SESSION_ID_LEN)) {
+			if ((entry->expiry > cur_time) && entry->ctrl->valid) {
+				memcpy(shared_secret, entry->shared_secret, CURVE_KEY_LEN);
+				ctrl = entry->ctrl;
+			} else {
+				/* Stale anyway, no need to keep it around */
+				memset(entry, 0, sizeof(pair_resume_entry_t));
+			}
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&pair_resume_lock);
+	return ctrl;
+}
+
+/* Removes the entry for the given session ID and controller, once the
+ * controller has proved that it has the shared secret. Returns false if
+ * it is gone already, e.g. because a parallel resume used it first.
+ */
+static bool hap_pair_resume_remove(const uint8_t *session_id, hap_ctrl_data_t *ctrl)
+{
+	bool removed = false;
+	int i;
+	portENTER_CRITICAL(&pair_resume_lock);
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		pair_resume_entry_t *entry = &pair_resume_cache[i];
+		if (entry->expiry && (entry->ctrl == ctrl) &&
+				!memcmp(entry->session_id, session_id, PAIR_RESUME_SESSION_ID_LEN)) {
+			memset(entry, 0, sizeof(pair_resume_entry_t));
+			removed = true;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&pair_resume_lock);
+	return removed;
+}
+
+/* Forgets the resumable sessions of a controller which is being removed */
+static void hap_pair_resume_forget(hap_ctrl_data_t *ctrl)
+{
+	int i;
+	portENTER_CRITICAL(&pair_resume_lock);
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		if (pair_resume_cache[i].ctrl == ctrl)
+			memset(&pair_resume_cache[i], 0, sizeof(pair_resume_entry_t));
+	}
+	portEXIT_CRITICAL(&pair_resume_lock);
+}
+
+#ifdef CONFIG_HAP_PAIR_RESUME_PERSIST
+/* A resumable session as written to NVS. The controller is referred to by its
+ * slot, with the hash of its ID to catch the slot having been reused.
+ */
+typedef struct {
+	uint8_t session_id[PAIR_RESUME_SESSION_ID_LEN];
+	uint8_t shared_secret[CURVE_KEY_LEN];
+	uint32_t ctrl_id_hash;
+	uint32_t remaining_secs;
+	uint8_t ctrl_index;
+} __attribute__((packed)) pair_resume_ticket_t;
+
+/* Layout in NVS: nonce, encrypted tickets, auth tag */
+typedef struct {
+	uint8_t nonce[TICKET_NONCE_LEN];
+	pair_resume_ticket_t tickets[PAIR_RESUME_CACHE_SIZE];
+	uint8_t auth_tag[POLY_AUTHTAG_LEN];
+} __attribute__((packed)) pair_resume_blob_t;
+
+static void hap_pair_resume_ticket_key(uint8_t *key)
+{
+	hkdf(SHA512, (unsigned char *) PAIR_RESUME_TICKET_SALT, strlen(PAIR_RESUME_TICKET_SALT),
+			hap_priv.ltska, sizeof(hap_priv.ltska),
+			(unsigned char *) PAIR_RESUME_TICKET_INFO, strlen(PAIR_RESUME_TICKET_INFO),
+			key, ENCRYPT_KEY_LEN);
+}
+
+/* Writes the resumable sessions to NVS, for the next hap_start() to load */
+void hap_pair_resume_persist(void)
+{
+	pair_resume_blob_t *blob = hap_platform_memory_calloc(1, sizeof(pair_resume_blob_t));
+	if (!blob)
+		return;
+	int64_t cur_time = esp_timer_get_time() / 1000;
+	int i, cnt = 0;
+	portENTER_CRITICAL(&pair_resume_lock);
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		pair_resume_entry_t *entry = &pair_resume_cache[i];
+		if ((entry->expiry <= cur_time) || !entry->ctrl->valid)
+			continue;
+		pair_resume_ticket_t *ticket = &blob->tickets[cnt++];
+		memcpy(ticket->session_id, entry->session_id, PAIR_RESUME_SESSION_ID_LEN);
+		memcpy(ticket->shared_secret, entry->shared_secret, CURVE_KEY_LEN);
+		ticket->ctrl_id_hash = entry->ctrl->id_hash;
+		ticket->remaining_secs = (entry->expiry - cur_time) / 1000;
+		ticket->ctrl_index = entry->ctrl - hap_priv.controllers;
+	}
+	portEXIT_CRITICAL(&pair_resume_lock);
+
+	if (cnt) {
+		uint8_t key[ENCRYPT_KEY_LEN];
+		unsigned long long mlen;
+		hap_pair_resume_ticket_key(key);
+		esp_mfi_get_random(blob->nonce, sizeof(blob->nonce));
+		crypto_aead_chacha20poly1305_ietf_encrypt_detached((uint8_t *)blob->tickets, blob->auth_tag, &mlen,
+				(uint8_t *)blob->tickets, sizeof(blob->tickets), NULL, 0, NULL, blob->nonce, key);
+		memset(key, 0, sizeof(key));
+		if (hap_keystore_set(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_RESUME_TICKETS,
+					(uint8_t *)blob, sizeof(pair_resume_blob_t)) == HAP_SUCCESS) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Saved %d resumable sessions", cnt);
+		}
+	}
+	memset(blob, 0, sizeof(pair_resume_blob_t));
+	hap_platform_memory_free(blob);
+}
+
+/* Loads the resumable sessions saved before the reboot. They are removed from
+ * NVS right away, so that each is good for a single reboot.
+ */
+void hap_pair_resume_restore(void)
+{
+	pair_resume_blob_t *blob = hap_platform_memory_calloc(1, sizeof(pair_resume_blob_t));
+	if (!blob)
+		return;
+	size_t blob_size = sizeof(pair_resume_blob_t);
+	if ((hap_keystore_get(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_RESUME_TICKETS,
+				(uint8_t *)blob, &blob_size) != HAP_SUCCESS)) {
+		hap_platform_memory_free(blob);
+		return;
+	}
+	hap_keystore_delete(HAP_KEYSTORE_NAMESPACE_HAPMAIN, HAP_KEY_RESUME_TICKETS);
+
+	uint8_t key[ENCRYPT_KEY_LEN];
+	hap_pair_resume_ticket_key(key);
+	int ret = -1;
+	if (blob_size == sizeof(pair_resume_blob_t)) {
+		ret = crypto_aead_chacha20poly1305_ietf_decrypt_detached((uint8_t *)blob->tickets, NULL,
+				(uint8_t *)blob->tickets, sizeof(blob->tickets), blob->auth_tag, NULL, 0, blob->nonce, key);
+	}
+	memset(key, 0, sizeof(key));
+	if (ret != 0) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Discarding invalid resumable sessions");
+		hap_platform_memory_free(blob);
+		return;
+	}
+
+	int i, cnt = 0;
+	for (i = 0; i < PAIR_RESUME_CACHE_SIZE; i++) {
+		pair_resume_ticket_t *ticket = &blob->tickets[i];
+		if (!ticket->remaining_secs || (ticket->ctrl_index >= HAP_MAX_CONTROLLERS))
+			continue;
+		hap_ctrl_data_t *ctrl = &hap_priv.controllers[ticket->ctrl_index];
+		if (!ctrl->valid || (ctrl->id_hash != ticket->ctrl_id_hash))
+			continue;
+		/* Keep the expiry it had before the reboot */
+		hap_pair_resume_save(ticket->session_id, ticket->shared_secret, ctrl,
+				ticket->remaining_secs * 1000LL);
+		cnt++;
+	}
+	memset(blob, 0, sizeof(pair_resume_blob_t));
+	hap_platform_memory_free(blob);
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Restored %d resumable sessions", cnt);
+}
+#endif /* CONFIG_HAP_PAIR_RESUME_PERSIST */
+#endif /* CONFIG_HAP_PAIR_RESUME_ENABLE */
+
+/* Free indices of hap_priv.sessions[], used as a stack. A session keeps its index
+ * for its lifetime, since that is its bit in the characteristics' ev_ctrls and owner_ctrl.
+ */
+static uint8_t *hap_session_free_slots;
+static int hap_session_free_cnt;
+static portMUX_TYPE hap_sessions_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_HAP_SESSION_POOL_SIZE > 0
+/* Statically allocated sessions, with a bit set in the used mask for each one handed out */
+#define HAP_SESSION_POOL_MASK	((uint32_t)(0xffffffffULL >> (32 - CONFIG_HAP_SESSION_POOL_SIZE)))
+static hap_secure_session_t hap_session_pool[CONFIG_HAP_SESSION_POOL_SIZE] __attribute__((aligned(8)));
+static uint32_t hap_session_pool_used;
+static uint32_t hap_session_pool_misses;
+#endif /* CONFIG_HAP_SESSION_POOL_SIZE > 0 */
+
+/* Gets a zeroed session from the pool, or from the heap if the pool is used up */
+static hap_secure_session_t *hap_session_alloc(void)
+{
+#if CONFIG_HAP_SESSION_POOL_SIZE > 0
+	hap_secure_session_t *session = NULL;
+	uint32_t misses;
+	portENTER_CRITICAL(&hap_sessions_lock);
+	uint32_t free_mask = ~hap_session_pool_used & HAP_SESSION_POOL_MASK;
+	if (free_mask) {
+		int i = __builtin_ctz(free_mask);
+		hap_session_pool_used |= (1UL << i);
+		session = &hap_session_pool[i];
+	}
+	misses = session ? hap_session_pool_misses : ++hap_session_pool_misses;
+	portEXIT_CRITICAL(&hap_sessions_lock);
+	if (session) {
+		memset(session, 0, sizeof(hap_secure_session_t));
+		return session;
+	}
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Session pool used up (%u times so far). Allocating from heap",
+			(unsigned)misses);
+#endif /* CONFIG_HAP_SESSION_POOL_SIZE > 0 */
+	return hap_platform_memory_calloc(sizeof(hap_secure_session_t), 1);
+}
+
+/* Wipes the keys of a session and gives its memory back to wherever it came from */
+static void hap_session_release(hap_secure_session_t *session)
+{
+	memset(session, 0, sizeof(hap_secure_session_t));
+#if CONFIG_HAP_SESSION_POOL_SIZE > 0
+	if ((session >= hap_session_pool) && (session < hap_session_pool + CONFIG_HAP_SESSION_POOL_SIZE)) {
+		portENTER_CRITICAL(&hap_sessions_lock);
+		hap_session_pool_used &= ~(1UL << (session - hap_session_pool));
+		portEXIT_CRITICAL(&hap_sessions_lock);
+		return;
+	}
+#endif /* CONFIG_HAP_SESSION_POOL_SIZE > 0 */
+	hap_platform_memory_free(session);
+}
+
+int hap_sessions_init(void)
+{
+	int max_sessions = hap_priv.cfg.max_sessions;
+	int i;
+	if (hap_priv.sessions)
+		return HAP_SUCCESS;
+	hap_priv.sessions = hap_platform_memory_calloc(max_sessions, sizeof(hap_secure_session_t *));
+	hap_session_free_slots = hap_platform_memory_calloc(max_sessions, sizeof(uint8_t));
+	if (!hap_priv.sessions || !hap_session_free_slots) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to allocate the session table");
+		hap_platform_memory_free(hap_priv.sessions);
+		hap_platform_memory_free(hap_session_free_slots);
+		hap_priv.sessions = NULL;
+		hap_session_free_slots = NULL;
+		return HAP_FAIL;
+	}
+	/* Lowest indices get used first */
+	for (i = 0; i < max_sessions; i++)
+		hap_session_free_slots[i] = max_sessions - 1 - i;
+	hap_session_free_cnt = max_sessions;
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Session table for %d sessions takes %u bytes. Each active session takes %u more",
+			max_sessions, (unsigned)(max_sessions * (sizeof(hap_secure_session_t *) + sizeof(uint8_t))),
+			(unsigned)sizeof(hap_secure_session_t));
+#if CONFIG_HAP_SESSION_POOL_SIZE > 0
+	if (max_sessions > CONFIG_HAP_SESSION_POOL_SIZE)
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Only %d of %d sessions fit in the session pool. The rest will use the heap",
+				CONFIG_HAP_SESSION_POOL_SIZE, max_sessions);
+#endif /* CONFIG_HAP_SESSION_POOL_SIZE > 0 */
+	return HAP_SUCCESS;
+}
+
+int hap_get_ctrl_session_index(hap_secure_session_t *session)
+{
+	if (!session || (session->slot < 0) || (session->slot >= hap_priv.cfg.max_sessions))
+		return -1;
+	if (hap_priv.sessions[session->slot] != session)
+		return -1;
+	return session->slot;
+}
+
+void hap_session_touch(hap_secure_session_t *session)
+{
+	session->last_used = xTaskGetTickCount();
+	if (!hap_conn_is_ble(session->conn_identifier))
+		httpd_sess_update_lru_counter(hap_priv.server, session->conn_identifier);
+}
+
+/* Closes the connection a session or pairing context runs on, whichever the transport */
+void hap_conn_trigger_close(int conn_identifier)
+{
+	if (hap_conn_is_ble(conn_identifier))
+		hap_ble_conn_close(conn_identifier);
+	else
+		httpd_sess_trigger_close(hap_priv.server, conn_identifier);
+}
+
 void hap_close_session(hap_secure_session_t *session)
 {
-    if (!session)
+    if (hap_get_ctrl_session_index(session) < 0)
         return;
-    int i;
-    for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-        if (!hap_priv.sessions[i])
-            continue;
-        if (hap_priv.sessions[i] == session) {
-            hap_report_event(HAP_EVENT_CTRL_DISCONNECTED, (session->ctrl->info.id),
-                    sizeof((session->ctrl->info.id)));
-            httpd_sess_trigger_close(hap_priv.server, hap_priv.sessions[i]->conn_identifier);
-        }
-    }
+    hap_report_event(HAP_EVENT_CTRL_DISCONNECTED, (session->ctrl->info.id),
+            sizeof((session->ctrl->info.id)));
+    hap_conn_trigger_close(session->conn_identifier);
 }
 
 void hap_close_sessions_of_ctrl(hap_ctrl_data_t *ctrl)
@@ -82,33 +443,24 @@ void hap_close_sessions_of_ctrl(hap_ctrl_data_t *ctrl)
 	if (!ctrl)
 		return;
 	int i;
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
+#ifdef CONFIG_HAP_PAIR_RESUME_ENABLE
+	hap_pair_resume_forget(ctrl);
+#endif
+	for (i = 0; i < hap_priv.cfg.max_sessions; i++) {
         if (!hap_priv.sessions[i])
             continue;
 		if (hap_priv.sessions[i]->ctrl == ctrl) {
             hap_report_event(HAP_EVENT_CTRL_DISCONNECTED, (ctrl->info.id),
                     sizeof((ctrl->info.id)));
-			/* TODO: Use some generic function and not a direct HTTPD function
-			 */
-            httpd_sess_trigger_close(hap_priv.server, hap_priv.sessions[i]->conn_identifier);
+            hap_conn_trigger_close(hap_priv.sessions[i]->conn_identifier);
 		}
 	}
 }
 
-int hap_get_ctrl_session_index(hap_secure_session_t *session)
-{
-	int i;
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		if (hap_priv.sessions[i] == session)
-			return i;
-	}
-	return -1;
-}
-
 void hap_close_all_sessions()
 {
 	int i;
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
+	for (i = 0; i < hap_priv.cfg.max_sessions; i++) {
 		if (hap_priv.sessions[i]) {
 			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Closing Session");
             hap_close_session(hap_priv.sessions[i]);
@@ -116,45 +468,362 @@ void hap_close_all_sessions()
 	}
 }
 
-static void hap_add_secure_session(hap_secure_session_t *session)
+/* Session that has gone the longest without a request or a notification.
+ * Called with hap_sessions_lock held.
+ */
+static hap_secure_session_t *hap_session_get_lru(void)
 {
+	hap_secure_session_t *lru = NULL;
+	uint32_t now = xTaskGetTickCount();
 	int i;
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		if (hap_priv.sessions[i] == NULL) {
-			hap_priv.sessions[i] = session;
-            hap_report_event(HAP_EVENT_CTRL_CONNECTED, session->ctrl->info.id,
-                            sizeof(session->ctrl->info.id));
-            /* Set the disconnected_event_sent flag here to false so that an
-             * event can be sent later for a state change, when no controller
-             * is connected.
-             * HAP Spec R15 say that the state number should change only once
-             * between accessory disconneted (from all controllers) to connected
-             * state.
-             */
-            hap_priv.disconnected_event_sent = false;
-			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HomeKit Session active");
-			break;
+	for (i = 0; i < hap_priv.cfg.max_sessions; i++) {
+		hap_secure_session_t *session = hap_priv.sessions[i];
+		if (session && (!lru || ((now - session->last_used) > (now - lru->last_used))))
+			lru = session;
+	}
+	return lru;
+}
+
+static int hap_add_secure_session(hap_secure_session_t *session)
+{
+	hap_secure_session_t *evicted = NULL;
+	/* Copied under the lock, as httpd may free the evicted session right after */
+	char evicted_id[HAP_CTRL_ID_LEN];
+	int evicted_conn = -1;
+	int slot = -1;
+	session->slot = -1;
+	session->last_used = xTaskGetTickCount();
+	portENTER_CRITICAL(&hap_sessions_lock);
+	if (!hap_session_free_cnt) {
+		/* The table is full. The idle-most session gives its index to this one */
+		evicted = hap_session_get_lru();
+		if (evicted) {
+			slot = evicted->slot;
+			evicted->slot = -1;
+			memcpy(evicted_id, evicted->ctrl->info.id, sizeof(evicted_id));
+			evicted_conn = evicted->conn_identifier;
 		}
+	} else {
+		slot = hap_session_free_slots[--hap_session_free_cnt];
+	}
+	if (slot >= 0) {
+		hap_priv.sessions[slot] = session;
+		session->slot = slot;
+	}
+	portEXIT_CRITICAL(&hap_sessions_lock);
+	if (slot < 0) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No room for a new session");
+		return HAP_FAIL;
+	}
+	if (evicted) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_WARN, "Session table full. Closing the least recently used session");
+		/* The index has not been given out yet, so nothing can subscribe meanwhile */
+		hap_disable_all_char_notif(slot);
+		hap_tw_cancel(slot);
+		hap_report_event(HAP_EVENT_CTRL_DISCONNECTED, evicted_id, sizeof(evicted_id));
+		hap_conn_trigger_close(evicted_conn);
 	}
+	hap_report_event(HAP_EVENT_CTRL_CONNECTED, session->ctrl->info.id,
+			sizeof(session->ctrl->info.id));
+	/* Set the disconnected_event_sent flag here to false so that an
+	 * event can be sent later for a state change, when no controller
+	 * is connected.
+	 * HAP Spec R15 say that the state number should change only once
+	 * between accessory disconneted (from all controllers) to connected
+	 * state.
+	 */
+	hap_priv.disconnected_event_sent = false;
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HomeKit Session active");
+	return HAP_SUCCESS;
 }
 
 void hap_free_session(void *session)
 {
 	if (!session)
 		return;
-	int i;
-	for (i = 0; i < HAP_MAX_SESSIONS; i++) {
-		if (hap_priv.sessions[i] == session) {
-			/* Disable all characteristic notifications on this session */
-			hap_disable_all_char_notif(i);
-			hap_priv.sessions[i] = NULL;
-			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HomeKit Session terminated");
-			break;
+	hap_secure_session_t *_session = (hap_secure_session_t *)session;
+	int slot;
+	portENTER_CRITICAL(&hap_sessions_lock);
+	slot = hap_get_ctrl_session_index(_session);
+	if (slot >= 0)
+		hap_priv.sessions[slot] = NULL;
+	portEXIT_CRITICAL(&hap_sessions_lock);
+	if (slot >= 0) {
+		/* Disable all characteristic notifications on this session,
+		 * before the index can go to another one
+		 */
+		hap_disable_all_char_notif(slot);
+		hap_tw_cancel(slot);
+		portENTER_CRITICAL(&hap_sessions_lock);
+		hap_session_free_slots[hap_session_free_cnt++] = slot;
+		portEXIT_CRITICAL(&hap_sessions_lock);
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "HomeKit Session terminated");
+	}
+	hap_platform_memory_free(_session->decrypt_frame.data);
+	hap_session_release(_session);
+}
+
+static int hap_curve_keypair_generate(uint8_t *sk, uint8_t *pk)
+{
+	esp_mfi_get_random(sk, CURVE_KEY_LEN);
+	/* This particular value of basepoint is required to generate the public key
+	 * from secret key
+	 */
+	uint8_t basepoint[32] = {9};
+	return crypto_scalarmult_curve25519(pk, sk, basepoint);
+}
+
+#if CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0
+static void hap_curve_key_pool_task(void *arg)
+{
+	curve_keypair_t keypair;
+	while (1) {
+		/* Wait till a key pair gets used, unless the pool has to be filled */
+		portENTER_CRITICAL(&curve_key_pool_lock);
+		bool full = (curve_key_pool_cnt == CONFIG_HAP_CURVE_KEY_POOL_SIZE);
+		portEXIT_CRITICAL(&curve_key_pool_lock);
+		if (full) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			continue;
+		}
+		if (hap_curve_keypair_generate(keypair.sk, keypair.pk) == -1) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
+			continue;
 		}
+		portENTER_CRITICAL(&curve_key_pool_lock);
+		if (curve_key_pool_cnt < CONFIG_HAP_CURVE_KEY_POOL_SIZE) {
+			curve_key_pool[curve_key_pool_cnt++] = keypair;
+		}
+		portEXIT_CRITICAL(&curve_key_pool_lock);
+		memset(&keypair, 0, sizeof(keypair));
 	}
-	hap_platform_memory_free(session);
 }
 
+int hap_curve_key_pool_start(void)
+{
+	if (curve_key_pool_task) {
+		return HAP_SUCCESS;
+	}
+	if (xTaskCreatePinnedToCore(hap_curve_key_pool_task, CURVE_KEY_POOL_TASK_NAME, CURVE_KEY_POOL_STACKSIZE,
+				NULL, tskIDLE_PRIORITY + 1, &curve_key_pool_task, HAP_PLATFORM_TASK_CORE_ID) != pdPASS) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Failed to create Curve25519 key pool task");
+		curve_key_pool_task = NULL;
+		return HAP_FAIL;
+	}
+	return HAP_SUCCESS;
+}
+
+void hap_curve_key_pool_stop(void)
+{
+	if (!curve_key_pool_task) {
+		return;
+	}
+	vTaskDelete(curve_key_pool_task);
+	curve_key_pool_task = NULL;
+	portENTER_CRITICAL(&curve_key_pool_lock);
+	memset(curve_key_pool, 0, sizeof(curve_key_pool));
+	curve_key_pool_cnt = 0;
+	portEXIT_CRITICAL(&curve_key_pool_lock);
+}
+#else
+int hap_curve_key_pool_start(void)
+{
+	return HAP_SUCCESS;
+}
+
+void hap_curve_key_pool_stop(void)
+{
+}
+#endif /* CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0 */
+
+/* Gets an ephemeral key pair from the pool, or generates one if it is empty */
+static int hap_curve_keypair_get(uint8_t *sk, uint8_t *pk)
+{
+#if CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0
+	bool found = false;
+	portENTER_CRITICAL(&curve_key_pool_lock);
+	if (curve_key_pool_cnt) {
+		curve_keypair_t *keypair = &curve_key_pool[--curve_key_pool_cnt];
+		memcpy(sk, keypair->sk, CURVE_KEY_LEN);
+		memcpy(pk, keypair->pk, CURVE_KEY_LEN);
+		memset(keypair, 0, sizeof(curve_keypair_t));
+		found = true;
+	}
+	portEXIT_CRITICAL(&curve_key_pool_lock);
+	if (curve_key_pool_task) {
+		xTaskNotifyGive(curve_key_pool_task);
+	}
+	if (found) {
+		return 0;
+	}
+#endif /* CONFIG_HAP_CURVE_KEY_POOL_SIZE > 0 */
+	return hap_curve_keypair_generate(sk, pk);
+}
+
+/* Creates the secure session for a verified controller, with the
+ * Encryption and Decryption Keys derived from the shared secret
+ */
+static hap_secure_session_t *hap_pair_verify_create_session(const uint8_t *shared_secret,
+		hap_ctrl_data_t *ctrl)
+{
+	/* Get memory for the secure session information */
+	hap_secure_session_t *session = hap_session_alloc();
+	if (!session) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Memory allocation failed");
+		return NULL;
+	}
+
+	/* Generate the Encryption and Decryption Keys.
+	 * Since, read and write are from the controller's point of view,
+	 * encryption key uses READ_INFO and decryption key uses WRITE_INFO
+	 *
+	 * Both keys share the salt and the shared secret, and so the Extract
+	 * step, which is done only once. Also, set the nonce to zero
+	 */
+	uint8_t prk[SHA512HashSize];
+	hkdfExtract(SHA512, (unsigned char *) CONTROL_SALT, strlen(CONTROL_SALT),
+			shared_secret, CURVE_KEY_LEN, prk);
+	hkdfExpand(SHA512, prk, sizeof(prk),
+			(unsigned char *) CONTROL_READ_INFO, strlen(CONTROL_READ_INFO),
+			session->encrypt_key, sizeof(session->encrypt_key));
+	hkdfExpand(SHA512, prk, sizeof(prk),
+			(unsigned char *) CONTROL_WRITE_INFO, strlen(CONTROL_WRITE_INFO),
+			session->decrypt_key, sizeof(session->decrypt_key));
+	memset(prk, 0, sizeof(prk));
+
+	session->state = STATE_VERIFIED;
+
+	session->encrypt_nonce = 0;
+	session->decrypt_nonce = 0;
+	session->ctrl = ctrl;
+
+	/* Add the session information to database */
+	if (hap_add_secure_session(session) != HAP_SUCCESS) {
+		hap_session_release(session);
+		return NULL;
+	}
+	return session;
+}
+
+#ifdef CONFIG_HAP_PAIR_RESUME_ENABLE
+/* Derives key_len bytes from the shared secret of the earlier session,
+ * salted with the controller's new public key and the session ID
+ */
+static void hap_pair_resume_derive(const uint8_t *shared_secret, const uint8_t *ctrl_curve_pk,
+		const uint8_t *session_id, const char *info, uint8_t *key, int key_len)
+{
+	uint8_t salt[CURVE_KEY_LEN + PAIR_RESUME_SESSION_ID_LEN];
+	memcpy(salt, ctrl_curve_pk, CURVE_KEY_LEN);
+	memcpy(salt + CURVE_KEY_LEN, session_id, PAIR_RESUME_SESSION_ID_LEN);
+	hkdf(SHA512, salt, sizeof(salt), shared_secret, CURVE_KEY_LEN,
+			(unsigned char *) info, strlen(info), key, key_len);
+}
+
+/* Makes a verified session resumable later. The session ID is derived
+ * from the shared secret, so the controller knows it without being told.
+ */
+static void hap_pair_resume_remember(const uint8_t *shared_secret, hap_ctrl_data_t *ctrl)
+{
+	uint8_t session_id[PAIR_RESUME_SESSION_ID_LEN];
+	hkdf(SHA512, (unsigned char *) PAIR_RESUME_SESSION_ID_SALT,
+			strlen(PAIR_RESUME_SESSION_ID_SALT),
+			shared_secret, CURVE_KEY_LEN,
+			(unsigned char *) PAIR_RESUME_SESSION_ID_INFO,
+			strlen(PAIR_RESUME_SESSION_ID_INFO),
+			session_id, sizeof(session_id));
+	hap_pair_resume_save(session_id, shared_secret, ctrl, CONFIG_HAP_PAIR_RESUME_TIMEOUT * 1000LL);
+}
+
+/* Handles an M1 with the Resume method. Returns HAP_FAIL, without preparing
+ * any response, if the session cannot be resumed, so that the caller can go
+ * ahead with a regular Pair Verify instead.
+ */
+static int hap_pair_resume_process(pair_verify_ctx_t *pv_ctx, uint8_t *buf, int inlen,
+		int bufsize, int *outlen)
+{
+	uint8_t session_id[PAIR_RESUME_SESSION_ID_LEN];
+	uint8_t auth_tag[POLY_AUTHTAG_LEN];
+	if ((get_value_from_tlv(buf, inlen, kTLVType_SessionID, session_id,
+					sizeof(session_id)) != sizeof(session_id)) ||
+			(get_value_from_tlv(buf, inlen, kTLVType_EncryptedData, auth_tag,
+					sizeof(auth_tag)) != sizeof(auth_tag))) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Invalid Pair Resume TLVs");
+		return HAP_FAIL;
+	}
+	uint8_t shared_secret[CURVE_KEY_LEN];
+	uint8_t key[ENCRYPT_KEY_LEN];
+	int ret = HAP_FAIL;
+	hap_ctrl_data_t *ctrl = hap_pair_resume_find(session_id, shared_secret);
+	if (!ctrl) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Session not resumable");
+		goto resume_end;
+	}
+
+	/* The request carries just the authTag of an empty message, which
+	 * proves that the controller has the earlier shared secret
+	 */
+	uint8_t newnonce[12];
+	memset(newnonce, 0, sizeof newnonce);
+	memcpy(newnonce+4, PR_NONCE1, 8);
+	hap_pair_resume_derive(shared_secret, pv_ctx->ctrl_curve_pk, session_id,
+			PAIR_RESUME_REQUEST_INFO, key, sizeof(key));
+	if (crypto_aead_chacha20poly1305_ietf_decrypt_detached(NULL, NULL, NULL, 0, auth_tag,
+				NULL, 0, newnonce, key) != 0) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Pair Resume authentication failed");
+		goto resume_end;
+	}
+	/* Only a genuine controller gets to use up the entry */
+	if (!hap_pair_resume_remove(session_id, ctrl)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Session already resumed");
+		goto resume_end;
+	}
+
+	/* Move on to a new session ID and shared secret */
+	uint8_t new_session_id[PAIR_RESUME_SESSION_ID_LEN];
+	esp_mfi_get_random(new_session_id, sizeof(new_session_id));
+	memcpy(newnonce+4, PR_NONCE2, 8);
+	hap_pair_resume_derive(shared_secret, pv_ctx->ctrl_curve_pk, new_session_id,
+			PAIR_RESUME_RESPONSE_INFO, key, sizeof(key));
+	unsigned long long mlen = POLY_AUTHTAG_LEN;
+	crypto_aead_chacha20poly1305_ietf_encrypt_detached(NULL, auth_tag, &mlen, NULL, 0,
+			NULL, 0, NULL, newnonce, key);
+	hap_pair_resume_derive(shared_secret, pv_ctx->ctrl_curve_pk, new_session_id,
+			PAIR_RESUME_SHARED_SECRET_INFO, pv_ctx->shared_secret,
+			sizeof(pv_ctx->shared_secret));
+
+	/* Construct the response M2 */
+	hap_tlv_data_t tlv_data;
+	tlv_data.bufptr = buf;
+	tlv_data.bufsize = bufsize;
+	tlv_data.curlen = 0;
+	uint8_t state = STATE_M2;
+	uint8_t method = HAP_METHOD_RESUME;
+	if ((add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_Method, 1, &method) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_SessionID, sizeof(new_session_id),
+				 new_session_id) < 0) ||
+			(add_tlv(&tlv_data, kTLVType_EncryptedData, sizeof(auth_tag), auth_tag) < 0)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
+		goto resume_end;
+	}
+	hap_secure_session_t *session = hap_pair_verify_create_session(pv_ctx->shared_secret, ctrl);
+	if (!session) {
+		goto resume_end;
+	}
+	*outlen = tlv_data.curlen;
+	hap_pair_resume_save(new_session_id, pv_ctx->shared_secret, ctrl,
+			CONFIG_HAP_PAIR_RESUME_TIMEOUT * 1000LL);
+	pv_ctx->session = session;
+	pv_ctx->state = STATE_VERIFIED;
+	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Resume Successful for %s", ctrl->info.id);
+	ret = HAP_SUCCESS;
+resume_end:
+	memset(shared_secret, 0, sizeof(shared_secret));
+	memset(key, 0, sizeof(key));
+	return ret;
+}
+#endif /* CONFIG_HAP_PAIR_RESUME_ENABLE */
+
 static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf, int inlen,
 		int bufsize, int *outlen)
 {
@@ -181,21 +850,31 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Verify M1 Received");
 	hex_dbg_with_name("ctrl curve pk", pv_ctx->ctrl_curve_pk, 32);
 
-	/* Generate a new Curve25519 Key Pair */
+#ifdef CONFIG_HAP_PAIR_RESUME_ENABLE
+	uint8_t method;
+	if ((get_value_from_tlv(buf, inlen, kTLVType_Method, &method, sizeof(method)) == sizeof(method)) &&
+			(method == HAP_METHOD_RESUME)) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Resume requested");
+		if (hap_pair_resume_process(pv_ctx, buf, inlen, bufsize, outlen) == HAP_SUCCESS) {
+			return HAP_SUCCESS;
+		}
+		/* Fall back to a regular Pair Verify, using the public key from M1 */
+	}
+#endif /* CONFIG_HAP_PAIR_RESUME_ENABLE */
+
+	/* Get a new Curve25519 Key Pair */
 	uint8_t acc_curve_sk[CURVE_KEY_LEN];
-	esp_mfi_get_random(acc_curve_sk, CURVE_KEY_LEN);
-	/* This particular value of basepoint is required to generate the public key
-	 * from secret key
-	 */
-	uint8_t basepoint[32] = {9};
-    if (crypto_scalarmult_curve25519(pv_ctx->acc_curve_pk, acc_curve_sk, basepoint) == -1) {
+    if (hap_curve_keypair_get(acc_curve_sk, pv_ctx->acc_curve_pk) == -1) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
     }
 	hex_dbg_with_name("acc curve sk", acc_curve_sk, 32);
 	hex_dbg_with_name("acc curve pk", pv_ctx->acc_curve_pk, 32);
-    if (crypto_scalarmult_curve25519(pv_ctx->shared_secret, acc_curve_sk, pv_ctx->ctrl_curve_pk) == -1) {
+    int ret = crypto_scalarmult_curve25519(pv_ctx->shared_secret, acc_curve_sk, pv_ctx->ctrl_curve_pk);
+    /* The secret key is not needed any more */
+    memset(acc_curve_sk, 0, sizeof(acc_curve_sk));
+    if (ret == -1) {
         ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Curve25519 Error");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -223,15 +902,14 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	 * with its Long Term Secret Key AccessoryLTSK
 	 */
 	unsigned char ed_sign[64];
-    unsigned long long ed_sign_len;
-    crypto_sign_ed25519_detached(ed_sign, &ed_sign_len, acc_info, acc_info_len, hap_priv.ltska);
+    hap_acc_sign(acc_info, acc_info_len, ed_sign);
 	hex_dbg_with_name("sign", ed_sign, 64);
 
 	/* Construct a subTLV with
 	 * kTLVType_Identifier : Accessory Identifier
 	 * kTLVType_Signature : AccessorySignature generated above
 	 */
-	uint8_t subtlv[4 + HAP_ACC_ID_LEN + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
+	uint8_t subtlv[4 + HAP_ACC_ID_LEN + ED_SIGN_LEN];
 	hap_tlv_data_t tlv_data;
 	tlv_data.bufptr = subtlv;
 	tlv_data.bufsize = sizeof(subtlv);
@@ -250,22 +928,9 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 			(unsigned char *) PAIR_VERIFY_ENCRYPT_INFO,
 			strlen(PAIR_VERIFY_ENCRYPT_INFO),
 			pv_ctx->hkdf_key, sizeof(pv_ctx->hkdf_key));
-	/* Encrypt the sub TLV to get encryptedData and an authTag using
-	 * Chacha20-Poly1305 AEAD Algorithm
-	 */
-	uint8_t edata[4 + HAP_ACC_ID_LEN + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
-    unsigned long long mlen = 16;
-    uint8_t newnonce[12];
-    memset(newnonce, 0, sizeof newnonce);
-    memcpy(newnonce+4, PV_NONCE1, 8);
-
-    crypto_aead_chacha20poly1305_ietf_encrypt_detached(edata, edata + subtlv_len, &mlen, subtlv, subtlv_len, NULL, 0, NULL, newnonce, pv_ctx->hkdf_key);
-
-	int edata_len = subtlv_len + POLY_AUTHTAG_LEN;
-
-	hex_dbg_with_name("encrypt_data", edata, edata_len);
-
 	/* Construct the response M2 */
+	int edata_len = subtlv_len + POLY_AUTHTAG_LEN;
+	uint8_t *edata;
 	tlv_data.bufptr = buf;
 	tlv_data.bufsize = bufsize;
 	tlv_data.curlen = 0;
@@ -273,11 +938,24 @@ static int hap_pair_verify_process_start(pair_verify_ctx_t *pv_ctx, uint8_t *buf
 	if ((add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) ||
 			(add_tlv(&tlv_data, kTLVType_PublicKey, CURVE_KEY_LEN,
 				 pv_ctx->acc_curve_pk) < 0) ||
-			(add_tlv(&tlv_data, kTLVType_EncryptedData, edata_len, edata) < 0)) {
+			((edata = hap_tlv_reserve(&tlv_data, edata_len)) == NULL)) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
 		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+
+	/* Encrypt the sub TLV to get encryptedData and an authTag using
+	 * Chacha20-Poly1305 AEAD Algorithm, directly into the response
+	 */
+    unsigned long long mlen = 16;
+    uint8_t newnonce[12];
+    memset(newnonce, 0, sizeof newnonce);
+    memcpy(newnonce+4, PV_NONCE1, 8);
+
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(edata, edata + subtlv_len, &mlen, subtlv, subtlv_len, NULL, 0, NULL, newnonce, pv_ctx->hkdf_key);
+
+	hex_dbg_with_name("encrypt_data", edata, edata_len);
+	hap_tlv_commit(&tlv_data, kTLVType_EncryptedData, edata_len);
 	*outlen = tlv_data.curlen;
 	hex_dbg_with_name("M2", buf, *outlen);
 	pv_ctx->state = STATE_M2;
@@ -295,11 +973,13 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
-	uint8_t edata[4 + HAP_CTRL_ID_LEN + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
+	hap_tlv_index_t tlv_idx;
+	uint8_t *edata;
 	int edata_len;
-	if ((get_value_from_tlv(buf, inlen, kTLVType_State, &state, sizeof(state)) < 0) ||
-		((edata_len = get_value_from_tlv(buf, inlen, kTLVType_EncryptedData,
-					 edata, sizeof(edata))) < 0)) {
+	if ((hap_tlv_index_build(&tlv_idx, buf, inlen) < 0) ||
+		(hap_tlv_get_u8(&tlv_idx, kTLVType_State, &state) < 0) ||
+		((edata_len = hap_tlv_get(&tlv_idx, kTLVType_EncryptedData,
+					 &edata)) < POLY_AUTHTAG_LEN)) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Invalid TLVs received");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
@@ -311,7 +991,7 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	}
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Verify M3 Received");
 
-    /* Decrypt the received data to get the subTLV */
+    /* Decrypt the received data in place to get the subTLV */
     uint8_t newnonce[12];
     memset(newnonce, 0, sizeof newnonce);
     memcpy(newnonce+4, PV_NONCE2, 8);
@@ -326,17 +1006,21 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	/* Parse the subTLV to get the iOSDevicePairingID and iOSDeviceSignature
 	 */
 	edata_len = edata_len - POLY_AUTHTAG_LEN;
-    unsigned char ed_sign[64];
+	hap_tlv_index_t subtlv_idx;
+	uint8_t *ctrl_id_val, *ed_sign;
+	int ctrl_id_len;
 	char ctrl_id[HAP_CTRL_ID_LEN];
-	memset(ctrl_id, 0, sizeof(ctrl_id));
-	if ((get_value_from_tlv(edata, edata_len, kTLVType_Identifier,
-					ctrl_id, sizeof(ctrl_id)) < 0) ||
-			(get_value_from_tlv(edata, edata_len, kTLVType_Signature,
-					ed_sign, sizeof(ed_sign)) < 0)) {
+	if ((hap_tlv_index_build(&subtlv_idx, edata, edata_len) < 0) ||
+			((ctrl_id_len = hap_tlv_get(&subtlv_idx, kTLVType_Identifier,
+					&ctrl_id_val)) < 0) ||
+			(ctrl_id_len >= (int)sizeof(ctrl_id)) ||
+			(hap_tlv_get(&subtlv_idx, kTLVType_Signature, &ed_sign) != ED_SIGN_LEN)) {
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Wrong subTLV received");
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
 		return HAP_FAIL;
 	}
+	memcpy(ctrl_id, ctrl_id_val, ctrl_id_len);
+	ctrl_id[ctrl_id_len] = 0; /* NULL termination */
 
 	/* Check if the controller is present in the database i.e. check
 	 * if the controller was paired with the accessory
@@ -370,13 +1054,6 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 		return HAP_FAIL;
 	}
 
-	/* Allocate memory for the secure session information */
-	hap_secure_session_t *session = hap_platform_memory_calloc(sizeof(hap_secure_session_t), 1);
-	if (!session) {
-		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
-		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Memory allocation failed");
-		return HAP_FAIL;
-	}
 	/* Construct the response M4 */
 	hap_tlv_data_t tlv_data;
 	tlv_data.bufptr = buf;
@@ -385,39 +1062,21 @@ static int hap_pair_verify_process_finish(pair_verify_ctx_t *pv_ctx, uint8_t *bu
 	state = STATE_M4;
 	if (add_tlv(&tlv_data, kTLVType_State, 1, &state) < 0) {
 		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
-		hap_platform_memory_free(session);
 		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
 		return HAP_FAIL;
 	}
-	*outlen = tlv_data.curlen;
-
-	/* Generate the Encryption and Decryption Keys.
-	 * Since, read and write are from the controller's point of view,
-	 * encryption key uses READ_INFO and decryption key uses WRITE_INFO
-	 *
-	 * Also, set the nonce to zero
-	 */
-	hkdf(SHA512, (unsigned char *) CONTROL_SALT, strlen(CONTROL_SALT),
-			pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
-			(unsigned char *) CONTROL_READ_INFO, strlen(CONTROL_READ_INFO),
-			session->encrypt_key, sizeof(session->encrypt_key));
-
-	hkdf(SHA512, (unsigned char *) CONTROL_SALT, strlen(CONTROL_SALT),
-			pv_ctx->shared_secret, sizeof(pv_ctx->shared_secret),
-			(unsigned char *) CONTROL_WRITE_INFO, strlen(CONTROL_WRITE_INFO),
-			session->decrypt_key, sizeof(session->decrypt_key));
 
-	session->state = STATE_VERIFIED;
+	hap_secure_session_t *session = hap_pair_verify_create_session(pv_ctx->shared_secret, ctrl);
+	if (!session) {
+		hap_prepare_error_tlv(STATE_M4, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
+	*outlen = tlv_data.curlen;
 	pv_ctx->state = STATE_VERIFIED;
-
-	memset(session->encrypt_nonce, 0, sizeof(session->encrypt_nonce));
-	memset(session->decrypt_nonce, 0, sizeof(session->decrypt_nonce));
-	session->ctrl = ctrl;
-
 	pv_ctx->session = session;
-
-	/* Add the session information to database */
-	hap_add_secure_session(session);
+#ifdef CONFIG_HAP_PAIR_RESUME_ENABLE
+	hap_pair_resume_remember(pv_ctx->shared_secret, ctrl);
+#endif
 	ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Pair Verify Successful for %s", ctrl_id);
 	return HAP_SUCCESS;
 }
@@ -426,10 +1085,17 @@ int hap_pair_verify_process(void **ctx, uint8_t *buf, int inlen, int bufsize, in
 {
 	pair_verify_ctx_t *pv_ctx = (pair_verify_ctx_t *)(*ctx);
 	if (pv_ctx) {
-		if (pv_ctx->state == STATE_M0)
-			return hap_pair_verify_process_start(pv_ctx, buf, inlen,
+		if (pv_ctx->state == STATE_M0) {
+			int ret = hap_pair_verify_process_start(pv_ctx, buf, inlen,
 					bufsize, outlen);
-		else if (pv_ctx->state == STATE_M2) {
+			/* A resumed session is verified right away, in M2 itself */
+			if ((ret == HAP_SUCCESS) && (pv_ctx->state == STATE_VERIFIED)) {
+				hap_secure_session_t *session = pv_ctx->session;
+				hap_platform_memory_free(pv_ctx);
+				*ctx = session;
+			}
+			return ret;
+		} else if (pv_ctx->state == STATE_M2) {
 			int ret = hap_pair_verify_process_finish(pv_ctx, buf, inlen,
 					bufsize, outlen);
 			/* Successful finish means that the pair verify was successful.
@@ -74,9 +74,9 @@ void hap_remove_all_controllers()
 	for (i = 0; i < HAP_MAX_CONTROLLERS; i++) {
 		if (hap_priv.controllers[i].valid) {
 			hap_close_sessions_of_ctrl(&hap_priv.controllers[i]);
-			hap_controller_remove(&hap_priv.controllers[i]);
 		}
 	}
+	hap_controller_remove_all();
 }
 static int hap_process_pair_remove(uint8_t *buf, int inlen, int bufsize, int *outlen)
 {
@@ -144,7 +144,7 @@ static int hap_process_pair_add(uint8_t *buf, int inlen, int bufsize, int *outle
 		if (memcmp(ltpkc, ctrl->info.ltpk, ED_KEY_LEN)) {
 			hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 			return HAP_FAIL;
-		} else {
+		} else if (ctrl->info.perms != perms) {
 			/* Else, just change the permissions */
 			ctrl->info.perms = perms;
 	        ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Modifying Existing Controller %s", ctrl_id);
@@ -178,13 +178,12 @@ static int hap_process_pair_add(uint8_t *buf, int inlen, int bufsize, int *outle
 	return HAP_SUCCESS;
 
 }
-static int hap_process_pair_list(uint8_t *buf, int inlen, int bufsize, int *outlen)
+/* Writes the M2 response for List Pairings, one controller entry at a time,
+ * so that the stream can send it out in frames rather than needing a buffer
+ * large enough for HAP_MAX_CONTROLLERS entries.
+ */
+int hap_pairings_list_write(hap_tlv_stream_t *stream)
 {
-	hap_tlv_data_t tlv_data = {
-		.bufptr = buf,
-		.bufsize = bufsize,
-		.curlen = 0,
-	};
 	int i;
 	hap_ctrl_data_t *ctrl;
     hap_ctrl_info_t *ctrl_info;
@@ -195,39 +194,62 @@ static int hap_process_pair_list(uint8_t *buf, int inlen, int bufsize, int *outl
 			continue;
         /* If an entry is already added, include a separator */
         if (entry_added) {
-            if (add_tlv(&tlv_data, kTLVType_Separator, 0, NULL) < 0) {
-                ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
-                hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown,
-                        buf, bufsize, outlen);
+            if (hap_tlv_stream_add(stream, kTLVType_Separator, 0, NULL) < 0) {
                 return HAP_FAIL;
             }
         } else {
             /* Else, since this is the first entry, add the state */
 	        uint8_t state = STATE_M2;
-            if (add_tlv(&tlv_data, kTLVType_State, sizeof(state), &state) < 0) {
-                ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
-                hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown,
-                        buf, bufsize, outlen);
+            if (hap_tlv_stream_add(stream, kTLVType_State, sizeof(state), &state) < 0) {
                 return HAP_FAIL;
             }
         }
         ctrl_info = &ctrl->info;
-		if ((add_tlv(&tlv_data, kTLVType_Identifier,
+		if ((hap_tlv_stream_add(stream, kTLVType_Identifier,
 						strlen(ctrl_info->id), ctrl_info->id) < 0) ||
-				(add_tlv(&tlv_data, kTLVType_PublicKey,
+				(hap_tlv_stream_add(stream, kTLVType_PublicKey,
 					 ED_KEY_LEN, ctrl_info->ltpk) < 0) ||
-				(add_tlv(&tlv_data, kTLVType_Permissions,
+				(hap_tlv_stream_add(stream, kTLVType_Permissions,
 					 1, &ctrl_info->perms) < 0)) {
-			ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
-			hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
 			return HAP_FAIL;
 		}
 		entry_added = true;
 	}
-	*outlen = tlv_data.curlen;
 	return HAP_SUCCESS;
 }
 
+static int hap_process_pair_list(uint8_t *buf, int inlen, int bufsize, int *outlen)
+{
+	hap_tlv_stream_t stream;
+	/* No flush callback, so the whole list has to fit in buf */
+	hap_tlv_stream_init(&stream, buf, bufsize, NULL, NULL);
+	if (hap_pairings_list_write(&stream) != HAP_SUCCESS) {
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TLV creation failed");
+		hap_prepare_error_tlv(STATE_M2, kTLVError_Unknown, buf, bufsize, outlen);
+		return HAP_FAIL;
+	}
+	*outlen = stream.curlen;
+	return HAP_SUCCESS;
+}
+
+/* Checks whether a request is a valid List Pairings one from an admin controller.
+ * Such a request can be answered with hap_pairings_list_write(), the rest go to
+ * hap_pairings_process().
+ */
+bool hap_pairings_is_list_req(void *ctx, uint8_t *buf, int inlen)
+{
+	uint8_t state, method;
+	if (!hap_is_req_admin(ctx) || (inlen <= 0)) {
+		return false;
+	}
+	if ((get_value_from_tlv(buf, inlen, kTLVType_State, &state, sizeof(state)) < 0) ||
+			(get_value_from_tlv(buf, inlen, kTLVType_Method,
+					    &method, sizeof(method)) < 0)) {
+		return false;
+	}
+	return (state == STATE_M1) && (method == HAP_METHOD_LIST_PAIRINGS);
+}
+
 int hap_pairings_process(void *ctx, uint8_t *buf, int inlen, int bufsize, int *outlen)
 {
 	if (!hap_is_req_admin(ctx)) {
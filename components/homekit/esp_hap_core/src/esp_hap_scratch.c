@@ -0,0 +1,156 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sdkconfig.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <hap_platform_memory.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_scratch.h>
+
+#define HAP_SCRATCH_ALIGN	8
+/* The httpd task, the hap-loop task and the pairing worker */
+#define HAP_SCRATCH_MAX_TASKS	4
+
+typedef struct hap_scratch_spill {
+	struct hap_scratch_spill *next;
+	uint8_t data[] __attribute__((aligned(HAP_SCRATCH_ALIGN)));
+} hap_scratch_spill_t;
+
+typedef struct {
+	TaskHandle_t owner;
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	/* Everything asked for since the last reset, including the spills */
+	size_t demand;
+	hap_scratch_spill_t *spills;
+} hap_scratch_arena_t;
+
+static hap_scratch_arena_t hap_scratch_arenas[HAP_SCRATCH_MAX_TASKS];
+static portMUX_TYPE hap_scratch_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* An arena is only ever touched by its owner, the lock just covers a task
+ * claiming a free slot.
+ */
+static hap_scratch_arena_t *hap_scratch_get(bool claim)
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	hap_scratch_arena_t *arena = NULL;
+	int i;
+	for (i = 0; i < HAP_SCRATCH_MAX_TASKS; i++) {
+		if (hap_scratch_arenas[i].owner == task)
+			return &hap_scratch_arenas[i];
+	}
+	if (!claim)
+		return NULL;
+	portENTER_CRITICAL(&hap_scratch_lock);
+	for (i = 0; i < HAP_SCRATCH_MAX_TASKS; i++) {
+		if (!hap_scratch_arenas[i].owner) {
+			arena = &hap_scratch_arenas[i];
+			arena->owner = task;
+			arena->size = CONFIG_HAP_SCRATCH_ARENA_SIZE;
+			break;
+		}
+	}
+	portEXIT_CRITICAL(&hap_scratch_lock);
+	return arena;
+}
+
+static void *hap_scratch_spill(hap_scratch_arena_t *arena, size_t size)
+{
+	hap_scratch_spill_t *spill = hap_platform_memory_malloc(sizeof(hap_scratch_spill_t) + size);
+	if (!spill)
+		return NULL;
+	spill->next = arena->spills;
+	arena->spills = spill;
+	return spill->data;
+}
+
+void *hap_scratch_alloc(size_t size)
+{
+	size = (size + HAP_SCRATCH_ALIGN - 1) & ~(size_t)(HAP_SCRATCH_ALIGN - 1);
+	hap_scratch_arena_t *arena = hap_scratch_get(true);
+	if (!arena) {
+		/* More tasks than slots. Nothing would ever free this. */
+		ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "No scratch arena left for this task");
+		return NULL;
+	}
+	arena->demand += size;
+	if (!arena->base) {
+		arena->base = hap_platform_memory_malloc(arena->size);
+		if (!arena->base)
+			return hap_scratch_spill(arena, size);
+	}
+	if ((arena->size - arena->used) < size)
+		return hap_scratch_spill(arena, size);
+	void *ptr = arena->base + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void hap_scratch_reset(void)
+{
+	hap_scratch_arena_t *arena = hap_scratch_get(false);
+	if (!arena)
+		return;
+	if (arena->spills) {
+		while (arena->spills) {
+			hap_scratch_spill_t *next = arena->spills->next;
+			hap_platform_memory_free(arena->spills);
+			arena->spills = next;
+		}
+		/* Grow to what this round needed, the next allocation picks it up */
+		if (arena->demand > arena->size) {
+			ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "Growing scratch arena from %d to %d bytes",
+					(int)arena->size, (int)arena->demand);
+			if (arena->base)
+				hap_platform_memory_free(arena->base);
+			arena->base = NULL;
+			arena->size = arena->demand;
+		}
+	}
+	arena->used = 0;
+	arena->demand = 0;
+}
+
+void hap_scratch_deinit(void)
+{
+	int i;
+	for (i = 0; i < HAP_SCRATCH_MAX_TASKS; i++) {
+		hap_scratch_arena_t *arena = &hap_scratch_arenas[i];
+		while (arena->spills) {
+			hap_scratch_spill_t *next = arena->spills->next;
+			hap_platform_memory_free(arena->spills);
+			arena->spills = next;
+		}
+		if (arena->base)
+			hap_platform_memory_free(arena->base);
+		arena->base = NULL;
+		arena->owner = NULL;
+		arena->size = arena->used = arena->demand = 0;
+	}
+}
@@ -26,6 +26,7 @@
 #include <esp_err.h>
 #include <esp_log.h>
 #include <hap.h>
+#include <esp_hap_database.h>
 
 #include <base36.h>
 
@@ -33,6 +34,7 @@ static const char *TAG = "esp_hap_setup_payload";
 
 #define SETUP_CODE_MASK     0x0000000007ffffff
 #define HAP_OVER_IP_MASK    0x0000000010000000
+#define HAP_OVER_BLE_MASK   0x0000000020000000
 #define WAC_MASK            0x0000000040000000
 #define SETUP_PAYLOAD_PREFIX              "X-HM://00"
 
@@ -69,7 +71,14 @@ char *esp_hap_get_setup_payload(char *setup_code, char *setup_id, bool wac_suppo
 
     payload |= code;
     payload |= category;
-    payload |= HAP_OVER_IP_MASK;
+    /* Before hap_init(), the transport is not known yet. Assume IP, as before */
+    if ((hap_priv.transport & (HAP_TRANSPORT_WIFI | HAP_TRANSPORT_ETHERNET | HAP_TRANSPORT_THREAD)) ||
+            (hap_priv.transport == HAP_TRANSPORT_UNKNOWN)) {
+        payload |= HAP_OVER_IP_MASK;
+    }
+    if (hap_priv.transport & HAP_TRANSPORT_BLE) {
+        payload |= HAP_OVER_BLE_MASK;
+    }
     if (wac_support) {
         payload |= WAC_MASK;
     }
@@ -0,0 +1,268 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/* HAP over IP on a Thread network.
+ *
+ * Thread gives the accessory routable IPv6 addresses on the mesh, and the HAP
+ * HTTP server already listens on every IPv6 address, so pairing and sessions
+ * run the same code as over Wi-Fi. What differs is discovery: Thread does not
+ * forward mDNS multicast, so the _hap._tcp service is registered with the SRP
+ * (Service Registration Protocol) server of a Border Router instead, which
+ * advertises it over mDNS on the home network for the accessory. Controllers
+ * then reach the accessory through the Border Router like any IP accessory.
+ *
+ * This is not the CoAP based HAP-over-Thread transport of the later
+ * specifications, which the core does not implement.
+ *
+ * The SRP client keeps pointers to the service, its name and its TXT records
+ * until the service is removed, so they all live in static storage here. Every
+ * change clears the service from the client and adds it back, which sends one
+ * update to the server. All OpenThread calls are made with the OpenThread lock
+ * held, as the stack runs in its own task.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <sdkconfig.h>
+
+#ifdef CONFIG_HAP_THREAD_ENABLE
+
+#include <freertos/FreeRTOS.h>
+#include <esp_openthread.h>
+#include <esp_openthread_lock.h>
+#include <openthread/dataset.h>
+#include <openthread/instance.h>
+#include <openthread/ip6.h>
+#include <openthread/link.h>
+#include <openthread/srp_client.h>
+#include <openthread/thread.h>
+
+#include <hap.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_mdns.h>
+#include <esp_hap_thread.h>
+
+/* "_hap._tcp" */
+#define HAP_THREAD_SERV_TYPE_LEN    24
+/* One DNS label */
+#define HAP_THREAD_INSTANCE_LEN     64
+/* "hap-" and the extended address in hex */
+#define HAP_THREAD_HOST_NAME_LEN    24
+
+static otSrpClientService hap_srp_service;
+/* The service is in the client's list. Stays set while it is being removed */
+static bool hap_srp_service_listed;
+/* The service is meant to be registered */
+static bool hap_srp_service_active;
+static char hap_srp_host_name[HAP_THREAD_HOST_NAME_LEN];
+static char hap_srp_service_type[HAP_THREAD_SERV_TYPE_LEN];
+static char hap_srp_instance_name[HAP_THREAD_INSTANCE_LEN];
+static uint16_t hap_srp_port;
+static otDnsTxtEntry hap_srp_txt[HAP_MDNS_MAX_TXT];
+static char hap_srp_txt_keys[HAP_MDNS_MAX_TXT][HAP_MDNS_TXT_KEY_LEN];
+static char hap_srp_txt_values[HAP_MDNS_MAX_TXT][HAP_MDNS_TXT_VAL_LEN];
+static size_t hap_srp_num_txt;
+
+static void hap_thread_lock(void)
+{
+    esp_openthread_lock_acquire(portMAX_DELAY);
+}
+
+static void hap_thread_unlock(void)
+{
+    esp_openthread_lock_release();
+}
+
+/* Copies the TXT records into the static storage. Called with the lock held */
+static int hap_thread_txt_copy(mdns_txt_item_t *txt_records, size_t num_txt)
+{
+    size_t i;
+    if (num_txt > HAP_MDNS_MAX_TXT) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "Too many TXT records for SRP: %u", (unsigned)num_txt);
+        return HAP_FAIL;
+    }
+    for (i = 0; i < num_txt; i++) {
+        size_t key_len = strlen(txt_records[i].key);
+        size_t value_len = strlen(txt_records[i].value);
+        if ((key_len >= HAP_MDNS_TXT_KEY_LEN) || (value_len >= HAP_MDNS_TXT_VAL_LEN)) {
+            ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "TXT record %s too long for SRP", txt_records[i].key);
+            return HAP_FAIL;
+        }
+    }
+    for (i = 0; i < num_txt; i++) {
+        strcpy(hap_srp_txt_keys[i], txt_records[i].key);
+        strcpy(hap_srp_txt_values[i], txt_records[i].value);
+        hap_srp_txt[i].mKey = hap_srp_txt_keys[i];
+        hap_srp_txt[i].mValue = (const uint8_t *)hap_srp_txt_values[i];
+        hap_srp_txt[i].mValueLength = strlen(hap_srp_txt_values[i]);
+    }
+    hap_srp_num_txt = num_txt;
+    return HAP_SUCCESS;
+}
+
+/* (Re)adds the service to the SRP client. Called with the lock held */
+static int hap_thread_serv_register(void)
+{
+    otInstance *instance = esp_openthread_get_instance();
+    if (hap_srp_service_listed) {
+        otSrpClientClearService(instance, &hap_srp_service);
+        hap_srp_service_listed = false;
+    }
+    memset(&hap_srp_service, 0, sizeof(hap_srp_service));
+    hap_srp_service.mName = hap_srp_service_type;
+    hap_srp_service.mInstanceName = hap_srp_instance_name;
+    hap_srp_service.mTxtEntries = hap_srp_txt;
+    hap_srp_service.mNumTxtEntries = hap_srp_num_txt;
+    hap_srp_service.mPort = hap_srp_port;
+    otError err = otSrpClientAddService(instance, &hap_srp_service);
+    if (err != OT_ERROR_NONE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP service registration failed: %d", err);
+        return HAP_FAIL;
+    }
+    hap_srp_service_listed = true;
+    return HAP_SUCCESS;
+}
+
+int hap_thread_serv_start(const char *name, const char *type, const char *protocol,
+        int port, mdns_txt_item_t *txt_records, size_t num_txt)
+{
+    if ((strlen(name) >= sizeof(hap_srp_instance_name)) ||
+            (snprintf(hap_srp_service_type, sizeof(hap_srp_service_type), "%s.%s", type, protocol)
+             >= (int)sizeof(hap_srp_service_type))) {
+        return HAP_FAIL;
+    }
+    int ret;
+    hap_thread_lock();
+    strcpy(hap_srp_instance_name, name);
+    hap_srp_port = port;
+    ret = hap_thread_txt_copy(txt_records, num_txt);
+    if (ret == HAP_SUCCESS) {
+        ret = hap_thread_serv_register();
+    }
+    hap_srp_service_active = (ret == HAP_SUCCESS);
+    hap_thread_unlock();
+    return ret;
+}
+
+int hap_thread_serv_update_txt(mdns_txt_item_t *txt_records, size_t num_txt)
+{
+    int ret = HAP_FAIL;
+    hap_thread_lock();
+    if (hap_srp_service_active) {
+        ret = hap_thread_txt_copy(txt_records, num_txt);
+        if (ret == HAP_SUCCESS) {
+            ret = hap_thread_serv_register();
+        }
+    }
+    hap_thread_unlock();
+    return ret;
+}
+
+int hap_thread_serv_name_change(const char *instance_name)
+{
+    if (strlen(instance_name) >= sizeof(hap_srp_instance_name)) {
+        return HAP_FAIL;
+    }
+    int ret = HAP_FAIL;
+    hap_thread_lock();
+    if (hap_srp_service_active) {
+        strcpy(hap_srp_instance_name, instance_name);
+        ret = hap_thread_serv_register();
+    }
+    hap_thread_unlock();
+    return ret;
+}
+
+int hap_thread_serv_stop(void)
+{
+    int ret = HAP_SUCCESS;
+    hap_thread_lock();
+    if (hap_srp_service_active) {
+        /* Tells the server, unlike clearing. The service stays listed until it's done */
+        if (otSrpClientRemoveService(esp_openthread_get_instance(), &hap_srp_service) != OT_ERROR_NONE) {
+            ret = HAP_FAIL;
+        }
+        hap_srp_service_active = false;
+    }
+    hap_thread_unlock();
+    return ret;
+}
+
+int hap_thread_srp_init(void)
+{
+    hap_thread_lock();
+    otInstance *instance = esp_openthread_get_instance();
+    const otExtAddress *ext_addr = otLinkGetExtendedAddress(instance);
+    /* Unique on the Border Router, which advertises it as <host>.local */
+    snprintf(hap_srp_host_name, sizeof(hap_srp_host_name), "hap-%02x%02x%02x%02x%02x%02x%02x%02x",
+            ext_addr->m8[0], ext_addr->m8[1], ext_addr->m8[2], ext_addr->m8[3],
+            ext_addr->m8[4], ext_addr->m8[5], ext_addr->m8[6], ext_addr->m8[7]);
+    otError err = otSrpClientSetHostName(instance, hap_srp_host_name);
+    if (err == OT_ERROR_NONE) {
+        /* Registers the mesh-local and off-mesh addresses, and keeps them up to date */
+        err = otSrpClientEnableAutoHostAddress(instance);
+    }
+    if (err == OT_ERROR_NONE) {
+        /* Starts once attached, with the server found in the Network Data */
+        otSrpClientEnableAutoStartMode(instance, NULL, NULL);
+    }
+    hap_thread_unlock();
+    if (err != OT_ERROR_NONE) {
+        ESP_MFI_DEBUG(ESP_MFI_DEBUG_ERR, "SRP client setup failed: %d", err);
+        return HAP_FAIL;
+    }
+    ESP_MFI_DEBUG(ESP_MFI_DEBUG_INFO, "SRP client initialised as %s", hap_srp_host_name);
+    return HAP_SUCCESS;
+}
+
+int hap_thread_srp_deinit(void)
+{
+    hap_thread_lock();
+    otInstance *instance = esp_openthread_get_instance();
+    otSrpClientDisableAutoStartMode(instance);
+    otSrpClientRemoveHostAndServices(instance, false, true);
+    hap_srp_service_active = false;
+    hap_thread_unlock();
+    return HAP_SUCCESS;
+}
+
+bool hap_thread_is_provisioned(void)
+{
+    hap_thread_lock();
+    bool provisioned = otDatasetIsCommissioned(esp_openthread_get_instance());
+    hap_thread_unlock();
+    return provisioned;
+}
+
+void hap_thread_erase_network_info(void)
+{
+    hap_thread_lock();
+    otInstance *instance = esp_openthread_get_instance();
+    otThreadSetEnabled(instance, false);
+    otIp6SetEnabled(instance, false);
+    otInstanceErasePersistentInfo(instance);
+    hap_thread_unlock();
+}
+
+#endif /* CONFIG_HAP_THREAD_ENABLE */
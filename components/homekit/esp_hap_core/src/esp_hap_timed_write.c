@@ -0,0 +1,183 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+#include <esp_mfi_debug.h>
+#include <esp_hap_main.h>
+#include <esp_hap_database.h>
+#include <esp_hap_timed_write.h>
+
+typedef struct {
+	uint64_t pid;
+	int64_t deadline_us;
+	hap_tw_state_t state;
+} hap_tw_t;
+
+/* Indexed by session index. Written from the HTTP task and the expiry timer */
+static hap_tw_t hap_tw[HAP_MAX_SESSIONS_LIMIT];
+static hap_tw_stats_t hap_tw_stats;
+static portMUX_TYPE hap_tw_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t hap_tw_timer;
+
+#define hap_tw_index_valid(index)	(((index) >= 0) && ((index) < HAP_MAX_SESSIONS_LIMIT))
+
+/* Expires whatever is due and returns the next deadline, or 0 if nothing is armed.
+ * Must be called with the lock held.
+ */
+static int64_t hap_tw_expire(int64_t now_us)
+{
+	int64_t next_us = 0;
+	int i;
+	for (i = 0; i < HAP_MAX_SESSIONS_LIMIT; i++) {
+		if (hap_tw[i].state != HAP_TW_ARMED)
+			continue;
+		if (hap_tw[i].deadline_us <= now_us) {
+			hap_tw[i].state = HAP_TW_EXPIRED;
+			hap_tw_stats.pending--;
+			hap_tw_stats.expired++;
+		} else if (!next_us || (hap_tw[i].deadline_us < next_us)) {
+			next_us = hap_tw[i].deadline_us;
+		}
+	}
+	return next_us;
+}
+
+static void hap_tw_schedule(int64_t next_us)
+{
+	esp_timer_stop(hap_tw_timer);
+	if (next_us) {
+		int64_t delay_us = next_us - esp_timer_get_time();
+		esp_timer_start_once(hap_tw_timer, delay_us > 0 ? delay_us : 1);
+	}
+}
+
+static void hap_tw_timer_cb(void *arg)
+{
+	portENTER_CRITICAL(&hap_tw_lock);
+	int64_t next_us = hap_tw_expire(esp_timer_get_time());
+	portEXIT_CRITICAL(&hap_tw_lock);
+	hap_tw_schedule(next_us);
+}
+
+int hap_tw_init(void)
+{
+	if (hap_tw_timer)
+		return HAP_SUCCESS;
+	esp_timer_create_args_t timer_args = {
+		.callback = hap_tw_timer_cb,
+		.dispatch_method = ESP_TIMER_TASK,
+		.name = "hap_tw",
+	};
+	if (esp_timer_create(&timer_args, &hap_tw_timer) != ESP_OK)
+		return HAP_FAIL;
+	return HAP_SUCCESS;
+}
+
+void hap_tw_deinit(void)
+{
+	if (hap_tw_timer) {
+		esp_timer_stop(hap_tw_timer);
+		esp_timer_delete(hap_tw_timer);
+		hap_tw_timer = NULL;
+	}
+	portENTER_CRITICAL(&hap_tw_lock);
+	memset(hap_tw, 0, sizeof(hap_tw));
+	hap_tw_stats.pending = 0;
+	portEXIT_CRITICAL(&hap_tw_lock);
+}
+
+int hap_tw_arm(int index, uint64_t pid, int64_t ttl)
+{
+	if (!hap_tw_timer || !hap_tw_index_valid(index) || (ttl <= 0) || (ttl > INT64_MAX / 1000)) {
+		portENTER_CRITICAL(&hap_tw_lock);
+		hap_tw_stats.rejected++;
+		portEXIT_CRITICAL(&hap_tw_lock);
+		return HAP_FAIL;
+	}
+	int64_t now_us = esp_timer_get_time();
+	portENTER_CRITICAL(&hap_tw_lock);
+	/* A new prepare replaces the previous one */
+	if (hap_tw[index].state != HAP_TW_ARMED)
+		hap_tw_stats.pending++;
+	hap_tw[index].pid = pid;
+	hap_tw[index].deadline_us = now_us + ttl * 1000;
+	hap_tw[index].state = HAP_TW_ARMED;
+	hap_tw_stats.armed++;
+	int64_t next_us = hap_tw_expire(now_us);
+	portEXIT_CRITICAL(&hap_tw_lock);
+	hap_tw_schedule(next_us);
+	return HAP_SUCCESS;
+}
+
+hap_tw_state_t hap_tw_take(int index, uint64_t *pid, int64_t *deadline_us)
+{
+	if (!hap_tw_index_valid(index))
+		return HAP_TW_NONE;
+	portENTER_CRITICAL(&hap_tw_lock);
+	hap_tw_state_t state = hap_tw[index].state;
+	if (state == HAP_TW_ARMED) {
+		*pid = hap_tw[index].pid;
+		*deadline_us = hap_tw[index].deadline_us;
+		hap_tw_stats.pending--;
+	}
+	/* A prepare is valid only for the write immediately following it */
+	hap_tw[index].state = HAP_TW_NONE;
+	portEXIT_CRITICAL(&hap_tw_lock);
+	/* The timer may now be early, which is harmless, as it reschedules itself */
+	return state;
+}
+
+bool hap_tw_check(hap_tw_state_t state, uint64_t prepared_pid, int64_t deadline_us, uint64_t pid)
+{
+	bool valid = (state == HAP_TW_ARMED) && (pid == prepared_pid) &&
+		(esp_timer_get_time() <= deadline_us);
+	portENTER_CRITICAL(&hap_tw_lock);
+	if (valid)
+		hap_tw_stats.completed++;
+	else
+		hap_tw_stats.rejected++;
+	portEXIT_CRITICAL(&hap_tw_lock);
+	return valid;
+}
+
+void hap_tw_cancel(int index)
+{
+	if (!hap_tw_index_valid(index))
+		return;
+	portENTER_CRITICAL(&hap_tw_lock);
+	if (hap_tw[index].state == HAP_TW_ARMED)
+		hap_tw_stats.pending--;
+	hap_tw[index].state = HAP_TW_NONE;
+	portEXIT_CRITICAL(&hap_tw_lock);
+}
+
+void hap_tw_get_stats(hap_tw_stats_t *stats)
+{
+	portENTER_CRITICAL(&hap_tw_lock);
+	*stats = hap_tw_stats;
+	portEXIT_CRITICAL(&hap_tw_lock);
+}
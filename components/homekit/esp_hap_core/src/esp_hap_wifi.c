@@ -26,6 +26,7 @@
 #include <string.h>
 #include <esp_wifi.h>
 #include <esp_hap_database.h>
+#include <esp_hap_thread.h>
 
 esp_err_t hap_wifi_is_provisioned(bool *provisioned)
 {
@@ -52,6 +53,11 @@ bool hap_is_network_configured(void)
     if (hap_priv.transport == HAP_TRANSPORT_ETHERNET) {
         return true;
     }
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        return hap_thread_is_provisioned();
+    }
+#endif
 
     bool provisioned = false;
     hap_wifi_is_provisioned(&provisioned);
@@ -60,6 +66,12 @@ bool hap_is_network_configured(void)
 
 void hap_erase_network_info(void)
 {
+#ifdef CONFIG_HAP_THREAD_ENABLE
+    if (hap_priv.transport & HAP_TRANSPORT_THREAD) {
+        hap_thread_erase_network_info();
+        return;
+    }
+#endif
     esp_wifi_restore();
 }
 
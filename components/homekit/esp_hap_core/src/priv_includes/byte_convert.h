@@ -17,11 +17,16 @@
  *
  * This module offers APIs to convert 16bit, 32bit and 64 bit unsigned integers
  * into Little/Big Endian byte streams
+ *
+ * The Little Endian helpers are inline, since they sit on the per frame encryption
+ * path. On a Little Endian target they reduce to a memcpy(), which the compiler
+ * turns into plain (unaligned safe) word accesses.
  */
 #ifndef _BYTE_CONVERT_H
 #define _BYTE_CONVERT_H
 
 #include <stdint.h>
+#include <string.h>
 
 /** Little Endian to uint16 Conversion
  * Get a uint16 integer from a little Endian byte stream
@@ -30,7 +35,20 @@
  *
  * \return The converted uint16 integer
  */
-uint16_t get_u16_le(const void *val_ptr);
+static inline uint16_t get_u16_le(const void *val_ptr)
+{
+	uint16_t val;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&val, val_ptr, sizeof(val));
+#else
+	const uint8_t *p = (const uint8_t *)val_ptr;
+	int i;
+	val = 0;
+	for (i = sizeof(val) - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+#endif
+	return val;
+}
 
 /** Little Endian to uint32 Conversion
  * Get a uint32 integer from a little Endian byte stream
@@ -39,16 +57,42 @@ uint16_t get_u16_le(const void *val_ptr);
  *
  * \return The converted uint32 integer
  */
-uint32_t get_u32_le(const void *val_ptr);
+static inline uint32_t get_u32_le(const void *val_ptr)
+{
+	uint32_t val;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&val, val_ptr, sizeof(val));
+#else
+	const uint8_t *p = (const uint8_t *)val_ptr;
+	int i;
+	val = 0;
+	for (i = sizeof(val) - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+#endif
+	return val;
+}
 
 /** Little Endian to uint64 Conversion
  * Get a uint64 integer from a little Endian byte stream
  *
  * \param[in] val_ptr Pointer to the 8 byte stream
  *
- * \return The converted uint32 integer
+ * \return The converted uint64 integer
  */
-uint64_t get_u64_le(const void *val_ptr);
+static inline uint64_t get_u64_le(const void *val_ptr)
+{
+	uint64_t val;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&val, val_ptr, sizeof(val));
+#else
+	const uint8_t *p = (const uint8_t *)val_ptr;
+	int i;
+	val = 0;
+	for (i = sizeof(val) - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+#endif
+	return val;
+}
 
 /** Big Endian to uint16 Conversion
  * Get a uint16 integer from a Big Endian byte stream
@@ -85,7 +129,17 @@ uint64_t get_u64_be(const void *val_ptr);
  *
  * \param[in] The uint16 integer
  */
-void put_u16_le(void *val_ptr, const uint16_t val);
+static inline void put_u16_le(void *val_ptr, const uint16_t val)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(val_ptr, &val, sizeof(val));
+#else
+	uint8_t *p = (uint8_t *)val_ptr;
+	unsigned int i;
+	for (i = 0; i < sizeof(val); i++)
+		p[i] = (uint8_t)(val >> (8 * i));
+#endif
+}
 
 /** Uint32 to Little Endian Conversion
  *
@@ -95,7 +149,17 @@ void put_u16_le(void *val_ptr, const uint16_t val);
  *
  * \param[in] The uint32 integer
  */
-void put_u32_le(void *val_ptr, const uint32_t val);
+static inline void put_u32_le(void *val_ptr, const uint32_t val)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(val_ptr, &val, sizeof(val));
+#else
+	uint8_t *p = (uint8_t *)val_ptr;
+	unsigned int i;
+	for (i = 0; i < sizeof(val); i++)
+		p[i] = (uint8_t)(val >> (8 * i));
+#endif
+}
 
 /** Uint64 to Little Endian Conversion
  *
@@ -105,7 +169,17 @@ void put_u32_le(void *val_ptr, const uint32_t val);
  *
  * \param[in] The uint64 integer
  */
-void put_u64_le(void *val_ptr, const uint64_t val);
+static inline void put_u64_le(void *val_ptr, const uint64_t val)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(val_ptr, &val, sizeof(val));
+#else
+	uint8_t *p = (uint8_t *)val_ptr;
+	unsigned int i;
+	for (i = 0; i < sizeof(val); i++)
+		p[i] = (uint8_t)(val >> (8 * i));
+#endif
+}
 
 /** Uint16 to Big Endian Conversion
  *
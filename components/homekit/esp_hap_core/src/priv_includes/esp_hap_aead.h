@@ -0,0 +1,68 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _HAP_AEAD_H_
+#define _HAP_AEAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define HAP_AEAD_KEY_LEN    32
+#define HAP_AEAD_NONCE_LEN  12
+#define HAP_AEAD_TAG_LEN    16
+
+/* ChaCha20-Poly1305 (IETF, RFC 8439) for the session traffic.
+ *
+ * Same arguments and results as libsodium's
+ * crypto_aead_chacha20poly1305_ietf_{en,de}crypt_detached(), and in place
+ * operation is allowed. Decryption returns -1 without touching the output if
+ * the tag does not match.
+ *
+ * On targets with an optimised kernel, hap_aead_init() checks it against
+ * known answers and libsodium first, and the kernel is used only if it
+ * agrees. Everything goes to libsodium otherwise.
+ */
+int hap_aead_encrypt_detached(uint8_t *c, uint8_t *mac, const uint8_t *m, size_t mlen,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k);
+int hap_aead_decrypt_detached(uint8_t *m, const uint8_t *c, size_t clen, const uint8_t *mac,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k);
+void hap_aead_init(void);
+
+#ifdef CONFIG_HAP_AEAD_KERNEL
+/* The optimised kernel, in esp_hap_aead_kernel.c */
+int hap_aead_kernel_encrypt_detached(uint8_t *c, uint8_t *mac, const uint8_t *m, size_t mlen,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k);
+int hap_aead_kernel_decrypt_detached(uint8_t *m, const uint8_t *c, size_t clen, const uint8_t *mac,
+        const uint8_t *ad, size_t adlen, const uint8_t *npub, const uint8_t *k);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_AEAD_H_ */
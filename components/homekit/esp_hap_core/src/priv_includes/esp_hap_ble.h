@@ -0,0 +1,73 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_BLE_H_
+#define _HAP_BLE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <hap.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* Sessions remember the connection they run on in conn_identifier. For HAP over
+ * IP, that is the socket. HAP-BLE connections get their GAP connection handle
+ * offset by this, which no socket number ever reaches.
+ */
+#define HAP_BLE_CONN_ID_BASE    0x10000
+
+static inline bool hap_conn_is_ble(int conn_identifier)
+{
+    return conn_identifier >= HAP_BLE_CONN_ID_BASE;
+}
+
+#ifdef CONFIG_HAP_BLE_ENABLE
+int hap_ble_start(void);
+void hap_ble_stop(void);
+/* Drains the pending notification list. Only for BLE-only accessories, since
+ * otherwise the IP notification pass drains it and hands it over
+ */
+void hap_ble_send_notif(void);
+/* Indicates the changed characteristics to a connected controller, or bumps
+ * the GSN in the advertisement if none is connected
+ */
+void hap_ble_notify_chars(hap_char_t **chars, int cnt);
+void hap_ble_conn_close(int conn_identifier);
+/* Restarts advertising with the current pairing status, config number and GSN */
+void hap_ble_adv_refresh(void);
+#else
+static inline int hap_ble_start(void) { return HAP_SUCCESS; }
+static inline void hap_ble_stop(void) { }
+static inline void hap_ble_send_notif(void) { }
+static inline void hap_ble_notify_chars(hap_char_t **chars, int cnt) { }
+static inline void hap_ble_conn_close(int conn_identifier) { }
+static inline void hap_ble_adv_refresh(void) { }
+#endif /* CONFIG_HAP_BLE_ENABLE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_BLE_H_ */
@@ -35,60 +35,90 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-#define HAP_CHAR_MIN_FLAG		(1 << 0)
-#define HAP_CHAR_MAX_FLAG		(1 << 1)
-#define HAP_CHAR_STEP_FLAG		(1 << 2)
-#define HAP_CHAR_MAXLEN_FLAG		(1 << 3)
-#define HAP_CHAR_MAXDATALEN_FLAG	(1 << 4)
+/* Flags for __hap_char_t.desc_flags */
+#define HAP_CHAR_DESC_OWNED		(1 << 0) /* desc is a private copy, on the heap */
+#define HAP_CHAR_VALID_VALS_OWNED	(1 << 1) /* desc->valid_vals is on the heap */
+#define HAP_CHAR_STR_STATIC		(1 << 2) /* val.s points at a string the characteristic does not own */
+
+struct __hap_char;
+
+/* Notification rate state of a characteristic, allocated when a policy is set */
+typedef struct {
+    hap_char_notif_policy_t policy;
+    int64_t last_notif_us;  /* When the last notification was queued, 0 if never */
+    hap_val_t last_val;     /* Value at that time, for the deadband */
+} hap_char_notif_rate_t;
+
+/* Checks a value against the constraints of a characteristic */
+typedef int (*hap_char_validator_t)(struct __hap_char *_hc, hap_val_t *val);
 
 /**
  * @brief characteristics object information
  */
-typedef struct  {
+typedef struct __hap_char {
     uint32_t iid;        /* Characteristic instance ID */
-    const char *type_uuid;       /* Apple's characteristic UUID */
-    uint16_t permission; /* Characteristic permission */
-    hap_char_format_t      format;   /* data type of the value */
+    /* UUID, format, permissions and constraints. Either shared (e.g. a const table of the
+     * Apple profiles) or, with HAP_CHAR_DESC_OWNED, a private copy
+     */
+    const hap_char_desc_t *desc;
+    uint16_t type_id;    /* Short form of desc->type_uuid, HAP_UUID_FULL for custom ones */
+    uint8_t desc_flags;
     hap_val_t       val;
+    uint16_t str_cap;    /* Length of the longest string val.s can hold in place, 0 if not owned */
+    uint32_t data_crc;   /* CRC32 of the val.d contents last stored, for data and TLV8 formats */
     bool ev;         /* check if characteristics supports event */
-    char *description;      /* characteristics's description */
-    char *unit;
 
     /* Characteristics's father subsystem */
     hap_serv_t                *parent;
 
-    uint8_t constraint_flags;
-
-    hap_val_t       max;       /* maximum value, maxlen, max data len*/
-    hap_val_t       min;       /* minimum value */
-    hap_val_t       step;      /* step value */
+    /* Picked based on the format and constraints, NULL if there is nothing to check */
+    hap_char_validator_t validate;
+    uint32_t        step_mask;  /* step - 1, if an integer step is a power of 2 */
+    float           step_inv;   /* 1 / step, for float steps */
+    bool            quantize;   /* Float values snap to the step rather than failing validation */
+    float           quant_hyst; /* Quantization hysteresis, in steps */
 
     hap_char_t *next_char;
     /* Bitmap to indicate which controllers have enabled notifications
      */
-	uint16_t ev_ctrls;
+	uint32_t ev_ctrls;
 
     /* Bitmap indicating the last controller that modified the value.
      * No notification should be sent to the owner
      */
-    uint16_t owner_ctrl;
+    uint32_t owner_ctrl;
 
-    /* Pointer to a valid values range. It will be a 2 byte array, if set from application */
-    uint8_t *valid_vals_range;
-    /* Since a list of valid values can have any length, using a pointer here,
-     * which will be allocated if valid values are set for a characteristic
-     */
-    uint8_t *valid_vals;
-    size_t valid_vals_cnt;
     bool update_called;
+
+    /* Set while the characteristic waits in the pending notification list */
+    bool notif_pending;
+    hap_char_t *next_pending;
+
+    /* NULL unless a notification rate policy was set */
+    hap_char_notif_rate_t *rate;
+
+    /* Each controller write holds back notifications until this time, so that
+     * writes from several controllers in quick succession end in a single
+     * notification of the final value
+     */
+    int64_t merge_until;
+
+    /* Set while a change is held back, until held_until, by the rate policy or a write */
+    bool held;
+    int64_t held_until;
+    hap_char_t *next_held;
 } __hap_char_t;
 
 void hap_char_manage_notification(hap_char_t *hc, int index, bool ev);
 bool hap_char_is_ctrl_subscribed(hap_char_t *hc, int index);
 void hap_char_set_owner_ctrl(hap_char_t *hc, int index);
+void hap_char_note_write(hap_char_t *hc, int index);
 bool hap_char_is_ctrl_owner(hap_char_t *hc, int index);
 void hap_disable_all_char_notif(int index);
+int hap_char_get_subs_cnt(int index);
+int hap_char_set_str(__hap_char_t *_hc, const char *s, bool is_static);
 int hap_char_check_val_constraints(__hap_char_t *_hc, hap_val_t *val);
+void hap_char_quantize_val(__hap_char_t *_hc, hap_val_t *val);
 int hap_event_queue_init();
 int hap_event_queue_deinit();
 hap_char_t * hap_get_pending_notif_char();
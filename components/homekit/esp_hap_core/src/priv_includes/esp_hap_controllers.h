@@ -47,15 +47,24 @@ typedef struct {
 	bool valid;
     /* Index is used just for better managing the keystore data */
     uint8_t index;
+    /* Hash of info.id, so that lookups can skip most string compares */
+    uint32_t id_hash;
 } hap_ctrl_data_t;
 
-int hap_controllers_init();
+int hap_controllers_init(const hap_ctrl_info_t *snapshot, uint32_t valid_map);
 bool is_accessory_paired();
 bool is_admin_paired();
 hap_ctrl_data_t *hap_controller_get_empty_loc();
 int hap_controller_save(hap_ctrl_data_t *ctrl_data);
 void hap_controller_remove(hap_ctrl_data_t *ctrl_data);
+void hap_controller_remove_all();
 hap_ctrl_data_t *hap_get_controller(char *ctrl_id);
 void hap_erase_controller_info();
+/* Precomputes the parts of the accessory's Ed25519 signing key that do not
+ * depend on the message (CONFIG_HAP_ED25519_PRECOMPUTE), once the key is known,
+ * and wipes them when the key goes away.
+ */
+void hap_acc_sign_key_init(void);
+void hap_acc_sign_key_wipe(void);
 
 #endif /* _HAP_CONTROLLERS_H_ */
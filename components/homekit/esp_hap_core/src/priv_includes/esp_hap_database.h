@@ -36,7 +36,12 @@
 #define HAP_KEYSTORE_NAMESPACE_HAPMAIN  "hap_main"
 #define HAP_FACTORY_NAMESPACE_HAP_SETUP "hap_setup"
 
+/* Default for hap_cfg_t.max_sessions */
 #define HAP_MAX_SESSIONS	8
+/* Upper limit for hap_cfg_t.max_sessions, set by the width of the
+ * ev_ctrls and owner_ctrl bitmaps of the characteristics
+ */
+#define HAP_MAX_SESSIONS_LIMIT	32
 #define SETUP_ID_LEN        4
 #define SETUP_HASH_LEN      4
 
@@ -58,7 +63,7 @@ typedef struct {
 	uint8_t ltpka[ED_KEY_LEN];
 	hap_cid_t cid;
 	hap_ctrl_data_t controllers[HAP_MAX_CONTROLLERS];
-	hap_secure_session_t *sessions[HAP_MAX_SESSIONS];
+	hap_secure_session_t **sessions; /* hap_priv.cfg.max_sessions entries */
 	uint8_t pair_attempts;
     hap_mdns_handle_t wac_mdns_handle;
     hap_mdns_handle_t hap_mdns_handle;
@@ -92,4 +97,7 @@ int hap_acc_setup_init();
 void hap_erase_accessory_info();
 void hap_increment_and_save_config_num();
 void hap_increment_and_save_state_num();
+void hap_db_snapshot_save();
+void hap_db_snapshot_invalidate();
+void hap_db_snapshot_disable();
 #endif /* _HAP_DATABASE_H_ */
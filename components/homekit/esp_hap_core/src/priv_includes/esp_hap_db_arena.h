@@ -0,0 +1,54 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _HAP_DB_ARENA_H_
+#define _HAP_DB_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* Allocators for the accessory database objects (accessories, services,
+ * characteristics and their strings).
+ *
+ * With CONFIG_HAP_DB_ARENA_ENABLE, everything created before hap_start() is
+ * carved out of a few large chunks, instead of one heap block per object.
+ * hap_start() seals the arena and later allocations go to the heap as usual.
+ * hap_db_free() is a no-op for arena memory, which is given back only when
+ * the whole database goes away, in hap_delete_all_accessories().
+ */
+void *hap_db_calloc(size_t count, size_t size);
+char *hap_db_strdup(const char *s);
+void hap_db_free(void *ptr);
+void hap_db_arena_seal(void);
+void hap_db_arena_free(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_DB_ARENA_H_ */
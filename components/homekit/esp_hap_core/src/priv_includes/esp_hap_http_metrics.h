@@ -0,0 +1,75 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_HTTP_METRICS_H_
+#define _HAP_HTTP_METRICS_H_
+
+#include <sdkconfig.h>
+#include <esp_http_server.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* HomeKit HTTP endpoints with their own request metrics */
+typedef enum {
+	HAP_HTTP_EP_PAIR_SETUP = 0,
+	HAP_HTTP_EP_PAIR_VERIFY,
+	HAP_HTTP_EP_PAIRINGS,
+	HAP_HTTP_EP_ACCESSORIES,
+	HAP_HTTP_EP_CHARACTERISTICS_GET,
+	HAP_HTTP_EP_CHARACTERISTICS_PUT,
+	HAP_HTTP_EP_IDENTIFY,
+	HAP_HTTP_EP_PREPARE,
+	HAP_HTTP_EP_MAX,
+} hap_http_ep_t;
+
+/* Per endpoint request counts, error counts, bytes in/out and latency histograms.
+ *
+ * With CONFIG_HAP_HTTP_METRICS_ENABLE, hap_http_metrics_wrap() routes an
+ * endpoint's handler through a wrapper which times it and counts its request.
+ * Everything is updated with relaxed atomics, so the HTTP task never blocks on
+ * a reader. The metrics are served on /debug/http and, optionally, logged
+ * periodically. /debug/http also has the timed write counts, pending included.
+ *
+ * Bytes in are request bodies. Bytes out are everything sent from within the
+ * handler, headers included, before encryption. Responses sent later, by the
+ * async pairing worker, are not included.
+ */
+#ifdef CONFIG_HAP_HTTP_METRICS_ENABLE
+void hap_http_metrics_wrap(struct httpd_uri *uri, hap_http_ep_t ep);
+void hap_http_metrics_add_bytes_out(int len);
+void hap_http_metrics_start(httpd_handle_t server);
+void hap_http_metrics_stop(httpd_handle_t server);
+#else
+#define hap_http_metrics_wrap(uri, ep)
+#define hap_http_metrics_add_bytes_out(len)
+#define hap_http_metrics_start(server)
+#define hap_http_metrics_stop(server)
+#endif /* CONFIG_HAP_HTTP_METRICS_ENABLE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_HTTP_METRICS_H_ */
@@ -32,6 +32,8 @@ int hap_httpd_stop();
 int hap_ip_services_start();
 int hap_ip_services_stop();
 int hap_mdns_announce(bool first);
+int hap_mdns_announce_flush(void);
 int hap_mdns_deannounce();
 void hap_http_send_notif();
+void hap_http_invalidate_acc_db();
 #endif /* _HAP_IP_SERVICES_H_ */
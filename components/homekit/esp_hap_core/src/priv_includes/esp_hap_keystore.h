@@ -24,9 +24,14 @@
 #ifndef _HAP_KEYSTORE_H_
 #define _HAP_KEYSTORE_H_
 #include <hap.h>
+#include <hap_platform_keystore.h>
 int hap_keystore_init();
 int hap_keystore_get(const char *name_space, const char *key, uint8_t *val, size_t *val_size);
+int hap_keystore_get_multi(const char *name_space, hap_platform_keystore_item_t *items, int count);
 int hap_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
+int hap_keystore_set_deferred(const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
+int hap_keystore_commit();
+void hap_keystore_flush();
 int hap_keystore_delete(const char *name_space, const char *key);
 int hap_keystore_delete_namespace(const char *name_space);
 int hap_factory_keystore_set(const char *name_space, const char *key, const uint8_t *val, const size_t val_len);
@@ -50,6 +50,8 @@ typedef enum {
     HAP_INTERNAL_EVENT_RESET_HOMEKIT_DATA,
     HAP_INTERNAL_EVENT_NETWORK_SWITCH,
     HAP_INTERNAL_EVENT_NETWORK_REVERT,
+    HAP_INTERNAL_EVENT_KEYSTORE_COMMIT,
+    HAP_INTERNAL_EVENT_MDNS_ANNOUNCE,
 } hap_internal_event_t;
 
 typedef struct {
@@ -27,9 +27,25 @@
 #include <mdns.h>
 #include <hap.h>
 
+#define HAP_MDNS_MAX_TXT        12
+#define HAP_MDNS_TXT_KEY_LEN    8
+#define HAP_MDNS_TXT_VAL_LEN    72
+
+/* Copy of a TXT record, as last pushed to the mDNS responder */
+typedef struct {
+    char key[HAP_MDNS_TXT_KEY_LEN];
+    char value[HAP_MDNS_TXT_VAL_LEN];
+} hap_mdns_txt_cache_t;
+
 typedef struct {
     char type[32];
     char proto[32];
+    /* TXT records last pushed. If "txt_cached" is false, the next update
+     * pushes all the records
+     */
+    hap_mdns_txt_cache_t txt[HAP_MDNS_MAX_TXT];
+    size_t num_txt;
+    bool txt_cached;
 } hap_mdns_handle_t;
 
 int hap_mdns_serv_start(hap_mdns_handle_t *handle, const char *name, const char *type,
@@ -24,8 +24,13 @@
 #ifndef _HAP_NETWORK_IO_H_
 #define _HAP_NETWORK_IO_H_
 #include <stdint.h>
+#include <sys/uio.h>
 #include <hap_platform_httpd.h>
 int hap_httpd_send(httpd_handle_t hd, int sockfd, const char *buf, unsigned buf_len, int flags);
+/* Sends several buffers as if they were one. On encrypted sessions, they get
+ * packed into as few HAP frames as possible and go out in a single send().
+ */
+int hap_httpd_sendv(httpd_handle_t hd, int sockfd, const struct iovec *iov, int iovcnt, int flags);
 int hap_httpd_recv(httpd_handle_t hd, int sockfd, char *buf, unsigned buf_len, int flags);
 
 #endif /* _HAP_NETWORK_IO_H_ */
@@ -49,6 +49,7 @@ typedef enum {
 	HAP_METHOD_ADD_PAIRING = 3,
 	HAP_METHOD_REMOVE_PAIRING = 4,
 	HAP_METHOD_LIST_PAIRINGS = 5,
+	HAP_METHOD_RESUME = 6,
 } hap_pairing_methods_t;
 
 
@@ -77,6 +78,7 @@ typedef enum {
 	kTLVType_Permissions = 0x0b,
 	kTLVType_FragmentedData = 0x0c,
 	kTLVType_FragmentLast = 0x0d,
+	kTLVType_SessionID = 0x0e,
     kTLVType_Flags = 0x13,
     kTLVType_OwnershipProofToken = 0x1A,
     kTLVType_ProductData = 0x1C,
@@ -89,26 +91,96 @@ typedef struct {
 	int curlen;
 } hap_tlv_data_t;
 
+/* Called by a TLV stream with every full buffer, and with the remainder on the final flush */
+typedef int (*hap_tlv_stream_flush_t)(const uint8_t *data, int len, void *priv);
+
+/* TLV8 writer for responses that need not fit in one buffer. Items are copied in
+ * byte by byte, and each time the buffer fills up it is handed to the flush callback
+ * and reused, so item boundaries do not line up with buffer boundaries. Without a
+ * buffer, it only counts the bytes, which is used for sizing the Content-Length.
+ */
+typedef struct {
+	uint8_t *buf;
+	int bufsize;
+	int curlen;
+	int total;
+	hap_tlv_stream_flush_t flush;
+	void *priv;
+} hap_tlv_stream_t;
+
+#define HAP_TLV_INDEX_MAX	12
+
+typedef struct {
+	uint8_t type;
+	uint16_t offset;	/* Offset of the value from the start of the indexed buffer */
+	uint16_t len;		/* Total length, after joining the fragments */
+} hap_tlv_item_t;
+
+/* Items of a received TLV8 buffer, indexed in a single pass by hap_tlv_index_build().
+ * Values are looked up with hap_tlv_get(), which returns pointers into the indexed
+ * buffer itself rather than copies.
+ */
+typedef struct {
+	uint8_t *buf;
+	int cnt;
+	hap_tlv_item_t items[HAP_TLV_INDEX_MAX];
+} hap_tlv_index_t;
+
+#define HAP_MAX_NW_FRAME_SIZE	1024 /* As per HAP Specifications */
+#define AUTH_TAG_LEN            16
+
+/* Decrypted frame that did not fit in the reader's buffer, possibly only partly
+ * consumed yet. Each session keeps its own, so frames from concurrent controllers
+ * never clobber each other. The data buffer is allocated the first time a frame
+ * does not fit, as a bulk buffer, and lives until the session is freed.
+ */
+typedef struct {
+	uint16_t pkt_size;
+	uint16_t bytes_read;
+	uint8_t *data;
+} hap_decrypt_frame_t;
+
+/* Verified session. Only what is needed after Pair Verify lives here. The handshake
+ * state (ephemeral keys, the shared secret) stays in the Pair Verify context, which is
+ * freed once the session is made.
+ * The fields used for every frame come first, each key right after its counter, so
+ * that the AEAD path reads one run of memory. "state" has to remain the first byte,
+ * as it is read from contexts that are not sessions yet.
+ */
 typedef struct {
 	uint8_t state;
+	/* Index in hap_priv.sessions[], or -1 if the session is not in there */
+	int8_t slot;
+	/* Tick count of the last request or notification, for evicting idle sessions */
+	uint32_t last_used;
+	/* Frame counters, serialised as the last NONCE_LEN bytes of the AEAD nonce */
+	uint64_t encrypt_nonce;
 	uint8_t encrypt_key[ENCRYPT_KEY_LEN];
+	uint64_t decrypt_nonce;
 	uint8_t decrypt_key[ENCRYPT_KEY_LEN];
-	uint8_t encrypt_nonce[NONCE_LEN];
-	uint8_t decrypt_nonce[NONCE_LEN];
+	/* Cold fields, used on connect, close and for frames that do not fit */
 	hap_ctrl_data_t *ctrl;
-    uint64_t pid;
-    int64_t ttl;
-    int64_t prepare_time;
 	/* TODO: As of now, this identifier will be the socket
 	 * number, since only http is supported.
 	 * Need to make this generic later.
 	 */
 	int conn_identifier;
+	hap_decrypt_frame_t decrypt_frame;
 } hap_secure_session_t;
 
 void hap_tlv_data_init(hap_tlv_data_t *tlv_data, uint8_t *buf, int buf_size);
 int get_value_from_tlv(uint8_t *buf, int buf_len, uint8_t type, void *val, int val_size);
 int get_tlv_length(uint8_t *buf, int buflen, uint8_t type);
 int add_tlv(hap_tlv_data_t *tlv_data, uint8_t type, int len, void *val);
+int hap_tlv_index_build(hap_tlv_index_t *idx, uint8_t *buf, int buflen);
+int hap_tlv_get(const hap_tlv_index_t *idx, uint8_t type, uint8_t **val);
+int hap_tlv_get_u8(const hap_tlv_index_t *idx, uint8_t type, uint8_t *val);
+uint8_t *hap_tlv_reserve(hap_tlv_data_t *tlv_data, int len);
+int hap_tlv_commit(hap_tlv_data_t *tlv_data, uint8_t type, int len);
+void hap_tlv_stream_init(hap_tlv_stream_t *stream, uint8_t *buf, int buf_size,
+		hap_tlv_stream_flush_t flush, void *priv);
+int hap_tlv_stream_write(hap_tlv_stream_t *stream, const void *data, int len);
+int hap_tlv_stream_add(hap_tlv_stream_t *stream, uint8_t type, int len, const void *val);
+int hap_tlv_stream_flush(hap_tlv_stream_t *stream);
 void hap_prepare_error_tlv(uint8_t state, uint8_t error, void *buf, int buf_size, int *out_len);
 #endif /* _HAP_PAIR_COMMON_H_ */
@@ -33,4 +33,11 @@ int hap_get_ctrl_session_index(hap_secure_session_t *session);
 int hap_close_session(hap_secure_session_t *session);
 void hap_close_sessions_of_ctrl(hap_ctrl_data_t *ctrl);
 void hap_close_all_sessions();
+int hap_sessions_init(void);
+void hap_session_touch(hap_secure_session_t *session);
+void hap_conn_trigger_close(int conn_identifier);
+int hap_curve_key_pool_start(void);
+void hap_curve_key_pool_stop(void);
+void hap_pair_resume_persist(void);
+void hap_pair_resume_restore(void);
 #endif /* _HAP_PAIR_VERIFY_H_ */
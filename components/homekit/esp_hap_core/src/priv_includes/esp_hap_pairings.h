@@ -25,5 +25,7 @@
 #define _HAP_PAIRINGS_H_
 #include <esp_hap_pair_common.h>
 int hap_pairings_process(void *ctx, uint8_t *buf, int inlen, int bufsize, int *outlen);
+bool hap_pairings_is_list_req(void *ctx, uint8_t *buf, int inlen);
+int hap_pairings_list_write(hap_tlv_stream_t *stream);
 bool hap_is_req_secure(hap_secure_session_t *session);
 #endif /* _HAP_PAIRINGS_H_ */
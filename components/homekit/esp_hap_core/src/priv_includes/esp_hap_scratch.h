@@ -0,0 +1,55 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef _HAP_SCRATCH_H_
+#define _HAP_SCRATCH_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* Per task scratch memory for the request handlers.
+ *
+ * hap_scratch_alloc() bumps a pointer in an arena owned by the calling task,
+ * so the large working buffers of a handler do not have to be on its stack.
+ * There is no free. The handler that owns the work calls hap_scratch_reset()
+ * when done, which releases everything the task allocated since the previous
+ * reset. Helpers called from a handler may allocate, but must never reset.
+ *
+ * Requests that do not fit spill over to the heap, and the next reset grows
+ * the arena to the size that was needed, so that it settles at the real peak.
+ * Returns NULL only if the heap is exhausted too.
+ */
+void *hap_scratch_alloc(size_t size);
+void hap_scratch_reset(void);
+/* Frees the arenas of all tasks, once none of them is handling requests */
+void hap_scratch_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_SCRATCH_H_ */
@@ -50,6 +50,7 @@ typedef struct {
 
     bool                hidden;     /* If set it to be True, the service is not visible to user. */
     bool                primary;    /* If set it to be True, this is the primary service of the accessory. */
+    uint16_t            type_id;    /* Short form of type_uuid, HAP_UUID_FULL for custom ones */
 
     /**
      * List of Characteristic objects. Must not be empty. The maximum number of characteristics
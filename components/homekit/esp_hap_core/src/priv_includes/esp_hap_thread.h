@@ -0,0 +1,59 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_THREAD_H_
+#define _HAP_THREAD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <mdns.h>
+#include <hap.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#ifdef CONFIG_HAP_THREAD_ENABLE
+/* Sets up the SRP client, which registers services with the SRP server of a
+ * Thread Border Router once the device has attached. The Border Router then
+ * advertises them over mDNS on the infrastructure link
+ */
+int hap_thread_srp_init(void);
+int hap_thread_srp_deinit(void);
+/* Same as their hap_mdns_serv_* counterparts, for the SRP client */
+int hap_thread_serv_start(const char *name, const char *type, const char *protocol,
+        int port, mdns_txt_item_t *txt_records, size_t num_txt);
+int hap_thread_serv_update_txt(mdns_txt_item_t *txt_records, size_t num_txt);
+int hap_thread_serv_name_change(const char *instance_name);
+int hap_thread_serv_stop(void);
+/* Whether an active operational dataset has been committed */
+bool hap_thread_is_provisioned(void);
+/* Detaches and forgets the operational dataset */
+void hap_thread_erase_network_info(void);
+#endif /* CONFIG_HAP_THREAD_ENABLE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_THREAD_H_ */
@@ -0,0 +1,78 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_TIMED_WRITE_H_
+#define _HAP_TIMED_WRITE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* Timed writes of HAP over IP.
+ *
+ * PUT /prepare arms a timed write for the session with its pid and a deadline
+ * of now + ttl, on the monotonic esp_timer clock. The next PUT /characteristics
+ * of the session takes it over with hap_tw_take(), and its writes go through
+ * only if the pid matches and the deadline has not passed.
+ *
+ * Armed timed writes are kept per session index, and a single timer set to the
+ * earliest deadline marks them expired as soon as they are due, so that the
+ * pending count is always accurate. An expired one still fails the write that
+ * follows, the same as one found late would.
+ */
+typedef enum {
+	HAP_TW_NONE = 0,
+	HAP_TW_ARMED,
+	HAP_TW_EXPIRED,
+} hap_tw_state_t;
+
+typedef struct {
+	uint32_t pending;   /* Armed right now */
+	uint32_t armed;     /* Total prepares accepted */
+	uint32_t expired;   /* Deadline passed before the write came */
+	uint32_t completed; /* Writes which matched the pid in time */
+	uint32_t rejected;  /* Invalid prepares, and writes with the wrong pid or too late */
+} hap_tw_stats_t;
+
+int hap_tw_init(void);
+void hap_tw_deinit(void);
+/* Arms a timed write for the session index. The ttl (in msec) must be positive */
+int hap_tw_arm(int index, uint64_t pid, int64_t ttl);
+/* Takes over whatever was prepared for the session index, leaving nothing armed.
+ * The pid and deadline are filled in for HAP_TW_ARMED.
+ */
+hap_tw_state_t hap_tw_take(int index, uint64_t *pid, int64_t *deadline_us);
+/* Checks the pid of a write against what was taken over, and counts the outcome */
+bool hap_tw_check(hap_tw_state_t state, uint64_t prepared_pid, int64_t deadline_us, uint64_t pid);
+/* Drops anything armed for a session index that is going away */
+void hap_tw_cancel(int index);
+void hap_tw_get_stats(hap_tw_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _HAP_TIMED_WRITE_H_ */
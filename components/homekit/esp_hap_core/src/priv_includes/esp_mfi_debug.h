@@ -27,6 +27,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sdkconfig.h>
 #include <esp_idf_version.h>
 #include <inttypes.h>
 
@@ -60,6 +61,16 @@ extern "C"{
 #define ESP_MFI_DEBUG_ASSERT    4
 #define ESP_MFI_DEBUG_BLOCK     5
 
+/* Messages below this level are compiled out, along with their format strings and arguments */
+#ifdef CONFIG_HAP_DEBUG_MIN_LEVEL
+#define ESP_MFI_DEBUG_MIN_LEVEL CONFIG_HAP_DEBUG_MIN_LEVEL
+#else
+#define ESP_MFI_DEBUG_MIN_LEVEL ESP_MFI_DEBUG_INFO
+#endif
+
+/* Whether messages of level l are built in. l is always a constant, so the compiler drops the rest */
+#define ESP_MFI_DEBUG_BUILT_IN(l)   ((l) >= ESP_MFI_DEBUG_MIN_LEVEL)
+
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
 #include <esp_rom_sys.h>
 #define esp_intr_printf esp_rom_printf
@@ -103,7 +114,7 @@ uint32_t esp_mfi_get_debug_level(uint32_t level, uint32_t *color);
 #define ESP_MFI_DEBUG(l, fmt, ...)                                                          \
     {                                                                                       \
         uint32_t __color_LINE;                                                              \
-        if (l > esp_mfi_get_debug_level(l, &__color_LINE)) {                                \
+        if (ESP_MFI_DEBUG_BUILT_IN(l) && l > esp_mfi_get_debug_level(l, &__color_LINE)) {   \
             printf("\e[1;%" PRId32 "m" fmt "\e[0m" ESP_MFI_DEBUG_FL,                         \
                                 __color_LINE,  ##__VA_ARGS__);                              \
         }                                                                                   \
@@ -111,7 +122,7 @@ uint32_t esp_mfi_get_debug_level(uint32_t level, uint32_t *color);
 #define ESP_MFI_DEBUG_INTR(l, fmt, ...)                                                          \
     {                                                                                       \
         uint32_t __color_LINE;                                                              \
-        if (l > esp_mfi_get_debug_level(l, &__color_LINE)) {                                \
+        if (ESP_MFI_DEBUG_BUILT_IN(l) && l > esp_mfi_get_debug_level(l, &__color_LINE)) {   \
             esp_intr_printf("\e[1;%dm" fmt "\e[0m" ESP_MFI_DEBUG_FL,                        \
                                 __color_LINE,  ##__VA_ARGS__);                              \
         }                                                                                   \
@@ -43,6 +43,42 @@ extern "C" {
 /** Custom UUID for the Read-Only Firmware Upgrade Status */
 #define HAP_CHAR_CUSTOM_UUID_FW_UPG_STATUS  "d5703b5e-3736-11e8-b467-0ed5f89f718b"
 
+/** Custom UUID for the Read-Only Firmware Upgrade Progress, in percent */
+#define HAP_CHAR_CUSTOM_UUID_FW_UPG_PROGRESS "d5703cc6-3736-11e8-b467-0ed5f89f718b"
+
+/** Custom UUID for the Write-Only Firmware Upgrade Cancel. Writing true cancels an upgrade in progress */
+#define HAP_CHAR_CUSTOM_UUID_FW_UPG_CANCEL  "d5703e2e-3736-11e8-b467-0ed5f89f718b"
+
+/** Firmware Delta Patch
+ *
+ * Instead of a full image, the URL can point to a delta against the firmware
+ * which is running on the accessory. The target image is rebuilt while it
+ * streams in, from pieces of the running partition and new data carried in the
+ * patch, and then validated like a full image. All numbers are little endian.
+ *
+ * Header (\ref HAP_FW_DELTA_HDR_LEN bytes):
+ * - 4 bytes \ref HAP_FW_DELTA_MAGIC
+ * - 4 bytes version, \ref HAP_FW_DELTA_VERSION
+ * - 4 bytes length of the target image
+ * - 32 bytes SHA-256 of the running image, as reported by esp_partition_get_sha256()
+ *
+ * Followed by op records (\ref HAP_FW_DELTA_OP_LEN bytes each):
+ * - 1 byte op
+ * - 4 bytes length
+ * - 4 bytes offset in the running partition (\ref HAP_FW_DELTA_OP_COPY only, else 0)
+ *
+ * \ref HAP_FW_DELTA_OP_INSERT records are followed by "length" bytes of data.
+ * The ops must produce exactly the target length.
+ */
+#define HAP_FW_DELTA_MAGIC          "HAPD"
+#define HAP_FW_DELTA_VERSION        1
+#define HAP_FW_DELTA_HDR_LEN        44
+#define HAP_FW_DELTA_OP_LEN         9
+/** Copy "length" bytes from "offset" of the running partition */
+#define HAP_FW_DELTA_OP_COPY        0
+/** Write the "length" bytes following the record */
+#define HAP_FW_DELTA_OP_INSERT      1
+
 typedef struct {
     char * server_cert_pem; /*!< Server verification, PEM format as string */
 } hap_fw_upgrade_config_t;
@@ -60,6 +96,8 @@ typedef enum {
     FW_UPG_STATUS_UPGRADING = 1,
     /** FW Upgrade Successful */
     FW_UPG_STATUS_SUCCESS = 2,
+    /** FW Upgrade Cancelled */
+    FW_UPG_STATUS_CANCELLED = 3,
 } hap_fw_upgrade_status_t;
 
 /** Create Firmware Upgrade Service
@@ -68,7 +106,14 @@ typedef enum {
  * Add this service to the accessory, to enable the HTTP Client based Firmware Upgrade.
  * Host the FW image binary on a webserver and provide the URL as write value for
  * \ref HAP_CHAR_CUSTOM_UUID_FW_UPG_URL. The status will be reported on
- * \ref HAP_CHAR_CUSTOM_UUID_FW_UPG_STATUS
+ * \ref HAP_CHAR_CUSTOM_UUID_FW_UPG_STATUS and the download progress on
+ * \ref HAP_CHAR_CUSTOM_UUID_FW_UPG_PROGRESS
+ *
+ * An interrupted download is resumed with HTTP range requests, so the server
+ * must support those for the upgrade to survive connection drops.
+ * The URL may serve either a full image or a delta patch, described above.
+ * The URL can be up to 511 characters long. An upgrade in progress can be
+ * cancelled by writing true to \ref HAP_CHAR_CUSTOM_UUID_FW_UPG_CANCEL.
  *
  * Please refer the top level README.md for more details.
  * ESP32 OTA details: https://docs.espressif.com/projects/esp-idf/en/latest/api-reference/system/ota.html
@@ -80,6 +125,15 @@ typedef enum {
  */
 hap_serv_t * hap_serv_fw_upgrade_create(hap_fw_upgrade_config_t *ota_config);
 
+/** Cancel the Firmware Upgrade in progress
+ *
+ * The download stops at the next read, or straight away if it is waiting to
+ * retry, and the partially written image is discarded. The status is then
+ * reported as \ref FW_UPG_STATUS_CANCELLED. Does nothing if no upgrade is
+ * in progress.
+ */
+void hap_fw_upgrade_cancel(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,59 +24,521 @@
 
 /* Firmware Upgrade HomeKit Custom Service
  */
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <esp_log.h>
 #include <hap.h>
 #include <hap_fw_upgrade.h>
-#include <esp_https_ota.h>
+#include <hap_platform_os.h>
+#include <hap_platform_memory.h>
+#include <esp_http_client.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
 #include <esp_idf_version.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
 
+/* Both the download and the flash writer tasks run at this priority, so that
+ * fan control and HAP traffic stay responsive during an upgrade.
+ */
 #define FW_UPG_TASK_PRIORITY    1
 #define FW_UPG_STACKSIZE        6 * 1024
 #define FW_UPG_TASK_NAME        "hap_fw_upgrade"
+#define FW_UPG_WRITER_STACKSIZE 3 * 1024
+#define FW_UPG_WRITER_TASK_NAME "hap_fw_writer"
+
+/* One flash sector per buffer. While one buffer is being written, the
+ * other one is being filled from the network.
+ */
+#define FW_UPG_BUF_SIZE         4096
+#define FW_UPG_NUM_BUFS         2
+/* Number of times an interrupted download is resumed before giving up */
+#define FW_UPG_MAX_RETRIES      5
+#define FW_UPG_RETRY_DELAY_MS   2000
+/* How often a retry delay checks for cancellation */
+#define FW_UPG_CANCEL_POLL_MS   100
+/* Longest URL that can be written to the URL characteristic */
+#define FW_UPG_URL_MAX_LEN      512
+/* Progress is reported in steps of this many percent */
+#define FW_UPG_PROGRESS_STEP    5
 
 static const char *TAG = "HAP FW Upgrade";
 
 static hap_fw_upgrade_status_t fw_upgrade_status = FW_UPG_STATUS_IDLE;
+/* Guards the idle -> upgrading transition of fw_upgrade_status */
+static portMUX_TYPE fw_upgrade_status_lock = portMUX_INITIALIZER_UNLOCKED;
 static hap_char_t *fw_upgrade_status_char;
+static hap_char_t *fw_upgrade_progress_char;
+
+typedef struct {
+    char *data;
+    int len;        /* 0 marks the end of the image */
+} fw_upg_chunk_t;
+
+/* Delta patch decoder, see \ref HAP_FW_DELTA_MAGIC for the format */
+typedef enum {
+    FW_DELTA_PROBE = 0,     /* Not known yet whether this is a delta */
+    FW_DELTA_FULL_IMAGE,    /* Plain image, written as is */
+    FW_DELTA_HDR,
+    FW_DELTA_OP,
+    FW_DELTA_INSERT,
+} fw_delta_state_t;
+
+typedef struct {
+    fw_delta_state_t state;
+    uint8_t rec[HAP_FW_DELTA_HDR_LEN];  /* Header or op record being gathered */
+    int rec_len;
+    uint32_t insert_left;
+    uint32_t target_len;
+    uint32_t written;
+    const esp_partition_t *source;
+    uint8_t *copy_buf;
+} fw_delta_t;
+
+typedef struct {
+    esp_ota_handle_t ota_handle;
+    fw_delta_t delta;
+    QueueHandle_t free_q;       /* Empty buffers, for the download task */
+    QueueHandle_t full_q;       /* Filled buffers, for the writer task */
+    SemaphoreHandle_t writer_done;
+    esp_err_t write_err;
+    int total_len;              /* 0 if the server did not report it */
+    int progress;
+} fw_upg_pipeline_t;
+
+/* The one upgrade job there can be at a time. The URL and client config live
+ * here for the lifetime of the service, so that starting a job allocates
+ * nothing, and the download buffers are taken in one block at the start of
+ * a job and given back in one piece when it ends, whatever the outcome.
+ */
+typedef struct {
+    esp_http_client_config_t client_config;
+    char url[FW_UPG_URL_MAX_LEN];
+    volatile bool cancel;
+} fw_upg_job_t;
+
+static fw_upg_job_t fw_upg_job;
+
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+/* Only one upgrade runs at a time, so the upgrade task and the download
+ * pipeline are reserved once. The upgrade task is kept alive and woken for
+ * every upgrade, its TCB could not be reused right after a vTaskDelete().
+ * The writer task still comes from the heap, for the same reason.
+ */
+static StackType_t fw_upgrade_stack[FW_UPG_STACKSIZE];
+static StaticTask_t fw_upgrade_tcb;
+static TaskHandle_t fw_upgrade_task;
+/* The download buffers, followed by the delta copy buffer */
+static char fw_upg_bufs[(FW_UPG_NUM_BUFS + 1) * FW_UPG_BUF_SIZE];
+static uint8_t fw_upg_free_q_storage[FW_UPG_NUM_BUFS * sizeof(char *)];
+static StaticQueue_t fw_upg_free_q_buf;
+static uint8_t fw_upg_full_q_storage[(FW_UPG_NUM_BUFS + 1) * sizeof(fw_upg_chunk_t)];
+static StaticQueue_t fw_upg_full_q_buf;
+static StaticSemaphore_t fw_upg_writer_done_buf;
+#endif /* CONFIG_HAP_STATIC_ALLOCATION */
+
+static void fw_upgrade_report_progress(int progress)
+{
+    hap_val_t val = {.u = progress};
+    hap_char_update_val(fw_upgrade_progress_char, &val);
+}
+
+static inline uint32_t fw_delta_get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static esp_err_t fw_delta_write(fw_delta_t *d, esp_ota_handle_t ota_handle, const void *data, uint32_t len)
+{
+    if (len > d->target_len - d->written) {
+        ESP_LOGE(TAG, "Delta produces more than the %"PRIu32" byte target", d->target_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    d->written += len;
+    return esp_ota_write(ota_handle, data, len);
+}
 
-static void remove_escape_char(char *url)
+static esp_err_t fw_delta_copy(fw_delta_t *d, esp_ota_handle_t ota_handle, uint32_t src_offset, uint32_t len)
 {
-    char *target_url = url;
-    while (*url) {
-        if (*url == '\\') {
-            url++;
+    if ((src_offset > d->source->size) || (len > d->source->size - src_offset)) {
+        ESP_LOGE(TAG, "Delta copy outside the running partition");
+        return ESP_ERR_INVALID_ARG;
+    }
+    while (len) {
+        uint32_t n = (len > FW_UPG_BUF_SIZE) ? FW_UPG_BUF_SIZE : len;
+        esp_err_t err = esp_partition_read(d->source, src_offset, d->copy_buf, n);
+        if (err == ESP_OK) {
+            err = fw_delta_write(d, ota_handle, d->copy_buf, n);
+        }
+        if (err != ESP_OK) {
+            return err;
         }
-        *target_url++ = *url++;
+        src_offset += n;
+        len -= n;
     }
-    *target_url = '\0';
+    return ESP_OK;
 }
 
-static void fw_upgrade_thread_entry(void *data)
+/* The patch must be against the image which is running now */
+static esp_err_t fw_delta_check_hdr(fw_delta_t *d)
+{
+    uint32_t version = fw_delta_get_le32(d->rec + 4);
+    if (version != HAP_FW_DELTA_VERSION) {
+        ESP_LOGE(TAG, "Unsupported delta version %"PRIu32, version);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    d->target_len = fw_delta_get_le32(d->rec + 8);
+    d->source = esp_ota_get_running_partition();
+    uint8_t sha256[32];
+    if (!d->source || (esp_partition_get_sha256(d->source, sha256) != ESP_OK)) {
+        return ESP_FAIL;
+    }
+    if (memcmp(sha256, d->rec + 12, sizeof(sha256))) {
+        ESP_LOGE(TAG, "Delta was made for a different firmware than the one running");
+        return ESP_ERR_INVALID_STATE;
+    }
+    ESP_LOGI(TAG, "Applying delta for a %"PRIu32" byte image", d->target_len);
+    return ESP_OK;
+}
+
+static esp_err_t fw_delta_run_op(fw_delta_t *d, esp_ota_handle_t ota_handle)
+{
+    uint8_t op = d->rec[0];
+    uint32_t len = fw_delta_get_le32(d->rec + 1);
+    switch (op) {
+        case HAP_FW_DELTA_OP_COPY:
+            return fw_delta_copy(d, ota_handle, fw_delta_get_le32(d->rec + 5), len);
+        case HAP_FW_DELTA_OP_INSERT:
+            d->insert_left = len;
+            if (len) {
+                d->state = FW_DELTA_INSERT;
+            }
+            return ESP_OK;
+        default:
+            ESP_LOGE(TAG, "Invalid delta op %d", op);
+            return ESP_ERR_INVALID_ARG;
+    }
+}
+
+/* Takes the downloaded stream in arbitrary pieces. A plain image goes to
+ * flash as is, while a delta is expanded against the running partition.
+ */
+static esp_err_t fw_delta_feed(fw_delta_t *d, esp_ota_handle_t ota_handle, const uint8_t *data, int len)
+{
+    esp_err_t err = ESP_OK;
+    while (len && (err == ESP_OK)) {
+        int need, n;
+        switch (d->state) {
+            case FW_DELTA_FULL_IMAGE:
+                return esp_ota_write(ota_handle, data, len);
+            case FW_DELTA_INSERT:
+                n = ((uint32_t)len < d->insert_left) ? len : (int)d->insert_left;
+                err = fw_delta_write(d, ota_handle, data, n);
+                d->insert_left -= n;
+                if (!d->insert_left) {
+                    d->state = FW_DELTA_OP;
+                }
+                break;
+            default:
+                need = (d->state == FW_DELTA_OP) ? HAP_FW_DELTA_OP_LEN :
+                        (d->state == FW_DELTA_HDR) ? HAP_FW_DELTA_HDR_LEN : 4;
+                n = need - d->rec_len;
+                if (n > len) {
+                    n = len;
+                }
+                memcpy(d->rec + d->rec_len, data, n);
+                d->rec_len += n;
+                if (d->rec_len < need) {
+                    break;
+                }
+                d->rec_len = 0;
+                if (d->state == FW_DELTA_PROBE) {
+                    if (memcmp(d->rec, HAP_FW_DELTA_MAGIC, 4)) {
+                        /* Not a delta. Pass on the bytes held back so far */
+                        d->state = FW_DELTA_FULL_IMAGE;
+                        err = esp_ota_write(ota_handle, d->rec, need);
+                    } else {
+                        /* The magic is the start of the header */
+                        d->state = FW_DELTA_HDR;
+                        d->rec_len = need;
+                    }
+                } else if (d->state == FW_DELTA_HDR) {
+                    err = fw_delta_check_hdr(d);
+                    d->state = FW_DELTA_OP;
+                } else {
+                    err = fw_delta_run_op(d, ota_handle);
+                }
+                break;
+        }
+        data += n;
+        len -= n;
+    }
+    return err;
+}
+
+/* Checks that the stream ended cleanly */
+static esp_err_t fw_delta_finish(fw_delta_t *d, esp_ota_handle_t ota_handle)
+{
+    esp_err_t err = ESP_OK;
+    if (d->state == FW_DELTA_PROBE) {
+        /* Fewer bytes than the magic. Certainly not a valid image, but let
+         * esp_ota_end() reject it
+         */
+        err = esp_ota_write(ota_handle, d->rec, d->rec_len);
+    } else if ((d->state != FW_DELTA_FULL_IMAGE) &&
+            ((d->state != FW_DELTA_OP) || d->rec_len || (d->written != d->target_len))) {
+        ESP_LOGE(TAG, "Delta ended early, %"PRIu32" of %"PRIu32" bytes", d->written, d->target_len);
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    return err;
+}
+
+static void fw_upgrade_writer_entry(void *data)
+{
+    fw_upg_pipeline_t *p = (fw_upg_pipeline_t *)data;
+    fw_upg_chunk_t chunk;
+    while (xQueueReceive(p->full_q, &chunk, portMAX_DELAY) == pdTRUE) {
+        if (!chunk.len) {
+            break;
+        }
+        /* After an error, keep returning the buffers so that the download
+         * task does not block. It will notice the error and stop.
+         */
+        if (p->write_err == ESP_OK) {
+            p->write_err = fw_delta_feed(&p->delta, p->ota_handle, (uint8_t *)chunk.data, chunk.len);
+            if (p->write_err != ESP_OK) {
+                ESP_LOGE(TAG, "Flash write failed: %s", esp_err_to_name(p->write_err));
+            }
+        }
+        xQueueSend(p->free_q, &chunk.data, portMAX_DELAY);
+    }
+    xSemaphoreGive(p->writer_done);
+    vTaskDelete(NULL);
+}
+
+/* Fetches the image from *offset onwards and hands it to the writer task a
+ * buffer at a time. *offset is advanced by whatever was handed over, so that
+ * a failed attempt can be resumed from there with a ranged request.
+ *
+ * The client is kept across attempts, so that a resumed download over HTTPS
+ * can resume the TLS session as well.
+ */
+static esp_err_t fw_upgrade_fetch(esp_http_client_handle_t client,
+        fw_upg_pipeline_t *p, int *offset)
+{
+    if (*offset) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%d-", *offset);
+        esp_http_client_set_header(client, "Range", range);
+    }
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        goto fetch_end;
+    }
+    int content_len = esp_http_client_fetch_headers(client);
+    int status = esp_http_client_get_status_code(client);
+    if (*offset) {
+        /* Without 206 Partial Content, the server has ignored the range */
+        if (status != 206) {
+            ESP_LOGE(TAG, "Server cannot resume the download (HTTP %d)", status);
+            err = ESP_ERR_NOT_SUPPORTED;
+            goto fetch_end;
+        }
+    } else {
+        if (status != 200) {
+            ESP_LOGE(TAG, "Image download failed (HTTP %d)", status);
+            err = ESP_ERR_NOT_SUPPORTED;
+            goto fetch_end;
+        }
+        p->total_len = (content_len > 0) ? content_len : 0;
+    }
+
+    bool done = false;
+    while (!done && (err == ESP_OK)) {
+        char *buf;
+        xQueueReceive(p->free_q, &buf, portMAX_DELAY);
+        int len = 0;
+        while (len < FW_UPG_BUF_SIZE) {
+            if (fw_upg_job.cancel) {
+                err = ESP_ERR_INVALID_STATE;
+                break;
+            }
+            int read_len = esp_http_client_read(client, buf + len, FW_UPG_BUF_SIZE - len);
+            if (read_len > 0) {
+                len += read_len;
+                continue;
+            }
+            if ((read_len == 0) && esp_http_client_is_complete_data_received(client)) {
+                done = true;
+            } else {
+                ESP_LOGW(TAG, "Connection interrupted");
+                err = ESP_FAIL;
+            }
+            break;
+        }
+        if (!len) {
+            xQueueSend(p->free_q, &buf, portMAX_DELAY);
+            break;
+        }
+        /* Even after an error, whatever was received is valid */
+        fw_upg_chunk_t chunk = {
+            .data = buf,
+            .len = len,
+        };
+        xQueueSend(p->full_q, &chunk, portMAX_DELAY);
+        *offset += len;
+        if (p->write_err != ESP_OK) {
+            err = p->write_err;
+        }
+        if (p->total_len) {
+            int progress = (int)((int64_t)*offset * 100 / p->total_len);
+            if (progress >= p->progress + FW_UPG_PROGRESS_STEP) {
+                p->progress = progress - (progress % FW_UPG_PROGRESS_STEP);
+                fw_upgrade_report_progress(p->progress);
+            }
+        }
+    }
+fetch_end:
+    esp_http_client_close(client);
+    return err;
+}
+
+/* Waits between attempts, returning early if the job gets cancelled */
+static void fw_upgrade_retry_delay(void)
+{
+    int waited;
+    for (waited = 0; (waited < FW_UPG_RETRY_DELAY_MS) && !fw_upg_job.cancel; waited += FW_UPG_CANCEL_POLL_MS) {
+        vTaskDelay(pdMS_TO_TICKS(FW_UPG_CANCEL_POLL_MS));
+    }
+}
+
+/* Downloads the image and writes it to the next OTA partition, with the
+ * download of a buffer overlapping the flash erase/write of the previous one.
+ */
+static esp_err_t fw_upgrade_download(esp_http_client_config_t *client_config)
+{
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (!partition) {
+        ESP_LOGE(TAG, "No OTA partition available");
+        return ESP_ERR_NOT_FOUND;
+    }
+    esp_err_t err = ESP_ERR_NO_MEM;
+    fw_upg_pipeline_t p = {0};
+    esp_http_client_handle_t client = NULL;
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+    char *bufs = fw_upg_bufs;
+    p.free_q = xQueueCreateStatic(FW_UPG_NUM_BUFS, sizeof(char *), fw_upg_free_q_storage, &fw_upg_free_q_buf);
+    p.full_q = xQueueCreateStatic(FW_UPG_NUM_BUFS + 1, sizeof(fw_upg_chunk_t),
+            fw_upg_full_q_storage, &fw_upg_full_q_buf);
+    p.writer_done = xSemaphoreCreateBinaryStatic(&fw_upg_writer_done_buf);
+#else
+    char *bufs = hap_platform_memory_malloc_caps((FW_UPG_NUM_BUFS + 1) * FW_UPG_BUF_SIZE, HAP_MEM_CAPS_BULK);
+    p.free_q = xQueueCreate(FW_UPG_NUM_BUFS, sizeof(char *));
+    /* One more for the end marker */
+    p.full_q = xQueueCreate(FW_UPG_NUM_BUFS + 1, sizeof(fw_upg_chunk_t));
+    p.writer_done = xSemaphoreCreateBinary();
+#endif
+    client = esp_http_client_init(client_config);
+    if (!bufs || !p.free_q || !p.full_q || !p.writer_done || !client) {
+        goto download_end;
+    }
+    p.delta.copy_buf = (uint8_t *)bufs + (FW_UPG_NUM_BUFS * FW_UPG_BUF_SIZE);
+    int i;
+    for (i = 0; i < FW_UPG_NUM_BUFS; i++) {
+        char *buf = bufs + (i * FW_UPG_BUF_SIZE);
+        xQueueSend(p.free_q, &buf, 0);
+    }
+    /* Sequential writes erase each sector just before writing it, instead of
+     * the whole partition up front
+     */
+    err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &p.ota_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        goto download_end;
+    }
+    if (xTaskCreatePinnedToCore(fw_upgrade_writer_entry, FW_UPG_WRITER_TASK_NAME, FW_UPG_WRITER_STACKSIZE,
+                &p, FW_UPG_TASK_PRIORITY, NULL, HAP_PLATFORM_TASK_CORE_ID) != pdTRUE) {
+        esp_ota_abort(p.ota_handle);
+        err = ESP_ERR_NO_MEM;
+        goto download_end;
+    }
+
+    int offset = 0;
+    int attempt;
+    for (attempt = 0; attempt <= FW_UPG_MAX_RETRIES; attempt++) {
+        if (attempt) {
+            ESP_LOGW(TAG, "Resuming download at %d bytes (attempt %d)", offset, attempt);
+            fw_upgrade_retry_delay();
+        }
+        if (fw_upg_job.cancel) {
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        err = fw_upgrade_fetch(client, &p, &offset);
+        if ((err == ESP_OK) || (err == ESP_ERR_NOT_SUPPORTED) || (p.write_err != ESP_OK) ||
+                fw_upg_job.cancel) {
+            break;
+        }
+    }
+    /* Let the writer finish whatever is still queued */
+    fw_upg_chunk_t end = {0};
+    xQueueSend(p.full_q, &end, portMAX_DELAY);
+    xSemaphoreTake(p.writer_done, portMAX_DELAY);
+    esp_err_t delta_err = fw_delta_finish(&p.delta, p.ota_handle);
+    if (err == ESP_OK) {
+        err = (p.write_err != ESP_OK) ? p.write_err : delta_err;
+    }
+    if (err == ESP_OK) {
+        /* This also validates the image */
+        err = esp_ota_end(p.ota_handle);
+        if (err == ESP_OK) {
+            err = esp_ota_set_boot_partition(partition);
+        }
+    } else {
+        esp_ota_abort(p.ota_handle);
+    }
+    ESP_LOGI(TAG, "Received %d bytes", offset);
+download_end:
+    if (client) {
+        esp_http_client_cleanup(client);
+    }
+    if (p.writer_done) {
+        vSemaphoreDelete(p.writer_done);
+    }
+    if (p.full_q) {
+        vQueueDelete(p.full_q);
+    }
+    if (p.free_q) {
+        vQueueDelete(p.free_q);
+    }
+#ifndef CONFIG_HAP_STATIC_ALLOCATION
+    hap_platform_memory_free(bufs);
+#endif
+    return err;
+}
+
+static void fw_upgrade_run(esp_http_client_config_t *client_config)
 {
-    esp_http_client_config_t *client_config = (esp_http_client_config_t *)data;
-    remove_escape_char((char *)client_config->url);
     ESP_LOGI(TAG, "Fetching FW image from %s", client_config->url);
-    fw_upgrade_status = FW_UPG_STATUS_UPGRADING;
+    /* fw_upgrade_claim() already moved the status to upgrading */
     hap_val_t val = {.i = fw_upgrade_status};
     hap_char_update_val(fw_upgrade_status_char, &val);
-    esp_err_t ret;
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-    esp_https_ota_config_t ota_config = {
-        .http_config = client_config,
-    };
-    ret = esp_https_ota(&ota_config);
-#else
-    ret = esp_https_ota(client_config);
-#endif
+    fw_upgrade_report_progress(0);
+    esp_err_t ret = fw_upgrade_download(client_config);
     if (ret == ESP_OK) {
         ESP_LOGI(TAG, "FW Upgrade Successful");
         fw_upgrade_status = FW_UPG_STATUS_SUCCESS;
+        fw_upgrade_report_progress(100);
+    } else if (fw_upg_job.cancel) {
+        ESP_LOGW(TAG, "FW Upgrade Cancelled");
+        fw_upgrade_status = FW_UPG_STATUS_CANCELLED;
     } else {
         ESP_LOGE(TAG, "FW Upgrade Failed");
         fw_upgrade_status = FW_UPG_STATUS_FAIL;
     }
-    free((char *)client_config->url);
     val.i = fw_upgrade_status;
     hap_char_update_val(fw_upgrade_status_char, &val);
     if (fw_upgrade_status == FW_UPG_STATUS_SUCCESS) {
@@ -93,7 +555,64 @@ static void fw_upgrade_thread_entry(void *data)
      * controllers to read.
      */
     fw_upgrade_status = FW_UPG_STATUS_IDLE;
+}
+
+static void fw_upgrade_thread_entry(void *data)
+{
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+    /* Woken by hap_fw_upgrade_write() for every upgrade */
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        fw_upgrade_run((esp_http_client_config_t *)data);
+    }
+#else
+    fw_upgrade_run((esp_http_client_config_t *)data);
     vTaskDelete(NULL);
+#endif
+}
+
+/* Moves the status from idle to upgrading, so that only one URL write can
+ * get a job going. Returns false if a job is already in progress.
+ */
+static bool fw_upgrade_claim(void)
+{
+    bool claimed = false;
+    portENTER_CRITICAL(&fw_upgrade_status_lock);
+    if (fw_upgrade_status == FW_UPG_STATUS_IDLE) {
+        fw_upgrade_status = FW_UPG_STATUS_UPGRADING;
+        claimed = true;
+    }
+    portEXIT_CRITICAL(&fw_upgrade_status_lock);
+    return claimed;
+}
+
+/* Gives up a claim for a job that could not be started */
+static void fw_upgrade_unclaim(void)
+{
+    portENTER_CRITICAL(&fw_upgrade_status_lock);
+    fw_upgrade_status = FW_UPG_STATUS_IDLE;
+    portEXIT_CRITICAL(&fw_upgrade_status_lock);
+}
+
+/* Starts an upgrade with client_config->url set */
+static bool fw_upgrade_start(esp_http_client_config_t *client_config)
+{
+    fw_upg_job.cancel = false;
+#ifdef CONFIG_HAP_STATIC_ALLOCATION
+    if (!fw_upgrade_task) {
+        fw_upgrade_task = xTaskCreateStaticPinnedToCore(fw_upgrade_thread_entry, FW_UPG_TASK_NAME,
+                sizeof(fw_upgrade_stack), client_config, FW_UPG_TASK_PRIORITY, fw_upgrade_stack,
+                &fw_upgrade_tcb, HAP_PLATFORM_TASK_CORE_ID);
+        if (!fw_upgrade_task) {
+            return false;
+        }
+    }
+    xTaskNotifyGive(fw_upgrade_task);
+    return true;
+#else
+    return xTaskCreatePinnedToCore(fw_upgrade_thread_entry, FW_UPG_TASK_NAME, FW_UPG_STACKSIZE,
+            client_config, FW_UPG_TASK_PRIORITY, NULL, HAP_PLATFORM_TASK_CORE_ID) == pdTRUE;
+#endif
 }
 
 static int hap_fw_upgrade_write(hap_write_data_t write_data[], int count,
@@ -103,26 +622,40 @@ static int hap_fw_upgrade_write(hap_write_data_t write_data[], int count,
     hap_write_data_t *write;
     for (i = 0; i < count; i++) {
         write = &write_data[i];
-        if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_CUSTOM_UUID_FW_UPG_URL)) {
+        if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_CUSTOM_UUID_FW_UPG_CANCEL)) {
+            if (write->val.b) {
+                hap_fw_upgrade_cancel();
+            }
+            *(write->status) = HAP_STATUS_SUCCESS;
+        } else if (!strcmp(hap_char_get_type_uuid(write->hc), HAP_CHAR_CUSTOM_UUID_FW_UPG_URL)) {
             /* If the Upgrade Status is not idle, it means that a FW Upgrade attempt
              * is already in progress. Report appropriate status in such a case and do
-             * not proceed
+             * not proceed. The status is claimed right here, before the task starts,
+             * so that two writes close together cannot both start a job.
              */
-            if (fw_upgrade_status != FW_UPG_STATUS_IDLE) {
+            if (!fw_upgrade_claim()) {
                 *(write->status) = HAP_STATUS_RES_BUSY;
                 ret = HAP_FAIL;
             } else {
                 if (!serv_priv) {
+                    fw_upgrade_unclaim();
                     *(write->status) = HAP_STATUS_OO_RES;
                     ret = HAP_FAIL;
                     continue;
                 }
-                esp_http_client_config_t *client_config = (esp_http_client_config_t *)serv_priv;
-                client_config->url = strndup(write->val.s, strlen(write->val.s)+1);
-                if (xTaskCreate(fw_upgrade_thread_entry, FW_UPG_TASK_NAME, FW_UPG_STACKSIZE,
-                    client_config, FW_UPG_TASK_PRIORITY, NULL) == pdTRUE) {
+                fw_upg_job_t *job = (fw_upg_job_t *)serv_priv;
+                if (!write->val.s || (strlen(write->val.s) >= sizeof(job->url))) {
+                    fw_upgrade_unclaim();
+                    *(write->status) = HAP_STATUS_VAL_INVALID;
+                    ret = HAP_FAIL;
+                    continue;
+                }
+                strcpy(job->url, write->val.s);
+                job->client_config.url = job->url;
+                if (fw_upgrade_start(&job->client_config)) {
                     *(write->status) = HAP_STATUS_SUCCESS;
                 } else {
+                    fw_upgrade_unclaim();
                     *(write->status) = HAP_STATUS_OO_RES;
                     ret = HAP_FAIL;
                 }
@@ -135,6 +668,15 @@ static int hap_fw_upgrade_write(hap_write_data_t write_data[], int count,
     return ret;
 }
 
+void hap_fw_upgrade_cancel(void)
+{
+    /* Starting a job clears this, so it is harmless while no job is running */
+    fw_upg_job.cancel = true;
+    if (fw_upgrade_status == FW_UPG_STATUS_UPGRADING) {
+        ESP_LOGI(TAG, "Cancelling FW Upgrade");
+    }
+}
+
 hap_serv_t * hap_serv_fw_upgrade_create(hap_fw_upgrade_config_t *ota_config)
 {
     hap_serv_t *hs = hap_serv_create(HAP_SERV_CUSTOM_UUID_FW_UPG);
@@ -145,29 +687,37 @@ hap_serv_t * hap_serv_fw_upgrade_create(hap_fw_upgrade_config_t *ota_config)
     int ret = hap_serv_add_char(hs, hc);
     fw_upgrade_status_char = hap_char_int_create(HAP_CHAR_CUSTOM_UUID_FW_UPG_STATUS, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
     ret = hap_serv_add_char(hs, fw_upgrade_status_char);
+    fw_upgrade_progress_char = hap_char_uint8_create(HAP_CHAR_CUSTOM_UUID_FW_UPG_PROGRESS, HAP_CHAR_PERM_PR | HAP_CHAR_PERM_EV, 0);
+    ret |= hap_serv_add_char(hs, fw_upgrade_progress_char);
+    hap_char_t *cancel_char = hap_char_bool_create(HAP_CHAR_CUSTOM_UUID_FW_UPG_CANCEL, HAP_CHAR_PERM_PW, false);
+    ret |= hap_serv_add_char(hs, cancel_char);
     if (ret != HAP_SUCCESS) {
         hap_serv_delete(hs);
         return NULL;
     }
     hap_char_add_description(hc, "FW Upgrade URL");
     hap_char_add_description(fw_upgrade_status_char, "FW Upgrade Status");
+    hap_char_add_description(fw_upgrade_progress_char, "FW Upgrade Progress");
+    hap_char_add_description(cancel_char, "FW Upgrade Cancel");
+    hap_char_add_unit(fw_upgrade_progress_char, HAP_CHAR_UNIT_PERCENTAGE);
+    hap_char_int_set_constraints(fw_upgrade_progress_char, 0, 100, 1);
     hap_serv_set_write_cb(hs, hap_fw_upgrade_write);
-    esp_http_client_config_t *client_config = calloc(1, sizeof(esp_http_client_config_t));
-    if (!client_config) {
-        hap_serv_delete(hs);
-        return NULL;
-    }
+    esp_http_client_config_t *client_config = &fw_upg_job.client_config;
+    memset(client_config, 0, sizeof(esp_http_client_config_t));
     if(ota_config->server_cert_pem) {
         client_config->cert_pem = strdup(ota_config->server_cert_pem);
         if(!client_config->cert_pem) {
-            free(client_config);
             hap_serv_delete(hs);
             return NULL;
         }
     } else {
         ESP_LOGW(TAG, "Server certificate not provided in OTA config.");
     }
-    hap_serv_set_priv(hs, client_config);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    /* Lets a resumed download skip the full TLS handshake */
+    client_config->save_client_session = true;
+#endif
+    hap_serv_set_priv(hs, &fw_upg_job);
 
     /* Mark the service as hidden as it need not be controlled directly by users */
     hap_serv_mark_hidden(hs);
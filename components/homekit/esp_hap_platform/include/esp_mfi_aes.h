@@ -24,6 +24,7 @@
 #ifndef ESP_MFI_AES_H_
 #define ESP_MFI_AES_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -37,6 +38,9 @@ typedef void* esp_mfi_aes_ctr_t;
 /**
  * @brief Create AES context
  *
+ * Contexts come from a small static pool (CONFIG_HAP_MFI_AES_CTX_POOL_SIZE),
+ * and from the heap only once all of those are in use.
+ *
  * @return pointer of the AES context
  */
 esp_mfi_aes_ctr_t esp_mfi_aes_ctr_new(void);
@@ -57,6 +61,9 @@ int esp_mfi_aes_ctr_init(esp_mfi_aes_ctr_t incontext, const uint8_t inkey[MFI_AE
 /**
  * @brief Update AES context
  *
+ * Can be called any number of times with chunks of any length, the key stream
+ * carries on from where the previous call left it.
+ *
  * @param incontext  AES context point
  * @param insrc  pointer of the source data to be updated
  * @param insrclen  source data length
@@ -66,7 +73,7 @@ int esp_mfi_aes_ctr_init(esp_mfi_aes_ctr_t incontext, const uint8_t inkey[MFI_AE
  *     - 0 : succeed
  *     - others : fail
  */
-int esp_mfi_aes_ctr_update(esp_mfi_aes_ctr_t incontext, const void *insrc, uint16_t insrclen, void *indst);
+int esp_mfi_aes_ctr_update(esp_mfi_aes_ctr_t incontext, const void *insrc, size_t insrclen, void *indst);
 
 /**
  * @brief Destroy AES context pointer
@@ -24,6 +24,7 @@
 #ifndef ESP_MFI_BASE64_H_
 #define ESP_MFI_BASE64_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -60,6 +61,104 @@ int esp_mfi_base64_encode(const char *src, int len, char *dest, int dest_len, in
  */
 int esp_mfi_base64_decode(const char *src, int len, char *dest, int dest_len, int *out_len);
 
+/**
+ * @brief transform base64 data to bin data, writing it over the input
+ *
+ * @param buf input data point, which gets the output data
+ * @param len input data length
+ * @param out_len output data length
+ *
+ * @return
+ *     - 0 : succeed
+ *     - others : fail
+ */
+int esp_mfi_base64_decode_inplace(char *buf, int len, int *out_len);
+
+/**
+ * @brief base64 streaming context
+ *
+ * Holds the bytes (or characters) of an incomplete group between the chunks
+ * of a stream, so that large data can be transformed without a buffer for
+ * all of it. A context is used for either encoding or decoding.
+ */
+typedef struct {
+    uint8_t part[4];    /* Incomplete group from the previous chunk */
+    uint8_t part_len;   /* Number of bytes in part */
+    bool done;          /* Padding was decoded, so nothing more can follow */
+} esp_mfi_base64_ctx_t;
+
+/**
+ * @brief initialise a base64 streaming context
+ *
+ * @param ctx context to initialise
+ */
+void esp_mfi_base64_stream_init(esp_mfi_base64_ctx_t *ctx);
+
+/**
+ * @brief transform a chunk of bin data to base64 data
+ *
+ * The output is not NULL terminated. Bytes which do not make up a complete
+ * group of 3 are kept in the context for the next chunk.
+ *
+ * @param ctx streaming context
+ * @param src input data point
+ * @param len input data length
+ * @param dest output data point
+ * @param dest_len output data buffer length, at least 4 * ((len + 2) / 3)
+ * @param out_len output data length
+ *
+ * @return
+ *     - 0 : succeed
+ *     - others : fail
+ */
+int esp_mfi_base64_encode_update(esp_mfi_base64_ctx_t *ctx, const char *src, int len,
+        char *dest, int dest_len, int *out_len);
+
+/**
+ * @brief finish a base64 encoding stream, writing the padded last group if any
+ *
+ * @param ctx streaming context
+ * @param dest output data point
+ * @param dest_len output data buffer length, at least 4
+ * @param out_len output data length
+ *
+ * @return
+ *     - 0 : succeed
+ *     - others : fail
+ */
+int esp_mfi_base64_encode_finish(esp_mfi_base64_ctx_t *ctx, char *dest, int dest_len, int *out_len);
+
+/**
+ * @brief transform a chunk of base64 data to bin data
+ *
+ * Characters which do not make up a complete group of 4 are kept in the
+ * context for the next chunk.
+ *
+ * @param ctx streaming context
+ * @param src input data point
+ * @param len input data length
+ * @param dest output data point
+ * @param dest_len output data buffer length, at least 3 * ((len + 3) / 4)
+ * @param out_len output data length
+ *
+ * @return
+ *     - 0 : succeed
+ *     - others : fail
+ */
+int esp_mfi_base64_decode_update(esp_mfi_base64_ctx_t *ctx, const char *src, int len,
+        char *dest, int dest_len, int *out_len);
+
+/**
+ * @brief finish a base64 decoding stream
+ *
+ * @param ctx streaming context
+ *
+ * @return
+ *     - 0 : succeed
+ *     - others : the stream ended in the middle of a group
+ */
+int esp_mfi_base64_decode_finish(esp_mfi_base64_ctx_t *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,8 @@
 #define _HAP_PLATFORM_KEYSTORE_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -67,6 +69,33 @@ int hap_platform_keystore_init_partition(const char *part_name, bool read_only);
  */
 int hap_platform_keystore_get(const char *part_name, const char *name_space, const char *key, uint8_t *val, size_t *val_size);
 
+/** Key to be read by hap_platform_keystore_get_multi() */
+typedef struct {
+    /** Name of the key */
+    const char *key;
+    /** Allocated buffer into which the value will be read */
+    uint8_t *val;
+    /** Size of the allocated value buffer. Will hold the size of value read on success */
+    size_t val_size;
+    /** Set to 0 if the value was read, -1 otherwise */
+    int status;
+} hap_platform_keystore_item_t;
+
+/** Get Multiple Values from a Name space of the Key Store
+ *
+ * Reads all the keys through a single namespace handle. Missing keys are
+ * not an error, their status is just set to -1.
+ *
+ * @param[in] part_name Name of Partition
+ * @param[in] name_space Name space for the keys
+ * @param[in,out] items Keys to read, and where to read them
+ * @param[in] count Number of items
+ *
+ * @return Number of values read
+ */
+int hap_platform_keystore_get_multi(const char *part_name, const char *name_space,
+        hap_platform_keystore_item_t *items, int count);
+
 /** Set Value in Key Store
  *
  * @param[in] part_name Name of Partition
@@ -101,6 +130,13 @@ int hap_platform_keystore_delete(const char *part_name, const char *name_space,
  */
 int hap_platform_keystore_delete_namespace(const char *part_name, const char *name_space);
 
+/** Flush the Key Store
+ *
+ * Namespace handles are kept open between calls. This commits and closes
+ * all of them. Later calls just open them again.
+ */
+void hap_platform_keystore_flush(void);
+
 /** Erase a Key Store partition
  *
  * @param[in] part_name Name of Partition
@@ -24,10 +24,57 @@
 #ifndef _HAP_PLATFORM_MEMORY_H_
 #define _HAP_PLATFORM_MEMORY_H_
 #include <stdlib.h>
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** Maximum number of allocation sites tracked by hap_platform_memory_get_stats() */
+#define HAP_PLATFORM_MEMORY_MAX_SITES   16
+/** Maximum number of memory pools reported by hap_platform_memory_get_stats() */
+#define HAP_PLATFORM_MEMORY_MAX_POOLS   3
+
+/** Allocation counters for a single call site */
+typedef struct {
+    /** Return address of the hap_platform_memory_malloc()/calloc() call. Use addr2line to resolve */
+    const void *site;
+    /** Number of allocations made from this site */
+    uint32_t allocs;
+    /** Largest allocation requested from this site */
+    uint32_t max_size;
+} hap_platform_memory_site_t;
+
+/** Usage of a single fixed block pool */
+typedef struct {
+    uint16_t block_size;
+    uint16_t block_cnt;
+    uint16_t in_use;
+    /** Highest "in_use" seen so far */
+    uint16_t peak;
+} hap_platform_memory_pool_stats_t;
+
+/** Allocator statistics */
+typedef struct {
+    uint32_t allocs;
+    uint32_t frees;
+    /** Allocations which could not be served from the pools */
+    uint32_t heap_allocs;
+    uint8_t num_pools;
+    hap_platform_memory_pool_stats_t pools[HAP_PLATFORM_MEMORY_MAX_POOLS];
+    uint8_t num_sites;
+    hap_platform_memory_site_t sites[HAP_PLATFORM_MEMORY_MAX_SITES];
+} hap_platform_memory_stats_t;
+
+
+/** Placement of an allocation, for hap_platform_memory_malloc_caps() */
+typedef enum {
+    /** Same as hap_platform_memory_malloc() */
+    HAP_MEM_CAPS_DEFAULT = 0,
+    /** Large data buffer (JSON, frames, firmware chunks), fine in PSRAM */
+    HAP_MEM_CAPS_BULK,
+    /** Keys, DMA buffers and anything used with the flash cache disabled. Always internal RAM */
+    HAP_MEM_CAPS_INTERNAL,
+} hap_platform_memory_caps_t;
 
 /** Allocate memory
  *
@@ -53,14 +100,58 @@ void * hap_platform_memory_malloc(size_t size);
  */
 void * hap_platform_memory_calloc(size_t count, size_t size);
 
+/** Allocate memory with a placement
+ *
+ * With CONFIG_HAP_MEM_PSRAM_BULK, HAP_MEM_CAPS_BULK allocations of at least
+ * CONFIG_HAP_MEM_PSRAM_MIN_SIZE bytes come from PSRAM, falling back to internal
+ * RAM if PSRAM is full. Otherwise, this is the same as hap_platform_memory_malloc(),
+ * except that HAP_MEM_CAPS_INTERNAL never falls back to external memory.
+ *
+ * @param[in] size Number of bytes to be allocated
+ * @param[in] caps Where the memory may be placed
+ *
+ * @return pointer to the allocated memory, to be freed with hap_platform_memory_free()
+ * @return NULL on failure
+ */
+void * hap_platform_memory_malloc_caps(size_t size, hap_platform_memory_caps_t caps);
+
+/** Allocate zeroed contiguous memory for items, with a placement
+ *
+ * Same as hap_platform_memory_calloc(), placed as per hap_platform_memory_malloc_caps().
+ *
+ * @param[in] count Number of items
+ * @param[in] size Size of each item
+ * @param[in] caps Where the memory may be placed
+ *
+ * @return pointer to the allocated memory, to be freed with hap_platform_memory_free()
+ * @return NULL on failure
+ */
+void * hap_platform_memory_calloc_caps(size_t count, size_t size, hap_platform_memory_caps_t caps);
+
 /** Free allocate memory
  *
  * This API frees the memory allocated by hap_platform_memory_malloc() or hap_platform_memory_calloc()
  *
+ * @note Memory allocated by these APIs must be freed only using this API, since it may
+ * come from the HomeKit memory pools rather than the heap. Memory allocated using the
+ * standard malloc() family can also be freed using this API.
+ *
  * @param[in] ptr Pointer to the allocated memory
  */
 void hap_platform_memory_free(void *ptr);
 
+/** Get the allocator statistics
+ *
+ * Available only if CONFIG_HAP_MEM_STATS_ENABLE is set. Allocation sites beyond
+ * HAP_PLATFORM_MEMORY_MAX_SITES are counted only in the totals.
+ *
+ * @param[out] stats Statistics gathered since boot
+ *
+ * @return 0 on success
+ * @return -1 if statistics are not enabled
+ */
+int hap_platform_memory_get_stats(hap_platform_memory_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
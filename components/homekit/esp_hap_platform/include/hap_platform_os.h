@@ -24,6 +24,7 @@
 #ifndef _HAP_PLATFORM_OS_H_
 #define _HAP_PLATFORM_OS_H_
 #include <stdint.h>
+#include <sdkconfig.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -35,6 +36,15 @@ extern "C" {
  */
 uint16_t hap_platform_os_get_msec_per_tick();
 
+/** Core that the HomeKit tasks (hap-loop, HTTP server, pairing and crypto workers,
+ * firmware upgrade) are pinned to. tskNO_AFFINITY unless CONFIG_HAP_TASK_CORE_ID is set.
+ */
+#if defined(CONFIG_HAP_TASK_CORE_ID) && (CONFIG_HAP_TASK_CORE_ID >= 0)
+#define HAP_PLATFORM_TASK_CORE_ID   CONFIG_HAP_TASK_CORE_ID
+#else
+#define HAP_PLATFORM_TASK_CORE_ID   tskNO_AFFINITY
+#endif
+
 #ifdef __cplusplus
 }
 #endif
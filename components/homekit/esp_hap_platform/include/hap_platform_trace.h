@@ -0,0 +1,121 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#ifndef _HAP_PLATFORM_TRACE_H_
+#define _HAP_PLATFORM_TRACE_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <sdkconfig.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Points along the path of a characteristic write, and the notification back out */
+typedef enum {
+    HAP_TRACE_HTTPD_RECV = 0,   /* Socket read of an encrypted session, arg is the bytes read */
+    HAP_TRACE_DECRYPT,          /* Frame decryption in hap_decrypt_data(), arg is the frame length */
+    HAP_TRACE_SET_CHAR,         /* hap_http_handle_set_char(), arg is the element's index in the request */
+    HAP_TRACE_APP_WRITE,        /* Accessory write callback */
+    HAP_TRACE_APP_ENQUEUE,      /* Application event queued, arg is the event id */
+    HAP_TRACE_APP_DEQUEUE,      /* Application event taken off its queue, arg is the event id */
+    HAP_TRACE_APP_ACTUATE,      /* Application driving its hardware (relays etc.) */
+    HAP_TRACE_QUEUE_EVENT,      /* hap_queue_event(), arg is the iid */
+    HAP_TRACE_SEND_NOTIFICATION,/* hap_send_notification(), arg is the number of characteristics */
+    HAP_TRACE_ENCRYPT,          /* Frame encryption in hap_encrypt_data(), arg is the frame length */
+    HAP_TRACE_POINT_MAX,
+} hap_trace_point_t;
+
+/** What a trace entry marks */
+typedef enum {
+    HAP_TRACE_KIND_BEGIN = 0,
+    HAP_TRACE_KIND_END,
+    HAP_TRACE_KIND_MARK,
+} hap_trace_kind_t;
+
+/** A single entry in the trace buffer */
+typedef struct {
+    /** Time of the entry, in microseconds since boot (wraps after ~71 minutes) */
+    uint32_t timestamp_us;
+    uint8_t point;
+    uint8_t kind;
+    /** Point specific argument, see hap_trace_point_t */
+    uint16_t arg;
+} hap_trace_entry_t;
+
+#ifdef CONFIG_HAP_TRACE_ENABLE
+/** Record a trace entry
+ *
+ * Use the HAP_TRACE_BEGIN(), HAP_TRACE_END() and HAP_TRACE_MARK() macros rather than
+ * calling this directly, so that the calls compile out when tracing is disabled.
+ * Lock free, and safe to call from any task.
+ *
+ * @param[in] point Trace point
+ * @param[in] kind Whether the point is being entered, left, or just passed
+ * @param[in] arg Point specific argument
+ */
+void hap_platform_trace_record(hap_trace_point_t point, hap_trace_kind_t kind, uint16_t arg);
+
+#define HAP_TRACE_BEGIN(point, arg) hap_platform_trace_record(point, HAP_TRACE_KIND_BEGIN, arg)
+#define HAP_TRACE_END(point, arg)   hap_platform_trace_record(point, HAP_TRACE_KIND_END, arg)
+#define HAP_TRACE_MARK(point, arg)  hap_platform_trace_record(point, HAP_TRACE_KIND_MARK, arg)
+#else
+#define HAP_TRACE_BEGIN(point, arg)
+#define HAP_TRACE_END(point, arg)
+#define HAP_TRACE_MARK(point, arg)
+#endif /* CONFIG_HAP_TRACE_ENABLE */
+
+/** Copy out the trace buffer
+ *
+ * Copies the most recent entries, oldest first. Entries being written while this
+ * runs may come out garbled, so read it once things have gone quiet.
+ *
+ * @note Entries are only kept with the ring buffer backend. With SystemView,
+ * they go straight to the host instead.
+ *
+ * @param[out] entries Buffer for the entries
+ * @param[in] max_entries Number of entries the buffer can hold
+ *
+ * @return Number of entries copied, 0 if tracing is disabled
+ */
+size_t hap_platform_trace_read(hap_trace_entry_t *entries, size_t max_entries);
+
+/** Get the name of a trace point
+ *
+ * @param[in] point Trace point
+ *
+ * @return Name of the point, "unknown" if it is out of range
+ */
+const char *hap_platform_trace_point_name(hap_trace_point_t point);
+
+/** Register the /debug/trace endpoint
+ *
+ * Serves the trace buffer as text, one entry per line with the time since the previous
+ * entry, from the HomeKit HTTP server. Call after hap_start(). Does nothing unless
+ * CONFIG_HAP_TRACE_HTTP_ENDPOINT is set.
+ */
+void hap_platform_trace_register_http_handler(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _HAP_PLATFORM_TRACE_H_ */
@@ -23,9 +23,11 @@
  */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <sys/errno.h>
 
+#include <freertos/FreeRTOS.h>
 #include "mbedtls/aes.h"
 #include "esp_log.h"
 
@@ -41,13 +43,30 @@ static const char* TAG = "mfi_aes_adapter";
  * Call esp_mfi_aes_ctr_init to initialize the context. Don't use the context until it has been initialized.
  * Call esp_mfi_aes_ctr_update to encrypt or decrypt N bytes of input and generate N bytes of output.
  * Call esp_mfi_aes_ctr_final to finalize the context. After finalizing, you must call AES_CTR_Init to use it again.
+ *
+ * The key is expanded once in esp_mfi_aes_ctr_init, and the counter along with the unused part of
+ * the last key stream block carry over between updates, so data can be streamed through in chunks
+ * of any size. Each update hands the whole buffer to mbedtls in one call, so that with
+ * CONFIG_MBEDTLS_HARDWARE_AES the AES peripheral processes it in one go, using DMA for large
+ * buffers on the chips which have it.
 */
 
 typedef struct {
-    uint8_t key[MFI_AES_CTR_SIZE];
+    mbedtls_aes_context aes;
     uint8_t nonce[MFI_AES_CTR_SIZE];
+    uint8_t stream_block[MFI_AES_CTR_SIZE];
+    size_t offset;
+    bool initialized;
+    bool pooled;
 } aes_ctr_context_t;
 
+#if CONFIG_HAP_MFI_AES_CTX_POOL_SIZE > 0
+/* Contexts handed out by esp_mfi_aes_ctr_new before falling back to the heap */
+static aes_ctr_context_t aes_ctr_pool[CONFIG_HAP_MFI_AES_CTX_POOL_SIZE];
+static bool aes_ctr_pool_used[CONFIG_HAP_MFI_AES_CTX_POOL_SIZE];
+static portMUX_TYPE aes_ctr_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
 /**
  * @bref Create AES context
  *
@@ -58,7 +77,23 @@ typedef struct {
 esp_mfi_aes_ctr_t esp_mfi_aes_ctr_new(void)
 {
     aes_ctr_context_t *context = NULL;
-    context = (aes_ctr_context_t *) malloc(sizeof(aes_ctr_context_t));
+#if CONFIG_HAP_MFI_AES_CTX_POOL_SIZE > 0
+    portENTER_CRITICAL(&aes_ctr_pool_lock);
+    for (int i = 0; i < CONFIG_HAP_MFI_AES_CTX_POOL_SIZE; i++) {
+        if (!aes_ctr_pool_used[i]) {
+            aes_ctr_pool_used[i] = true;
+            context = &aes_ctr_pool[i];
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&aes_ctr_pool_lock);
+    if (context) {
+        memset(context, 0, sizeof(aes_ctr_context_t));
+        context->pooled = true;
+        return context;
+    }
+#endif
+    context = (aes_ctr_context_t *) calloc(1, sizeof(aes_ctr_context_t));
     return context;
 }
 
@@ -82,8 +117,19 @@ int esp_mfi_aes_ctr_init(esp_mfi_aes_ctr_t incontext, const uint8_t inkey[MFI_AE
 
     aes_ctr_context_t *context = incontext;
 
-    memcpy(context->key, inkey, MFI_AES_CTR_SIZE);
+    if (context->initialized) {
+        mbedtls_aes_free(&context->aes);
+    }
+    mbedtls_aes_init(&context->aes);
+    context->initialized = true;
+
+    ret = mbedtls_aes_setkey_enc(&context->aes, inkey, 128);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "mfi aes setkey[%d]", ret);
+        return -EINVAL;
+    }
     memcpy(context->nonce, innonce, MFI_AES_CTR_SIZE);
+    context->offset = 0;
 
     return ret;
 }
@@ -100,30 +146,20 @@ int esp_mfi_aes_ctr_init(esp_mfi_aes_ctr_t incontext, const uint8_t inkey[MFI_AE
  *      0 : sucessful
  *      others : failed
  */
-int esp_mfi_aes_ctr_update(esp_mfi_aes_ctr_t incontext, const void *insrc, uint16_t insrclen, void *indst)
+int esp_mfi_aes_ctr_update(esp_mfi_aes_ctr_t incontext, const void *insrc, size_t insrclen, void *indst)
 {
     int ret = 0;
 
-    if (incontext == NULL)
+    if (incontext == NULL || !((aes_ctr_context_t *)incontext)->initialized)
         return -EINVAL;
 
     aes_ctr_context_t *context = incontext;
-    size_t offset = 0;
-    uint8_t stream_block[MFI_AES_CTR_SIZE];
-    mbedtls_aes_context ctx;
-    mbedtls_aes_init(&ctx);
-
-    ret = mbedtls_aes_setkey_enc( &ctx, context->key, 128);
 
+    ret = mbedtls_aes_crypt_ctr(&context->aes, insrclen, &context->offset, context->nonce,
+            context->stream_block, (const uint8_t *) insrc, indst);
     if (ret != 0) {
-        ESP_LOGE(TAG, "mfi aes setkey[%d]", ret);
+        ESP_LOGE(TAG, "mfi aes crypt[%d]", ret);
         ret = -EINVAL;
-    } else {
-        ret = mbedtls_aes_crypt_ctr(&ctx, insrclen, &offset, context->nonce, stream_block, (uint8_t *) insrc, indst);
-        if (ret != 0) {
-            ESP_LOGE(TAG, "mfi aes crypt[%d]", ret);
-            ret = -EINVAL;
-        }
     }
 
     return ret;
@@ -139,7 +175,21 @@ int esp_mfi_aes_ctr_update(esp_mfi_aes_ctr_t incontext, const void *insrc, uint1
 void esp_mfi_aes_ctr_final(esp_mfi_aes_ctr_t incontext)
 {
     if (incontext) {
-        memset((aes_ctr_context_t *) incontext, 0, sizeof(aes_ctr_context_t));
+        aes_ctr_context_t *context = incontext;
+        bool pooled = context->pooled;
+        if (context->initialized) {
+            mbedtls_aes_free(&context->aes);
+        }
+        memset(context, 0, sizeof(aes_ctr_context_t));
+#if CONFIG_HAP_MFI_AES_CTX_POOL_SIZE > 0
+        if (pooled) {
+            portENTER_CRITICAL(&aes_ctr_pool_lock);
+            aes_ctr_pool_used[context - aes_ctr_pool] = false;
+            portEXIT_CRITICAL(&aes_ctr_pool_lock);
+            return;
+        }
+#endif
+        (void) pooled;
         free(incontext);
     }
 }
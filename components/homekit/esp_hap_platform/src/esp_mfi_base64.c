@@ -21,22 +21,119 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  */
-
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/errno.h>
 
-#include "mbedtls/base64.h"
+#include <esp_mfi_base64.h>
+
+/* Marks the characters that are not part of the alphabet in the decoding table */
+#define B64_INVALID     0x80
+
+static const char b64_enc_table[64] = {
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
+    'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
+    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
+    'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+/* Every byte which is not in the alphabet (including '=') maps to B64_INVALID */
+#define B64_X   B64_INVALID
+static const uint8_t b64_dec_table[256] = {
+    B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X,
+    B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X,
+    B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X,    62, B64_X, B64_X, B64_X,    63,
+       52,    53,    54,    55,    56,    57,    58,    59,    60,    61, B64_X, B64_X, B64_X, B64_X, B64_X, B64_X,
+    B64_X,     0,     1,     2,     3,     4,     5,     6,     7,     8,     9,    10,    11,    12,    13,    14,
+       15,    16,    17,    18,    19,    20,    21,    22,    23,    24,    25, B64_X, B64_X, B64_X, B64_X, B64_X,
+    B64_X,    26,    27,    28,    29,    30,    31,    32,    33,    34,    35,    36,    37,    38,    39,    40,
+       41,    42,    43,    44,    45,    46,    47,    48,    49,    50,    51, B64_X, B64_X, B64_X, B64_X, B64_X,
+    [128 ... 255] = B64_X
+};
+#undef B64_X
+
+/* Encodes 3 bytes into 4 characters */
+static inline void b64_encode_triple(const uint8_t *in, char *out)
+{
+    uint32_t v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+    out[0] = b64_enc_table[(v >> 18) & 0x3f];
+    out[1] = b64_enc_table[(v >> 12) & 0x3f];
+    out[2] = b64_enc_table[(v >> 6) & 0x3f];
+    out[3] = b64_enc_table[v & 0x3f];
+}
+
+/* Encodes the last 1 or 2 bytes into 4 characters, with padding */
+static void b64_encode_tail(const uint8_t *in, int len, char *out)
+{
+    uint8_t triple[3] = { in[0], (len > 1) ? in[1] : 0, 0 };
+    b64_encode_triple(triple, out);
+    out[3] = '=';
+    if (len == 1) {
+        out[2] = '=';
+    }
+}
+
+/* Decodes 4 characters with no padding into 3 bytes. The output may overlap the
+ * input, as long as it does not start after it.
+ */
+static inline int b64_decode_quad(const uint8_t *in, uint8_t *out)
+{
+    uint32_t a = b64_dec_table[in[0]], b = b64_dec_table[in[1]];
+    uint32_t c = b64_dec_table[in[2]], d = b64_dec_table[in[3]];
+    if ((a | b | c | d) & B64_INVALID) {
+        return -1;
+    }
+    uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+    out[0] = v >> 16;
+    out[1] = v >> 8;
+    out[2] = v;
+    return 3;
+}
+
+/* Decodes the last 4 characters of the input, which may end with one or two '='.
+ * Returns the number of bytes, or -1 if the characters are invalid.
+ */
+static int b64_decode_last_quad(const uint8_t *in, uint8_t *out)
+{
+    int pad = (in[3] == '=') + (in[3] == '=' && in[2] == '=');
+    uint8_t quad[4] = { in[0], in[1], pad > 1 ? 'A' : in[2], pad > 0 ? 'A' : in[3] };
+    uint8_t triple[3];
+    if (b64_decode_quad(quad, triple) < 0) {
+        return -1;
+    }
+    memcpy(out, triple, 3 - pad);
+    return 3 - pad;
+}
 
 /**
  * @brief transform bin data to base64 data
  */
 int esp_mfi_base64_encode(const char *src, int len, char *dest, int dest_len, int *out_len)
 {
-    int ret = mbedtls_base64_encode((unsigned char *)dest, dest_len, (size_t *)out_len, (unsigned char *)src, len);
-    if (ret != 0){
+    if (!src || !dest || !out_len || len < 0) {
         return -EINVAL;
-    } else{
-        return 0;
     }
+    int needed = ((len + 2) / 3) * 4;
+    /* Room is also needed for the NULL termination */
+    if (dest_len <= needed) {
+        *out_len = needed + 1;
+        return -EINVAL;
+    }
+    const uint8_t *in = (const uint8_t *)src;
+    char *out = dest;
+    int full = len / 3;
+    for (int i = 0; i < full; i++, in += 3, out += 4) {
+        b64_encode_triple(in, out);
+    }
+    if (len % 3) {
+        b64_encode_tail(in, len % 3, out);
+        out += 4;
+    }
+    *out = '\0';
+    *out_len = needed;
+    return 0;
 }
 
 /**
@@ -44,11 +141,171 @@ int esp_mfi_base64_encode(const char *src, int len, char *dest, int dest_len, in
  */
 int esp_mfi_base64_decode(const char *src, int len, char *dest, int dest_len, int *out_len)
 {
-    int ret = 0;
-    ret = mbedtls_base64_decode((unsigned char *)dest, dest_len, (size_t *)out_len, (unsigned char *)src, len);
-    if (ret != 0) {
+    if (!src || !dest || !out_len || len < 0 || (len % 4)) {
         return -EINVAL;
-    } else {
+    }
+    *out_len = 0;
+    if (len == 0) {
         return 0;
     }
+    const uint8_t *in = (const uint8_t *)src;
+    int needed = (len / 4) * 3 - (src[len - 1] == '=') - (src[len - 1] == '=' && src[len - 2] == '=');
+    if (dest_len < needed) {
+        *out_len = needed;
+        return -EINVAL;
+    }
+    uint8_t *out = (uint8_t *)dest;
+    int full = len / 4 - 1;
+    for (int i = 0; i < full; i++, in += 4, out += 3) {
+        if (b64_decode_quad(in, out) < 0) {
+            return -EINVAL;
+        }
+    }
+    if (b64_decode_last_quad(in, out) < 0) {
+        return -EINVAL;
+    }
+    *out_len = needed;
+    return 0;
+}
+
+/**
+ * @brief transform base64 data to bin data, in place
+ */
+int esp_mfi_base64_decode_inplace(char *buf, int len, int *out_len)
+{
+    /* Every 4 characters turn into at most 3 bytes, so the output never overtakes the input */
+    return esp_mfi_base64_decode(buf, len, buf, len, out_len);
+}
+
+/**
+ * @brief initialise a base64 streaming context
+ */
+void esp_mfi_base64_stream_init(esp_mfi_base64_ctx_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/**
+ * @brief transform a chunk of bin data to base64 data
+ */
+int esp_mfi_base64_encode_update(esp_mfi_base64_ctx_t *ctx, const char *src, int len,
+        char *dest, int dest_len, int *out_len)
+{
+    if (!ctx || (!src && len) || !dest || !out_len || len < 0) {
+        return -EINVAL;
+    }
+    int needed = ((ctx->part_len + len) / 3) * 4;
+    if (dest_len < needed) {
+        *out_len = needed;
+        return -EINVAL;
+    }
+    const uint8_t *in = (const uint8_t *)src;
+    char *out = dest;
+    /* Complete the triple left over from the previous chunk first */
+    if (ctx->part_len) {
+        while (ctx->part_len < 3 && len) {
+            ctx->part[ctx->part_len++] = *in++;
+            len--;
+        }
+        if (ctx->part_len < 3) {
+            *out_len = 0;
+            return 0;
+        }
+        b64_encode_triple(ctx->part, out);
+        out += 4;
+        ctx->part_len = 0;
+    }
+    for (; len >= 3; len -= 3, in += 3, out += 4) {
+        b64_encode_triple(in, out);
+    }
+    memcpy(ctx->part, in, len);
+    ctx->part_len = len;
+    *out_len = out - dest;
+    return 0;
+}
+
+/**
+ * @brief finish a base64 encoding stream
+ */
+int esp_mfi_base64_encode_finish(esp_mfi_base64_ctx_t *ctx, char *dest, int dest_len, int *out_len)
+{
+    if (!ctx || !dest || !out_len) {
+        return -EINVAL;
+    }
+    *out_len = ctx->part_len ? 4 : 0;
+    if (dest_len < *out_len) {
+        return -EINVAL;
+    }
+    if (ctx->part_len) {
+        b64_encode_tail(ctx->part, ctx->part_len, dest);
+    }
+    ctx->part_len = 0;
+    return 0;
+}
+
+/**
+ * @brief transform a chunk of base64 data to bin data
+ */
+int esp_mfi_base64_decode_update(esp_mfi_base64_ctx_t *ctx, const char *src, int len,
+        char *dest, int dest_len, int *out_len)
+{
+    if (!ctx || (!src && len) || !dest || !out_len || len < 0) {
+        return -EINVAL;
+    }
+    *out_len = 0;
+    /* Nothing can follow the padding */
+    if (ctx->done) {
+        return len ? -EINVAL : 0;
+    }
+    if (dest_len < ((ctx->part_len + len) / 4) * 3) {
+        *out_len = ((ctx->part_len + len) / 4) * 3;
+        return -EINVAL;
+    }
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dest;
+    while (len) {
+        const uint8_t *quad;
+        if (ctx->part_len || len < 4) {
+            while (ctx->part_len < 4 && len) {
+                ctx->part[ctx->part_len++] = *in++;
+                len--;
+            }
+            if (ctx->part_len < 4) {
+                break;
+            }
+            quad = ctx->part;
+            ctx->part_len = 0;
+        } else {
+            quad = in;
+            in += 4;
+            len -= 4;
+        }
+        int ret;
+        if (quad[3] == '=') {
+            ret = b64_decode_last_quad(quad, out);
+            ctx->done = true;
+            if (len) {
+                return -EINVAL;
+            }
+        } else {
+            ret = b64_decode_quad(quad, out);
+        }
+        if (ret < 0) {
+            return -EINVAL;
+        }
+        out += ret;
+    }
+    *out_len = out - (uint8_t *)dest;
+    return 0;
+}
+
+/**
+ * @brief finish a base64 decoding stream
+ */
+int esp_mfi_base64_decode_finish(esp_mfi_base64_ctx_t *ctx)
+{
+    if (!ctx || ctx->part_len) {
+        return -EINVAL;
+    }
+    return 0;
 }
@@ -22,22 +22,47 @@
  *
  */
 #include <esp_http_server.h>
+#include <hap_platform_os.h>
+
+#include <esp_log.h>
+#include <lwip/sockets.h>
+
+static const char *TAG = "hap_platform_httpd";
 
 httpd_handle_t *int_handle;
+
+#ifdef CONFIG_HAP_HTTP_TCP_NODELAY
+/* Called by the HTTP Server for every socket it accepts */
+static esp_err_t hap_platform_httpd_open(httpd_handle_t hd, int sockfd)
+{
+    (void)hd;
+    const int yes = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+        /* Not fatal, the session just gets Nagle's algorithm */
+        ESP_LOGW(TAG, "setsockopt failed for TCP_NODELAY on socket %d", sockfd);
+    }
+    return ESP_OK;
+}
+#endif
+
 int hap_platform_httpd_start(httpd_handle_t *handle)
 {
     httpd_config_t config = {
-        .task_priority  = tskIDLE_PRIORITY+5,
+        .task_priority      = tskIDLE_PRIORITY + CONFIG_HAP_HTTP_TASK_PRIORITY,
         .stack_size         = CONFIG_HAP_HTTP_STACK_SIZE,
         .server_port        = CONFIG_HAP_HTTP_SERVER_PORT,
         .ctrl_port          = CONFIG_HAP_HTTP_CONTROL_PORT,
         .max_open_sockets   = CONFIG_HAP_HTTP_MAX_OPEN_SOCKETS,
         .max_uri_handlers   = CONFIG_HAP_HTTP_MAX_URI_HANDLERS,
-        .max_resp_headers   = 8,
-        .backlog_conn       = 5,
+        .max_resp_headers   = CONFIG_HAP_HTTP_MAX_RESP_HEADERS,
+        .backlog_conn       = CONFIG_HAP_HTTP_BACKLOG_CONN,
         .lru_purge_enable   = true,
-        .recv_wait_timeout  = 5,
-        .send_wait_timeout  = 5,
+        .core_id            = HAP_PLATFORM_TASK_CORE_ID,
+        .recv_wait_timeout  = CONFIG_HAP_HTTP_RECV_WAIT_TIMEOUT,
+        .send_wait_timeout  = CONFIG_HAP_HTTP_SEND_WAIT_TIMEOUT,
+#ifdef CONFIG_HAP_HTTP_TCP_NODELAY
+        .open_fn            = hap_platform_httpd_open,
+#endif
     };
     esp_err_t err =  httpd_start(handle, &config);
     if (err == ESP_OK) {
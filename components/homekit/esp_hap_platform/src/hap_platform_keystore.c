@@ -24,10 +24,129 @@
 #include <esp_log.h>
 #include <nvs_flash.h>
 #include <string.h>
-
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <hap_platform_keystore.h>
 
 static const char *TAG = "hap_platform_keystore";
 
+/* Namespace handles are kept open across calls, instead of an open and close
+ * around every access. Boot alone reads dozens of keys from the same couple
+ * of namespaces. A handle is opened read-only until something is written, so
+ * that reads never create namespaces. The least recently used one is closed
+ * when the cache is full.
+ */
+#ifdef CONFIG_HAP_PLATFORM_KEYSTORE_HANDLE_CACHE
+#define HAP_KEYSTORE_HANDLE_CACHE   CONFIG_HAP_PLATFORM_KEYSTORE_HANDLE_CACHE
+#else
+#define HAP_KEYSTORE_HANDLE_CACHE   4
+#endif
+#define HAP_KEYSTORE_PART_NAME_LEN  17  /* Partition label and terminator */
+
+typedef struct {
+    char part_name[HAP_KEYSTORE_PART_NAME_LEN];
+    char name_space[NVS_KEY_NAME_MAX_SIZE];
+    nvs_handle handle;
+    uint32_t last_use;
+    bool writable;
+    bool used;
+} hap_keystore_handle_t;
+
+static hap_keystore_handle_t hap_keystore_handles[HAP_KEYSTORE_HANDLE_CACHE];
+static uint32_t hap_keystore_use_cnt;
+static SemaphoreHandle_t hap_keystore_cache_mutex;
+static StaticSemaphore_t hap_keystore_cache_mutex_buf;
+
+static void hap_keystore_cache_init(void)
+{
+    if (!hap_keystore_cache_mutex) {
+        hap_keystore_cache_mutex = xSemaphoreCreateMutexStatic(&hap_keystore_cache_mutex_buf);
+    }
+}
+
+static void hap_keystore_cache_lock(void)
+{
+    xSemaphoreTake(hap_keystore_cache_mutex, portMAX_DELAY);
+}
+
+static void hap_keystore_cache_unlock(void)
+{
+    xSemaphoreGive(hap_keystore_cache_mutex);
+}
+
+static void hap_keystore_handle_close(hap_keystore_handle_t *entry)
+{
+    if (entry->writable) {
+        nvs_commit(entry->handle);
+    }
+    nvs_close(entry->handle);
+    entry->used = false;
+}
+
+/* Closes the cached handles of a partition, or all of them for NULL */
+static void hap_keystore_handle_close_all(const char *part_name)
+{
+    int i;
+    for (i = 0; i < HAP_KEYSTORE_HANDLE_CACHE; i++) {
+        hap_keystore_handle_t *entry = &hap_keystore_handles[i];
+        if (entry->used && (!part_name || !strcmp(entry->part_name, part_name))) {
+            hap_keystore_handle_close(entry);
+        }
+    }
+}
+
+/* Must be called with the cache locked. The handle stays owned by the cache */
+static esp_err_t hap_keystore_handle_get(const char *part_name, const char *name_space, bool writable,
+        nvs_handle *handle)
+{
+    hap_keystore_handle_t *entry = NULL;
+    int i;
+    if ((strlen(part_name) >= HAP_KEYSTORE_PART_NAME_LEN) || (strlen(name_space) >= NVS_KEY_NAME_MAX_SIZE)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (i = 0; i < HAP_KEYSTORE_HANDLE_CACHE; i++) {
+        hap_keystore_handle_t *cur = &hap_keystore_handles[i];
+        if (cur->used && !strcmp(cur->name_space, name_space) && !strcmp(cur->part_name, part_name)) {
+            entry = cur;
+            break;
+        }
+    }
+    if (entry && (entry->writable || !writable)) {
+        entry->last_use = ++hap_keystore_use_cnt;
+        *handle = entry->handle;
+        return ESP_OK;
+    }
+    if (!entry) {
+        /* A free slot, or else the least recently used one */
+        for (i = 0; i < HAP_KEYSTORE_HANDLE_CACHE; i++) {
+            hap_keystore_handle_t *cur = &hap_keystore_handles[i];
+            if (!cur->used) {
+                entry = cur;
+                break;
+            }
+            if (!entry || (cur->last_use < entry->last_use)) {
+                entry = cur;
+            }
+        }
+    }
+    /* Either evicted, or only open for reading so far and now needed for writing */
+    if (entry->used) {
+        hap_keystore_handle_close(entry);
+    }
+    esp_err_t err = nvs_open_from_partition(part_name, name_space,
+            writable ? NVS_READWRITE : NVS_READONLY, &entry->handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    strcpy(entry->part_name, part_name);
+    strcpy(entry->name_space, name_space);
+    entry->writable = writable;
+    entry->used = true;
+    entry->last_use = ++hap_keystore_use_cnt;
+    *handle = entry->handle;
+    return ESP_OK;
+}
+
 char * hap_platform_keystore_get_nvs_partition_name()
 {
     return CONFIG_HAP_PLATFORM_DEF_NVS_RUNTIME_PARTITION;
@@ -42,6 +161,7 @@ char * hap_platform_keystore_get_factory_nvs_partition_name()
 int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
 {
     esp_err_t err;
+    hap_keystore_cache_init();
     nvs_sec_cfg_t *cfg = NULL;
     nvs_sec_cfg_t sec_cfg;
     esp_partition_iterator_t iterator = esp_partition_find(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS_KEYS, NULL);
@@ -79,6 +199,7 @@ int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
 int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
 {
     esp_err_t err;
+    hap_keystore_cache_init();
     if (read_only) {
         err = nvs_flash_init_partition(part_name);
     } else {
@@ -98,24 +219,42 @@ int hap_platform_keystore_init_partition(const char *part_name, bool read_only)
 int hap_platform_keystore_get(const char *part_name, const char *name_space, const char *key, uint8_t *val, size_t *val_size)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READONLY, &handle);
-    if (err != ESP_OK) {
-        return -1;
-    } else {
+    hap_keystore_cache_lock();
+    esp_err_t err = hap_keystore_handle_get(part_name, name_space, false, &handle);
+    if (err == ESP_OK) {
         err = nvs_get_blob(handle, key, val, val_size);
-        nvs_close(handle);
     }
+    hap_keystore_cache_unlock();
     if (err == ESP_OK) {
         return 0;
     }
     return -1;
 }
 
+int hap_platform_keystore_get_multi(const char *part_name, const char *name_space,
+        hap_platform_keystore_item_t *items, int count)
+{
+    nvs_handle handle;
+    int i, found = 0;
+    hap_keystore_cache_lock();
+    esp_err_t err = hap_keystore_handle_get(part_name, name_space, false, &handle);
+    for (i = 0; i < count; i++) {
+        items[i].status = -1;
+        if ((err == ESP_OK) && (nvs_get_blob(handle, items[i].key, items[i].val, &items[i].val_size) == ESP_OK)) {
+            items[i].status = 0;
+            found++;
+        }
+    }
+    hap_keystore_cache_unlock();
+    return found;
+}
+
 int hap_platform_keystore_set(const char *part_name, const char *name_space, const char *key, const uint8_t *val, const size_t val_len)
 
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    hap_keystore_cache_lock();
+    esp_err_t err = hap_keystore_handle_get(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
     } else {
@@ -125,8 +264,8 @@ int hap_platform_keystore_set(const char *part_name, const char *name_space, con
         } else {
             nvs_commit(handle);
         }
-        nvs_close(handle);
     }
+    hap_keystore_cache_unlock();
     if (err == ESP_OK) {
         return 0;
     }
@@ -136,7 +275,8 @@ int hap_platform_keystore_set(const char *part_name, const char *name_space, con
 int hap_platform_keystore_delete(const char *part_name, const char *name_space, const char *key)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    hap_keystore_cache_lock();
+    esp_err_t err = hap_keystore_handle_get(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
     } else {
@@ -146,8 +286,8 @@ int hap_platform_keystore_delete(const char *part_name, const char *name_space,
         } else {
             nvs_commit(handle);
         }
-        nvs_close(handle);
     }
+    hap_keystore_cache_unlock();
     if (err == ESP_OK) {
         return 0;
     }
@@ -157,7 +297,8 @@ int hap_platform_keystore_delete(const char *part_name, const char *name_space,
 int hap_platform_keystore_delete_namespace(const char *part_name, const char *name_space)
 {
     nvs_handle handle;
-    esp_err_t err = nvs_open_from_partition(part_name, name_space, NVS_READWRITE, &handle);
+    hap_keystore_cache_lock();
+    esp_err_t err = hap_keystore_handle_get(part_name, name_space, true, &handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Error (%d) opening NVS handle!", err);
     } else {
@@ -167,17 +308,28 @@ int hap_platform_keystore_delete_namespace(const char *part_name, const char *na
         } else {
             nvs_commit(handle);
         }
-        nvs_close(handle);
     }
+    hap_keystore_cache_unlock();
     if (err == ESP_OK) {
         return 0;
     }
     return -1;
 }
 
+void hap_platform_keystore_flush(void)
+{
+    hap_keystore_cache_lock();
+    hap_keystore_handle_close_all(NULL);
+    hap_keystore_cache_unlock();
+}
+
 int hap_platfrom_keystore_erase_partition(const char *part_name)
 {
+    /* The handles into the partition do not survive the erase */
+    hap_keystore_cache_lock();
+    hap_keystore_handle_close_all(part_name);
     esp_err_t err = nvs_flash_erase_partition(part_name);
+    hap_keystore_cache_unlock();
     if (err == ESP_OK) {
         return 0;
     }
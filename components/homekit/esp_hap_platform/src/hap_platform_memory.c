@@ -22,18 +22,298 @@
  *
  */
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_heap_caps.h>
+#include <hap_platform_memory.h>
 
-void * hap_platform_memory_malloc(size_t size)
+#ifdef CONFIG_HAP_MEM_STATS_ENABLE
+static hap_platform_memory_stats_t hap_mem_stats;
+static portMUX_TYPE hap_mem_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void hap_mem_stats_record_alloc(const void *site, size_t size, bool from_heap)
+{
+    int i;
+    portENTER_CRITICAL_SAFE(&hap_mem_stats_lock);
+    hap_mem_stats.allocs++;
+    if (from_heap) {
+        hap_mem_stats.heap_allocs++;
+    }
+    for (i = 0; i < hap_mem_stats.num_sites; i++) {
+        if (hap_mem_stats.sites[i].site == site) {
+            break;
+        }
+    }
+    if (i == hap_mem_stats.num_sites && i < HAP_PLATFORM_MEMORY_MAX_SITES) {
+        hap_mem_stats.sites[i].site = site;
+        hap_mem_stats.num_sites++;
+    }
+    if (i < hap_mem_stats.num_sites) {
+        hap_mem_stats.sites[i].allocs++;
+        if (size > hap_mem_stats.sites[i].max_size) {
+            hap_mem_stats.sites[i].max_size = size;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&hap_mem_stats_lock);
+}
+
+static void hap_mem_stats_record_free()
+{
+    portENTER_CRITICAL_SAFE(&hap_mem_stats_lock);
+    hap_mem_stats.frees++;
+    portEXIT_CRITICAL_SAFE(&hap_mem_stats_lock);
+}
+#else
+#define hap_mem_stats_record_alloc(site, size, from_heap)  ((void)(site), (void)(from_heap))
+#define hap_mem_stats_record_free()
+#endif /* CONFIG_HAP_MEM_STATS_ENABLE */
+
+/* Bulk buffers skip the pools when they can go to PSRAM instead */
+static inline bool hap_mem_to_psram(size_t size, hap_platform_memory_caps_t caps)
 {
+#ifdef CONFIG_HAP_MEM_PSRAM_BULK
+    return (caps == HAP_MEM_CAPS_BULK) && (size >= CONFIG_HAP_MEM_PSRAM_MIN_SIZE);
+#else
+    return false;
+#endif
+}
+
+static void *hap_mem_heap_alloc(size_t size, hap_platform_memory_caps_t caps)
+{
+    if (hap_mem_to_psram(size, caps)) {
+        void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (ptr) {
+            return ptr;
+        }
+        /* PSRAM is full, internal RAM will have to do */
+        return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+    if (caps == HAP_MEM_CAPS_INTERNAL) {
+        return heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
     return malloc(size);
 }
 
-void * hap_platform_memory_calloc(size_t count, size_t size)
+#ifdef CONFIG_HAP_MEM_POOL_ENABLE
+
+/* Small allocations of the HomeKit core come from a few static pools of fixed size
+ * blocks, so that they cost constant time and do not fragment the heap over long
+ * uptimes. Requests which do not fit in any pool (or when all suitable pools are
+ * exhausted) fall back to the heap.
+ */
+#define HAP_MEM_POOL_ALIGN(x)   (((x) + 7) & ~((size_t)7))
+#define HAP_MEM_POOL_CNT        3
+
+#define HAP_MEM_POOL0_BLOCK     HAP_MEM_POOL_ALIGN(CONFIG_HAP_MEM_POOL_SMALL_BLOCK_SIZE)
+#define HAP_MEM_POOL1_BLOCK     HAP_MEM_POOL_ALIGN(CONFIG_HAP_MEM_POOL_MEDIUM_BLOCK_SIZE)
+#define HAP_MEM_POOL2_BLOCK     HAP_MEM_POOL_ALIGN(CONFIG_HAP_MEM_POOL_LARGE_BLOCK_SIZE)
+
+typedef struct hap_mem_block {
+    struct hap_mem_block *next;
+} hap_mem_block_t;
+
+typedef struct {
+    uint8_t *base;
+    size_t block_size;
+    size_t block_cnt;
+    hap_mem_block_t *free_list;
+    size_t in_use;
+    size_t peak;
+} hap_mem_pool_t;
+
+static uint8_t hap_mem_pool0_buf[HAP_MEM_POOL0_BLOCK * CONFIG_HAP_MEM_POOL_SMALL_BLOCK_CNT] __attribute__((aligned(8)));
+static uint8_t hap_mem_pool1_buf[HAP_MEM_POOL1_BLOCK * CONFIG_HAP_MEM_POOL_MEDIUM_BLOCK_CNT] __attribute__((aligned(8)));
+static uint8_t hap_mem_pool2_buf[HAP_MEM_POOL2_BLOCK * CONFIG_HAP_MEM_POOL_LARGE_BLOCK_CNT] __attribute__((aligned(8)));
+
+/* Sorted by block size, smallest first */
+static hap_mem_pool_t hap_mem_pools[HAP_MEM_POOL_CNT] = {
+    { .base = hap_mem_pool0_buf, .block_size = HAP_MEM_POOL0_BLOCK, .block_cnt = CONFIG_HAP_MEM_POOL_SMALL_BLOCK_CNT },
+    { .base = hap_mem_pool1_buf, .block_size = HAP_MEM_POOL1_BLOCK, .block_cnt = CONFIG_HAP_MEM_POOL_MEDIUM_BLOCK_CNT },
+    { .base = hap_mem_pool2_buf, .block_size = HAP_MEM_POOL2_BLOCK, .block_cnt = CONFIG_HAP_MEM_POOL_LARGE_BLOCK_CNT },
+};
+static bool hap_mem_pools_init_done;
+static portMUX_TYPE hap_mem_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Must be called with hap_mem_pool_lock held */
+static void hap_mem_pools_init()
 {
-    return calloc(count, size);
+    int i;
+    size_t j;
+    for (i = 0; i < HAP_MEM_POOL_CNT; i++) {
+        hap_mem_pool_t *pool = &hap_mem_pools[i];
+        pool->free_list = NULL;
+        for (j = pool->block_cnt; j > 0; j--) {
+            hap_mem_block_t *block = (hap_mem_block_t *)(pool->base + (j - 1) * pool->block_size);
+            block->next = pool->free_list;
+            pool->free_list = block;
+        }
+    }
+    hap_mem_pools_init_done = true;
+}
+
+static void *hap_mem_pool_alloc(size_t size)
+{
+    int i;
+    void *ptr = NULL;
+    portENTER_CRITICAL_SAFE(&hap_mem_pool_lock);
+    if (!hap_mem_pools_init_done) {
+        hap_mem_pools_init();
+    }
+    /* Use the smallest pool that fits and still has a free block */
+    for (i = 0; i < HAP_MEM_POOL_CNT; i++) {
+        hap_mem_pool_t *pool = &hap_mem_pools[i];
+        if (size <= pool->block_size && pool->free_list) {
+            ptr = pool->free_list;
+            pool->free_list = pool->free_list->next;
+            if (++pool->in_use > pool->peak) {
+                pool->peak = pool->in_use;
+            }
+            break;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&hap_mem_pool_lock);
+    return ptr;
+}
+
+static bool hap_mem_pool_free(void *ptr)
+{
+    int i;
+    for (i = 0; i < HAP_MEM_POOL_CNT; i++) {
+        hap_mem_pool_t *pool = &hap_mem_pools[i];
+        if ((uint8_t *)ptr >= pool->base
+                && (uint8_t *)ptr < pool->base + pool->block_size * pool->block_cnt) {
+            hap_mem_block_t *block = ptr;
+            portENTER_CRITICAL_SAFE(&hap_mem_pool_lock);
+            block->next = pool->free_list;
+            pool->free_list = block;
+            pool->in_use--;
+            portEXIT_CRITICAL_SAFE(&hap_mem_pool_lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *hap_mem_alloc(size_t size, hap_platform_memory_caps_t caps, const void *site)
+{
+    void *ptr = (size && !hap_mem_to_psram(size, caps)) ? hap_mem_pool_alloc(size) : NULL;
+    bool from_heap = !ptr;
+    if (!ptr) {
+        ptr = hap_mem_heap_alloc(size, caps);
+    }
+    if (ptr) {
+        hap_mem_stats_record_alloc(site, size, from_heap);
+    }
+    return ptr;
+}
+
+static void *hap_mem_calloc(size_t count, size_t size, hap_platform_memory_caps_t caps, const void *site)
+{
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    size_t total = count * size;
+    void *ptr = (total && !hap_mem_to_psram(total, caps)) ? hap_mem_pool_alloc(total) : NULL;
+    bool from_heap = !ptr;
+    if (!ptr) {
+        ptr = hap_mem_heap_alloc(total, caps);
+    }
+    if (ptr) {
+        memset(ptr, 0, total);
+        hap_mem_stats_record_alloc(site, total, from_heap);
+    }
+    return ptr;
 }
 
 void hap_platform_memory_free(void *ptr)
 {
+    if (!ptr) {
+        return;
+    }
+    hap_mem_stats_record_free();
+    /* Memory not from the pools (heap fallback, strdup(), etc.) goes back to the heap */
+    if (!hap_mem_pool_free(ptr)) {
+        free(ptr);
+    }
+}
+
+#else /* !CONFIG_HAP_MEM_POOL_ENABLE */
+
+static void *hap_mem_alloc(size_t size, hap_platform_memory_caps_t caps, const void *site)
+{
+    void *ptr = hap_mem_heap_alloc(size, caps);
+    if (ptr) {
+        hap_mem_stats_record_alloc(site, size, true);
+    }
+    return ptr;
+}
+
+static void *hap_mem_calloc(size_t count, size_t size, hap_platform_memory_caps_t caps, const void *site)
+{
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = hap_mem_heap_alloc(count * size, caps);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+        hap_mem_stats_record_alloc(site, count * size, true);
+    }
+    return ptr;
+}
+
+void hap_platform_memory_free(void *ptr)
+{
+    if (ptr) {
+        hap_mem_stats_record_free();
+    }
     free(ptr);
 }
+
+#endif /* CONFIG_HAP_MEM_POOL_ENABLE */
+
+void * hap_platform_memory_malloc(size_t size)
+{
+    return hap_mem_alloc(size, HAP_MEM_CAPS_DEFAULT, __builtin_return_address(0));
+}
+
+void * hap_platform_memory_calloc(size_t count, size_t size)
+{
+    return hap_mem_calloc(count, size, HAP_MEM_CAPS_DEFAULT, __builtin_return_address(0));
+}
+
+void * hap_platform_memory_malloc_caps(size_t size, hap_platform_memory_caps_t caps)
+{
+    return hap_mem_alloc(size, caps, __builtin_return_address(0));
+}
+
+void * hap_platform_memory_calloc_caps(size_t count, size_t size, hap_platform_memory_caps_t caps)
+{
+    return hap_mem_calloc(count, size, caps, __builtin_return_address(0));
+}
+
+int hap_platform_memory_get_stats(hap_platform_memory_stats_t *stats)
+{
+#ifdef CONFIG_HAP_MEM_STATS_ENABLE
+    portENTER_CRITICAL_SAFE(&hap_mem_stats_lock);
+    *stats = hap_mem_stats;
+    portEXIT_CRITICAL_SAFE(&hap_mem_stats_lock);
+    stats->num_pools = 0;
+#ifdef CONFIG_HAP_MEM_POOL_ENABLE
+    int i;
+    portENTER_CRITICAL_SAFE(&hap_mem_pool_lock);
+    for (i = 0; i < HAP_MEM_POOL_CNT && i < HAP_PLATFORM_MEMORY_MAX_POOLS; i++) {
+        stats->pools[i].block_size = hap_mem_pools[i].block_size;
+        stats->pools[i].block_cnt = hap_mem_pools[i].block_cnt;
+        stats->pools[i].in_use = hap_mem_pools[i].in_use;
+        stats->pools[i].peak = hap_mem_pools[i].peak;
+        stats->num_pools++;
+    }
+    portEXIT_CRITICAL_SAFE(&hap_mem_pool_lock);
+#endif
+    return 0;
+#else
+    return -1;
+#endif /* CONFIG_HAP_MEM_STATS_ENABLE */
+}
@@ -0,0 +1,144 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sdkconfig.h>
+#include <esp_timer.h>
+#include <esp_http_server.h>
+#include <hap_platform_httpd.h>
+#include <hap_platform_trace.h>
+#ifdef CONFIG_HAP_TRACE_SYSVIEW
+#include <SEGGER_SYSVIEW.h>
+#endif
+
+static const char *hap_trace_point_names[HAP_TRACE_POINT_MAX] = {
+    [HAP_TRACE_HTTPD_RECV]          = "httpd_recv",
+    [HAP_TRACE_DECRYPT]             = "decrypt",
+    [HAP_TRACE_SET_CHAR]            = "set_char",
+    [HAP_TRACE_APP_WRITE]           = "app_write",
+    [HAP_TRACE_APP_ENQUEUE]         = "app_enqueue",
+    [HAP_TRACE_APP_DEQUEUE]         = "app_dequeue",
+    [HAP_TRACE_APP_ACTUATE]         = "app_actuate",
+    [HAP_TRACE_QUEUE_EVENT]         = "queue_event",
+    [HAP_TRACE_SEND_NOTIFICATION]   = "send_notification",
+    [HAP_TRACE_ENCRYPT]             = "encrypt",
+};
+
+const char *hap_platform_trace_point_name(hap_trace_point_t point)
+{
+    if (point >= HAP_TRACE_POINT_MAX) {
+        return "unknown";
+    }
+    return hap_trace_point_names[point];
+}
+
+#ifdef CONFIG_HAP_TRACE_RINGBUF
+#define HAP_TRACE_BUF_ENTRIES   (1 << CONFIG_HAP_TRACE_BUF_ENTRIES_LOG2)
+static hap_trace_entry_t hap_trace_buf[HAP_TRACE_BUF_ENTRIES];
+/* Total number of entries ever recorded, the low bits index the ring */
+static uint32_t hap_trace_head;
+
+void hap_platform_trace_record(hap_trace_point_t point, hap_trace_kind_t kind, uint16_t arg)
+{
+    /* Claim a slot first, so that concurrent writers never share one */
+    uint32_t idx = __atomic_fetch_add(&hap_trace_head, 1, __ATOMIC_RELAXED);
+    hap_trace_entry_t *entry = &hap_trace_buf[idx & (HAP_TRACE_BUF_ENTRIES - 1)];
+    entry->timestamp_us = (uint32_t)esp_timer_get_time();
+    entry->point = point;
+    entry->kind = kind;
+    entry->arg = arg;
+}
+
+size_t hap_platform_trace_read(hap_trace_entry_t *entries, size_t max_entries)
+{
+    uint32_t head = __atomic_load_n(&hap_trace_head, __ATOMIC_RELAXED);
+    uint32_t count = (head < HAP_TRACE_BUF_ENTRIES) ? head : HAP_TRACE_BUF_ENTRIES;
+    if (count > max_entries) {
+        count = max_entries;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i] = hap_trace_buf[(head - count + i) & (HAP_TRACE_BUF_ENTRIES - 1)];
+    }
+    return count;
+}
+#elif defined(CONFIG_HAP_TRACE_SYSVIEW)
+void hap_platform_trace_record(hap_trace_point_t point, hap_trace_kind_t kind, uint16_t arg)
+{
+    /* Points show up as SystemView user events, with hap_trace_point_t as the id */
+    if (kind != HAP_TRACE_KIND_END) {
+        SEGGER_SYSVIEW_OnUserStart(point);
+    }
+    if (kind != HAP_TRACE_KIND_BEGIN) {
+        SEGGER_SYSVIEW_OnUserStop(point);
+    }
+}
+
+size_t hap_platform_trace_read(hap_trace_entry_t *entries, size_t max_entries)
+{
+    return 0;
+}
+#else
+size_t hap_platform_trace_read(hap_trace_entry_t *entries, size_t max_entries)
+{
+    return 0;
+}
+#endif /* CONFIG_HAP_TRACE_RINGBUF */
+
+#ifdef CONFIG_HAP_TRACE_HTTP_ENDPOINT
+static esp_err_t hap_trace_http_handler(httpd_req_t *req)
+{
+    static const char kind_chars[] = { 'B', 'E', 'M' };
+    static hap_trace_entry_t entries[HAP_TRACE_BUF_ENTRIES];
+    char line[64];
+
+    /* Copy everything out at once, so that it is a consistent snapshot */
+    size_t count = hap_platform_trace_read(entries, HAP_TRACE_BUF_ENTRIES);
+    httpd_resp_set_type(req, "text/plain");
+    for (size_t i = 0; i < count; i++) {
+        uint32_t delta = i ? (entries[i].timestamp_us - entries[i - 1].timestamp_us) : 0;
+        int len = snprintf(line, sizeof(line), "%u +%u %c %s %u\n",
+                (unsigned)entries[i].timestamp_us, (unsigned)delta,
+                kind_chars[entries[i].kind % sizeof(kind_chars)],
+                hap_platform_trace_point_name(entries[i].point), (unsigned)entries[i].arg);
+        httpd_resp_send_chunk(req, line, len);
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static const httpd_uri_t hap_trace_get = {
+    .uri     = "/debug/trace",
+    .method  = HTTP_GET,
+    .handler = hap_trace_http_handler,
+};
+#endif /* CONFIG_HAP_TRACE_HTTP_ENDPOINT */
+
+void hap_platform_trace_register_http_handler(void)
+{
+#ifdef CONFIG_HAP_TRACE_HTTP_ENDPOINT
+    httpd_handle_t *handle = hap_platform_httpd_get_handle();
+    if (handle) {
+        httpd_register_uri_handler(*handle, &hap_trace_get);
+    }
+#endif
+}
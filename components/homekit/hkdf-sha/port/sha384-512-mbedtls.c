@@ -0,0 +1,181 @@
+/*
+ * ESPRESSIF MIT License
+ *
+ * Copyright (c) 2020 <ESPRESSIF SYSTEMS (SHANGHAI) PTE LTD>
+ *
+ * Permission is hereby granted for use on ESPRESSIF SYSTEMS products only, in which case,
+ * it is free of charge, to any person obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software is furnished
+ * to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * SHA-384 and SHA-512 on top of mbedTLS, which uses the SHA accelerator
+ * on targets where it supports SHA-512, and its own (much faster than
+ * the byte-at-a-time RFC 6234 code) software implementation elsewhere.
+ * Only whole octets are supported, which is all HKDF, HMAC and SRP need.
+ */
+#include "hkdf-sha.h"
+
+#ifdef CONFIG_HKDF_SHA512_USE_MBEDTLS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_timer.h>
+
+#ifdef CONFIG_IDF_TARGET_ESP8266
+#define mbedtls_sha512_starts mbedtls_sha512_starts_ret
+#define mbedtls_sha512_update mbedtls_sha512_update_ret
+#define mbedtls_sha512_finish mbedtls_sha512_finish_ret
+#endif
+
+static int SHA384_512Reset(SHA512Context *context, int is384)
+{
+  if (!context) return shaNull;
+  mbedtls_sha512_init(&context->mbedtls_ctx);
+  context->Computed = 0;
+  context->Corrupted = mbedtls_sha512_starts(&context->mbedtls_ctx, is384) ?
+                       shaBadParam : shaSuccess;
+  return context->Corrupted;
+}
+
+static int SHA384_512Input(SHA512Context *context,
+    const uint8_t *message_array, unsigned int length)
+{
+  if (!context) return shaNull;
+  if (!length) return shaSuccess;
+  if (!message_array) return shaNull;
+  if (context->Computed) return context->Corrupted = shaStateError;
+  if (context->Corrupted) return context->Corrupted;
+
+  if (mbedtls_sha512_update(&context->mbedtls_ctx, message_array, length))
+    context->Corrupted = shaBadParam;
+  return context->Corrupted;
+}
+
+static int SHA384_512FinalBits(SHA512Context *context,
+    uint8_t message_bits, unsigned int length)
+{
+  if (!context) return shaNull;
+  if (!length) return shaSuccess;
+  /* mbedTLS cannot hash partial octets */
+  return context->Corrupted = shaBadParam;
+}
+
+static int SHA384_512ResultN(SHA512Context *context,
+    uint8_t Message_Digest[ ], int HashSize)
+{
+  uint8_t digest[SHA512HashSize];
+
+  if (!context) return shaNull;
+  if (!Message_Digest) return shaNull;
+  if (context->Corrupted) return context->Corrupted;
+
+  if (!context->Computed) {
+    int ret = mbedtls_sha512_finish(&context->mbedtls_ctx, digest);
+    mbedtls_sha512_free(&context->mbedtls_ctx);
+    if (ret)
+      return context->Corrupted = shaBadParam;
+    /* Kept for repeated Result calls, like the portable code does */
+    memcpy(context->Message_Digest, digest, SHA512HashSize);
+    context->Computed = 1;
+  }
+  memcpy(Message_Digest, context->Message_Digest, HashSize);
+  return context->Corrupted;
+}
+
+int SHA384Reset(SHA384Context *context)
+{
+  return SHA384_512Reset(context, 1);
+}
+
+int SHA384Input(SHA384Context *context,
+    const uint8_t *message_array, unsigned int length)
+{
+  return SHA384_512Input(context, message_array, length);
+}
+
+int SHA384FinalBits(SHA384Context *context,
+    uint8_t message_bits, unsigned int length)
+{
+  return SHA384_512FinalBits(context, message_bits, length);
+}
+
+int SHA384Result(SHA384Context *context,
+    uint8_t Message_Digest[SHA384HashSize])
+{
+  return SHA384_512ResultN(context, Message_Digest, SHA384HashSize);
+}
+
+int SHA512Reset(SHA512Context *context)
+{
+  return SHA384_512Reset(context, 0);
+}
+
+int SHA512Input(SHA512Context *context,
+    const uint8_t *message_array, unsigned int length)
+{
+  return SHA384_512Input(context, message_array, length);
+}
+
+int SHA512FinalBits(SHA512Context *context,
+    uint8_t message_bits, unsigned int length)
+{
+  return SHA384_512FinalBits(context, message_bits, length);
+}
+
+int SHA512Result(SHA512Context *context,
+    uint8_t Message_Digest[SHA512HashSize])
+{
+  return SHA384_512ResultN(context, Message_Digest, SHA512HashSize);
+}
+
+int SHA512Benchmark(unsigned int len, unsigned int iterations)
+{
+  uint8_t digest_soft[SHA512HashSize], digest_mbedtls[SHA512HashSize];
+  SHA512SoftContext soft_ctx;
+  SHA512Context ctx;
+  unsigned int i;
+
+  if (!iterations) iterations = 1;
+  uint8_t *buf = malloc(len ? len : 1);
+  if (!buf) return shaNull;
+  for (i = 0; i < len; i++)
+    buf[i] = (uint8_t)i;
+
+  int64_t start = esp_timer_get_time();
+  for (i = 0; i < iterations; i++) {
+    SHA512SoftReset(&soft_ctx);
+    SHA512SoftInput(&soft_ctx, buf, len);
+    SHA512SoftResult(&soft_ctx, digest_soft);
+  }
+  int64_t soft_us = esp_timer_get_time() - start;
+
+  start = esp_timer_get_time();
+  for (i = 0; i < iterations; i++) {
+    SHA512Reset(&ctx);
+    SHA512Input(&ctx, buf, len);
+    SHA512Result(&ctx, digest_mbedtls);
+  }
+  int64_t mbedtls_us = esp_timer_get_time() - start;
+  free(buf);
+
+  printf("SHA-512 %u bytes x %u: portable %lld us/op, mbedTLS %lld us/op%s\n",
+         len, iterations, (long long)(soft_us / iterations), (long long)(mbedtls_us / iterations),
+         memcmp(digest_soft, digest_mbedtls, SHA512HashSize) ? " (DIGEST MISMATCH)" : "");
+  return shaSuccess;
+}
+#endif /* CONFIG_HKDF_SHA512_USE_MBEDTLS */
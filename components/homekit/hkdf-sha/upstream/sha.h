@@ -68,9 +68,20 @@
  *                         and SHA_Maj() macros that are equivalent
  *                         and potentially faster on many systems
  *
+ *    On ESP-IDF, CONFIG_HKDF_SHA512_USE_MBEDTLS makes SHA-384 and
+ *    SHA-512 (and so HKDF-SHA-512) go through mbedTLS, which uses the
+ *    SHA accelerator on targets that have SHA-512 in hardware. The
+ *    portable SHA-512 then remains available as SHA512Soft*().
+ *
  */
 
 #include <stdint.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#ifdef CONFIG_HKDF_SHA512_USE_MBEDTLS
+#include "mbedtls/sha512.h"
+#endif
 /*
  * If you do not have the ISO standard stdint.h header file, then you
  * must typedef the following:
@@ -163,7 +174,7 @@ typedef struct SHA256Context {
  *  This structure will hold context information for the SHA-512
  *  hashing operation.
  */
-typedef struct SHA512Context {
+typedef struct SHA512SoftContext {
 #ifdef USE_32BIT_ONLY
     uint32_t Intermediate_Hash[SHA512HashSize/4]; /* Message Digest  */
     uint32_t Length[4];                 /* Message length in bits */
@@ -176,9 +187,22 @@ typedef struct SHA512Context {
                                         /* 1024-bit message blocks */
     uint8_t Message_Block[SHA512_Message_Block_Size];
 
+    int Computed;                   /* Is the hash computed?*/
+    int Corrupted;                  /* Cumulative corruption code */
+} SHA512SoftContext;
+
+#ifdef CONFIG_HKDF_SHA512_USE_MBEDTLS
+typedef struct SHA512Context {
+    union {
+        mbedtls_sha512_context mbedtls_ctx;
+        uint8_t Message_Digest[SHA512HashSize]; /* Once Computed */
+    };
     int Computed;                   /* Is the hash computed?*/
     int Corrupted;                  /* Cumulative corruption code */
 } SHA512Context;
+#else /* !CONFIG_HKDF_SHA512_USE_MBEDTLS */
+typedef SHA512SoftContext SHA512Context;
+#endif /* CONFIG_HKDF_SHA512_USE_MBEDTLS */
 
 /*
  *  This structure will hold context information for the SHA-224
@@ -190,7 +214,7 @@ typedef struct SHA256Context SHA224Context;
  *  This structure will hold context information for the SHA-384
  *  hashing operation.  It uses the SHA-512 structure for computation.
  */
-typedef struct SHA512Context SHA384Context;
+typedef SHA512Context SHA384Context;
 
 /*
  *  This structure holds context information for all SHA
@@ -285,6 +309,29 @@ extern int SHA512FinalBits(SHA512Context *, uint8_t bits,
 extern int SHA512Result(SHA512Context *,
                         uint8_t Message_Digest[SHA512HashSize]);
 
+#ifdef CONFIG_HKDF_SHA512_USE_MBEDTLS
+/* Portable SHA-384/512, kept for comparison with the mbedTLS backend */
+extern int SHA384SoftReset(SHA512SoftContext *);
+extern int SHA384SoftInput(SHA512SoftContext *, const uint8_t *bytes,
+                           unsigned int bytecount);
+extern int SHA384SoftFinalBits(SHA512SoftContext *, uint8_t bits,
+                               unsigned int bit_count);
+extern int SHA384SoftResult(SHA512SoftContext *,
+                            uint8_t Message_Digest[SHA384HashSize]);
+extern int SHA512SoftReset(SHA512SoftContext *);
+extern int SHA512SoftInput(SHA512SoftContext *, const uint8_t *bytes,
+                           unsigned int bytecount);
+extern int SHA512SoftFinalBits(SHA512SoftContext *, uint8_t bits,
+                               unsigned int bit_count);
+extern int SHA512SoftResult(SHA512SoftContext *,
+                            uint8_t Message_Digest[SHA512HashSize]);
+
+/* Times both SHA-512 backends over a len byte message, and prints the
+ * results. Returns shaSuccess, or shaNull if no buffer could be allocated
+ */
+extern int SHA512Benchmark(unsigned int len, unsigned int iterations);
+#endif /* CONFIG_HKDF_SHA512_USE_MBEDTLS */
+
 /* Unified SHA functions, chosen by whichSha */
 extern int USHAReset(USHAContext *context, SHAversion whichSha);
 extern int USHAInput(USHAContext *context,
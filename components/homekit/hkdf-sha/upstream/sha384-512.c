@@ -45,6 +45,23 @@
 
 #include "sha.h"
 
+#ifdef CONFIG_HKDF_SHA512_USE_MBEDTLS
+/*
+ * The public SHA-384/512 functions come from sha384-512-mbedtls.c,
+ * so the ones below are built as SHA384Soft*() and SHA512Soft*().
+ */
+#define SHA384Context   SHA512SoftContext
+#define SHA512Context   SHA512SoftContext
+#define SHA384Reset     SHA384SoftReset
+#define SHA384Input     SHA384SoftInput
+#define SHA384FinalBits SHA384SoftFinalBits
+#define SHA384Result    SHA384SoftResult
+#define SHA512Reset     SHA512SoftReset
+#define SHA512Input     SHA512SoftInput
+#define SHA512FinalBits SHA512SoftFinalBits
+#define SHA512Result    SHA512SoftResult
+#endif /* CONFIG_HKDF_SHA512_USE_MBEDTLS */
+
 #ifdef USE_32BIT_ONLY
 /*
  * Define 64-bit arithmetic in terms of 32-bit arithmetic.
@@ -32,15 +32,17 @@ static inline int json_gen_get_empty_len(json_gen_str_t *jstr)
 /* This will add the incoming string to the JSON string buffer
  * and flush it out if the buffer is full. Note that the data being
  * flushed out will always be equal to the size of the buffer unless
- * this is the last chunk being flushed out on json_gen_end_str()
+ * this is the last chunk being flushed out on json_gen_end_str().
+ * The common case, where everything fits in the buffer, is a single memcpy()
  */
-static int json_gen_add_to_str(json_gen_str_t *jstr, char *str)
+static int json_gen_add_mem(json_gen_str_t *jstr, const char *str, int len)
 {
-    if (!str) {
-        return 0;
-    }
-	int len = strlen(str);
-	char *cur_ptr = str;
+	if (len <= json_gen_get_empty_len(jstr)) {
+		memcpy(jstr->free_ptr, str, len);
+		jstr->free_ptr += len;
+		return 0;
+	}
+	const char *cur_ptr = str;
 	while (1) {
 		int len_remaining = json_gen_get_empty_len(jstr);
 		int copy_len = len_remaining > len ? len : len_remaining;
@@ -64,7 +66,98 @@ static int json_gen_add_to_str(json_gen_str_t *jstr, char *str)
 	return 0;
 }
 
+/* For string literals, whose length is known at compile time */
+#define json_gen_add_lit(jstr, lit) json_gen_add_mem(jstr, lit, sizeof(lit) - 1)
 
+static int json_gen_add_to_str(json_gen_str_t *jstr, char *str)
+{
+    if (!str) {
+        return 0;
+    }
+	return json_gen_add_mem(jstr, str, strlen(str));
+}
+
+/* Writes the decimal representation of "val" backwards, ending just before "end".
+ * Returns the start of the digits.
+ */
+static char *json_gen_utoa_rev(uint64_t val, char *end)
+{
+	do {
+		*--end = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+	return end;
+}
+
+static int json_gen_itoa(int val, char *str)
+{
+	char tmp[MAX_INT_IN_STR];
+	char *end = tmp + sizeof(tmp);
+	/* Negate as unsigned, so that INT_MIN works too */
+	uint32_t uval = (val < 0) ? (0U - (uint32_t)val) : (uint32_t)val;
+	char *start = json_gen_utoa_rev(uval, end);
+	if (val < 0) {
+		*--start = '-';
+	}
+	int len = end - start;
+	memcpy(str, start, len);
+	return len;
+}
+
+/* Fixed precision formatting equivalent to "%.*f" with JSON_FLOAT_PRECISION,
+ * for values which fit in a 64 bit integer after scaling. Returns -1 for
+ * anything else (including NaN and infinities), so that snprintf() handles it.
+ * Like printf(), it rounds the exact binary value, with halfway cases going
+ * to the even digit (e.g. 18993.640625 gives 18993.64062).
+ */
+static int json_gen_ftoa(float val, char *str)
+{
+#if JSON_FLOAT_PRECISION <= 9
+	static const uint32_t scale_tbl[] = { 1, 10, 100, 1000, 10000, 100000,
+		1000000, 10000000, 100000000, 1000000000 };
+	const uint32_t scale = scale_tbl[JSON_FLOAT_PRECISION];
+	double d = val;
+	bool neg = d < 0;
+	if (neg) {
+		d = -d;
+	}
+	/* Exact, since a float times 10^n, n <= 9, fits in a double's mantissa */
+	double scaled = d * scale;
+	/* Also rejects NaN, since comparisons with it are false */
+	if (!(scaled < 1e18)) {
+		return -1;
+	}
+	uint64_t fixed = (uint64_t)scaled;
+	double rem = scaled - (double)fixed;
+	if ((rem > 0.5) || ((rem == 0.5) && (fixed & 1))) {
+		fixed++;
+	}
+	uint64_t int_part = fixed / scale;
+	uint32_t frac_part = fixed % scale;
+
+	char tmp[MAX_FLOAT_IN_STR];
+	char *end = tmp + sizeof(tmp);
+	char *start = end;
+	int i;
+	for (i = 0; i < JSON_FLOAT_PRECISION; i++) {
+		*--start = '0' + (frac_part % 10);
+		frac_part /= 10;
+	}
+	if (JSON_FLOAT_PRECISION) {
+		*--start = '.';
+	}
+	start = json_gen_utoa_rev(int_part, start);
+	/* Values which round to zero are printed without the sign */
+	if (neg && fixed) {
+		*--start = '-';
+	}
+	int len = end - start;
+	memcpy(str, start, len);
+	return len;
+#else
+	return -1;
+#endif
+}
 void json_gen_str_start(json_gen_str_t *jstr, char *buf, int buf_size,
 		json_gen_flush_cb_t flush_cb, void *priv)
 {
@@ -87,15 +180,27 @@ void json_gen_str_end(json_gen_str_t *jstr)
 static inline void json_gen_handle_comma(json_gen_str_t *jstr)
 {
 	if (jstr->comma_req)
-		json_gen_add_to_str(jstr, ",");
+		json_gen_add_lit(jstr, ",");
 }
 
 
 static int json_gen_handle_name(json_gen_str_t *jstr, char *name)
 {
-	json_gen_add_to_str(jstr, "\"");
-	json_gen_add_to_str(jstr, name);
-	return json_gen_add_to_str(jstr, "\":");
+	int len = strlen(name);
+	/* Fast path. Write "name": in one go if it fits */
+	if (len + 3 <= json_gen_get_empty_len(jstr)) {
+		char *p = jstr->free_ptr;
+		*p++ = '"';
+		memcpy(p, name, len);
+		p += len;
+		*p++ = '"';
+		*p++ = ':';
+		jstr->free_ptr = p;
+		return 0;
+	}
+	json_gen_add_lit(jstr, "\"");
+	json_gen_add_mem(jstr, name, len);
+	return json_gen_add_lit(jstr, "\":");
 }
 
 
@@ -103,13 +208,13 @@ int json_gen_start_object(json_gen_str_t *jstr)
 {
 	json_gen_handle_comma(jstr);
 	jstr->comma_req = false;
-	return json_gen_add_to_str(jstr, "{");
+	return json_gen_add_lit(jstr, "{");
 }
 
 int json_gen_end_object(json_gen_str_t *jstr)
 {
 	jstr->comma_req = true;
-	return json_gen_add_to_str(jstr, "}");
+	return json_gen_add_lit(jstr, "}");
 }
 
 
@@ -117,13 +222,13 @@ int json_gen_start_array(json_gen_str_t *jstr)
 {
 	json_gen_handle_comma(jstr);
 	jstr->comma_req = false;
-	return json_gen_add_to_str(jstr, "[");
+	return json_gen_add_lit(jstr, "[");
 }
 
 int json_gen_end_array(json_gen_str_t *jstr)
 {
 	jstr->comma_req = true;
-	return json_gen_add_to_str(jstr, "]");
+	return json_gen_add_lit(jstr, "]");
 }
 
 int json_gen_push_object(json_gen_str_t *jstr, char *name)
@@ -131,13 +236,13 @@ int json_gen_push_object(json_gen_str_t *jstr, char *name)
 	json_gen_handle_comma(jstr);
 	json_gen_handle_name(jstr, name);
 	jstr->comma_req = false;
-	return json_gen_add_to_str(jstr, "{");
+	return json_gen_add_lit(jstr, "{");
 }
 
 int json_gen_pop_object(json_gen_str_t *jstr)
 {
 	jstr->comma_req = true;
-	return json_gen_add_to_str(jstr, "}");
+	return json_gen_add_lit(jstr, "}");
 }
 
 int json_gen_push_object_str(json_gen_str_t *jstr, char *name, char *object_str)
@@ -153,12 +258,12 @@ int json_gen_push_array(json_gen_str_t *jstr, char *name)
 	json_gen_handle_comma(jstr);
 	json_gen_handle_name(jstr, name);
 	jstr->comma_req = false;
-	return json_gen_add_to_str(jstr, "[");
+	return json_gen_add_lit(jstr, "[");
 }
 int json_gen_pop_array(json_gen_str_t *jstr)
 {
 	jstr->comma_req = true;
-	return json_gen_add_to_str(jstr, "]");
+	return json_gen_add_lit(jstr, "]");
 }
 
 int json_gen_push_array_str(json_gen_str_t *jstr, char *name, char *array_str)
@@ -173,9 +278,9 @@ static int json_gen_set_bool(json_gen_str_t *jstr, bool val)
 {
 	jstr->comma_req = true;
 	if (val)
-		return json_gen_add_to_str(jstr, "true");
+		return json_gen_add_lit(jstr, "true");
 	else
-		return json_gen_add_to_str(jstr, "false");
+		return json_gen_add_lit(jstr, "false");
 }
 int json_gen_obj_set_bool(json_gen_str_t *jstr, char *name, bool val)
 {
@@ -194,8 +299,7 @@ static int json_gen_set_int(json_gen_str_t *jstr, int val)
 {
 	jstr->comma_req = true;
 	char str[MAX_INT_IN_STR];
-	snprintf(str, MAX_INT_IN_STR, "%d", val);
-	return json_gen_add_to_str(jstr, str);
+	return json_gen_add_mem(jstr, str, json_gen_itoa(val, str));
 }
 
 int json_gen_obj_set_int(json_gen_str_t *jstr, char *name, int val)
@@ -216,8 +320,14 @@ static int json_gen_set_float(json_gen_str_t *jstr, float val)
 {
 	jstr->comma_req = true;
 	char str[MAX_FLOAT_IN_STR];
-	snprintf(str, MAX_FLOAT_IN_STR, "%.*f", JSON_FLOAT_PRECISION, val);
-	return json_gen_add_to_str(jstr, str);
+	int len = json_gen_ftoa(val, str);
+	if (len < 0) {
+		len = snprintf(str, MAX_FLOAT_IN_STR, "%.*f", JSON_FLOAT_PRECISION, val);
+		if (len >= MAX_FLOAT_IN_STR) {
+			len = MAX_FLOAT_IN_STR - 1;
+		}
+	}
+	return json_gen_add_mem(jstr, str, len);
 }
 int json_gen_obj_set_float(json_gen_str_t *jstr, char *name, float val)
 {
@@ -234,9 +344,9 @@ int json_gen_arr_set_float(json_gen_str_t *jstr, float val)
 static int json_gen_set_string(json_gen_str_t *jstr, char *val)
 {
 	jstr->comma_req = true;
-	json_gen_add_to_str(jstr, "\"");
+	json_gen_add_lit(jstr, "\"");
 	json_gen_add_to_str(jstr, val);
-	return json_gen_add_to_str(jstr, "\"");
+	return json_gen_add_lit(jstr, "\"");
 }
 
 int json_gen_obj_set_string(json_gen_str_t *jstr, char *name, char *val)
@@ -255,7 +365,7 @@ int json_gen_arr_set_string(json_gen_str_t *jstr, char *val)
 static int json_gen_set_long_string(json_gen_str_t *jstr, char *val)
 {
 	jstr->comma_req = true;
-	json_gen_add_to_str(jstr, "\"");
+	json_gen_add_lit(jstr, "\"");
 	return json_gen_add_to_str(jstr, val);
 }
 
@@ -277,14 +387,19 @@ int json_gen_add_to_long_string(json_gen_str_t *jstr, char *val)
     return json_gen_add_to_str(jstr, val);
 }
 
+int json_gen_add_to_long_string_len(json_gen_str_t *jstr, const char *val, int len)
+{
+    return json_gen_add_mem(jstr, val, len);
+}
+
 int json_gen_end_long_string(json_gen_str_t *jstr)
 {
-    return json_gen_add_to_str(jstr, "\"");
+    return json_gen_add_lit(jstr, "\"");
 }
 static int json_gen_set_null(json_gen_str_t *jstr)
 {
 	jstr->comma_req = true;
-	return json_gen_add_to_str(jstr, "null");
+	return json_gen_add_lit(jstr, "null");
 }
 int json_gen_obj_set_null(json_gen_str_t *jstr, char *name)
 {
@@ -487,6 +487,22 @@ int json_gen_arr_start_long_string(json_gen_str_t *jstr, char *val);
  */
 int json_gen_add_to_long_string(json_gen_str_t *jstr, char *val);
 
+/** Add to a JSON Long string, with a known length
+ *
+ * Same as json_gen_add_to_long_string(), but takes the length of the value instead of
+ * a NULL terminated string, so that it can be copied without scanning it first.
+ *
+ * \param[in] jstr Pointer to the \ref json_gen_str_t structure initialised by json_gen_str_start()
+ * \param[in] val Extending part of the string value. Need not be NULL terminated.
+ * \param[in] len Length of val
+ *
+ * \return 0 on Success
+ * \return -1 if buffer is out of space (possible only if no callback function
+ * is passed to json_gen_str_start(). Else, buffer will be flushed out and new data
+ * added after that
+ */
+int json_gen_add_to_long_string_len(json_gen_str_t *jstr, const char *val, int len);
+
 /** End a JSON Long string
  *
  * This ends the string initialised by json_gen_obj_start_long_string() or
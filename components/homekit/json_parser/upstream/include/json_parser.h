@@ -42,6 +42,66 @@ typedef struct {
 
 int json_parse_start(jparse_ctx_t *jctx, char *js, int len);
 int json_parse_end(jparse_ctx_t *jctx);
+/* Same as json_parse_start(), but the tokens come from tok_buf instead of
+ * the heap. json_parse_end() must not be called for such a context.
+ */
+int json_parse_start_static(jparse_ctx_t *jctx, char *js, int len,
+		void *tok_buf, int tok_buf_size);
+
+/* Token storage kept across parses, so that parsing one request after
+ * another does not allocate each time. It starts empty (zeroed), grows to
+ * the largest document seen and is released with json_tok_pool_free().
+ */
+typedef struct {
+	json_tok_t *tokens;
+	int num_tokens;
+} json_tok_pool_t;
+
+/* Same as json_parse_start(), but the tokens come from the pool. The context
+ * is valid until the next parse with the same pool. json_parse_end() must not
+ * be called for such a context.
+ */
+int json_parse_start_pool(jparse_ctx_t *jctx, char *js, int len, json_tok_pool_t *pool);
+void json_tok_pool_free(json_tok_pool_t *pool);
+
+/* Incremental parsing of a document, for bodies that should not be held in
+ * memory in full. The elements of the top level array named arr_name are
+ * handed over one by one to the callback as soon as they are complete.
+ * They must be objects or arrays. Everything outside that array is kept,
+ * with the array emptied, and parsed by json_stream_end().
+ *
+ * Only the element being received needs to fit in buf. If it does not,
+ * json_stream_get_buf() returns 0 and a bigger buffer can be handed over
+ * with json_stream_set_buf().
+ */
+typedef int (*json_stream_cb_t)(jparse_ctx_t *jctx, void *priv);
+
+typedef struct {
+	char *arr_name;
+	json_stream_cb_t cb;
+	void *priv;
+	char *buf;
+	int buf_size;
+	int len;
+	int elem_start;
+	char *rest;
+	int rest_size;
+	int rest_len;
+	void *tok_buf;
+	int tok_buf_size;
+	int depth;
+	bool in_str;
+	bool escape;
+	bool in_arr;
+} json_stream_t;
+
+void json_stream_start(json_stream_t *stream, char *arr_name, char *buf, int buf_size,
+		char *rest, int rest_size, void *tok_buf, int tok_buf_size,
+		json_stream_cb_t cb, void *priv);
+int json_stream_get_buf(json_stream_t *stream, char **ptr);
+void json_stream_set_buf(json_stream_t *stream, char *buf, int buf_size);
+int json_stream_feed(json_stream_t *stream, int len);
+int json_stream_end(json_stream_t *stream, jparse_ctx_t *jctx);
 
 int json_obj_get_array(jparse_ctx_t *jctx, char *name, int *num_elem);
 int json_obj_leave_array(jparse_ctx_t *jctx);
@@ -51,6 +111,9 @@ int json_obj_get_bool(jparse_ctx_t *jctx, char *name, bool *val);
 int json_obj_get_int(jparse_ctx_t *jctx, char *name, int *val);
 int json_obj_get_int64(jparse_ctx_t *jctx, char *name, int64_t *val);
 int json_obj_get_float(jparse_ctx_t *jctx, char *name, float *val);
+/* Strings come out with their escape sequences resolved. Their lengths are those of
+ * the raw JSON values, which are upper bounds for the resolved ones.
+ */
 int json_obj_get_string(jparse_ctx_t *jctx, char *name, char *val, int size);
 int json_obj_get_strlen(jparse_ctx_t *jctx, char *name, int *strlen);
 int json_obj_get_object_str(jparse_ctx_t *jctx, char *name, char *val, int size);
@@ -100,6 +100,113 @@ static int json_tok_to_string(jparse_ctx_t *jctx, json_tok_t *tok, char *val, in
 	return OS_SUCCESS;
 }
 
+/* Value of the 4 hex digits of a \u escape, or -1 if they are not all there */
+static int json_hex4(const char *p, const char *end)
+{
+	int val = 0;
+	int i;
+	if ((end - p) < 4)
+		return -1;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+		val <<= 4;
+		if ((c >= '0') && (c <= '9'))
+			val |= c - '0';
+		else if ((c >= 'a') && (c <= 'f'))
+			val |= c - 'a' + 10;
+		else if ((c >= 'A') && (c <= 'F'))
+			val |= c - 'A' + 10;
+		else
+			return -1;
+	}
+	return val;
+}
+
+/* Writes a code point as UTF-8. Returns the number of bytes, or 0 if there is no room */
+static int json_put_utf8(char *dst, int room, uint32_t cp)
+{
+	int len = (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+	if (len > room)
+		return 0;
+	switch (len) {
+	case 1:
+		dst[0] = cp;
+		break;
+	case 2:
+		dst[0] = 0xC0 | (cp >> 6);
+		dst[1] = 0x80 | (cp & 0x3F);
+		break;
+	case 3:
+		dst[0] = 0xE0 | (cp >> 12);
+		dst[1] = 0x80 | ((cp >> 6) & 0x3F);
+		dst[2] = 0x80 | (cp & 0x3F);
+		break;
+	default:
+		dst[0] = 0xF0 | (cp >> 18);
+		dst[1] = 0x80 | ((cp >> 12) & 0x3F);
+		dst[2] = 0x80 | ((cp >> 6) & 0x3F);
+		dst[3] = 0x80 | (cp & 0x3F);
+		break;
+	}
+	return len;
+}
+
+/* Copies a string token while resolving its escape sequences, so the value is
+ * walked just once. \u escapes (including surrogate pairs) become UTF-8. The
+ * result is never longer than the token, so the size from json_obj_get_strlen()
+ * (plus 1 for the NULL termination) always fits.
+ */
+static int json_tok_to_unescaped(jparse_ctx_t *jctx, json_tok_t *tok, char *val, int size)
+{
+	const char *src = jctx->js + tok->start;
+	const char *end = jctx->js + tok->end;
+	char *dst = val;
+	char *dst_end = val + size - 1;
+	if (size <= 0)
+		return -OS_FAIL;
+	while (src < end) {
+		char c = *src++;
+		if ((c == '\\') && (src < end)) {
+			c = *src++;
+			switch (c) {
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u': {
+				int cp = json_hex4(src, end);
+				if (cp < 0)
+					return -OS_FAIL;
+				src += 4;
+				/* A high surrogate followed by a low one makes a single code point */
+				if ((cp >= 0xD800) && (cp < 0xDC00) && ((end - src) >= 6) &&
+						(src[0] == '\\') && (src[1] == 'u')) {
+					int low = json_hex4(src + 2, end);
+					if ((low >= 0xDC00) && (low < 0xE000)) {
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+						src += 6;
+					}
+				}
+				int len = json_put_utf8(dst, dst_end - dst, cp);
+				if (!len)
+					return -OS_FAIL;
+				dst += len;
+				continue;
+			}
+			default:
+				/* \", \\ and \/ stand for themselves */
+				break;
+			}
+		}
+		if (dst >= dst_end)
+			return -OS_FAIL;
+		*dst++ = c;
+	}
+	*dst = 0;
+	return OS_SUCCESS;
+}
+
 static json_tok_t *json_obj_search(jparse_ctx_t *jctx, char *key)
 {
 	json_tok_t *tok = jctx->cur;
@@ -213,7 +320,7 @@ int json_obj_get_string(jparse_ctx_t *jctx, char *name, char *val, int size)
 	json_tok_t *tok = json_obj_get_val_tok(jctx, name, JSMN_STRING);
 	if (!tok)
 		return -OS_FAIL;
-	return json_tok_to_string(jctx, tok, val, size);
+	return json_tok_to_unescaped(jctx, tok, val, size);
 }
 
 int json_obj_get_strlen(jparse_ctx_t *jctx, char *name, int *strlen)
@@ -354,7 +461,7 @@ int json_arr_get_string(jparse_ctx_t *jctx, uint32_t index, char *val, int size)
 	json_tok_t *tok = json_arr_get_val_tok(jctx, index, JSMN_STRING);
 	if (!tok)
 		return -OS_FAIL;
-	return json_tok_to_string(jctx, tok, val, size);
+	return json_tok_to_unescaped(jctx, tok, val, size);
 }
 
 int json_arr_get_strlen(jparse_ctx_t *jctx, uint32_t index, int *strlen)
@@ -366,29 +473,79 @@ int json_arr_get_strlen(jparse_ctx_t *jctx, uint32_t index, int *strlen)
 	return OS_SUCCESS;
 }
 
+/* Initial token count for a document of len bytes. Real documents average
+ * well over 4 bytes per token (HAP writes are closer to 8), so this is usually
+ * enough for a single pass. If not, the tokens are grown and parsing resumes
+ * where it stopped, as jsmn allows after JSMN_ERROR_NOMEM.
+ */
+#define JSON_TOK_ESTIMATE(len)	((len) / 4 + 4)
+
+/* Parses js in a single pass into *tokens, growing it as needed.
+ * Returns the number of tokens parsed.
+ */
+static int json_parse_grow(jparse_ctx_t *jctx, char *js, int len,
+		json_tok_t **tokens, int *num_tokens)
+{
+	/* jsmn only counts when given no tokens, so there must be some to begin with */
+	int ret = JSMN_ERROR_NOMEM;
+	if (*tokens && *num_tokens)
+		ret = 0;
+	jsmn_init(&jctx->parser);
+	while (1) {
+		if (ret == JSMN_ERROR_NOMEM) {
+			int new_num = *num_tokens ? *num_tokens * 2 : JSON_TOK_ESTIMATE(len);
+			json_tok_t *new_tokens = realloc(*tokens, new_num * sizeof(json_tok_t));
+			if (!new_tokens)
+				return JSMN_ERROR_NOMEM;
+			*tokens = new_tokens;
+			*num_tokens = new_num;
+		}
+		ret = jsmn_parse(&jctx->parser, js, len, *tokens, *num_tokens);
+		if (ret != JSMN_ERROR_NOMEM)
+			return ret;
+	}
+}
+
 int json_parse_start(jparse_ctx_t *jctx, char *js, int len)
 {
 	memset(jctx, 0, sizeof(jparse_ctx_t));
-	jsmn_init(&jctx->parser);
-	int num_tokens = jsmn_parse(&jctx->parser, js, len, NULL, 0);
-	if (num_tokens <= 0)
-		return -OS_FAIL;
-	jctx->num_tokens = num_tokens;
-	jctx->tokens = calloc(num_tokens, sizeof(json_tok_t));
-	if (!jctx->tokens)
+	json_tok_t *tokens = NULL;
+	int num_tokens = 0;
+	int ret = json_parse_grow(jctx, js, len, &tokens, &num_tokens);
+	if (ret <= 0) {
+		free(tokens);
+		memset(jctx, 0, sizeof(jparse_ctx_t));
 		return -OS_FAIL;
+	}
 	jctx->js = js;
-	jsmn_init(&jctx->parser);
-	int ret = jsmn_parse(&jctx->parser, js, len, jctx->tokens, jctx->num_tokens);
+	jctx->tokens = tokens;
+	jctx->num_tokens = ret;
+	jctx->cur = jctx->tokens;
+	return OS_SUCCESS;
+}
+
+int json_parse_start_pool(jparse_ctx_t *jctx, char *js, int len, json_tok_pool_t *pool)
+{
+	memset(jctx, 0, sizeof(jparse_ctx_t));
+	int ret = json_parse_grow(jctx, js, len, &pool->tokens, &pool->num_tokens);
 	if (ret <= 0) {
-		free(jctx->tokens);
 		memset(jctx, 0, sizeof(jparse_ctx_t));
 		return -OS_FAIL;
 	}
+	jctx->js = js;
+	jctx->tokens = pool->tokens;
+	jctx->num_tokens = ret;
 	jctx->cur = jctx->tokens;
 	return OS_SUCCESS;
 }
 
+void json_tok_pool_free(json_tok_pool_t *pool)
+{
+	free(pool->tokens);
+	pool->tokens = NULL;
+	pool->num_tokens = 0;
+}
+
 int json_parse_end(jparse_ctx_t *jctx)
 {
 	if (jctx->tokens)
@@ -396,3 +553,151 @@ int json_parse_end(jparse_ctx_t *jctx)
 	memset(jctx, 0, sizeof(jparse_ctx_t));
 	return OS_SUCCESS;
 }
+
+int json_parse_start_static(jparse_ctx_t *jctx, char *js, int len,
+		void *tok_buf, int tok_buf_size)
+{
+	memset(jctx, 0, sizeof(jparse_ctx_t));
+	jctx->tokens = tok_buf;
+	jctx->num_tokens = tok_buf_size / sizeof(json_tok_t);
+	jctx->js = js;
+	jsmn_init(&jctx->parser);
+	int ret = jsmn_parse(&jctx->parser, js, len, jctx->tokens, jctx->num_tokens);
+	if (ret <= 0) {
+		memset(jctx, 0, sizeof(jparse_ctx_t));
+		return -OS_FAIL;
+	}
+	jctx->num_tokens = ret;
+	jctx->cur = jctx->tokens;
+	return OS_SUCCESS;
+}
+
+void json_stream_start(json_stream_t *stream, char *arr_name, char *buf, int buf_size,
+		char *rest, int rest_size, void *tok_buf, int tok_buf_size,
+		json_stream_cb_t cb, void *priv)
+{
+	memset(stream, 0, sizeof(json_stream_t));
+	stream->arr_name = arr_name;
+	stream->buf = buf;
+	stream->buf_size = buf_size;
+	stream->elem_start = -1;
+	stream->rest = rest;
+	stream->rest_size = rest_size;
+	stream->tok_buf = tok_buf;
+	stream->tok_buf_size = tok_buf_size;
+	stream->cb = cb;
+	stream->priv = priv;
+}
+
+int json_stream_get_buf(json_stream_t *stream, char **ptr)
+{
+	*ptr = stream->buf + stream->len;
+	return stream->buf_size - stream->len;
+}
+
+void json_stream_set_buf(json_stream_t *stream, char *buf, int buf_size)
+{
+	memmove(buf, stream->buf, stream->len);
+	stream->buf = buf;
+	stream->buf_size = buf_size;
+}
+
+static int json_stream_add_to_rest(json_stream_t *stream, char c)
+{
+	if (stream->rest_len >= stream->rest_size)
+		return -OS_FAIL;
+	stream->rest[stream->rest_len++] = c;
+	return OS_SUCCESS;
+}
+
+/* Checks if the rest collected so far ends with "<arr_name>": */
+static bool json_stream_at_arr_name(json_stream_t *stream)
+{
+	int i = stream->rest_len;
+	int name_len = strlen(stream->arr_name);
+	while (i > 0 && strchr(" \t\r\n", stream->rest[i - 1]))
+		i--;
+	if (i == 0 || stream->rest[--i] != ':')
+		return false;
+	while (i > 0 && strchr(" \t\r\n", stream->rest[i - 1]))
+		i--;
+	if (i < name_len + 2 || stream->rest[i - 1] != '"')
+		return false;
+	i -= name_len + 2;
+	return (stream->rest[i] == '"') &&
+		(strncmp(&stream->rest[i + 1], stream->arr_name, name_len) == 0);
+}
+
+int json_stream_feed(json_stream_t *stream, int len)
+{
+	int i = stream->len;
+	stream->len += len;
+	for (; i < stream->len; i++) {
+		char c = stream->buf[i];
+		bool in_elem = (stream->elem_start >= 0);
+		/* The contents of the streamed array are left out of the rest */
+		bool keep = !(stream->in_arr && stream->depth >= 2);
+		if (stream->in_str) {
+			if (stream->escape)
+				stream->escape = false;
+			else if (c == '\\')
+				stream->escape = true;
+			else if (c == '"')
+				stream->in_str = false;
+		} else if (c == '"') {
+			stream->in_str = true;
+		} else if (c == '{' || c == '[') {
+			if (stream->in_arr && stream->depth == 2 && !in_elem) {
+				stream->elem_start = i;
+				in_elem = true;
+			} else if (stream->depth == 1 && c == '[' && json_stream_at_arr_name(stream)) {
+				stream->in_arr = true;
+			}
+			stream->depth++;
+		} else if (c == '}' || c == ']') {
+			if (stream->depth == 0)
+				return -OS_FAIL;
+			stream->depth--;
+			if (stream->in_arr && stream->depth == 1) {
+				stream->in_arr = false;
+				keep = true;
+			} else if (in_elem && stream->depth == 2) {
+				jparse_ctx_t jctx;
+				int ret = json_parse_start_static(&jctx, stream->buf + stream->elem_start,
+						i + 1 - stream->elem_start, stream->tok_buf, stream->tok_buf_size);
+				if (ret != OS_SUCCESS)
+					return ret;
+				ret = stream->cb(&jctx, stream->priv);
+				if (ret != OS_SUCCESS)
+					return ret;
+				stream->elem_start = -1;
+				continue;
+			}
+		} else if (stream->in_arr && stream->depth == 2 && !in_elem &&
+				!strchr(" \t\r\n,", c)) {
+			/* Only objects and arrays can be streamed */
+			return -OS_FAIL;
+		}
+		if (keep) {
+			if (json_stream_add_to_rest(stream, c) != OS_SUCCESS)
+				return -OS_FAIL;
+		}
+	}
+	/* Keep only the element in progress */
+	if (stream->elem_start > 0) {
+		stream->len -= stream->elem_start;
+		memmove(stream->buf, stream->buf + stream->elem_start, stream->len);
+		stream->elem_start = 0;
+	} else if (stream->elem_start < 0) {
+		stream->len = 0;
+	}
+	return OS_SUCCESS;
+}
+
+int json_stream_end(json_stream_t *stream, jparse_ctx_t *jctx)
+{
+	if (stream->depth != 0 || stream->in_str || stream->elem_start >= 0)
+		return -OS_FAIL;
+	return json_parse_start_static(jctx, stream->rest, stream->rest_len,
+			stream->tok_buf, stream->tok_buf_size);
+}
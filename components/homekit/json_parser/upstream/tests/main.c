@@ -27,6 +27,7 @@
 			",\"object\",\"array\"],\n" \
 			"\"features\" : { \"objects\":true, "\
 			"\"arrays\":\"yes\"},\n"\
+			"\"esc_val\":\"a\\/b\\\"c\\\\d\\te\\u00e9\\ud83d\\ude00\",\n"\
 			"\"int_64\":109174583252}"
 
 int main(int argc, char **argv)
@@ -72,6 +73,8 @@ int main(int argc, char **argv)
 			printf("arrays %s\n", str_val);
 		json_obj_leave_object(&jctx);
 	}
+	if (json_obj_get_string(&jctx, "esc_val", str_val, sizeof(str_val)) == OS_SUCCESS)
+		printf("esc_val %s\n", str_val);
 	if (json_obj_get_int64(&jctx, "int_64", &int64_val) == OS_SUCCESS)
 		printf("int64_val %lld\n", int64_val);
 
@@ -329,6 +329,59 @@ error:
 	return -1;
 }
 
+/* Writes bn as a big endian number of exactly len bytes, padded with leading zeros */
+static int mu_bn_to_padded_bin(mu_bn_t *bn, char *buf, int len)
+{
+	int bn_len;
+	char *bytes = mu_bn_to_bin(bn, &bn_len);
+	if (! bytes)
+		return -1;
+	if (bn_len > len) {
+		free(bytes);
+		return -1;
+	}
+	memset(buf, 0, len - bn_len);
+	memcpy(buf + len - bn_len, bytes, bn_len);
+	free(bytes);
+	return 0;
+}
+
+int mu_srp_gen_salt_verifier(mu_srp_handle_t *hd, const char *username, const char *pass, int pass_len,
+		char *salt, int salt_len, char *verifier, int verifier_len)
+{
+	int ret = -1;
+	mu_bn_t *s = mu_bn_new();
+	mu_bn_t *x = NULL;
+	mu_bn_t *v = mu_bn_new();
+	if (!s || !v)
+		goto error;
+
+	/* Fixed length salt, so that the bytes hashed into x are the ones sent */
+	mu_bn_get_rand(s, 8 * salt_len, -1, 0);
+	if (mu_bn_to_padded_bin(s, salt, salt_len) < 0)
+		goto error;
+	hex_dbg("Salt", salt, salt_len);
+
+	x = calculate_x(salt, salt_len, username, pass, pass_len);
+	if (! x)
+		goto error;
+
+	/* v = g^x % N */
+	mu_bn_a_exp_b_mod_c(v, hd->g, x, hd->n, hd->ctx);
+	hex_dbg_bn("Verifier", v);
+	if (mu_bn_to_padded_bin(v, verifier, verifier_len) < 0)
+		goto error;
+	ret = 0;
+error:
+	if (s)
+		mu_bn_free(s);
+	if (x)
+		mu_bn_free(x);
+	if (v)
+		mu_bn_free(v);
+	return ret;
+}
+
 int mu_srp_srv_pubkey_from_salt_verifier(mu_srp_handle_t *hd, char **bytes_B, int *len_B)
 {
     return __mu_srp_srv_pubkey(hd, bytes_B, len_B);
@@ -67,6 +67,16 @@ int mu_srp_srv_pubkey(mu_srp_handle_t *hd, const char *username, const char *pas
 int mu_srp_set_salt_verifier(mu_srp_handle_t *hd, const char *salt, int salt_len,
             const char *verifier, int verifier_len);
 
+/* Generate a random salt and the verifier for a password, for storing and passing
+ * to mu_srp_set_salt_verifier() later, so that v = g^x % N is computed only once
+ * for a password rather than on every mu_srp_srv_pubkey().
+ *
+ * The handle only needs mu_srp_init(). Both outputs are written in full, left padded
+ * with zeros. verifier_len should be the length of N.
+ */
+int mu_srp_gen_salt_verifier(mu_srp_handle_t *hd, const char *username, const char *pass, int pass_len,
+		char *salt, int salt_len, char *verifier, int verifier_len);
+
 /* Returns B (pub key) when the salt and verifier are set using mu_srp_set_salt_verifier()
  *
  * *bytes_B MUST NOT BE FREED BY THE CALLER
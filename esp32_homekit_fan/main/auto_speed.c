@@ -0,0 +1,262 @@
+/**
+ * @file auto_speed.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to set the fan speed from the temperature.
+ *
+ * The ESP32-C3 has a temperature sensor on the die, which saves wiring up an
+ * external one. It reads the chip rather than the room, so readings go through
+ * a configurable offset, then a small moving average to take out the jitter.
+ * The result is exposed to HomeKit as a Temperature Sensor service.
+ *
+ * The control loop is an esp_timer that takes a sample every few seconds. Each
+ * speed has a temperature it turns on at, and only drops back once it's cooler
+ * than that by the hysteresis, so a temperature sitting right on a threshold
+ * doesn't flip between speeds. Below the first threshold the fan is off.
+ *
+ * Like the sleep timer, this component never touches the hardware. It posts
+ * power and speed events from SOURCE_AUTO into the event queue, and no more
+ * often than the minimum dwell, so the relays can't chatter however the
+ * temperature moves. The auto mode itself is part of the fan state, set from
+ * HomeKit's Target Fan State or the remote's temperature button, and cleared
+ * by any other source taking over power or speed. Only the fan the board is
+ * wired to has a sensor.
+ *
+ * @addtogroup AutoSpeed
+ * @{
+ */
+
+#include <stdbool.h>                     /* Boolean type */
+#include <stdint.h>                      /* Extended integer types */
+
+#include <sdkconfig.h>                   /* Project configuration */
+#include <esp_log.h>                     /* ESP logging functions */
+#include <esp_timer.h>                   /* Periodic sampling timer */
+
+#include <hap.h>                         /* HomeKit Accessory Protocol library */
+#include <hap_apple_servs.h>             /* Temperature Sensor service */
+#include <hap_apple_chars.h>             /* Name characteristic */
+
+#ifdef CONFIG_FAN_AUTO
+#include <driver/temperature_sensor.h>   /* On-die temperature sensor */
+#endif
+
+#include "main.h"
+#include "event_queue.h"
+#include "auto_speed.h"
+
+#ifdef CONFIG_FAN_AUTO
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC 1000000
+
+/** Fan the sensor is on */
+#define AUTO_FAN 0
+
+/** Weight of the newest sample in the moving average, as 1/N */
+#define AUTO_FILTER_WEIGHT 4
+
+/** Change (in degC) in the filtered temperature worth telling HomeKit about */
+#define AUTO_REPORT_DELTA_C 0.5f
+
+/** Range (in degC) the sensor is set up to measure */
+#define AUTO_SENSOR_MIN_C (-10)
+#define AUTO_SENSOR_MAX_C 80
+
+/** Tag used for ESP logging */
+static const char *TAG = "AutoSpeed";
+
+/** Temperature (in degC) each speed turns on at */
+static const float thresholds_c[NUM_SPEED] = {
+    [SPEED_OFF] = 0.0f,
+    [SPEED_1]   = CONFIG_FAN_AUTO_SPEED1_C,
+    [SPEED_2]   = CONFIG_FAN_AUTO_SPEED2_C,
+    [SPEED_3]   = CONFIG_FAN_AUTO_SPEED3_C,
+    [SPEED_4]   = CONFIG_FAN_AUTO_SPEED4_C,
+};
+
+/** Temperature sensor and the timer sampling it */
+static temperature_sensor_handle_t sensor;
+static esp_timer_handle_t          sample_timer;
+
+/** Filtered temperature (in degC), and the last one reported to HomeKit */
+static float filtered_c;
+static float reported_c;
+static bool  have_sample;
+
+/** Speed the temperature currently calls for */
+static enum State_speed level;
+
+/** Time (in uSec) the auto mode last switched the fan, 0 if never */
+static int64_t last_switch_us;
+
+/** Current Temperature characteristic of the service */
+static hap_char_t *temperature_char;
+
+/**
+ * @brief   Find the speed a temperature calls for.
+ * @details Steps up through every threshold reached, then down through every
+ *          one left behind by more than the hysteresis. Only one of the two
+ *          can happen for a given temperature.
+ * @param   from      Speed called for until now
+ * @param   celsius   Filtered temperature
+ * @return  Speed called for now.
+ */
+static enum State_speed band_speed(enum State_speed from, float celsius)
+{
+    const float hysteresis_c = CONFIG_FAN_AUTO_HYSTERESIS_DECI_C / 10.0f;
+    int         speed        = (int) from;
+
+    while (speed < SPEED_4 && celsius >= thresholds_c[speed + 1])
+    {
+        speed++;
+    }
+    while (speed > SPEED_OFF && celsius < thresholds_c[speed] - hysteresis_c)
+    {
+        speed--;
+    }
+
+    return (enum State_speed) speed;
+}
+
+/**
+ * @brief Post an event for the auto fan.
+ * @param id  Event ID
+ * @param arg Event argument
+ */
+static void send_event(enum Event_id id, uint32_t arg)
+{
+    Fan_event_t event = {
+        .source       = SOURCE_AUTO,
+        .id           = id,
+        .fan          = AUTO_FAN,
+        .arg          = arg,
+        .timestamp_us = esp_timer_get_time(),
+    };
+
+    if (!Event_queue_send(&event))
+    {
+        ESP_LOGW(TAG, "Event queue full, dropping event");
+    }
+}
+
+/**
+ * @brief   Timer callback taking one sample and running the control loop.
+ * @details Runs in the esp_timer task. Outside of auto mode the speed band
+ *          just follows whatever the fan is doing, so hysteresis is measured
+ *          from the running speed the moment auto mode is turned on.
+ *
+ *          The speed goes in before power, so turning on lands straight on
+ *          the new speed.
+ * @param   args [in] Unused
+ */
+static void sample_callback(void *args)
+{
+    float celsius;
+
+    UNUSED_PARAM(args);
+
+    if (ESP_OK != temperature_sensor_get_celsius(sensor, &celsius))
+    {
+        ESP_LOGW(TAG, "Failed to read the temperature sensor");
+        return;
+    }
+    celsius += CONFIG_FAN_AUTO_OFFSET_DECI_C / 10.0f;
+
+    filtered_c  = (have_sample) ? filtered_c + (celsius - filtered_c) / AUTO_FILTER_WEIGHT : celsius;
+    have_sample = true;
+
+    if (NULL != temperature_char &&
+        (filtered_c >= reported_c + AUTO_REPORT_DELTA_C || filtered_c <= reported_c - AUTO_REPORT_DELTA_C))
+    {
+        hap_val_t new_val = { .f = filtered_c };
+        hap_char_update_val(temperature_char, &new_val);
+        reported_c = filtered_c;
+    }
+
+    Fan_state_t state;
+    Fan_state_snapshot(AUTO_FAN, &state);
+    enum State_speed running = (state.on) ? state.speed : SPEED_OFF;
+
+    if (!state.auto_mode)
+    {
+        level = running;
+        return;
+    }
+
+    level = band_speed(level, filtered_c);
+
+    int64_t now_us = esp_timer_get_time();
+    if (level == running ||
+        (last_switch_us && now_us - last_switch_us < (int64_t) CONFIG_FAN_AUTO_MIN_DWELL_S * NUM_USEC_IN_SEC))
+    {
+        return;
+    }
+
+    ESP_LOGI(TAG, "%.1f degC, speed %d -> %d", (double) filtered_c, (int) running, (int) level);
+    last_switch_us = now_us;
+
+    if (SPEED_OFF != level)
+    {
+        send_event(ID_SPEED, (uint32_t) level);
+    }
+    send_event(ID_POWER, (uint32_t) (SPEED_OFF != level));
+}
+
+/**
+ * @brief   Initializer for the AutoSpeed component.
+ * @details Takes a first sample right away, so the Temperature Sensor service
+ *          starts out with a real reading.
+ */
+void Auto_speed_init(void)
+{
+    temperature_sensor_config_t sensor_config = TEMPERATURE_SENSOR_CONFIG_DEFAULT(AUTO_SENSOR_MIN_C, AUTO_SENSOR_MAX_C);
+    if (ESP_OK != temperature_sensor_install(&sensor_config, &sensor) ||
+        ESP_OK != temperature_sensor_enable(sensor))
+    {
+        ESP_LOGE(TAG, "Failed to start the temperature sensor");
+        return;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback        = sample_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "auto_speed",
+    };
+    if (ESP_OK != esp_timer_create(&timer_args, &sample_timer))
+    {
+        ESP_LOGE(TAG, "Failed to create the sampling timer");
+        return;
+    }
+
+    sample_callback(NULL);
+    reported_c = filtered_c;
+    ESP_ERROR_CHECK(esp_timer_start_periodic(sample_timer, (uint64_t) CONFIG_FAN_AUTO_PERIOD_S * NUM_USEC_IN_SEC));
+
+    ESP_LOGI(TAG, "AutoSpeed component init!");
+}
+
+/**
+ * @brief   Add the Temperature Sensor service to an accessory.
+ * @details Must be called before the accessory is added to the HomeKit
+ *          database, and only for the accessory of the fan the sensor is on.
+ * @param   accessory [in] Accessory to add the service to
+ */
+void Auto_speed_add_service(hap_acc_t *accessory)
+{
+    hap_serv_t *service = hap_serv_temperature_sensor_create(filtered_c);
+
+    temperature_char = hap_serv_get_char_by_uuid(service, HAP_CHAR_UUID_CURRENT_TEMPERATURE);
+
+    hap_serv_add_char(service, hap_char_name_create("Temperature"));
+    hap_acc_add_serv(accessory, service);
+}
+
+#else /* !CONFIG_FAN_AUTO */
+
+void Auto_speed_init(void) {}
+void Auto_speed_add_service(hap_acc_t *accessory) { UNUSED_PARAM(accessory); }
+
+#endif /* CONFIG_FAN_AUTO */
+
+/** @} end AutoSpeed */
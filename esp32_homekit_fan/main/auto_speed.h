@@ -0,0 +1,22 @@
+/**
+ * @file auto_speed.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to set the fan speed from the temperature.
+ * 
+ * @addtogroup AutoSpeed
+ * @{
+ */
+
+#ifndef AUTO_SPEED_H
+#define AUTO_SPEED_H
+
+#include <hap.h> /* hap_acc_t */
+
+/** Public functions for the AutoSpeed component */
+void Auto_speed_init(void);
+void Auto_speed_add_service(hap_acc_t *accessory);
+
+#endif /* AUTO_SPEED_H */
+
+/** @} end AutoSpeed */
@@ -0,0 +1,420 @@
+/**
+ * @file benchmark.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to time the cryptographic primitives used by HomeKit.
+ *
+ * Pairing and session throughput come down to a handful of primitives: the
+ * ChaCha20-Poly1305 frames of every encrypted session, Curve25519 and Ed25519
+ * for pair verify, HKDF-SHA512 for the session keys, and the SRP modular
+ * exponentiation of pair setup. This component times each of them once, a
+ * few seconds after boot, from a low priority task, over a few payload sizes.
+ *
+ * Every case reports the CPU cycles spent per operation and per byte (from
+ * the cycle counter, so independent of the clock frequency) and operations
+ * per second (from wall time). The numbers are printed to the log as CSV
+ * lines starting with "bench," and can be fetched from the HomeKit HTTP
+ * server in the same format:
+ *
+ * curl <fan-ip>:<hap-port>/debug/benchmark
+ *
+ * so that runs on ESP32, C3 and S3, or with a different crypto backend
+ * (hardware SHA, MPI), can be compared with a diff.
+ *
+ * @addtogroup Benchmark
+ * @{
+ */
+
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <inttypes.h>             /* Format macros for extended integers */
+#include <string.h>               /* For memory/string-related functions */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+
+#ifdef CONFIG_FAN_CRYPTO_BENCHMARK
+#include <esp_cpu.h>              /* CPU cycle counter */
+#include <esp_timer.h>            /* Wall time */
+#include <esp_random.h>           /* Random keys and payloads */
+#include <freertos/FreeRTOS.h>    /* Basic FreeRTOS functions */
+#include <freertos/task.h>        /* Benchmark task */
+
+#include <sodium/crypto_aead_chacha20poly1305.h>
+#include <sodium/crypto_scalarmult_curve25519.h>
+#include <sodium/crypto_sign_ed25519.h>
+#include <hkdf-sha.h>             /* HKDF-SHA512 */
+#include <mu_srp.h>               /* SRP-6a */
+
+#ifdef CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+#endif /* CONFIG_FAN_CRYPTO_BENCHMARK */
+
+#include "main.h"
+#include "benchmark.h"
+
+#ifdef CONFIG_FAN_CRYPTO_BENCHMARK
+
+#define BENCHMARK_TASK_NAME       "benchmark"
+#define BENCHMARK_TASK_STACKSIZE  8 * 1024
+#define BENCHMARK_TASK_PRIORITY   1
+
+/** Time (in mSec) to wait after boot, so that start up does not skew the numbers */
+#define BENCHMARK_START_DELAY_MS  5000
+
+/** Time (in uSec) the benchmark may run before yielding to lower priority tasks */
+#define BENCHMARK_YIELD_US        100000
+
+/** Largest payload of a case, one HAP frame */
+#define BENCHMARK_MAX_BYTES       1024
+
+/** Size of the buffer used to format a single result line */
+#define BENCHMARK_LINE_SIZE       128
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC           1000000
+
+/** Column names of the CSV output */
+#define BENCHMARK_CSV_HEADER      "bench,primitive,bytes,iterations,cycles_per_op,cycles_per_byte,ops_per_s"
+
+/** One timed operation on a payload of the given size */
+typedef void (*Benchmark_op_t)(size_t bytes);
+
+/** A primitive timed at one payload size */
+typedef struct Benchmark_case_t
+{
+    const char     *name;       /** Name in the output */
+    Benchmark_op_t  op;         /** Operation to time */
+    size_t          bytes;      /** Payload size (in Bytes) */
+    uint32_t        iterations; /** Number of timed operations */
+} Benchmark_case_t;
+
+/** Result of one case */
+typedef struct Benchmark_result_t
+{
+    uint64_t cycles; /** Total cycles over all iterations */
+    int64_t  time_us; /** Total wall time over all iterations */
+} Benchmark_result_t;
+
+static void bench_aead_encrypt(size_t bytes);
+static void bench_aead_decrypt(size_t bytes);
+static void bench_hkdf_sha512(size_t bytes);
+static void bench_curve25519(size_t bytes);
+static void bench_ed25519_sign(size_t bytes);
+static void bench_ed25519_verify(size_t bytes);
+static void bench_srp_verifier(size_t bytes);
+
+/** Every case, from the cheap to the slow ones */
+static const Benchmark_case_t cases[] = {
+    { "chacha20poly1305_encrypt", bench_aead_encrypt,   64,   256 },
+    { "chacha20poly1305_encrypt", bench_aead_encrypt,   256,  256 },
+    { "chacha20poly1305_encrypt", bench_aead_encrypt,   1024, 128 },
+    { "chacha20poly1305_decrypt", bench_aead_decrypt,   64,   256 },
+    { "chacha20poly1305_decrypt", bench_aead_decrypt,   256,  256 },
+    { "chacha20poly1305_decrypt", bench_aead_decrypt,   1024, 128 },
+    { "hkdf_sha512",              bench_hkdf_sha512,    32,   64  },
+    { "hkdf_sha512",              bench_hkdf_sha512,    64,   64  },
+    { "curve25519",               bench_curve25519,     32,   8   },
+    { "ed25519_sign",             bench_ed25519_sign,   64,   8   },
+    { "ed25519_sign",             bench_ed25519_sign,   256,  8   },
+    { "ed25519_verify",           bench_ed25519_verify, 64,   8   },
+    { "ed25519_verify",           bench_ed25519_verify, 256,  8   },
+    { "srp3072_verifier",         bench_srp_verifier,   384,  2   },
+};
+
+#define NUM_BENCHMARK_CASE (sizeof(cases) / sizeof(cases[0]))
+
+/** Tag used for ESP logging */
+static const char *TAG = "Benchmark";
+
+/** Results, valid up to num_done */
+static Benchmark_result_t results[NUM_BENCHMARK_CASE];
+static volatile uint32_t  num_done;
+
+/** Inputs shared by the cases, filled in once before timing */
+static uint8_t payload[BENCHMARK_MAX_BYTES + crypto_aead_chacha20poly1305_IETF_ABYTES];
+static uint8_t sealed[BENCHMARK_MAX_BYTES + crypto_aead_chacha20poly1305_IETF_ABYTES];
+static uint8_t key[crypto_aead_chacha20poly1305_IETF_KEYBYTES];
+static uint8_t nonce[crypto_aead_chacha20poly1305_IETF_NPUBBYTES];
+static uint8_t sign_pk[crypto_sign_ed25519_PUBLICKEYBYTES];
+static uint8_t sign_sk[crypto_sign_ed25519_SECRETKEYBYTES];
+static uint8_t signature[crypto_sign_ed25519_BYTES];
+static size_t  signature_bytes;
+
+/**
+ * @brief Encrypt a frame in place, as hap_encrypt_data() does.
+ * @param bytes Frame length
+ */
+static void bench_aead_encrypt(size_t bytes)
+{
+    unsigned long long mlen = 16;
+
+    crypto_aead_chacha20poly1305_ietf_encrypt_detached(payload, payload + bytes, &mlen,
+            payload, bytes, NULL, 0, NULL, nonce, key);
+}
+
+/**
+ * @brief Decrypt a frame sealed beforehand, as hap_decrypt_data() does.
+ * @param bytes Frame length
+ */
+static void bench_aead_decrypt(size_t bytes)
+{
+    /* Decrypt into the payload buffer, so that the sealed frame stays valid */
+    if (0 != crypto_aead_chacha20poly1305_ietf_decrypt_detached(payload, NULL, sealed, bytes,
+                sealed + bytes, NULL, 0, nonce, key))
+    {
+        ESP_LOGW(TAG, "Frame failed to decrypt");
+    }
+}
+
+/**
+ * @brief Derive a session key, as pair verify does.
+ * @param bytes Length of the input key material
+ */
+static void bench_hkdf_sha512(size_t bytes)
+{
+    uint8_t okm[32];
+
+    (void) hkdf(SHA512, (const unsigned char *) "Control-Salt", 12, payload, (int) bytes,
+                (const unsigned char *) "Control-Read-Encryption-Key", 27, okm, sizeof(okm));
+}
+
+/**
+ * @brief Generate an ephemeral Curve25519 public key, as pair verify does.
+ * @param bytes Unused, keys are always 32 Bytes
+ */
+static void bench_curve25519(size_t bytes)
+{
+    static const uint8_t basepoint[32] = {9};
+    uint8_t              pk[32];
+
+    UNUSED_PARAM(bytes);
+    (void) crypto_scalarmult_curve25519(pk, payload, basepoint);
+}
+
+/**
+ * @brief Sign a message with the accessory's long term key.
+ * @param bytes Message length
+ */
+static void bench_ed25519_sign(size_t bytes)
+{
+    unsigned long long len;
+
+    (void) crypto_sign_ed25519_detached(signature, &len, payload, bytes, sign_sk);
+}
+
+/**
+ * @brief Verify a controller's signature.
+ * @param bytes Message length, must match the one last signed
+ */
+static void bench_ed25519_verify(size_t bytes)
+{
+    if (0 != crypto_sign_ed25519_verify_detached(signature, payload, bytes, sign_pk))
+    {
+        ESP_LOGW(TAG, "Signature failed to verify");
+    }
+}
+
+/**
+ * @brief Compute an SRP verifier, one 3072-bit modular exponentiation.
+ * @param bytes Verifier length, the length of N
+ */
+static void bench_srp_verifier(size_t bytes)
+{
+    mu_srp_handle_t srp;
+    char            salt[16];
+    char            verifier[384];
+
+    if (bytes > sizeof(verifier) || 0 != mu_srp_init(&srp, MU_NG_3072))
+    {
+        return;
+    }
+    (void) mu_srp_gen_salt_verifier(&srp, "Pair-Setup", "11122333", 8,
+                                    salt, sizeof(salt), verifier, (int) bytes);
+    mu_srp_free(&srp);
+}
+
+/**
+ * @brief Set up the inputs a case expects, outside of the timed region.
+ * @param bench_case Case about to be timed
+ */
+static void prepare_case(const Benchmark_case_t *bench_case)
+{
+    if (bench_aead_decrypt == bench_case->op)
+    {
+        unsigned long long mlen;
+
+        crypto_aead_chacha20poly1305_ietf_encrypt_detached(sealed, sealed + bench_case->bytes, &mlen,
+                payload, bench_case->bytes, NULL, 0, NULL, nonce, key);
+    }
+    else if (bench_ed25519_verify == bench_case->op && signature_bytes != bench_case->bytes)
+    {
+        bench_ed25519_sign(bench_case->bytes);
+        signature_bytes = bench_case->bytes;
+    }
+}
+
+/**
+ * @brief  Format one result as a CSV line.
+ * @param  index Index of the case
+ * @param  buf   [out] Buffer to write into
+ * @param  size  Size of the buffer
+ * @return Number of characters written.
+ */
+static int format_result(uint32_t index, char *buf, size_t size)
+{
+    const Benchmark_case_t   *bench_case = &cases[index];
+    const Benchmark_result_t *result     = &results[index];
+
+    uint64_t cycles_per_op = result->cycles / bench_case->iterations;
+    double   ops_per_s     = (result->time_us > 0)
+                             ? (double) bench_case->iterations * NUM_USEC_IN_SEC / result->time_us : 0.0;
+
+    int len = snprintf(buf, size, "bench,%s,%u,%" PRIu32 ",%" PRIu64 ",%.2f,%.1f",
+                       bench_case->name, (unsigned) bench_case->bytes, bench_case->iterations,
+                       cycles_per_op, (double) cycles_per_op / bench_case->bytes, ops_per_s);
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief Run every case once, then exit.
+ * @param arg Unused
+ */
+static void benchmark_task(void *arg)
+{
+    char line[BENCHMARK_LINE_SIZE];
+
+    UNUSED_PARAM(arg);
+    vTaskDelay(pdMS_TO_TICKS(BENCHMARK_START_DELAY_MS));
+
+    esp_fill_random(payload, sizeof(payload));
+    esp_fill_random(key, sizeof(key));
+    esp_fill_random(nonce, sizeof(nonce));
+    crypto_sign_ed25519_keypair(sign_pk, sign_sk);
+
+    ESP_LOGI(TAG, "%s", BENCHMARK_CSV_HEADER);
+    for (uint32_t index = 0; index < NUM_BENCHMARK_CASE; index++)
+    {
+        const Benchmark_case_t *bench_case = &cases[index];
+        Benchmark_result_t     *result     = &results[index];
+        int64_t                 yielded_us = esp_timer_get_time();
+
+        prepare_case(bench_case);
+        for (uint32_t i = 0; i < bench_case->iterations; i++)
+        {
+            int64_t  start_us     = esp_timer_get_time();
+            uint32_t start_cycles = esp_cpu_get_cycle_count();
+
+            bench_case->op(bench_case->bytes);
+
+            /* The counter is 32-bit, the difference is right across a wrap */
+            result->cycles  += (uint32_t) (esp_cpu_get_cycle_count() - start_cycles);
+            result->time_us += esp_timer_get_time() - start_us;
+
+            /* Let the idle task run, so the task watchdog stays quiet */
+            if (esp_timer_get_time() - yielded_us > BENCHMARK_YIELD_US)
+            {
+                vTaskDelay(1);
+                yielded_us = esp_timer_get_time();
+            }
+        }
+
+        num_done = index + 1;
+        (void) format_result(index, line, sizeof(line));
+        ESP_LOGI(TAG, "%s", line);
+    }
+
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start the benchmark task, which runs every case once.
+ */
+void Benchmark_init(void)
+{
+    (void) xTaskCreate(
+        benchmark_task,
+        BENCHMARK_TASK_NAME,
+        BENCHMARK_TASK_STACKSIZE,
+        NULL,
+        BENCHMARK_TASK_PRIORITY,
+        NULL);
+}
+
+/**
+ * @brief Dump the results so far to the log.
+ */
+void Benchmark_dump(void)
+{
+    char line[BENCHMARK_LINE_SIZE];
+
+    ESP_LOGI(TAG, "%s", BENCHMARK_CSV_HEADER);
+    for (uint32_t index = 0; index < num_done; index++)
+    {
+        (void) format_result(index, line, sizeof(line));
+        ESP_LOGI(TAG, "%s", line);
+    }
+}
+
+#ifdef CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT
+/**
+ * @brief  HTTP handler returning the results so far as CSV.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t benchmark_http_handler(httpd_req_t *req)
+{
+    char line[BENCHMARK_LINE_SIZE];
+
+    httpd_resp_set_type(req, "text/csv");
+    httpd_resp_sendstr_chunk(req, BENCHMARK_CSV_HEADER "\n");
+    for (uint32_t index = 0; index < num_done; index++)
+    {
+        int len = format_result(index, line, sizeof(line) - 1);
+        line[len++] = '\n';
+        httpd_resp_send_chunk(req, line, len);
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the benchmark debug endpoint */
+static const httpd_uri_t benchmark_get = {
+    .uri     = "/debug/benchmark",
+    .method  = HTTP_GET,
+    .handler = benchmark_http_handler,
+};
+#endif /* CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the benchmark debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT is set.
+ */
+void Benchmark_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, benchmark endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &benchmark_get);
+#endif /* CONFIG_FAN_CRYPTO_BENCHMARK_HTTP_ENDPOINT */
+}
+
+#else /* !CONFIG_FAN_CRYPTO_BENCHMARK */
+
+void Benchmark_init(void) {}
+void Benchmark_dump(void) {}
+void Benchmark_register_http_handler(void) {}
+
+#endif /* CONFIG_FAN_CRYPTO_BENCHMARK */
+
+/** @} end Benchmark */
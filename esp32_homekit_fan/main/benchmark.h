@@ -0,0 +1,21 @@
+/**
+ * @file benchmark.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to time the cryptographic primitives used by HomeKit.
+ *
+ * @addtogroup Benchmark
+ * @{
+ */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+/** Public functions for the Benchmark component */
+void Benchmark_init(void);
+void Benchmark_dump(void);
+void Benchmark_register_http_handler(void);
+
+#endif /* BENCHMARK_H */
+
+/** @} end Benchmark */
@@ -9,171 +9,215 @@
  * chose to only solder leads for the power and oscillation buttons on the front
  * fascia of the fan.
  *
- * In order to get input from these buttons, interrupts are registered which are
- * triggered on the positive edge of the button GPIO pin signal. To avoid
- * bouncing, the time of button presses is stored and a minimum wait time of
- * 250 msec between presses is enforced. Internal pulldown resistors are also
- * used to ensure we get a clean logic low/high.
+ * The buttons are driven by the bundled iot_button component, which samples
+ * every button from one shared timer tick while any of them is active. It takes
+ * care of debouncing, and tells apart the gestures each button supports:
  *
- * Instead of handling hardware changes themselves, the button interrupts will
+ * Power:       tap cycles speeds / on-off, holding steps quickly through speeds
+ * Oscillation: tap toggles oscillation, double tap toggles the fascia LEDs,
+ *              holding starts IR learning, holding longer forgets learned codes
+ *
+ * Where the chip has one, the GPIO glitch filter is also enabled to strip out
+ * sub-uSec spikes before they ever raise an interrupt.
+ *
+ * Instead of handling hardware changes themselves, the button callbacks will
  * construct event structures which are then enqueued to the main task queue. It
  * will handle the events from there.
+ *
+ * Each button event owns an atomic admission latch which counts presses that have
+ * not yet been handled. Only the press that moves the count off zero enqueues an
+ * event, later presses simply bump the count. The event handler releases the
+ * latch with Button_release(), collecting every press made in the meantime, so
+ * no press is dropped and the queue never floods.
  * 
  * @addtogroup Button
  * @{
  */
 
 #include <stdbool.h>            /* Boolean type */
-#include <sys/time.h>           /* Time functions */
+#include <stdint.h>             /* Extended integer types */
+#include <stdatomic.h>          /* Lock-free atomic types */
 
 #include <esp_log.h>            /* ESP logging functions */
-#include <esp_attr.h>           /* Extra function attributes (IRAM_ATTR) */
+#include <esp_timer.h>          /* High-resolution timestamps */
+#include <soc/soc_caps.h>       /* Chip capabilities */
 #include <driver/gpio.h>        /* ESP GPIO-related functions */
+#if SOC_GPIO_SUPPORT_PIN_GLITCH_FILTER
+#include <driver/gpio_filter.h> /* ESP GPIO glitch filter functions */
+#endif
 #include <freertos/FreeRTOS.h>  /* Basic FreeRTOS functions */
-#include <freertos/queue.h>     /* Definitions for inter-task queues */
+#include <iot_button.h>         /* Shared tick-wheel button driver */
 
 #include "main.h"
 #include "button.h"
+#include "event_queue.h"
+#include "remote.h"
 
 /** Total number of buttons */
 #define NUM_TOTAL_BUTTON 2
-/** Number of uSecs in a mSec */
-#define NUM_USEC_IN_MSEC 1000
-/** Minimum amount of time (in mSec) between button presses */
-#define MIN_TIME_BETWEEN_PRESS (250 * NUM_USEC_IN_MSEC)
+/** Time (in Sec) the power button must be held before stepping speeds */
+#define HOLD_START_SEC 1
+/** Time (in mSec) between speed steps while the power button is held */
+#define HOLD_REPEAT_MS 300
+/** Time (in Sec) the oscillation button must be held to start IR learning */
+#define LEARN_HOLD_SEC 5
+/** Time (in Sec) the oscillation button must be held to forget learned codes */
+#define LEARN_CLEAR_SEC 10
 
 /** Tag used for ESP logging */
 static const char *TAG = "Button";
 
-/** Time of the last button press, for debounce */
-static int64_t prev_time_us;
-
-/** Array to help with mass-setting GPIO pins for buttons */
-static gpio_num_t buttons[] = {
+/** GPIO for every button */
+static const gpio_num_t buttons[NUM_TOTAL_BUTTON] = {
     FAN_PWR_BUTTON_GPIO,
     FAN_OSC_BUTTON_GPIO,
 };
 
+/** Per-event count of presses not yet collected by the event handler */
+static atomic_uint pending_presses[NUM_EVENT_ID];
+
 /**
- * @brief   Interrupt for the power button GPIO.
- * @details Builds an event structure for the event, places it in the queue to
- *          be handled by the main task.
- * @param   args [in] Required argument from FreeRTOS
+ * @brief   Admit a button gesture, enqueueing an event if none is pending.
+ * @details The first gesture on an idle latch sends an event to the main task.
+ *          Any further gestures before the handler releases the latch are only
+ *          counted. If the queue is full the latch is reset so the button can
+ *          never get stuck.
+ *
+ *          Also used to press the buttons from software, for the event
+ *          pipeline benchmark.
+ * @param   id Event ID the gesture maps to
+ * @return  Whether the press was taken, false if the queue was full.
  */
-static void IRAM_ATTR power_interrupt(void *args)
+bool Button_press(enum Event_id id)
 {
-    (void) args;
-
-    if (g_Fan_event_lock)
+    if (id >= NUM_EVENT_ID)
     {
-        goto exit;
+        return false;
     }
 
-    /* Ensure we aren't receiving bounces */
-    struct timeval tv_now;
-    (void) gettimeofday(&tv_now, NULL);
-    int64_t time_us = (int64_t) tv_now.tv_sec * 1000000L + (int64_t) tv_now.tv_usec;
-    if (time_us - prev_time_us < MIN_TIME_BETWEEN_PRESS)
+    if (0 != atomic_fetch_add(&pending_presses[id], 1))
     {
-        /* If the required amount of time hasn't elapsed, this is a bounce! */
-        goto exit;
+        /* An event is already on its way, press has been counted */
+        return true;
     }
 
-    /* We have not woken a task at the start of the ISR. */
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-
-    /* Simple power event to send to the main task */
     Fan_event_t event = {
-        .source = SOURCE_BUTTON,
-        .id     = ID_POWER
+        .source       = SOURCE_BUTTON,
+        .id           = id,
+        .timestamp_us = esp_timer_get_time()
     };
 
-    (void) xQueueSendFromISR(g_Fan_event_queue, &event, &xHigherPriorityTaskWoken);
-
-    /* Update the previous time now */
-    prev_time_us = time_us;
-
-exit:
-    if (xHigherPriorityTaskWoken)
+    if (!Event_queue_send(&event))
     {
-        portYIELD_FROM_ISR();
+        /* Couldn't deliver, leave the latch open for the next press */
+        atomic_store(&pending_presses[id], 0);
+        return false;
     }
+
+    return true;
 }
 
 /**
- * @brief   Interrupt for the oscillate button GPIO.
- * @details Builds an event structure for the event, places it in the queue to
- *          be handled by the main task.
- * @param   args [in] Required argument from FreeRTOS
+ * @brief Button callback admitting a gesture.
+ * @param args Event ID to send, passed through the button callback.
  */
-static void IRAM_ATTR oscillate_interrupt(void *args)
+static void admit_press(void *args)
 {
-    (void) args;
-
-    if (g_Fan_event_lock)
-    {
-        goto exit;
-    }
-
-    /* Ensure we aren't receiving bounces */
-    struct timeval tv_now;
-    (void) gettimeofday(&tv_now, NULL);
-    int64_t time_us = (int64_t) tv_now.tv_sec * 1000000L + (int64_t) tv_now.tv_usec;
-    if (time_us - prev_time_us < MIN_TIME_BETWEEN_PRESS)
-    {
-        /* If the required amount of time hasn't elapsed, this is a bounce! */
-        goto exit;
-    }
+    (void) Button_press((enum Event_id) (uintptr_t) args);
+}
 
-    /* We have not woken a task at the start of the ISR. */
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+#ifdef CONFIG_FAN_REMOTE_LEARNING
+/**
+ * @brief Start IR learning mode, from holding the oscillation button.
+ * @param args [in] Unused
+ */
+static void learn_start(void *args)
+{
+    UNUSED_PARAM(args);
 
-    /* Simple oscillation event to send to the main task */
-    Fan_event_t event = {
-        .source = SOURCE_BUTTON,
-        .id     = ID_OSCILLATE
-    };
+    Remote_learn_start();
+}
 
-    (void) xQueueSendFromISR(g_Fan_event_queue, &event, &xHigherPriorityTaskWoken);
+/**
+ * @brief Forget learned IR codes, from holding the oscillation button longer.
+ * @param args [in] Unused
+ */
+static void learn_clear(void *args)
+{
+    UNUSED_PARAM(args);
 
-    /* Update the previous time now */
-    prev_time_us = time_us;
+    Remote_learn_clear();
+}
+#endif /* CONFIG_FAN_REMOTE_LEARNING */
 
-exit:
-    if (xHigherPriorityTaskWoken)
+/**
+ * @brief   Release the admission latch for a button event.
+ * @details Called by the event handler once it picks up a button event. Hands
+ *          back every press counted since the event was sent and re-opens the
+ *          latch so the next press sends a new event.
+ * @param   id Event ID associated with the button.
+ * @return  Number of presses made since the latch was last released.
+ */
+uint32_t Button_release(enum Event_id id)
+{
+    if (id >= NUM_EVENT_ID)
     {
-        portYIELD_FROM_ISR();
+        return 0;
     }
+
+    return atomic_exchange(&pending_presses[id], 0);
 }
 
 /**
  * @brief   Initialization function for the Button component.
- * @details Initializes the GPIO pins associated with buttons. Adds interrupt
- *          handlers that are activated on button presses.
+ * @details Creates the buttons and registers the gestures for each of them.
+ *          Enables the glitch filter on each button GPIO where available.
  */
 void Button_init(void)
 {
-    /* Initialize the basic GPIO attributes for our buttons */
+    button_handle_t power     = iot_button_create(FAN_PWR_BUTTON_GPIO, BUTTON_ACTIVE_HIGH);
+    button_handle_t oscillate = iot_button_create(FAN_OSC_BUTTON_GPIO, BUTTON_ACTIVE_HIGH);
+    if (NULL == power || NULL == oscillate)
+    {
+        ESP_LOGE(TAG, "Failed to create buttons");
+        return;
+    }
+
+    /* Power taps cycle, holding steps through speeds without a tap on release */
+    (void) iot_button_set_evt_cb(power, BUTTON_CB_TAP, admit_press, (void *) (uintptr_t) ID_POWER);
+    (void) iot_button_add_on_press_cb(power, HOLD_START_SEC, NULL, NULL);
+    (void) iot_button_set_serial_cb(power, HOLD_START_SEC, pdMS_TO_TICKS(HOLD_REPEAT_MS),
+                                    admit_press, (void *) (uintptr_t) ID_SPEED);
+
+    /* Oscillation taps toggle, double taps toggle the fascia LEDs */
+    (void) iot_button_set_evt_cb(oscillate, BUTTON_CB_TAP, admit_press, (void *) (uintptr_t) ID_OSCILLATE);
+    (void) iot_button_set_evt_cb(oscillate, BUTTON_CB_DOUBLE_TAP, admit_press, (void *) (uintptr_t) ID_TIME);
+
+#ifdef CONFIG_FAN_REMOTE_LEARNING
+    /* Holding oscillation teaches the fan another remote, or forgets them all */
+    (void) iot_button_add_on_press_cb(oscillate, LEARN_HOLD_SEC, learn_start, NULL);
+    (void) iot_button_add_on_press_cb(oscillate, LEARN_CLEAR_SEC, learn_clear, NULL);
+#endif
+
+#if SOC_GPIO_SUPPORT_PIN_GLITCH_FILTER
     for (int i = 0; i < NUM_TOTAL_BUTTON; i++)
     {
-        esp_rom_gpio_pad_select_gpio(buttons[i]);
-        gpio_set_direction(buttons[i], GPIO_MODE_INPUT);
-        gpio_pulldown_en(buttons[i]);
-        gpio_pullup_dis(buttons[i]);
-        gpio_set_intr_type(buttons[i], GPIO_INTR_POSEDGE);
+        /* Let the hardware drop the shortest glitches for us */
+        gpio_glitch_filter_handle_t filter;
+        gpio_pin_glitch_filter_config_t filter_cfg = {
+            .clk_src  = GLITCH_FILTER_CLK_SRC_DEFAULT,
+            .gpio_num = buttons[i],
+        };
+        if (ESP_OK == gpio_new_pin_glitch_filter(&filter_cfg, &filter))
+        {
+            (void) gpio_glitch_filter_enable(filter);
+        }
+        else
+        {
+            ESP_LOGW(TAG, "No glitch filter for GPIO %d", (int) buttons[i]);
+        }
     }
-    
-    /* Get the ISR service set up for the board */
-    gpio_install_isr_service(0);
-
-    /* Install interrupts for our two buttons */
-    gpio_isr_handler_add(FAN_PWR_BUTTON_GPIO, power_interrupt, NULL);
-    gpio_isr_handler_add(FAN_OSC_BUTTON_GPIO, oscillate_interrupt, NULL);
-
-    /* Get the current time for button debouncing */
-    struct timeval tv_now;
-    (void) gettimeofday(&tv_now, NULL);
-    prev_time_us = (int64_t) tv_now.tv_sec * 1000000L + (int64_t) tv_now.tv_usec;
+#endif
 
     ESP_LOGI(TAG, "Button component init!");
 }
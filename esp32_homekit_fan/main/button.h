@@ -11,7 +11,14 @@
 #ifndef BUTTON_H
 #define BUTTON_H
 
+#include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
+
+#include "main.h"
+
 /** Public functions for the Button component */
+bool Button_press(enum Event_id id);
+uint32_t Button_release(enum Event_id id);
 void Button_init(void);
 
 #endif /* BUTTON_H */
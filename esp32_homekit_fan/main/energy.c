@@ -0,0 +1,413 @@
+/**
+ * @file energy.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to profile where the fan's energy goes.
+ *
+ * Before trading latency for idle current, we want numbers. This component
+ * runs a fixed sequence of profiling windows once Wi-Fi has settled, so runs
+ * can be repeated and compared:
+ *
+ * - idle:     nothing happening, the floor,
+ * - homekit:  a controller polling, driven from the network by hap_loadgen.py
+ *             started on the window's "energy_start" line,
+ * - ir_storm: a held remote button, injected as repeat events at
+ *             CONFIG_FAN_ENERGY_IR_RATE_HZ. Pointing a real remote or an IR
+ *             blaster at the sensor adds the RMT side to it.
+ *
+ * The sequence is repeated CONFIG_FAN_ENERGY_RUNS times. A trigger pin goes
+ * high for the length of every window, so an external power meter can
+ * integrate over exactly the same stretch the statistics cover.
+ *
+ * Every window logs one CSV line starting with "energy," giving the light
+ * sleep time, the number of light sleeps and what woke each of them, the time
+ * spent in each Wi-Fi power save profile, frames sent and received, and IR
+ * captures. A line per task starting with "energy_task," gives its share of
+ * the CPU over the window. Then esp_pm_dump_locks() prints the PM lock and
+ * mode times, which are totals since boot, so a window is the difference from
+ * the previous dump. The "wifi" lock there is how long the radio was awake.
+ *
+ * Each statistic needs its own options, all of them set in
+ * sdkconfig.defaults.energy, and is left out without them.
+ *
+ * @addtogroup Energy
+ * @{
+ */
+
+#include <stdbool.h>              /* Boolean type */
+#include <stdio.h>                /* snprintf, stdout */
+#include <stdint.h>               /* Extended integer types */
+#include <string.h>               /* For memory/string-related functions */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+
+#ifdef CONFIG_FAN_ENERGY_PROFILE
+#include <esp_attr.h>             /* IRAM_ATTR */
+#include <esp_pm.h>               /* Light sleep callbacks, PM lock dump */
+#include <esp_sleep.h>            /* Wakeup causes */
+#include <esp_timer.h>            /* Wall time, IR storm timer */
+#include <driver/gpio.h>          /* Trigger pin */
+#include <freertos/FreeRTOS.h>    /* Basic FreeRTOS functions */
+#include <freertos/task.h>        /* Profiling task, run time statistics */
+#include <app_wifi.h>             /* Wi-Fi power save residency */
+
+#if CONFIG_LWIP_STATS
+#include <lwip/stats.h>           /* Frames sent and received */
+#endif
+#endif /* CONFIG_FAN_ENERGY_PROFILE */
+
+#include "main.h"
+#include "event_queue.h"
+#include "ir_decoder.h"
+#include "energy.h"
+
+#ifdef CONFIG_FAN_ENERGY_PROFILE
+
+#define ENERGY_TASK_NAME      "energy"
+#define ENERGY_TASK_STACKSIZE 4 * 1024
+#define ENERGY_TASK_PRIORITY  1
+
+/** Time (in mSec) to wait after boot, for Wi-Fi and HomeKit to settle */
+#define ENERGY_START_DELAY_MS 30000
+
+/** Time (in mSec) the trigger pin stays low between windows */
+#define ENERGY_GAP_MS         2000
+
+/** Most tasks whose CPU share is tracked */
+#define ENERGY_MAX_TASKS      32
+
+/** Wakeup causes counted, larger ones are counted as other */
+#define NUM_WAKEUP_CAUSE      16
+
+/** Size of the buffer used to format a single line */
+#define ENERGY_LINE_SIZE      256
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC       1000000
+
+/** Column names of the CSV output */
+#define ENERGY_CSV_HEADER     "energy,scenario,run,window_ms,light_sleep_ms,sleeps,wake_timer,wake_gpio," \
+                              "wake_wifi,wake_uart,wake_other,ps_none_ms,ps_min_ms,ps_max_ms,"           \
+                              "wifi_tx,wifi_rx,ir_captures,injected"
+
+/** Whether per-task CPU time is available */
+#define ENERGY_TASK_STATS (CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS && CONFIG_FREERTOS_USE_TRACE_FACILITY)
+
+/** Enum for the profiled scenarios, in the order they run */
+enum Energy_scenario
+{
+    ENERGY_IDLE = 0,     /** Nothing happening */
+    ENERGY_HOMEKIT,      /** A controller polling over the network */
+    ENERGY_IR_STORM,     /** A remote button held down */
+    NUM_ENERGY_SCENARIO  /** For arithmetic */
+};
+
+/** Counters sampled at either end of a window */
+typedef struct Energy_counters_t
+{
+    int64_t  time_us;                       /** Time of the sample */
+    int64_t  sleep_us;                      /** Time spent in light sleep */
+    uint32_t sleeps;                        /** Number of light sleeps */
+    uint32_t wakeups[NUM_WAKEUP_CAUSE];     /** Wakeups by cause */
+    uint32_t ps_ms[APP_WIFI_PS_PROFILE_MAX]; /** Time in each Wi-Fi power save profile */
+    uint32_t wifi_tx;                       /** Frames sent */
+    uint32_t wifi_rx;                       /** Frames received */
+    uint32_t ir_captures;                   /** IR captures decoded or not */
+} Energy_counters_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Energy";
+
+/** Names used in the output */
+static const char *scenario_names[NUM_ENERGY_SCENARIO] = { "idle", "homekit", "ir_storm" };
+
+/** Light sleep counters, written from the light sleep exit callback */
+static volatile int64_t  sleep_us;
+static volatile uint32_t sleeps;
+static volatile uint32_t wakeups[NUM_WAKEUP_CAUSE];
+
+/** Timer injecting the IR press storm, and the events it injected */
+static esp_timer_handle_t storm_timer;
+static volatile uint32_t  injected;
+
+#if ENERGY_TASK_STATS
+/** Run time counters of every task, at the start and end of a window */
+static TaskStatus_t task_start[ENERGY_MAX_TASKS];
+static TaskStatus_t task_end[ENERGY_MAX_TASKS];
+static UBaseType_t  num_task_start;
+static uint32_t     total_start;
+#endif
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+/**
+ * @brief  Count a light sleep and what ended it.
+ * @param  sleep_time_us Time (in uSec) spent asleep
+ * @param  arg           Unused
+ * @return ESP_OK.
+ */
+static esp_err_t IRAM_ATTR sleep_exit_callback(int64_t sleep_time_us, void *arg)
+{
+    uint32_t cause = (uint32_t) esp_sleep_get_wakeup_cause();
+
+    UNUSED_PARAM(arg);
+
+    wakeups[(cause < NUM_WAKEUP_CAUSE) ? cause : 0]++;
+    sleeps++;
+    sleep_us += sleep_time_us;
+
+    return ESP_OK;
+}
+#endif
+
+/**
+ * @brief   Timer callback injecting one repeat frame of a held remote button.
+ * @details Held power doesn't change the fan, so the storm costs exactly the
+ *          pipeline's work for each frame.
+ * @param   args [in] Unused
+ */
+static void storm_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    Fan_event_t event = {
+        .source       = SOURCE_REMOTE,
+        .id           = ID_POWER,
+        .arg          = REMOTE_HELD,
+        .timestamp_us = esp_timer_get_time(),
+    };
+
+    if (Event_queue_send(&event))
+    {
+        injected++;
+    }
+}
+
+/**
+ * @brief Drive the power meter trigger pin, if there is one.
+ * @param level Whether a window is running
+ */
+static void set_trigger(bool level)
+{
+#if CONFIG_FAN_ENERGY_TRIGGER_GPIO >= 0
+    gpio_set_level((gpio_num_t) CONFIG_FAN_ENERGY_TRIGGER_GPIO, (level) ? GPIO_HIGH : GPIO_LOW);
+#else
+    UNUSED_PARAM(level);
+#endif
+}
+
+/**
+ * @brief Sample every counter.
+ * @param counters [out] Counters right now
+ */
+static void sample(Energy_counters_t *counters)
+{
+    app_wifi_stats_t wifi;
+    Ir_stats_t       ir;
+
+    memset(counters, 0, sizeof(*counters));
+    counters->time_us  = esp_timer_get_time();
+    counters->sleep_us = sleep_us;
+    counters->sleeps   = sleeps;
+    for (int cause = 0; cause < NUM_WAKEUP_CAUSE; cause++)
+    {
+        counters->wakeups[cause] = wakeups[cause];
+    }
+
+    app_wifi_get_stats(&wifi);
+    memcpy(counters->ps_ms, wifi.ps_residency_ms, sizeof(counters->ps_ms));
+
+#if CONFIG_LWIP_STATS
+    counters->wifi_tx = lwip_stats.link.xmit;
+    counters->wifi_rx = lwip_stats.link.recv;
+#endif
+
+    Ir_decode_get_stats(&ir);
+    counters->ir_captures = ir.captures;
+}
+
+/**
+ * @brief Log the CPU share of every task over the window.
+ * @param scenario Scenario of the window
+ * @param run      Run the window is part of
+ */
+static void log_tasks(enum Energy_scenario scenario, int run)
+{
+#if ENERGY_TASK_STATS
+    uint32_t    total_end;
+    UBaseType_t num_task_end = uxTaskGetSystemState(task_end, ENERGY_MAX_TASKS, &total_end);
+    uint32_t    total        = total_end - total_start;
+
+    for (UBaseType_t i = 0; i < num_task_end && total; i++)
+    {
+        uint32_t start = 0;
+
+        /* Tasks created during the window started from zero */
+        for (UBaseType_t j = 0; j < num_task_start; j++)
+        {
+            if (task_start[j].xHandle == task_end[i].xHandle)
+            {
+                start = task_start[j].ulRunTimeCounter;
+                break;
+            }
+        }
+
+        ESP_LOGI(TAG, "energy_task,%s,%d,%s,%.2f", scenario_names[scenario], run, task_end[i].pcTaskName,
+                 (double) (task_end[i].ulRunTimeCounter - start) * 100.0 / total);
+    }
+#else
+    UNUSED_PARAM(scenario);
+    UNUSED_PARAM(run);
+#endif
+}
+
+/**
+ * @brief Run one profiling window.
+ * @param scenario Scenario to run
+ * @param run      Run the window is part of
+ */
+static void run_window(enum Energy_scenario scenario, int run)
+{
+    Energy_counters_t start, end;
+    char              line[ENERGY_LINE_SIZE];
+
+    ESP_LOGI(TAG, "energy_start,%s,%d,%d", scenario_names[scenario], run, CONFIG_FAN_ENERGY_WINDOW_S);
+
+#if ENERGY_TASK_STATS
+    num_task_start = uxTaskGetSystemState(task_start, ENERGY_MAX_TASKS, &total_start);
+#endif
+    injected = 0;
+    sample(&start);
+    set_trigger(true);
+
+    if (ENERGY_IR_STORM == scenario)
+    {
+        (void) esp_timer_start_periodic(storm_timer, NUM_USEC_IN_SEC / CONFIG_FAN_ENERGY_IR_RATE_HZ);
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(CONFIG_FAN_ENERGY_WINDOW_S * 1000));
+
+    if (ENERGY_IR_STORM == scenario)
+    {
+        (void) esp_timer_stop(storm_timer);
+    }
+
+    set_trigger(false);
+    sample(&end);
+
+    uint32_t other = 0;
+    for (int cause = 0; cause < NUM_WAKEUP_CAUSE; cause++)
+    {
+        if (ESP_SLEEP_WAKEUP_TIMER != cause && ESP_SLEEP_WAKEUP_GPIO != cause &&
+            ESP_SLEEP_WAKEUP_WIFI != cause && ESP_SLEEP_WAKEUP_UART != cause)
+        {
+            other += end.wakeups[cause] - start.wakeups[cause];
+        }
+    }
+
+    (void) snprintf(line, sizeof(line),
+                    "energy,%s,%d,%" PRId64 ",%" PRId64 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ","
+                    "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32,
+                    scenario_names[scenario], run, (end.time_us - start.time_us) / 1000,
+                    (end.sleep_us - start.sleep_us) / 1000, end.sleeps - start.sleeps,
+                    end.wakeups[ESP_SLEEP_WAKEUP_TIMER] - start.wakeups[ESP_SLEEP_WAKEUP_TIMER],
+                    end.wakeups[ESP_SLEEP_WAKEUP_GPIO] - start.wakeups[ESP_SLEEP_WAKEUP_GPIO],
+                    end.wakeups[ESP_SLEEP_WAKEUP_WIFI] - start.wakeups[ESP_SLEEP_WAKEUP_WIFI],
+                    end.wakeups[ESP_SLEEP_WAKEUP_UART] - start.wakeups[ESP_SLEEP_WAKEUP_UART], other,
+                    end.ps_ms[APP_WIFI_PS_NONE] - start.ps_ms[APP_WIFI_PS_NONE],
+                    end.ps_ms[APP_WIFI_PS_MIN_MODEM] - start.ps_ms[APP_WIFI_PS_MIN_MODEM],
+                    end.ps_ms[APP_WIFI_PS_MAX_MODEM] - start.ps_ms[APP_WIFI_PS_MAX_MODEM],
+                    end.wifi_tx - start.wifi_tx, end.wifi_rx - start.wifi_rx,
+                    end.ir_captures - start.ir_captures, (uint32_t) injected);
+    ESP_LOGI(TAG, "%s", line);
+
+    log_tasks(scenario, run);
+
+#if CONFIG_PM_PROFILING
+    /* Totals since boot, each window is the difference from the last dump */
+    ESP_LOGI(TAG, "energy_pm,%s,%d", scenario_names[scenario], run);
+    esp_pm_dump_locks(stdout);
+#endif
+}
+
+/**
+ * @brief Run every window of every run, then exit.
+ * @param arg Unused
+ */
+static void energy_task(void *arg)
+{
+    UNUSED_PARAM(arg);
+    vTaskDelay(pdMS_TO_TICKS(ENERGY_START_DELAY_MS));
+
+    ESP_LOGI(TAG, "%s", ENERGY_CSV_HEADER);
+    for (int run = 1; run <= CONFIG_FAN_ENERGY_RUNS; run++)
+    {
+        for (int scenario = 0; scenario < NUM_ENERGY_SCENARIO; scenario++)
+        {
+            run_window((enum Energy_scenario) scenario, run);
+            vTaskDelay(pdMS_TO_TICKS(ENERGY_GAP_MS));
+        }
+    }
+
+    ESP_LOGI(TAG, "energy_done");
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief   Initializer for the Energy component.
+ * @details Sets up the trigger pin and the light sleep callbacks, then starts
+ *          the profiling task. Call once every other task exists.
+ */
+void Energy_init(void)
+{
+#if CONFIG_FAN_ENERGY_TRIGGER_GPIO >= 0
+    gpio_config_t trigger_cfg = {
+        .pin_bit_mask = BIT64(CONFIG_FAN_ENERGY_TRIGGER_GPIO),
+        .mode         = GPIO_MODE_OUTPUT,
+        .pull_up_en   = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_DISABLE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&trigger_cfg));
+    set_trigger(false);
+
+    /* Keep driving the pin through light sleep */
+    (void) gpio_sleep_sel_dis((gpio_num_t) CONFIG_FAN_ENERGY_TRIGGER_GPIO);
+#endif
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t sleep_cbs = {
+        .exit_cb = sleep_exit_callback,
+    };
+    if (ESP_OK != esp_pm_light_sleep_register_cbs(&sleep_cbs))
+    {
+        ESP_LOGW(TAG, "Failed to register the light sleep callback, no wakeup sources");
+    }
+#endif
+
+    const esp_timer_create_args_t timer_args = {
+        .callback        = storm_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "energy_storm",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &storm_timer));
+
+    (void) xTaskCreate(
+        energy_task,
+        ENERGY_TASK_NAME,
+        ENERGY_TASK_STACKSIZE,
+        NULL,
+        ENERGY_TASK_PRIORITY,
+        NULL);
+
+    ESP_LOGI(TAG, "Energy component init!");
+}
+
+#else /* !CONFIG_FAN_ENERGY_PROFILE */
+
+void Energy_init(void) {}
+
+#endif /* CONFIG_FAN_ENERGY_PROFILE */
+
+/** @} end Energy */
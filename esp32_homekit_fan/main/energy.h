@@ -0,0 +1,19 @@
+/**
+ * @file energy.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to profile where the fan's energy goes.
+ *
+ * @addtogroup Energy
+ * @{
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+/** Public functions for the Energy component */
+void Energy_init(void);
+
+#endif /* ENERGY_H */
+
+/** @} end Energy */
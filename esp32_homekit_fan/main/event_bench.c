@@ -0,0 +1,534 @@
+/**
+ * @file event_bench.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to benchmark the fan event pipeline with synthetic events.
+ *
+ * Every control path ends in the same place: an event in the queue, folded by
+ * the event handler task, written to the relays and reported to HomeKit. This
+ * component finds out how many events per second that pipeline keeps up with,
+ * and where it starts to drop them. Some time after boot, a task injects a few
+ * scenarios of events from a mix of sources (HomeKit, remote, button, UDP and
+ * MQTT), each toggling or stepping the fan so that every event has work to do:
+ *
+ * - steady streams, paced per tick, at a low and a high rate,
+ * - bursts, sent all at once from above the event handler's priority like a
+ *   button ISR or a task on the other core, some of them longer than the queue,
+ * - a flood, sent back to back from below the event handler's priority.
+ *
+ * The relays are put in a dry run for the length of the benchmark, so nothing
+ * switches and there's no settle time, but everything else runs for real. The
+ * event handler calls back into this component for every event it dequeues and
+ * every batch it applies, which gives the latency of each event from creation
+ * until its batch was applied. Button presses go through the button's own
+ * admission latch, so presses made while one is pending are folded into it
+ * and never reach the queue, as on the real button.
+ *
+ * Every scenario reports the input events injected, those dropped with the
+ * queue full, the events and batches handled, events per second, the latency
+ * percentiles, and HomeKit characteristic updates and notifications (updates
+ * with a subscriber) per input event. The numbers go to the log as CSV lines
+ * starting with "evbench," and can be fetched from the HomeKit HTTP server:
+ *
+ * curl <fan-ip>:<hap-port>/debug/eventbench
+ *
+ * Once done, the fans are set back to their states from before the run and
+ * the relays written to match. The injected events do go through the journal,
+ * MQTT and UDP like any others, and any real events during a run are counted
+ * along with them.
+ *
+ * @addtogroup EventBench
+ * @{
+ */
+
+#include <stdbool.h>              /* Boolean type */
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <stdlib.h>               /* qsort */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+
+#ifdef CONFIG_FAN_EVENT_BENCHMARK
+#include <esp_timer.h>            /* Wall time */
+#include <freertos/FreeRTOS.h>    /* Basic FreeRTOS functions */
+#include <freertos/task.h>        /* Injector task */
+
+#ifdef CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+#endif /* CONFIG_FAN_EVENT_BENCHMARK */
+
+#include "main.h"
+#include "event_queue.h"
+#include "relay.h"
+#include "button.h"
+#include "homekit.h"
+#include "event_bench.h"
+
+#ifdef CONFIG_FAN_EVENT_BENCHMARK
+
+#define EVENT_BENCH_TASK_NAME      "event_bench"
+#define EVENT_BENCH_TASK_STACKSIZE 4 * 1024
+
+/** Priorities to inject from, below and above the event handler */
+#define EVENT_BENCH_PRIORITY_BELOW ((FAN_IO_PRIORITY > 1) ? FAN_IO_PRIORITY - 1 : 1)
+#define EVENT_BENCH_PRIORITY_ABOVE (FAN_IO_PRIORITY + 1)
+
+/** Time (in mSec) to wait after boot, after the crypto benchmark is done */
+#define EVENT_BENCH_START_DELAY_MS 15000
+
+/** Time (in mSec) the pipeline must sit idle before a scenario counts as drained */
+#define EVENT_BENCH_DRAIN_MS       100
+
+/** Time (in uSec) a flood may run before yielding to lower priority tasks */
+#define EVENT_BENCH_YIELD_US       100000
+
+/** Most latencies kept per scenario, later events are still counted */
+#define EVENT_BENCH_MAX_SAMPLES    1024
+
+/** Most events timed in a single batch */
+#define EVENT_BENCH_MAX_PENDING    64
+
+/** Size of the buffer used to format a single result line */
+#define EVENT_BENCH_LINE_SIZE      192
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC            1000000
+
+/** Column names of the CSV output */
+#define EVENT_BENCH_CSV_HEADER     "evbench,scenario,inputs,dropped,dequeued,batches,events_per_s," \
+                                   "p50_us,p90_us,p99_us,max_us,updates_per_input,notifications_per_input"
+
+/** One event of the mix, every scenario cycles through them */
+typedef struct Event_bench_mix_t
+{
+    enum Event_source source; /** Source to send as */
+    enum Event_id     id;     /** Event ID */
+    uint32_t          arg;    /** Event argument */
+} Event_bench_mix_t;
+
+/** How a scenario injects its events */
+typedef struct Event_bench_scenario_t
+{
+    const char *name;   /** Name in the output */
+    uint32_t    inputs; /** Number of input events */
+    uint32_t    rate;   /** Events per second of a steady stream, 0 otherwise */
+    uint32_t    burst;  /** Events per burst, 0 otherwise */
+    uint32_t    gap_ms; /** Time (in mSec) between bursts */
+} Event_bench_scenario_t;
+
+/** Result of one scenario */
+typedef struct Event_bench_result_t
+{
+    uint32_t inputs;        /** Input events injected */
+    uint32_t dropped;       /** Input events dropped with the queue full */
+    uint32_t dequeued;      /** Events the handler dequeued */
+    uint32_t batches;       /** Batches the handler applied */
+    int64_t  elapsed_us;    /** First injection to the last batch applied */
+    uint32_t p50_us;        /** Median latency */
+    uint32_t p90_us;        /** 90th percentile latency */
+    uint32_t p99_us;        /** 99th percentile latency */
+    uint32_t max_us;        /** Largest latency */
+    uint32_t updates;       /** HomeKit characteristic updates */
+    uint32_t notifications; /** Updates with a subscriber */
+} Event_bench_result_t;
+
+/** Events of every scenario, toggling and stepping the fan around */
+static const Event_bench_mix_t mix[] = {
+    { SOURCE_HOMEKIT, ID_POWER,     1            },
+    { SOURCE_HOMEKIT, ID_SPEED,     SPEED_2      },
+    { SOURCE_REMOTE,  ID_SPEED,     REMOTE_PRESS },
+    { SOURCE_REMOTE,  ID_SPEED,     REMOTE_HELD  },
+    { SOURCE_BUTTON,  ID_OSCILLATE, 0            },
+    { SOURCE_UDP,     ID_SPEED,     SPEED_4      },
+    { SOURCE_MQTT,    ID_OSCILLATE, 0            },
+    { SOURCE_BUTTON,  ID_POWER,     0            },
+    { SOURCE_REMOTE,  ID_POWER,     REMOTE_PRESS },
+    { SOURCE_MQTT,    ID_POWER,     1            },
+    { SOURCE_HOMEKIT, ID_SPEED,     SPEED_1      },
+    { SOURCE_UDP,     ID_POWER,     0            },
+};
+
+#define NUM_EVENT_BENCH_MIX (sizeof(mix) / sizeof(mix[0]))
+
+/** Every scenario, from the gentle to the overloading ones */
+static const Event_bench_scenario_t scenarios[] = {
+    { "steady_100",  500,  100,  0,  0   },
+    { "steady_1000", 2000, 1000, 0,  0   },
+    { "burst_8",     800,  0,    8,  50  },
+    { "burst_32",    800,  0,    32, 100 },
+    { "flood",       4000, 0,    0,  0   },
+};
+
+#define NUM_EVENT_BENCH_SCENARIO (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/** Tag used for ESP logging */
+static const char *TAG = "EventBench";
+
+/** Results, valid up to num_done */
+static Event_bench_result_t results[NUM_EVENT_BENCH_SCENARIO];
+static volatile uint32_t    num_done;
+
+/** Whether a scenario is being timed, the handler only records while set */
+static volatile bool running;
+
+/** Counters and latencies of the running scenario, written by the event handler */
+static volatile uint32_t num_dequeued;
+static uint32_t          num_batches;
+static int64_t           last_applied_us;
+static int64_t           pending_us[EVENT_BENCH_MAX_PENDING];
+static uint32_t          num_pending;
+static uint32_t          samples_us[EVENT_BENCH_MAX_SAMPLES];
+static uint32_t          num_samples;
+
+/**
+ * @brief Note an event dequeued by the event handler.
+ * @param event [in] Event dequeued
+ */
+void Event_bench_dequeued(const Fan_event_t *event)
+{
+    if (!running)
+    {
+        return;
+    }
+
+    num_dequeued++;
+    if (num_pending < EVENT_BENCH_MAX_PENDING)
+    {
+        pending_us[num_pending++] = event->timestamp_us;
+    }
+}
+
+/**
+ * @brief Note that the event handler applied the batch of events it dequeued.
+ */
+void Event_bench_applied(void)
+{
+    if (!running || 0 == num_pending)
+    {
+        return;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < num_pending && num_samples < EVENT_BENCH_MAX_SAMPLES; i++)
+    {
+        samples_us[num_samples++] = (uint32_t) (now_us - pending_us[i]);
+    }
+
+    num_pending     = 0;
+    num_batches++;
+    last_applied_us = now_us;
+}
+
+/**
+ * @brief  Inject one event of the mix.
+ * @param  index Index of the event in the scenario
+ * @return Whether it was taken, false if dropped with the queue full.
+ */
+static bool inject(uint32_t index)
+{
+    const Event_bench_mix_t *entry = &mix[index % NUM_EVENT_BENCH_MIX];
+
+    /* Only the first fan has buttons */
+    if (SOURCE_BUTTON == entry->source)
+    {
+        return Button_press(entry->id);
+    }
+
+    Fan_event_t event = {
+        .source       = entry->source,
+        .id           = entry->id,
+        .fan          = (uint8_t) ((index / NUM_EVENT_BENCH_MIX) % FAN_NUM_FANS),
+        .arg          = entry->arg,
+        .timestamp_us = esp_timer_get_time(),
+    };
+
+    return Event_queue_send(&event);
+}
+
+/**
+ * @brief Wait until the event handler has gone quiet.
+ */
+static void drain(void)
+{
+    uint32_t dequeued;
+
+    do
+    {
+        dequeued = num_dequeued;
+        vTaskDelay(pdMS_TO_TICKS(EVENT_BENCH_DRAIN_MS));
+    } while (dequeued != num_dequeued);
+}
+
+/**
+ * @brief  Order latencies for qsort().
+ * @param  a [in] First latency
+ * @param  b [in] Second latency
+ * @return Negative, zero or positive as a is below, equal to or above b.
+ */
+static int compare_us(const void *a, const void *b)
+{
+    uint32_t lhs = *(const uint32_t *) a;
+    uint32_t rhs = *(const uint32_t *) b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * @brief Run one scenario.
+ * @param scenario [in]  Scenario to run
+ * @param result   [out] Its result
+ */
+static void run_scenario(const Event_bench_scenario_t *scenario, Event_bench_result_t *result)
+{
+    uint32_t updates, notifications;
+    uint32_t sent = 0;
+
+    num_dequeued = 0;
+    num_batches  = 0;
+    num_pending  = 0;
+    num_samples  = 0;
+    HomeKit_get_update_counts(&updates, &notifications);
+
+    /* Bursts pile up in the queue before the handler gets to run */
+    vTaskPrioritySet(NULL, (scenario->burst) ? EVENT_BENCH_PRIORITY_ABOVE : EVENT_BENCH_PRIORITY_BELOW);
+    *result = (Event_bench_result_t) { .inputs = scenario->inputs };
+
+    running = true;
+    int64_t start_us   = esp_timer_get_time();
+    int64_t yielded_us = start_us;
+    while (sent < scenario->inputs)
+    {
+        uint32_t due = scenario->inputs;
+
+        if (scenario->rate)
+        {
+            /* Send whatever is due by now, then wait out a tick */
+            due = (uint32_t) ((esp_timer_get_time() - start_us) * scenario->rate / NUM_USEC_IN_SEC) + 1;
+        }
+        else if (scenario->burst)
+        {
+            due = sent + scenario->burst;
+        }
+        due = (due < scenario->inputs) ? due : scenario->inputs;
+
+        for (; sent < due; sent++)
+        {
+            result->dropped += !inject(sent);
+            if (!scenario->rate && !scenario->burst && esp_timer_get_time() - yielded_us > EVENT_BENCH_YIELD_US)
+            {
+                /* Let the idle task run, so the task watchdog stays quiet */
+                vTaskDelay(1);
+                yielded_us = esp_timer_get_time();
+            }
+        }
+
+        if (scenario->rate)
+        {
+            vTaskDelay(1);
+        }
+        else if (scenario->burst)
+        {
+            vTaskDelay(pdMS_TO_TICKS(scenario->gap_ms));
+        }
+    }
+
+    vTaskPrioritySet(NULL, EVENT_BENCH_PRIORITY_BELOW);
+    drain();
+    running = false;
+
+    uint32_t end_updates, end_notifications;
+    HomeKit_get_update_counts(&end_updates, &end_notifications);
+
+    result->dequeued      = num_dequeued;
+    result->batches       = num_batches;
+    result->elapsed_us    = (last_applied_us > start_us) ? last_applied_us - start_us : 0;
+    result->updates       = end_updates - updates;
+    result->notifications = end_notifications - notifications;
+
+    if (num_samples)
+    {
+        qsort(samples_us, num_samples, sizeof(samples_us[0]), compare_us);
+        result->p50_us = samples_us[(num_samples - 1) * 50 / 100];
+        result->p90_us = samples_us[(num_samples - 1) * 90 / 100];
+        result->p99_us = samples_us[(num_samples - 1) * 99 / 100];
+        result->max_us = samples_us[num_samples - 1];
+    }
+}
+
+/**
+ * @brief Put every fan back to a state from before the benchmark.
+ * @param saved [in] State of every fan
+ */
+static void restore(const Fan_state_t *saved)
+{
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        /* Sent as UDP commands, which set values outright. The auto mode goes
+           last, as anything else changing power or speed turns it off. */
+        const struct
+        {
+            enum Event_id id;
+            uint32_t      arg;
+        } steps[] = {
+            { ID_SPEED,       (uint32_t) saved[fan].speed     },
+            { ID_OSCILLATE,   (uint32_t) saved[fan].oscillate },
+            { ID_POWER,       (uint32_t) saved[fan].on        },
+            { ID_TIME,        (uint32_t) saved[fan].timer     },
+            { ID_TEMPERATURE, (uint32_t) saved[fan].auto_mode },
+        };
+
+        for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+        {
+            Fan_event_t event = {
+                .source       = SOURCE_UDP,
+                .id           = steps[i].id,
+                .fan          = fan,
+                .arg          = steps[i].arg,
+                .timestamp_us = esp_timer_get_time(),
+            };
+
+            if (!Event_queue_send(&event))
+            {
+                ESP_LOGW(TAG, "Event queue full, fan %u may not be restored", (unsigned) fan);
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(EVENT_BENCH_DRAIN_MS));
+    }
+}
+
+/**
+ * @brief  Format one result as a CSV line.
+ * @param  index Index of the scenario
+ * @param  buf   [out] Buffer to write into
+ * @param  size  Size of the buffer
+ * @return Number of characters written.
+ */
+static int format_result(uint32_t index, char *buf, size_t size)
+{
+    const Event_bench_result_t *result = &results[index];
+
+    double events_per_s = (result->elapsed_us > 0)
+                          ? (double) result->dequeued * NUM_USEC_IN_SEC / result->elapsed_us : 0.0;
+    double inputs       = (result->inputs) ? (double) result->inputs : 1.0;
+
+    int len = snprintf(buf, size, "evbench,%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%.1f,"
+                       "%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%.2f,%.2f",
+                       scenarios[index].name, result->inputs, result->dropped, result->dequeued,
+                       result->batches, events_per_s, result->p50_us, result->p90_us, result->p99_us,
+                       result->max_us, result->updates / inputs, result->notifications / inputs);
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief Run every scenario once, then exit.
+ * @param arg Unused
+ */
+static void event_bench_task(void *arg)
+{
+    char        line[EVENT_BENCH_LINE_SIZE];
+    Fan_state_t saved[FAN_NUM_FANS];
+
+    UNUSED_PARAM(arg);
+    vTaskDelay(pdMS_TO_TICKS(EVENT_BENCH_START_DELAY_MS));
+
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        (void) Fan_state_snapshot(fan, &saved[fan]);
+    }
+    Relay_set_dry_run(true);
+
+    ESP_LOGI(TAG, "%s", EVENT_BENCH_CSV_HEADER);
+    for (uint32_t index = 0; index < NUM_EVENT_BENCH_SCENARIO; index++)
+    {
+        run_scenario(&scenarios[index], &results[index]);
+
+        num_done = index + 1;
+        (void) format_result(index, line, sizeof(line));
+        ESP_LOGI(TAG, "%s", line);
+    }
+
+    restore(saved);
+    Relay_set_dry_run(false);
+
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start the injector task, which runs every scenario once.
+ */
+void Event_bench_init(void)
+{
+    (void) xTaskCreate(
+        event_bench_task,
+        EVENT_BENCH_TASK_NAME,
+        EVENT_BENCH_TASK_STACKSIZE,
+        NULL,
+        EVENT_BENCH_PRIORITY_BELOW,
+        NULL);
+}
+
+#ifdef CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT
+/**
+ * @brief  HTTP handler returning the results so far as CSV.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t event_bench_http_handler(httpd_req_t *req)
+{
+    char line[EVENT_BENCH_LINE_SIZE];
+
+    httpd_resp_set_type(req, "text/csv");
+    httpd_resp_sendstr_chunk(req, EVENT_BENCH_CSV_HEADER "\n");
+    for (uint32_t index = 0; index < num_done; index++)
+    {
+        int len = format_result(index, line, sizeof(line) - 1);
+        line[len++] = '\n';
+        httpd_resp_send_chunk(req, line, len);
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the event benchmark debug endpoint */
+static const httpd_uri_t event_bench_get = {
+    .uri     = "/debug/eventbench",
+    .method  = HTTP_GET,
+    .handler = event_bench_http_handler,
+};
+#endif /* CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the event benchmark debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT is set.
+ */
+void Event_bench_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, event benchmark endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &event_bench_get);
+#endif /* CONFIG_FAN_EVENT_BENCHMARK_HTTP_ENDPOINT */
+}
+
+#else /* !CONFIG_FAN_EVENT_BENCHMARK */
+
+void Event_bench_init(void) {}
+void Event_bench_dequeued(const Fan_event_t *event) { UNUSED_PARAM(event); }
+void Event_bench_applied(void) {}
+void Event_bench_register_http_handler(void) {}
+
+#endif /* CONFIG_FAN_EVENT_BENCHMARK */
+
+/** @} end EventBench */
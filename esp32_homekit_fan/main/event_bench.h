@@ -0,0 +1,24 @@
+/**
+ * @file event_bench.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to benchmark the fan event pipeline with synthetic events.
+ *
+ * @addtogroup EventBench
+ * @{
+ */
+
+#ifndef EVENT_BENCH_H
+#define EVENT_BENCH_H
+
+#include "main.h" /* Fan_event_t */
+
+/** Public functions for the EventBench component */
+void Event_bench_init(void);
+void Event_bench_dequeued(const Fan_event_t *event);
+void Event_bench_applied(void);
+void Event_bench_register_http_handler(void);
+
+#endif /* EVENT_BENCH_H */
+
+/** @} end EventBench */
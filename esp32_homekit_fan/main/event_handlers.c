@@ -4,259 +4,516 @@
  * @date 2023
  * @brief "Component" to handle incoming events from different sources.
  *
- * We expect events to come from three distinct sources: HomeKit, IR remote
- * interrupts, and front-fascia button interrupts. Each of these operate
- * slightly differently, and thus require separate handling.
+ * We expect events to come from nine distinct sources: HomeKit, IR remote
+ * interrupts, front-fascia button interrupts, the sleep timer, on-device
+ * schedules, the ESP-NOW link between a bridge and its satellites, the local
+ * UDP control API, an MQTT broker, and the temperature auto mode. Each of
+ * these operate slightly differently, and thus require separate handling.
+ *
+ * Rather than each source getting its own switch statement, every transition
+ * lives in a single constant table indexed by (source, id, argument, current
+ * state). The fan state is packed into a small index so the whole table can be
+ * built at compile time, and handling an event is a single lookup.
+ *
+ * Events fold into a target fan state without touching the relays. Once every
+ * pending event has been folded, only the outputs that actually differ are
+ * written to the hardware. This way a burst of events (such as dragging the
+ * speed slider in the Apple Home app) only causes as much relay chatter as
+ * there are distinct states.
+ *
+ * Because the IR remote and button events occur only on the hardware, they
+ * have to update the HomeKit state after being applied such that a user can
+ * see up-to-date status changes in the Apple Home app.
  *
- * Each of these handlers will make appropriate alterations to the hardware and
- * internal state. Because the IR remote and button events occur only on the
- * hardware, they have to update the HomeKit state after finishing such that a
- * user can see up-to-date status changes in the Apple Home app.
- * 
  * @addtogroup EventHandlers
  * @{
  */
 
 #include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
 
 #include <esp_log.h> /* ESP logging functions */
 
 #include "main.h"
 #include "led.h"
 #include "relay.h"
+#include "phase.h"
 #include "homekit.h"
+#include "button.h"
+#include "storage.h"
+#include "sleep_timer.h"
+#include "link.h"
+#include "warm_boot.h"
+#include "event_handlers.h"
+
+/** Layout of a packed fan state index */
+#define STATE_SPEED_MASK 0x07
+#define STATE_OSC_BIT    0x08
+#define STATE_ON_BIT     0x10
+#define NUM_STATE        32
+
+/** Number of distinct event arguments, speeds and timer settings being the widest */
+#define NUM_ARG NUM_SPEED
+_Static_assert((int) NUM_TIMER <= (int) NUM_ARG, "Timer settings must fit in an event argument");
+
+/** Flags in a transition entry to step or set (to the argument) the sleep timer */
+#define TRANSITION_TIMER_STEP 0x20
+#define TRANSITION_TIMER_SET  0x40
+/** Flag in a transition entry to toggle the front-fascia LEDs */
+#define TRANSITION_LED_TOGGLE 0x80
+/** Mask of a transition entry giving the next packed state */
+#define TRANSITION_STATE_MASK 0x1F
+
+/** Helpers to pick apart and build packed states */
+#define ST_SPEED(s) ((s) & STATE_SPEED_MASK)
+#define ST_OSC(s)   (0 != ((s) & STATE_OSC_BIT))
+#define ST_ON(s)    (0 != ((s) & STATE_ON_BIT))
+#define ST_PACK(on, osc, speed) \
+    (((on) ? STATE_ON_BIT : 0) | ((osc) ? STATE_OSC_BIT : 0) | (speed))
+
+/** Whether a packed state holds a real stored speed, others map to themselves */
+#define ST_VALID(s) (ST_SPEED(s) >= SPEED_1 && ST_SPEED(s) <= SPEED_4)
+
+/**
+ * Transitions for each (source, id) pair, given an argument a and a packed
+ * state s. These are only ever expanded at compile time into the table below.
+ */
+
+/** Events that don't change the fan */
+#define T_NONE(a, s) (s)
+
+/**
+ * HomeKit sets values outright. It'll often send power on and speed change
+ * events together, in a semi-random order (race condition?). Thus, a speed of
+ * zero is ignored and left to the power event that comes before/after it.
+ */
+#define T_HK_POWER(a, s) ST_PACK((a), ST_OSC(s), ST_SPEED(s))
+#define T_HK_OSC(a, s)   ST_PACK(ST_ON(s), (a), ST_SPEED(s))
+#define T_HK_SPEED(a, s) ((SPEED_OFF == (a)) ? (s) : ST_PACK(ST_ON(s), ST_OSC(s), (a)))
+
+/**
+ * Because the power button cycles through speeds / on-off, we need to calculate
+ * the speed to switch to. We never want to set our stored speed to off, giving
+ * the following state changes:
+ *
+ * (fan off) SPEED_4 -> (fan on)  SPEED_4
+ * (fan on)  SPEED_4 ->           SPEED_3
+ *           SPEED_3 ->           SPEED_2
+ *           SPEED_2 ->           SPEED_1
+ *           SPEED_1 -> (fan off) SPEED_4
+ */
+#define T_BTN_POWER(a, s)                                                    \
+    (!ST_VALID(s)              ? (s) :                                       \
+     !ST_ON(s)                 ? ST_PACK(true, ST_OSC(s), ST_SPEED(s)) :     \
+     (SPEED_1 == ST_SPEED(s))  ? ST_PACK(false, ST_OSC(s), SPEED_4) :        \
+                                 ST_PACK(true, ST_OSC(s), ST_SPEED(s) - 1))
+
+/** Toggles shared by the button and the remote */
+#define T_TOGGLE_POWER(a, s) ST_PACK(!ST_ON(s), ST_OSC(s), ST_SPEED(s))
+#define T_TOGGLE_OSC(a, s)   ST_PACK(ST_ON(s), !ST_OSC(s), ST_SPEED(s))
+
+/**
+ * Holding a remote button down keeps sending held events. Only the speed button
+ * acts on them, every other button acts once per press.
+ */
+#define T_RMT_POWER(a, s) ((REMOTE_HELD == (a)) ? (s) : T_TOGGLE_POWER(a, s))
+#define T_RMT_OSC(a, s)   ((REMOTE_HELD == (a)) ? (s) : T_TOGGLE_OSC(a, s))
+
+/**
+ * The remote speed button, and holding the power button, go to the next lowest
+ * speed with wraparound back to SPEED_4, but only while the fan is on. Holding
+ * either keeps stepping:
+ *
+ * SPEED_4 -> SPEED_3
+ * SPEED_3 -> SPEED_2
+ * SPEED_2 -> SPEED_1
+ * SPEED_1 -> SPEED_4
+ */
+#define T_STEP_SPEED(a, s)                                                   \
+    ((!ST_VALID(s) || !ST_ON(s)) ? (s) :                                     \
+     ST_PACK(true, ST_OSC(s), ((ST_SPEED(s) - 2 + SPEED_4) % SPEED_4) + 1))
+
+/**
+ * The sleep timer only runs while the fan is on. The remote clock button steps
+ * through the timer settings, once per press, like the stock Lasko:
+ *
+ * TIMER_OFF -> TIMER_1H -> TIMER_2H -> TIMER_4H -> TIMER_8H -> TIMER_OFF
+ *
+ * HomeKit sets the timer outright, with the setting as the argument.
+ */
+#define T_STEP_TIMER(a, s) \
+    ((REMOTE_HELD == (a) || !ST_ON(s)) ? (s) : ((s) | TRANSITION_TIMER_STEP))
+#define T_HK_TIMER(a, s) (!ST_ON(s) ? (s) : ((s) | TRANSITION_TIMER_SET))
+
+/**
+ * Without the auto mode, the remote has no use for the temperature button, so
+ * it is used to enable and disable the front-fascia LEDs. So is a double tap on
+ * the oscillation button. With it, the temperature button toggles the auto
+ * mode instead, which lives outside the packed state like the sleep timer.
+ */
+#define T_TOGGLE_LEDS(a, s) ((REMOTE_HELD == (a)) ? (s) : ((s) | TRANSITION_LED_TOGGLE))
+#ifdef CONFIG_FAN_AUTO
+#define T_RMT_TEMP(a, s) T_NONE(a, s)
+#else
+#define T_RMT_TEMP(a, s) T_TOGGLE_LEDS(a, s)
+#endif
+
+/** Expand a transition over every packed state, then over every argument */
+#define T_ROW4(t, a, s) t(a, (s)), t(a, (s) + 1), t(a, (s) + 2), t(a, (s) + 3)
+#define T_ROW(t, a)                                                          \
+    { T_ROW4(t, a,  0), T_ROW4(t, a,  4), T_ROW4(t, a,  8), T_ROW4(t, a, 12), \
+      T_ROW4(t, a, 16), T_ROW4(t, a, 20), T_ROW4(t, a, 24), T_ROW4(t, a, 28) }
+#define T_ARGS(t) { T_ROW(t, 0), T_ROW(t, 1), T_ROW(t, 2), T_ROW(t, 3), T_ROW(t, 4) }
 
 /** Tag used for ESP logging */
 static const char *TAG = "EventHandlers";
 
-/** Global semaphore for adding events */
-volatile bool g_Fan_event_lock;
+/** Transition table, yields the next packed state plus any transition flags */
+static const uint8_t transitions[NUM_SOURCE][NUM_EVENT_ID][NUM_ARG][NUM_STATE] = {
+    [SOURCE_HOMEKIT] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_HK_OSC),
+        [ID_TIME]        = T_ARGS(T_HK_TIMER),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    [SOURCE_REMOTE] = {
+        [ID_POWER]       = T_ARGS(T_RMT_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_RMT_OSC),
+        [ID_TIME]        = T_ARGS(T_STEP_TIMER),
+        [ID_SPEED]       = T_ARGS(T_STEP_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_RMT_TEMP),
+    },
+    [SOURCE_BUTTON] = {
+        [ID_POWER]       = T_ARGS(T_BTN_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_TOGGLE_OSC),
+        [ID_TIME]        = T_ARGS(T_TOGGLE_LEDS),
+        [ID_SPEED]       = T_ARGS(T_STEP_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    [SOURCE_TIMER] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_NONE),
+        [ID_TIME]        = T_ARGS(T_NONE),
+        [ID_SPEED]       = T_ARGS(T_NONE),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    [SOURCE_SCHEDULE] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_NONE),
+        [ID_TIME]        = T_ARGS(T_NONE),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    /* The link carries whole states, set outright like HomeKit */
+    [SOURCE_LINK] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_HK_OSC),
+        [ID_TIME]        = T_ARGS(T_HK_TIMER),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    /* UDP commands take the same arguments as HomeKit writes */
+    [SOURCE_UDP] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_HK_OSC),
+        [ID_TIME]        = T_ARGS(T_HK_TIMER),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    /* So do MQTT commands */
+    [SOURCE_MQTT] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_HK_OSC),
+        [ID_TIME]        = T_ARGS(T_HK_TIMER),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+    /* The auto mode sets power and speed outright, but nothing else */
+    [SOURCE_AUTO] = {
+        [ID_POWER]       = T_ARGS(T_HK_POWER),
+        [ID_OSCILLATE]   = T_ARGS(T_NONE),
+        [ID_TIME]        = T_ARGS(T_NONE),
+        [ID_SPEED]       = T_ARGS(T_HK_SPEED),
+        [ID_TEMPERATURE] = T_ARGS(T_NONE),
+    },
+};
 
 /**
- * @brief   Handler for HomeKit-sourced events.
- * @details This function gets called whenever there is a new event with the
- *          HomeKit source type. You'll note that the handling here is a bit
- *          odd, and that is due to how HomeKit handles power on/speed change
- *          events.
- * 
- *          It'll often send power on and speed change events together, in a
- *          semi-random order (race condition?). Thus, I've added some logic to
- *          handle these scenarios. 
- * @param   event [in] HomeKit event to handle
+ * @brief  Pack a fan state into a table index.
+ * @param  state [in] State to pack
+ * @return Packed state index.
  */
-void handle_homekit(Fan_event_t *event)
+static inline uint8_t pack_state(const Fan_state_t *state)
 {
-    switch (event->id)
-    {
-        case ID_POWER:
-            if (g_Fan_state.on == (bool) event->arg)
-            {
-                /* Ignore redundant power events (ON->ON or OFF->OFF) */
-                break;
-            }
+    return ST_PACK(state->on, state->oscillate, state->speed & STATE_SPEED_MASK);
+}
 
-            /* If we are turning on, utilize the stored speed state. If we are
-             * turning off, simply use the off speed.
-             */
-            Relay_write_speed((event->arg) ? g_Fan_state.speed : SPEED_OFF);
-            
-            /* If we are turning on, utilize the stored oscillation state. If we
-             * are turning off, simply use false.
-             */
-            Relay_write_oscillate((event->arg) ? g_Fan_state.oscillate : false);
-
-            /* Update the global state and finish */
-            g_Fan_state.on = (bool) event->arg;
-            break;
-
-        case ID_OSCILLATE:
-            if (g_Fan_state.on)
-            {
-                /* If we are on, immediately apply the new state */
-                Relay_write_oscillate((bool) event->arg);
-            }
+/**
+ * @brief Unpack a table index into a fan state, marking what changed as dirty.
+ * @param packed Packed state index
+ * @param state  [in,out] Unpacked state
+ */
+static inline void unpack_state(uint8_t packed, Fan_state_t *state)
+{
+    bool             on        = ST_ON(packed);
+    bool             oscillate = ST_OSC(packed);
+    enum State_speed speed     = (enum State_speed) ST_SPEED(packed);
 
-            /* If we were off, the new state will be applied the next time the
-             * fan powers on.
-             */
+    state->dirty |= ((on != state->on) ? STATE_DIRTY_ON : 0) |
+                    ((oscillate != state->oscillate) ? STATE_DIRTY_OSCILLATE : 0) |
+                    ((speed != state->speed) ? STATE_DIRTY_SPEED : 0);
 
-            /* Update the global state and finish */
-            g_Fan_state.oscillate = (bool) event->arg;
-            break;
+    state->on        = on;
+    state->oscillate = oscillate;
+    state->speed     = speed;
+}
 
-        case ID_SPEED:
-            if (SPEED_OFF == (enum State_speed) event->arg)
-            {
-                /* If we are being turned off, leave handling to the power event
-                 * that will come before/after this event.
-                 */
-                break;
-            }
+#ifdef CONFIG_FAN_AUTO
+/**
+ * @brief   Fold an event into the auto mode of a target state.
+ * @details The remote temperature button toggles the auto mode once per press,
+ *          everything else sets it outright. Taking over power or speed from
+ *          any source but the auto mode itself drops back to manual, so the
+ *          fan never fights a user.
+ * @param   event     [in]     Event being handled
+ * @param   state     [in,out] Target state, already folded
+ * @param   was_on    Whether the fan was on before the event
+ * @param   was_speed Speed of the fan before the event
+ */
+static void fold_auto_mode(const Fan_event_t *event, Fan_state_t *state, bool was_on, enum State_speed was_speed)
+{
+    bool auto_mode = state->auto_mode;
 
-            if (g_Fan_state.on)
-            {
-                /* If we are on, immediately apply the new state */
-                Relay_write_speed((enum State_speed) event->arg);
-            }
+    if (ID_TEMPERATURE == event->id)
+    {
+        if (SOURCE_REMOTE != event->source)
+        {
+            auto_mode = (0 != event->arg);
+        }
+        else if (REMOTE_PRESS == event->arg)
+        {
+            auto_mode = !auto_mode;
+        }
+    }
+    else if (SOURCE_AUTO != event->source && (was_on != state->on || was_speed != state->speed))
+    {
+        auto_mode = false;
+    }
+
+    if (auto_mode != state->auto_mode)
+    {
+        state->auto_mode = auto_mode;
+        state->dirty    |= STATE_DIRTY_AUTO;
+    }
+}
+#endif /* CONFIG_FAN_AUTO */
 
-            /* If we were off, the new state will be applied the next time the
-             * fan powers on.
-             */
-            
-            /* Update the global state and finish */
-            g_Fan_state.speed = (enum State_speed) event->arg;
+/**
+ * @brief   Fold an event into the exact speed of a target state.
+ * @details The table only knows speed levels. A speed event carrying an exact
+ *          speed sets it, as long as the table took the event and it landed in
+ *          that level. Anything else moving the level goes to the top of the
+ *          new level, which is all the relays can do anyway.
+ * @param   event [in]     Event being handled
+ * @param   state [in,out] Target state, already folded
+ */
+static void fold_speed_pct(const Fan_event_t *event, Fan_state_t *state)
+{
+    uint8_t pct = state->speed_pct;
 
-            break;
+    if (ID_SPEED == event->id && 0 != event->pct && Speed_from_pct(event->pct) == state->speed)
+    {
+        pct = event->pct;
+    }
+    else if (Speed_from_pct(pct) != state->speed)
+    {
+        pct = Speed_to_pct(state->speed);
+    }
 
-        default:
-            ESP_LOGW(TAG, "Unhandled event ID");
-            break;
+    if (pct != state->speed_pct)
+    {
+        state->speed_pct = pct;
+        state->dirty    |= STATE_DIRTY_SPEED;
     }
 }
 
 /**
- * @brief   Handler for Button-sourced events.
- * @details This function gets called whenever there is a new event with the
- *          Button source type. Handling for the front-fascia buttons is a bit
- *          different as the power button will cycle through speeds. The rest is
- *          fairly simple.
- * @param   event [in] Button event to handle
+ * @brief   Fold an incoming event into a target state.
+ * @details Looks up the transition for the event's source, ID and argument. For
+ *          button events, picking up the event releases the button's latch,
+ *          which hands back every press made since the event was sent. Each
+ *          press is folded in turn so none are lost.
+ *
+ *          The sleep timer isn't part of the packed state, so entries carry
+ *          flags to step or set it instead. Turning off always clears it. The
+ *          exact speed and the auto mode aren't either, and are folded in
+ *          afterwards.
+ * @param   event [in]     Event to handle
+ * @param   state [in,out] Target state to fold the event into
+ * @return  Outputs toggled by the event beyond the state itself.
  */
-void handle_button(Fan_event_t *event)
+uint8_t handle_event(const Fan_event_t *event, Fan_state_t *state)
 {
-    switch (event->id)
+    if (event->source >= NUM_SOURCE || event->id >= NUM_EVENT_ID || event->arg >= NUM_ARG)
     {
-        case ID_POWER:
-            /**
-             * Because the power button cycles through speeds / on-off, we need
-             * to calculate the speed to switch to. This is a bit funky as we
-             * never want to set our current speed to off. Thus, we do fancy
-             * math to ensure the following state changes:
-             *
-             * (fan off) SPEED_4 -> (fan on)  SPEED_4
-             * (fan on)  SPEED_4 ->           SPEED_3
-             *           SPEED_3 ->           SPEED_2
-             *           SPEED_2 ->           SPEED_1
-             *           SPEED_1 -> (fan off) SPEED_4
-             */
-            enum State_speed next_speed = (((g_Fan_state.speed) - 1) % NUM_SPEED) + !g_Fan_state.on;
-
-            /* Update the speed relays */
-            Relay_write_speed(next_speed);
-
-            /* Update the oscillation relay */
-            Relay_write_oscillate((SPEED_OFF != next_speed) ? g_Fan_state.oscillate : false);
-
-            /* Update the global state and finish */
-            g_Fan_state.speed = (SPEED_OFF != next_speed) ? next_speed : SPEED_4;
-            g_Fan_state.on = (SPEED_OFF != next_speed);
-            break;
-
-        case ID_OSCILLATE:
-            if (g_Fan_state.on)
-            {
-                /* If we are on, immediately apply the new state */
-                Relay_write_oscillate(!g_Fan_state.oscillate);
-            }
+        ESP_LOGW(TAG, "Unhandled event");
+        return 0;
+    }
 
-            /* If we were off, the new state will be applied the next time the
-             * fan powers on.
-             */
+    uint32_t presses = (SOURCE_BUTTON == event->source) ? Button_release(event->id) : 1;
+    uint8_t  packed  = pack_state(state);
+    uint8_t  toggled = 0;
 
-            /* Update the global state and finish */
-            g_Fan_state.oscillate = !g_Fan_state.oscillate;
-            break;
+    enum State_timer timer     = state->timer;
+    bool             was_on    = state->on;
+    enum State_speed was_speed = state->speed;
 
-        default:
-            ESP_LOGW(TAG, "Unhandled event ID");
-            break;
+    const uint8_t *row = transitions[event->source][event->id][event->arg];
+    for (; presses > 0; presses--)
+    {
+        uint8_t entry = row[packed];
+
+        packed   = entry & TRANSITION_STATE_MASK;
+        toggled ^= (entry & TRANSITION_LED_TOGGLE) ? OUTPUT_LED_ENABLE : 0;
+
+        if (entry & TRANSITION_TIMER_SET)
+        {
+            timer = (enum State_timer) event->arg;
+        }
+        else if (entry & TRANSITION_TIMER_STEP)
+        {
+            timer = (enum State_timer) ((timer + 1) % NUM_TIMER);
+        }
+    }
+
+    unpack_state(packed, state);
+    fold_speed_pct(event, state);
+
+#ifdef CONFIG_FAN_AUTO
+    fold_auto_mode(event, state, was_on, was_speed);
+#else
+    UNUSED_PARAM(was_on);
+    UNUSED_PARAM(was_speed);
+#endif
+
+    if (!state->on)
+    {
+        timer = TIMER_OFF;
     }
+    if (timer != state->timer)
+    {
+        state->timer  = timer;
+        state->dirty |= STATE_DIRTY_TIMER;
+    }
+
+    return toggled;
+}
 
-    /* Event triggered by hardware, report hardware changes to HomeKit */
-    HomeKit_update_char();
+/**
+ * @brief  Work out which outputs differ between two states.
+ * @param  from [in] State currently on the hardware
+ * @param  to   [in] State to move to
+ * @return Set of OUTPUT_* groups that need writing.
+ */
+uint8_t diff_outputs(const Fan_state_t *from, const Fan_state_t *to)
+{
+    /* Speed and oscillation only make it to the outputs while on. Phase
+       control drives the exact speed, the relays only the level */
+#ifdef CONFIG_FAN_PHASE_CONTROL
+    uint8_t          from_speed = (from->on) ? from->speed_pct : 0;
+    uint8_t          to_speed   = (to->on) ? to->speed_pct : 0;
+#else
+    enum State_speed from_speed = (from->on) ? from->speed : SPEED_OFF;
+    enum State_speed to_speed   = (to->on) ? to->speed : SPEED_OFF;
+#endif
+    bool             from_osc   = from->on && from->oscillate;
+    bool             to_osc     = to->on && to->oscillate;
+
+    return ((from_speed != to_speed) ? OUTPUT_SPEED : 0) |
+           ((from_osc != to_osc) ? OUTPUT_OSCILLATE : 0) |
+           ((from->timer != to->timer) ? OUTPUT_TIMER : 0);
 }
 
 /**
- * @brief   Handler for Remote-sourced events.
- * @details This function gets called whenever there is a new event with the
- *          Remote source type. Handling here differs in that the remote
- *          includes 5 different events that can be triggered. Implementation
- *          for even shared events like power/oscillation/speed differ a bit,
- *          which is why this exists.
- * @param   event [in] Remote event to handle
+ * @brief   Apply a target state to the hardware of a fan.
+ * @details Writes only the output groups that changed and then commits the
+ *          target as the new global state of the fan. Only the characteristics
+ *          marked dirty in the target are reported to HomeKit, and only a
+ *          dirty target gets saved. Without report, only the characteristics
+ *          derived from the state are.
+ * @param   fan     Fan the state is for
+ * @param   state   [in] Target state to apply
+ * @param   changed Set of OUTPUT_* groups to write
+ * @param   report  Whether to report the new state to HomeKit
  */
-void handle_remote(Fan_event_t *event)
+void apply_state(uint8_t fan, const Fan_state_t *state, uint8_t changed, bool report)
 {
-    switch (event->id)
+    enum State_speed speed = (state->on) ? state->speed : SPEED_OFF;
+
+    if (changed & OUTPUT_SPEED)
     {
-        case ID_POWER:
-            /* Either turn off the fan or set it to the previous speed */
-            Relay_write_speed((g_Fan_state.on) ? SPEED_OFF : g_Fan_state.speed);
+#ifdef CONFIG_FAN_PHASE_CONTROL
+        Phase_write_speed(fan, (state->on) ? state->speed_pct : 0);
+#else
+        Relay_write_speed(fan, speed);
+#endif
+    }
 
-            /* Either turn off oscillation or set it to the previous state */
-            Relay_write_oscillate((g_Fan_state.on) ? false : g_Fan_state.oscillate);
+    if (changed & OUTPUT_OSCILLATE)
+    {
+        Relay_write_oscillate(fan, state->on && state->oscillate);
+    }
 
-            /* Update the global state and finish */
-            g_Fan_state.on = !g_Fan_state.on;
-            break;
+    if (changed & OUTPUT_LED_ENABLE)
+    {
+        Led_write_enable(!g_Led_enable);
 
-        case ID_OSCILLATE:
-            if (g_Fan_state.on)
+        /* The enable covers every fan, so bring the others back too */
+        for (uint8_t other = 0; other < FAN_NUM_FANS; other++)
+        {
+            if (other != fan)
             {
-                /* If we are on, immediately apply the new state */
-                Relay_write_oscillate(!g_Fan_state.oscillate);
+                const Fan_state_t *other_state = &g_Fan_state[other];
+                Led_write_speed(other, (other_state->on) ? other_state->speed : SPEED_OFF);
             }
+        }
+    }
 
-            /* Update the global state and finish */
-            g_Fan_state.oscillate = !g_Fan_state.oscillate;
-            break;
+    if (changed & (OUTPUT_SPEED | OUTPUT_LED_ENABLE))
+    {
+        /* Update the front-fascia LEDs with any changes */
+        Led_write_speed(fan, speed);
+    }
 
-        case ID_SPEED:
-            if (!g_Fan_state.on)
-            {
-                /* We only accept speed events when the fan is on */
-                break;
-            }
+    if (changed & OUTPUT_TIMER)
+    {
+        /* Restart the countdown for the new timer setting */
+        Sleep_timer_set(fan, state->timer);
+    }
 
-            /**
-             * More fun math!
-             *
-             * The goal of this calculation is to get the next lowest speed with
-             * wraparound back to SPEED_4. I ran into a problem where negative
-             * values weren't properly transitioning back into the enum, which I
-             * solved by adding SPEED_4, which is cancelled out by the modulus.
-             *
-             * Also note that there is a -1/+1 pair to shift the enum to start
-             * at 0. This is to ignore the SPEED_OFF value. To summarize:
-             *
-             * SPEED_4 -> SPEED_3
-             * SPEED_3 -> SPEED_2
-             * SPEED_2 -> SPEED_1
-             * SPEED_1 -> SPEED_4
-             */
-            enum State_speed next_speed = ((((int) g_Fan_state.speed - 1) - 1 + SPEED_4) % SPEED_4) + 1;
-            Relay_write_speed(next_speed);
-
-            /* Update the global state and finish */
-            g_Fan_state.speed = next_speed;
-            break;
-
-        case ID_TIME:
-        case ID_TEMPERATURE:
-            /**
-             * No current use for these buttons, so using them to enable and
-             * disable the front-fascia LEDs.
-             */
-            Led_write_enable(!g_Led_enable);
-            break;
-
-        default:
-            ESP_LOGW(TAG, "Unhandled event ID");
-            break;
+    /* Update the global state, and save it once things settle down */
+    Fan_state_commit(fan, state);
+    Warm_boot_save(fan, &g_Fan_state[fan]);
+    if (state->dirty)
+    {
+        Storage_save_later(fan, &g_Fan_state[fan]);
     }
 
-    /* Update HomeKit with whatever happened */
-    HomeKit_update_char();
+#ifdef CONFIG_FAN_LINK_SATELLITE
+    if (report && state->dirty)
+    {
+        /* Satellites have no HomeKit of their own, the bridge reports for them */
+        Link_send_state(fan, &g_Fan_state[fan]);
+    }
+#else
+    if (state->dirty)
+    {
+        /* Changes from the hardware are reported to HomeKit. Those HomeKit
+           wrote still need their derived characteristics updated. */
+        HomeKit_update_char(fan, state->dirty, !report);
+    }
+#endif
 }
 
 /** @} end EventHandlers */
@@ -11,11 +11,20 @@
 #ifndef EVENT_HANDLERS_H
 #define EVENT_HANDLERS_H
 
-#include "main.h" /* Fan_event_t */
+#include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
 
-void handle_homekit(Fan_event_t *event);
-void handle_button(Fan_event_t *event);
-void handle_remote(Fan_event_t *event);
+#include "main.h"    /* Fan_event_t, Fan_state_t */
+
+/** Output groups that a state transition can change */
+#define OUTPUT_SPEED      0x01 /** Speed relays and LEDs */
+#define OUTPUT_OSCILLATE  0x02 /** Oscillation relay */
+#define OUTPUT_LED_ENABLE 0x04 /** Front-fascia LED enable */
+#define OUTPUT_TIMER      0x08 /** Sleep timer countdown */
+
+uint8_t handle_event(const Fan_event_t *event, Fan_state_t *state);
+uint8_t diff_outputs(const Fan_state_t *from, const Fan_state_t *to);
+void apply_state(uint8_t fan, const Fan_state_t *state, uint8_t changed, bool report);
 
 #endif /* EVENT_HANDLERS_H */
 
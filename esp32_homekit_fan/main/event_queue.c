@@ -0,0 +1,199 @@
+/**
+ * @file event_queue.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to pass control events to the main event handler task.
+ *
+ * Events come in from a few places: the button ISRs, the IR remote task, and
+ * the HomeKit thread. They all end up in front of the single event handler
+ * task in main.c, so what we need is a multi-producer, single-consumer queue.
+ *
+ * Rather than a heap-allocated FreeRTOS queue, events are kept in a statically
+ * allocated ring buffer. Producers only hold a spinlock for the few cycles it
+ * takes to copy an event in, and then wake the consumer with a direct-to-task
+ * notification. This keeps the ISR path cheap and the memory use fixed.
+ *
+ * The ring also keeps track of its high-water mark and how many events were
+ * dropped because it was full, so we can tell if it is sized properly.
+ * 
+ * @addtogroup EventQueue
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+
+#include <esp_attr.h>          /* Extra function attributes (IRAM_ATTR) */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Direct-to-task notifications */
+#include <hap_platform_trace.h> /* Optional trace points */
+
+#include "main.h"
+#include "event_queue.h"
+
+/** Number of events the ring can hold, must be a power of two */
+#define EVENT_QUEUE_LENGTH 16
+/** Mask to wrap ring indices */
+#define EVENT_QUEUE_MASK   (EVENT_QUEUE_LENGTH - 1)
+
+/** Storage for queued events */
+static Fan_event_t ring[EVENT_QUEUE_LENGTH];
+
+/** Free-running write/read counters, wrapped with EVENT_QUEUE_MASK */
+static uint32_t head;
+static uint32_t tail;
+
+/** Spinlock guarding the ring, safe to take from tasks and ISRs */
+static portMUX_TYPE ring_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** Task to notify when events are added */
+static TaskHandle_t consumer_task;
+
+/** Fill-level counters for the ring */
+static Event_queue_stats_t ring_stats;
+
+/**
+ * @brief  Copy an event into the ring if there is room.
+ * @param  event [in] Event to add
+ * @return Whether the event was added.
+ */
+static bool IRAM_ATTR push(const Fan_event_t *event)
+{
+    bool pushed = false;
+
+    portENTER_CRITICAL_SAFE(&ring_lock);
+
+    uint32_t used = head - tail;
+    if (used < EVENT_QUEUE_LENGTH)
+    {
+        ring[head & EVENT_QUEUE_MASK] = *event;
+        head++;
+        used++;
+
+        if (used > ring_stats.high_water)
+        {
+            ring_stats.high_water = used;
+        }
+
+        pushed = true;
+    }
+    else
+    {
+        /* Full, the event is dropped */
+        ring_stats.overflows++;
+    }
+
+    portEXIT_CRITICAL_SAFE(&ring_lock);
+
+    return pushed;
+}
+
+/**
+ * @brief  Copy the oldest event out of the ring, if there is one.
+ * @param  event [out] Event removed from the ring
+ * @return Whether an event was removed.
+ */
+static bool pop(Fan_event_t *event)
+{
+    bool popped = false;
+
+    portENTER_CRITICAL(&ring_lock);
+
+    if (head != tail)
+    {
+        *event = ring[tail & EVENT_QUEUE_MASK];
+        tail++;
+        popped = true;
+    }
+
+    portEXIT_CRITICAL(&ring_lock);
+
+    return popped;
+}
+
+/**
+ * @brief  Send an event to the event handler task, from task context.
+ * @param  event [in] Event to send
+ * @return Whether the event was queued, false if the queue was full.
+ */
+bool Event_queue_send(const Fan_event_t *event)
+{
+    if (!push(event))
+    {
+        return false;
+    }
+    HAP_TRACE_MARK(HAP_TRACE_APP_ENQUEUE, event->id);
+
+    if (NULL != consumer_task)
+    {
+        (void) xTaskNotifyGive(consumer_task);
+    }
+
+    return true;
+}
+
+/**
+ * @brief  Send an event to the event handler task, from an ISR.
+ * @param  event [in]  Event to send
+ * @param  woken [out] Set if a higher-priority task was woken
+ * @return Whether the event was queued, false if the queue was full.
+ */
+bool IRAM_ATTR Event_queue_send_from_isr(const Fan_event_t *event, BaseType_t *woken)
+{
+    if (!push(event))
+    {
+        return false;
+    }
+
+    if (NULL != consumer_task)
+    {
+        vTaskNotifyGiveFromISR(consumer_task, woken);
+    }
+
+    return true;
+}
+
+/**
+ * @brief   Receive the oldest event, waiting for one if needed.
+ * @details Must only be called from the consumer task given to
+ *          Event_queue_init(), as that is the task that gets notified.
+ * @param   event         [out] Event received
+ * @param   ticks_to_wait Maximum number of ticks to wait for an event
+ * @return  Whether an event was received.
+ */
+bool Event_queue_receive(Fan_event_t *event, TickType_t ticks_to_wait)
+{
+    while (!pop(event))
+    {
+        if (0 == ulTaskNotifyTake(pdTRUE, ticks_to_wait))
+        {
+            /* Timed out with nothing new */
+            return false;
+        }
+    }
+    HAP_TRACE_MARK(HAP_TRACE_APP_DEQUEUE, event->id);
+
+    return true;
+}
+
+/**
+ * @brief Get a copy of the fill-level counters for the queue.
+ * @param stats [out] Current counters
+ */
+void Event_queue_get_stats(Event_queue_stats_t *stats)
+{
+    portENTER_CRITICAL(&ring_lock);
+    *stats = ring_stats;
+    portEXIT_CRITICAL(&ring_lock);
+}
+
+/**
+ * @brief Initializer for the EventQueue component.
+ * @param consumer Task that will receive events.
+ */
+void Event_queue_init(TaskHandle_t consumer)
+{
+    consumer_task = consumer;
+}
+
+/** @} end EventQueue */
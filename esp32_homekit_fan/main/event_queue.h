@@ -0,0 +1,38 @@
+/**
+ * @file event_queue.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to pass control events to the main event handler task.
+ * 
+ * @addtogroup EventQueue
+ * @{
+ */
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Task handles */
+
+#include "main.h"              /* Fan_event_t */
+
+/** Counters describing how full the event queue has been */
+typedef struct Event_queue_stats_t
+{
+    uint32_t high_water; /** Most events ever waiting at once */
+    uint32_t overflows;  /** Events dropped because the queue was full */
+} Event_queue_stats_t;
+
+/** Public functions for the EventQueue component */
+bool Event_queue_send(const Fan_event_t *event);
+bool Event_queue_send_from_isr(const Fan_event_t *event, BaseType_t *woken);
+bool Event_queue_receive(Fan_event_t *event, TickType_t ticks_to_wait);
+void Event_queue_get_stats(Event_queue_stats_t *stats);
+void Event_queue_init(TaskHandle_t consumer);
+
+#endif /* EVENT_QUEUE_H */
+
+/** @} end EventQueue */
@@ -12,62 +12,416 @@
  * and configure it with the proper services and characteristics. It also
  * implements a write callback which fires whenever HomeKit sends an update for
  * a characteristic.
+ *
+ * Reads are served by a bulk read callback from a snapshot of the fan state,
+ * so state changes only have to be pushed into the HAP library for the
+ * characteristics a controller is subscribed to. Everything else is left
+ * stale until it is read.
+ *
+ * With CONFIG_FAN_BRIDGE, the accessory becomes a bridge with one bridged
+ * accessory per fan, each with its own Fan service. Writes are routed to the
+ * right fan by the service private data. Notifications for every fan go out
+ * over the one controller session after the same coalescing window, so a
+ * change to several fans is reported in one batch.
  * 
  * @addtogroup HomeKit
  * @{
  */
 
+#include <stdio.h>                 /* snprintf */
+#include <stdint.h>                /* Extended integer types */
 #include <string.h>                /* For memory/string-related functions */
 
 #include <esp_log.h>               /* ESP logging functions */
+#include <esp_timer.h>             /* High-resolution timestamps */
 #include <freertos/FreeRTOS.h>     /* Basic FreeRTOS functions */
-#include <freertos/queue.h>        /* Definitions for inter-task queues */
+#include <freertos/task.h>         /* Task for building the database */
 
 #include <hap.h>                   /* HomeKit Accessory Protocol library */
 #include <hap_apple_servs.h>       /* HAP service definitions */
 #include <hap_apple_chars.h>       /* HAP service characteristic definitions */
+#include <hap_platform_trace.h>    /* Optional trace points */
 
 #include <app_wifi.h>              /* For setting up WiFi connection */
 #include <app_hap_setup_payload.h> /* For setting up the accessory with QR */
 
 #include "main.h"
 #include "homekit.h"
+#include "event_queue.h"
+#include "latency.h"
+#include "sleep_timer.h"
+#include "telemetry.h"
+#include "benchmark.h"
+#include "event_bench.h"
+#include "watchdog.h"
+#include "power.h"
+#include "udp_control.h"
+#include "auto_speed.h"
+#include "journal.h"
+#include "led.h"
+#include "thread_net.h"
+
+/** Time (in mSec) to gather characteristic changes before notifying controllers */
+#define HOMEKIT_NOTIF_COALESCE_MS 50
+
+/** Time (in mSec) to merge writes from several controllers before notifying the final value */
+#define HOMEKIT_WRITE_MERGE_MS 150
+
+/** Rotation Speed step (in %), one per fan speed */
+#define HOMEKIT_SPEED_STEP 25.0f
+
+/** Rotation Speed hysteresis, as a fraction of a step (0.2 = 5%) */
+#define HOMEKIT_SPEED_HYSTERESIS 0.2f
+
+/** Size of the buffers for the names and serial numbers of bridged fans */
+#define HOMEKIT_FAN_NAME_SIZE 16
+
+/**
+ * Whether the accessory database is built while Wi-Fi associates. SoftAP and
+ * WAC provisioning serve from the HAP HTTP server, so need HAP started first.
+ */
+#if !defined(CONFIG_FAN_HAP_BLE) && !defined(CONFIG_FAN_HAP_THREAD) && \
+    !defined(CONFIG_APP_WIFI_PROV_TRANSPORT_SOFTAP) && !defined(CONFIG_APP_WIFI_USE_WAC_PROVISIONING)
+#define HOMEKIT_PARALLEL_BOOT 1
+#else
+#define HOMEKIT_PARALLEL_BOOT 0
+#endif
+
+/** Arguments for the task building the accessory database */
+#define HOMEKIT_BUILD_NAME      "HomeKitBuild"
+#define HOMEKIT_BUILD_STACKSIZE 6 * 1024
 
 /** Tag used for ESP logging */
 static const char *TAG = "HomeKit";
 
-/** Characteristics associated with our service */
-static hap_char_t *on_char;
-static hap_char_t *oscillate_char;
-static hap_char_t *speed_char;
+static uint32_t HomeKit_arg_bool(const hap_val_t *val);
+static uint32_t HomeKit_arg_speed(const hap_val_t *val);
+static uint8_t HomeKit_speed_pct(const hap_val_t *val);
+static uint32_t HomeKit_arg_timer(const hap_val_t *val);
+#if defined(CONFIG_FAN_AUTO) || defined(CONFIG_FAN_HAP_FAN_V2)
+static uint32_t HomeKit_arg_flag(const hap_val_t *val);
+#endif
+#ifdef CONFIG_FAN_HAP_FAN_V2
+static uint8_t HomeKit_current_fan_state(const Fan_state_t *state);
+#endif
+
+/** Current Fan State values */
+#define HOMEKIT_FAN_STATE_INACTIVE 0
+#define HOMEKIT_FAN_STATE_IDLE     1
+#define HOMEKIT_FAN_STATE_BLOWING  2
+
+/**
+ * @brief   Description of the characteristics of the Fan service.
+ * @details Everything about a characteristic is in its row, then expanded by
+ *          the X-macros below into the handle enum, the write dispatch table,
+ *          the state readback and the service construction. Adding a
+ *          characteristic is a matter of adding a row.
+ *
+ *          Columns:
+ *          - handle index
+ *          - constructor from hap_apple_chars.h
+ *          - hap_val_t member holding the value
+ *          - value for the fan state in state
+ *          - STATE_DIRTY_* flag that reports it
+ *          - event ID a HomeKit write maps to
+ *          - converter from a written value to the event argument
+ *
+ *          Read-only characteristics derived from the state have no event ID
+ *          (NUM_EVENT_ID) and no converter. They are reported along with the
+ *          state they derive from, so they go out in the same notification.
+ *
+ *          Instance IDs are handed out in row order, after the Name.
+ */
+#define HOMEKIT_FAN_CHARS(X)                                                                                                                                    \
+    HOMEKIT_FAN_POWER_CHARS(X)                                                                                                                                  \
+    X(FAN_CHAR_OSCILLATE, hap_char_swing_mode_create,     b, state->oscillate,                     STATE_DIRTY_OSCILLATE, ID_OSCILLATE, HomeKit_arg_bool)  \
+    X(FAN_CHAR_SPEED,     hap_char_rotation_speed_create, f, state->speed_pct,                     STATE_DIRTY_SPEED,     ID_SPEED,     HomeKit_arg_speed) \
+    X(FAN_CHAR_TIMER,     hap_char_set_duration_create,   u, Sleep_timer_duration_s(state->timer), STATE_DIRTY_TIMER,     ID_TIME,      HomeKit_arg_timer) \
+    HOMEKIT_FAN_AUTO_CHARS(X)
+
+/**
+ * The legacy Fan service has a boolean On. Fan v2 has Active instead, plus a
+ * Current Fan State derived from power and the auto mode.
+ */
+#ifdef CONFIG_FAN_HAP_FAN_V2
+#define HOMEKIT_FAN_SERV_UUID HAP_SERV_UUID_FAN_V2
+#define HOMEKIT_FAN_POWER_CHARS(X)                                                                                                                                          \
+    X(FAN_CHAR_ON,    hap_char_active_create,            u, state->on,                         STATE_DIRTY_ON,                    ID_POWER,     HomeKit_arg_flag) \
+    X(FAN_CHAR_STATE, hap_char_current_fan_state_create, u, HomeKit_current_fan_state(state), STATE_DIRTY_ON | STATE_DIRTY_AUTO, NUM_EVENT_ID, NULL)
+#else
+#define HOMEKIT_FAN_SERV_UUID HAP_SERV_UUID_FAN
+#define HOMEKIT_FAN_POWER_CHARS(X) \
+    X(FAN_CHAR_ON, hap_char_on_create, b, state->on, STATE_DIRTY_ON, ID_POWER, HomeKit_arg_bool)
+#endif
+
+/** Target Fan State (0 manual, 1 auto) only exists with the auto mode */
+#ifdef CONFIG_FAN_AUTO
+#define HOMEKIT_FAN_AUTO_CHARS(X) \
+    X(FAN_CHAR_AUTO, hap_char_target_fan_state_create, u, state->auto_mode, STATE_DIRTY_AUTO, ID_TEMPERATURE, HomeKit_arg_flag)
+#else
+#define HOMEKIT_FAN_AUTO_CHARS(X)
+#endif
+
+/** Handle indices of the Fan service characteristics */
+typedef enum
+{
+#define HOMEKIT_CHAR_ENUM(handle, create, member, value, dirty, id, to_arg) handle,
+    HOMEKIT_FAN_CHARS(HOMEKIT_CHAR_ENUM)
+#undef HOMEKIT_CHAR_ENUM
+    NUM_FAN_CHAR /** For arithmetic */
+} HomeKit_fan_char_t;
+
+/** How a characteristic is reported and how its writes are routed */
+typedef struct
+{
+    uint8_t       dirty;                         /** STATE_DIRTY_* flags reporting it */
+    enum Event_id id;                            /** Event ID for writes, NUM_EVENT_ID if derived */
+    uint32_t    (*to_arg)(const hap_val_t *val); /** Written value to event argument */
+} HomeKit_char_desc_t;
+
+/** Write dispatch table, indexed by HomeKit_fan_char_t */
+static const HomeKit_char_desc_t fan_char_descs[NUM_FAN_CHAR] = {
+#define HOMEKIT_CHAR_DESC(handle, create, member, value, dirty, id, to_arg) [handle] = {dirty, id, to_arg},
+    HOMEKIT_FAN_CHARS(HOMEKIT_CHAR_DESC)
+#undef HOMEKIT_CHAR_DESC
+};
+
+/** Characteristics of the service of each fan, indexed by fan and HomeKit_fan_char_t */
+static hap_char_t *fan_chars[FAN_NUM_FANS][NUM_FAN_CHAR];
+
+/** Characteristic updates due from the fan states, and how many had subscribers */
+static uint32_t num_updates;
+static uint32_t num_notifications;
+
+/**
+ * @brief   Get the value of a characteristic for a fan state.
+ * @param   handle Characteristic to get the value of
+ * @param   state  [in] Fan state to get it for
+ * @param   val    [out] Value, with the unused bytes cleared
+ */
+static void HomeKit_char_value(HomeKit_fan_char_t handle, const Fan_state_t *state, hap_val_t *val)
+{
+    memset(val, 0, sizeof(*val));
+
+    switch (handle)
+    {
+#define HOMEKIT_CHAR_VALUE(handle, create, member, value, dirty, id, to_arg) \
+    case handle:                                                           \
+        val->member = (value);                                             \
+        break;
+        HOMEKIT_FAN_CHARS(HOMEKIT_CHAR_VALUE)
+#undef HOMEKIT_CHAR_VALUE
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief   Find which characteristic of a fan's service a handle is.
+ * @param   fan Fan the service belongs to
+ * @param   hc  [in] Characteristic handle from the HAP library
+ * @return  Its index, NUM_FAN_CHAR if it isn't one of ours (the Name).
+ */
+static HomeKit_fan_char_t HomeKit_char_handle(uint8_t fan, const hap_char_t *hc)
+{
+    int handle;
+
+    for (handle = 0; handle < NUM_FAN_CHAR; handle++)
+    {
+        if (fan_chars[fan][handle] == hc)
+        {
+            break;
+        }
+    }
+
+    return (HomeKit_fan_char_t) handle;
+}
 
 /**
  * @brief   Update the stored accessory state within the HAP library.
- * @details In order to avoid needing to utilize a read callback to get the
- *          current fan state, I have chosen to dynamically update the state
- *          instead. This way, whenever HomeKit gets our state no hardware or
- *          global variables need to be checked.
+ * @details Only needed for the notifications. Reads go through
+ *          HomeKit_read_callback(), so characteristics without subscribers
+ *          are skipped and left to be refreshed by the next read.
+ *
+ *          Only the characteristics that changed are updated, so toggling
+ *          oscillation doesn't cause any work for power or speed. Derived
+ *          characteristics are updated in the same pass as what they derive
+ *          from, so the HAP core sends them in the same notification batch.
+ *
+ *          For changes HomeKit wrote itself, the written characteristics
+ *          already hold the new value and only the derived ones are updated.
+ * @param   fan          Fan whose state changed
+ * @param   dirty        STATE_DIRTY_* flags for the characteristics to update
+ * @param   derived_only Whether to update just the derived characteristics
  */
-void HomeKit_update_char(void)
+void HomeKit_update_char(uint8_t fan, uint8_t dirty, bool derived_only)
 {
     hap_val_t new_val;
 
-    ESP_LOGI(TAG, "Sending updated state to HomeKit");
+    if (fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
 
-    /* Update the power state */
-    memset(&new_val, 0, sizeof(new_val));
-    new_val.b = g_Fan_state.on;
-    hap_char_update_val(on_char, &new_val);
+    if (!derived_only)
+    {
+        ESP_LOGI(TAG, "Sending updated state of fan %u to HomeKit (0x%02x)", (unsigned) fan, (unsigned) dirty);
+    }
 
-    /* Update the oscillation state */
-    memset(&new_val, 0, sizeof(new_val));
-    new_val.b = g_Fan_state.oscillate;
-    hap_char_update_val(oscillate_char, &new_val);
+    for (int i = 0; i < NUM_FAN_CHAR; i++)
+    {
+        if ((dirty & fan_char_descs[i].dirty) && (!derived_only || NUM_EVENT_ID == fan_char_descs[i].id))
+        {
+            num_updates++;
+            if (hap_char_has_subscribers(fan_chars[fan][i]))
+            {
+                num_notifications++;
+                HomeKit_char_value((HomeKit_fan_char_t) i, &g_Fan_state[fan], &new_val);
+                hap_char_update_val(fan_chars[fan][i], &new_val);
+            }
+        }
+    }
+}
 
-    /* Update the speed state, using 25 multiplier as we only have 4 speeds */
-    memset(&new_val, 0, sizeof(new_val));
-    new_val.f = 25.0f * g_Fan_state.speed;
-    hap_char_update_val(speed_char, &new_val);
+/**
+ * @brief   Get the running counts of characteristic updates.
+ * @details Counted by HomeKit_update_char(), so only written by the event
+ *          handler task. Updates are every characteristic due to change,
+ *          notifications the ones that had a controller subscribed.
+ * @param   updates       [out] Characteristic updates since boot
+ * @param   notifications [out] Updates handed to the HAP core to notify
+ */
+void HomeKit_get_update_counts(uint32_t *updates, uint32_t *notifications)
+{
+    *updates       = num_updates;
+    *notifications = num_notifications;
+}
+
+/**
+ * @brief   Event argument for a written On/Swing Mode value.
+ * @param   val [in] Value written by HomeKit
+ * @return  The boolean state
+ */
+static uint32_t HomeKit_arg_bool(const hap_val_t *val)
+{
+    return (uint32_t) val->b;
+}
+
+/**
+ * @brief   Exact speed for a written Rotation Speed value.
+ * @details The HAP layer snaps written values to the speed steps, or to whole
+ *          percents with phase control, so this only has to round.
+ * @param   val [in] Value written by HomeKit, in percent
+ * @return  The speed, in whole percents
+ */
+static uint8_t HomeKit_speed_pct(const hap_val_t *val)
+{
+    if (val->f <= 0.0f)
+    {
+        return 0;
+    }
+    if (val->f >= 100.0f)
+    {
+        return 100;
+    }
+    return (uint8_t) (val->f + 0.5f);
+}
+
+/**
+ * @brief   Event argument for a written Rotation Speed value.
+ * @param   val [in] Value written by HomeKit, in percent
+ * @return  The fan speed the percentage falls into
+ */
+static uint32_t HomeKit_arg_speed(const hap_val_t *val)
+{
+    /* Bin the speed for easier processing later */
+    return (uint32_t) Speed_from_pct(HomeKit_speed_pct(val));
+}
+
+/**
+ * @brief   Event argument for a written Set Duration value.
+ * @param   val [in] Value written by HomeKit, in seconds
+ * @return  The shortest timer setting of the fan that is at least as long
+ */
+static uint32_t HomeKit_arg_timer(const hap_val_t *val)
+{
+    uint32_t timer = (uint32_t) TIMER_OFF;
+
+    /* Round up to the next timer setting the fan has */
+    while (timer < TIMER_8H && Sleep_timer_duration_s(timer) < val->u)
+    {
+        timer++;
+    }
+
+    return timer;
+}
+
+#if defined(CONFIG_FAN_AUTO) || defined(CONFIG_FAN_HAP_FAN_V2)
+/**
+ * @brief   Event argument for a written Active/Target Fan State value.
+ * @param   val [in] Value written by HomeKit, 0 or 1
+ * @return  Whether the value is set (active, auto)
+ */
+static uint32_t HomeKit_arg_flag(const hap_val_t *val)
+{
+    return (uint32_t) (0 != val->u);
+}
+#endif
+
+#ifdef CONFIG_FAN_HAP_FAN_V2
+/**
+ * @brief   Current Fan State for a fan state.
+ * @details A fan that is off while in auto mode is idle, waiting for the
+ *          temperature to call for it.
+ * @param   state [in] Fan state
+ * @return  HOMEKIT_FAN_STATE_* value
+ */
+static uint8_t HomeKit_current_fan_state(const Fan_state_t *state)
+{
+    if (state->on)
+    {
+        return HOMEKIT_FAN_STATE_BLOWING;
+    }
+
+    return (state->auto_mode) ? HOMEKIT_FAN_STATE_IDLE : HOMEKIT_FAN_STATE_INACTIVE;
+}
+#endif /* CONFIG_FAN_HAP_FAN_V2 */
+
+/**
+ * @brief   Serve a read from HomeKit.
+ * @details Runs in the HTTP server task, so the values come from one snapshot
+ *          of the fan state, consistent across every characteristic read.
+ *          The values are stored with hap_char_update_val(), where the HAP
+ *          library picks them up for the response. The Name is left as is.
+ * @param   read_data [in] Characteristics being read
+ * @param   count     Number of characteristics in read_data
+ * @param   serv_priv [in] Private data for the service, the fan index
+ * @param   read_priv [in] Can be used with hap_is_req_admin() (UNUSED)
+ * @retval  HAP_SUCCESS Always, every characteristic can be read
+ */
+static int HomeKit_read_callback(hap_read_data_t read_data[], int count, void *serv_priv, void *read_priv)
+{
+    uint8_t     fan = (uint8_t) (uintptr_t) serv_priv;
+    Fan_state_t state;
+    hap_val_t   val;
+
+    UNUSED_PARAM(read_priv);
+
+    Fan_state_snapshot(fan, &state);
+
+    for (int i = 0; i < count; i++)
+    {
+        HomeKit_fan_char_t handle = HomeKit_char_handle(fan, read_data[i].hc);
+
+        if (NUM_FAN_CHAR != handle)
+        {
+            HomeKit_char_value(handle, &state, &val);
+            hap_char_update_val(read_data[i].hc, &val);
+        }
+        *(read_data[i].status) = HAP_STATUS_SUCCESS;
+    }
+
+    return HAP_SUCCESS;
 }
 
 /**
@@ -76,105 +430,248 @@ void HomeKit_update_char(void)
  *          will be triggered with the affected characteristics. From there, it
  *          is this function's job to decipher the updates and enqueue the
  *          appropriate event for the event handler to act upon.
+ *
+ *          Characteristics are told apart by their handles rather than by
+ *          comparing type UUID strings, since we created each of them.
  * @param   write_data [in] Buffer with updated characteristics
  * @param   count      Number of characteristics in buffer
- * @param   serv_priv  [in] Private data for the service (UNUSED)
+ * @param   serv_priv  [in] Private data for the service, the fan index
  * @param   write_priv [in] Can be used with hap_is_req_admin() (UNUSED)
  * @retval  HAP_SUCCESS Callback was successful
  * @retval  HAP_FAIL    An error occurred while handling a characteristic
  */
 static int HomeKit_write_callback(hap_write_data_t write_data[], int count, void *serv_priv, void *write_priv)
 {
-    UNUSED_PARAM(serv_priv);
+    uint8_t fan = (uint8_t) (uintptr_t) serv_priv;
+
     UNUSED_PARAM(write_priv);
+    HAP_TRACE_BEGIN(HAP_TRACE_APP_WRITE, count);
+
+    /* Keep the radio awake for the rest of the burst */
+    Power_hap_write();
 
     for (int i = 0; i < count; i++)
     {
-        Fan_event_t       event = {.source = SOURCE_HOMEKIT};
+        Fan_event_t       event = {.source = SOURCE_HOMEKIT, .fan = fan, .timestamp_us = esp_timer_get_time()};
         hap_write_data_t *write = &write_data[i];
 
-        /* Identify what command was sent by HomeKit */
-        if (0 == strcmp(HAP_CHAR_UUID_ON, hap_char_get_type_uuid(write->hc)))
-        {
-            /* Power state command */
-            event.id = ID_POWER;
-            event.arg = (uint32_t) write->val.b;
+        /* Identify what command was sent by HomeKit, we hold every handle */
+        HomeKit_fan_char_t handle = HomeKit_char_handle(fan, write->hc);
 
-        }
-        else if (0 == strcmp(HAP_CHAR_UUID_SWING_MODE, hap_char_get_type_uuid(write->hc)))
+        if (NUM_FAN_CHAR == handle || NULL == fan_char_descs[handle].to_arg)
         {
-            /* Oscillation mode command */
-            event.id = ID_OSCILLATE;
-            event.arg = (uint32_t) write->val.b;
+            /* Unknown or read-only HAP characteristic passed in */
+            *(write->status) = HAP_STATUS_RES_ABSENT;
+            HAP_TRACE_END(HAP_TRACE_APP_WRITE, count);
+            return HAP_FAIL;
         }
-        else if (0 == strcmp(HAP_CHAR_UUID_ROTATION_SPEED, hap_char_get_type_uuid(write->hc)))
-        {
-            int integer_speed = (int) write->val.f;
-
-            /* Fan speed command */
-            event.id = ID_SPEED;
 
-            /* Bin the speed for easier processing later */
-            if (0 == integer_speed)
-            {
-                event.arg = (uint32_t) SPEED_OFF;
-            }
-            else if (integer_speed <= 25)
-            {
-                event.arg = (uint32_t) SPEED_1;
-            }
-            else if (integer_speed <= 50)
-            {
-                event.arg = (uint32_t) SPEED_2;
-            }
-            else if (integer_speed <= 75)
-            {
-                event.arg = (uint32_t) SPEED_3;
-            }
-            else
-            {
-                event.arg = (uint32_t) SPEED_4;
-            }
-        }
-        else
+        event.id = fan_char_descs[handle].id;
+        event.arg = fan_char_descs[handle].to_arg(&write->val);
+        if (FAN_CHAR_SPEED == handle)
         {
-            /* Unknown HAP characteristic passed in */
-            *(write->status) = HAP_STATUS_RES_ABSENT;
-            return HAP_FAIL;
+            event.pct = HomeKit_speed_pct(&write->val);
         }
 
+        /* Dragging the speed slider lands many writes in the same speed. The
+         * stored value may be stale without subscribers, so check the state */
+        Fan_state_t state;
+        Fan_state_snapshot(fan, &state);
+        bool same_speed = (FAN_CHAR_SPEED == handle) && (event.arg == (uint32_t) state.speed) &&
+                          (event.pct == state.speed_pct);
+
         /* Update the value in the HAP internals */
         hap_char_update_val(write->hc, &(write->val));
         *(write->status) = HAP_STATUS_SUCCESS;
 
-        /* Send the event to the main queue, wait 10 ticks if necessary */
-        (void) xQueueSend(g_Fan_event_queue, &event, (TickType_t) 10);
+        if (same_speed)
+        {
+            continue;
+        }
+
+        /* Send the event to the main queue */
+        if (!Event_queue_send(&event))
+        {
+            ESP_LOGW(TAG, "Event queue full, dropping event");
+        }
     }
 
+    HAP_TRACE_END(HAP_TRACE_APP_WRITE, count);
     return HAP_SUCCESS;
 }
 
 /**
  * @brief   Mandatory identify routine for the accessory.
- * @details In a real accessory, something like LED blink should be implemented 
- *          got visual identification. Currently just prints a message.
+ * @details Blinks the builtin LED. The blink runs in hardware, so this returns
+ *          straight away rather than holding up the HomeKit thread.
  * @param   ha [in] Accessory handle
  */
 static int HomeKit_identify(hap_acc_t *ha)
 {
     ESP_LOGI(TAG, "Accessory identified");
+    Led_identify();
     return HAP_SUCCESS;
 }
 
 /**
- * @brief   Initializer for the HomeKit component.
- * @details Handles the setup of the HomeKit Accessory Protocol (HAP) core
- *          library. Includes setting up the accessory and the services/
- *          characteristics associated with it.
- * @note    If interrupts fire while the Wi-Fi task is starting up at the end,
- *          a crash is possible.
+ * @brief   Create the Fan service of a fan and add it to an accessory.
+ * @param   accessory [in] Accessory to add the service to
+ * @param   fan       Fan the service controls
+ * @param   name      [in] User visible name of the service
  */
-void HomeKit_init(void)
+static void HomeKit_add_fan_service(hap_acc_t *accessory, uint8_t fan, const char *name)
+{
+    const Fan_state_t *state = &g_Fan_state[fan];
+    hap_char_t       **chars = fan_chars[fan];
+
+    /* Create the Fan Service. Include the "name" since this is a user visible service  */
+    hap_serv_t *service = hap_serv_create(HOMEKIT_FAN_SERV_UUID);
+
+    /* Create the characteristics of our fan service, starting from the restored state */
+#define HOMEKIT_CHAR_CREATE(handle, create, member, value, dirty, id, to_arg) chars[handle] = create(value);
+    HOMEKIT_FAN_CHARS(HOMEKIT_CHAR_CREATE)
+#undef HOMEKIT_CHAR_CREATE
+
+    /* Set Duration tops out at an hour by default, allow up to the 8 hour timer */
+    hap_char_int_set_constraints(chars[FAN_CHAR_TIMER], 0, (int) Sleep_timer_duration_s(TIMER_8H), 1);
+
+#ifdef CONFIG_FAN_PHASE_CONTROL
+    /* Phase control runs the motor at any speed */
+    hap_char_float_set_constraints(chars[FAN_CHAR_SPEED], 0.0f, 100.0f, 1.0f);
+#else
+    /* Only offer the speeds the fan has, snapping anything in between */
+    hap_char_float_set_constraints(chars[FAN_CHAR_SPEED], 0.0f, 100.0f, HOMEKIT_SPEED_STEP);
+    hap_char_float_set_quantization(chars[FAN_CHAR_SPEED], HOMEKIT_SPEED_HYSTERESIS);
+#endif
+
+    /**
+     * Build out the service. Give information on what the device supports and
+     * the name for the service.
+     *
+     * Our device supports variable speed as well as swing modes, plus a sleep
+     * timer through the Set Duration characteristic, and optionally an auto
+     * mode through Target Fan State.
+     */
+    hap_serv_add_char(service, hap_char_name_create((char *) name));
+    for (int i = 0; i < NUM_FAN_CHAR; i++)
+    {
+        hap_serv_add_char(service, chars[i]);
+    }
+
+    /* Set the read and write callbacks for the service, which need to know the fan */
+    hap_serv_set_priv(service, (void *) (uintptr_t) fan);
+    hap_serv_set_write_cb(service, HomeKit_write_callback);
+    hap_serv_set_bulk_read_cb(service, HomeKit_read_callback);
+
+    /* Add the Fan Service to the Accessory Object */
+    hap_acc_add_serv(accessory, service);
+
+    /* The temperature sensor is on the board of the first fan */
+    if (0 == fan)
+    {
+        Auto_speed_add_service(accessory);
+    }
+}
+
+#if FAN_NUM_FANS > 1
+/**
+ * @brief   Add a bridged accessory for each fan.
+ * @details The serial numbers are stable, so the accessory IDs handed out by
+ *          hap_get_unique_aid() stay the same across reboots and controllers
+ *          keep their room and scene assignments.
+ */
+static void HomeKit_add_bridged_fans(void)
+{
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        char name[HOMEKIT_FAN_NAME_SIZE];
+        char serial[HOMEKIT_FAN_NAME_SIZE];
+
+        snprintf(name, sizeof(name), "Lasko %u", (unsigned) fan + 1);
+        snprintf(serial, sizeof(serial), "1-%u", (unsigned) fan + 1);
+
+        hap_acc_cfg_t cfg = {
+            .name = name,
+            .manufacturer = "Ryan_Banks",
+            .model = "Lasko_18in_Fan",
+            .serial_num = serial,
+            .fw_rev = "0.0.0",
+            .hw_rev = "0.0.0",
+            .pv = "0.0.0",
+            .identify_routine = HomeKit_identify,
+            .cid = HAP_CID_FAN,
+        };
+        hap_acc_t *accessory = hap_acc_create(&cfg);
+
+        HomeKit_add_fan_service(accessory, fan, name);
+
+        hap_add_bridged_accessory(accessory, hap_get_unique_aid(serial));
+    }
+}
+#endif /* FAN_NUM_FANS > 1 */
+
+/**
+ * @brief   Mark the first controller connection in the boot-phase timeline.
+ * @details That's when the fan becomes controllable from the Apple Home app.
+ *          Called inline, so the timestamp is taken as the session comes up.
+ * @param   event     HomeKit event ID
+ * @param   data      [in] Data associated with the event (UNUSED)
+ * @param   data_size Size of the data (UNUSED)
+ * @param   priv      [in] Unused
+ */
+static void HomeKit_boot_event_handler(hap_event_t event, const void *data, size_t data_size, void *priv)
+{
+    static bool controller_seen = false;
+
+    UNUSED_PARAM(event);
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(data_size);
+    UNUSED_PARAM(priv);
+
+    if (!controller_seen)
+    {
+        controller_seen = true;
+        Boot_log_phase("first controller connected");
+    }
+}
+
+/**
+ * @brief   Handle HomeKit controller and pairing events.
+ * @details Tells the Power component about controller sessions, and the
+ *          UdpControl component about pairing changes. Both can take a while
+ *          (switching the Wi-Fi power save mode, deriving keys), so this is a
+ *          deferred subscriber and stays off the HAP request path.
+ * @param   event     HomeKit event ID
+ * @param   data      [in] Data associated with the event (UNUSED)
+ * @param   data_size Size of the data (UNUSED)
+ * @param   priv      [in] Unused
+ */
+static void HomeKit_event_handler(hap_event_t event, const void *data, size_t data_size, void *priv)
+{
+    UNUSED_PARAM(data);
+    UNUSED_PARAM(data_size);
+    UNUSED_PARAM(priv);
+
+    /* Keys derived for local UDP control follow the pairings */
+    if (HAP_EVENT_CTRL_PAIRED == event || HAP_EVENT_CTRL_UNPAIRED == event)
+    {
+        Udp_control_pairings_changed();
+    }
+
+    /* The Wi-Fi power save profile depends on whether controllers are around */
+    if (HAP_EVENT_CTRL_CONNECTED == event || HAP_EVENT_CTRL_DISCONNECTED == event)
+    {
+        Power_hap_session(HAP_EVENT_CTRL_CONNECTED == event);
+    }
+}
+
+/**
+ * @brief   Build the HomeKit accessory database.
+ * @details Initializes the HAP core, which loads the keystore and pairings
+ *          from NVS, then creates the accessory along with its services/
+ *          characteristics. Leaves the HAP core ready for hap_start().
+ */
+static void HomeKit_build_database(void)
 {
     /**
      * Configure HomeKit core to make the Accessory name (and thus the WAC SSID)
@@ -184,14 +681,36 @@ void HomeKit_init(void)
     hap_cfg_t hap_cfg;
     hap_get_config(&hap_cfg);
     hap_cfg.unique_param = UNIQUE_NAME;
+    hap_cfg.notif_coalesce_ms = HOMEKIT_NOTIF_COALESCE_MS;
+    hap_cfg.write_merge_ms = HOMEKIT_WRITE_MERGE_MS;
     hap_set_config(&hap_cfg);
 
     /* Initialize the HAP core */
+#if defined(CONFIG_FAN_HAP_BLE)
+    hap_init(HAP_TRANSPORT_BLE);
+#elif defined(CONFIG_FAN_HAP_THREAD)
+    hap_init(HAP_TRANSPORT_THREAD);
+#else
     hap_init(HAP_TRANSPORT_WIFI);
+#endif
 
-    /* Create accessory object */
+    /* Listen for HomeKit core events */
+    (void) hap_event_subscribe(HAP_EVENT_MASK(HAP_EVENT_CTRL_CONNECTED), HAP_EVENT_DISPATCH_INLINE,
+                               HomeKit_boot_event_handler, NULL);
+    if (HAP_FAIL == hap_event_subscribe(HAP_EVENT_MASK(HAP_EVENT_CTRL_PAIRED) | HAP_EVENT_MASK(HAP_EVENT_CTRL_UNPAIRED) |
+                                        HAP_EVENT_MASK(HAP_EVENT_CTRL_CONNECTED) | HAP_EVENT_MASK(HAP_EVENT_CTRL_DISCONNECTED),
+                                        HAP_EVENT_DISPATCH_DEFERRED, HomeKit_event_handler, NULL))
+    {
+        ESP_LOGE(TAG, "Failed to subscribe to HomeKit events");
+    }
+
+    /* Create accessory object, the bridge itself when serving several fans */
     hap_acc_cfg_t cfg = {
+#if FAN_NUM_FANS > 1
+        .name = "HomeKit_Fan_Bridge",
+#else
         .name = "HomeKit_Fan",
+#endif
         .manufacturer = "Ryan_Banks",
         .model = "Lasko_18in_Fan",
         .serial_num = "1",
@@ -199,7 +718,11 @@ void HomeKit_init(void)
         .hw_rev = "0.0.0",
         .pv = "0.0.0",
         .identify_routine = HomeKit_identify,
+#if FAN_NUM_FANS > 1
+        .cid = HAP_CID_BRIDGE,
+#else
         .cid = HAP_CID_FAN,
+#endif
     };
     hap_acc_t *accessory = hap_acc_create(&cfg);
 
@@ -207,42 +730,35 @@ void HomeKit_init(void)
     uint8_t product_data[] = {'E','S','P','3','2','H','A','P'};
     hap_acc_add_product_data(accessory, product_data, sizeof(product_data));
 
+#if defined(CONFIG_FAN_HAP_BLE)
+    /* Add the Protocol Information service required for HAP over BLE */
+    hap_acc_add_serv(accessory, hap_serv_protocol_information_create("2.2.0"));
+#elif !defined(CONFIG_FAN_HAP_THREAD)
     /* Add Wi-Fi Transport service required for HAP Spec R16 */
     hap_acc_add_wifi_transport_service(accessory, 0);
+#endif
 
-    /* Create the Fan Service. Include the "name" since this is a user visible service  */
-    hap_serv_t *service = hap_serv_create(HAP_SERV_UUID_FAN);
-
-    /* Create the characteristics of our fan service */
-    on_char = hap_char_on_create(false);
-    oscillate_char = hap_char_swing_mode_create(0);
-    speed_char = hap_char_rotation_speed_create(0);
-
-    /**
-     * Build out the service. Give information on what the device supports and
-     * the name for the service.
-     *
-     * Our device supports variable speed as well as swing modes.
-     */
-    hap_serv_add_char(service, hap_char_name_create("Lasko"));
-    hap_serv_add_char(service, on_char);
-    hap_serv_add_char(service, oscillate_char);
-    hap_serv_add_char(service, speed_char);
-
-    /* Set the write callback for the service */
-    hap_serv_set_write_cb(service, HomeKit_write_callback);
+#if FAN_NUM_FANS == 1
+    /* A single fan is the accessory itself */
+    HomeKit_add_fan_service(accessory, 0, "Lasko");
+#endif
 
-    /* Add the Fan Service to the Accessory Object */
-    hap_acc_add_serv(accessory, service);
+    /* Optionally expose heap and stack headroom as a custom service */
+    Telemetry_add_service(accessory);
 
     /* Add the Accessory to the HomeKit Database */
     hap_add_accessory(accessory);
 
+#if FAN_NUM_FANS > 1
+    /* Then each fan as a bridged accessory */
+    HomeKit_add_bridged_fans();
+#endif
+
     /**
      * For production accessories, the setup code shouldn't be programmed on to
      * the device. Instead, the setup info, derived from the setup code must
-     * be used. Use the factory_nvs_gen utility to generate this data and then
-     * flash it into the factory NVS partition.
+     * be used. Use tools/factory_provision.py to generate this data, with a
+     * unique setup code per unit, and then flash it into the factory NVS partition.
      *
      * By default, the setup ID and setup info will be read from the factory_nvs
      * Flash partition and so, is not required to set here explicitly.
@@ -260,19 +776,107 @@ void HomeKit_init(void)
 #else
     app_hap_setup_payload(CONFIG_EXAMPLE_SETUP_CODE, CONFIG_EXAMPLE_SETUP_ID, false, cfg.cid);
 #endif
+#else
+    /* The payload on the unit's label was provisioned along with the setup info */
+    app_hap_setup_payload_provisioned();
 #endif
 
     /* Enable Hardware MFi authentication (applicable only for MFi variant of SDK) */
     hap_enable_mfi_auth(HAP_MFI_AUTH_HW);
+}
+
+#if HOMEKIT_PARALLEL_BOOT
+/**
+ * @brief Builds the accessory database while the caller brings up Wi-Fi.
+ *        Notifies the caller when done.
+ * @param p [in] Handle of the task to notify
+ */
+static void HomeKit_build_task(void *p)
+{
+    HomeKit_build_database();
+
+    (void) xTaskNotifyGive((TaskHandle_t) p);
+    vTaskDelete(NULL);
+}
+#endif
+
+/**
+ * @brief   Initializer for the HomeKit component.
+ * @details Handles the setup of the HomeKit Accessory Protocol (HAP) core
+ *          library. Includes setting up the accessory and the services/
+ *          characteristics associated with it.
+ *
+ *          Over Wi-Fi, association is started first and the database is built
+ *          on a separate task meanwhile, as both spend most of their time
+ *          waiting on the radio and on flash. The two are joined before
+ *          hap_start(), since the HAP core only needs an IP address once it
+ *          is running. SoftAP and WAC provisioning keep the old order.
+ * @note    Does not wait for Wi-Fi to connect, use app_wifi_wait_connected()
+ *          (or Thread_net_wait_attached() over Thread) if that's needed.
+ */
+void HomeKit_init(void)
+{
+#ifdef CONFIG_FAN_HAP_BLE
+    HomeKit_build_database();
+
+    /* Start the HAP core task, which starts advertising over BLE */
+    hap_start();
+#elif defined(CONFIG_FAN_HAP_THREAD)
+    /* Start OpenThread first, the SRP client needs it once the HAP core starts */
+    Thread_net_init();
+
+    HomeKit_build_database();
+
+    /* Start the HAP core task, which registers with the Border Router once attached */
+    hap_start();
+#elif HOMEKIT_PARALLEL_BOOT
+    /* Initialize Wi-Fi first, the accessory name is made unique from its MAC */
+    app_wifi_init();
+
+    /* Build the database on another task while Wi-Fi associates */
+    TaskHandle_t build_task = NULL;
+    if (pdPASS != xTaskCreate(HomeKit_build_task, HOMEKIT_BUILD_NAME, HOMEKIT_BUILD_STACKSIZE,
+                              xTaskGetCurrentTaskHandle(), uxTaskPriorityGet(NULL), &build_task))
+    {
+        ESP_LOGW(TAG, "Failed to create the build task, building in line");
+        HomeKit_build_database();
+    }
+
+    /* Start Wi-Fi task, don't block on the connection */
+    app_wifi_start(0);
+
+    /* Join the build, then start the HAP core task */
+    if (NULL != build_task)
+    {
+        (void) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    hap_start();
+#else
+    HomeKit_build_database();
 
     /* Initialize Wi-Fi before startup */
     app_wifi_init();
 
     /* After all the initialization is done, start the HAP core task */
     hap_start();
-
-    /* Start Wi-Fi task */
-    app_wifi_start(portMAX_DELAY);
+#endif /* CONFIG_FAN_HAP_BLE */
+
+#ifndef CONFIG_FAN_HAP_BLE
+
+    /* The HTTP server is up now, add our debug endpoints */
+    Latency_register_http_handler();
+    Telemetry_register_http_handler();
+    Benchmark_register_http_handler();
+    Event_bench_register_http_handler();
+    Watchdog_register_http_handler();
+    Journal_register_http_handler();
+    hap_platform_trace_register_http_handler();
+
+#if !HOMEKIT_PARALLEL_BOOT && !defined(CONFIG_FAN_HAP_THREAD)
+    /* Start Wi-Fi task, don't block on the connection */
+    app_wifi_start(0);
+#endif
+#endif /* CONFIG_FAN_HAP_BLE */
 
     ESP_LOGI(TAG, "HomeKit component init!");
 }
@@ -11,7 +11,11 @@
 #ifndef HOMEKIT_H
 #define HOMEKIT_H
 
-void HomeKit_update_char(void);
+#include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
+
+void HomeKit_update_char(uint8_t fan, uint8_t dirty, bool derived_only);
+void HomeKit_get_update_counts(uint32_t *updates, uint32_t *notifications);
 void HomeKit_init(void);
 
 #endif /* HOMEKIT_H */
@@ -0,0 +1,291 @@
+/**
+ * @file host_backend.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Stand-in hardware backends for the linux target.
+ *
+ * On the linux target there are no relays, LEDs, buttons or IR receiver, so
+ * this file takes the place of relay.c, led.c, button.c and remote.c. The
+ * outputs only log what they would have driven, and keep the same state the
+ * real components do (the last switch time for the latency histograms, for
+ * example).
+ *
+ * Inputs come from stdin, one command per line, which are sent to the event
+ * queue as if they came from the IR remote:
+ *
+ * power, oscillate, speed, time, temperature
+ *
+ * which lets the event handler, sleep timer, storage and HomeKit paths run
+ * under a host profiler without flashing a board.
+ *
+ * @addtogroup HostBackend
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <stdio.h>             /* Reading commands from stdin */
+#include <string.h>            /* For memory/string-related functions */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Definitions for creating tasks */
+
+#include "main.h"
+#include "relay.h"
+#include "led.h"
+#include "button.h"
+#include "remote.h"
+#include "event_queue.h"
+
+#define HOST_INPUT_NAME       "host_input"
+#define HOST_INPUT_STACKSIZE  4 * 1024
+#define HOST_INPUT_PRIORITY   1
+
+/** Longest command line read from stdin */
+#define HOST_INPUT_LINE_SIZE  32
+
+/** Struct mapping a stdin command to the event it sends */
+typedef struct Host_command_t
+{
+    const char    *name; /** Command typed on stdin */
+    enum Event_id  id;   /** Event sent for it */
+} Host_command_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Host";
+
+/** Commands understood on stdin */
+static const Host_command_t commands[] = {
+    { "power",       ID_POWER       },
+    { "oscillate",   ID_OSCILLATE   },
+    { "speed",       ID_SPEED       },
+    { "time",        ID_TIME        },
+    { "temperature", ID_TEMPERATURE },
+};
+
+/** Global LED enable, as in led.c */
+bool g_Led_enable;
+
+/** Time (in uSec) of the last relay switch of each fan, 0 if never */
+static int64_t last_switch_us[FAN_NUM_FANS];
+
+/**
+ * @brief Pretend to switch the speed relays.
+ * @param fan   Fan to switch
+ * @param speed Speed to switch to
+ */
+void Relay_write_speed(uint8_t fan, enum State_speed speed)
+{
+    last_switch_us[fan] = esp_timer_get_time();
+    ESP_LOGI(TAG, "Relays: fan %u speed %d", (unsigned) fan, (int) speed);
+}
+
+/**
+ * @brief Pretend to switch the oscillation relay.
+ * @param fan       Fan to switch
+ * @param oscillate Whether to oscillate
+ */
+void Relay_write_oscillate(uint8_t fan, bool oscillate)
+{
+    last_switch_us[fan] = esp_timer_get_time();
+    ESP_LOGI(TAG, "Relays: fan %u oscillate %d", (unsigned) fan, (int) oscillate);
+}
+
+/**
+ * @brief Nothing to wait for, there are no contacts to settle.
+ */
+void Relay_wait_settled(void)
+{
+}
+
+/**
+ * @brief Nothing to stop writing, the relays are only logged.
+ * @param enable Whether to start a dry run
+ */
+void Relay_set_dry_run(bool enable)
+{
+    UNUSED_PARAM(enable);
+}
+
+/**
+ * @brief  Get the time of the most recent relay switch of a fan.
+ * @param  fan Fan to check
+ * @return Time (in uSec, esp_timer base) a relay last switched, 0 if never.
+ */
+int64_t Relay_get_last_switch_us(uint8_t fan)
+{
+    return last_switch_us[fan];
+}
+
+/**
+ * @brief  No relays to count, every statistic reads zero.
+ * @param  fan   Fan the relay belongs to
+ * @param  relay Relay to get
+ * @param  stats [out] Statistics of the relay
+ * @return False, no relay is wired.
+ */
+bool Relay_get_stats(uint8_t fan, enum Relay_index relay, Relay_stats_t *stats)
+{
+    UNUSED_PARAM(fan);
+    UNUSED_PARAM(relay);
+    memset(stats, 0, sizeof(*stats));
+    return false;
+}
+
+/**
+ * @brief Nothing to load, the relays aren't counted.
+ */
+void Relay_load_cycles(void)
+{
+}
+
+/**
+ * @brief Nothing to initialize for the relays.
+ */
+void Relay_init(void)
+{
+}
+
+/**
+ * @brief Pretend to enable or disable the fascia LEDs.
+ * @param enable Whether the LEDs are enabled
+ */
+void Led_write_enable(bool enable)
+{
+    g_Led_enable = enable;
+    ESP_LOGI(TAG, "LEDs: enable %d", (int) enable);
+}
+
+/**
+ * @brief Pretend to show a speed on the fascia LEDs.
+ * @param fan   Fan to show it for
+ * @param speed Speed to show
+ */
+void Led_write_speed(uint8_t fan, enum State_speed speed)
+{
+    ESP_LOGI(TAG, "LEDs: fan %u speed %d", (unsigned) fan, (int) speed);
+}
+
+/**
+ * @brief Pretend to drive the builtin LED.
+ * @param state Whether the LED is on
+ */
+void Led_write_builtin(bool state)
+{
+    ESP_LOGD(TAG, "LEDs: builtin %d", (int) state);
+}
+
+/**
+ * @brief Pretend to blink the builtin LED for identify.
+ */
+void Led_identify(void)
+{
+    ESP_LOGI(TAG, "LEDs: identify");
+}
+
+/**
+ * @brief Nothing to initialize for the LEDs.
+ */
+void Led_init(void)
+{
+    /* Start with LEDs enabled */
+    g_Led_enable = true;
+}
+
+/**
+ * @brief  Press a button from software, sent straight through as an event.
+ * @param  id Event ID the press maps to
+ * @return Whether the press was taken, false if the queue was full.
+ */
+bool Button_press(enum Event_id id)
+{
+    Fan_event_t event = {
+        .source       = SOURCE_BUTTON,
+        .id           = id,
+        .timestamp_us = esp_timer_get_time()
+    };
+
+    return Event_queue_send(&event);
+}
+
+/**
+ * @brief  Release the admission latch for a button event.
+ * @param  id Event ID associated with the button.
+ * @return Always 1, host commands are never coalesced.
+ */
+uint32_t Button_release(enum Event_id id)
+{
+    UNUSED_PARAM(id);
+    return 1;
+}
+
+/**
+ * @brief Nothing to initialize for the buttons, stdin stands in for them.
+ */
+void Button_init(void)
+{
+}
+
+/**
+ * @brief Read commands from stdin and send them as remote events.
+ * @param args Unused
+ */
+static void host_input_task(void *args)
+{
+    char line[HOST_INPUT_LINE_SIZE];
+
+    UNUSED_PARAM(args);
+    while (NULL != fgets(line, sizeof(line), stdin))
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        size_t i;
+        for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+        {
+            if (0 == strcmp(line, commands[i].name))
+            {
+                break;
+            }
+        }
+
+        if (i == sizeof(commands) / sizeof(commands[0]))
+        {
+            ESP_LOGW(TAG, "Unknown command '%s'", line);
+            continue;
+        }
+
+        Fan_event_t event = {
+            .source       = SOURCE_REMOTE,
+            .id           = commands[i].id,
+            .arg          = REMOTE_PRESS,
+            .timestamp_us = esp_timer_get_time()
+        };
+
+        if (!Event_queue_send(&event))
+        {
+            ESP_LOGW(TAG, "Event queue full, dropping event");
+        }
+    }
+
+    /* End of input, nothing more will come */
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Start reading commands from stdin in place of the IR receiver.
+ */
+void Remote_init(void)
+{
+    (void) xTaskCreate(
+        host_input_task,
+        HOST_INPUT_NAME,
+        HOST_INPUT_STACKSIZE,
+        NULL,
+        HOST_INPUT_PRIORITY,
+        NULL);
+}
+
+/** @} end HostBackend */
@@ -0,0 +1,638 @@
+/**
+ * @file ir_decoder.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to decode IR remote frames from RMT symbols.
+ *
+ * The RMT peripheral hands us IR captures as an array of symbols, where each
+ * symbol holds a mark (carrier on) duration followed by a space (carrier off)
+ * duration. Different remotes encode bits into these in different ways, so
+ * rather than hard-coding one pattern, each protocol is described by a small
+ * descriptor of pulse widths and bit counts.
+ *
+ * Two encodings are supported:
+ *
+ * Pulse encodings use one symbol per bit, telling a 0 from a 1 by the mark
+ * and/or space length. The original Lasko remote works like this, with no
+ * header and 11 bits:
+ *
+ * logic 0: (long , short)
+ * logic 1: (short, long )
+ *
+ * NEC is similar, but with a header, equal marks, a stop bit, and a special
+ * short frame sent while a button is held.
+ *
+ * Manchester encodings (RC5) put a transition in the middle of every bit, so
+ * the symbols are expanded into half-bit levels first and then paired up.
+ *
+ * The decoder scans a capture of any length and pulls out every frame it can
+ * find, so truncated or noisy captures still yield whatever valid frames they
+ * contain.
+ *
+ * Worn remotes and flat batteries stretch or shrink every pulse by about the
+ * same factor, so each protocol's timings are scaled before matching. With
+ * CONFIG_FAN_REMOTE_CALIBRATION, every full frame decoded adds its measured
+ * over nominal duration to a histogram, and every IR_CAL_WINDOW frames the
+ * scale moves to the median, within IR_SCALE_MIN and IR_SCALE_MAX. Older
+ * frames are halved each time, so the scale keeps following the remote.
+ * 
+ * @addtogroup IrDecoder
+ * @{
+ */
+
+#include <stdbool.h>       /* Boolean type */
+#include <stddef.h>        /* Size type */
+#include <stdint.h>        /* Extended integer types */
+
+#include "ir_decoder.h"
+
+/** Minimum margin of error (in uSec) for identifying durations */
+#define IR_TOLERANCE_MIN_US 100
+
+/** Largest number of half-bits a Manchester frame can have */
+#define IR_MAX_HALF_BITS 64
+
+/** Fewest symbols of any frame, shorter captures are noise */
+#define IR_MIN_FRAME_SYMBOLS 2
+
+#ifdef CONFIG_FAN_REMOTE_CALIBRATION
+/** Width of a calibration histogram bin, in 1/256ths of the nominal timings */
+#define IR_CAL_BIN_WIDTH 8
+
+/** Number of histogram bins, one centered on every step from min to max */
+#define IR_CAL_NUM_BINS  ((IR_SCALE_MAX - IR_SCALE_MIN) / IR_CAL_BIN_WIDTH + 1)
+
+/** Number of frames between updates of the scale */
+#define IR_CAL_WINDOW    16
+#endif
+
+/** Enum for the ways bits are encoded into symbols */
+enum Ir_encoding
+{
+    IR_ENCODING_PULSE = 0, /** One symbol per bit, mark/space lengths vary */
+    IR_ENCODING_MANCHESTER /** Fixed bit time, transition mid-bit */
+};
+
+/** Struct for the measured and nominal length of a frame */
+typedef struct Ir_timing_t
+{
+    uint32_t measured_us; /** Sum of the durations received */
+    uint32_t nominal_us;  /** Sum of the durations expected at nominal timings */
+} Ir_timing_t;
+
+/** Struct describing a single IR protocol */
+typedef struct Ir_protocol_desc_t
+{
+    enum Ir_encoding encoding; /** How bits are encoded */
+    uint8_t  num_bits;         /** Number of data bits in a frame */
+    bool     msb_first;        /** Whether the first bit received is the MSB */
+    uint16_t header_mark_us;   /** Header mark, 0 for no header */
+    uint16_t header_space_us;  /** Header space for a data frame */
+    uint16_t repeat_space_us;  /** Header space for a repeat frame, 0 for none */
+    uint16_t zero_mark_us;     /** Mark for a logic 0 */
+    uint16_t zero_space_us;    /** Space for a logic 0 */
+    uint16_t one_mark_us;      /** Mark for a logic 1 */
+    uint16_t one_space_us;     /** Space for a logic 1 */
+    uint16_t stop_mark_us;     /** Trailing stop mark, 0 for none */
+    uint16_t unit_us;          /** Half-bit time for Manchester encodings */
+    uint32_t toggle_mask;      /** Code bits that flip on every new press */
+} Ir_protocol_desc_t;
+
+/** Descriptors for every supported protocol, indexed by Ir_protocol */
+static const Ir_protocol_desc_t IR_DECODER_DATA protocols[NUM_IR_PROTOCOL] = {
+    [IR_PROTOCOL_LASKO] = {
+        .encoding      = IR_ENCODING_PULSE,
+        .num_bits      = 11,
+        .msb_first     = true,
+        .zero_mark_us  = 1200,
+        .zero_space_us = 400,
+        .one_mark_us   = 400,
+        .one_space_us  = 1200,
+    },
+    [IR_PROTOCOL_NEC] = {
+        .encoding        = IR_ENCODING_PULSE,
+        .num_bits        = 32,
+        .msb_first       = false,
+        .header_mark_us  = 9000,
+        .header_space_us = 4500,
+        .repeat_space_us = 2250,
+        .zero_mark_us    = 560,
+        .zero_space_us   = 560,
+        .one_mark_us     = 560,
+        .one_space_us    = 1690,
+        .stop_mark_us    = 560,
+    },
+    [IR_PROTOCOL_RC5] = {
+        .encoding    = IR_ENCODING_MANCHESTER,
+        .num_bits    = 14,
+        .msb_first   = true,
+        .unit_us     = 889,
+        .toggle_mask = 1 << 11,
+    },
+};
+
+/** Last code seen for each protocol, for repeat detection across captures */
+static uint32_t last_code[NUM_IR_PROTOCOL];
+static uint32_t last_toggle[NUM_IR_PROTOCOL];
+static bool     have_last[NUM_IR_PROTOCOL];
+
+/** Last frame decoded from any protocol, for captures arriving in pieces */
+static Ir_frame_t last_frame;
+
+/** Timing scale of each protocol, and of the one being matched */
+static uint16_t scale[NUM_IR_PROTOCOL] = { [0 ... NUM_IR_PROTOCOL - 1] = IR_SCALE_NOMINAL };
+static uint32_t active_scale = IR_SCALE_NOMINAL;
+
+/** Whether a scale changed since Ir_decode_take_changed() was last called */
+static bool scale_changed;
+
+/** Decode statistics */
+static uint32_t num_captures;
+static uint32_t num_decoded;
+static uint32_t num_frames_total;
+
+#ifdef CONFIG_FAN_REMOTE_CALIBRATION
+/** Histogram of the measured timing scale of recent frames, per protocol */
+static uint16_t histogram[NUM_IR_PROTOCOL][IR_CAL_NUM_BINS];
+static uint16_t window_count[NUM_IR_PROTOCOL];
+#endif
+
+/**
+ * @brief  Check whether a duration is within an expected range.
+ * @param  duration Duration being range-checked.
+ * @param  spec     Duration to check against, at nominal timings.
+ * @return Whether duration was in range of spec.
+ */
+static inline bool IR_DECODER_ATTR in_range(uint32_t duration, uint32_t spec)
+{
+    spec = (spec * active_scale) / IR_SCALE_NOMINAL;
+
+    uint32_t margin = (spec / 4) + IR_TOLERANCE_MIN_US;
+
+    return (duration < (spec + margin)) && (duration + margin > spec);
+}
+
+/**
+ * @brief  Classify a pulse-encoded symbol as a logic 0 or 1.
+ * @param  desc   [in] Protocol descriptor.
+ * @param  symbol [in] Symbol to classify.
+ * @param  last   Whether this is the last symbol of the frame, whose space
+ *                blends into the gap after it.
+ * @return 0 or 1 for a valid bit, -1 otherwise.
+ */
+static int IR_DECODER_ATTR classify_pulse(const Ir_protocol_desc_t *desc, const rmt_symbol_word_t *symbol, bool last)
+{
+    bool one_mark  = in_range(symbol->duration0, desc->one_mark_us);
+    bool zero_mark = in_range(symbol->duration0, desc->zero_mark_us);
+
+    if (last && desc->one_mark_us != desc->zero_mark_us)
+    {
+        /* Trailing space can't be trusted, the mark alone has to decide */
+        return (one_mark) ? 1 : (zero_mark) ? 0 : -1;
+    }
+
+    if (one_mark && in_range(symbol->duration1, desc->one_space_us))
+    {
+        return 1;
+    }
+
+    if (zero_mark && in_range(symbol->duration1, desc->zero_space_us))
+    {
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief  Try to decode a pulse-encoded frame at the start of a symbol array.
+ * @param  desc        [in]  Protocol descriptor.
+ * @param  symbols     [in]  Symbols to decode.
+ * @param  num_symbols Number of symbols available.
+ * @param  code        [out] Decoded code.
+ * @param  repeat      [out] Whether this was a repeat frame.
+ * @param  timing      [out] Measured and nominal length of the frame.
+ * @return Number of symbols making up the frame, 0 if there wasn't one.
+ */
+static size_t IR_DECODER_ATTR decode_pulse(const Ir_protocol_desc_t *desc, const rmt_symbol_word_t *symbols,
+                                           size_t num_symbols, uint32_t *code, bool *repeat, Ir_timing_t *timing)
+{
+    size_t i = 0;
+
+    *repeat = false;
+    timing->measured_us = 0;
+    timing->nominal_us  = 0;
+
+    if (desc->header_mark_us)
+    {
+        if (num_symbols < 1 || !in_range(symbols[0].duration0, desc->header_mark_us))
+        {
+            return 0;
+        }
+
+        if (desc->repeat_space_us && in_range(symbols[0].duration1, desc->repeat_space_us))
+        {
+            /* Repeat frame, just a header and a stop mark */
+            if (num_symbols < 2 || !in_range(symbols[1].duration0, desc->stop_mark_us))
+            {
+                return 0;
+            }
+
+            *repeat = true;
+            return 2;
+        }
+
+        if (!in_range(symbols[0].duration1, desc->header_space_us))
+        {
+            return 0;
+        }
+
+        timing->measured_us += symbols[0].duration0 + symbols[0].duration1;
+        timing->nominal_us  += desc->header_mark_us + desc->header_space_us;
+        i = 1;
+    }
+
+    if (num_symbols < i + desc->num_bits + ((desc->stop_mark_us) ? 1 : 0))
+    {
+        /* Not enough symbols left for a whole frame */
+        return 0;
+    }
+
+    uint32_t value = 0;
+    for (int bit_index = 0; bit_index < desc->num_bits; bit_index++, i++)
+    {
+        bool last = (bit_index == desc->num_bits - 1) && !desc->stop_mark_us;
+        int  bit  = classify_pulse(desc, &symbols[i], last);
+        if (bit < 0)
+        {
+            return 0;
+        }
+
+        timing->measured_us += symbols[i].duration0;
+        timing->nominal_us  += (bit) ? desc->one_mark_us : desc->zero_mark_us;
+        if (!last)
+        {
+            timing->measured_us += symbols[i].duration1;
+            timing->nominal_us  += (bit) ? desc->one_space_us : desc->zero_space_us;
+        }
+
+        if (desc->msb_first)
+        {
+            value = (value << 1) | (uint32_t) bit;
+        }
+        else
+        {
+            value |= (uint32_t) bit << bit_index;
+        }
+    }
+
+    if (desc->stop_mark_us)
+    {
+        if (!in_range(symbols[i].duration0, desc->stop_mark_us))
+        {
+            return 0;
+        }
+        timing->measured_us += symbols[i].duration0;
+        timing->nominal_us  += desc->stop_mark_us;
+        i++;
+    }
+
+    *code = value;
+    return i;
+}
+
+/**
+ * @brief  Expand a duration into a number of Manchester half-bits.
+ * @param  duration Duration to expand.
+ * @param  unit     Half-bit time.
+ * @return 1 or 2 half-bits, 0 if the duration fits neither.
+ */
+static inline int IR_DECODER_ATTR half_bits(uint32_t duration, uint32_t unit)
+{
+    return in_range(duration, unit) ? 1 : in_range(duration, 2 * unit) ? 2 : 0;
+}
+
+/**
+ * @brief  Try to decode a Manchester-encoded frame at the start of a symbol
+ *         array.
+ * @param  desc        [in]  Protocol descriptor.
+ * @param  symbols     [in]  Symbols to decode.
+ * @param  num_symbols Number of symbols available.
+ * @param  code        [out] Decoded code.
+ * @param  timing      [out] Measured and nominal length of the frame.
+ * @return Number of symbols making up the frame, 0 if there wasn't one.
+ */
+static size_t IR_DECODER_ATTR decode_manchester(const Ir_protocol_desc_t *desc, const rmt_symbol_word_t *symbols,
+                                                size_t num_symbols, uint32_t *code, Ir_timing_t *timing)
+{
+    uint8_t levels[IR_MAX_HALF_BITS];
+    size_t  needed = 2 * (size_t) desc->num_bits;
+    size_t  count  = 0;
+    size_t  i      = 0;
+
+    timing->measured_us = 0;
+    timing->nominal_us  = 0;
+
+    /* The frame starts with a 1 (space, mark), but the space blends into idle */
+    levels[count++] = 0;
+
+    while (count < needed && i < num_symbols)
+    {
+        int marks = half_bits(symbols[i].duration0, desc->unit_us);
+        if (0 == marks)
+        {
+            return 0;
+        }
+
+        timing->measured_us += symbols[i].duration0;
+        timing->nominal_us  += (uint32_t) marks * desc->unit_us;
+
+        for (; marks > 0 && count < needed; marks--)
+        {
+            levels[count++] = 1;
+        }
+
+        int spaces = half_bits(symbols[i].duration1, desc->unit_us);
+        i++;
+
+        if (0 == spaces)
+        {
+            /* End of the frame, a trailing space blends into idle */
+            while (count < needed)
+            {
+                levels[count++] = 0;
+            }
+            break;
+        }
+
+        timing->measured_us += symbols[i - 1].duration1;
+        timing->nominal_us  += (uint32_t) spaces * desc->unit_us;
+
+        for (; spaces > 0 && count < needed; spaces--)
+        {
+            levels[count++] = 0;
+        }
+    }
+
+    if (count < needed)
+    {
+        return 0;
+    }
+
+    uint32_t value = 0;
+    for (size_t bit_index = 0; bit_index < desc->num_bits; bit_index++)
+    {
+        uint8_t first  = levels[2 * bit_index];
+        uint8_t second = levels[2 * bit_index + 1];
+        if (first == second)
+        {
+            /* No mid-bit transition, not Manchester */
+            return 0;
+        }
+
+        /* A 1 goes from space to mark, a 0 from mark to space */
+        value = (value << 1) | second;
+    }
+
+    *code = value;
+    return i;
+}
+
+#ifdef CONFIG_FAN_REMOTE_CALIBRATION
+/**
+ * @brief   Add a decoded frame to the calibration of its protocol.
+ * @details Once the window fills, the scale moves to the median of the
+ *          histogram, and the histogram is halved so older frames fade out.
+ * @param   protocol Protocol the frame was decoded with.
+ * @param   timing   [in] Measured and nominal length of the frame.
+ */
+static void IR_DECODER_ATTR calibrate(int protocol, const Ir_timing_t *timing)
+{
+    uint16_t *bins = histogram[protocol];
+
+    if (0 == timing->nominal_us)
+    {
+        return;
+    }
+
+    int32_t ratio = (int32_t) ((timing->measured_us * IR_SCALE_NOMINAL) / timing->nominal_us);
+    int32_t bin   = (ratio - IR_SCALE_MIN + IR_CAL_BIN_WIDTH / 2) / IR_CAL_BIN_WIDTH;
+    bin = (bin < 0) ? 0 : (bin >= IR_CAL_NUM_BINS) ? IR_CAL_NUM_BINS - 1 : bin;
+    bins[bin]++;
+
+    if (++window_count[protocol] < IR_CAL_WINDOW)
+    {
+        return;
+    }
+    window_count[protocol] = 0;
+
+    uint32_t total = 0;
+    for (int i = 0; i < IR_CAL_NUM_BINS; i++)
+    {
+        total += bins[i];
+    }
+
+    uint32_t seen   = 0;
+    int      median = 0;
+    for (; median < IR_CAL_NUM_BINS - 1; median++)
+    {
+        seen += bins[median];
+        if (2 * seen >= total)
+        {
+            break;
+        }
+    }
+
+    for (int i = 0; i < IR_CAL_NUM_BINS; i++)
+    {
+        bins[i] /= 2;
+    }
+
+    uint16_t new_scale = (uint16_t) (IR_SCALE_MIN + median * IR_CAL_BIN_WIDTH);
+    if (new_scale != scale[protocol])
+    {
+        scale[protocol] = new_scale;
+        scale_changed   = true;
+    }
+}
+#else
+#define calibrate(protocol, timing)
+#endif /* CONFIG_FAN_REMOTE_CALIBRATION */
+
+/**
+ * @brief   Decode every IR frame found in a capture of RMT symbols.
+ * @details Scans through the capture, trying every protocol at each position.
+ *          Frames that repeat an earlier press, either as a protocol repeat
+ *          frame, an unchanged toggle bit, or the same frame again within the
+ *          same capture, are flagged as repeats.
+ *
+ *          Long captures can be handed over in pieces. A frame split across
+ *          two pieces is lost, but frames after it are still found, which is
+ *          all a held button needs.
+ * @param   symbols     [in]  Captured RMT symbols, any length.
+ * @param   num_symbols Number of symbols in the capture.
+ * @param   continued   Whether the symbols carry on from the previous call.
+ * @param   frames      [out] Decoded frames.
+ * @param   max_frames  Maximum number of frames to decode.
+ * @return  Number of frames decoded.
+ */
+size_t IR_DECODER_ATTR Ir_decode(const rmt_symbol_word_t *symbols, size_t num_symbols, bool continued,
+                                 Ir_frame_t *frames, size_t max_frames)
+{
+    size_t            num_frames = 0;
+    size_t            offset     = 0;
+    const Ir_frame_t *previous   = (continued) ? &last_frame : NULL;
+
+    if (num_symbols < IR_MIN_FRAME_SYMBOLS)
+    {
+        return 0;
+    }
+
+    while (offset < num_symbols && num_frames < max_frames)
+    {
+        size_t used = 0;
+
+        for (int protocol = 0; protocol < NUM_IR_PROTOCOL && 0 == used; protocol++)
+        {
+            const Ir_protocol_desc_t *desc = &protocols[protocol];
+            uint32_t                  raw  = 0;
+            bool                      repeat_frame = false;
+            Ir_timing_t               timing;
+
+            active_scale = scale[protocol];
+            if (IR_ENCODING_MANCHESTER == desc->encoding)
+            {
+                used = decode_manchester(desc, &symbols[offset], num_symbols - offset, &raw, &timing);
+            }
+            else
+            {
+                used = decode_pulse(desc, &symbols[offset], num_symbols - offset, &raw, &repeat_frame, &timing);
+            }
+
+            if (0 == used || (repeat_frame && !have_last[protocol]))
+            {
+                /* No frame, or a repeat of something we never saw */
+                continue;
+            }
+
+            Ir_frame_t *frame = &frames[num_frames++];
+            frame->protocol = (enum Ir_protocol) protocol;
+
+            if (repeat_frame)
+            {
+                frame->code   = last_code[protocol];
+                frame->repeat = true;
+            }
+            else
+            {
+                uint32_t toggle = raw & desc->toggle_mask;
+                frame->code   = raw & ~desc->toggle_mask;
+                frame->repeat = (previous && previous->protocol == frame->protocol &&
+                                 previous->code == frame->code) ||
+                                (desc->toggle_mask && have_last[protocol] &&
+                                 last_code[protocol] == frame->code && last_toggle[protocol] == toggle);
+
+                last_code[protocol]   = frame->code;
+                last_toggle[protocol] = toggle;
+                have_last[protocol]   = true;
+
+                calibrate(protocol, &timing);
+            }
+
+            previous   = frame;
+            last_frame = *frame;
+        }
+
+        /* Skip past the frame, or past one bad symbol */
+        offset += (used) ? used : 1;
+    }
+
+    num_captures++;
+    num_decoded      += (num_frames) ? 1 : 0;
+    num_frames_total += num_frames;
+
+    return num_frames;
+}
+
+/**
+ * @brief   Get the longest duration a frame can hold.
+ * @details Any mark or space longer than this can only be the gap after a
+ *          frame, so a capture can be ended on it. Takes the current timing
+ *          scale and the matching tolerance into account.
+ * @param   protocol Protocol of the frame, NUM_IR_PROTOCOL for any protocol.
+ * @return  Longest duration (in uSec) within a frame.
+ */
+uint32_t IR_DECODER_ATTR Ir_decode_longest_us(enum Ir_protocol protocol)
+{
+    uint32_t longest = 0;
+
+    for (int i = 0; i < NUM_IR_PROTOCOL; i++)
+    {
+        const Ir_protocol_desc_t *desc = &protocols[i];
+        uint32_t                  spec = 2 * (uint32_t) desc->unit_us;
+
+        if (NUM_IR_PROTOCOL != protocol && i != (int) protocol)
+        {
+            continue;
+        }
+
+        spec = (desc->header_mark_us > spec) ? desc->header_mark_us : spec;
+        spec = (desc->header_space_us > spec) ? desc->header_space_us : spec;
+        spec = (desc->zero_mark_us > spec) ? desc->zero_mark_us : spec;
+        spec = (desc->zero_space_us > spec) ? desc->zero_space_us : spec;
+        spec = (desc->one_mark_us > spec) ? desc->one_mark_us : spec;
+        spec = (desc->one_space_us > spec) ? desc->one_space_us : spec;
+
+        /* Same bound in_range() accepts up to */
+        spec = (spec * scale[i]) / IR_SCALE_NOMINAL;
+        spec += (spec / 4) + IR_TOLERANCE_MIN_US;
+
+        longest = (spec > longest) ? spec : longest;
+    }
+
+    return longest;
+}
+
+/**
+ * @brief Get the decode statistics and the current timing scales.
+ * @param stats [out] Statistics.
+ */
+void Ir_decode_get_stats(Ir_stats_t *stats)
+{
+    stats->captures = num_captures;
+    stats->decoded  = num_decoded;
+    stats->frames   = num_frames_total;
+    for (int protocol = 0; protocol < NUM_IR_PROTOCOL; protocol++)
+    {
+        stats->scale[protocol] = scale[protocol];
+    }
+}
+
+/**
+ * @brief   Set the timing scales, as saved from an earlier calibration.
+ * @details Scales outside IR_SCALE_MIN to IR_SCALE_MAX are left at nominal.
+ *          Call before decoding starts.
+ * @param   new_scale [in] Timing scale of each protocol.
+ */
+void Ir_decode_set_scale(const uint16_t *new_scale)
+{
+    for (int protocol = 0; protocol < NUM_IR_PROTOCOL; protocol++)
+    {
+        bool valid = new_scale[protocol] >= IR_SCALE_MIN && new_scale[protocol] <= IR_SCALE_MAX;
+        scale[protocol] = (valid) ? new_scale[protocol] : IR_SCALE_NOMINAL;
+    }
+}
+
+/**
+ * @brief  Check whether calibration changed a timing scale, and clear it.
+ * @return Whether a scale changed since the last call.
+ */
+bool IR_DECODER_ATTR Ir_decode_take_changed(void)
+{
+    bool changed = scale_changed;
+
+    scale_changed = false;
+    return changed;
+}
+
+/** @} end IrDecoder */
@@ -0,0 +1,87 @@
+/**
+ * @file ir_decoder.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to decode IR remote frames from RMT symbols.
+ * 
+ * @addtogroup IrDecoder
+ * @{
+ */
+
+#ifndef IR_DECODER_H
+#define IR_DECODER_H
+
+#include <stdbool.h>       /* Boolean type */
+#include <stddef.h>        /* Size type */
+#include <stdint.h>        /* Extended integer types */
+
+#include <sdkconfig.h>     /* Project configuration */
+#include <esp_attr.h>      /* Extra function attributes (IRAM_ATTR) */
+#ifdef CONFIG_IDF_TARGET_LINUX
+/** Same layout as the RMT driver's symbol, for decoding captures on the host */
+typedef union
+{
+    struct
+    {
+        uint16_t duration0 : 15; /** Duration of level0 */
+        uint16_t level0 : 1;     /** Level of the first part */
+        uint16_t duration1 : 15; /** Duration of level1 */
+        uint16_t level1 : 1;     /** Level of the second part */
+    };
+    uint32_t val;                /** Both parts as one word */
+} rmt_symbol_word_t;
+#else
+#include <driver/rmt_rx.h> /* RMT symbol type */
+#endif
+
+/** The decoder has to live in IRAM when it runs inside the RMT callback */
+#ifdef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+#define IR_DECODER_ATTR IRAM_ATTR
+#define IR_DECODER_DATA DRAM_ATTR
+#else
+#define IR_DECODER_ATTR
+#define IR_DECODER_DATA
+#endif
+
+/** Enum for IR protocols the decoder understands */
+enum Ir_protocol
+{
+    IR_PROTOCOL_LASKO = 0, /** Original Lasko fan remote, 11-bit pulse width */
+    IR_PROTOCOL_NEC,       /** NEC, 32-bit pulse distance with repeat frames */
+    IR_PROTOCOL_RC5,       /** Philips RC5, 14-bit Manchester with toggle bit */
+    NUM_IR_PROTOCOL        /** For arithmetic */
+};
+
+/** Timing scale (in 1/256ths of the nominal timings) and the bounds it's kept within */
+#define IR_SCALE_NOMINAL 256
+#define IR_SCALE_MIN     192
+#define IR_SCALE_MAX     320
+
+/** Struct for a single decoded IR frame */
+typedef struct Ir_frame_t
+{
+    enum Ir_protocol protocol; /** Protocol the frame was decoded with */
+    uint32_t code;             /** Decoded code, without any toggle bits */
+    bool repeat;               /** Whether this repeats a previous press */
+} Ir_frame_t;
+
+/** Struct for the decoder's statistics and timing calibration */
+typedef struct Ir_stats_t
+{
+    uint32_t captures;               /** Captures long enough to hold a frame */
+    uint32_t decoded;                /** Captures that held at least one frame */
+    uint32_t frames;                 /** Frames decoded */
+    uint16_t scale[NUM_IR_PROTOCOL]; /** Timing scale of each protocol */
+} Ir_stats_t;
+
+/** Public functions for the IrDecoder component */
+size_t Ir_decode(const rmt_symbol_word_t *symbols, size_t num_symbols, bool continued,
+                 Ir_frame_t *frames, size_t max_frames);
+uint32_t Ir_decode_longest_us(enum Ir_protocol protocol);
+void Ir_decode_get_stats(Ir_stats_t *stats);
+void Ir_decode_set_scale(const uint16_t *scale);
+bool Ir_decode_take_changed(void);
+
+#endif /* IR_DECODER_H */
+
+/** @} end IrDecoder */
@@ -0,0 +1,312 @@
+/**
+ * @file journal.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep a journal of the events that changed the fans.
+ *
+ * When a fan misbehaves in the field, the log is long gone by the time anyone
+ * looks. This component keeps the last few hundred events, along with the fan
+ * state each one led to, in a ring of 8 Byte entries in RTC memory. That
+ * memory isn't cleared by a soft reset (panic, watchdog, brownout or
+ * esp_restart()), so the events leading up to a crash survive it, and nothing
+ * is ever written to flash. Each boot appends a marker with the reset reason.
+ *
+ * Only the event handler task appends events, so no lock is needed: an entry
+ * is filled in, then the head is published. Recording is a handful of stores,
+ * the timestamp is kept in units of 1024 uSec so it is a shift rather than a
+ * 64 bit division.
+ *
+ * After a reset that looks like a crash, the journal is dumped to the log on
+ * boot. It can also be dumped with Journal_dump(), or fetched from the
+ * HomeKit HTTP server:
+ *
+ * curl <fan-ip>:<hap-port>/debug/journal
+ *
+ * @addtogroup Journal
+ * @{
+ */
+
+#include <stdbool.h>              /* Boolean type */
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+
+#ifdef CONFIG_FAN_JOURNAL
+#include <esp_attr.h>             /* RTC_NOINIT_ATTR */
+#include <esp_system.h>           /* Reset reason */
+#endif
+
+#ifdef CONFIG_FAN_JOURNAL_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+
+#include "main.h"
+#include "latency.h"
+#include "journal.h"
+
+#ifdef CONFIG_FAN_JOURNAL
+
+/** Number of entries in the ring, a power of two */
+#define JOURNAL_SIZE (1u << CONFIG_FAN_JOURNAL_SIZE_LOG2)
+#define JOURNAL_MASK (JOURNAL_SIZE - 1)
+
+/** Marks a journal that survived from an earlier boot, changes with the layout */
+#define JOURNAL_MAGIC 0x4A524E31
+
+/** Timestamps are kept in units of 1 << JOURNAL_TIME_SHIFT uSec */
+#define JOURNAL_TIME_SHIFT 10
+
+/** Event byte of a boot marker, whose argument is the reset reason */
+#define JOURNAL_EVENT_BOOT 0xFF
+
+/** Layout of the event byte of an entry */
+#define JOURNAL_SOURCE_SHIFT 4
+#define JOURNAL_ID_MASK      0x0F
+
+/** Layout of the state of an entry */
+#define JOURNAL_STATE_SPEED_MASK  0x0007
+#define JOURNAL_STATE_OSC_BIT     0x0008
+#define JOURNAL_STATE_ON_BIT      0x0010
+#define JOURNAL_STATE_AUTO_BIT    0x0020
+#define JOURNAL_STATE_TIMER_SHIFT 6
+#define JOURNAL_STATE_TIMER_MASK  0x0007
+#define JOURNAL_STATE_FAN_SHIFT   9
+
+/** Size of the buffer used to format a single entry */
+#define JOURNAL_LINE_SIZE 96
+
+_Static_assert(NUM_SOURCE <= (1 << (8 - JOURNAL_SOURCE_SHIFT)), "Event sources must fit in a journal entry");
+_Static_assert(NUM_EVENT_ID <= JOURNAL_ID_MASK + 1, "Event IDs must fit in a journal entry");
+_Static_assert(NUM_TIMER <= JOURNAL_STATE_TIMER_MASK + 1, "Timer settings must fit in a journal entry");
+
+/** One journal entry */
+typedef struct Journal_entry_t
+{
+    uint32_t time;  /** Event timestamp, in units of 1024 uSec since boot */
+    uint8_t  event; /** Source in the high nibble and ID in the low one, or JOURNAL_EVENT_BOOT */
+    uint8_t  arg;   /** Event argument, or the reset reason for a boot marker */
+    uint16_t state; /** Resulting fan state, or the boot count for a boot marker */
+} Journal_entry_t;
+
+/** The journal, as kept in RTC memory */
+typedef struct Journal_t
+{
+    uint32_t        magic;                /** JOURNAL_MAGIC once initialized */
+    uint32_t        head;                 /** Entries ever appended, the next goes at head & JOURNAL_MASK */
+    uint32_t        boots;                /** Boots since the journal was cleared */
+    Journal_entry_t entries[JOURNAL_SIZE]; /** Ring of entries */
+} Journal_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Journal";
+
+/** Names used when dumping */
+static const char *id_names[NUM_EVENT_ID] = { "power", "oscillate", "time", "speed", "temperature" };
+
+/** The journal, left alone by soft resets */
+static RTC_NOINIT_ATTR Journal_t journal;
+
+/**
+ * @brief Append an entry to the ring.
+ * @param entry [in] Entry to append
+ */
+static inline void append(const Journal_entry_t *entry)
+{
+    uint32_t head = journal.head;
+
+    journal.entries[head & JOURNAL_MASK] = *entry;
+
+    /* Publish the entry only once it's complete */
+    __atomic_store_n(&journal.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Record an event and the fan state it led to.
+ * @param event [in] Event that was handled
+ * @param state [in] Target state of the fan after the event
+ */
+void Journal_record(const Fan_event_t *event, const Fan_state_t *state)
+{
+    Journal_entry_t entry = {
+        .time  = (uint32_t) ((uint64_t) event->timestamp_us >> JOURNAL_TIME_SHIFT),
+        .event = (uint8_t) ((event->source << JOURNAL_SOURCE_SHIFT) | event->id),
+        .arg   = (uint8_t) event->arg,
+        .state = (uint16_t) ((state->speed & JOURNAL_STATE_SPEED_MASK) |
+                             ((state->oscillate) ? JOURNAL_STATE_OSC_BIT : 0) |
+                             ((state->on) ? JOURNAL_STATE_ON_BIT : 0) |
+                             ((state->auto_mode) ? JOURNAL_STATE_AUTO_BIT : 0) |
+                             ((state->timer & JOURNAL_STATE_TIMER_MASK) << JOURNAL_STATE_TIMER_SHIFT) |
+                             (event->fan << JOURNAL_STATE_FAN_SHIFT)),
+    };
+
+    append(&entry);
+}
+
+/**
+ * @brief  Format one entry into a single line of text.
+ * @param  entry [in] Entry to format
+ * @param  buf   [out] Buffer to write into
+ * @param  size  Size of the buffer
+ * @return Number of characters written.
+ */
+static int format_entry(const Journal_entry_t *entry, char *buf, size_t size)
+{
+    int len;
+
+    if (JOURNAL_EVENT_BOOT == entry->event)
+    {
+        len = snprintf(buf, size, "-- boot %u, reset reason %u --", (unsigned) entry->state, (unsigned) entry->arg);
+    }
+    else
+    {
+        uint64_t time_us = (uint64_t) entry->time << JOURNAL_TIME_SHIFT;
+        unsigned id      = entry->event & JOURNAL_ID_MASK;
+        uint16_t state   = entry->state;
+
+        len = snprintf(buf, size, "%10" PRIu64 " ms %s %s %u -> fan %u %s speed %u%s timer %u%s",
+                       time_us / 1000,
+                       Latency_source_name((enum Event_source) (entry->event >> JOURNAL_SOURCE_SHIFT)),
+                       (id < NUM_EVENT_ID) ? id_names[id] : "?", (unsigned) entry->arg,
+                       (unsigned) (state >> JOURNAL_STATE_FAN_SHIFT),
+                       (state & JOURNAL_STATE_ON_BIT) ? "on" : "off",
+                       (unsigned) (state & JOURNAL_STATE_SPEED_MASK),
+                       (state & JOURNAL_STATE_OSC_BIT) ? " osc" : "",
+                       (unsigned) ((state >> JOURNAL_STATE_TIMER_SHIFT) & JOURNAL_STATE_TIMER_MASK),
+                       (state & JOURNAL_STATE_AUTO_BIT) ? " auto" : "");
+    }
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief  Format the entry at a position of the journal, oldest first.
+ * @param  index Position, 0 being the oldest entry still in the ring
+ * @param  buf   [out] Buffer to write into
+ * @param  size  Size of the buffer
+ * @return Number of characters written, -1 past the newest entry.
+ */
+static int format_line(uint32_t index, char *buf, size_t size)
+{
+    uint32_t head  = __atomic_load_n(&journal.head, __ATOMIC_ACQUIRE);
+    uint32_t count = (head < JOURNAL_SIZE) ? head : JOURNAL_SIZE;
+
+    if (index >= count)
+    {
+        return -1;
+    }
+
+    /* Copy it out first, the event handler may be overwriting it */
+    Journal_entry_t entry = journal.entries[(head - count + index) & JOURNAL_MASK];
+    return format_entry(&entry, buf, size);
+}
+
+/**
+ * @brief Dump the journal to the log, oldest entry first.
+ */
+void Journal_dump(void)
+{
+    char line[JOURNAL_LINE_SIZE];
+
+    for (uint32_t i = 0; format_line(i, line, sizeof(line)) >= 0; i++)
+    {
+        ESP_LOGI(TAG, "%s", line);
+    }
+}
+
+/**
+ * @brief   Initializer for the Journal component.
+ * @details Keeps the journal from before the reset unless the chip lost
+ *          power, which leaves RTC memory full of noise. Must be called
+ *          before the event handler starts recording.
+ */
+void Journal_init(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    if (JOURNAL_MAGIC != journal.magic || ESP_RST_POWERON == reason)
+    {
+        journal.magic = JOURNAL_MAGIC;
+        journal.head  = 0;
+        journal.boots = 0;
+    }
+    journal.boots++;
+
+    if (ESP_RST_PANIC == reason || ESP_RST_INT_WDT == reason || ESP_RST_TASK_WDT == reason ||
+        ESP_RST_WDT == reason || ESP_RST_BROWNOUT == reason)
+    {
+        ESP_LOGW(TAG, "Reset by %d, events leading up to it:", (int) reason);
+        Journal_dump();
+    }
+
+    Journal_entry_t marker = {
+        .time  = 0,
+        .event = JOURNAL_EVENT_BOOT,
+        .arg   = (uint8_t) reason,
+        .state = (uint16_t) journal.boots,
+    };
+    append(&marker);
+}
+
+#ifdef CONFIG_FAN_JOURNAL_HTTP_ENDPOINT
+/**
+ * @brief  HTTP handler returning the journal as plain text.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t journal_http_handler(httpd_req_t *req)
+{
+    char line[JOURNAL_LINE_SIZE];
+    int  len;
+
+    httpd_resp_set_type(req, "text/plain");
+    for (uint32_t i = 0; (len = format_line(i, line, sizeof(line) - 1)) >= 0; i++)
+    {
+        line[len++] = '\n';
+        httpd_resp_send_chunk(req, line, len);
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the journal debug endpoint */
+static const httpd_uri_t journal_get = {
+    .uri     = "/debug/journal",
+    .method  = HTTP_GET,
+    .handler = journal_http_handler,
+};
+#endif /* CONFIG_FAN_JOURNAL_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the journal debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_JOURNAL_HTTP_ENDPOINT is set.
+ */
+void Journal_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_JOURNAL_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, journal endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &journal_get);
+#endif /* CONFIG_FAN_JOURNAL_HTTP_ENDPOINT */
+}
+
+#else /* !CONFIG_FAN_JOURNAL */
+
+void Journal_init(void) {}
+void Journal_record(const Fan_event_t *event, const Fan_state_t *state) { UNUSED_PARAM(event); UNUSED_PARAM(state); }
+void Journal_dump(void) {}
+void Journal_register_http_handler(void) {}
+
+#endif /* CONFIG_FAN_JOURNAL */
+
+/** @} end Journal */
@@ -0,0 +1,24 @@
+/**
+ * @file journal.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep a journal of the events that changed the fans.
+ *
+ * @addtogroup Journal
+ * @{
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "main.h" /* Fan_event_t, Fan_state_t */
+
+/** Public functions for the Journal component */
+void Journal_init(void);
+void Journal_record(const Fan_event_t *event, const Fan_state_t *state);
+void Journal_dump(void);
+void Journal_register_http_handler(void);
+
+#endif /* JOURNAL_H */
+
+/** @} end Journal */
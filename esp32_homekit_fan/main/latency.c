@@ -0,0 +1,223 @@
+/**
+ * @file latency.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to measure how long events take to reach the hardware.
+ *
+ * Every event is stamped with the time it was created, whether that was in a
+ * button ISR, the IR remote task, or the HomeKit write callback. The event
+ * handler then records how long the event sat in the queue, and how long it
+ * took from being dequeued until the relays were actually written.
+ *
+ * Latencies are kept in per-source histograms with power-of-two buckets, so
+ * recording is just a couple of adds. The histograms can be dumped to the log,
+ * or fetched from the HomeKit HTTP server with the debug endpoint:
+ *
+ * curl <fan-ip>:<hap-port>/debug/latency
+ * 
+ * @addtogroup Latency
+ * @{
+ */
+
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+
+#ifdef CONFIG_FAN_LATENCY_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+
+#include "main.h"
+#include "latency.h"
+
+/** Number of histogram buckets, bucket i holds latencies below 2^i uSec */
+#define NUM_LATENCY_BUCKET 24
+
+/** Size of the buffer used to format a single histogram line */
+#define LATENCY_LINE_SIZE 256
+
+/** Histogram of latencies for one (source, stage) pair */
+typedef struct Latency_histogram_t
+{
+    uint32_t buckets[NUM_LATENCY_BUCKET]; /** Counts per power-of-two bucket */
+    uint32_t count;                       /** Total samples */
+    int64_t  total_us;                    /** Sum of all samples, for the mean */
+    int64_t  max_us;                      /** Largest sample */
+} Latency_histogram_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Latency";
+
+/** Names used when dumping histograms */
+static const char *source_names[NUM_SOURCE] = { "homekit", "remote", "button", "timer", "schedule", "link", "udp", "mqtt", "auto" };
+static const char *stage_names[NUM_LATENCY_STAGE] = { "queue", "actuation" };
+
+/** Histograms for every source and stage */
+static Latency_histogram_t histograms[NUM_SOURCE][NUM_LATENCY_STAGE];
+
+/**
+ * @brief Record a single latency sample.
+ * @param source   Source of the event being timed
+ * @param stage    Stage of the pipeline being timed
+ * @param start_us Time (in uSec) the stage started
+ * @param end_us   Time (in uSec) the stage ended
+ */
+void Latency_record(enum Event_source source, enum Latency_stage stage, int64_t start_us, int64_t end_us)
+{
+    if (source >= NUM_SOURCE || stage >= NUM_LATENCY_STAGE || 0 == start_us)
+    {
+        /* Nothing sensible to record */
+        return;
+    }
+
+    Latency_histogram_t *histogram = &histograms[source][stage];
+    int64_t              latency   = (end_us > start_us) ? (end_us - start_us) : 0;
+
+    /* Bucket by the position of the highest set bit */
+    int bucket = (latency > 0) ? 64 - __builtin_clzll((uint64_t) latency) : 0;
+    if (bucket >= NUM_LATENCY_BUCKET)
+    {
+        bucket = NUM_LATENCY_BUCKET - 1;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->total_us += latency;
+    if (latency > histogram->max_us)
+    {
+        histogram->max_us = latency;
+    }
+}
+
+/**
+ * @brief Get the summary of one histogram.
+ * @param source  Source of the histogram
+ * @param stage   Stage of the histogram
+ * @param count   [out] Total samples
+ * @param mean_us [out] Mean latency (in uSec), 0 without samples
+ * @param max_us  [out] Largest latency (in uSec)
+ */
+void Latency_get_summary(enum Event_source source, enum Latency_stage stage,
+                         uint32_t *count, int64_t *mean_us, int64_t *max_us)
+{
+    const Latency_histogram_t *histogram = &histograms[source][stage];
+
+    *count   = histogram->count;
+    *mean_us = (histogram->count) ? histogram->total_us / histogram->count : 0;
+    *max_us  = histogram->max_us;
+}
+
+/**
+ * @brief  Get the name of an event source, as used in reports.
+ * @param  source Source to name
+ * @return Name of the source.
+ */
+const char *Latency_source_name(enum Event_source source)
+{
+    return (source < NUM_SOURCE) ? source_names[source] : "unknown";
+}
+
+/**
+ * @brief  Format one histogram into a single line of text.
+ * @param  source Source of the histogram
+ * @param  stage  Stage of the histogram
+ * @param  buf    [out] Buffer to write into
+ * @param  size   Size of the buffer
+ * @return Number of characters written.
+ */
+static int format_histogram(int source, int stage, char *buf, size_t size)
+{
+    const Latency_histogram_t *histogram = &histograms[source][stage];
+
+    int len = snprintf(buf, size, "%s/%s: n=%" PRIu32 " mean=%" PRId64 "us max=%" PRId64 "us |",
+                       source_names[source], stage_names[stage], histogram->count,
+                       (histogram->count) ? histogram->total_us / histogram->count : 0,
+                       histogram->max_us);
+
+    /* Only print the buckets that have something in them */
+    for (int i = 0; i < NUM_LATENCY_BUCKET && len < (int) size; i++)
+    {
+        if (histogram->buckets[i])
+        {
+            len += snprintf(buf + len, size - len, " <%luus:%" PRIu32,
+                            (unsigned long) (1UL << i), histogram->buckets[i]);
+        }
+    }
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief Dump every latency histogram to the log.
+ */
+void Latency_dump(void)
+{
+    char line[LATENCY_LINE_SIZE];
+
+    for (int source = 0; source < NUM_SOURCE; source++)
+    {
+        for (int stage = 0; stage < NUM_LATENCY_STAGE; stage++)
+        {
+            (void) format_histogram(source, stage, line, sizeof(line));
+            ESP_LOGI(TAG, "%s", line);
+        }
+    }
+}
+
+#ifdef CONFIG_FAN_LATENCY_HTTP_ENDPOINT
+/**
+ * @brief  HTTP handler returning every latency histogram as plain text.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t latency_http_handler(httpd_req_t *req)
+{
+    char line[LATENCY_LINE_SIZE];
+
+    httpd_resp_set_type(req, "text/plain");
+    for (int source = 0; source < NUM_SOURCE; source++)
+    {
+        for (int stage = 0; stage < NUM_LATENCY_STAGE; stage++)
+        {
+            int len = format_histogram(source, stage, line, sizeof(line) - 1);
+            line[len++] = '\n';
+            httpd_resp_send_chunk(req, line, len);
+        }
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the latency debug endpoint */
+static const httpd_uri_t latency_get = {
+    .uri     = "/debug/latency",
+    .method  = HTTP_GET,
+    .handler = latency_http_handler,
+};
+#endif /* CONFIG_FAN_LATENCY_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the latency debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_LATENCY_HTTP_ENDPOINT is set.
+ */
+void Latency_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_LATENCY_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, latency endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &latency_get);
+#endif /* CONFIG_FAN_LATENCY_HTTP_ENDPOINT */
+}
+
+/** @} end Latency */
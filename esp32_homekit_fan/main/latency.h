@@ -0,0 +1,36 @@
+/**
+ * @file latency.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to measure how long events take to reach the hardware.
+ * 
+ * @addtogroup Latency
+ * @{
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h> /* Extended integer types */
+
+#include "main.h"   /* Event_source */
+
+/** Enum for the stages of the event pipeline that are timed */
+enum Latency_stage
+{
+    LATENCY_QUEUE = 0,  /** Event creation to dequeue by the event handler */
+    LATENCY_ACTUATION,  /** Dequeue to the relays being written */
+    NUM_LATENCY_STAGE   /** For arithmetic */
+};
+
+/** Public functions for the Latency component */
+void Latency_record(enum Event_source source, enum Latency_stage stage, int64_t start_us, int64_t end_us);
+void Latency_get_summary(enum Event_source source, enum Latency_stage stage,
+                         uint32_t *count, int64_t *mean_us, int64_t *max_us);
+const char *Latency_source_name(enum Event_source source);
+void Latency_dump(void);
+void Latency_register_http_handler(void);
+
+#endif /* LATENCY_H */
+
+/** @} end Latency */
@@ -9,27 +9,70 @@
  * are present on the original control board of the fan. I also utilize the
  * in-built LED present on the specific ESP32 board I am using.
  *
- * Utilizing the LEDs is rather simple affair, simple requiring logic low/high
- * writes to the LED GPIO pins. I included the ability to disable LED operation
- * entirely as well, which can be nice for dark room situations where you don't
- * want the blinding blue LEDs shining.
+ * The speed LEDs are driven by LEDC channels, so they can be dimmed and fade
+ * from one speed to the next. A change just starts a hardware fade towards the
+ * new duty and returns, the LEDC fade ISR takes care of the rest, so the event
+ * handler never waits on the LEDs. I included a night mode as well, which can
+ * be nice for dark room situations where you don't want the blinding blue LEDs
+ * shining. With g_Led_enable cleared, the LEDs drop to the night brightness,
+ * which is off unless configured otherwise.
+ *
+ * There are only so many LEDC channels. Speed LEDs beyond those are driven as
+ * a bank, like the relays, only ever fully on or off. Each speed maps to a
+ * precomputed pin bitmask which is applied through the GPIO set/clear
+ * registers, rather than one driver call per pin. When bridging several fans,
+ * each one's speed LEDs come from its row of g_Fan_gpio_maps. The enable and
+ * the builtin LED are shared by the whole board.
+ *
+ * The builtin LED has an LEDC channel of its own, with its timer running at the
+ * identify blink rate. Steady on and off are full and zero duty, and identify
+ * just switches to half duty, so the blink is timed by the peripheral and the
+ * HomeKit identify routine returns right away. A one-shot timer puts the LED
+ * back to its steady state afterwards.
  * 
  * @addtogroup Led
  * @{
  */
 
-#include <stdbool.h>     /* Boolean type */
+#include <stdbool.h>      /* Boolean type */
+#include <stdint.h>       /* Extended integer types */
 
-#include <esp_log.h>     /* ESP logging functions */
-#include <driver/gpio.h> /* ESP GPIO-related functions */
+#include <esp_log.h>      /* ESP logging functions */
+#include <esp_timer.h>    /* Identify timeout */
+#include <driver/gpio.h>  /* ESP GPIO-related functions */
+#include <driver/ledc.h>  /* LEDC PWM and fades */
+#include <soc/soc.h>      /* Register access helpers */
+#include <soc/soc_caps.h> /* LEDC capabilities */
+#include <soc/gpio_reg.h> /* GPIO set/clear register addresses */
 
 #include "main.h"
 #include "led.h"
 
-/** Total number of speed-related LEDs */
-#define NUM_SPEED_LED 4
-/** Total number of LEDs */
-#define NUM_TOTAL_LED 5
+/** LEDC timer and channel driving the builtin LED */
+#define BUILTIN_LED_SPEED_MODE LEDC_LOW_SPEED_MODE
+#define BUILTIN_LED_TIMER      LEDC_TIMER_0
+#define BUILTIN_LED_CHANNEL    LEDC_CHANNEL_0
+
+/** Duty resolution of the builtin LED, enough to reach a blink of a few Hz */
+#define BUILTIN_LED_RESOLUTION LEDC_TIMER_14_BIT
+
+/** Builtin LED duties for steady on and for blinking */
+#define BUILTIN_LED_DUTY_ON    (1U << BUILTIN_LED_RESOLUTION)
+#define BUILTIN_LED_DUTY_BLINK (BUILTIN_LED_DUTY_ON / 2)
+
+/** LEDC timer for the speed LEDs, fast enough not to flicker */
+#define SPEED_LED_TIMER      LEDC_TIMER_1
+#define SPEED_LED_FREQ_HZ    5000
+#define SPEED_LED_RESOLUTION LEDC_TIMER_10_BIT
+
+/** Speed LEDs take the LEDC channels after the builtin LED's */
+#define SPEED_LED_FIRST_CHANNEL (BUILTIN_LED_CHANNEL + 1)
+
+/** Marks a speed LED without an LEDC channel, left on the GPIO bank */
+#define NO_CHANNEL (-1)
+
+/** Speed LED duty for a brightness (in percent) */
+#define SPEED_LED_DUTY(pct) ((uint32_t) (pct) * (1U << SPEED_LED_RESOLUTION) / 100)
 
 /** Global boolean to track whether front-fascia LEDs are enabled/disabled */
 bool g_Led_enable;
@@ -37,17 +80,51 @@ bool g_Led_enable;
 /** Tag used for ESP logging */
 static const char *TAG = "Led";
 
-/** Array to help with mass-setting GPIO pins for LEDs */
-static gpio_num_t leds[] = {
-    FAN_SPEED1_LED_GPIO,
-    FAN_SPEED2_LED_GPIO,
-    FAN_SPEED3_LED_GPIO,
-    FAN_SPEED4_LED_GPIO,
-    FAN_BUILTIN_LED_GPIO,
-};
+/** Speed LED to light for each fan and speed, indexed by fan and State_speed */
+static uint32_t speed_masks[FAN_NUM_FANS][NUM_SPEED];
+
+/** Every speed LED of every fan on the GPIO bank */
+static uint32_t speed_led_mask;
+
+/** LEDC channel of each fan and speed, NO_CHANNEL if on the bank or not wired */
+static int8_t speed_channels[FAN_NUM_FANS][NUM_SPEED];
+
+/** Duty each LEDC channel was last sent towards */
+static uint32_t channel_duty[LEDC_CHANNEL_MAX];
+
+/** Timer ending the identify blink */
+static esp_timer_handle_t identify_timer;
+
+/** Whether the builtin LED is blinking for identify */
+static volatile bool identifying;
+
+/** Steady state of the builtin LED, to go back to after identify */
+static volatile bool builtin_state;
+
+/**
+ * @brief  Get the bank mask for an LED pin.
+ * @param  gpio Pin of the LED, GPIO_NUM_NC if not wired
+ * @return Mask for the pin, zero if it isn't wired or doesn't fit the bank.
+ */
+static uint32_t pin_mask(gpio_num_t gpio)
+{
+    if (GPIO_NUM_NC == gpio)
+    {
+        return 0;
+    }
+    if ((int) gpio >= 32)
+    {
+        ESP_LOGE(TAG, "GPIO %d is outside the LED bank, leaving it unused", (int) gpio);
+        return 0;
+    }
+
+    return BIT(gpio);
+}
 
 /**
  * @brief Enables/disables the front-fascia LEDs.
+ * @details Disabling drops them to the night brightness. The event handler
+ *          then rewrites the speed of every fan at the new brightness.
  * @param enable Whether to enable speed LEDs
  */
 void Led_write_enable(bool enable) 
@@ -55,65 +132,88 @@ void Led_write_enable(bool enable)
     g_Led_enable = enable;
 
     ESP_LOGI(TAG, "%s front-fascia LEDs", (enable) ? "Enabling" : "Disabling");
+}
 
-    if (!g_Led_enable)
+/**
+ * @brief   Start a speed LED fading towards a duty.
+ * @details Returns once the fade is started, the fade ISR finishes it. A fade
+ *          still running is cut short and the new one starts from wherever it
+ *          got to.
+ * @param   channel LEDC channel of the LED
+ * @param   duty    Duty to fade to
+ */
+static void fade_to(int channel, uint32_t duty)
+{
+    if (channel_duty[channel] == duty)
     {
-        /* If LEDs were just disabled, clear them all */
-        for (int i = 0; i < NUM_SPEED_LED; i++)
-        {
-            gpio_set_level(leds[i], GPIO_LOW);
-        }
+        /* Already there, or on the way */
+        return;
     }
+    channel_duty[channel] = duty;
 
-    /* If LEDs were just enabled, the event handler will turn them back on */
+#if CONFIG_FAN_LED_FADE_MS > 0
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    /* Otherwise starting the next fade waits for this one to finish */
+    (void) ledc_fade_stop(LEDC_LOW_SPEED_MODE, (ledc_channel_t) channel);
+#endif
+    (void) ledc_set_fade_time_and_start(LEDC_LOW_SPEED_MODE, (ledc_channel_t) channel, duty,
+                                        CONFIG_FAN_LED_FADE_MS, LEDC_FADE_NO_WAIT);
+#else
+    (void) ledc_set_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t) channel, duty);
+    (void) ledc_update_duty(LEDC_LOW_SPEED_MODE, (ledc_channel_t) channel);
+#endif
 }
 
 /**
- * @brief   Sets the speed LEDs according to a given speed.
- * @details Starts out by clearing all LEDs. Then, bins the speed in order to
- *          determine which led to activate.
+ * @brief   Sets the speed LEDs of a fan according to a given speed.
+ * @details The LED for the given speed fades up to the current brightness as
+ *          the others fade out, so the fascia never goes fully dark
+ *          mid-transition. Bank LEDs are lit first and then the rest cleared,
+ *          for the same reason, and are off at a night brightness of zero.
+ * @param   fan   Fan to write
  * @param   speed Speed to write
  */
-void Led_write_speed(enum State_speed speed)
+void Led_write_speed(uint8_t fan, enum State_speed speed)
 {
-    if (!g_Led_enable)
+    if (fan >= FAN_NUM_FANS)
     {
         /* Nothing to do! */
         return;
     }
 
-    /* Disable all speed LEDs */
-    for (int i = 0; i < NUM_SPEED_LED; i++)
+    if ((unsigned) speed >= NUM_SPEED)
     {
-        gpio_set_level(leds[i], GPIO_LOW);
+        ESP_LOGW(TAG, "Invalid speed provided, leaving all off...");
+        speed = SPEED_OFF;
     }
 
-    /* Figure out which LED to turn on */
-    gpio_num_t gpio_num;
-    switch (speed)
+    uint32_t duty = (g_Led_enable) ? SPEED_LED_DUTY(CONFIG_FAN_LED_BRIGHTNESS_PCT)
+                                   : SPEED_LED_DUTY(CONFIG_FAN_LED_NIGHT_PCT);
+
+    for (int led = SPEED_1; led <= SPEED_4; led++)
     {
-        case SPEED_OFF:
-            /* Simply return, don't turn any back on */
-            return;
-        case SPEED_1:
-            gpio_num = FAN_SPEED1_LED_GPIO;
-            break;
-        case SPEED_2:
-            gpio_num = FAN_SPEED2_LED_GPIO;
-            break;
-        case SPEED_3:
-            gpio_num = FAN_SPEED3_LED_GPIO;
-            break;
-        case SPEED_4:
-            gpio_num = FAN_SPEED4_LED_GPIO;
-            break;
-        default:
-            ESP_LOGW(TAG, "Invalid speed provided, leaving all off...");
-            return;
+        if (NO_CHANNEL != speed_channels[fan][led])
+        {
+            fade_to(speed_channels[fan][led], (led == (int) speed) ? duty : 0);
+        }
     }
 
-    /* Turn on the LED associated with the provided speed */
-    gpio_set_level(gpio_num, GPIO_HIGH);
+    const uint32_t *masks  = speed_masks[fan];
+    uint32_t        target = (duty) ? masks[speed] : 0;
+
+    /* Turn on the LED associated with the provided speed, clear the others */
+    REG_WRITE(GPIO_OUT_W1TS_REG, target);
+    REG_WRITE(GPIO_OUT_W1TC_REG, (masks[SPEED_1] | masks[SPEED_2] | masks[SPEED_3] | masks[SPEED_4]) & ~target);
+}
+
+/**
+ * @brief Set the duty of the builtin LED.
+ * @param duty Duty to set
+ */
+static void builtin_set_duty(uint32_t duty)
+{
+    ledc_set_duty(BUILTIN_LED_SPEED_MODE, BUILTIN_LED_CHANNEL, duty);
+    ledc_update_duty(BUILTIN_LED_SPEED_MODE, BUILTIN_LED_CHANNEL);
 }
 
 /**
@@ -122,7 +222,48 @@ void Led_write_speed(enum State_speed speed)
  */
 void Led_write_builtin(bool state)
 {
-    gpio_set_level(FAN_BUILTIN_LED_GPIO, (state) ? GPIO_HIGH : GPIO_LOW);
+    builtin_state = state;
+
+    /* Identify owns the LED until it's done, then restores this state */
+    if (!identifying)
+    {
+        builtin_set_duty((state) ? BUILTIN_LED_DUTY_ON : 0);
+    }
+}
+
+/**
+ * @brief Timer callback ending the identify blink.
+ * @param args [in] Unused
+ */
+static void identify_done(void *args)
+{
+    UNUSED_PARAM(args);
+
+    identifying = false;
+    builtin_set_duty((builtin_state) ? BUILTIN_LED_DUTY_ON : 0);
+}
+
+/**
+ * @brief   Blink the builtin LED so the user can find the accessory.
+ * @details Returns right away, the blink is timed by the LEDC peripheral and
+ *          stops on its own after CONFIG_FAN_IDENTIFY_DURATION_MS. Identifying
+ *          again while blinking starts the duration over.
+ */
+void Led_identify(void)
+{
+    if (NULL == identify_timer)
+    {
+        return;
+    }
+
+    (void) esp_timer_stop(identify_timer);
+    identifying = true;
+
+    /* Start the period over, so the first blink is right away */
+    ledc_timer_rst(BUILTIN_LED_SPEED_MODE, BUILTIN_LED_TIMER);
+    builtin_set_duty(BUILTIN_LED_DUTY_BLINK);
+
+    ESP_ERROR_CHECK(esp_timer_start_once(identify_timer, (uint64_t) CONFIG_FAN_IDENTIFY_DURATION_MS * 1000));
 }
 
 /**
@@ -131,13 +272,93 @@ void Led_write_builtin(bool state)
  */
 void Led_init(void)
 {
-    for (int i = 0; i < NUM_TOTAL_LED; i++)
+    ledc_timer_config_t speed_timer_cfg = {
+        .speed_mode      = LEDC_LOW_SPEED_MODE,
+        .duty_resolution = SPEED_LED_RESOLUTION,
+        .timer_num       = SPEED_LED_TIMER,
+        .freq_hz         = SPEED_LED_FREQ_HZ,
+        .clk_cfg         = LEDC_AUTO_CLK,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&speed_timer_cfg));
+    ESP_ERROR_CHECK(ledc_fade_func_install(0));
+
+    /* Give each speed LED a channel while they last, then build the bank masks from the rest */
+    int channel    = SPEED_LED_FIRST_CHANNEL;
+    speed_led_mask = 0;
+    for (int fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        speed_masks[fan][SPEED_OFF]    = 0;
+        speed_channels[fan][SPEED_OFF] = NO_CHANNEL;
+        for (int speed = SPEED_1; speed <= SPEED_4; speed++)
+        {
+            gpio_num_t gpio = g_Fan_gpio_maps[fan].speed_led[speed - SPEED_1];
+
+            speed_masks[fan][speed]    = 0;
+            speed_channels[fan][speed] = NO_CHANNEL;
+            if (GPIO_NUM_NC != gpio && channel < LEDC_CHANNEL_MAX)
+            {
+                ledc_channel_config_t speed_channel_cfg = {
+                    .gpio_num   = gpio,
+                    .speed_mode = LEDC_LOW_SPEED_MODE,
+                    .channel    = (ledc_channel_t) channel,
+                    .intr_type  = LEDC_INTR_DISABLE,
+                    .timer_sel  = SPEED_LED_TIMER,
+                    .duty       = 0,
+                    .hpoint     = 0,
+                };
+                ESP_ERROR_CHECK(ledc_channel_config(&speed_channel_cfg));
+                speed_channels[fan][speed] = (int8_t) channel++;
+                continue;
+            }
+
+            speed_masks[fan][speed] = pin_mask(gpio);
+            speed_led_mask         |= speed_masks[fan][speed];
+        }
+    }
+
+    /* Start with every LED off */
+    REG_WRITE(GPIO_OUT_W1TC_REG, speed_led_mask);
+
+    gpio_config_t led_cfg = {
+        .pin_bit_mask = speed_led_mask,
+        .mode         = GPIO_MODE_OUTPUT,
+        .pull_up_en   = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_DISABLE,
+    };
+    if (0 != speed_led_mask)
     {
-        esp_rom_gpio_pad_select_gpio(leds[i]);
-        gpio_set_direction(leds[i], GPIO_MODE_OUTPUT);
-        gpio_set_level(leds[i], GPIO_LOW);
+        ESP_ERROR_CHECK(gpio_config(&led_cfg));
     }
 
+    /* The builtin LED timer runs at the identify rate the whole time */
+    ledc_timer_config_t timer_cfg = {
+        .speed_mode      = BUILTIN_LED_SPEED_MODE,
+        .duty_resolution = BUILTIN_LED_RESOLUTION,
+        .timer_num       = BUILTIN_LED_TIMER,
+        .freq_hz         = CONFIG_FAN_IDENTIFY_BLINK_HZ,
+        .clk_cfg         = LEDC_AUTO_CLK,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer_cfg));
+
+    ledc_channel_config_t channel_cfg = {
+        .gpio_num   = FAN_BUILTIN_LED_GPIO,
+        .speed_mode = BUILTIN_LED_SPEED_MODE,
+        .channel    = BUILTIN_LED_CHANNEL,
+        .intr_type  = LEDC_INTR_DISABLE,
+        .timer_sel  = BUILTIN_LED_TIMER,
+        .duty       = 0,
+        .hpoint     = 0,
+    };
+    ESP_ERROR_CHECK(ledc_channel_config(&channel_cfg));
+
+    const esp_timer_create_args_t timer_args = {
+        .callback        = identify_done,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "identify",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &identify_timer));
+
     /* Start with LEDs enabled */
     g_Led_enable = true;
 
@@ -12,6 +12,7 @@
 #define LED_H
 
 #include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
 
 #include "main.h"
 
@@ -20,8 +21,9 @@ extern bool g_Led_enable;
 
 /** Public functions for the LED component */
 void Led_write_enable(bool enable);
-void Led_write_speed(enum State_speed speed);
+void Led_write_speed(uint8_t fan, enum State_speed speed);
 void Led_write_builtin(bool state);
+void Led_identify(void);
 void Led_init(void);
 
 #endif /* LED_H */
@@ -0,0 +1,553 @@
+/**
+ * @file link.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to link satellite fans to a bridge over ESP-NOW.
+ *
+ * In bridge mode every fan shows up in HomeKit, but only the first one is wired
+ * to the bridge itself. The others can be satellites: boards that only drive
+ * their own relays, LEDs, buttons and IR remote, and talk to the bridge over
+ * ESP-NOW. A satellite never associates with the access point or runs the HAP
+ * stack, so it is controllable a few mSec after reset and does no DHCP, mDNS
+ * or session crypto.
+ *
+ * Frames are a handful of bytes, holding the whole state of one fan. The bridge
+ * sends a command frame whenever HomeKit, the sleep timer or a schedule changes
+ * a satellite fan, and the satellite sends a state frame back whenever its own
+ * state changes, including from a command. Both ends feed the frames into the
+ * event queue as SOURCE_LINK events, which set values outright like HomeKit
+ * does. The satellite is the one switching the relays, so what it reports
+ * always wins, and the bridge reports it on to HomeKit.
+ *
+ * A satellite finds its bridge by broadcasting hello frames, hopping from
+ * CONFIG_FAN_LINK_CHANNEL through every channel until the bridge (which sits
+ * on the channel of its access point) welcomes it. It then keeps sending hello
+ * frames, directly to the bridge, every LINK_KEEPALIVE_MS. The hello carries
+ * the satellite state, so the bridge catches up after either end reboots. If
+ * frames to the bridge keep failing, the satellite goes back to hopping.
+ *
+ * The link is not encrypted or authenticated, so like the IR remote it can be
+ * driven by anything in radio range that knows the frame format.
+ *
+ * @addtogroup Link
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <string.h>            /* For memory/string-related functions */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+
+#if defined(CONFIG_FAN_LINK_BRIDGE) || defined(CONFIG_FAN_LINK_SATELLITE)
+#define LINK_ENABLED 1
+#include <esp_now.h>           /* ESP-NOW connectionless Wi-Fi */
+#include <esp_wifi.h>          /* Wi-Fi channel and radio setup */
+#include <esp_event.h>         /* Default event loop for the Wi-Fi driver */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Definitions for creating tasks */
+#include <freertos/queue.h>    /* Definitions for inter-task queues */
+#endif
+
+#include "main.h"
+#include "link.h"
+#include "event_queue.h"
+
+#ifdef LINK_ENABLED
+/** Arguments for creating the link task, which only handles discovery */
+#define LINK_HANDLER_NAME      "LinkHandler"
+#define LINK_HANDLER_STACKSIZE       3 * 1024
+#define LINK_HANDLER_PRIORITY  2
+
+/** Number of discovery frames waiting for the link task */
+#define LINK_QUEUE_LENGTH      4
+
+/** First byte of every frame, to tell ours apart */
+#define LINK_MAGIC             0xFA
+
+/** Time (in mSec) a satellite waits for a welcome on each channel */
+#define LINK_HELLO_MS          50
+
+/** Time (in mSec) between hello frames once a satellite is linked */
+#define LINK_KEEPALIVE_MS      5000
+
+/** Failed sends in a row before a peer is considered gone */
+#define LINK_MAX_FAILURES      3
+
+/** Highest Wi-Fi channel a satellite hops to */
+#define LINK_NUM_CHANNELS      13
+
+/** Enum for the types of link frames */
+enum Link_frame_type
+{
+    LINK_FRAME_HELLO = 0, /** Satellite looking for, or keeping up with, its bridge */
+    LINK_FRAME_WELCOME,   /** Bridge answering a hello */
+    LINK_FRAME_COMMAND,   /** Bridge setting the state of a satellite */
+    LINK_FRAME_STATE,     /** Satellite reporting its state */
+};
+
+/** Struct for a frame on the link, the whole state of one fan */
+typedef struct __attribute__((packed)) Link_frame_t
+{
+    uint8_t magic;     /** LINK_MAGIC */
+    uint8_t type;      /** Link_frame_type */
+    uint8_t fan;       /** Fan index at the bridge */
+    uint8_t on;        /** Whether the fan is spinning */
+    uint8_t oscillate; /** Whether oscillation is enabled */
+    uint8_t speed;     /** Speed level */
+    uint8_t timer;     /** Sleep timer setting */
+} Link_frame_t;
+
+/** Struct for a discovery frame handed to the link task */
+typedef struct Link_rx_t
+{
+    uint8_t      mac[ESP_NOW_ETH_ALEN]; /** Sender of the frame */
+    Link_frame_t frame;                 /** Frame received */
+} Link_rx_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Link";
+
+/** Address hello frames are broadcast to */
+static const uint8_t broadcast_mac[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+/** Discovery frames for the link task */
+static QueueHandle_t rx_queue;
+
+#ifdef CONFIG_FAN_LINK_BRIDGE
+/** Address of the satellite driving each fan */
+static uint8_t satellite_macs[FAN_NUM_FANS][ESP_NOW_ETH_ALEN];
+
+/** Whether each fan has a satellite */
+static volatile bool linked[FAN_NUM_FANS];
+
+/** Failed sends in a row to each satellite */
+static uint8_t failures[FAN_NUM_FANS];
+#else
+/** Address of our bridge, once welcomed */
+static uint8_t bridge_mac[ESP_NOW_ETH_ALEN];
+
+/** Whether we have been welcomed by the bridge */
+static volatile bool locked;
+
+/** Failed sends in a row to the bridge */
+static uint8_t failures;
+
+/** Channel currently being tried, or the one the bridge is on */
+static uint8_t channel = CONFIG_FAN_LINK_CHANNEL;
+#endif
+
+/**
+ * @brief Fill in a frame with the state of a fan.
+ * @param frame [out] Frame to fill in
+ * @param type  Link_frame_type of the frame
+ * @param fan   Fan index at the bridge
+ * @param state [in] State of the fan
+ */
+static void fill_frame(Link_frame_t *frame, enum Link_frame_type type, uint8_t fan, const Fan_state_t *state)
+{
+    frame->magic     = LINK_MAGIC;
+    frame->type      = (uint8_t) type;
+    frame->fan       = fan;
+    frame->on        = (uint8_t) state->on;
+    frame->oscillate = (uint8_t) state->oscillate;
+    frame->speed     = (uint8_t) state->speed;
+    frame->timer     = (uint8_t) state->timer;
+}
+
+/**
+ * @brief   Send the state in a frame to the event handler.
+ * @details Power goes first, as the timer only sticks while the fan is on.
+ * @param   fan   Local fan the state is for
+ * @param   frame [in] Frame holding the state
+ */
+static void post_state(uint8_t fan, const Link_frame_t *frame)
+{
+    const Fan_event_t events[] = {
+        { .source = SOURCE_LINK, .id = ID_POWER,     .fan = fan, .arg = frame->on },
+        { .source = SOURCE_LINK, .id = ID_OSCILLATE, .fan = fan, .arg = frame->oscillate },
+        { .source = SOURCE_LINK, .id = ID_SPEED,     .fan = fan, .arg = frame->speed },
+        { .source = SOURCE_LINK, .id = ID_TIME,      .fan = fan, .arg = frame->timer },
+    };
+    int64_t now_us = esp_timer_get_time();
+
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+    {
+        Fan_event_t event  = events[i];
+        event.timestamp_us = now_us;
+
+        if (!Event_queue_send(&event))
+        {
+            ESP_LOGW(TAG, "Event queue full, dropping event");
+        }
+    }
+}
+
+/**
+ * @brief  Add an ESP-NOW peer on whatever channel the radio is on.
+ * @param  mac [in] Address of the peer
+ * @return ESP_OK if the peer was added or already known.
+ */
+static esp_err_t add_peer(const uint8_t *mac)
+{
+    esp_now_peer_info_t peer = {
+        .channel = 0,
+        .ifidx   = WIFI_IF_STA,
+        .encrypt = false,
+    };
+
+    if (esp_now_is_peer_exist(mac))
+    {
+        return ESP_OK;
+    }
+
+    memcpy(peer.peer_addr, mac, ESP_NOW_ETH_ALEN);
+    return esp_now_add_peer(&peer);
+}
+
+/**
+ * @brief   ESP-NOW receive callback.
+ * @details Runs in the Wi-Fi task, so commands and states go straight to the
+ *          event queue and only discovery is left to the link task.
+ * @param   info [in] Sender of the frame
+ * @param   data [in] Frame received
+ * @param   len  Length of the frame
+ */
+static void recv_callback(const esp_now_recv_info_t *info, const uint8_t *data, int len)
+{
+    Link_rx_t rx;
+
+    if (sizeof(Link_frame_t) != len)
+    {
+        return;
+    }
+
+    memcpy(rx.mac, info->src_addr, ESP_NOW_ETH_ALEN);
+    memcpy(&rx.frame, data, sizeof(rx.frame));
+    if (LINK_MAGIC != rx.frame.magic)
+    {
+        return;
+    }
+
+#ifdef CONFIG_FAN_LINK_BRIDGE
+    uint8_t fan = rx.frame.fan;
+
+    if (LINK_FRAME_STATE == rx.frame.type)
+    {
+        /* Only from the satellite that said hello for that fan */
+        if (fan > 0 && fan < FAN_NUM_FANS && linked[fan] &&
+            0 == memcmp(rx.mac, satellite_macs[fan], ESP_NOW_ETH_ALEN))
+        {
+            post_state(fan, &rx.frame);
+        }
+    }
+    else if (LINK_FRAME_HELLO == rx.frame.type)
+    {
+        (void) xQueueSend(rx_queue, &rx, 0);
+    }
+#else
+    if (rx.frame.fan != CONFIG_FAN_LINK_SATELLITE_FAN)
+    {
+        /* For another satellite */
+        return;
+    }
+
+    if (LINK_FRAME_COMMAND == rx.frame.type)
+    {
+        if (locked && 0 == memcmp(rx.mac, bridge_mac, ESP_NOW_ETH_ALEN))
+        {
+            post_state(0, &rx.frame);
+        }
+    }
+    else if (LINK_FRAME_WELCOME == rx.frame.type)
+    {
+        (void) xQueueSend(rx_queue, &rx, 0);
+    }
+#endif
+}
+
+/**
+ * @brief   ESP-NOW send callback.
+ * @details Counts failed sends to each peer, and gives up on a peer after
+ *          LINK_MAX_FAILURES in a row.
+ * @param   mac    [in] Peer the frame was sent to
+ * @param   status Whether the peer acknowledged the frame
+ */
+static void send_callback(const uint8_t *mac, esp_now_send_status_t status)
+{
+#ifdef CONFIG_FAN_LINK_BRIDGE
+    for (uint8_t fan = 1; fan < FAN_NUM_FANS; fan++)
+    {
+        if (!linked[fan] || 0 != memcmp(mac, satellite_macs[fan], ESP_NOW_ETH_ALEN))
+        {
+            continue;
+        }
+
+        if (ESP_NOW_SEND_SUCCESS == status)
+        {
+            failures[fan] = 0;
+        }
+        else if (++failures[fan] >= LINK_MAX_FAILURES)
+        {
+            /* The satellite will say hello again once it is back */
+            linked[fan] = false;
+            ESP_LOGW(TAG, "Lost the satellite for fan %u", (unsigned) fan);
+        }
+    }
+#else
+    if (!locked || 0 != memcmp(mac, bridge_mac, ESP_NOW_ETH_ALEN))
+    {
+        return;
+    }
+
+    if (ESP_NOW_SEND_SUCCESS == status)
+    {
+        failures = 0;
+    }
+    else if (++failures >= LINK_MAX_FAILURES)
+    {
+        /* The bridge may have moved channel with its access point, go find it */
+        locked = false;
+        ESP_LOGW(TAG, "Lost the bridge, searching");
+    }
+#endif
+}
+
+#ifdef CONFIG_FAN_LINK_BRIDGE
+/**
+ * @brief Take on the satellite that sent a hello.
+ * @param rx [in] Hello frame and its sender
+ */
+static void handle_hello(const Link_rx_t *rx)
+{
+    uint8_t      fan = rx->frame.fan;
+    Link_frame_t welcome;
+
+    if (0 == fan || fan >= FAN_NUM_FANS)
+    {
+        ESP_LOGW(TAG, "Hello for unknown fan %u", (unsigned) fan);
+        return;
+    }
+
+    if (0 != memcmp(rx->mac, satellite_macs[fan], ESP_NOW_ETH_ALEN))
+    {
+        /* A new board for this fan, forget the old one */
+        (void) esp_now_del_peer(satellite_macs[fan]);
+        memcpy(satellite_macs[fan], rx->mac, ESP_NOW_ETH_ALEN);
+        linked[fan] = false;
+    }
+
+    if (ESP_OK != add_peer(rx->mac))
+    {
+        ESP_LOGW(TAG, "No room for the satellite for fan %u", (unsigned) fan);
+        return;
+    }
+
+    if (!linked[fan])
+    {
+        ESP_LOGI(TAG, "Satellite " MACSTR " drives fan %u", MAC2STR(rx->mac), (unsigned) fan);
+    }
+    failures[fan] = 0;
+    linked[fan]   = true;
+
+    Fan_state_t state;
+    Fan_state_snapshot(fan, &state);
+    fill_frame(&welcome, LINK_FRAME_WELCOME, fan, &state);
+    (void) esp_now_send(rx->mac, (const uint8_t *) &welcome, sizeof(welcome));
+
+    /* The satellite knows best what its fan is doing */
+    post_state(fan, &rx->frame);
+}
+#else
+/**
+ * @brief Send a hello carrying our state, to the bridge or to everyone.
+ * @param mac [in] Bridge, or broadcast_mac while searching
+ */
+static void send_hello(const uint8_t *mac)
+{
+    Link_frame_t hello;
+    Fan_state_t  state;
+
+    Fan_state_snapshot(0, &state);
+    fill_frame(&hello, LINK_FRAME_HELLO, CONFIG_FAN_LINK_SATELLITE_FAN, &state);
+    (void) esp_now_send(mac, (const uint8_t *) &hello, sizeof(hello));
+}
+
+/**
+ * @brief Lock on to the bridge that welcomed us.
+ * @param rx [in] Welcome frame and its sender
+ */
+static void handle_welcome(const Link_rx_t *rx)
+{
+    if (locked)
+    {
+        /* Answer to a keepalive */
+        return;
+    }
+
+    memcpy(bridge_mac, rx->mac, ESP_NOW_ETH_ALEN);
+    if (ESP_OK != add_peer(bridge_mac))
+    {
+        ESP_LOGW(TAG, "Failed to add the bridge as a peer");
+        return;
+    }
+
+    failures = 0;
+    locked   = true;
+    ESP_LOGI(TAG, "Linked to bridge " MACSTR " on channel %u", MAC2STR(bridge_mac), (unsigned) channel);
+    Boot_log_phase("linked to bridge");
+}
+#endif /* CONFIG_FAN_LINK_BRIDGE */
+
+/**
+ * @brief Link FreeRTOS task, handles discovery.
+ * @param p [in] Required FreeRTOS parameter (UNUSED)
+ */
+static void Link_task(void *p)
+{
+    Link_rx_t rx;
+
+    UNUSED_PARAM(p);
+
+    while (true)
+    {
+#ifdef CONFIG_FAN_LINK_BRIDGE
+        if (pdTRUE == xQueueReceive(rx_queue, &rx, portMAX_DELAY))
+        {
+            handle_hello(&rx);
+        }
+#else
+        if (!locked)
+        {
+            /* Try the next channel for the bridge */
+            (void) esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+            send_hello(broadcast_mac);
+
+            if (pdTRUE == xQueueReceive(rx_queue, &rx, pdMS_TO_TICKS(LINK_HELLO_MS)))
+            {
+                handle_welcome(&rx);
+            }
+            else
+            {
+                channel = (channel % LINK_NUM_CHANNELS) + 1;
+            }
+        }
+        else if (pdTRUE == xQueueReceive(rx_queue, &rx, pdMS_TO_TICKS(LINK_KEEPALIVE_MS)))
+        {
+            handle_welcome(&rx);
+        }
+        else
+        {
+            /* Quiet for a while, make sure the bridge is still there */
+            send_hello(bridge_mac);
+        }
+#endif
+    }
+}
+
+#ifdef CONFIG_FAN_LINK_SATELLITE
+/**
+ * @brief Bring the radio up for ESP-NOW only, without associating.
+ */
+static void start_radio(void)
+{
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+}
+#endif
+#endif /* LINK_ENABLED */
+
+/**
+ * @brief   Send the state of a fan over the link.
+ * @details On a bridge, commands the satellite driving the fan, if it has one.
+ *          On a satellite, reports the state to the bridge, if linked. Does
+ *          nothing without a link role.
+ * @param   fan   Local fan the state is for
+ * @param   state [in] State to send
+ */
+void Link_send_state(uint8_t fan, const Fan_state_t *state)
+{
+#if defined(CONFIG_FAN_LINK_BRIDGE)
+    Link_frame_t frame;
+
+    if (fan >= FAN_NUM_FANS || !linked[fan])
+    {
+        return;
+    }
+
+    fill_frame(&frame, LINK_FRAME_COMMAND, fan, state);
+    if (ESP_OK != esp_now_send(satellite_macs[fan], (const uint8_t *) &frame, sizeof(frame)))
+    {
+        ESP_LOGW(TAG, "Failed to send a command for fan %u", (unsigned) fan);
+    }
+#elif defined(CONFIG_FAN_LINK_SATELLITE)
+    Link_frame_t frame;
+
+    UNUSED_PARAM(fan);
+    if (!locked)
+    {
+        /* The next hello carries it */
+        return;
+    }
+
+    fill_frame(&frame, LINK_FRAME_STATE, CONFIG_FAN_LINK_SATELLITE_FAN, state);
+    if (ESP_OK != esp_now_send(bridge_mac, (const uint8_t *) &frame, sizeof(frame)))
+    {
+        ESP_LOGW(TAG, "Failed to send our state");
+    }
+#else
+    UNUSED_PARAM(fan);
+    UNUSED_PARAM(state);
+#endif
+}
+
+/**
+ * @brief   Initializer for the Link component.
+ * @details A bridge needs Wi-Fi started, so call after HomeKit_init(). A
+ *          satellite brings up the radio itself. Does nothing without a link
+ *          role.
+ */
+void Link_init(void)
+{
+#ifdef LINK_ENABLED
+#ifdef CONFIG_FAN_LINK_SATELLITE
+    start_radio();
+#endif
+
+    rx_queue = xQueueCreate(LINK_QUEUE_LENGTH, sizeof(Link_rx_t));
+
+    esp_err_t err = esp_now_init();
+    if (ESP_OK != err)
+    {
+        ESP_LOGE(TAG, "Failed to start ESP-NOW: %s", esp_err_to_name(err));
+        return;
+    }
+
+    ESP_ERROR_CHECK(esp_now_register_recv_cb(recv_callback));
+    ESP_ERROR_CHECK(esp_now_register_send_cb(send_callback));
+
+#ifdef CONFIG_FAN_LINK_SATELLITE
+    /* Hello frames are broadcast until the bridge answers */
+    ESP_ERROR_CHECK(add_peer(broadcast_mac));
+#endif
+
+    (void) xTaskCreate(
+        Link_task,
+        LINK_HANDLER_NAME,
+        LINK_HANDLER_STACKSIZE,
+        NULL,
+        LINK_HANDLER_PRIORITY,
+        NULL);
+
+    ESP_LOGI(TAG, "Link component init!");
+#endif /* LINK_ENABLED */
+}
+
+/** @} end Link */
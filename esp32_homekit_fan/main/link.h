@@ -0,0 +1,24 @@
+/**
+ * @file link.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to link satellite fans to a bridge over ESP-NOW.
+ *
+ * @addtogroup Link
+ * @{
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <stdint.h> /* Extended integer types */
+
+#include "main.h"   /* Fan_state_t */
+
+/** Public functions for the Link component */
+void Link_send_state(uint8_t fan, const Fan_state_t *state);
+void Link_init(void);
+
+#endif /* LINK_H */
+
+/** @} end Link */
@@ -13,40 +13,170 @@
  */
 
 #include <stdbool.h>           /* Boolean type */
+#include <inttypes.h>          /* Format macros for extended integers */
 
 #include <esp_log.h>           /* ESP logging functions */
+#include <esp_system.h>        /* Free heap size */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <driver/gpio.h>       /* Shared GPIO interrupt service */
 #include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
 #include <freertos/task.h>     /* Definitions for creating tasks */
-#include <freertos/queue.h>    /* Definitions for inter-task queues */
+
+#include <app_wifi.h>          /* For waiting on the WiFi connection */
 
 #include "main.h"
 #include "relay.h"
+#include "phase.h"
 #include "led.h"
 #include "button.h"
 #include "remote.h"
 #include "homekit.h"
 #include "event_handlers.h"
+#include "event_queue.h"
+#include "latency.h"
+#include "storage.h"
+#include "sleep_timer.h"
+#include "schedule.h"
+#include "power.h"
+#include "telemetry.h"
+#include "benchmark.h"
+#include "watchdog.h"
+#include "link.h"
+#include "udp_control.h"
+#include "mqtt.h"
+#include "auto_speed.h"
+#include "journal.h"
+#include "warm_boot.h"
+#include "event_bench.h"
+#include "energy.h"
+#include "thread_net.h"
 
 /** Arguments for creating the main event handler task */
 #define EVENT_HANDLER_NAME      "EventHandler"
 #define EVENT_HANDLER_STACKSIZE       4 * 1024
-#define EVENT_HANDLER_PRIORITY               1
+#define EVENT_HANDLER_PRIORITY  FAN_IO_PRIORITY
+
+/** Arguments for the task setting up inputs on the fan I/O core */
+#define INPUT_INIT_NAME         "InputInit"
+#define INPUT_INIT_STACKSIZE          4 * 1024
+
+#ifdef CONFIG_FAN_STATIC_ALLOCATION
+/** Stack and TCB of the event handler task, which never exits */
+static StackType_t  event_handler_stack[EVENT_HANDLER_STACKSIZE];
+static StaticTask_t event_handler_tcb;
+#endif
+
+/** Global current state of each fan */
+Fan_state_t g_Fan_state[FAN_NUM_FANS];
 
-/** Global current state of the fan */
-Fan_state_t g_Fan_state;
+/** Sequence count of each fan's state, odd while it is being written */
+static uint32_t state_seq[FAN_NUM_FANS];
 
-/** Global queue to hold incoming control events */
-QueueHandle_t g_Fan_event_queue;
+/** Keeps a reader on the same core from preempting a write halfway */
+static portMUX_TYPE state_write_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** Output pins of each fan, only the first is wired up on the stock board */
+const Fan_gpio_map_t g_Fan_gpio_maps[FAN_NUM_FANS] = {
+    {
+        .speed_relay = { FAN_SPEED1_RELAY_GPIO, FAN_SPEED2_RELAY_GPIO, FAN_SPEED3_RELAY_GPIO, FAN_SPEED4_RELAY_GPIO },
+        .osc_relay   = FAN_OSC_RELAY_GPIO,
+        .speed_led   = { FAN_SPEED1_LED_GPIO, FAN_SPEED2_LED_GPIO, FAN_SPEED3_LED_GPIO, FAN_SPEED4_LED_GPIO },
+    },
+#if FAN_NUM_FANS > 1
+    /* Fill in the pins for boards wiring up more fans, unwired fans only show in HomeKit */
+    [1 ... FAN_NUM_FANS - 1] = {
+        .speed_relay = { GPIO_NUM_NC, GPIO_NUM_NC, GPIO_NUM_NC, GPIO_NUM_NC },
+        .osc_relay   = GPIO_NUM_NC,
+        .speed_led   = { GPIO_NUM_NC, GPIO_NUM_NC, GPIO_NUM_NC, GPIO_NUM_NC },
+    },
+#endif
+};
 
 /** Tag used for ESP logging */
 static const char *TAG = "Main";
 
+/** Time (in uSec) of the previously logged boot phase */
+static int64_t prev_phase_us;
+
+/**
+ * @brief   Log a boot phase along with when it was reached.
+ * @details Gives a timeline of startup in the log, with the time since reset,
+ *          the time spent since the previous phase and the free heap. Handy for
+ *          spotting startup regressions, tools/perf_report.py reads these lines.
+ * @param   phase [in] Name of the phase that was just reached
+ */
+void Boot_log_phase(const char *phase)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Boot phase \"%s\" at %" PRId64 " ms (+%" PRId64 " ms), heap free %" PRIu32,
+             phase, now_us / 1000, (now_us - prev_phase_us) / 1000, esp_get_free_heap_size());
+
+    prev_phase_us = now_us;
+}
+
+/**
+ * @brief   Commit a new state of a fan to g_Fan_state.
+ * @details Only the event handler task writes the states, so writes don't need
+ *          to exclude one another. The sequence count goes odd for the length
+ *          of the write, which is what tells readers to try again. The write
+ *          is short and can't be preempted, so a reader of higher priority on
+ *          the same core never spins waiting for it.
+ * @param   fan   Fan the state is for
+ * @param   state [in] New state, committed with no dirty flags
+ */
+void Fan_state_commit(uint8_t fan, const Fan_state_t *state)
+{
+    portENTER_CRITICAL(&state_write_lock);
+
+    __atomic_store_n(&state_seq[fan], state_seq[fan] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    g_Fan_state[fan]       = *state;
+    g_Fan_state[fan].dirty = 0;
+
+    __atomic_store_n(&state_seq[fan], state_seq[fan] + 1, __ATOMIC_RELEASE);
+
+    portEXIT_CRITICAL(&state_write_lock);
+}
+
+/**
+ * @brief   Take a consistent copy of the state of a fan.
+ * @details For any task other than the event handler, which can read
+ *          g_Fan_state directly. Never blocks the writer, the copy is just
+ *          taken again if a write overlapped it.
+ * @param   fan   Fan to read
+ * @param   state [out] Copy of the state
+ * @return  Version of the state, which goes up with every commit.
+ */
+uint32_t Fan_state_snapshot(uint8_t fan, Fan_state_t *state)
+{
+    for (;;)
+    {
+        uint32_t begin = __atomic_load_n(&state_seq[fan], __ATOMIC_ACQUIRE);
+        if (0 == (begin & 1))
+        {
+            *state = g_Fan_state[fan];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (begin == __atomic_load_n(&state_seq[fan], __ATOMIC_RELAXED))
+            {
+                return begin >> 1;
+            }
+        }
+    }
+}
+
 /**
  * @brief   Event handler FreeRTOS task for the fan.
- * @details The initialization task sets up a FreeRTOS queue that this task
- *          reads from. This task is in charge of polling the queue for incoming
- *          events. When an event is received, it is sorted based on its source
- *          ID and then passed off to an appropriate handler in event_handlers.c
+ * @details The initialization task sets up the event queue that this task
+ *          reads from. This task is in charge of waiting on the queue for incoming
+ *          events. When an event is received, it is passed off to the transition
+ *          table in event_handlers.c
+ *
+ *          Any other events already waiting in the queue are folded into the
+ *          same target state before anything is applied, so a burst of events
+ *          results in a single transition to the net state. When bridging,
+ *          each fan has its own target.
  *
  *          Note that while handling an event the task will light up the built-
  *          in LED on the ESP32.
@@ -56,99 +186,346 @@ static void Lasko_event_handler(void *p)
 {
     UNUSED_PARAM(p);
 
+    Watchdog_subscribe(WATCHDOG_EVENT_HANDLER);
+
     /* Enter a while(1) loop to handle things in the queue */
     while (true)
     {
         Fan_event_t event;
 
-        if (!xQueueReceive(g_Fan_event_queue, &event, portMAX_DELAY))
+        if (!Event_queue_receive(&event, Watchdog_wait_ticks()))
         {
-            /* No new events, keep waiting */
+            /* No new events, check in and keep waiting */
+            Watchdog_feed(WATCHDOG_EVENT_HANDLER);
             continue;
         }
 
         /* Received an event! */
+        Watchdog_begin(WATCHDOG_EVENT_HANDLER, (int) event.source, (int) event.id);
 
         Led_write_builtin(true);
-        
-        /* Acquire the lock */
-        g_Fan_event_lock = true;
 
-        switch (event.source)
+        /* Fold this event, and any others pending, into one target state per fan */
+        Fan_state_t target[FAN_NUM_FANS];
+        uint8_t     changed[FAN_NUM_FANS] = { 0 };
+        bool        report[FAN_NUM_FANS]  = { false };
+        bool        forward[FAN_NUM_FANS] = { false };
+        int64_t     dequeued_us[NUM_SOURCE] = { 0 };
+        for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
         {
-            case SOURCE_HOMEKIT:
-                handle_homekit(&event);
-                break;
-            case SOURCE_BUTTON:
-                handle_button(&event);
-                break;
-            case SOURCE_REMOTE:
-                handle_remote(&event);
-                break;
-            default:
-                ESP_LOGW(TAG, "Unknown event source");
-                break;
+            target[fan] = g_Fan_state[fan];
         }
+        do
+        {
+            int64_t now_us = esp_timer_get_time();
 
-        /* Update the front-fascia LEDs with any changes */
-        Led_write_speed((g_Fan_state.on) ? g_Fan_state.speed : SPEED_OFF);
+            if (event.fan >= FAN_NUM_FANS)
+            {
+                ESP_LOGW(TAG, "Dropping event %d for unknown fan %u", (int) event.id, (unsigned) event.fan);
+                continue;
+            }
 
-        Led_write_builtin(false);
+            /* Time spent waiting in the queue */
+            Latency_record(event.source, LATENCY_QUEUE, event.timestamp_us, now_us);
+            Event_bench_dequeued(&event);
+            if (event.source < NUM_SOURCE && 0 == dequeued_us[event.source])
+            {
+                dequeued_us[event.source] = now_us;
+            }
+
+            bool was_auto = target[event.fan].auto_mode;
+
+            changed[event.fan] ^= handle_event(&event, &target[event.fan]);
+            Journal_record(&event, &target[event.fan]);
+
+            /* Hardware-sourced changes need to be reported to HomeKit, as does
+               a HomeKit write knocking the fan out of auto mode */
+            report[event.fan] |= (SOURCE_HOMEKIT != event.source) ||
+                                 (ID_TEMPERATURE != event.id && was_auto != target[event.fan].auto_mode);
+
+            /* Anything but the satellite itself changing a fan goes out to it */
+            forward[event.fan] |= (SOURCE_LINK != event.source);
+        } while (Event_queue_receive(&event, 0));
+
+        /* Apply only the outputs that changed to the hardware */
+        int64_t actuated_us = 0;
+        bool    publish     = false;
+        for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+        {
+            changed[fan] |= diff_outputs(&g_Fan_state[fan], &target[fan]);
+            apply_state(fan, &target[fan], changed[fan], report[fan]);
+            if (target[fan].dirty)
+            {
+                publish = true;
+                Mqtt_publish_state(fan);
+            }
+#ifdef CONFIG_FAN_LINK_BRIDGE
+            if (forward[fan] && target[fan].dirty)
+            {
+                /* Satellite fans switch their own relays */
+                Link_send_state(fan, &g_Fan_state[fan]);
+            }
+#endif
 
-        /* Give time to settle before continuing, 250ms */
-        vTaskDelay(250 / portTICK_PERIOD_MS);
+            if (changed[fan] & (OUTPUT_SPEED | OUTPUT_OSCILLATE))
+            {
+                int64_t switch_us = Relay_get_last_switch_us(fan);
+                if (switch_us > actuated_us)
+                {
+                    actuated_us = switch_us;
+                }
+            }
+        }
+
+        if (publish)
+        {
+            /* Let local UDP listeners know too */
+            Udp_control_publish();
+        }
+        Event_bench_applied();
+
+        if (actuated_us)
+        {
+            /* Time from dequeue until the relays actually switched */
+            for (int source = 0; source < NUM_SOURCE; source++)
+            {
+                Latency_record(source, LATENCY_ACTUATION, dequeued_us[source], actuated_us);
+            }
+        }
 
-        /* Release the lock */
-        g_Fan_event_lock = false;
+        Led_write_builtin(false);
+        Watchdog_end(WATCHDOG_EVENT_HANDLER);
+
+        /* Only wait if a relay actually switched, and only as long as needed */
+        Relay_wait_settled();
     }
 }
 
+/**
+ * @brief   Installs the GPIO interrupt service shared by the input modules.
+ * @details Has to come before any of them, since the first install fixes the
+ *          flags for everyone and the rest just get ESP_ERR_INVALID_STATE.
+ *          With phase control the zero-cross handler needs IRAM and a high
+ *          level, so the button and IR wake handlers sharing the service are
+ *          IRAM_ATTR and only call GPIO/esp_timer functions kept in IRAM.
+ */
+static void input_isr_service_init(void)
+{
+#ifdef CONFIG_FAN_PHASE_CONTROL
+    ESP_ERROR_CHECK(gpio_install_isr_service(ESP_INTR_FLAG_IRAM | ESP_INTR_FLAG_LEVEL3));
+#else
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+#endif
+}
+
+#if FAN_IO_PINNED
+/**
+ * @brief   Sets up the input hardware from the fan I/O core.
+ * @details Interrupts are allocated on whichever core installs them, so the
+ *          button, zero-cross detector and IR receiver are initialized from
+ *          here to keep their ISRs on the I/O core. Notifies the caller when done.
+ * @param   p [in] Handle of the task to notify
+ */
+static void input_init_task(void *p)
+{
+    input_isr_service_init();
+    Button_init();
+    Phase_init();
+    Remote_init();
+
+    (void) xTaskNotifyGive((TaskHandle_t) p);
+    vTaskDelete(NULL);
+}
+#endif
+
 /**
  * @brief   Initialization FreeRTOS task for the project.
- * @details Initializes both hardware devices along with the HomeKit software
- *          library. Ends off by creating the event handler FreeRTOS task which
- *          will continue execution.
+ * @details Restores the last fan state, then initializes both hardware devices
+ *          along with the HomeKit software library. After a soft reset, the
+ *          relays are put back first, from the state mirrored in RTC memory,
+ *          before NVS is even up. The event queue and event handler task are created before
+ *          anything that can produce events, so the buttons and IR remote can
+ *          control the fan locally straight away, well before WiFi is up.
  *
- *          Note that the initialization order is intentional. The HomeKit
- *          library starts up the WiFi task which can cause crashes if a button
- *          or remote interrupt fires during startup. Thus, we startup HomeKit
- *          and give some time before initializing the button/remote.
+ *          HomeKit and WiFi then come up in the background. This task sticks
+ *          around only to log when the network becomes ready, giving a full
+ *          boot-phase timeline.
  */
 void app_main(void)
 {
-    /* Initialize the output hardware */
-    Relay_init();
-    Led_init();
+    Boot_log_phase("app_main");
 
-    /* Initialize the HomeKit component */
-    HomeKit_init();
+    /* Pick up the journal from before the reset, before any event is recorded */
+    Journal_init();
 
-    /* Give 10 seconds for the WiFi task to get going */
-    vTaskDelay((10 * 1000) / portTICK_PERIOD_MS);
+    /* Initialize the relays, everything starts off */
+    Fan_state_t restored[FAN_NUM_FANS];
+    bool        resumed[FAN_NUM_FANS] = { false };
+    bool        warm                  = Warm_boot_init();
+    Relay_init();
 
-    /* Initialize the input hardware */
-    Button_init();
-    Remote_init();
+    /* After a soft reset, ramp the motors back to what they were doing */
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        restored[fan] = (Fan_state_t) {
+            .on        = false,
+            .oscillate = false,
+            .speed     = SPEED_4,
+            .speed_pct = Speed_to_pct(SPEED_4),
+        };
+        resumed[fan] = Warm_boot_load(fan, &restored[fan]);
+        if (resumed[fan] && restored[fan].on)
+        {
+#ifdef CONFIG_FAN_PHASE_CONTROL
+            Phase_write_speed(fan, restored[fan].speed_pct);
+#else
+            Relay_write_speed(fan, restored[fan].speed);
+#endif
+            Relay_write_oscillate(fan, restored[fan].oscillate);
+        }
+    }
+    if (warm)
+    {
+        Boot_log_phase("relays resumed");
+    }
+
+    /* Otherwise restore the last saved state of the fan */
+    Storage_init();
+    Relay_load_cycles();
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        Fan_state_t saved = restored[fan];
+        if (Storage_load(fan, &saved) && !resumed[fan])
+        {
+            restored[fan] = saved;
+        }
+    }
 
-    /* Initialize the current state of the fan */
-    g_Fan_state.on = false;
-    g_Fan_state.oscillate = false;
-    g_Fan_state.speed = SPEED_4;
+    /* Initialize the rest of the output hardware */
+    Led_init();
+    Sleep_timer_init();
 
-    /* Create a FreeRTOS queue, alloc'ing space for 10 events in the queue */
-    g_Fan_event_queue = xQueueCreate(10, sizeof(Fan_event_t));
+    /* Bring the outputs up to the restored state */
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        apply_state(fan, &restored[fan], diff_outputs(&g_Fan_state[fan], &restored[fan]), false);
+        if (resumed[fan])
+        {
+            /* The saved state may be older than the one we resumed */
+            Storage_save_later(fan, &g_Fan_state[fan]);
+        }
+    }
 
-    /* Ready to receive events */
-    g_Fan_event_lock = false;
+    /* Start the task watchdog before anything subscribes to it */
+    Watchdog_init();
 
     /* Create our event handler task */
-    (void) xTaskCreate(
+#ifdef CONFIG_FAN_STATIC_ALLOCATION
+    TaskHandle_t event_task = xTaskCreateStaticPinnedToCore(
+        Lasko_event_handler,
+        EVENT_HANDLER_NAME,
+        EVENT_HANDLER_STACKSIZE,
+        NULL,
+        EVENT_HANDLER_PRIORITY,
+        event_handler_stack,
+        &event_handler_tcb,
+        FAN_IO_CORE_ID);
+#else
+    TaskHandle_t event_task = NULL;
+    (void) xTaskCreatePinnedToCore(
         Lasko_event_handler, 
         EVENT_HANDLER_NAME, 
         EVENT_HANDLER_STACKSIZE, 
         NULL, 
         EVENT_HANDLER_PRIORITY, 
-        NULL);
+        &event_task,
+        FAN_IO_CORE_ID);
+#endif
+
+    /* Point the event queue at the handler task */
+    Event_queue_init(event_task);
+
+    Boot_log_phase("outputs ready");
+
+    /* Initialize the input hardware, events now have somewhere to go */
+#if FAN_IO_PINNED
+    (void) xTaskCreatePinnedToCore(
+        input_init_task,
+        INPUT_INIT_NAME,
+        INPUT_INIT_STACKSIZE,
+        xTaskGetCurrentTaskHandle(),
+        EVENT_HANDLER_PRIORITY,
+        NULL,
+        FAN_IO_CORE_ID);
+    (void) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+    input_isr_service_init();
+    Button_init();
+    Phase_init();
+    Remote_init();
+#endif
+
+    Boot_log_phase("local controls ready");
+
+#ifdef CONFIG_FAN_LINK_SATELLITE
+    /* A satellite only talks to its bridge, there is no HomeKit or WiFi association */
+    Link_init();
+
+    Boot_log_phase("init done");
+#else
+    /* Start reading the temperature, before HomeKit so its service has a value */
+    Auto_speed_init();
+
+    /* Initialize the HomeKit component, WiFi connects in the background */
+    HomeKit_init();
+
+    Boot_log_phase("HomeKit started");
+
+    /* Start talking to any satellite fans */
+    Link_init();
+
+    /* Open the local UDP control port, which needs the HomeKit keys */
+    Udp_control_init();
+
+    /* Connect to the MQTT broker, if there is one */
+    Mqtt_init();
+
+#ifndef CONFIG_FAN_HAP_BLE
+    /* Start keeping time for any on-device schedules */
+    Schedule_init();
+#endif
+
+    /* Everything is up, let the chip sleep whenever it's idle */
+    Power_init();
+
+    /* Start sampling heap and stack usage, now that every task exists */
+    Telemetry_init();
+
+    /* Time the crypto primitives once things have settled */
+    Benchmark_init();
+
+    /* Then load up the event pipeline */
+    Event_bench_init();
+
+    /* Profile energy use once Wi-Fi has settled */
+    Energy_init();
+
+    Boot_log_phase("init done");
+
+#if defined(CONFIG_FAN_HAP_THREAD)
+    /* Wait for the network so the boot timeline is complete */
+    if (ESP_OK == Thread_net_wait_attached(portMAX_DELAY))
+    {
+        Boot_log_phase("Thread attached");
+    }
+#elif !defined(CONFIG_FAN_HAP_BLE)
+    /* Wait for the network so the boot timeline is complete */
+    if (ESP_OK == app_wifi_wait_connected(portMAX_DELAY))
+    {
+        Boot_log_phase("WiFi connected");
+    }
+#endif
+#endif /* CONFIG_FAN_LINK_SATELLITE */
 }
 
 /** @} end Main */
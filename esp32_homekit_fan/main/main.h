@@ -13,8 +13,8 @@
 
 #include <stdint.h>            /* Extended integer types */
 
+#include <sdkconfig.h>         /* Project configuration */
 #include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
-#include <freertos/queue.h>    /* Definitions for creating inter-task queues */
 #include <hal/gpio_types.h>    /* ESP GPIO-related functions */
 
 /** GPIO logic level low/high */
@@ -24,6 +24,21 @@
 /** For dealing with unused parameters */
 #define UNUSED_PARAM(param) (void) param;
 
+/**
+ * Core and priority for the fan I/O tasks (event handler and remote handler).
+ * The button and IR receiver interrupts are set up from the same core. On
+ * dual-core chips, pick the other core for CONFIG_HAP_TASK_CORE_ID so pairing
+ * crypto never shares a core with the relays.
+ */
+#if defined(CONFIG_FAN_IO_CORE_ID) && (CONFIG_FAN_IO_CORE_ID >= 0)
+#define FAN_IO_PINNED   1
+#define FAN_IO_CORE_ID  CONFIG_FAN_IO_CORE_ID
+#else
+#define FAN_IO_PINNED   0
+#define FAN_IO_CORE_ID  tskNO_AFFINITY
+#endif
+#define FAN_IO_PRIORITY CONFIG_FAN_IO_TASK_PRIORITY
+
 /**
  * GPIO table for the project
  * ``````````````````````````
@@ -41,14 +56,16 @@
  * GPIO11 -> (OUT)      Speed 4 LED
  * GPIO12 -> (OUT)      Built-in LED 1
  * GPIO13 -> (OUT)      Built-in LED 2
- * GPIO14 -> (UNUSED)
- * GPIO15 -> (UNUSED)
+ * GPIO14 -> (IN)       Zero-cross DETECTOR *
+ * GPIO15 -> (OUT)      Triac gate *
  * GPIO16 -> (UNUSED)
  * GPIO17 -> (UNUSED)
  * GPIO18 -> (DONT USE) USB-JTAG 
  * GPIO19 -> (DONT USE) USB-JTAG
  * GPIO20 -> ?
  * GPIO21 -> ?
+ *
+ * (*) Only with CONFIG_FAN_PHASE_CONTROL, on any of GPIO14-17.
  */
 #define FAN_IR_SENSOR_GPIO    GPIO_NUM_0  /** IR sensor */
 #define FAN_PWR_BUTTON_GPIO   GPIO_NUM_1  /** Power button */
@@ -64,12 +81,42 @@
 #define FAN_SPEED4_LED_GPIO   GPIO_NUM_13 /** Speed 4 LED */
 #define FAN_BUILTIN_LED_GPIO  GPIO_NUM_12 /** Built-in LED */
 
+/**
+ * Number of fans driven by this board. With more than one, the board shows up
+ * in HomeKit as a bridge with one bridged accessory per fan. Fan 0 is the one
+ * wired as in the table above, and the only one the buttons, IR remote and
+ * schedules control.
+ */
+#ifdef CONFIG_FAN_BRIDGE
+#define FAN_NUM_FANS CONFIG_FAN_BRIDGE_NUM_FANS
+#else
+#define FAN_NUM_FANS 1
+#endif
+
+/** Struct for the output pins of one fan, GPIO_NUM_NC for pins not wired */
+typedef struct Fan_gpio_map_t
+{
+    gpio_num_t speed_relay[4]; /** Speed 1-4 relays */
+    gpio_num_t osc_relay;      /** Oscillation relay */
+    gpio_num_t speed_led[4];   /** Speed 1-4 LEDs */
+} Fan_gpio_map_t;
+
+/** Output pins of every fan, indexed by fan */
+extern const Fan_gpio_map_t g_Fan_gpio_maps[FAN_NUM_FANS];
+
 /** Enum for sources of incoming events */
 enum Event_source
 {
     SOURCE_HOMEKIT = 0, /** Event originated from HomeKit */
     SOURCE_REMOTE,      /** Event originated from IR remote */
-    SOURCE_BUTTON       /** Event originated from front-fascia button */
+    SOURCE_BUTTON,      /** Event originated from front-fascia button */
+    SOURCE_TIMER,       /** Event originated from the sleep timer */
+    SOURCE_SCHEDULE,    /** Event originated from an on-device schedule */
+    SOURCE_LINK,        /** Event originated from the ESP-NOW link */
+    SOURCE_UDP,         /** Event originated from the local UDP control API */
+    SOURCE_MQTT,        /** Event originated from an MQTT broker */
+    SOURCE_AUTO,        /** Event originated from the temperature auto mode */
+    NUM_SOURCE          /** For arithmetic */
 };
 
 /** Enum for identifying incoming events */
@@ -79,7 +126,15 @@ enum Event_id
     ID_OSCILLATE,       /** Oscillation state changed */
     ID_TIME,            /** IR remote clock button pressed */
     ID_SPEED,           /** Fan speed changed */
-    ID_TEMPERATURE      /** IR remote temperature button pressed */
+    ID_TEMPERATURE,     /** IR remote temperature button pressed, or auto mode set */
+    NUM_EVENT_ID        /** For arithmetic */
+};
+
+/** Enum for arguments of IR remote events */
+enum Remote_arg
+{
+    REMOTE_PRESS = 0, /** Button was just pressed */
+    REMOTE_HELD,      /** Button is still being held down */
 };
 
 /** Struct for incoming control events */
@@ -87,7 +142,10 @@ typedef struct Fan_event_t
 {
     enum Event_source source;   /** Source of the event */
     enum Event_id id;           /** ID of the event */
+    uint8_t fan;                /** Fan the event is for, 0 unless bridged */
+    uint8_t pct;                /** Exact speed (in %) of an ID_SPEED event, 0 for the top of its speed */
     uint32_t arg;               /** Argument for the event */
+    int64_t timestamp_us;       /** Time (in uSec) the event was created */
 } Fan_event_t;
 
 /** Enum for distinct speed levels for fan */
@@ -101,22 +159,74 @@ enum State_speed
     NUM_SPEED      /** For arithmetic */
 };
 
+/** Rotation speed (in %) covered by each speed level */
+#define SPEED_PCT_STEP 25
+
+/**
+ * @brief  Get the speed level an exact speed falls into.
+ * @param  pct Speed (in %)
+ * @return Speed level, SPEED_1 covering 1-25% up to SPEED_4 covering 76-100%.
+ */
+static inline enum State_speed Speed_from_pct(uint8_t pct)
+{
+    if (pct > 100)
+    {
+        pct = 100;
+    }
+    return (enum State_speed) ((pct + SPEED_PCT_STEP - 1) / SPEED_PCT_STEP);
+}
+
+/**
+ * @brief  Get the exact speed a speed level runs at by default, the top of it.
+ * @param  speed Speed level
+ * @return Speed (in %).
+ */
+static inline uint8_t Speed_to_pct(enum State_speed speed)
+{
+    return (uint8_t) (speed * SPEED_PCT_STEP);
+}
+
+/** Enum for sleep timer settings, each turning the fan off after a while */
+enum State_timer
+{
+    TIMER_OFF = 0, /** No sleep timer */
+    TIMER_1H,      /** Turn off after 1 hour */
+    TIMER_2H,      /** Turn off after 2 hours */
+    TIMER_4H,      /** Turn off after 4 hours */
+    TIMER_8H,      /** Turn off after 8 hours */
+    NUM_TIMER      /** For arithmetic */
+};
+
+/** Flags for parts of the fan state that changed since last reported */
+#define STATE_DIRTY_ON        0x01
+#define STATE_DIRTY_OSCILLATE 0x02
+#define STATE_DIRTY_SPEED     0x04
+#define STATE_DIRTY_TIMER     0x08
+#define STATE_DIRTY_AUTO      0x10
+
 /** Struct to represent current state of the fan */
 typedef struct Fan_state_t
 {
     bool on;                /** Whether the fan is spinning */
     bool oscillate;         /** Whether oscillation is enabled */
     enum State_speed speed; /** Current speed level */
+    uint8_t speed_pct;      /** Exact speed (in %), always within the speed level */
+    enum State_timer timer; /** Current sleep timer setting */
+    bool auto_mode;         /** Whether the temperature sets the speed */
+    uint8_t dirty;          /** STATE_DIRTY_* flags not yet reported */
 } Fan_state_t;
 
-/** Current state of the fan */
-extern Fan_state_t g_Fan_state;
-
-/** Queue to hold incoming control events */
-extern QueueHandle_t g_Fan_event_queue;
+/**
+ * Current state of every fan, indexed by fan. Only the event handler task
+ * writes it, through Fan_state_commit(), and only it may read it directly.
+ * Other tasks take a copy with Fan_state_snapshot().
+ */
+extern Fan_state_t g_Fan_state[FAN_NUM_FANS];
 
-/** Global semaphore for adding events */
-extern volatile bool g_Fan_event_lock;
+/** Public functions for the Main component */
+void Boot_log_phase(const char *phase);
+void Fan_state_commit(uint8_t fan, const Fan_state_t *state);
+uint32_t Fan_state_snapshot(uint8_t fan, Fan_state_t *state);
 
 #endif /* MAIN_H */
 
@@ -0,0 +1,450 @@
+/**
+ * @file mqtt.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bridge fan control and telemetry to an MQTT broker.
+ *
+ * With CONFIG_FAN_MQTT, the fan connects to CONFIG_FAN_MQTT_BROKER_URI and
+ * shows up under CONFIG_FAN_MQTT_TOPIC_PREFIX (below as <prefix>):
+ *
+ *     <prefix>/status             "online" or "offline" (last will), retained
+ *     <prefix>/<fan>/state        {"on":1,"oscillate":0,"speed":2,"timer":0}, retained
+ *     <prefix>/<fan>/set/power    0/1 (or on/off), commands in
+ *     <prefix>/<fan>/set/oscillate
+ *     <prefix>/<fan>/set/speed    0 to 4, as for HomeKit writes
+ *     <prefix>/<fan>/set/timer    0 to 4, as for HomeKit writes
+ *     <prefix>/telemetry          batched samples and latency summaries
+ *
+ * Commands go into the event queue like HomeKit writes do, so the result is
+ * reported back to HomeKit like any other local change.
+ *
+ * Nothing here may hold up the HomeKit path. Callers only set a bit and wake
+ * the low-priority publish task, which does all the formatting and network
+ * writes. State is never queued: each fan has a pending bit and the current
+ * state is read when it goes out, so a burst of changes collapses into one
+ * QoS 1 message. Telemetry samples go into a small ring that is sent as one
+ * QoS 0 message every CONFIG_FAN_MQTT_PUBLISH_PERIOD_MS. While the broker is
+ * unreachable the ring fills, and the oldest samples are dropped first.
+ *
+ * @addtogroup Mqtt
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+
+#ifdef CONFIG_FAN_MQTT
+#include <stdio.h>             /* snprintf */
+#include <stdlib.h>            /* strtoul */
+#include <string.h>            /* For memory/string-related functions */
+#include <strings.h>           /* strcasecmp */
+#include <inttypes.h>          /* Format macros for extended integers */
+
+#include <esp_heap_caps.h>     /* Free heap readings */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Definitions for creating tasks */
+#include <mqtt_client.h>       /* ESP-MQTT client */
+#endif
+
+#include "main.h"
+#include "mqtt.h"
+#include "event_queue.h"
+#include "latency.h"
+
+#ifdef CONFIG_FAN_MQTT
+/** Arguments for creating the publish task, below everything on the HomeKit path */
+#define MQTT_PUBLISH_NAME      "MqttPublish"
+#define MQTT_PUBLISH_STACKSIZE 4 * 1024
+#define MQTT_PUBLISH_PRIORITY  1
+
+/** Priority of the ESP-MQTT client task, which runs the command callbacks */
+#define MQTT_CLIENT_PRIORITY   2
+
+/** Time (in mSec) between telemetry samples */
+#define MQTT_SAMPLE_MS         1000
+
+/** Sizes of the topic and message buffers */
+#define MQTT_TOPIC_SIZE        64
+#define MQTT_STATE_SIZE        64
+#define MQTT_BATCH_SIZE        1536
+
+/** Longest command payload accepted */
+#define MQTT_MAX_COMMAND_LEN   7
+
+/** Struct for one telemetry sample */
+typedef struct Mqtt_sample_t
+{
+    uint32_t uptime_s;      /** Time (in Sec) since boot */
+    uint32_t heap_free;     /** Free heap (in Bytes) */
+    uint32_t heap_min_free; /** Least free heap (in Bytes) since boot */
+} Mqtt_sample_t;
+
+/** Struct mapping a command topic to an event */
+typedef struct Mqtt_command_t
+{
+    const char   *name; /** Last level of the topic */
+    enum Event_id id;   /** Event it is sent as */
+} Mqtt_command_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Mqtt";
+
+/** Command topics under <prefix>/<fan>/set/ */
+static const Mqtt_command_t commands[] = {
+    { .name = "power",     .id = ID_POWER },
+    { .name = "oscillate", .id = ID_OSCILLATE },
+    { .name = "speed",     .id = ID_SPEED },
+    { .name = "timer",     .id = ID_TIME },
+};
+
+/** Ring of telemetry samples, only touched by the publish task */
+static Mqtt_sample_t samples[CONFIG_FAN_MQTT_TELEMETRY_SAMPLES];
+static uint32_t      sample_head;
+static uint32_t      sample_count;
+static uint32_t      samples_dropped;
+
+/** Fans (one bit each) whose state has yet to be published */
+static uint32_t pending_state;
+
+/** Whether the broker is connected, set by the client task */
+static volatile bool connected;
+
+static esp_mqtt_client_handle_t client;
+static TaskHandle_t             publish_task;
+static char                     batch[MQTT_BATCH_SIZE];
+
+/**
+ * @brief Add a telemetry sample to the ring, dropping the oldest if it's full.
+ */
+static void take_sample(void)
+{
+    if (CONFIG_FAN_MQTT_TELEMETRY_SAMPLES == sample_count)
+    {
+        sample_head = (sample_head + 1) % CONFIG_FAN_MQTT_TELEMETRY_SAMPLES;
+        sample_count--;
+        samples_dropped++;
+    }
+
+    Mqtt_sample_t *sample = &samples[(sample_head + sample_count) % CONFIG_FAN_MQTT_TELEMETRY_SAMPLES];
+    sample->uptime_s      = (uint32_t) (esp_timer_get_time() / 1000000);
+    sample->heap_free     = (uint32_t) heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    sample->heap_min_free = (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    sample_count++;
+}
+
+/**
+ * @brief Publish the current state of one fan, retained.
+ * @param fan Fan to publish
+ */
+static void publish_state(uint8_t fan)
+{
+    char topic[MQTT_TOPIC_SIZE];
+    char payload[MQTT_STATE_SIZE];
+
+    Fan_state_t state;
+    Fan_state_snapshot(fan, &state);
+
+    (void) snprintf(topic, sizeof(topic), CONFIG_FAN_MQTT_TOPIC_PREFIX "/%u/state", (unsigned) fan);
+    int len = snprintf(payload, sizeof(payload), "{\"on\":%d,\"oscillate\":%d,\"speed\":%d,\"timer\":%d}",
+                       (int) state.on, (int) state.oscillate, (int) state.speed, (int) state.timer);
+
+    (void) esp_mqtt_client_publish(client, topic, payload, len, 1, 1);
+}
+
+/**
+ * @brief   Publish every sample in the ring as one message, then empty it.
+ * @details Latency summaries are appended for every source that has seen
+ *          events. If the message doesn't fit, the newest samples are kept.
+ */
+static void publish_batch(void)
+{
+    uint32_t skip = 0;
+    int      len;
+
+    do
+    {
+        len = snprintf(batch, sizeof(batch), "{\"dropped\":%" PRIu32 ",\"samples\":[", samples_dropped + skip);
+        for (uint32_t i = skip; i < sample_count && len < (int) sizeof(batch); i++)
+        {
+            const Mqtt_sample_t *sample = &samples[(sample_head + i) % CONFIG_FAN_MQTT_TELEMETRY_SAMPLES];
+            len += snprintf(batch + len, sizeof(batch) - len, "%s[%" PRIu32 ",%" PRIu32 ",%" PRIu32 "]",
+                            (i > skip) ? "," : "", sample->uptime_s, sample->heap_free, sample->heap_min_free);
+        }
+        len += snprintf(batch + len, sizeof(batch) - len, "],\"latency\":{");
+
+        bool first = true;
+        for (int source = 0; source < NUM_SOURCE && len < (int) sizeof(batch); source++)
+        {
+            uint32_t count[NUM_LATENCY_STAGE];
+            int64_t  mean_us[NUM_LATENCY_STAGE];
+            int64_t  max_us[NUM_LATENCY_STAGE];
+
+            for (int stage = 0; stage < NUM_LATENCY_STAGE; stage++)
+            {
+                Latency_get_summary(source, stage, &count[stage], &mean_us[stage], &max_us[stage]);
+            }
+            if (0 == count[LATENCY_QUEUE])
+            {
+                continue;
+            }
+
+            len += snprintf(batch + len, sizeof(batch) - len,
+                            "%s\"%s\":[%" PRIu32 ",%" PRId64 ",%" PRId64 ",%" PRIu32 ",%" PRId64 ",%" PRId64 "]",
+                            first ? "" : ",", Latency_source_name(source),
+                            count[LATENCY_QUEUE], mean_us[LATENCY_QUEUE], max_us[LATENCY_QUEUE],
+                            count[LATENCY_ACTUATION], mean_us[LATENCY_ACTUATION], max_us[LATENCY_ACTUATION]);
+            first = false;
+        }
+        len += snprintf(batch + len, sizeof(batch) - len, "}}");
+
+        /* Too long, drop the oldest half of what's left and try again */
+        skip += (sample_count - skip + 1) / 2;
+    } while (len >= (int) sizeof(batch) && skip < sample_count);
+
+    if (len >= (int) sizeof(batch))
+    {
+        ESP_LOGW(TAG, "Telemetry too long, not sent");
+        return;
+    }
+
+    /* Telemetry is best effort, a lost batch isn't worth a retransmission */
+    if (esp_mqtt_client_publish(client, CONFIG_FAN_MQTT_TOPIC_PREFIX "/telemetry", batch, len, 0, 0) >= 0)
+    {
+        sample_head     = 0;
+        sample_count    = 0;
+        samples_dropped = 0;
+    }
+}
+
+/**
+ * @brief   Publish FreeRTOS task, sends pending state and telemetry.
+ * @details Wakes to take a sample every MQTT_SAMPLE_MS, and whenever a fan
+ *          changes. Nothing is sent while the broker is disconnected, pending
+ *          state stays pending and samples pile up in the ring.
+ * @param   p [in] Required FreeRTOS parameter (UNUSED)
+ */
+static void Mqtt_publish_task(void *p)
+{
+    TickType_t last_sample = xTaskGetTickCount();
+    TickType_t last_batch  = last_sample;
+
+    UNUSED_PARAM(p);
+
+    while (true)
+    {
+        TickType_t since = xTaskGetTickCount() - last_sample;
+        TickType_t wait  = (since < pdMS_TO_TICKS(MQTT_SAMPLE_MS)) ? pdMS_TO_TICKS(MQTT_SAMPLE_MS) - since : 0;
+        (void) ulTaskNotifyTake(pdTRUE, wait);
+
+        TickType_t now = xTaskGetTickCount();
+        if (now - last_sample >= pdMS_TO_TICKS(MQTT_SAMPLE_MS))
+        {
+            last_sample = now;
+            take_sample();
+        }
+
+        if (!connected)
+        {
+            continue;
+        }
+
+        uint32_t pending = __atomic_exchange_n(&pending_state, 0, __ATOMIC_RELAXED);
+        for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+        {
+            if (pending & (1UL << fan))
+            {
+                publish_state(fan);
+            }
+        }
+
+        if (now - last_batch >= pdMS_TO_TICKS(CONFIG_FAN_MQTT_PUBLISH_PERIOD_MS) && sample_count)
+        {
+            last_batch = now;
+            publish_batch();
+        }
+    }
+}
+
+/**
+ * @brief   Turn a command topic and payload into an event.
+ * @details Topics are <prefix>/<fan>/set/<command>, and aren't terminated.
+ *          Payloads are a number, as for HomeKit writes, or on/off.
+ * @param   event [in] ESP-MQTT data event
+ */
+static void handle_command(const esp_mqtt_event_t *event)
+{
+    static const size_t prefix_len = sizeof(CONFIG_FAN_MQTT_TOPIC_PREFIX) - 1;
+    char                topic[MQTT_TOPIC_SIZE];
+    char                payload[MQTT_MAX_COMMAND_LEN + 1];
+    char               *end;
+
+    if (event->topic_len >= (int) sizeof(topic) || event->data_len > MQTT_MAX_COMMAND_LEN ||
+        event->data_len != event->total_data_len)
+    {
+        return;
+    }
+
+    memcpy(topic, event->topic, event->topic_len);
+    topic[event->topic_len] = '\0';
+    memcpy(payload, event->data, event->data_len);
+    payload[event->data_len] = '\0';
+
+    if (0 != strncmp(topic, CONFIG_FAN_MQTT_TOPIC_PREFIX "/", prefix_len + 1))
+    {
+        return;
+    }
+
+    unsigned long fan = strtoul(topic + prefix_len + 1, &end, 10);
+    if (0 != strncmp(end, "/set/", 5) || fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    const char *name = end + 5;
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (0 != strcmp(name, commands[i].name))
+        {
+            continue;
+        }
+
+        unsigned long arg;
+        if (0 == strcasecmp(payload, "on") || 0 == strcasecmp(payload, "true"))
+        {
+            arg = 1;
+        }
+        else if (0 == strcasecmp(payload, "off") || 0 == strcasecmp(payload, "false"))
+        {
+            arg = 0;
+        }
+        else
+        {
+            arg = strtoul(payload, &end, 10);
+            if (end == payload || '\0' != *end)
+            {
+                ESP_LOGW(TAG, "Bad payload for %s", topic);
+                return;
+            }
+        }
+
+        Fan_event_t fan_event = {
+            .source       = SOURCE_MQTT,
+            .fan          = (uint8_t) fan,
+            .id           = commands[i].id,
+            .arg          = (uint32_t) arg,
+            .timestamp_us = esp_timer_get_time(),
+        };
+
+        if (!Event_queue_send(&fan_event))
+        {
+            ESP_LOGW(TAG, "Event queue full, dropping event");
+        }
+        return;
+    }
+}
+
+/**
+ * @brief Callback for ESP-MQTT client events, runs in the client task.
+ * @param args       [in] Unused
+ * @param base       Event base (UNUSED)
+ * @param event_id   ID of the event
+ * @param event_data [in] The esp_mqtt_event_t
+ */
+static void mqtt_event_handler(void *args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_t *event = (esp_mqtt_event_t *) event_data;
+
+    UNUSED_PARAM(args);
+    UNUSED_PARAM(base);
+
+    switch ((esp_mqtt_event_id_t) event_id)
+    {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(TAG, "Connected to %s", CONFIG_FAN_MQTT_BROKER_URI);
+            (void) esp_mqtt_client_subscribe(client, CONFIG_FAN_MQTT_TOPIC_PREFIX "/+/set/+", 1);
+            (void) esp_mqtt_client_publish(client, CONFIG_FAN_MQTT_TOPIC_PREFIX "/status", "online", 0, 1, 1);
+            connected = true;
+
+            /* The broker may have lost the retained state, send all of it */
+            for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+            {
+                Mqtt_publish_state(fan);
+            }
+            break;
+
+        case MQTT_EVENT_DISCONNECTED:
+            connected = false;
+            break;
+
+        case MQTT_EVENT_DATA:
+            handle_command(event);
+            break;
+
+        default:
+            break;
+    }
+}
+#endif /* CONFIG_FAN_MQTT */
+
+/**
+ * @brief   Publish the state of a fan soon.
+ * @details Cheap enough to call on every change, the message is built in the
+ *          publish task. Does nothing unless CONFIG_FAN_MQTT is set.
+ * @param   fan Fan whose state changed
+ */
+void Mqtt_publish_state(uint8_t fan)
+{
+#ifdef CONFIG_FAN_MQTT
+    if (fan < FAN_NUM_FANS && NULL != publish_task)
+    {
+        (void) __atomic_fetch_or(&pending_state, 1UL << fan, __ATOMIC_RELAXED);
+        (void) xTaskNotifyGive(publish_task);
+    }
+#else
+    UNUSED_PARAM(fan);
+#endif
+}
+
+/**
+ * @brief   Initializer for the Mqtt component.
+ * @note    The client connects once the network is up, and keeps
+ *          reconnecting on its own. Does nothing unless CONFIG_FAN_MQTT is set.
+ */
+void Mqtt_init(void)
+{
+#ifdef CONFIG_FAN_MQTT
+    const esp_mqtt_client_config_t config = {
+        .broker.address.uri             = CONFIG_FAN_MQTT_BROKER_URI,
+        .session.last_will.topic        = CONFIG_FAN_MQTT_TOPIC_PREFIX "/status",
+        .session.last_will.msg          = "offline",
+        .session.last_will.qos          = 1,
+        .session.last_will.retain       = 1,
+        .task.priority                  = MQTT_CLIENT_PRIORITY,
+    };
+
+    client = esp_mqtt_client_init(&config);
+    if (NULL == client)
+    {
+        ESP_LOGE(TAG, "Failed to create the MQTT client");
+        return;
+    }
+
+    (void) xTaskCreate(Mqtt_publish_task, MQTT_PUBLISH_NAME, MQTT_PUBLISH_STACKSIZE, NULL,
+                       MQTT_PUBLISH_PRIORITY, &publish_task);
+
+    (void) esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, mqtt_event_handler, NULL);
+    if (ESP_OK != esp_mqtt_client_start(client))
+    {
+        ESP_LOGE(TAG, "Failed to start the MQTT client");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Mqtt component init!");
+#endif /* CONFIG_FAN_MQTT */
+}
+
+/** @} end Mqtt */
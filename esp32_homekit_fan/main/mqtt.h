@@ -0,0 +1,22 @@
+/**
+ * @file mqtt.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bridge fan control and telemetry to an MQTT broker.
+ *
+ * @addtogroup Mqtt
+ * @{
+ */
+
+#ifndef MQTT_H
+#define MQTT_H
+
+#include <stdint.h> /* Extended integer types */
+
+/** Public functions for the Mqtt component */
+void Mqtt_publish_state(uint8_t fan);
+void Mqtt_init(void);
+
+#endif /* MQTT_H */
+
+/** @} end Mqtt */
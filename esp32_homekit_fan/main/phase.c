@@ -0,0 +1,405 @@
+/**
+ * @file phase.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to drive the fan motor through triac phase control.
+ *
+ * The speed relays only give four speeds, one per tap of the motor winding.
+ * With CONFIG_FAN_PHASE_CONTROL, the motor instead runs off a triac in series
+ * with its highest speed tap, and Rotation Speed goes in 1% steps. Each half
+ * cycle of the mains, the triac is fired some time after the zero crossing and
+ * conducts until the current next falls to zero. The later it's fired, the
+ * less of the half cycle reaches the motor and the slower it turns.
+ *
+ * A zero-cross detector gives an edge at every zero crossing. The GPIO
+ * interrupt for it reads a 1 MHz GPTimer and sets a one-shot alarm for the
+ * firing point, and the alarm raises the gate, then lowers it again a gate
+ * pulse later. Edges that come too early to be the next zero crossing are
+ * taken as noise and ignored. The length of a half cycle is measured rather
+ * than taken from the nominal mains frequency, since the mains drifts.
+ *
+ * The firing point has to be hit to within tens of microseconds, or the motor
+ * hums and the speed wobbles. So both interrupts run from IRAM at level 3,
+ * where they keep going through flash writes and aren't held up by Wi-Fi and
+ * HomeKit work. They're allocated from the same core and level, so they never
+ * preempt each other. The lateness of each alarm is recorded for telemetry.
+ *
+ * Speeding up eases the conduction in one step per half cycle, which keeps
+ * the inrush down like the relay ramp does. Slowing down takes effect at the
+ * next zero crossing. While the motor is off, the timer and the zero-cross
+ * interrupt are stopped so the chip can sleep.
+ *
+ * @addtogroup Phase
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <string.h>            /* memset */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+
+#include "main.h"
+#include "phase.h"
+
+#ifdef CONFIG_FAN_PHASE_CONTROL
+#include <esp_attr.h>          /* Extra function attributes (IRAM_ATTR) */
+#include <esp_intr_alloc.h>    /* Interrupt allocation flags */
+#include <esp_pm.h>            /* Power management locks */
+#include <driver/gpio.h>       /* ESP GPIO-related functions */
+#include <driver/gptimer.h>    /* General purpose timers */
+#include <soc/soc.h>           /* Register access helpers */
+#include <soc/gpio_reg.h>      /* GPIO set/clear register addresses */
+
+/** The set/clear registers only cover the first 32 GPIOs */
+_Static_assert(CONFIG_FAN_PHASE_GATE_GPIO < 32, "Triac gate must live in GPIO 0-31");
+_Static_assert(CONFIG_FAN_PHASE_ZC_GPIO != CONFIG_FAN_PHASE_GATE_GPIO,
+               "Zero-cross detector and triac gate need their own GPIOs");
+
+/** Resolution of the phase timer (1 tick per uSec) */
+#define PHASE_TIMER_HZ         1000000
+/** Nominal length (in uSec) of a half cycle of the mains */
+#define PHASE_NOMINAL_HALF_US  (PHASE_TIMER_HZ / (2 * CONFIG_FAN_PHASE_MAINS_HZ))
+/** Length (in uSec) of a gate pulse */
+#define PHASE_PULSE_US         CONFIG_FAN_PHASE_GATE_PULSE_US
+/** Conduction (in % of the half cycle) at the lowest speed */
+#define PHASE_MIN_CONDUCTION   CONFIG_FAN_PHASE_MIN_PCT
+/** Full conduction, where the gate is just held high */
+#define PHASE_FULL_CONDUCTION  100
+/** Conduction added per half cycle while speeding up */
+#define PHASE_RAMP_STEP        1
+/** Weight (as a shift) of each new half cycle in the measured length */
+#define PHASE_HALF_EMA_SHIFT   3
+/** Pin mask of the triac gate */
+#define PHASE_GATE_MASK        (1UL << CONFIG_FAN_PHASE_GATE_GPIO)
+
+static const char *TAG = "Phase";
+
+/** Timer used to time the firing point and gate pulse */
+static gptimer_handle_t timer;
+/** Keeps the chip out of light sleep while the motor is running */
+static esp_pm_lock_handle_t pm_lock;
+/** Conduction (in %) asked for, 0 when off */
+static volatile uint32_t target;
+/** Conduction (in %) of the current half cycle */
+static uint32_t conduction;
+/** Timer count at the last zero crossing */
+static uint64_t last_zc;
+/** Whether last_zc belongs to the current run */
+static bool synced;
+/** Whether the gate is in the middle of a pulse */
+static bool pulsing;
+/** Whether Phase_init() has run */
+static bool initialized;
+/** Statistics, written from the interrupts */
+static Phase_stats_t stats;
+
+/**
+ * @brief  Converts a Rotation Speed to a conduction.
+ * @param  pct [in] Rotation Speed (in %), 0 for off
+ * @return Conduction (in % of the half cycle)
+ */
+static uint32_t conduction_from_pct(uint8_t pct)
+{
+    if (0 == pct)
+    {
+        return 0;
+    }
+    if (pct > 100)
+    {
+        pct = 100;
+    }
+    return PHASE_MIN_CONDUCTION +
+           ((uint32_t) (pct - 1) * (PHASE_FULL_CONDUCTION - PHASE_MIN_CONDUCTION)) / 99;
+}
+
+/**
+ * @brief  Schedules the next alarm.
+ * @param  count [in] Timer count to fire at, or 0 for none
+ */
+static void IRAM_ATTR set_alarm(uint64_t count)
+{
+    if (0 == count)
+    {
+        (void) gptimer_set_alarm_action(timer, NULL);
+        return;
+    }
+    gptimer_alarm_config_t alarm = {
+        .alarm_count = count,
+    };
+    (void) gptimer_set_alarm_action(timer, &alarm);
+}
+
+/**
+ * @brief   Timer alarm, at the firing point and at the end of the gate pulse.
+ * @param   timer [in] Phase timer
+ * @param   edata [in] Alarm and current timer counts
+ * @param   arg   [in] Unused
+ * @return  False, no task is woken
+ */
+static bool IRAM_ATTR phase_alarm_cb(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg)
+{
+    UNUSED_PARAM(timer);
+    UNUSED_PARAM(arg);
+
+    if (pulsing)
+    {
+        REG_WRITE(GPIO_OUT_W1TC_REG, PHASE_GATE_MASK);
+        pulsing = false;
+        set_alarm(0);
+        return false;
+    }
+    if (0 == target)
+    {
+        set_alarm(0);
+        return false;
+    }
+
+    REG_WRITE(GPIO_OUT_W1TS_REG, PHASE_GATE_MASK);
+    pulsing = true;
+    set_alarm(edata->alarm_value + PHASE_PULSE_US);
+
+    uint32_t late = (uint32_t) (edata->count_value - edata->alarm_value);
+    stats.fires++;
+    if (late > stats.fire_late_max_us)
+    {
+        stats.fire_late_max_us = late;
+    }
+    return false;
+}
+
+/**
+ * @brief   Zero-cross detector interrupt.
+ * @details Filters out noise, measures the half cycle and schedules the firing
+ *          point for the half cycle that just started.
+ * @param   arg [in] Unused
+ */
+static void IRAM_ATTR phase_zc_isr(void *arg)
+{
+    UNUSED_PARAM(arg);
+
+    uint64_t now = 0;
+    (void) gptimer_get_raw_count(timer, &now);
+
+    uint32_t half = stats.half_cycle_us;
+    if (synced)
+    {
+        uint32_t elapsed = (uint32_t) (now - last_zc);
+        if (elapsed < half - half / 4)
+        {
+            stats.glitches++;
+            return;
+        }
+        if (elapsed <= half + half / 4)
+        {
+            int32_t error = (int32_t) elapsed - (int32_t) half;
+            half = (uint32_t) ((int32_t) half + error / (1 << PHASE_HALF_EMA_SHIFT));
+            stats.half_cycle_us = half;
+            if (elapsed < stats.half_cycle_min_us || 0 == stats.half_cycle_min_us)
+            {
+                stats.half_cycle_min_us = elapsed;
+            }
+            if (elapsed > stats.half_cycle_max_us)
+            {
+                stats.half_cycle_max_us = elapsed;
+            }
+        }
+        else
+        {
+            stats.dropouts++;
+        }
+    }
+    last_zc = now;
+    synced  = true;
+    stats.zero_crossings++;
+
+    /* Ease into faster speeds, slow down straight away */
+    uint32_t want = target;
+    if (want > conduction)
+    {
+        conduction = (conduction < PHASE_MIN_CONDUCTION) ? PHASE_MIN_CONDUCTION
+                                                         : conduction + PHASE_RAMP_STEP;
+        if (conduction > want)
+        {
+            conduction = want;
+        }
+    }
+    else
+    {
+        conduction = want;
+    }
+
+    if (conduction >= PHASE_FULL_CONDUCTION)
+    {
+        REG_WRITE(GPIO_OUT_W1TS_REG, PHASE_GATE_MASK);
+        pulsing = false;
+        set_alarm(0);
+        return;
+    }
+
+    REG_WRITE(GPIO_OUT_W1TC_REG, PHASE_GATE_MASK);
+    pulsing = false;
+    if (0 == conduction)
+    {
+        set_alarm(0);
+        return;
+    }
+
+    /* Leave room for the pulse to end before the next zero crossing */
+    uint32_t delay  = (half * (PHASE_FULL_CONDUCTION - conduction)) / PHASE_FULL_CONDUCTION
+                    + CONFIG_FAN_PHASE_ZC_LEAD_US;
+    uint32_t latest = (half > 2 * PHASE_PULSE_US) ? half - 2 * PHASE_PULSE_US : 0;
+    if (delay > latest)
+    {
+        delay = latest;
+    }
+    set_alarm(now + ((delay > 0) ? delay : 1));
+}
+
+/**
+ * @brief Starts firing the triac.
+ * @param want [in] Conduction (in %) to ease into
+ */
+static void phase_start(uint32_t want)
+{
+    (void) esp_pm_lock_acquire(pm_lock);
+    synced     = false;
+    conduction = 0;
+    target     = want;
+    ESP_ERROR_CHECK(gptimer_enable(timer));
+    ESP_ERROR_CHECK(gptimer_start(timer));
+    ESP_ERROR_CHECK(gpio_intr_enable(CONFIG_FAN_PHASE_ZC_GPIO));
+}
+
+/**
+ * @brief Stops firing the triac and leaves the gate low.
+ */
+static void phase_stop(void)
+{
+    ESP_ERROR_CHECK(gpio_intr_disable(CONFIG_FAN_PHASE_ZC_GPIO));
+    target = 0;
+    ESP_ERROR_CHECK(gptimer_stop(timer));
+    ESP_ERROR_CHECK(gptimer_disable(timer));
+    REG_WRITE(GPIO_OUT_W1TC_REG, PHASE_GATE_MASK);
+    pulsing = false;
+    (void) esp_pm_lock_release(pm_lock);
+}
+
+/**
+ * @brief Sets the speed of a fan's motor.
+ * @param fan [in] Index of the fan, only fan 0 has a triac
+ * @param pct [in] Rotation Speed (in %), 0 for off
+ */
+void Phase_write_speed(uint8_t fan, uint8_t pct)
+{
+    if (0 != fan)
+    {
+        return;
+    }
+
+    uint32_t want = conduction_from_pct(pct);
+    uint32_t was  = target;
+    ESP_LOGI(TAG, "Phase writing speed: %u%% (conduction %u%%)", (unsigned) pct, (unsigned) want);
+
+    if (!initialized)
+    {
+        target = want;
+        return;
+    }
+
+    if (0 == was && 0 != want)
+    {
+        phase_start(want);
+    }
+    else if (0 != was && 0 == want)
+    {
+        phase_stop();
+    }
+    else
+    {
+        target = want;
+    }
+}
+
+/**
+ * @brief Gets the phase control statistics.
+ * @param out [out] Statistics
+ */
+void Phase_get_stats(Phase_stats_t *out)
+{
+    *out = stats;
+}
+
+/**
+ * @brief Initializes the triac gate, zero-cross detector and phase timer.
+ */
+void Phase_init(void)
+{
+    gpio_config_t gate_conf = {
+        .pin_bit_mask = PHASE_GATE_MASK,
+        .mode         = GPIO_MODE_OUTPUT,
+        .pull_up_en   = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_ENABLE,
+        .intr_type    = GPIO_INTR_DISABLE,
+    };
+    REG_WRITE(GPIO_OUT_W1TC_REG, PHASE_GATE_MASK);
+    ESP_ERROR_CHECK(gpio_config(&gate_conf));
+
+    /* The detector's output is pulled high around each zero crossing */
+    gpio_config_t zc_conf = {
+        .pin_bit_mask = 1ULL << CONFIG_FAN_PHASE_ZC_GPIO,
+        .mode         = GPIO_MODE_INPUT,
+        .pull_up_en   = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_POSEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&zc_conf));
+    ESP_ERROR_CHECK(gpio_intr_disable(CONFIG_FAN_PHASE_ZC_GPIO));
+
+    /* app_main installed the GPIO ISR service with IRAM/level 3 flags for us */
+    ESP_ERROR_CHECK(gpio_isr_handler_add(CONFIG_FAN_PHASE_ZC_GPIO, phase_zc_isr, NULL));
+
+    gptimer_config_t timer_conf = {
+        .clk_src       = GPTIMER_CLK_SRC_DEFAULT,
+        .direction     = GPTIMER_COUNT_UP,
+        .resolution_hz = PHASE_TIMER_HZ,
+        .intr_priority = 3,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_conf, &timer));
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = phase_alarm_cb,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(timer, &callbacks, NULL));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "phase", &pm_lock));
+
+    stats.half_cycle_us = PHASE_NOMINAL_HALF_US;
+    initialized = true;
+
+    /* Catch up on a speed written before init (e.g. a warm resume) */
+    if (0 != target)
+    {
+        phase_start(target);
+    }
+
+    ESP_LOGI(TAG, "Phase component init! (zero-cross GPIO %d, gate GPIO %d)",
+             CONFIG_FAN_PHASE_ZC_GPIO, CONFIG_FAN_PHASE_GATE_GPIO);
+}
+#else
+void Phase_write_speed(uint8_t fan, uint8_t pct)
+{
+    UNUSED_PARAM(fan);
+    UNUSED_PARAM(pct);
+}
+
+void Phase_get_stats(Phase_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void Phase_init(void)
+{
+}
+#endif /* CONFIG_FAN_PHASE_CONTROL */
+
+/** @} end Phase */
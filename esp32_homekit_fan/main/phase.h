@@ -0,0 +1,36 @@
+/**
+ * @file phase.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to drive the fan motor through triac phase control.
+ *
+ * @addtogroup Phase
+ * @{
+ */
+
+#ifndef PHASE_H
+#define PHASE_H
+
+#include <stdint.h> /* Extended integer types */
+
+/** Phase control statistics */
+typedef struct Phase_stats_t
+{
+    uint32_t zero_crossings;    /** Zero crossings accepted */
+    uint32_t glitches;          /** Detector edges too early to be a zero crossing */
+    uint32_t dropouts;          /** Gaps too long to be a single half cycle */
+    uint32_t half_cycle_us;     /** Measured length of a half cycle */
+    uint32_t half_cycle_min_us; /** Shortest half cycle seen */
+    uint32_t half_cycle_max_us; /** Longest half cycle seen */
+    uint32_t fires;             /** Gate pulses started */
+    uint32_t fire_late_max_us;  /** Latest a gate pulse started after its alarm */
+} Phase_stats_t;
+
+/** Public functions for the Phase component */
+void Phase_write_speed(uint8_t fan, uint8_t pct);
+void Phase_get_stats(Phase_stats_t *stats);
+void Phase_init(void);
+
+#endif /* PHASE_H */
+
+/** @} end Phase */
@@ -0,0 +1,190 @@
+/**
+ * @file power.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep the fan's idle power draw down.
+ *
+ * The fan spends nearly all of its time waiting on the event queue with nothing
+ * to do, yet would otherwise sit there with the CPU at full clock. With
+ * CONFIG_FAN_LIGHT_SLEEP, automatic light sleep and dynamic frequency scaling
+ * are turned on, so the chip drops into light sleep whenever every task is
+ * blocked, and Wi-Fi modem sleep only wakes the radio for beacons.
+ *
+ * Each component keeps itself awake only while it really needs to. The RMT
+ * driver holds its own PM lock while the IR receiver is enabled, which the
+ * Remote component only does while IR is arriving, and the Relay component
+ * holds one for the length of a speed transition. The buttons and the IR
+ * sensor arm their own pins as GPIO wakeup sources, this component just turns
+ * GPIO wakeup on as a whole.
+ *
+ * With CONFIG_FAN_WIFI_PS_AUTO, the Wi-Fi power save profile follows what
+ * HomeKit is doing. Modem sleep is off while a controller is writing, so the
+ * rest of a burst lands right away. Minimum modem sleep is used while a
+ * controller is connected, so the first write only waits for the next DTIM
+ * beacon. Maximum modem sleep is used when no controller is connected.
+ *
+ * A bridge with CONFIG_FAN_LINK_BRIDGE keeps modem sleep off altogether. The
+ * access point doesn't buffer ESP-NOW frames, so a sleeping radio would miss
+ * what its satellites send.
+ * 
+ * @addtogroup Power
+ * @{
+ */
+
+#include <sdkconfig.h>  /* Project configuration */
+#include <esp_err.h>    /* ESP error handling */
+#include <esp_log.h>    /* ESP logging functions */
+#include <esp_pm.h>     /* Power management */
+#include <esp_sleep.h>  /* Light sleep wakeup sources */
+#include <esp_timer.h>  /* Write burst timer */
+#include <app_wifi.h>   /* Wi-Fi power save profiles */
+
+#include "main.h"
+#include "power.h"
+
+/** Whether modem sleep has to stay off, satellites can send at any time */
+#ifdef CONFIG_FAN_LINK_BRIDGE
+#define POWER_RADIO_ALWAYS_ON true
+#else
+#define POWER_RADIO_ALWAYS_ON false
+#endif
+
+/** Tag used for ESP logging */
+static const char *TAG = "Power";
+
+#ifdef CONFIG_FAN_WIFI_PS_AUTO
+/** Number of uSecs in a mSec */
+#define NUM_USEC_IN_MSEC 1000
+
+/** Timer ending a write burst */
+static esp_timer_handle_t burst_timer;
+
+/** Whether a controller is writing */
+static volatile bool in_burst = false;
+
+/** Number of controller sessions open */
+static volatile int num_controllers = 0;
+
+/**
+ * @brief Switch to the profile for the current HomeKit activity.
+ */
+static void apply_profile(void)
+{
+    app_wifi_ps_profile_t profile = APP_WIFI_PS_MAX_MODEM;
+
+    if (in_burst || POWER_RADIO_ALWAYS_ON)
+    {
+        profile = APP_WIFI_PS_NONE;
+    }
+    else if (num_controllers > 0)
+    {
+        profile = APP_WIFI_PS_MIN_MODEM;
+    }
+
+    if (ESP_OK != app_wifi_set_ps_profile(profile))
+    {
+        ESP_LOGW(TAG, "Failed to switch Wi-Fi power save profile");
+    }
+}
+
+/**
+ * @brief Callback for the end of a write burst.
+ * @param args [in] Unused
+ */
+static void burst_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    in_burst = false;
+    apply_profile();
+}
+#endif /* CONFIG_FAN_WIFI_PS_AUTO */
+
+/**
+ * @brief   Initializer for the Power component.
+ * @note    Needs Wi-Fi initialized, so call after HomeKit_init().
+ */
+void Power_init(void)
+{
+#if CONFIG_FAN_LIGHT_SLEEP
+    /* Scale down to the crystal frequency when idle, and light sleep if possible */
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz       = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz       = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+
+    /* The buttons and IR sensor have already enabled wakeup on their pins */
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+#endif
+
+#ifdef CONFIG_FAN_WIFI_PS_AUTO
+    const esp_timer_create_args_t timer_args = {
+        .callback        = burst_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "ps_burst",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &burst_timer));
+
+    /* Controllers may have connected already, they are counted from HomeKit_init() on */
+    apply_profile();
+#elif !defined(CONFIG_FAN_HAP_BLE) && !defined(CONFIG_FAN_HAP_THREAD)
+    /* Only wake the radio for DTIM beacons, HomeKit stays reachable */
+    ESP_ERROR_CHECK(app_wifi_set_ps_profile(POWER_RADIO_ALWAYS_ON ? APP_WIFI_PS_NONE : APP_WIFI_PS_MIN_MODEM));
+#endif
+
+    ESP_LOGI(TAG, "Power component init!");
+}
+
+/**
+ * @brief   Note a write from a HomeKit controller.
+ * @details Keeps the radio awake until no write has come in for
+ *          CONFIG_FAN_WIFI_PS_BURST_HOLD_MS.
+ */
+void Power_hap_write(void)
+{
+#ifdef CONFIG_FAN_WIFI_PS_AUTO
+    if (NULL == burst_timer)
+    {
+        return;
+    }
+
+    if (!in_burst)
+    {
+        in_burst = true;
+        apply_profile();
+    }
+
+    esp_timer_stop(burst_timer);
+    esp_timer_start_once(burst_timer, (uint64_t) CONFIG_FAN_WIFI_PS_BURST_HOLD_MS * NUM_USEC_IN_MSEC);
+#endif
+}
+
+/**
+ * @brief Note a HomeKit controller session opening or closing.
+ * @param connected True if a session opened, false if one closed
+ */
+void Power_hap_session(bool connected)
+{
+#ifdef CONFIG_FAN_WIFI_PS_AUTO
+    if (connected)
+    {
+        num_controllers++;
+    }
+    else if (num_controllers > 0)
+    {
+        num_controllers--;
+    }
+
+    /* Before Power_init() the profile is applied there */
+    if (NULL != burst_timer && !in_burst)
+    {
+        apply_profile();
+    }
+#else
+    UNUSED_PARAM(connected);
+#endif
+}
+
+/** @} end Power */
@@ -0,0 +1,23 @@
+/**
+ * @file power.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep the fan's idle power draw down.
+ * 
+ * @addtogroup Power
+ * @{
+ */
+
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h> /* Boolean types */
+
+/** Public functions for the Power component */
+void Power_init(void);
+void Power_hap_write(void);
+void Power_hap_session(bool connected);
+
+#endif /* POWER_H */
+
+/** @} end Power */
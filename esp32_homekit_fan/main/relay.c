@@ -13,93 +13,645 @@
  *
  * All the relays are configured as active-low, meaning that when they receive a
  * logic low signal they let the electrons flow!
+ *
+ * Relays are mechanical, so they need a little time after switching before the
+ * contacts stop bouncing. Rather than having callers sleep a fixed amount after
+ * every event, this component tracks the level of each relay and only schedules
+ * a settle deadline when a relay actually changes. Speed changes also enforce a
+ * short break-before-make dead time so two motor windings are never energized
+ * at the same time.
+ *
+ * The relays of each fan are treated as a single bank. Each speed maps to a
+ * precomputed pin bitmask, and relays are released or engaged with one write
+ * to the GPIO set/clear registers. That makes each step of a transition
+ * atomic, with no window where the bank sits in some intermediate state. When
+ * bridging several fans, every fan has its own bank, built from its row of
+ * g_Fan_gpio_maps, and its own ramp.
+ *
+ * Jumping straight from off to the highest speed draws a big inrush current
+ * and makes the motor spin up audibly. So speeding up ramps through each of
+ * the speeds in between, dwelling on each for CONFIG_FAN_RAMP_DWELL_MS. Slowing
+ * down or turning off goes straight to the new speed. Ramps (and the dead time)
+ * are driven by an esp_timer per fan rather than delays in the event handler, so
+ * a new speed can retarget or cut short a ramp already in progress.
+ *
+ * With power management enabled, a PM lock keeps the chip out of light sleep
+ * for as long as a transition is running, so the dead time and dwell timing
+ * stay accurate. It is released again as soon as the ramp reaches its target.
+ *
+ * For benchmarking the event pipeline, the relays can be put in a dry run.
+ * Banks and ramps are tracked as usual, but nothing is written to the pins
+ * and there's no settle time to wait out. Leaving the dry run writes the pins
+ * to whatever the banks ended up at.
+ *
+ * Every relay counts its switching, to show how much event coalescing and
+ * ramping actually save. Each engagement is a cycle, and the lifetime cycle
+ * counts are kept in NVS with the write-behind state saving. The lifetime
+ * against CONFIG_FAN_RELAY_RATED_CYCLES gives a wear estimate. The time
+ * between switches of each relay goes into a histogram, where a pile-up in the
+ * shortest buckets means chatter. Dry runs only count the cycles they would
+ * have caused, since no contacts move.
  * 
  * @addtogroup Relay
  * @{
  */
 
-#include <stdbool.h>     /* Boolean type */
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <string.h>            /* memset, memcpy */
 
-#include <esp_log.h>     /* ESP logging functions */
-#include <driver/gpio.h> /* ESP GPIO-related functions */
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <esp_pm.h>            /* Power management locks */
+#include <driver/gpio.h>       /* ESP GPIO-related functions */
+#include <soc/soc.h>           /* Register access helpers */
+#include <soc/gpio_reg.h>      /* GPIO set/clear register addresses */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Definitions for task delays */
+#include <hap_platform_trace.h> /* Optional trace points */
 
 #include "main.h"
 #include "relay.h"
+#include "storage.h"
+
+/** The set/clear registers only cover the first 32 GPIOs */
+_Static_assert(FAN_SPEED1_RELAY_GPIO < 32 && FAN_SPEED2_RELAY_GPIO < 32 &&
+               FAN_SPEED3_RELAY_GPIO < 32 && FAN_SPEED4_RELAY_GPIO < 32 &&
+               FAN_OSC_RELAY_GPIO < 32, "Relay bank must live in GPIO 0-31");
 
-/** Total number of speed-related relays */
-#define NUM_SPEED_RELAY 4
-/** Total number of relays */
-#define NUM_TOTAL_RELAY 5
+/** Number of uSecs in a mSec */
+#define NUM_USEC_IN_MSEC 1000
+/** Time (in uSec) a relay's contacts need to settle after switching */
+#define RELAY_SETTLE_TIME_US (20 * NUM_USEC_IN_MSEC)
+/** Dead time (in uSec) between releasing one speed relay and engaging another */
+#define RELAY_DEAD_TIME_US   (10 * NUM_USEC_IN_MSEC)
+/** Time (in uSec) spent on each intermediate speed while ramping up */
+#define RELAY_RAMP_DWELL_US  ((int64_t) CONFIG_FAN_RAMP_DWELL_MS * NUM_USEC_IN_MSEC)
+
+/** Upper bound (in uSec) of each bucket of time between switches, but the last */
+static const int64_t interval_bounds_us[NUM_RELAY_INTERVAL - 1] = {
+    100LL * NUM_USEC_IN_MSEC,
+    1000LL * NUM_USEC_IN_MSEC,
+    10000LL * NUM_USEC_IN_MSEC,
+    60000LL * NUM_USEC_IN_MSEC,
+    600000LL * NUM_USEC_IN_MSEC,
+    3600000LL * NUM_USEC_IN_MSEC,
+};
+
+/** Enum for where the speed ramp is at */
+enum Ramp_phase
+{
+    RAMP_IDLE = 0,  /** Sitting at the target speed */
+    RAMP_DEAD_TIME, /** Speed relays released, waiting to engage the next one */
+    RAMP_DWELL,     /** Dwelling on an intermediate speed */
+};
+
+/** Struct for the switching counters of one relay */
+typedef struct Relay_counter_t
+{
+    uint32_t mask;                          /** Pin of the relay in its bank */
+    uint32_t saved_cycles;                  /** Lifetime cycles as of boot */
+    uint32_t boot_cycles;                   /** Cycles since boot */
+    uint32_t dry_run_cycles;                /** Cycles skipped by dry runs */
+    int64_t  last_switch_us;                /** Time (in uSec) it last switched */
+    uint32_t intervals[NUM_RELAY_INTERVAL]; /** Histogram of time between switches */
+} Relay_counter_t;
+
+/** Struct for the relay bank and speed ramp of one fan */
+typedef struct Relay_bank_t
+{
+    uint32_t           speed_masks[NUM_SPEED]; /** Speed relay to engage for each speed */
+    uint32_t           speed_mask;             /** Every speed relay */
+    uint32_t           osc_mask;               /** Oscillation relay */
+    uint32_t           engaged_mask;           /** Relays currently engaged (driven low) */
+    uint32_t           pins_engaged;           /** Relays the pins engage, lags engaged_mask in a dry run */
+    Relay_counter_t    relays[NUM_RELAY];      /** Switching counters of each relay */
+    bool               cycles_dirty;           /** Whether cycles were added since the last save */
+    int64_t            last_switch_us;         /** Time (in uSec) a relay last switched */
+    enum Ramp_phase    ramp_phase;             /** Where the speed ramp is at */
+    enum State_speed   ramp_speed;             /** Last engaged speed */
+    enum State_speed   ramp_target;            /** Speed being ramped to */
+    esp_timer_handle_t ramp_timer;             /** Timer driving the ramp and dead time */
+} Relay_bank_t;
 
 /** Tag used for ESP logging */
 static const char *TAG = "Relay";
 
-/** Array to help with mass-setting GPIO pins for speed relays */
-static gpio_num_t relays[] = {
-    FAN_SPEED1_RELAY_GPIO,
-    FAN_SPEED2_RELAY_GPIO,
-    FAN_SPEED3_RELAY_GPIO,
-    FAN_SPEED4_RELAY_GPIO,
-    FAN_OSC_RELAY_GPIO
-};
+/** Relay bank of every fan */
+static Relay_bank_t banks[FAN_NUM_FANS];
+
+/** Time (in uSec) at which every switched relay will have settled */
+static int64_t settle_deadline_us;
+
+/** Lock for the relay banks and ramp states, shared with the ramp timers */
+static portMUX_TYPE relay_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/** Whether the pins are left alone, see Relay_set_dry_run() */
+static bool dry_run;
+
+#if CONFIG_PM_ENABLE
+/** PM lock held while any transition is running, taken once per ramp */
+static esp_pm_lock_handle_t pm_lock;
+#endif
 
 /**
- * @brief   Sets the speed relays according to a given speed.
- * @details Starts out by clearing all relays so the fan turns off. Then, bins
- *          the speed in order to determine which relay to activate.
- * @param   speed Speed to write.
+ * @brief  Block the calling task until a given point in time.
+ * @param  deadline_us Time (in uSec, esp_timer base) to wait until.
+ */
+static void wait_until(int64_t deadline_us)
+{
+    int64_t remaining_us = deadline_us - esp_timer_get_time();
+    if (remaining_us <= 0)
+    {
+        /* Already there, nothing to wait for */
+        return;
+    }
+
+    /* Round up to whole ticks so we never wake up early */
+    TickType_t ticks = (TickType_t) ((remaining_us + (portTICK_PERIOD_MS * NUM_USEC_IN_MSEC) - 1) /
+                                     (portTICK_PERIOD_MS * NUM_USEC_IN_MSEC));
+    vTaskDelay(ticks);
+}
+
+/**
+ * @brief  Get the bank mask for a relay pin.
+ * @param  gpio Pin of the relay, GPIO_NUM_NC if not wired
+ * @return Mask for the pin, zero if it isn't wired or doesn't fit the bank.
+ */
+static uint32_t pin_mask(gpio_num_t gpio)
+{
+    if (GPIO_NUM_NC == gpio)
+    {
+        return 0;
+    }
+    if ((int) gpio >= 32)
+    {
+        ESP_LOGE(TAG, "GPIO %d is outside the relay bank, leaving it unused", (int) gpio);
+        return 0;
+    }
+
+    return BIT(gpio);
+}
+
+/**
+ * @brief Note that relays of a fan just switched, pushing out the settle deadline.
+ * @param bank [in,out] Bank that switched
  */
-void Relay_write_speed(enum State_speed speed)
+static void mark_switched(Relay_bank_t *bank)
 {
-    if (g_Fan_state.speed == speed && true == g_Fan_state.on)
+    bank->last_switch_us = esp_timer_get_time();
+    if (dry_run)
+    {
+        /* No contacts moved, nothing to settle */
+        return;
+    }
+
+    int64_t deadline_us = bank->last_switch_us + RELAY_SETTLE_TIME_US;
+    if (deadline_us > settle_deadline_us)
+    {
+        settle_deadline_us = deadline_us;
+    }
+}
+
+/**
+ * @brief  Count relays of a fan that just switched.
+ * @note   Call with relay_lock held, after engaged_mask is updated.
+ * @param  bank    [in,out] Bank the relays belong to
+ * @param  changed Relays that switched.
+ */
+static void count_switches(Relay_bank_t *bank, uint32_t changed)
+{
+    int64_t now_us = esp_timer_get_time();
+
+    for (int i = 0; i < NUM_RELAY; i++)
+    {
+        Relay_counter_t *relay   = &bank->relays[i];
+        bool             engaged = (0 != (bank->engaged_mask & relay->mask));
+
+        if (0 == (changed & relay->mask))
+        {
+            continue;
+        }
+
+        if (dry_run)
+        {
+            relay->dry_run_cycles += (engaged) ? 1 : 0;
+            continue;
+        }
+
+        if (0 != relay->last_switch_us)
+        {
+            int64_t gap_us = now_us - relay->last_switch_us;
+            int     bucket = 0;
+            while (bucket < NUM_RELAY_INTERVAL - 1 && gap_us >= interval_bounds_us[bucket])
+            {
+                bucket++;
+            }
+            relay->intervals[bucket]++;
+        }
+        relay->last_switch_us = now_us;
+
+        if (engaged)
+        {
+            relay->boot_cycles++;
+            bank->cycles_dirty = true;
+        }
+    }
+}
+
+/**
+ * @brief Queue up the lifetime cycles of a fan for saving, if any were added.
+ * @note  Call without relay_lock held.
+ * @param fan Fan to save
+ */
+static void save_cycles(uint8_t fan)
+{
+    Relay_bank_t *bank = &banks[fan];
+    uint32_t      cycles[NUM_RELAY];
+
+    portENTER_CRITICAL(&relay_lock);
+    bool dirty = bank->cycles_dirty;
+    bank->cycles_dirty = false;
+    for (int i = 0; i < NUM_RELAY; i++)
+    {
+        cycles[i] = bank->relays[i].saved_cycles + bank->relays[i].boot_cycles;
+    }
+    portEXIT_CRITICAL(&relay_lock);
+
+    if (dirty)
+    {
+        Storage_save_cycles_later(fan, cycles);
+    }
+}
+
+/**
+ * @brief  Release a set of relays in a single register write.
+ * @note   Call with relay_lock held.
+ * @param  bank [in,out] Bank the relays belong to
+ * @param  mask Relays to release, already-released ones are ignored.
+ * @return Whether any relay actually switched.
+ */
+static bool bank_release(Relay_bank_t *bank, uint32_t mask)
+{
+    mask &= bank->engaged_mask;
+    if (0 == mask)
     {
         /* Nothing to do! */
+        return false;
+    }
+
+    /* Active-low, so releasing means driving high */
+    bank->engaged_mask &= ~mask;
+    if (!dry_run)
+    {
+        REG_WRITE(GPIO_OUT_W1TS_REG, mask);
+        bank->pins_engaged = bank->engaged_mask;
+    }
+
+    mark_switched(bank);
+    count_switches(bank, mask);
+    return true;
+}
+
+/**
+ * @brief  Engage a set of relays in a single register write.
+ * @note   Call with relay_lock held.
+ * @param  bank [in,out] Bank the relays belong to
+ * @param  mask Relays to engage, already-engaged ones are ignored.
+ * @return Whether any relay actually switched.
+ */
+static bool bank_engage(Relay_bank_t *bank, uint32_t mask)
+{
+    mask &= ~bank->engaged_mask;
+    if (0 == mask)
+    {
+        /* Nothing to do! */
+        return false;
+    }
+
+    /* Active-low, so engaging means driving low */
+    bank->engaged_mask |= mask;
+    if (!dry_run)
+    {
+        REG_WRITE(GPIO_OUT_W1TC_REG, mask);
+        bank->pins_engaged = bank->engaged_mask;
+    }
+
+    mark_switched(bank);
+    count_switches(bank, mask);
+    return true;
+}
+
+/**
+ * @brief  Move the speed ramp of a fan to a new phase.
+ * @details Holds the PM lock for as long as the ramp is away from idle. The
+ *          lock counts, so every fan ramping holds it once.
+ * @note   Call with relay_lock held.
+ * @param  bank  [in,out] Bank of the fan
+ * @param  phase Phase to move to.
+ */
+static void ramp_set_phase(Relay_bank_t *bank, enum Ramp_phase phase)
+{
+#if CONFIG_PM_ENABLE
+    if (RAMP_IDLE == bank->ramp_phase && RAMP_IDLE != phase)
+    {
+        (void) esp_pm_lock_acquire(pm_lock);
+    }
+    else if (RAMP_IDLE != bank->ramp_phase && RAMP_IDLE == phase)
+    {
+        (void) esp_pm_lock_release(pm_lock);
+    }
+#endif
+
+    bank->ramp_phase = phase;
+}
+
+/**
+ * @brief  Work out the next speed to step to on the way to the target.
+ * @param  bank [in] Bank of the fan
+ * @return Next speed, one above the current when ramping up, else the target.
+ */
+static enum State_speed ramp_next_speed(const Relay_bank_t *bank)
+{
+    if (RELAY_RAMP_DWELL_US > 0 && bank->ramp_target > bank->ramp_speed + 1)
+    {
+        /* Ramping up, go through every speed in between */
+        return (SPEED_OFF == bank->ramp_speed) ? SPEED_1 : bank->ramp_speed + 1;
+    }
+
+    return bank->ramp_target;
+}
+
+/**
+ * @brief  Engage a speed, then dwell on it if the ramp isn't done yet.
+ * @note   Call with relay_lock held.
+ * @param  bank  [in,out] Bank of the fan
+ * @param  speed Speed to engage.
+ */
+static void ramp_engage(Relay_bank_t *bank, enum State_speed speed)
+{
+    (void) bank_engage(bank, bank->speed_masks[speed]);
+    bank->ramp_speed = speed;
+
+    if (bank->ramp_speed != bank->ramp_target)
+    {
+        ramp_set_phase(bank, RAMP_DWELL);
+        (void) esp_timer_start_once(bank->ramp_timer, RELAY_RAMP_DWELL_US);
+    }
+    else
+    {
+        ramp_set_phase(bank, RAMP_IDLE);
+    }
+}
+
+/**
+ * @brief   Take the next step of the speed ramp.
+ * @details Releases every speed relay other than the next one needed. If any
+ *          relay was released, the new one is only engaged once the
+ *          break-before-make dead time has passed.
+ * @note    Call with relay_lock held.
+ * @param   bank [in,out] Bank of the fan
+ */
+static void ramp_step(Relay_bank_t *bank)
+{
+    enum State_speed next   = ramp_next_speed(bank);
+    uint32_t         target = bank->speed_masks[next];
+
+    /* Release every speed relay we don't need */
+    bool released = bank_release(bank, bank->speed_mask & ~target);
+
+    if (0 == (target & ~bank->engaged_mask))
+    {
+        /* Nothing (else) to engage */
+        bank->ramp_speed = next;
+        ramp_set_phase(bank, RAMP_IDLE);
         return;
     }
 
-    ESP_LOGI(TAG, "Relay writing speed: %d", speed);
-    
-    /* Disable all speed relays */
-    for (int i = 0; i < NUM_SPEED_RELAY; i++)
+    if (released)
     {
-        gpio_set_level(relays[i], GPIO_HIGH);
+        /* Break-before-make, let the released contacts open fully */
+        ramp_set_phase(bank, RAMP_DEAD_TIME);
+        (void) esp_timer_start_once(bank->ramp_timer, RELAY_DEAD_TIME_US);
+        return;
     }
 
-    /* Figure out which relay to turn on */
-    gpio_num_t gpio_num;
-    switch (speed)
+    ramp_engage(bank, next);
+}
+
+/**
+ * @brief   Timer callback for the speed ramp.
+ * @details Either the dead time or a dwell just ended. After the dead time,
+ *          engages whatever the ramp wants now (the target may have changed
+ *          in the meantime). After a dwell, takes the next step.
+ * @param   args [in] Bank of the fan
+ */
+static void ramp_callback(void *args)
+{
+    Relay_bank_t *bank = (Relay_bank_t *) args;
+
+    portENTER_CRITICAL(&relay_lock);
+    if (RAMP_DEAD_TIME == bank->ramp_phase)
+    {
+        enum State_speed next = ramp_next_speed(bank);
+        if (SPEED_OFF == next)
+        {
+            bank->ramp_speed = SPEED_OFF;
+            ramp_set_phase(bank, RAMP_IDLE);
+        }
+        else
+        {
+            ramp_engage(bank, next);
+        }
+    }
+    else if (RAMP_DWELL == bank->ramp_phase)
+    {
+        ramp_set_phase(bank, RAMP_IDLE);
+        ramp_step(bank);
+    }
+    portEXIT_CRITICAL(&relay_lock);
+
+    save_cycles((uint8_t) (bank - banks));
+}
+
+/**
+ * @brief   Sets the speed relays of a fan according to a given speed.
+ * @details Retargets the speed ramp. Slowing down, or turning off, happens
+ *          right away and cuts short any ramp in progress. Speeding up starts
+ *          a ramp, or carries on with the one already running.
+ * @param   fan   Fan to write
+ * @param   speed Speed to write.
+ */
+void Relay_write_speed(uint8_t fan, enum State_speed speed)
+{
+    if (fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    if ((unsigned) speed >= NUM_SPEED)
     {
-        case SPEED_OFF:
-            /* Simply return, don't turn any back on */
-            return;
-        case SPEED_1:
-            gpio_num = FAN_SPEED1_RELAY_GPIO;
-            break;
-        case SPEED_2:
-            gpio_num = FAN_SPEED2_RELAY_GPIO;
-            break;
-        case SPEED_3:
-            gpio_num = FAN_SPEED3_RELAY_GPIO;
-            break;
-        case SPEED_4:
-            gpio_num = FAN_SPEED4_RELAY_GPIO;
-            break;
-        default:
-            ESP_LOGW(TAG, "Invalid speed provided, leaving all off...");
-            return;
+        ESP_LOGW(TAG, "Invalid speed provided, leaving all off...");
+        speed = SPEED_OFF;
     }
-    
-    /* Turn on the relay associated with the provided speed */
-    gpio_set_level(gpio_num, GPIO_LOW);
+
+    ESP_LOGI(TAG, "Relay writing speed: %d (fan %u)", speed, (unsigned) fan);
+    HAP_TRACE_BEGIN(HAP_TRACE_APP_ACTUATE, speed);
+
+    Relay_bank_t *bank = &banks[fan];
+
+    portENTER_CRITICAL(&relay_lock);
+    bank->ramp_target = speed;
+    if (RAMP_IDLE == bank->ramp_phase || (RAMP_DWELL == bank->ramp_phase && speed <= bank->ramp_speed))
+    {
+        /* Nothing to wait on, or the dwell is no longer wanted */
+        (void) esp_timer_stop(bank->ramp_timer);
+        ramp_set_phase(bank, RAMP_IDLE);
+        ramp_step(bank);
+    }
+    /* Otherwise the ramp timer picks up the new target when it fires */
+    portEXIT_CRITICAL(&relay_lock);
+    save_cycles(fan);
+    HAP_TRACE_END(HAP_TRACE_APP_ACTUATE, speed);
 }
 
 /**
- * @brief Sets the oscillation relay according to a given bool.
+ * @brief Sets the oscillation relay of a fan according to a given bool.
+ * @param fan       Fan to write
  * @param oscillate Whether to enable oscillation
  */
-void Relay_write_oscillate(bool oscillate)
+void Relay_write_oscillate(uint8_t fan, bool oscillate)
+{
+    if (fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    Relay_bank_t *bank = &banks[fan];
+
+    portENTER_CRITICAL(&relay_lock);
+    if (oscillate)
+    {
+        (void) bank_engage(bank, bank->osc_mask);
+    }
+    else
+    {
+        (void) bank_release(bank, bank->osc_mask);
+    }
+    portEXIT_CRITICAL(&relay_lock);
+    save_cycles(fan);
+}
+
+/**
+ * @brief   Wait for any recently switched relays to settle.
+ * @details Returns immediately if no relay of any fan has switched within the
+ *          settle time, otherwise blocks only for the remainder of it.
+ */
+void Relay_wait_settled(void)
+{
+    wait_until(settle_deadline_us);
+}
+
+/**
+ * @brief   Stop or resume writing the relay pins.
+ * @details While in a dry run every write is tracked but never reaches the
+ *          pins. Coming out of it, each bank's pins are written to match
+ *          what it tracked, so the relays land on the last state written.
+ * @param   enable Whether to start a dry run
+ */
+void Relay_set_dry_run(bool enable)
+{
+    portENTER_CRITICAL(&relay_lock);
+    bool resync = dry_run && !enable;
+
+    dry_run = enable;
+    if (resync)
+    {
+        for (int fan = 0; fan < FAN_NUM_FANS; fan++)
+        {
+            Relay_bank_t *bank    = &banks[fan];
+            uint32_t      changed = bank->pins_engaged ^ bank->engaged_mask;
+
+            REG_WRITE(GPIO_OUT_W1TS_REG, (bank->speed_mask | bank->osc_mask) & ~bank->engaged_mask);
+            REG_WRITE(GPIO_OUT_W1TC_REG, bank->engaged_mask);
+            bank->pins_engaged = bank->engaged_mask;
+            mark_switched(bank);
+            count_switches(bank, changed);
+        }
+    }
+    portEXIT_CRITICAL(&relay_lock);
+
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        save_cycles(fan);
+    }
+
+    ESP_LOGI(TAG, "Relay dry run %s", (enable) ? "started" : "ended");
+}
+
+/**
+ * @brief  Get the time of the most recent relay switch of a fan.
+ * @param  fan Fan to check
+ * @return Time (in uSec, esp_timer base) a relay last switched, 0 if never.
+ */
+int64_t Relay_get_last_switch_us(uint8_t fan)
 {
-    gpio_set_level(FAN_OSC_RELAY_GPIO, (oscillate) ? GPIO_LOW : GPIO_HIGH);
+    return (fan < FAN_NUM_FANS) ? banks[fan].last_switch_us : 0;
+}
+
+/**
+ * @brief  Get the switching statistics of a relay.
+ * @param  fan   Fan the relay belongs to
+ * @param  relay Relay to get
+ * @param  stats [out] Statistics of the relay
+ * @return Whether the relay is wired, zeroed statistics if not.
+ */
+bool Relay_get_stats(uint8_t fan, enum Relay_index relay, Relay_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (fan >= FAN_NUM_FANS || (unsigned) relay >= NUM_RELAY)
+    {
+        return false;
+    }
+
+    const Relay_counter_t *counter = &banks[fan].relays[relay];
+
+    portENTER_CRITICAL(&relay_lock);
+    stats->cycles         = counter->saved_cycles + counter->boot_cycles;
+    stats->boot_cycles    = counter->boot_cycles;
+    stats->dry_run_cycles = counter->dry_run_cycles;
+    memcpy(stats->intervals, counter->intervals, sizeof(stats->intervals));
+    portEXIT_CRITICAL(&relay_lock);
+
+    stats->wear_permille = (uint32_t) (((uint64_t) stats->cycles * 1000) / CONFIG_FAN_RELAY_RATED_CYCLES);
+    return (0 != counter->mask);
+}
+
+/**
+ * @brief   Pick up the lifetime cycle counts of every relay.
+ * @details Call once Storage is up. Anything switched before then is added
+ *          on top and queued up for saving.
+ */
+void Relay_load_cycles(void)
+{
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        Relay_bank_t *bank = &banks[fan];
+        uint32_t      cycles[NUM_RELAY];
+
+        if (Storage_load_cycles(fan, cycles))
+        {
+            portENTER_CRITICAL(&relay_lock);
+            for (int i = 0; i < NUM_RELAY; i++)
+            {
+                bank->relays[i].saved_cycles = cycles[i];
+            }
+            portEXIT_CRITICAL(&relay_lock);
+        }
+
+        save_cycles(fan);
+    }
 }
 
 /**
@@ -109,13 +661,56 @@ void Relay_write_oscillate(bool oscillate)
  */
 void Relay_init(void)
 {
-    for (int i = 0; i < NUM_TOTAL_RELAY; i++)
+    uint32_t total_mask = 0;
+
+    /* Build each fan's bank from its pins */
+    for (int fan = 0; fan < FAN_NUM_FANS; fan++)
     {
-        esp_rom_gpio_pad_select_gpio(relays[i]);
-        gpio_set_direction(relays[i], GPIO_MODE_OUTPUT);
-        gpio_set_level(relays[i], GPIO_HIGH);
+        const Fan_gpio_map_t *map  = &g_Fan_gpio_maps[fan];
+        Relay_bank_t         *bank = &banks[fan];
+
+        bank->speed_masks[SPEED_OFF] = 0;
+        bank->speed_mask             = 0;
+        for (int speed = SPEED_1; speed <= SPEED_4; speed++)
+        {
+            bank->speed_masks[speed] = pin_mask(map->speed_relay[speed - SPEED_1]);
+            bank->speed_mask        |= bank->speed_masks[speed];
+            bank->relays[RELAY_SPEED_1 + speed - SPEED_1].mask = bank->speed_masks[speed];
+        }
+        bank->osc_mask               = pin_mask(map->osc_relay);
+        bank->relays[RELAY_OSC].mask = bank->osc_mask;
+        bank->engaged_mask           = 0;
+        bank->pins_engaged           = 0;
+        total_mask        |= bank->speed_mask | bank->osc_mask;
+
+        /* Make the timer that drives speed ramps */
+        esp_timer_create_args_t timer_args = {
+            .callback        = ramp_callback,
+            .arg             = bank,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name            = "relay_ramp",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &bank->ramp_timer));
     }
 
+    /* Drive the banks high first so nothing engages when outputs enable */
+    REG_WRITE(GPIO_OUT_W1TS_REG, total_mask);
+
+    gpio_config_t relay_cfg = {
+        .pin_bit_mask = total_mask,
+        .mode         = GPIO_MODE_OUTPUT,
+        .pull_up_en   = GPIO_PULLUP_DISABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type    = GPIO_INTR_DISABLE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&relay_cfg));
+
+    settle_deadline_us = 0;
+
+#if CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "relay", &pm_lock));
+#endif
+
     ESP_LOGI(TAG, "Relay component init!");
 }
 
@@ -12,12 +12,52 @@
 #define RELAY_H
 
 #include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
 
 #include "main.h"
 
+/** Enum for the relays in a fan's bank */
+enum Relay_index
+{
+    RELAY_SPEED_1 = 0, /** Speed 1 relay */
+    RELAY_SPEED_2,     /** Speed 2 relay */
+    RELAY_SPEED_3,     /** Speed 3 relay */
+    RELAY_SPEED_4,     /** Speed 4 relay */
+    RELAY_OSC,         /** Oscillation relay */
+    NUM_RELAY,
+};
+
+/** Enum for the buckets of time between two switches of a relay */
+enum Relay_interval
+{
+    RELAY_INTERVAL_100MS = 0, /** Under 100 mSec */
+    RELAY_INTERVAL_1S,        /** Under 1 Sec */
+    RELAY_INTERVAL_10S,       /** Under 10 Sec */
+    RELAY_INTERVAL_1MIN,      /** Under 1 Min */
+    RELAY_INTERVAL_10MIN,     /** Under 10 Min */
+    RELAY_INTERVAL_1H,        /** Under 1 Hour */
+    RELAY_INTERVAL_LONGER,    /** 1 Hour or more */
+    NUM_RELAY_INTERVAL,
+};
+
+/** Switching statistics of one relay */
+typedef struct Relay_stats_t
+{
+    uint32_t cycles;                        /** Times it engaged over its lifetime */
+    uint32_t boot_cycles;                   /** Times it engaged since boot */
+    uint32_t dry_run_cycles;                /** Times it would have engaged during dry runs */
+    uint32_t wear_permille;                 /** Lifetime cycles against the rated cycles */
+    uint32_t intervals[NUM_RELAY_INTERVAL]; /** Time between switches since boot */
+} Relay_stats_t;
+
 /** Public functions for the Relay component */
-void Relay_write_speed(enum State_speed speed);
-void Relay_write_oscillate(bool oscillate);
+void Relay_write_speed(uint8_t fan, enum State_speed speed);
+void Relay_write_oscillate(uint8_t fan, bool oscillate);
+void Relay_wait_settled(void);
+void Relay_set_dry_run(bool enable);
+int64_t Relay_get_last_switch_us(uint8_t fan);
+bool Relay_get_stats(uint8_t fan, enum Relay_index relay, Relay_stats_t *stats);
+void Relay_load_cycles(void);
 void Relay_init(void);
 
 #endif /* RELAY_H */
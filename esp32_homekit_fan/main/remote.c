@@ -18,20 +18,77 @@
  * be processed by the remote handler task in this file. This will attempt to
  * parse incoming data and extract a remote command. If one is found, it packed
  * into an event and enqueued for the main event handler to process.
+ *
+ * With CONFIG_FAN_REMOTE_DECODE_IN_ISR, the callback decodes the symbols itself
+ * and posts events straight to the main event queue, so there's no remote task
+ * or local queue at all. The decoder is small enough that this costs only a
+ * few uSec in the ISR.
+ *
+ * Decoding itself lives in the IrDecoder component, which knows about several
+ * protocols. This file only maps decoded codes onto fan events.
+ *
+ * A capture ends once the IR has been idle for longer than any mark or space a
+ * frame can hold. Until a frame decodes that's the longest of every protocol,
+ * the NEC header, after which it narrows to the longest of the protocol the
+ * remote actually speaks. Each frame then comes through on its own as soon as
+ * it's over, rather than once a held button has filled the buffer with
+ * repeats. A capture holding no frame widens it again, so a different remote
+ * still gets through on its next frame. Captures following on within
+ * REMOTE_REPEAT_GAP_US are decoded as carrying on from the last one, which
+ * keeps the repeats of a held button from counting as new presses.
+ *
+ * An enabled RMT channel keeps the chip out of light sleep. So with
+ * CONFIG_FAN_LIGHT_SLEEP, the channel is disabled once IR has been quiet for
+ * REMOTE_IDLE_US, and the sensor pin is armed as a GPIO wakeup source instead.
+ * The first IR edge wakes the chip and re-enables the channel. Whatever part of
+ * the first frame arrives before then is lost, but remotes repeat the frame for
+ * as long as a button is down, so the press still comes through.
+ *
+ * With CONFIG_FAN_REMOTE_CAPTURE, every piece the remote task parses is also
+ * printed to the console as raw symbol words. tools/ir_replay.c feeds a saved
+ * log back through the decoder on the host, for tuning its timings against
+ * real remotes.
+ *
+ * With CONFIG_FAN_REMOTE_LEARNING, other remotes can be taught to the fan.
+ * Holding the oscillation button starts learning mode, and the next new code
+ * received is bound to each event in turn (power, oscillation, timer, speed,
+ * temperature), with a blink of the built-in LED for each. Learned codes are
+ * kept in a small open-addressed hash table, loaded from NVS on boot, so the
+ * lookup costs the same however many there are.
+ *
+ * With CONFIG_FAN_REMOTE_CALIBRATION, the decoder learns how far the remote's
+ * timings are off. The learned scales are saved to NVS a while after they
+ * change, so a run of presses costs a single write, and loaded again on boot.
  * 
  * @addtogroup Remote
  * @{
  */
 
+#include <stdio.h>             /* Printing raw captures */
+#include <string.h>            /* Memory copies */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_attr.h>          /* Extra function attributes (IRAM_ATTR) */
+#include <esp_idf_version.h>   /* ESP-IDF version checks */
 #include <esp_log.h>           /* ESP logging functions */
+#include <esp_timer.h>         /* High-resolution timestamps */
 #include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
 #include <freertos/task.h>     /* Definitions for creating tasks */
 #include <freertos/queue.h>    /* Definitions for inter-task queues */
 #include <freertos/projdefs.h> /* Special FreeRTOS definitions */
 #include <driver/rmt_rx.h>     /* ESP RMT receiver-related functions */
+#include <driver/gpio.h>       /* ESP GPIO-related functions */
+
+#if defined(CONFIG_FAN_REMOTE_CALIBRATION) || defined(CONFIG_FAN_REMOTE_LEARNING)
+#include <nvs.h>               /* NVS read/write functions */
+#endif
 
 #include "main.h"
 #include "remote.h"
+#include "event_queue.h"
+#include "watchdog.h"
+#include "ir_decoder.h"
+#include "led.h"
 
 /** Infrared codes for our remote */
 #define IR_CODE_POWER          0x13F
@@ -40,8 +97,8 @@
 #define IR_CODE_TIME           0x13E
 #define IR_CODE_TEMPERATURE    0x12F
 
-/** Expected number of RMT symbols in a Lasko IR code */
-#define NUM_SYMBOL_EXPECTED       11
+/** Most frames we expect to decode out of a single capture */
+#define MAX_FRAMES_PER_CAPTURE   8
 
 /** Resolution that the RMT will operate at, 1MHz resolution, 1 tick = 1us */
 #define RMT_IR_RESOLUTION_HZ 1000000
@@ -49,17 +106,70 @@
 /** Amount of RMT symbols that our channel can store at a time */
 #define RMT_MAX_MEM_SYMBOLS       48
 
-/** Margin of error for identifying durations */
-#define DURATION_ERROR_MARGIN    200
+/** Amount of RMT symbols handed to the parsing task at a time */
+#define RMT_RX_BUFFER_SYMBOLS     (2 * RMT_MAX_MEM_SYMBOLS)
+
+/** Number of buffers to ping-pong received symbols between */
+#define REMOTE_NUM_CHUNKS         2
+
+/** Time (in uSec) between held events while a button is held down */
+#define REMOTE_HOLD_INTERVAL_US   400000
+
+/** Idle time (in uSec) past the longest duration in a frame that ends a capture */
+#define REMOTE_FRAME_END_MARGIN_US 500
+
+/** Time (in uSec) between captures within which the second repeats the first */
+#define REMOTE_REPEAT_GAP_US      200000
+
+/** Time (in uSec) without IR before the receiver is disabled to allow sleep */
+#define REMOTE_IDLE_US            2000000
+
+/** NVS namespace and key for the learned IR timing scales */
+#define REMOTE_CAL_NAMESPACE      "fan"
+#define REMOTE_CAL_KEY            "ir_cal"
+
+/** Time (in uSec) after a timing scale changes before it is saved */
+#define REMOTE_CAL_SAVE_DELAY_US  60000000
+
+/** NVS key for the table of learned codes, in the same namespace */
+#define REMOTE_LEARN_KEY          "ir_learn"
+
+/** Number of slots in the learned code table, a power of two */
+#define REMOTE_LEARN_BITS         5
+#define REMOTE_LEARN_SLOTS        (1 << REMOTE_LEARN_BITS)
 
-/** Two lengths of durations to identify pulses */
-#define DURATION_SHORT           400
-#define DURATION_LONG           1200
+/** Most codes learned at once, keeping probe sequences short */
+#define REMOTE_LEARN_MAX          (REMOTE_LEARN_SLOTS * 3 / 4)
+
+/** Time (in uSec) learning mode waits for each code before giving up */
+#define REMOTE_LEARN_TIMEOUT_US   15000000
+
+/**
+ * Newer ESP-IDF releases can stream a long capture out in pieces rather than
+ * truncating it once the buffer fills, which is exactly what a held button
+ * produces. Older releases get a single piece per capture.
+ */
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+#define REMOTE_PARTIAL_RX         1
+#define REMOTE_IS_LAST(edata)     ((edata)->flags.is_last)
+#else
+#define REMOTE_PARTIAL_RX         0
+#define REMOTE_IS_LAST(edata)     (true)
+#endif
+
+/** Decoding in the receive callback needs everything it touches in IRAM */
+#ifdef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+#define REMOTE_ATTR               IRAM_ATTR
+#define REMOTE_DATA               DRAM_ATTR
+#else
+#define REMOTE_ATTR
+#define REMOTE_DATA
+#endif
 
 /** Arguments for creating the main event handler task */
 #define REMOTE_HANDLER_NAME      "RemoteHandler"
 #define REMOTE_HANDLER_STACKSIZE       4 * 1024
-#define REMOTE_HANDLER_PRIORITY               1
+#define REMOTE_HANDLER_PRIORITY  FAN_IO_PRIORITY
 
 /** Tag used for ESP logging */
 static const char *TAG = "Remote";
@@ -70,160 +180,697 @@ static rmt_receive_config_t receive_config;
 /** Handle for our RMT receiver channel */
 static rmt_channel_handle_t rx_channel;
 
+#ifndef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+/** Struct for a piece of a capture handed to the parsing task */
+typedef struct Remote_chunk_t
+{
+    const rmt_symbol_word_t *symbols; /** Received symbols */
+    size_t num_symbols;               /** Number of symbols received */
+    bool continued;                   /** Whether this carries on from the last piece */
+} Remote_chunk_t;
+
 /** Local queue for passing received RMT symbols to our parsing task */
 static QueueHandle_t receive_queue;
 
+#ifdef CONFIG_FAN_STATIC_ALLOCATION
+/** Storage for the receive queue and the remote handler task */
+static uint8_t       receive_queue_storage[REMOTE_NUM_CHUNKS * sizeof(Remote_chunk_t)];
+static StaticQueue_t receive_queue_buf;
+static StackType_t   remote_handler_stack[REMOTE_HANDLER_STACKSIZE];
+static StaticTask_t  remote_handler_tcb;
+#endif
+
+/** Ping-pong buffers, one is filled while the task parses the other */
+static rmt_symbol_word_t chunks[REMOTE_NUM_CHUNKS][RMT_RX_BUFFER_SYMBOLS];
+static size_t active_chunk;
+#endif /* CONFIG_FAN_REMOTE_DECODE_IN_ISR */
+
+/** Buffer the RMT driver receives into */
+static rmt_symbol_word_t rx_buffer[RMT_RX_BUFFER_SYMBOLS];
+
+/** Whether the capture in progress has already handed over a piece */
+static bool capture_continued;
+
+/** Time (in uSec) the last capture ended */
+static int64_t capture_end_us;
+
+/** Protocol of the last frame decoded, NUM_IR_PROTOCOL if the last capture had none */
+static enum Ir_protocol frame_protocol = NUM_IR_PROTOCOL;
+
+/** Time (in uSec) the last event was sent for a held button */
+static int64_t last_event_us;
+
+#ifdef CONFIG_FAN_LIGHT_SLEEP
+/** Timers to disable the receiver once IR goes quiet, and to enable it again */
+static esp_timer_handle_t idle_timer;
+static esp_timer_handle_t wake_timer;
+#endif
+
+#ifdef CONFIG_FAN_REMOTE_CALIBRATION
+/** Timer to save the learned timing scales */
+static esp_timer_handle_t cal_timer;
+#endif
+
+#ifdef CONFIG_FAN_REMOTE_LEARNING
+/** Struct for a learned code, as kept in the hash table */
+typedef struct Remote_learned_t
+{
+    uint32_t code;     /** Decoded code */
+    uint8_t  protocol; /** Protocol the code arrives in */
+    uint8_t  id;       /** Event to send for the code */
+    uint8_t  used;     /** Whether the slot holds a code */
+    uint8_t  reserved; /** Padding, kept zero */
+} Remote_learned_t;
+
+/** Table of learned codes, open-addressed with linear probing */
+static Remote_learned_t learned[REMOTE_LEARN_SLOTS];
+static size_t           num_learned;
+
+/** Learning mode state, the event the next code is bound to */
+static volatile bool learning;
+static enum Event_id learn_step;
+
+/** Frame received in learning mode, waiting to be bound by the learn timer */
+static Ir_frame_t    learn_frame;
+static volatile bool learn_pending;
+
+/** Last frame bound, so pressing the same button twice doesn't bind it twice */
+static Ir_frame_t learn_last;
+static bool       have_learn_last;
+
+/** Timer binding received frames and ending learning mode if none arrive */
+static esp_timer_handle_t learn_timer;
+#endif
+
+/** Struct mapping a decoded IR code to a fan event */
+typedef struct Remote_keymap_t
+{
+    enum Ir_protocol protocol; /** Protocol the code arrives in */
+    uint32_t code;             /** Decoded code */
+    enum Event_id id;          /** Event to send for the code */
+} Remote_keymap_t;
+
+/**
+ * Every code we act on. Other remotes can be supported by adding their codes
+ * here, any code that isn't listed is logged at debug level so it can be found.
+ */
+static const Remote_keymap_t REMOTE_DATA keymap[] = {
+    { IR_PROTOCOL_LASKO, IR_CODE_POWER,       ID_POWER       },
+    { IR_PROTOCOL_LASKO, IR_CODE_OSCILLATE,   ID_OSCILLATE   },
+    { IR_PROTOCOL_LASKO, IR_CODE_SPEED,       ID_SPEED       },
+    { IR_PROTOCOL_LASKO, IR_CODE_TIME,        ID_TIME        },
+    { IR_PROTOCOL_LASKO, IR_CODE_TEMPERATURE, ID_TEMPERATURE },
+};
+
+#ifdef CONFIG_FAN_REMOTE_LEARNING
 /**
- * @brief Check whether a duration is within an expected range.
- * @param signal_duration Duration being range-checked.
- * @param spec_duration   Duration to check against.
- * @return Whether signal_duration was in range of spec_duration.
+ * @brief  Find the slot of a code in the learned code table.
+ * @param  frame [in] Decoded IR frame.
+ * @param  for_insert Whether to return the free slot the code would go in, if it
+ *                    isn't in the table.
+ * @return Slot holding the code, or the free slot for it, NULL if neither.
  */
-static inline bool check_in_range(uint32_t signal_duration, uint32_t spec_duration)
+static Remote_learned_t *REMOTE_ATTR learn_find(const Ir_frame_t *frame, bool for_insert)
 {
-    return (signal_duration < (spec_duration + DURATION_ERROR_MARGIN)) &&
-           (signal_duration > (spec_duration - DURATION_ERROR_MARGIN));
+    /* Fibonacci hashing, the top bits of the product are the best mixed */
+    uint32_t key  = frame->code ^ ((uint32_t) frame->protocol << 28);
+    uint32_t slot = (key * 2654435761u) >> (32 - REMOTE_LEARN_BITS);
+
+    for (int probe = 0; probe < REMOTE_LEARN_SLOTS; probe++)
+    {
+        Remote_learned_t *entry = &learned[(slot + probe) & (REMOTE_LEARN_SLOTS - 1)];
+
+        if (!entry->used)
+        {
+            return (for_insert) ? entry : NULL;
+        }
+        if (entry->protocol == (uint8_t) frame->protocol && entry->code == frame->code)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
 }
 
 /**
- * @brief  Check whether a RMT symbol represents logic zero.
- * @param  rmt_symbols [in] RMT symbol to parse.
- * @return Whether symbol represents a logic 0.
+ * @brief   Save the learned code table to NVS.
+ * @details The table is saved as it is in RAM, so it loads back with every
+ *          code in the same slot.
  */
-static bool parse_logic0(rmt_symbol_word_t *symbol)
+static void learn_save(void)
 {
-    return check_in_range(symbol->duration0, DURATION_LONG) &&
-           check_in_range(symbol->duration1, DURATION_SHORT);
+    nvs_handle_t nvs;
+
+    esp_err_t err = nvs_open(REMOTE_CAL_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ESP_OK == err)
+    {
+        err = nvs_set_blob(nvs, REMOTE_LEARN_KEY, learned, sizeof(learned));
+        if (ESP_OK == err)
+        {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+
+    if (ESP_OK != err)
+    {
+        ESP_LOGW(TAG, "Failed to save learned IR codes (%s)", esp_err_to_name(err));
+    }
+}
+
+/**
+ * @brief   Hand a frame received in learning mode to the learn timer.
+ * @details Safe to call from the receive callback. Frames arriving while one is
+ *          still waiting to be bound are dropped, and so are repeats.
+ * @param   frame [in] Decoded IR frame.
+ * @return  Whether learning mode took the frame, and so no event is sent.
+ */
+static bool REMOTE_ATTR learn_capture(const Ir_frame_t *frame)
+{
+    if (!learning)
+    {
+        return false;
+    }
+
+    if (!frame->repeat && !learn_pending)
+    {
+        learn_frame   = *frame;
+        learn_pending = true;
+        (void) esp_timer_stop(learn_timer);
+        (void) esp_timer_start_once(learn_timer, 0);
+    }
+
+    return true;
 }
 
 /**
- * @brief  Check whether a RMT symbol represents logic one.
- * @param  symbol [in] RMT symbol to parse.
- * @return Whether symbol represents a logic 1.
+ * @brief   Timer callback binding a received frame, or ending learning mode.
+ * @details Binds the frame to the event for the current step and saves the
+ *          table. Learning mode ends once every event has a code, or when no
+ *          frame arrives within REMOTE_LEARN_TIMEOUT_US.
+ * @param   args [in] Unused
  */
-static bool parse_logic1(rmt_symbol_word_t *symbol)
+static void learn_callback(void *args)
 {
-    return check_in_range(symbol->duration0, DURATION_SHORT) &&
-           check_in_range(symbol->duration1, DURATION_LONG);
+    UNUSED_PARAM(args);
+
+    if (!learn_pending)
+    {
+        ESP_LOGI(TAG, "IR learning timed out at event %d", (int) learn_step);
+        learning = false;
+        return;
+    }
+
+    Ir_frame_t frame = learn_frame;
+    learn_pending = false;
+
+    bool same = have_learn_last && learn_last.protocol == frame.protocol && learn_last.code == frame.code;
+    if (!same)
+    {
+        Remote_learned_t *entry = learn_find(&frame, true);
+
+        if (NULL == entry || (!entry->used && num_learned >= REMOTE_LEARN_MAX))
+        {
+            ESP_LOGW(TAG, "No room to learn IR code 0x%lx", (unsigned long) frame.code);
+        }
+        else
+        {
+            if (!entry->used)
+            {
+                entry->code     = frame.code;
+                entry->protocol = (uint8_t) frame.protocol;
+                num_learned++;
+            }
+            entry->id   = (uint8_t) learn_step;
+            entry->used = true;
+
+            learn_save();
+            Led_identify();
+            ESP_LOGI(TAG, "Learned IR code 0x%lx (protocol %d) for event %d", (unsigned long) frame.code,
+                     (int) frame.protocol, (int) learn_step);
+
+            learn_last      = frame;
+            have_learn_last = true;
+            learn_step++;
+        }
+    }
+
+    if (learn_step >= NUM_EVENT_ID)
+    {
+        ESP_LOGI(TAG, "IR learning done, %u codes learned", (unsigned) num_learned);
+        learning = false;
+        return;
+    }
+
+    (void) esp_timer_start_once(learn_timer, REMOTE_LEARN_TIMEOUT_US);
 }
 
 /**
- * @brief   Checks whether a given command code is a valid command. Sends event.
- * @details There are a set number of IR codes that are recognized as valid IR
- *          commands for the Lasko fan. If the command code matches any of them,
- *          create an event and place it in the main event handler queue.
- * @param   ir_code IR command code to check.
- * @return  Whether the command code was a valid command.
+ * @brief Load the learned code table from NVS, and set up the learn timer.
  */
-static bool is_command(uint16_t ir_code)
+static void learn_init(void)
 {
-    Fan_event_t event = { .source = SOURCE_REMOTE };
+    size_t       size = sizeof(learned);
+    nvs_handle_t nvs;
 
-    /* Determine the appropriate event ID */
+    if (ESP_OK == nvs_open(REMOTE_CAL_NAMESPACE, NVS_READONLY, &nvs))
+    {
+        if (ESP_OK != nvs_get_blob(nvs, REMOTE_LEARN_KEY, learned, &size) || sizeof(learned) != size)
+        {
+            memset(learned, 0, sizeof(learned));
+        }
+        nvs_close(nvs);
+    }
 
-    switch (ir_code)
+    for (int slot = 0; slot < REMOTE_LEARN_SLOTS; slot++)
     {
-        case IR_CODE_POWER:
-            /* Power state command */
-            event.id = ID_POWER;
-            break;
-        case IR_CODE_OSCILLATE:
-            /* Oscillation state command */
-            event.id = ID_OSCILLATE;
-            break;
-        case IR_CODE_SPEED:
-            /* Speed state command */
-            event.id = ID_SPEED;
-            break;
-        case IR_CODE_TIME:
-            /* Time button command */
-            event.id = ID_TIME;
-            break;
-        case IR_CODE_TEMPERATURE:
-            /* Temperature button command */
-            event.id = ID_TEMPERATURE;
+        if (learned[slot].used && (learned[slot].id >= NUM_EVENT_ID || learned[slot].protocol >= NUM_IR_PROTOCOL))
+        {
+            /* Left over from a different build, drop the whole table */
+            memset(learned, 0, sizeof(learned));
+            num_learned = 0;
             break;
-        default:
-            return false;
+        }
+        num_learned += (learned[slot].used) ? 1 : 0;
     }
 
-    /* Send the event to the main queue, wait 10 ticks if necessary */
-    (void) xQueueSend(g_Fan_event_queue, &event, (TickType_t) 10);
+    esp_timer_create_args_t learn_args = {
+        .callback        = learn_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "remote_learn",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&learn_args, &learn_timer));
 
-    return true;
+    ESP_LOGI(TAG, "%u learned IR codes", (unsigned) num_learned);
 }
 
 /**
- * @brief   Parse RMT symbols to extract a valid IR code.
- * @details So this method of parsing RMT symbols is rather specific to this use
- *          case. I found through experimentation that whenever I would press a
- *          button on the IR remote, there were 11 RMT symbols received,
- *          followed by a very long duration.
- *
- *          With this, I reasoned that valid codes were 11 symbols long and went
- *          about determining what each was. In order to distinguish symbols
- *          from each other, I defined long and short durations. Long durations
- *          are roughly 1200 uSec, whereas short durations are roughly 400 uSec.
- *
- *          With this, I was able to parse a symbol into either a logic 0, or
- *          logic 1 based upon the durations it contained. They were created as
- *          such:
- *
- *          logic 0: (long , short)
- *          logic 1: (short, long )
- *
- *          With this, I am able to craft an 11-bit IR code which I place into a
- *          16-bit variable. To do so, I bit shift a 1 starting with 10 and then
- *          descending based upon how many bits I have set already.
- *
- *          Upon completing this algorithm, we have an IR code to check the
- *          validity of!
- * @param   rmt_symbols [in] Array of RMT symbols to parse.
- * @param   num_symbols Number of RMT symbols present in the array.
+ * @brief   Start learning mode.
+ * @details The next new code received is bound to ID_POWER, the one after to
+ *          the next event, and so on through every event. Starting over while
+ *          learning begins again from the first event.
+ */
+void Remote_learn_start(void)
+{
+    if (NULL == learn_timer)
+    {
+        return;
+    }
+
+    (void) esp_timer_stop(learn_timer);
+    learn_step      = (enum Event_id) 0;
+    have_learn_last = false;
+    learn_pending   = false;
+    learning        = true;
+    (void) esp_timer_start_once(learn_timer, REMOTE_LEARN_TIMEOUT_US);
+
+    Led_identify();
+    ESP_LOGI(TAG, "IR learning, press a remote button for each event in turn");
+}
+
+/**
+ * @brief Forget every learned code, and leave learning mode.
  */
-static void parse_ir_code(rmt_symbol_word_t *rmt_symbols, size_t num_symbols)
+void Remote_learn_clear(void)
 {
-    if (RMT_MAX_MEM_SYMBOLS != num_symbols)
+    if (NULL == learn_timer)
     {
-        /* We expect to fill up the buffer with valid presses, all else is noise */
         return;
     }
 
-    /* Iterate through the collected RMT symbols, try to build an IR code */
-    uint16_t ir_code   = 0;
-    size_t   bit_index = 0;
-    for (size_t i = 0; i < num_symbols; i++)
+    (void) esp_timer_stop(learn_timer);
+    learning = false;
+
+    memset(learned, 0, sizeof(learned));
+    num_learned = 0;
+    learn_save();
+
+    ESP_LOGI(TAG, "Learned IR codes cleared");
+}
+#else
+#define learn_capture(frame) (false)
+#define learn_init()
+void Remote_learn_start(void) {}
+void Remote_learn_clear(void) {}
+#endif /* CONFIG_FAN_REMOTE_LEARNING */
+
+/**
+ * @brief  Find the event a decoded frame maps to.
+ * @details Learned codes take precedence over the built-in keymap.
+ * @param  frame [in]  Decoded IR frame.
+ * @param  id    [out] Event for the frame.
+ * @return Whether the frame was a known command.
+ */
+static bool REMOTE_ATTR lookup_command(const Ir_frame_t *frame, enum Event_id *id)
+{
+#ifdef CONFIG_FAN_REMOTE_LEARNING
+    const Remote_learned_t *entry = learn_find(frame, false);
+    if (NULL != entry)
+    {
+        *id = (enum Event_id) entry->id;
+        return true;
+    }
+#endif
+
+    for (size_t i = 0; i < sizeof(keymap) / sizeof(keymap[0]); i++)
+    {
+        if (keymap[i].protocol == frame->protocol && keymap[i].code == frame->code)
+        {
+            *id = keymap[i].id;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief   Look up a decoded frame and send its event.
+ * @details If the frame's code is learned or in the keymap, create an event
+ *          and place it in the main event handler queue.
+ * @param   frame [in]     Decoded IR frame.
+ * @param   arg   Whether this is a new press or a held button.
+ * @param   woken [in,out] Set if sending woke a higher priority task, only
+ *                used when called from the receive callback.
+ * @return  Whether the frame was a known command.
+ */
+static bool REMOTE_ATTR send_command(const Ir_frame_t *frame, enum Remote_arg arg, BaseType_t *woken)
+{
+    enum Event_id id;
+
+    if (!lookup_command(frame, &id))
+    {
+#ifndef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+        ESP_LOGD(TAG, "Unknown IR code 0x%lx (protocol %d)", (unsigned long) frame->code, (int) frame->protocol);
+#endif
+        return false;
+    }
+
+    Fan_event_t event = {
+        .source       = SOURCE_REMOTE,
+        .id           = id,
+        .arg          = arg,
+        .timestamp_us = esp_timer_get_time()
+    };
+
+    /* Send the event to the main queue */
+#ifdef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+    /* No logging from the ISR, the event queue counts overflows for us */
+    (void) Event_queue_send_from_isr(&event, woken);
+#else
+    UNUSED_PARAM(woken);
+    if (!Event_queue_send(&event))
+    {
+        ESP_LOGW(TAG, "Event queue full, dropping event");
+    }
+#endif
+
+    return true;
+}
+
+#ifdef CONFIG_FAN_REMOTE_CALIBRATION
+/**
+ * @brief   Timer callback saving the learned timing scales to NVS.
+ * @param   args [in] Unused
+ */
+static void cal_save_callback(void *args)
+{
+    Ir_stats_t   stats;
+    nvs_handle_t nvs;
+
+    UNUSED_PARAM(args);
+
+    Ir_decode_get_stats(&stats);
+    esp_err_t err = nvs_open(REMOTE_CAL_NAMESPACE, NVS_READWRITE, &nvs);
+    if (ESP_OK == err)
     {
-        if (parse_logic1(&rmt_symbols[i]))
+        err = nvs_set_blob(nvs, REMOTE_CAL_KEY, stats.scale, sizeof(stats.scale));
+        if (ESP_OK == err)
         {
-            /* Set the bit, since this is logic 1 */
-            ir_code |= (1 << (NUM_SYMBOL_EXPECTED - bit_index - 1));
+            err = nvs_commit(nvs);
         }
-        else if (!parse_logic0(&rmt_symbols[i]))
+        nvs_close(nvs);
+    }
+
+    if (ESP_OK != err)
+    {
+        ESP_LOGW(TAG, "Failed to save IR calibration (%s)", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Saved IR calibration, Lasko scale %u/%u", (unsigned) stats.scale[IR_PROTOCOL_LASKO],
+             (unsigned) IR_SCALE_NOMINAL);
+}
+
+/**
+ * @brief Load the timing scales learned on an earlier boot, and set up saving.
+ */
+static void cal_init(void)
+{
+    uint16_t     scale[NUM_IR_PROTOCOL];
+    size_t       size = sizeof(scale);
+    nvs_handle_t nvs;
+
+    if (ESP_OK == nvs_open(REMOTE_CAL_NAMESPACE, NVS_READONLY, &nvs))
+    {
+        if (ESP_OK == nvs_get_blob(nvs, REMOTE_CAL_KEY, scale, &size) && sizeof(scale) == size)
         {
-            /* Bad RMT symbols, exit */
-            return;
+            Ir_decode_set_scale(scale);
         }
+        nvs_close(nvs);
+    }
 
-        bit_index += 1;
+    esp_timer_create_args_t cal_args = {
+        .callback        = cal_save_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "remote_cal",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&cal_args, &cal_timer));
+}
 
-        /* Check whether we have a command! */
-        if (NUM_SYMBOL_EXPECTED == bit_index && !is_command(ir_code))
+/**
+ * @brief Save the timing scales later if calibration just changed them.
+ * @note  Safe to call from the receive callback. A save already pending picks
+ *        up the latest scales, so isn't restarted.
+ */
+static inline void REMOTE_ATTR cal_check(void)
+{
+    if (Ir_decode_take_changed())
+    {
+        (void) esp_timer_start_once(cal_timer, REMOTE_CAL_SAVE_DELAY_US);
+    }
+}
+#else
+#define cal_init()
+#define cal_check()
+#endif /* CONFIG_FAN_REMOTE_CALIBRATION */
+
+/**
+ * @brief   Parse RMT symbols to extract valid IR commands.
+ * @details Hands the symbols, whatever their length, to the IR decoder. Holding
+ *          a button down sends the same frame over and over, so new presses
+ *          are sent as press events and repeats are sent as held events, at
+ *          most once every REMOTE_HOLD_INTERVAL_US.
+ * @param   rmt_symbols [in]     Array of RMT symbols to parse.
+ * @param   num_symbols Number of RMT symbols present in the array.
+ * @param   continued   Whether the symbols carry on from the last piece.
+ * @param   woken       [in,out] Set if an event woke a higher priority task.
+ */
+static void REMOTE_ATTR parse_ir_code(const rmt_symbol_word_t *rmt_symbols, size_t num_symbols,
+                                      bool continued, BaseType_t *woken)
+{
+    Ir_frame_t frames[MAX_FRAMES_PER_CAPTURE];
+    size_t     num_frames = Ir_decode(rmt_symbols, num_symbols, continued,
+                                      frames, MAX_FRAMES_PER_CAPTURE);
+    int64_t    now        = esp_timer_get_time();
+
+    /* End the next capture on the gap after this protocol's frames */
+    frame_protocol = (num_frames) ? frames[num_frames - 1].protocol : NUM_IR_PROTOCOL;
+
+    for (size_t i = 0; i < num_frames; i++)
+    {
+        if (learn_capture(&frames[i]))
         {
-            /* If it was not a valid command, reset counters */
-            ir_code = 0;
-            bit_index = 0;
+            /* Learning mode takes the frame instead */
         }
+        else if (!frames[i].repeat)
+        {
+            (void) send_command(&frames[i], REMOTE_PRESS, woken);
+            last_event_us = now;
+        }
+        else if (now - last_event_us >= REMOTE_HOLD_INTERVAL_US)
+        {
+            (void) send_command(&frames[i], REMOTE_HELD, woken);
+            last_event_us = now;
+        }
+    }
+
+    cal_check();
+}
 
-        /* If IR code was valid, event has been sent! */
+/**
+ * @brief   Start receiving on the RMT channel.
+ * @details Safe to call from the receive callback, so the next capture is
+ *          armed without waiting on the parsing task. The capture ends on the
+ *          first idle longer than a frame of the last protocol seen can hold.
+ */
+static void REMOTE_ATTR start_receive(void)
+{
+    receive_config.signal_range_max_ns = (Ir_decode_longest_us(frame_protocol) + REMOTE_FRAME_END_MARGIN_US) * 1000;
+    (void) rmt_receive(rx_channel, rx_buffer, sizeof(rx_buffer), &receive_config);
+}
+
+/**
+ * @brief   Check whether a piece carries on from the last one.
+ * @details Either it's a later piece of the same capture, or the capture began
+ *          soon enough after the last one to be the same button still held.
+ * @param   edata [in] Received piece.
+ * @return  Whether the piece carries on from the last one.
+ */
+static bool REMOTE_ATTR capture_follows(const rmt_rx_done_event_data_t *edata)
+{
+    int64_t now       = esp_timer_get_time();
+    bool    continued = capture_continued || (now - capture_end_us < REMOTE_REPEAT_GAP_US);
+
+    capture_continued = !REMOTE_IS_LAST(edata);
+    if (!capture_continued)
+    {
+        capture_end_us = now;
     }
+
+    return continued;
+}
+
+#ifdef CONFIG_FAN_LIGHT_SLEEP
+/**
+ * @brief Push back disabling the receiver, as IR just arrived.
+ * @note  Safe to call from the receive callback.
+ */
+static inline void REMOTE_ATTR receive_activity(void)
+{
+    (void) esp_timer_stop(idle_timer);
+    (void) esp_timer_start_once(idle_timer, REMOTE_IDLE_US);
+}
+
+/**
+ * @brief   Timer callback for IR having gone quiet.
+ * @details Disables the RMT channel, releasing its PM lock, and hands over to
+ *          the GPIO interrupt to spot the next IR edge.
+ * @param   args [in] Unused
+ */
+static void idle_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    (void) rmt_disable(rx_channel);
+    capture_continued = false;
+    (void) gpio_intr_enable(FAN_IR_SENSOR_GPIO);
+}
+
+/**
+ * @brief   Timer callback for IR arriving while the receiver was disabled.
+ * @details Enables the RMT channel again and starts receiving.
+ * @param   args [in] Unused
+ */
+static void wake_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    (void) rmt_enable(rx_channel);
+    start_receive();
+    receive_activity();
+}
+
+/**
+ * @brief   GPIO interrupt for the first IR edge while the receiver is disabled.
+ * @details Masks itself until the receiver goes idle again, the RMT channel
+ *          can't be enabled from an ISR so that's left to the wake timer.
+ * @param   arg [in] Unused
+ */
+static void IRAM_ATTR ir_wake_isr(void *arg)
+{
+    UNUSED_PARAM(arg);
+
+    (void) gpio_intr_disable(FAN_IR_SENSOR_GPIO);
+    (void) esp_timer_start_once(wake_timer, 0);
+}
+
+/**
+ * @brief Set up the idle/wake timers and the sensor pin as a wakeup source.
+ */
+static void sleep_init(void)
+{
+    esp_timer_create_args_t idle_args = {
+        .callback        = idle_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "remote_idle",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&idle_args, &idle_timer));
+
+    esp_timer_create_args_t wake_args = {
+        .callback        = wake_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "remote_wake",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&wake_args, &wake_timer));
+
+    /* The sensor idles high, any IR pulls it low. Stay masked until idle */
+    (void) gpio_install_isr_service(0);
+    ESP_ERROR_CHECK(gpio_set_intr_type(FAN_IR_SENSOR_GPIO, GPIO_INTR_LOW_LEVEL));
+    ESP_ERROR_CHECK(gpio_intr_disable(FAN_IR_SENSOR_GPIO));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(FAN_IR_SENSOR_GPIO, ir_wake_isr, NULL));
+    ESP_ERROR_CHECK(gpio_wakeup_enable(FAN_IR_SENSOR_GPIO, GPIO_INTR_LOW_LEVEL));
 }
+#else
+#define receive_activity()
+#endif /* CONFIG_FAN_LIGHT_SLEEP */
 
+#ifdef CONFIG_FAN_REMOTE_DECODE_IN_ISR
 /**
  * @brief  Receiver callback for the RMT channel.
  * @details This callback will fire any time our RMT channel receives some
- *          amount of data. The received data is passed to us in the form of RMT
- *          symbols that will be parsed later.
+ *          amount of data. The symbols are decoded right here, straight out of
+ *          the driver's buffer, and any commands are posted to the main event
+ *          queue. The receive is then re-armed once the capture is over.
+ * @param channel
+ * @param edata     [in]
+ * @param user_data [in]
+ */
+static bool IRAM_ATTR rmt_rx_callback(rmt_channel_handle_t channel, const rmt_rx_done_event_data_t *edata, void *user_data)
+{
+    /* We have not woken a task at the start of the ISR. */
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    UNUSED_PARAM(channel);
+    UNUSED_PARAM(user_data);
+
+    bool continued = capture_follows(edata);
+    parse_ir_code(edata->received_symbols, edata->num_symbols, continued, &xHigherPriorityTaskWoken);
+    receive_activity();
+
+    if (!capture_continued)
+    {
+        /* Capture is over, start the next one right away */
+        start_receive();
+    }
+
+    return (xHigherPriorityTaskWoken == pdTRUE);
+}
+#else
+/**
+ * @brief  Receiver callback for the RMT channel.
+ * @details This callback will fire any time our RMT channel receives some
+ *          amount of data. The received symbols are copied into whichever
+ *          ping-pong buffer is free and handed to the parsing task, and the
+ *          receive is re-armed straight away so nothing is missed in between.
+ *
+ *          A piece of a capture arrives long after the previous one (dozens of
+ *          symbols at no less than a few hundred uSec each), so the task has
+ *          long since parsed a buffer before it gets reused.
  * @param channel
  * @param edata     [in]
  * @param user_data [in]
@@ -233,39 +880,90 @@ static bool rmt_rx_callback(rmt_channel_handle_t channel, const rmt_rx_done_even
     /* We have not woken a task at the start of the ISR. */
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
 
+    UNUSED_PARAM(channel);
     UNUSED_PARAM(user_data);
-    
+
+    size_t num_symbols = (edata->num_symbols < RMT_RX_BUFFER_SYMBOLS) ?
+                         edata->num_symbols : RMT_RX_BUFFER_SYMBOLS;
+
+    Remote_chunk_t chunk = {
+        .symbols     = chunks[active_chunk],
+        .num_symbols = num_symbols,
+        .continued   = capture_follows(edata),
+    };
+
+    memcpy(chunks[active_chunk], edata->received_symbols, num_symbols * sizeof(rmt_symbol_word_t));
+    active_chunk = (active_chunk + 1) % REMOTE_NUM_CHUNKS;
+    receive_activity();
+
+    if (!capture_continued)
+    {
+        /* Capture is over, start the next one right away */
+        start_receive();
+    }
+
     /* Send the received RMT symbols to the parsing task */
-    xQueueSendFromISR(receive_queue, edata, &xHigherPriorityTaskWoken);
+    xQueueSendFromISR(receive_queue, &chunk, &xHigherPriorityTaskWoken);
 
     return (xHigherPriorityTaskWoken == pdTRUE);
 }
 
+#ifdef CONFIG_FAN_REMOTE_CAPTURE
 /**
- * @brief FreeRTOS task for receiving data on the RMT channel. 
+ * @brief   Print a piece of a capture as raw symbol words.
+ * @details One line per piece, "irc,<continued>,<count>,<word>,...", with each
+ *          word in hex as the RMT driver stores it. The whole line goes out in
+ *          one go so it stays readable alongside other logging.
+ * @param   chunk [in] Piece of a capture to print.
+ */
+static void capture_dump(const Remote_chunk_t *chunk)
+{
+    /* "irc,c,nnn" plus ",xxxxxxxx" per symbol and the newline */
+    static char line[16 + 9 * RMT_RX_BUFFER_SYMBOLS + 2];
+    int len = snprintf(line, sizeof(line), "irc,%d,%u", chunk->continued ? 1 : 0, (unsigned) chunk->num_symbols);
+
+    for (size_t i = 0; i < chunk->num_symbols; i++)
+    {
+        len += snprintf(&line[len], sizeof(line) - len, ",%08lx", (unsigned long) chunk->symbols[i].val);
+    }
+
+    line[len++] = '\n';
+    (void) fwrite(line, 1, len, stdout);
+}
+#else
+#define capture_dump(chunk)
+#endif /* CONFIG_FAN_REMOTE_CAPTURE */
+
+/**
+ * @brief FreeRTOS task for parsing data received on the RMT channel.
  * @param p [in]
  */
 static void Remote_task(void *p)
 {
-    rmt_symbol_word_t raw_symbols[RMT_MAX_MEM_SYMBOLS];
-    rmt_rx_done_event_data_t rx_data;
-    
+    Remote_chunk_t chunk;
+
     UNUSED_PARAM(p);
 
     /* Begin receiving RMT data, start the run loop */
-    ESP_ERROR_CHECK(rmt_receive(rx_channel, raw_symbols, sizeof(raw_symbols), &receive_config));
+    start_receive();
+    Watchdog_subscribe(WATCHDOG_REMOTE_HANDLER);
     while (true) 
     {
-        // wait for RX done signal
-        if (xQueueReceive(receive_queue, &rx_data, portMAX_DELAY)) 
+        if (xQueueReceive(receive_queue, &chunk, Watchdog_wait_ticks())) 
+        {
+            Watchdog_begin(WATCHDOG_REMOTE_HANDLER, (int) chunk.continued, (int) chunk.num_symbols);
+            capture_dump(&chunk);
+            parse_ir_code(chunk.symbols, chunk.num_symbols, chunk.continued, NULL);
+            Watchdog_end(WATCHDOG_REMOTE_HANDLER);
+        }
+        else
         {
-            // parse the receive symbols and print the result
-            parse_ir_code(rx_data.received_symbols, rx_data.num_symbols);
-            // start receive again
-            ESP_ERROR_CHECK(rmt_receive(rx_channel, raw_symbols, sizeof(raw_symbols), &receive_config));
+            /* Nothing received, check in and keep waiting */
+            Watchdog_feed(WATCHDOG_REMOTE_HANDLER);
         }
     }
 }
+#endif /* CONFIG_FAN_REMOTE_DECODE_IN_ISR */
 
 /**
  * @brief   Initializer for the Remote component.
@@ -283,12 +981,23 @@ void Remote_init(void)
     };
     ESP_ERROR_CHECK(rmt_new_rx_channel(&rx_channel_cfg, &rx_channel));
 
-    /* Setup a queue to pass RMT data with */
-    receive_queue = xQueueCreate(10, sizeof(rmt_rx_done_event_data_t));
+    /* Pick up the remote's timings and learned codes, before anything is decoded */
+    cal_init();
+    learn_init();
+
+#ifndef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+    /* Setup a queue to pass RMT data with, one for each ping-pong buffer */
+#ifdef CONFIG_FAN_STATIC_ALLOCATION
+    receive_queue = xQueueCreateStatic(REMOTE_NUM_CHUNKS, sizeof(Remote_chunk_t),
+                                       receive_queue_storage, &receive_queue_buf);
+#else
+    receive_queue = xQueueCreate(REMOTE_NUM_CHUNKS, sizeof(Remote_chunk_t));
+#endif
+#endif
 
     /* Register the ISR to handle RMT receives */
     rmt_rx_event_callbacks_t cbs = { .on_recv_done = rmt_rx_callback };
-    ESP_ERROR_CHECK(rmt_rx_register_event_callbacks(rx_channel, &cbs, receive_queue));
+    ESP_ERROR_CHECK(rmt_rx_register_event_callbacks(rx_channel, &cbs, NULL));
 
     /* Enable the RMT signal */
     ESP_ERROR_CHECK(rmt_enable(rx_channel));
@@ -297,20 +1006,45 @@ void Remote_init(void)
      * The shortest duration for signal is 560us, 1250ns < 560us, valid
      * signal won't be treated as noise
      *
-     * The longest duration for signal is 9000us, 12000000ns > 9000us, the
-     * receive won't stop early.
+     * The longest duration is set on every receive, from the protocol in use.
      */
     receive_config.signal_range_min_ns = 1250;
-    receive_config.signal_range_max_ns = 12000000;
+#if REMOTE_PARTIAL_RX
+    receive_config.flags.en_partial_rx = true;
+#endif
 
+#ifdef CONFIG_FAN_LIGHT_SLEEP
+    /* Disable the receiver again if nothing shows up */
+    sleep_init();
+    receive_activity();
+#endif
+
+#ifdef CONFIG_FAN_REMOTE_DECODE_IN_ISR
+    /* No task to do it for us, start receiving right away */
+    start_receive();
+#else
     /* Create our event handler task */
-    (void) xTaskCreate(
+#ifdef CONFIG_FAN_STATIC_ALLOCATION
+    (void) xTaskCreateStaticPinnedToCore(
+        Remote_task,
+        REMOTE_HANDLER_NAME,
+        REMOTE_HANDLER_STACKSIZE,
+        NULL,
+        REMOTE_HANDLER_PRIORITY,
+        remote_handler_stack,
+        &remote_handler_tcb,
+        FAN_IO_CORE_ID);
+#else
+    (void) xTaskCreatePinnedToCore(
         Remote_task, 
         REMOTE_HANDLER_NAME,
         REMOTE_HANDLER_STACKSIZE,
         NULL, 
         REMOTE_HANDLER_PRIORITY,
-        NULL);
+        NULL,
+        FAN_IO_CORE_ID);
+#endif
+#endif
 
     ESP_LOGI(TAG, "Remote component init!");
 }
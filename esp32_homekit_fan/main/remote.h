@@ -11,6 +11,9 @@
 #ifndef REMOTE_H
 #define REMOTE_H
 
+/** Public functions for the Remote component */
+void Remote_learn_start(void);
+void Remote_learn_clear(void);
 void Remote_init(void);
 
 #endif /* REMOTE_H */
@@ -0,0 +1,390 @@
+/**
+ * @file schedule.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to run on/off and speed programs on the device itself.
+ *
+ * HomeKit automations need a home hub, and stop running whenever it's offline.
+ * So simple programs such as "speed 2 from 22:00 to 06:00" can be given in
+ * CONFIG_FAN_SCHEDULE instead, and run on the fan against SNTP-synced local
+ * time. Rules are written as "HH:MM-HH:MM=S" (turn on at speed S for a window)
+ * or "HH:MM=S" (just set speed S, or turn off for 0), separated by ';'.
+ *
+ * Each rule has a start edge, and maybe an end edge. Every edge sits in a
+ * min-heap keyed on when it next fires, and a single one-shot esp_timer is
+ * armed for the earliest. When it fires, the due edges are sent as events and
+ * pushed a day ahead, costing O(log n) each. Nothing scans the rules every
+ * minute. The heap is only rebuilt when SNTP (re)syncs the clock, since the
+ * wall clock may have jumped.
+ *
+ * Rules are edge-triggered like HomeKit automations. Booting up in the middle
+ * of a window doesn't turn the fan on, and the fan can be changed by hand in
+ * the middle of one.
+ * 
+ * @addtogroup Schedule
+ * @{
+ */
+
+#include <stdatomic.h>         /* Atomic types and operations */
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <stdio.h>             /* For parsing rules */
+#include <stdlib.h>            /* For the TZ environment variable */
+#include <string.h>            /* For memory/string-related functions */
+#include <time.h>              /* Wall-clock time */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+#include <esp_timer.h>         /* One-shot timers */
+#include <esp_netif_sntp.h>    /* SNTP time sync */
+
+#include "main.h"
+#include "event_queue.h"
+#include "schedule.h"
+
+/** Most rules that can be configured, and thus edges in the heap */
+#define SCHEDULE_MAX_RULES 8
+#define SCHEDULE_MAX_EDGES (2 * SCHEDULE_MAX_RULES)
+
+/** Length of the rule config string we're willing to parse */
+#define SCHEDULE_MAX_CONFIG_LEN 128
+
+/** End minute for rules that only have a start */
+#define SCHEDULE_NO_END UINT16_MAX
+
+/** Number of minutes in an hour/day */
+#define NUM_MIN_IN_HOUR 60
+#define NUM_MIN_IN_DAY  (24 * NUM_MIN_IN_HOUR)
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC 1000000
+
+/** Earliest time (in Sec since epoch, 2023-01-01) taken to mean SNTP synced */
+#define SCHEDULE_VALID_EPOCH_S 1672531200
+
+/** Struct for a configured rule */
+typedef struct Schedule_rule_t
+{
+    uint16_t start_min;     /** Minute of the day the rule starts */
+    uint16_t end_min;       /** Minute of the day the rule ends, or SCHEDULE_NO_END */
+    enum State_speed speed; /** Speed to run at, SPEED_OFF to turn off */
+} Schedule_rule_t;
+
+/** Struct for a rule edge waiting in the heap */
+typedef struct Schedule_edge_t
+{
+    time_t fire_s; /** Time (in Sec since epoch) the edge next fires */
+    uint8_t rule;  /** Index of the rule the edge belongs to */
+    bool is_end;   /** Whether this is the rule's end edge */
+} Schedule_edge_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Schedule";
+
+/** Configured rules */
+static Schedule_rule_t rules[SCHEDULE_MAX_RULES];
+static size_t num_rules;
+
+/** Min-heap of rule edges, ordered by when they next fire */
+static Schedule_edge_t heap[SCHEDULE_MAX_EDGES];
+static size_t heap_len;
+
+/** Timer armed for the earliest edge */
+static esp_timer_handle_t schedule_timer;
+
+/** Whether the clock (re)synced, and the heap needs rebuilding */
+static atomic_bool resync_pending;
+
+/**
+ * @brief  Work out when a minute of the day next comes around.
+ * @details Goes through local time with mktime(), so DST changes are handled.
+ * @param  minute  Minute of the day
+ * @param  after_s Time (in Sec since epoch) to look after
+ * @return Time (in Sec since epoch) of the next occurrence after after_s.
+ */
+static time_t next_fire_s(uint16_t minute, time_t after_s)
+{
+    struct tm local;
+    time_t    fire_s;
+
+    (void) localtime_r(&after_s, &local);
+    for (int day = 0; day < 2; day++)
+    {
+        local.tm_mday += day;
+        local.tm_hour  = minute / NUM_MIN_IN_HOUR;
+        local.tm_min   = minute % NUM_MIN_IN_HOUR;
+        local.tm_sec   = 0;
+        local.tm_isdst = -1;
+
+        fire_s = mktime(&local);
+        if (fire_s > after_s)
+        {
+            break;
+        }
+    }
+
+    return fire_s;
+}
+
+/**
+ * @brief  Get the minute of the day an edge fires at.
+ * @param  edge [in] Edge to look up
+ * @return Minute of the day.
+ */
+static inline uint16_t edge_minute(const Schedule_edge_t *edge)
+{
+    return (edge->is_end) ? rules[edge->rule].end_min : rules[edge->rule].start_min;
+}
+
+/**
+ * @brief Move a heap entry down until both its children fire after it.
+ * @param i Index of the entry
+ */
+static void heap_sift_down(size_t i)
+{
+    while (true)
+    {
+        size_t earliest = i;
+        size_t left     = (2 * i) + 1;
+        size_t right    = left + 1;
+
+        if (left < heap_len && heap[left].fire_s < heap[earliest].fire_s)
+        {
+            earliest = left;
+        }
+        if (right < heap_len && heap[right].fire_s < heap[earliest].fire_s)
+        {
+            earliest = right;
+        }
+        if (earliest == i)
+        {
+            return;
+        }
+
+        Schedule_edge_t swap = heap[i];
+        heap[i]              = heap[earliest];
+        heap[earliest]       = swap;
+        i                    = earliest;
+    }
+}
+
+/**
+ * @brief Add an edge to the heap.
+ * @param edge [in] Edge to add
+ */
+static void heap_push(const Schedule_edge_t *edge)
+{
+    size_t i = heap_len++;
+
+    /* Move the new entry up until its parent fires before it */
+    while (i > 0 && edge->fire_s < heap[(i - 1) / 2].fire_s)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i       = (i - 1) / 2;
+    }
+    heap[i] = *edge;
+}
+
+/**
+ * @brief Rebuild the heap from scratch, after the clock (re)synced.
+ * @param after_s Time (in Sec since epoch) edges have to fire after
+ */
+static void heap_rebuild(time_t after_s)
+{
+    heap_len = 0;
+    for (size_t i = 0; i < num_rules; i++)
+    {
+        Schedule_edge_t start = {.fire_s = next_fire_s(rules[i].start_min, after_s), .rule = i, .is_end = false};
+        heap_push(&start);
+
+        if (SCHEDULE_NO_END != rules[i].end_min)
+        {
+            Schedule_edge_t end = {.fire_s = next_fire_s(rules[i].end_min, after_s), .rule = i, .is_end = true};
+            heap_push(&end);
+        }
+    }
+}
+
+/**
+ * @brief Send the events for an edge that fired.
+ * @param edge [in] Edge that fired
+ */
+static void fire_edge(const Schedule_edge_t *edge)
+{
+    const Schedule_rule_t *rule  = &rules[edge->rule];
+    Fan_event_t            event = {.source = SOURCE_SCHEDULE, .timestamp_us = esp_timer_get_time()};
+    bool                   sent  = true;
+
+    ESP_LOGI(TAG, "Rule %u %s", (unsigned) edge->rule, (edge->is_end) ? "ended" : "started");
+
+    if (!edge->is_end && SPEED_OFF != rule->speed)
+    {
+        /* Set the speed first, so the fan comes on straight at it */
+        event.id  = ID_SPEED;
+        event.arg = (uint32_t) rule->speed;
+        sent &= Event_queue_send(&event);
+    }
+
+    event.id  = ID_POWER;
+    event.arg = (uint32_t) (!edge->is_end && SPEED_OFF != rule->speed);
+    sent &= Event_queue_send(&event);
+
+    if (!sent)
+    {
+        ESP_LOGW(TAG, "Event queue full, dropping event");
+    }
+}
+
+/**
+ * @brief   Timer callback for the schedule.
+ * @details Runs in the esp_timer task, which is the only place the heap is
+ *          touched after init. Rebuilds the heap if the clock synced, fires
+ *          every edge that's due, then re-arms for the earliest edge left.
+ * @param   args [in] Unused
+ */
+static void schedule_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    time_t now_s = time(NULL);
+    if (now_s < SCHEDULE_VALID_EPOCH_S)
+    {
+        /* Clock isn't set yet, the sync callback will get us going */
+        return;
+    }
+
+    if (atomic_exchange(&resync_pending, false))
+    {
+        /* Edges due right now should still fire */
+        heap_rebuild(now_s - 1);
+    }
+
+    while (heap_len > 0 && heap[0].fire_s <= now_s)
+    {
+        fire_edge(&heap[0]);
+
+        /* Push this edge to its next occurrence, which keeps it at the same index */
+        heap[0].fire_s = next_fire_s(edge_minute(&heap[0]), now_s);
+        heap_sift_down(0);
+    }
+
+    if (heap_len > 0)
+    {
+        (void) esp_timer_stop(schedule_timer);
+        (void) esp_timer_start_once(schedule_timer, (uint64_t) (heap[0].fire_s - now_s) * NUM_USEC_IN_SEC);
+    }
+
+    if (atomic_load(&resync_pending))
+    {
+        /* Synced again while we were busy, make sure the rebuild isn't lost */
+        (void) esp_timer_stop(schedule_timer);
+        (void) esp_timer_start_once(schedule_timer, 0);
+    }
+}
+
+/**
+ * @brief   SNTP callback for whenever the clock gets synced.
+ * @details Runs in the LwIP task, so just hands the rebuild off to the timer.
+ * @param   tv [in] Synced time (UNUSED)
+ */
+static void time_sync_callback(struct timeval *tv)
+{
+    UNUSED_PARAM(tv);
+
+    ESP_LOGI(TAG, "Clock synced");
+
+    atomic_store(&resync_pending, true);
+    (void) esp_timer_stop(schedule_timer);
+    (void) esp_timer_start_once(schedule_timer, 0);
+}
+
+/**
+ * @brief  Parse the rules given in CONFIG_FAN_SCHEDULE.
+ * @return Number of rules parsed.
+ */
+static size_t parse_rules(void)
+{
+    char  config[SCHEDULE_MAX_CONFIG_LEN];
+    char *save = NULL;
+
+    (void) snprintf(config, sizeof(config), "%s", CONFIG_FAN_SCHEDULE);
+
+    num_rules = 0;
+    for (char *token = strtok_r(config, ";", &save); NULL != token; token = strtok_r(NULL, ";", &save))
+    {
+        unsigned start_h, start_m, end_h, end_m, speed;
+        Schedule_rule_t rule;
+
+        if (5 == sscanf(token, " %u:%u-%u:%u=%u", &start_h, &start_m, &end_h, &end_m, &speed))
+        {
+            rule.end_min = (uint16_t) ((end_h * NUM_MIN_IN_HOUR) + end_m);
+        }
+        else if (3 == sscanf(token, " %u:%u=%u", &start_h, &start_m, &speed))
+        {
+            rule.end_min = SCHEDULE_NO_END;
+            end_h = end_m = 0;
+        }
+        else
+        {
+            ESP_LOGW(TAG, "Ignoring malformed rule \"%s\"", token);
+            continue;
+        }
+        rule.start_min = (uint16_t) ((start_h * NUM_MIN_IN_HOUR) + start_m);
+        rule.speed     = (enum State_speed) speed;
+
+        if (start_h >= 24 || start_m >= NUM_MIN_IN_HOUR || end_h >= 24 || end_m >= NUM_MIN_IN_HOUR ||
+            speed >= NUM_SPEED || rule.start_min == rule.end_min)
+        {
+            ESP_LOGW(TAG, "Ignoring invalid rule \"%s\"", token);
+            continue;
+        }
+        if (num_rules >= SCHEDULE_MAX_RULES)
+        {
+            ESP_LOGW(TAG, "Too many rules, ignoring \"%s\"", token);
+            break;
+        }
+
+        rules[num_rules++] = rule;
+    }
+
+    return num_rules;
+}
+
+/**
+ * @brief   Initializer for the Schedule component.
+ * @details Parses the configured rules and, if there are any, starts SNTP. The
+ *          first sync (or the clock already being set) builds the heap.
+ * @note    Needs the network interface up, so call after HomeKit_init().
+ */
+void Schedule_init(void)
+{
+    if (0 == parse_rules())
+    {
+        ESP_LOGI(TAG, "No rules configured");
+        return;
+    }
+
+    /* Rules are given in local time */
+    setenv("TZ", CONFIG_FAN_SCHEDULE_TZ, 1);
+    tzset();
+
+    esp_timer_create_args_t timer_args = {
+        .callback        = schedule_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "schedule",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &schedule_timer));
+
+    /* Build the heap straight away in case the clock survived a reset */
+    atomic_store(&resync_pending, true);
+    ESP_ERROR_CHECK(esp_timer_start_once(schedule_timer, 0));
+
+    esp_sntp_config_t sntp_config = ESP_NETIF_SNTP_DEFAULT_CONFIG(CONFIG_FAN_SNTP_SERVER);
+    sntp_config.sync_cb = time_sync_callback;
+    ESP_ERROR_CHECK(esp_netif_sntp_init(&sntp_config));
+
+    ESP_LOGI(TAG, "Schedule component init with %u rules!", (unsigned) num_rules);
+}
+
+/** @} end Schedule */
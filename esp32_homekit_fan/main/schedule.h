@@ -0,0 +1,19 @@
+/**
+ * @file schedule.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to run on/off and speed programs on the device itself.
+ * 
+ * @addtogroup Schedule
+ * @{
+ */
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+/** Public functions for the Schedule component */
+void Schedule_init(void);
+
+#endif /* SCHEDULE_H */
+
+/** @} end Schedule */
@@ -0,0 +1,135 @@
+/**
+ * @file sleep_timer.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to turn the fan off after a set time.
+ *
+ * Like the stock Lasko controls, the clock button cycles the fan through 1, 2,
+ * 4 and 8 hour auto-off timers, and HomeKit can set the timer too. The timer
+ * setting itself is part of the fan state and gets folded by the event
+ * handlers like everything else; this component only does the countdown.
+ *
+ * The countdown is a one-shot esp_timer per fan, re-armed whenever the setting
+ * changes, so nothing polls while it runs. When it expires it doesn't touch the
+ * hardware, it just posts a power off event from SOURCE_TIMER into the event
+ * queue. That way the fan turns off through the same path as any other event,
+ * and HomeKit hears about it.
+ * 
+ * @addtogroup SleepTimer
+ * @{
+ */
+
+#include <stdint.h>    /* Extended integer types */
+
+#include <esp_log.h>   /* ESP logging functions */
+#include <esp_timer.h> /* One-shot timers */
+
+#include "main.h"
+#include "event_queue.h"
+#include "sleep_timer.h"
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC 1000000
+
+/** Number of Secs in an hour */
+#define NUM_SEC_IN_HOUR 3600
+
+/** Tag used for ESP logging */
+static const char *TAG = "SleepTimer";
+
+/** Length (in Sec) of each timer setting */
+static const uint32_t timer_durations_s[NUM_TIMER] = {
+    [TIMER_OFF] = 0,
+    [TIMER_1H]  = 1 * NUM_SEC_IN_HOUR,
+    [TIMER_2H]  = 2 * NUM_SEC_IN_HOUR,
+    [TIMER_4H]  = 4 * NUM_SEC_IN_HOUR,
+    [TIMER_8H]  = 8 * NUM_SEC_IN_HOUR,
+};
+
+/** Timers counting down to turning each fan off, indexed by fan */
+static esp_timer_handle_t sleep_timers[FAN_NUM_FANS];
+
+/**
+ * @brief  Get the length of a timer setting.
+ * @param  timer Timer setting
+ * @return Length of the timer (in Sec), zero when off.
+ */
+uint32_t Sleep_timer_duration_s(enum State_timer timer)
+{
+    return ((unsigned) timer < NUM_TIMER) ? timer_durations_s[timer] : 0;
+}
+
+/**
+ * @brief   Timer callback for when the sleep timer runs out.
+ * @details Runs in the esp_timer task. Sends a power off event, the event
+ *          handler then clears the timer setting along with turning off.
+ * @param   args [in] Index of the fan the timer belongs to
+ */
+static void expire_callback(void *args)
+{
+    Fan_event_t event = {
+        .source       = SOURCE_TIMER,
+        .id           = ID_POWER,
+        .fan          = (uint8_t) (uintptr_t) args,
+        .arg          = (uint32_t) false,
+        .timestamp_us = esp_timer_get_time(),
+    };
+
+    ESP_LOGI(TAG, "Sleep timer expired (fan %u)", (unsigned) event.fan);
+
+    if (!Event_queue_send(&event))
+    {
+        ESP_LOGW(TAG, "Event queue full, dropping event");
+    }
+}
+
+/**
+ * @brief   (Re)start the countdown for a timer setting.
+ * @details Any countdown already running is dropped, so changing the setting
+ *          always counts down from the new length. TIMER_OFF just stops it.
+ * @param   fan   Fan to turn off
+ * @param   timer Timer setting to count down
+ */
+void Sleep_timer_set(uint8_t fan, enum State_timer timer)
+{
+    uint32_t duration_s = Sleep_timer_duration_s(timer);
+
+    if (fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    esp_timer_handle_t sleep_timer = sleep_timers[fan];
+    (void) esp_timer_stop(sleep_timer);
+
+    if (duration_s > 0)
+    {
+        ESP_LOGI(TAG, "Turning off in %lu h", (unsigned long) (duration_s / NUM_SEC_IN_HOUR));
+        ESP_ERROR_CHECK(esp_timer_start_once(sleep_timer, (uint64_t) duration_s * NUM_USEC_IN_SEC));
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Sleep timer off");
+    }
+}
+
+/**
+ * @brief Initializer for the SleepTimer component.
+ */
+void Sleep_timer_init(void)
+{
+    for (int fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        esp_timer_create_args_t timer_args = {
+            .callback        = expire_callback,
+            .arg             = (void *) (uintptr_t) fan,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name            = "sleep_timer",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sleep_timers[fan]));
+    }
+
+    ESP_LOGI(TAG, "SleepTimer component init!");
+}
+
+/** @} end SleepTimer */
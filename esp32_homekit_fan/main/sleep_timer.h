@@ -0,0 +1,25 @@
+/**
+ * @file sleep_timer.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to turn the fan off after a set time.
+ * 
+ * @addtogroup SleepTimer
+ * @{
+ */
+
+#ifndef SLEEP_TIMER_H
+#define SLEEP_TIMER_H
+
+#include <stdint.h> /* Extended integer types */
+
+#include "main.h"   /* State_timer */
+
+/** Public functions for the SleepTimer component */
+uint32_t Sleep_timer_duration_s(enum State_timer timer);
+void Sleep_timer_set(uint8_t fan, enum State_timer timer);
+void Sleep_timer_init(void);
+
+#endif /* SLEEP_TIMER_H */
+
+/** @} end SleepTimer */
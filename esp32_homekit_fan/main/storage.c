@@ -0,0 +1,377 @@
+/**
+ * @file storage.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep the fan state across power cuts.
+ *
+ * Without this, the fan would always come back up off at full speed after a
+ * power cut, no matter how it was left. Instead, the last fan state is kept in
+ * NVS and restored at boot before the outputs are driven.
+ *
+ * Writing to flash on every event would add flash latency to the event handler
+ * and wear out the NVS partition, especially while someone drags the speed
+ * slider in the Apple Home app. So saving is write-behind: every change just
+ * (re)starts a one-shot timer, and the state is only committed once things have
+ * been idle for CONFIG_FAN_STATE_SAVE_DELAY_S seconds. The whole state packs
+ * into a single 16-bit record, and nothing is written at all if it matches
+ * what's already in flash. NVS itself is log-structured, so each commit simply
+ * appends one small entry and the flash wears evenly.
+ *
+ * When bridging several fans, each has its own record. Fan 0 keeps the
+ * original key, so a board that becomes a bridge keeps its saved state.
+ *
+ * The lifetime cycle counts of each fan's relays ride along on the same
+ * timer, as one blob per fan. Relays only switch when the state changes, so
+ * this adds no commits of its own beyond the ones the state already causes.
+ * 
+ * @addtogroup Storage
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <stdio.h>             /* snprintf */
+#include <string.h>            /* memcmp, memcpy */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+#include <esp_timer.h>         /* One-shot timers */
+#include <nvs.h>               /* NVS read/write functions */
+#include <nvs_flash.h>         /* NVS partition initialization */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+
+#include "main.h"
+#include "storage.h"
+#include "relay.h"
+
+/** NVS namespace and key for the fan state record, other fans append their index */
+#define STORAGE_NAMESPACE "fan"
+#define STORAGE_KEY       "state"
+#define STORAGE_KEY_SIZE  8
+
+/** NVS key for the relay cycle counts, other fans append their index */
+#define STORAGE_CYCLES_KEY "relays"
+
+/** Version of the record layout, bump whenever it changes */
+#define STORAGE_VERSION 2
+
+/** Layout of a fan state record */
+#define RECORD_SPEED_MASK 0x0007
+#define RECORD_OSC_BIT    0x0008
+#define RECORD_ON_BIT     0x0010
+#define RECORD_AUTO_BIT   0x0020
+#define RECORD_PCT_SHIFT  6
+#define RECORD_PCT_MASK   0x007F
+#define RECORD_VER_SHIFT  13
+
+/** Version 1 records had no exact speed, and the version at bit 8 */
+#define RECORD_V1_VER_SHIFT 8
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC 1000000
+
+/** Tag used for ESP logging */
+static const char *TAG = "Storage";
+
+/** Handle for our NVS namespace */
+static nvs_handle_t nvs;
+
+/** Whether NVS could be opened */
+static bool nvs_ready;
+
+/** Timer that commits the pending record once things go idle */
+static esp_timer_handle_t save_timer;
+
+/** Records waiting to be committed, and the records currently in flash, indexed by fan */
+static uint16_t pending_records[FAN_NUM_FANS];
+static uint16_t saved_records[FAN_NUM_FANS];
+
+/** Relay cycle counts waiting to be committed, and the counts currently in flash, indexed by fan */
+static uint32_t pending_cycles[FAN_NUM_FANS][NUM_RELAY];
+static uint32_t saved_cycles[FAN_NUM_FANS][NUM_RELAY];
+
+/** Lock for the pending record and cycle counts */
+static portMUX_TYPE record_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief  Pack a fan state into a record.
+ * @param  state [in] State to pack
+ * @return Packed record.
+ */
+static uint16_t pack_record(const Fan_state_t *state)
+{
+    return (uint16_t) ((STORAGE_VERSION << RECORD_VER_SHIFT) |
+                       ((state->on) ? RECORD_ON_BIT : 0) |
+                       ((state->oscillate) ? RECORD_OSC_BIT : 0) |
+                       ((state->auto_mode) ? RECORD_AUTO_BIT : 0) |
+                       ((state->speed_pct & RECORD_PCT_MASK) << RECORD_PCT_SHIFT) |
+                       (state->speed & RECORD_SPEED_MASK));
+}
+
+/**
+ * @brief Get the NVS key for an entry of a fan.
+ * @param base Key of fan 0's entry
+ * @param fan  Fan of the entry
+ * @param key  [out] Key, STORAGE_KEY_SIZE long
+ */
+static void record_key(const char *base, uint8_t fan, char *key)
+{
+    if (0 == fan)
+    {
+        snprintf(key, STORAGE_KEY_SIZE, "%s", base);
+    }
+    else
+    {
+        snprintf(key, STORAGE_KEY_SIZE, "%s%u", base, (unsigned) fan);
+    }
+}
+
+/**
+ * @brief Commit the pending relay cycle counts of every fan.
+ */
+static void save_cycles(void)
+{
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        uint32_t cycles[NUM_RELAY];
+        char     key[STORAGE_KEY_SIZE];
+
+        portENTER_CRITICAL(&record_lock);
+        memcpy(cycles, pending_cycles[fan], sizeof(cycles));
+        portEXIT_CRITICAL(&record_lock);
+
+        if (0 == memcmp(cycles, saved_cycles[fan], sizeof(cycles)))
+        {
+            continue;
+        }
+
+        record_key(STORAGE_CYCLES_KEY, fan, key);
+        esp_err_t err = nvs_set_blob(nvs, key, cycles, sizeof(cycles));
+        if (ESP_OK == err)
+        {
+            err = nvs_commit(nvs);
+        }
+
+        if (ESP_OK != err)
+        {
+            ESP_LOGW(TAG, "Failed to save fan %u relay cycles: %s", (unsigned) fan, esp_err_to_name(err));
+            continue;
+        }
+
+        memcpy(saved_cycles[fan], cycles, sizeof(cycles));
+    }
+}
+
+/**
+ * @brief  Timer callback to commit the pending records.
+ * @param  args [in] Unused
+ */
+static void save_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    for (uint8_t fan = 0; fan < FAN_NUM_FANS; fan++)
+    {
+        char key[STORAGE_KEY_SIZE];
+
+        portENTER_CRITICAL(&record_lock);
+        uint16_t record = pending_records[fan];
+        portEXIT_CRITICAL(&record_lock);
+
+        if (record == saved_records[fan])
+        {
+            /* Unchanged, or changed and then changed back, nothing to write */
+            continue;
+        }
+
+        record_key(STORAGE_KEY, fan, key);
+        esp_err_t err = nvs_set_u16(nvs, key, record);
+        if (ESP_OK == err)
+        {
+            err = nvs_commit(nvs);
+        }
+
+        if (ESP_OK != err)
+        {
+            ESP_LOGW(TAG, "Failed to save fan %u state: %s", (unsigned) fan, esp_err_to_name(err));
+            continue;
+        }
+
+        saved_records[fan] = record;
+        ESP_LOGI(TAG, "Saved fan %u state 0x%04x", (unsigned) fan, (unsigned) record);
+    }
+
+    save_cycles();
+}
+
+/**
+ * @brief   Load the last saved state of a fan.
+ * @details Leaves the state untouched if nothing valid was saved, so the
+ *          caller can fill in defaults first.
+ * @param   fan   Fan to load
+ * @param   state [out] Restored fan state
+ * @return  Whether a saved state was restored.
+ */
+bool Storage_load(uint8_t fan, Fan_state_t *state)
+{
+    uint16_t record = 0;
+    char     key[STORAGE_KEY_SIZE];
+
+    if (fan >= FAN_NUM_FANS)
+    {
+        return false;
+    }
+
+    record_key(STORAGE_KEY, fan, key);
+    if (!nvs_ready || ESP_OK != nvs_get_u16(nvs, key, &record))
+    {
+        return false;
+    }
+
+    enum State_speed speed   = (enum State_speed) (record & RECORD_SPEED_MASK);
+    uint8_t          pct     = (uint8_t) ((record >> RECORD_PCT_SHIFT) & RECORD_PCT_MASK);
+    uint16_t         version = record >> RECORD_VER_SHIFT;
+    if (1 == (record >> RECORD_V1_VER_SHIFT))
+    {
+        /* Saved before the exact speed was, run at the top of the level */
+        pct     = Speed_to_pct(speed);
+        version = STORAGE_VERSION;
+    }
+
+    if (version != STORAGE_VERSION || speed < SPEED_1 || speed > SPEED_4 || Speed_from_pct(pct) != speed)
+    {
+        ESP_LOGW(TAG, "Ignoring saved fan state 0x%04x", (unsigned) record);
+        return false;
+    }
+
+    state->on        = (0 != (record & RECORD_ON_BIT));
+    state->oscillate = (0 != (record & RECORD_OSC_BIT));
+    state->auto_mode = (0 != (record & RECORD_AUTO_BIT));
+    state->speed     = speed;
+    state->speed_pct = pct;
+    state->dirty     = 0;
+
+    saved_records[fan]   = record;
+    pending_records[fan] = record;
+
+    ESP_LOGI(TAG, "Restored fan %u state 0x%04x", (unsigned) fan, (unsigned) record);
+    return true;
+}
+
+/**
+ * @brief   Save the state of a fan once things have been idle for a while.
+ * @details Cheap enough to call on every change, it only stashes the record
+ *          and pushes the commit deadline back.
+ * @param   fan   Fan to save
+ * @param   state [in] State to save
+ */
+void Storage_save_later(uint8_t fan, const Fan_state_t *state)
+{
+    if (!nvs_ready || fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&record_lock);
+    pending_records[fan] = pack_record(state);
+    portEXIT_CRITICAL(&record_lock);
+
+    /* Restart the idle countdown */
+    (void) esp_timer_stop(save_timer);
+    (void) esp_timer_start_once(save_timer, (uint64_t) CONFIG_FAN_STATE_SAVE_DELAY_S * NUM_USEC_IN_SEC);
+}
+
+/**
+ * @brief   Load the lifetime cycle counts of a fan's relays.
+ * @details A blob of a different size, from a bank with a different number of
+ *          relays, reads as nothing saved.
+ * @param   fan    Fan to load
+ * @param   cycles [out] Cycle count of each relay, NUM_RELAY long
+ * @return  Whether saved counts were loaded.
+ */
+bool Storage_load_cycles(uint8_t fan, uint32_t *cycles)
+{
+    size_t size = NUM_RELAY * sizeof(uint32_t);
+    char   key[STORAGE_KEY_SIZE];
+
+    if (!nvs_ready || fan >= FAN_NUM_FANS)
+    {
+        return false;
+    }
+
+    record_key(STORAGE_CYCLES_KEY, fan, key);
+    if (ESP_OK != nvs_get_blob(nvs, key, cycles, &size) || NUM_RELAY * sizeof(uint32_t) != size)
+    {
+        return false;
+    }
+
+    portENTER_CRITICAL(&record_lock);
+    memcpy(saved_cycles[fan], cycles, size);
+    memcpy(pending_cycles[fan], cycles, size);
+    portEXIT_CRITICAL(&record_lock);
+    return true;
+}
+
+/**
+ * @brief   Save the lifetime cycle counts of a fan's relays along with the state.
+ * @details Like Storage_save_later(), only stashes the counts and pushes the
+ *          commit deadline back.
+ * @param   fan    Fan to save
+ * @param   cycles [in] Cycle count of each relay, NUM_RELAY long
+ */
+void Storage_save_cycles_later(uint8_t fan, const uint32_t *cycles)
+{
+    if (!nvs_ready || fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&record_lock);
+    memcpy(pending_cycles[fan], cycles, sizeof(pending_cycles[fan]));
+    portEXIT_CRITICAL(&record_lock);
+
+    /* Restart the idle countdown */
+    (void) esp_timer_stop(save_timer);
+    (void) esp_timer_start_once(save_timer, (uint64_t) CONFIG_FAN_STATE_SAVE_DELAY_S * NUM_USEC_IN_SEC);
+}
+
+/**
+ * @brief   Initializer for the Storage component.
+ * @details Brings up NVS and opens our namespace. Has to run before anything
+ *          that wants to load the fan state.
+ */
+void Storage_init(void)
+{
+    esp_err_t err = nvs_flash_init();
+    if (ESP_ERR_NVS_NO_FREE_PAGES == err || ESP_ERR_NVS_NEW_VERSION_FOUND == err)
+    {
+        /* Partition is full or from a newer layout, start it over */
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+
+    if (ESP_OK == err)
+    {
+        err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &nvs);
+    }
+
+    if (ESP_OK != err)
+    {
+        ESP_LOGE(TAG, "NVS unavailable, fan state won't persist: %s", esp_err_to_name(err));
+        return;
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback        = save_callback,
+        .arg             = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "state_save",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &save_timer));
+
+    nvs_ready = true;
+
+    ESP_LOGI(TAG, "Storage component init!");
+}
+
+/** @} end Storage */
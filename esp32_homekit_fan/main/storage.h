@@ -0,0 +1,28 @@
+/**
+ * @file storage.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to keep the fan state across power cuts.
+ * 
+ * @addtogroup Storage
+ * @{
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
+
+#include "main.h"    /* Fan_state_t */
+
+/** Public functions for the Storage component */
+bool Storage_load(uint8_t fan, Fan_state_t *state);
+void Storage_save_later(uint8_t fan, const Fan_state_t *state);
+bool Storage_load_cycles(uint8_t fan, uint32_t *cycles);
+void Storage_save_cycles_later(uint8_t fan, const uint32_t *cycles);
+void Storage_init(void);
+
+#endif /* STORAGE_H */
+
+/** @} end Storage */
@@ -0,0 +1,441 @@
+/**
+ * @file telemetry.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to sample heap and stack usage over time.
+ *
+ * Stack sizes and heap headroom are otherwise guesswork, so this component
+ * samples them periodically from an esp_timer. Each sample records the stack
+ * high-water mark (the least free stack a task has ever had) of the HomeKit
+ * and fan tasks, along with the current, minimum ever and largest free block
+ * of the heap. The last few free heap readings are kept to show the trend.
+ *
+ * The HomeKit core's allocation counters (per call site, plus memory pool
+ * usage) come from hap_platform_memory_get_stats(). Call sites are return
+ * addresses, resolve them with addr2line against the application ELF.
+ *
+ * Each relay's switching (lifetime and since-boot cycles, wear against its
+ * rated life, and a histogram of the time between switches) comes from the
+ * Relay component, to check that coalescing and ramping cut switching.
+ *
+ * Everything can be dumped to the log, fetched from the HomeKit HTTP server:
+ *
+ * curl <fan-ip>:<hap-port>/debug/telemetry
+ *
+ * or read in HomeKit through a custom service with the minimum free heap and
+ * the smallest stack headroom across the tracked tasks.
+ * 
+ * @addtogroup Telemetry
+ * @{
+ */
+
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+#include <esp_timer.h>            /* Periodic sampling timer */
+#include <esp_heap_caps.h>        /* Heap statistics */
+#include <freertos/FreeRTOS.h>    /* Basic FreeRTOS functions */
+#include <freertos/task.h>        /* Stack high-water marks */
+
+#include <hap.h>                  /* HomeKit Accessory Protocol library */
+#include <hap_apple_chars.h>      /* Name characteristic */
+#include <hap_platform_memory.h>  /* HomeKit core allocation statistics */
+#include <app_wifi.h>             /* Wi-Fi connection statistics */
+
+#ifdef CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+
+#include "main.h"
+#include "telemetry.h"
+#include "ir_decoder.h"
+#include "thread_net.h"
+#include "phase.h"
+#include "relay.h"
+
+#ifdef CONFIG_FAN_TELEMETRY
+
+/** Number of uSecs in a Sec */
+#define NUM_USEC_IN_SEC 1000000
+
+/** Number of tasks whose stacks are tracked */
+#define NUM_TRACKED_TASK 6
+
+/** Number of free heap readings kept for the trend */
+#define NUM_HEAP_TREND 16
+
+/** Size of the buffer used to format a single line */
+#define TELEMETRY_LINE_SIZE 256
+
+/** Custom UUIDs for the telemetry service and its characteristics */
+#define TELEMETRY_SERV_UUID       "9C1F0000-3B8E-4D2A-A5F1-6E0B7C4D2E19"
+#define TELEMETRY_CHAR_HEAP_UUID  "9C1F0001-3B8E-4D2A-A5F1-6E0B7C4D2E19"
+#define TELEMETRY_CHAR_STACK_UUID "9C1F0002-3B8E-4D2A-A5F1-6E0B7C4D2E19"
+
+/** Stack usage of one tracked task */
+typedef struct Telemetry_task_t
+{
+    const char *name;      /** FreeRTOS task name */
+    uint32_t    stack_hwm; /** Least free stack (in Bytes) seen, 0 if never found */
+} Telemetry_task_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Telemetry";
+
+/** Tasks whose stacks are tracked, HomeKit core ones first */
+static Telemetry_task_t tasks[NUM_TRACKED_TASK] = {
+    { .name = "hap-loop" },
+    { .name = "httpd" },
+    { .name = "hap-pair-worker" },
+    { .name = "EventHandler" },
+    { .name = "RemoteHandler" },
+    { .name = "esp_timer" },
+};
+
+/** Names of the relays in a bank, indexed by Relay_index */
+static const char *relay_names[NUM_RELAY] = { "speed1", "speed2", "speed3", "speed4", "osc" };
+
+/** Names of the buckets of time between relay switches, indexed by Relay_interval */
+static const char *relay_interval_names[NUM_RELAY_INTERVAL] = { "<100ms", "<1s", "<10s", "<1m", "<10m", "<1h", ">=1h" };
+
+/** Heap readings (in Bytes) */
+static uint32_t heap_free;
+static uint32_t heap_min_free;
+static uint32_t heap_largest_block;
+static uint32_t heap_trend[NUM_HEAP_TREND];
+static uint32_t num_samples;
+
+/** Timer driving the sampling */
+static esp_timer_handle_t sample_timer;
+
+#ifdef CONFIG_FAN_TELEMETRY_HAP_SERVICE
+/** Characteristics of the telemetry service */
+static hap_char_t *heap_char;
+static hap_char_t *stack_char;
+#endif
+
+/**
+ * @brief  Get the smallest stack headroom across the tracked tasks.
+ * @return Least free stack (in Bytes), 0 if no task was found yet.
+ */
+static uint32_t min_stack_hwm(void)
+{
+    uint32_t min_hwm = 0;
+
+    for (int i = 0; i < NUM_TRACKED_TASK; i++)
+    {
+        if (tasks[i].stack_hwm && (0 == min_hwm || tasks[i].stack_hwm < min_hwm))
+        {
+            min_hwm = tasks[i].stack_hwm;
+        }
+    }
+
+    return min_hwm;
+}
+
+/**
+ * @brief   Timer callback taking one sample.
+ * @details Runs in the esp_timer task. Tasks are looked up by name every time,
+ *          since the HomeKit ones come and go with hap_start()/hap_stop(). A
+ *          task that is gone keeps its last reading.
+ * @param   args [in] Unused
+ */
+static void sample_callback(void *args)
+{
+    UNUSED_PARAM(args);
+
+    for (int i = 0; i < NUM_TRACKED_TASK; i++)
+    {
+        TaskHandle_t handle = xTaskGetHandle(tasks[i].name);
+        if (NULL != handle)
+        {
+            /* ESP-IDF reports the high-water mark in Bytes */
+            tasks[i].stack_hwm = (uint32_t) uxTaskGetStackHighWaterMark(handle);
+        }
+    }
+
+    heap_free          = (uint32_t) heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+    heap_min_free      = (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+    heap_largest_block = (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+    heap_trend[num_samples % NUM_HEAP_TREND] = heap_free;
+    num_samples++;
+
+#ifdef CONFIG_FAN_TELEMETRY_HAP_SERVICE
+    hap_val_t new_val = { .u = heap_min_free };
+    hap_char_update_val(heap_char, &new_val);
+    new_val.u = min_stack_hwm();
+    hap_char_update_val(stack_char, &new_val);
+#endif
+}
+
+/**
+ * @brief  Format one line of the telemetry report.
+ * @param  line Index of the line to format
+ * @param  buf  [out] Buffer to write into
+ * @param  size Size of the buffer
+ * @return Number of characters written, -1 once past the last line.
+ */
+static int format_line(int line, char *buf, size_t size)
+{
+    int len = 0;
+
+    if (0 == line--)
+    {
+        len = snprintf(buf, size, "heap: free=%" PRIu32 " min=%" PRIu32 " largest=%" PRIu32 " samples=%" PRIu32,
+                       heap_free, heap_min_free, heap_largest_block, num_samples);
+    }
+    else if (0 == line--)
+    {
+        /* Oldest reading first */
+        uint32_t count = (num_samples < NUM_HEAP_TREND) ? num_samples : NUM_HEAP_TREND;
+        len = snprintf(buf, size, "heap trend:");
+        for (uint32_t i = num_samples - count; i < num_samples && len < (int) size; i++)
+        {
+            len += snprintf(buf + len, size - len, " %" PRIu32, heap_trend[i % NUM_HEAP_TREND]);
+        }
+    }
+#ifdef CONFIG_FAN_HAP_THREAD
+    else if (0 == line--)
+    {
+        Thread_net_stats_t thread;
+        Thread_net_get_stats(&thread);
+        len = snprintf(buf, size, "thread: time_to_attach=%" PRIu32 "ms attaches=%" PRIu32 " role=%" PRIu32,
+                       thread.time_to_attach_ms, thread.attaches, thread.role);
+    }
+    else if (0 == line--)
+    {
+        Thread_net_stats_t thread;
+        Thread_net_get_stats(&thread);
+        len = snprintf(buf, size, "thread mac: tx=%" PRIu32 " rx=%" PRIu32 " retries=%" PRIu32,
+                       thread.tx_frames, thread.rx_frames, thread.tx_retries);
+    }
+#else
+    else if (0 == line--)
+    {
+        app_wifi_stats_t wifi;
+        app_wifi_get_stats(&wifi);
+        len = snprintf(buf, size, "wifi: time_to_ip=%" PRIu32 "ms connects=%" PRIu32 " fast=%" PRIu32,
+                       wifi.time_to_ip_ms, wifi.connects, wifi.fast_connects);
+    }
+    else if (0 == line--)
+    {
+        app_wifi_stats_t wifi;
+        app_wifi_get_stats(&wifi);
+        len = snprintf(buf, size, "wifi ps: none=%" PRIu32 "ms min=%" PRIu32 "ms max=%" PRIu32 "ms switches=%" PRIu32,
+                       wifi.ps_residency_ms[APP_WIFI_PS_NONE], wifi.ps_residency_ms[APP_WIFI_PS_MIN_MODEM],
+                       wifi.ps_residency_ms[APP_WIFI_PS_MAX_MODEM], wifi.ps_switches);
+    }
+#endif
+    else if (0 == line--)
+    {
+        hap_event_bus_stats_t events;
+        hap_event_bus_get_stats(&events);
+        len = snprintf(buf, size, "hap events: reported=%" PRIu32 " deferred=%" PRIu32 " dropped=%" PRIu32
+                       " max_queued=%" PRIu32, events.reported, events.deferred, events.dropped, events.max_queued);
+    }
+#ifdef CONFIG_FAN_PHASE_CONTROL
+    else if (0 == line--)
+    {
+        Phase_stats_t phase;
+        Phase_get_stats(&phase);
+        len = snprintf(buf, size, "phase: half_cycle=%" PRIu32 "us min=%" PRIu32 "us max=%" PRIu32 "us fires=%" PRIu32
+                       " late_max=%" PRIu32 "us zc=%" PRIu32 " glitches=%" PRIu32 " dropouts=%" PRIu32,
+                       phase.half_cycle_us, phase.half_cycle_min_us, phase.half_cycle_max_us, phase.fires,
+                       phase.fire_late_max_us, phase.zero_crossings, phase.glitches, phase.dropouts);
+    }
+#endif
+    else if (0 == line--)
+    {
+        Ir_stats_t ir;
+        Ir_decode_get_stats(&ir);
+        len = snprintf(buf, size, "ir: captures=%" PRIu32 " decoded=%" PRIu32 " (%" PRIu32 "%%) frames=%" PRIu32 " scale=",
+                       ir.captures, ir.decoded, (ir.captures) ? ir.decoded * 100 / ir.captures : 0, ir.frames);
+        for (int protocol = 0; protocol < NUM_IR_PROTOCOL && len < (int) size; protocol++)
+        {
+            len += snprintf(buf + len, size - len, "%s%u%%", (protocol) ? "/" : "",
+                            (unsigned) (ir.scale[protocol] * 100 / IR_SCALE_NOMINAL));
+        }
+    }
+    else if (line < FAN_NUM_FANS * NUM_RELAY)
+    {
+        Relay_stats_t relay;
+        if (!Relay_get_stats(line / NUM_RELAY, line % NUM_RELAY, &relay))
+        {
+            len = snprintf(buf, size, "relay %d/%s: not wired", line / NUM_RELAY, relay_names[line % NUM_RELAY]);
+        }
+        else
+        {
+            len = snprintf(buf, size, "relay %d/%s: cycles=%" PRIu32 " boot=%" PRIu32 " dry_run=%" PRIu32
+                           " wear=%" PRIu32 ".%" PRIu32 "%% gaps",
+                           line / NUM_RELAY, relay_names[line % NUM_RELAY], relay.cycles, relay.boot_cycles,
+                           relay.dry_run_cycles, relay.wear_permille / 10, relay.wear_permille % 10);
+            for (int i = 0; i < NUM_RELAY_INTERVAL && len < (int) size; i++)
+            {
+                len += snprintf(buf + len, size - len, " %s=%" PRIu32, relay_interval_names[i], relay.intervals[i]);
+            }
+        }
+    }
+    else if ((line -= FAN_NUM_FANS * NUM_RELAY) < NUM_TRACKED_TASK)
+    {
+        len = snprintf(buf, size, "stack %s: hwm=%" PRIu32, tasks[line].name, tasks[line].stack_hwm);
+    }
+    else
+    {
+        hap_platform_memory_stats_t stats;
+        line -= NUM_TRACKED_TASK;
+
+        if (0 != hap_platform_memory_get_stats(&stats))
+        {
+            return -1;
+        }
+
+        if (0 == line--)
+        {
+            len = snprintf(buf, size, "hap mem: allocs=%" PRIu32 " frees=%" PRIu32 " heap=%" PRIu32,
+                           stats.allocs, stats.frees, stats.heap_allocs);
+        }
+        else if (line < stats.num_pools)
+        {
+            len = snprintf(buf, size, "hap pool %u: in_use=%u/%u peak=%u", (unsigned) stats.pools[line].block_size,
+                           (unsigned) stats.pools[line].in_use, (unsigned) stats.pools[line].block_cnt,
+                           (unsigned) stats.pools[line].peak);
+        }
+        else if ((line -= stats.num_pools) < stats.num_sites)
+        {
+            len = snprintf(buf, size, "hap site %p: allocs=%" PRIu32 " max=%" PRIu32, stats.sites[line].site,
+                           stats.sites[line].allocs, stats.sites[line].max_size);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief Start sampling heap and stack usage.
+ */
+void Telemetry_init(void)
+{
+    const esp_timer_create_args_t timer_args = {
+        .callback        = sample_callback,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name            = "telemetry",
+    };
+
+    if (ESP_OK != esp_timer_create(&timer_args, &sample_timer))
+    {
+        ESP_LOGE(TAG, "Failed to create the sampling timer");
+        return;
+    }
+
+    /* Take a first sample right away, then keep going periodically */
+    sample_callback(NULL);
+    esp_timer_start_periodic(sample_timer, (uint64_t) CONFIG_FAN_TELEMETRY_PERIOD_S * NUM_USEC_IN_SEC);
+}
+
+/**
+ * @brief Dump the latest telemetry to the log.
+ */
+void Telemetry_dump(void)
+{
+    char line[TELEMETRY_LINE_SIZE];
+
+    for (int i = 0; format_line(i, line, sizeof(line)) >= 0; i++)
+    {
+        ESP_LOGI(TAG, "%s", line);
+    }
+}
+
+/**
+ * @brief   Add the telemetry service to the accessory.
+ * @details Must be called before the accessory is added to the HomeKit
+ *          database. Does nothing unless CONFIG_FAN_TELEMETRY_HAP_SERVICE is
+ *          set.
+ * @param   accessory [in] Accessory to add the service to
+ */
+void Telemetry_add_service(hap_acc_t *accessory)
+{
+#ifdef CONFIG_FAN_TELEMETRY_HAP_SERVICE
+    hap_serv_t *service = hap_serv_create(TELEMETRY_SERV_UUID);
+
+    /* Read-only, there's no point notifying on a slow moving sample */
+    heap_char  = hap_char_uint32_create(TELEMETRY_CHAR_HEAP_UUID, HAP_CHAR_PERM_PR, heap_min_free);
+    stack_char = hap_char_uint32_create(TELEMETRY_CHAR_STACK_UUID, HAP_CHAR_PERM_PR, min_stack_hwm());
+    hap_char_add_description(heap_char, "Minimum Free Heap");
+    hap_char_add_description(stack_char, "Minimum Stack Headroom");
+
+    hap_serv_add_char(service, hap_char_name_create("Telemetry"));
+    hap_serv_add_char(service, heap_char);
+    hap_serv_add_char(service, stack_char);
+    hap_acc_add_serv(accessory, service);
+#else
+    UNUSED_PARAM(accessory);
+#endif /* CONFIG_FAN_TELEMETRY_HAP_SERVICE */
+}
+
+#ifdef CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT
+/**
+ * @brief  HTTP handler returning the latest telemetry as plain text.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t telemetry_http_handler(httpd_req_t *req)
+{
+    char line[TELEMETRY_LINE_SIZE];
+    int  len;
+
+    httpd_resp_set_type(req, "text/plain");
+    for (int i = 0; (len = format_line(i, line, sizeof(line) - 1)) >= 0; i++)
+    {
+        line[len++] = '\n';
+        httpd_resp_send_chunk(req, line, len);
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the telemetry debug endpoint */
+static const httpd_uri_t telemetry_get = {
+    .uri     = "/debug/telemetry",
+    .method  = HTTP_GET,
+    .handler = telemetry_http_handler,
+};
+#endif /* CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the telemetry debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT is set.
+ */
+void Telemetry_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, telemetry endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &telemetry_get);
+#endif /* CONFIG_FAN_TELEMETRY_HTTP_ENDPOINT */
+}
+
+#else /* !CONFIG_FAN_TELEMETRY */
+
+void Telemetry_init(void) {}
+void Telemetry_dump(void) {}
+void Telemetry_add_service(hap_acc_t *accessory) { UNUSED_PARAM(accessory); }
+void Telemetry_register_http_handler(void) {}
+
+#endif /* CONFIG_FAN_TELEMETRY */
+
+/** @} end Telemetry */
@@ -0,0 +1,24 @@
+/**
+ * @file telemetry.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to sample heap and stack usage over time.
+ * 
+ * @addtogroup Telemetry
+ * @{
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <hap.h> /* hap_acc_t */
+
+/** Public functions for the Telemetry component */
+void Telemetry_init(void);
+void Telemetry_dump(void);
+void Telemetry_add_service(hap_acc_t *accessory);
+void Telemetry_register_http_handler(void);
+
+#endif /* TELEMETRY_H */
+
+/** @} end Telemetry */
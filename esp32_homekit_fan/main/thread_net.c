@@ -0,0 +1,266 @@
+/**
+ * @file thread_net.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bring up the Thread network HomeKit is served on.
+ *
+ * Takes the place of app_wifi when HomeKit is served over Thread. It starts
+ * OpenThread on the 802.15.4 radio, attaches its network interface to lwIP
+ * and joins the network in the active operational dataset, or the one set in
+ * the OpenThread menuconfig when none has been committed yet. The HAP core
+ * then registers the accessory with the Border Router over SRP.
+ *
+ * With CONFIG_FAN_THREAD_SLEEPY, the fan joins as a sleepy end device: the
+ * radio stays off except to poll its parent every
+ * CONFIG_FAN_THREAD_POLL_PERIOD_MS, which bounds how long a request from a
+ * controller waits at the parent.
+ *
+ * @addtogroup ThreadNet
+ * @{
+ */
+
+#include <stdbool.h>                       /* Boolean type */
+#include <stdint.h>                        /* Extended integer types */
+#include <string.h>                        /* For memory/string-related functions */
+#include <inttypes.h>                      /* Format macros for extended integers */
+
+#include <sdkconfig.h>                     /* Project configuration */
+#include <esp_log.h>                       /* ESP logging functions */
+
+#ifdef CONFIG_FAN_HAP_THREAD
+#include <esp_event.h>                     /* Default event loop */
+#include <esp_netif.h>                     /* Network interface */
+#include <esp_timer.h>                     /* Time to attach */
+#include <esp_vfs_eventfd.h>               /* Event fds the OpenThread mainloop waits on */
+#include <esp_openthread.h>                /* OpenThread stack */
+#include <esp_openthread_lock.h>           /* OpenThread API lock */
+#include <esp_openthread_netif_glue.h>     /* lwIP glue */
+#include <esp_openthread_types.h>          /* Platform configuration */
+#include <freertos/task.h>                 /* Definitions for creating tasks */
+#include <freertos/event_groups.h>         /* Attached bit */
+#include <openthread/dataset.h>            /* Active operational dataset */
+#include <openthread/instance.h>           /* State change callback */
+#include <openthread/link.h>               /* Poll period, MAC counters */
+#include <openthread/thread.h>             /* Device role and mode */
+#endif
+
+#include "main.h"
+#include "thread_net.h"
+
+#ifdef CONFIG_FAN_HAP_THREAD
+
+#define THREAD_NET_TASK_NAME      "ThreadNet"
+#define THREAD_NET_TASK_STACKSIZE 8 * 1024
+#define THREAD_NET_TASK_PRIORITY  5
+
+/** Event fds for the radio driver, the task queue and the lwIP glue */
+#define THREAD_NET_EVENTFDS       3
+
+/** Sizes of the queues into the OpenThread task */
+#define THREAD_NET_QUEUE_SIZE     10
+
+/** Event group bit set while attached to a Thread network */
+#define THREAD_NET_ATTACHED_BIT   BIT0
+
+/** Number of uSecs in a mSec */
+#define NUM_USEC_IN_MSEC          1000
+
+/** Tag used for ESP logging */
+static const char *TAG = "ThreadNet";
+
+/** Attached bit */
+static EventGroupHandle_t thread_net_events;
+
+/** When the stack was started */
+static int64_t start_us;
+
+/** Statistics not kept by OpenThread */
+static uint32_t time_to_attach_ms;
+static uint32_t attaches;
+
+/**
+ * @brief Callback for OpenThread state changes, runs in the OpenThread task.
+ * @param flags   [in] Which parts of the state changed
+ * @param context [in] Unused
+ */
+static void state_changed_callback(otChangedFlags flags, void *context)
+{
+    UNUSED_PARAM(context);
+
+    if (!(flags & OT_CHANGED_THREAD_ROLE))
+    {
+        return;
+    }
+
+    otDeviceRole role = otThreadGetDeviceRole(esp_openthread_get_instance());
+    bool attached = (role >= OT_DEVICE_ROLE_CHILD);
+    bool was_attached = (0 != (xEventGroupGetBits(thread_net_events) & THREAD_NET_ATTACHED_BIT));
+
+    if (attached && !was_attached)
+    {
+        time_to_attach_ms = (uint32_t) ((esp_timer_get_time() - start_us) / NUM_USEC_IN_MSEC);
+        attaches++;
+        (void) xEventGroupSetBits(thread_net_events, THREAD_NET_ATTACHED_BIT);
+        ESP_LOGI(TAG, "Attached as %s after %" PRIu32 "ms", otThreadDeviceRoleToString(role), time_to_attach_ms);
+    }
+    else if (!attached && was_attached)
+    {
+        (void) xEventGroupClearBits(thread_net_events, THREAD_NET_ATTACHED_BIT);
+        ESP_LOGW(TAG, "Detached");
+        /* Time the next attach from here */
+        start_us = esp_timer_get_time();
+    }
+}
+
+/**
+ * @brief   Task running the OpenThread stack.
+ * @details Sets the stack up, then notifies the caller of Thread_net_init()
+ *          and runs the mainloop for good.
+ * @param p [in] Handle of the task to notify
+ */
+static void thread_net_task(void *p)
+{
+    esp_openthread_platform_config_t config = {
+        .radio_config = {
+            .radio_mode = RADIO_MODE_NATIVE,
+        },
+        .host_config = {
+            .host_connection_mode = HOST_CONNECTION_MODE_NONE,
+        },
+        .port_config = {
+            .storage_partition_name = "nvs",
+            .netif_queue_size       = THREAD_NET_QUEUE_SIZE,
+            .task_queue_size        = THREAD_NET_QUEUE_SIZE,
+        },
+    };
+    ESP_ERROR_CHECK(esp_openthread_init(&config));
+
+    esp_netif_config_t netif_cfg = ESP_NETIF_DEFAULT_OPENTHREAD();
+    esp_netif_t *netif = esp_netif_new(&netif_cfg);
+    ESP_ERROR_CHECK(esp_netif_attach(netif, esp_openthread_netif_glue_init(&config)));
+    ESP_ERROR_CHECK(esp_netif_set_default_netif(netif));
+
+    /* No other task uses the stack until the caller is notified */
+    otInstance *instance = esp_openthread_get_instance();
+    (void) otSetStateChangedCallback(instance, state_changed_callback, NULL);
+
+#ifdef CONFIG_FAN_THREAD_SLEEPY
+    otLinkModeConfig mode = {
+        .mRxOnWhenIdle = false,
+        .mDeviceType   = false,
+        .mNetworkData  = false,
+    };
+    (void) otThreadSetLinkMode(instance, mode);
+    (void) otLinkSetPollPeriod(instance, CONFIG_FAN_THREAD_POLL_PERIOD_MS);
+#endif
+
+    /* Rejoin the committed network, or fall back to the menuconfig one */
+    otOperationalDatasetTlvs dataset;
+    otError err = otDatasetGetActiveTlvs(instance, &dataset);
+    start_us = esp_timer_get_time();
+    ESP_ERROR_CHECK(esp_openthread_auto_start((OT_ERROR_NONE == err) ? &dataset : NULL));
+
+    (void) xTaskNotifyGive((TaskHandle_t) p);
+
+    /* Only returns if the stack is torn down, which never happens */
+    (void) esp_openthread_launch_mainloop();
+    ESP_LOGE(TAG, "OpenThread mainloop exited");
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief   Initializer for the ThreadNet component.
+ * @details Starts the OpenThread stack and returns once it can be used, without
+ *          waiting to attach. Use Thread_net_wait_attached() if that's needed.
+ */
+void Thread_net_init(void)
+{
+    esp_vfs_eventfd_config_t eventfd_config = {
+        .max_fds = THREAD_NET_EVENTFDS,
+    };
+
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    ESP_ERROR_CHECK(esp_vfs_eventfd_register(&eventfd_config));
+
+    thread_net_events = xEventGroupCreate();
+    if (NULL == thread_net_events)
+    {
+        ESP_LOGE(TAG, "Failed to create the event group");
+        return;
+    }
+
+    if (pdPASS != xTaskCreate(thread_net_task, THREAD_NET_TASK_NAME, THREAD_NET_TASK_STACKSIZE,
+                              xTaskGetCurrentTaskHandle(), THREAD_NET_TASK_PRIORITY, NULL))
+    {
+        ESP_LOGE(TAG, "Failed to create the OpenThread task");
+        vEventGroupDelete(thread_net_events);
+        thread_net_events = NULL;
+        return;
+    }
+    (void) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    ESP_LOGI(TAG, "ThreadNet component init!");
+}
+
+/**
+ * @brief Wait for the fan to attach to a Thread network.
+ * @param ticks_to_wait [in] How long to wait
+ * @return ESP_OK once attached
+ * @return ESP_ERR_TIMEOUT if not attached within ticks_to_wait
+ */
+esp_err_t Thread_net_wait_attached(TickType_t ticks_to_wait)
+{
+    if (NULL == thread_net_events)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    EventBits_t bits = xEventGroupWaitBits(thread_net_events, THREAD_NET_ATTACHED_BIT,
+                                           pdFALSE, pdTRUE, ticks_to_wait);
+    return (bits & THREAD_NET_ATTACHED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/**
+ * @brief Get the Thread network statistics.
+ * @param stats [out] Filled with the current statistics
+ */
+void Thread_net_get_stats(Thread_net_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->time_to_attach_ms = time_to_attach_ms;
+    stats->attaches          = attaches;
+
+    if (NULL == thread_net_events)
+    {
+        return;
+    }
+
+    esp_openthread_lock_acquire(portMAX_DELAY);
+    otInstance *instance = esp_openthread_get_instance();
+    const otMacCounters *counters = otLinkGetCounters(instance);
+    stats->role       = (uint32_t) otThreadGetDeviceRole(instance);
+    stats->tx_frames  = counters->mTxTotal;
+    stats->rx_frames  = counters->mRxTotal;
+    stats->tx_retries = counters->mTxRetry;
+    esp_openthread_lock_release();
+}
+
+#else /* !CONFIG_FAN_HAP_THREAD */
+
+void Thread_net_init(void) {}
+
+esp_err_t Thread_net_wait_attached(TickType_t ticks_to_wait)
+{
+    UNUSED_PARAM(ticks_to_wait);
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void Thread_net_get_stats(Thread_net_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif /* CONFIG_FAN_HAP_THREAD */
+
+/** @} end ThreadNet */
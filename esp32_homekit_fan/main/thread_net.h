@@ -0,0 +1,36 @@
+/**
+ * @file thread_net.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bring up the Thread network HomeKit is served on.
+ *
+ * @addtogroup ThreadNet
+ * @{
+ */
+
+#ifndef THREAD_NET_H
+#define THREAD_NET_H
+
+#include <stdint.h>            /* Extended integer types */
+#include <esp_err.h>           /* ESP error handling */
+#include <freertos/FreeRTOS.h> /* TickType_t */
+
+/** Thread network statistics */
+typedef struct Thread_net_stats_t
+{
+    uint32_t time_to_attach_ms; /** Time from starting the stack to the last attach */
+    uint32_t attaches;          /** Number of times the device attached */
+    uint32_t role;              /** Current otDeviceRole */
+    uint32_t tx_frames;         /** MAC frames sent */
+    uint32_t rx_frames;         /** MAC frames received */
+    uint32_t tx_retries;        /** MAC retransmissions */
+} Thread_net_stats_t;
+
+/** Public functions for the ThreadNet component */
+void Thread_net_init(void);
+esp_err_t Thread_net_wait_attached(TickType_t ticks_to_wait);
+void Thread_net_get_stats(Thread_net_stats_t *stats);
+
+#endif /* THREAD_NET_H */
+
+/** @} end ThreadNet */
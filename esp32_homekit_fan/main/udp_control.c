@@ -0,0 +1,450 @@
+/**
+ * @file udp_control.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component for low-latency local control over UDP.
+ *
+ * Going through a home hub adds seconds to every change, which is too slow for
+ * an automation server that drives the fan at high rates. With
+ * CONFIG_FAN_UDP_CONTROL, paired controllers can also send commands straight
+ * to the fan as UDP datagrams, which go into the event queue like HomeKit
+ * writes do and are reported back to HomeKit like any other local change.
+ *
+ * No new secret is needed. A command is sealed with ChaCha20-Poly1305 under a
+ * key derived from the HAP long-term keys (hap_ctrl_derive_key()), which only
+ * the accessory and that controller can compute. State changes are multicast
+ * to CONFIG_FAN_UDP_MULTICAST_GROUP, signed with the accessory long-term key
+ * (hap_acc_sign()), so any paired controller can check them against the
+ * AccessoryLTPK it got while pairing.
+ *
+ * Every datagram starts with a Udp_header_t. All fields are little endian.
+ *
+ * Command, controller to fan port:
+ *
+ *     header (type UDP_FRAME_COMMAND, id_len)
+ *     counter  uint64, larger than in any earlier command from the controller
+ *     id       id_len bytes, pairing identifier of the controller
+ *     sealed   up to UDP_MAX_COMMANDS of (fan, Event_id, argument), a byte each
+ *     tag      16 bytes
+ *
+ * sealed with the key from hap_ctrl_derive_key(id, UDP_KDF_SALT, UDP_KDF_INFO),
+ * the nonce epoch || counter and everything before sealed as associated data.
+ * Arguments are as for HomeKit writes (the speed or timer setting, or 0/1).
+ *
+ * State, fan to multicast group, on every change and in answer to a query:
+ *
+ *     header (type UDP_FRAME_STATE, id_len 0)
+ *     epoch    uint32, picked at random on every boot
+ *     sequence uint32, counts up with every state frame
+ *     num_fans uint8
+ *     fans     num_fans of (on, oscillate, speed, timer), a byte each
+ *     sig      Ed25519 signature of everything before it
+ *
+ * Query, anyone to fan port: header (type UDP_FRAME_QUERY) only.
+ *
+ * The epoch is part of the nonce so commands recorded before a reboot can't
+ * be replayed after it. Controllers learn it from the first state frame.
+ *
+ * @addtogroup UdpControl
+ * @{
+ */
+
+#include <stdbool.h>           /* Boolean type */
+#include <stdint.h>            /* Extended integer types */
+#include <string.h>            /* For memory/string-related functions */
+
+#include <sdkconfig.h>         /* Project configuration */
+#include <esp_log.h>           /* ESP logging functions */
+
+#ifdef CONFIG_FAN_UDP_CONTROL
+#include <esp_random.h>        /* Boot epoch */
+#include <esp_timer.h>         /* High-resolution timestamps */
+#include <freertos/FreeRTOS.h> /* Basic FreeRTOS functions */
+#include <freertos/task.h>     /* Definitions for creating tasks */
+#include <lwip/sockets.h>      /* UDP sockets */
+
+#include <hap.h>               /* Long-term key helpers */
+#include <sodium/crypto_aead_chacha20poly1305.h>
+#endif
+
+#include "main.h"
+#include "udp_control.h"
+#include "event_queue.h"
+
+#ifdef CONFIG_FAN_UDP_CONTROL
+/** Arguments for creating the receive and publish tasks */
+#define UDP_RX_NAME              "UdpControl"
+#define UDP_RX_STACKSIZE         4 * 1024
+#define UDP_RX_PRIORITY          FAN_IO_PRIORITY
+#define UDP_PUBLISH_NAME         "UdpPublish"
+#define UDP_PUBLISH_STACKSIZE    4 * 1024
+#define UDP_PUBLISH_PRIORITY     2
+
+/** Frame magic and format version */
+#define UDP_MAGIC                0xFC
+#define UDP_VERSION              1
+
+/** HKDF salt and info for the command keys */
+#define UDP_KDF_SALT             "Fan-UDP-Control-Salt"
+#define UDP_KDF_INFO             "Fan-UDP-Control-Key"
+
+/** Longest controller pairing identifier */
+#define UDP_MAX_ID_LEN           63
+
+/** Most commands in one datagram, and the size of each */
+#define UDP_MAX_COMMANDS         8
+#define UDP_COMMAND_SIZE         3
+
+/** Controllers we keep keys and counters for, as many as HAP can pair */
+#define UDP_MAX_PEERS            16
+
+/** Largest datagram accepted */
+#define UDP_RX_BUF_SIZE          160
+
+/** Shortest time (in mSec) between state frames, signing isn't free */
+#define UDP_PUBLISH_MIN_MS       100
+
+/** Sizes of the AEAD nonce and tag */
+#define UDP_NONCE_LEN            crypto_aead_chacha20poly1305_IETF_NPUBBYTES
+#define UDP_TAG_LEN              crypto_aead_chacha20poly1305_IETF_ABYTES
+
+/** Enum for the types of frames */
+enum Udp_frame_type
+{
+    UDP_FRAME_COMMAND = 0, /** Sealed commands from a controller */
+    UDP_FRAME_STATE,       /** Signed state of every fan */
+    UDP_FRAME_QUERY,       /** Ask for a state frame */
+};
+
+/** Struct for the header starting every frame */
+typedef struct __attribute__((packed)) Udp_header_t
+{
+    uint8_t magic;   /** UDP_MAGIC */
+    uint8_t version; /** UDP_VERSION */
+    uint8_t type;    /** Udp_frame_type */
+    uint8_t id_len;  /** Length of the controller identifier, commands only */
+} Udp_header_t;
+
+/** Struct for the fixed part of a state frame */
+typedef struct __attribute__((packed)) Udp_state_header_t
+{
+    Udp_header_t header;   /** Common header */
+    uint32_t     epoch;    /** Boot epoch */
+    uint32_t     sequence; /** State frame count */
+    uint8_t      num_fans; /** Number of fans that follow */
+} Udp_state_header_t;
+
+/** Struct for a controller that has sent us commands */
+typedef struct Udp_peer_t
+{
+    bool     used;                      /** Whether the entry is taken */
+    char     id[UDP_MAX_ID_LEN + 1];    /** Pairing identifier */
+    uint8_t  key[HAP_CTRL_KEY_LEN];     /** Command key */
+    uint32_t generation;                /** pairing_generation the key is from */
+    uint64_t counter;                   /** Highest counter accepted */
+} Udp_peer_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "UdpControl";
+
+/** Socket for commands, queries and state frames */
+static int udp_socket = -1;
+
+/** Where state frames go */
+static struct sockaddr_in group_addr;
+
+/** Random per boot, so old commands can't be replayed */
+static uint32_t epoch;
+
+/** Task signing and sending state frames */
+static TaskHandle_t publish_task;
+
+/** Bumped whenever pairings change, which makes every key stale */
+static volatile uint32_t pairing_generation;
+
+/** Controllers we know, only touched by the receive task */
+static Udp_peer_t peers[UDP_MAX_PEERS];
+
+/**
+ * @brief  Find the entry of a controller, refreshing its key if stale.
+ * @param  id [in] Pairing identifier of the controller
+ * @return Entry of the controller, NULL if it isn't paired.
+ */
+static Udp_peer_t *get_peer(const char *id)
+{
+    Udp_peer_t *peer       = NULL;
+    uint32_t    generation = pairing_generation;
+    uint8_t     key[HAP_CTRL_KEY_LEN];
+
+    for (int i = 0; i < UDP_MAX_PEERS; i++)
+    {
+        if (peers[i].used && 0 == strcmp(peers[i].id, id))
+        {
+            peer = &peers[i];
+            break;
+        }
+    }
+
+    if (NULL != peer && peer->generation == generation)
+    {
+        return peer;
+    }
+
+    /* Only paired controllers get an entry, the counter survives re-pairing */
+    if (HAP_SUCCESS != hap_ctrl_derive_key(id, UDP_KDF_SALT, UDP_KDF_INFO, key))
+    {
+        return NULL;
+    }
+
+    for (int i = 0; NULL == peer && i < UDP_MAX_PEERS; i++)
+    {
+        if (!peers[i].used)
+        {
+            peer = &peers[i];
+            memset(peer, 0, sizeof(*peer));
+            peer->used = true;
+            strcpy(peer->id, id);
+        }
+    }
+
+    if (NULL == peer)
+    {
+        ESP_LOGW(TAG, "No room for controller %s", id);
+        return NULL;
+    }
+
+    memcpy(peer->key, key, sizeof(peer->key));
+    peer->generation = generation;
+    memset(key, 0, sizeof(key));
+
+    return peer;
+}
+
+/**
+ * @brief Check and open a command frame, and send its commands to the event handler.
+ * @param buf [in,out] Frame, opened in place
+ * @param len Length of the frame
+ */
+static void handle_command(uint8_t *buf, size_t len)
+{
+    const Udp_header_t *header = (const Udp_header_t *) buf;
+    char                id[UDP_MAX_ID_LEN + 1];
+    uint64_t            counter;
+    uint8_t             nonce[UDP_NONCE_LEN];
+
+    size_t ad_len = sizeof(*header) + sizeof(counter) + header->id_len;
+    if (0 == header->id_len || header->id_len > UDP_MAX_ID_LEN || len < ad_len + UDP_TAG_LEN)
+    {
+        return;
+    }
+
+    size_t sealed_len = len - ad_len - UDP_TAG_LEN;
+    if (0 != sealed_len % UDP_COMMAND_SIZE || sealed_len > UDP_MAX_COMMANDS * UDP_COMMAND_SIZE)
+    {
+        return;
+    }
+
+    memcpy(&counter, buf + sizeof(*header), sizeof(counter));
+    memcpy(id, buf + sizeof(*header) + sizeof(counter), header->id_len);
+    id[header->id_len] = '\0';
+
+    Udp_peer_t *peer = get_peer(id);
+    if (NULL == peer || counter <= peer->counter)
+    {
+        /* Not paired, or a replay */
+        return;
+    }
+
+    memcpy(nonce, &epoch, sizeof(epoch));
+    memcpy(nonce + sizeof(epoch), &counter, sizeof(counter));
+
+    uint8_t *sealed = buf + ad_len;
+    if (0 != crypto_aead_chacha20poly1305_ietf_decrypt_detached(sealed, NULL, sealed, sealed_len,
+                                                                sealed + sealed_len, buf, ad_len,
+                                                                nonce, peer->key))
+    {
+        ESP_LOGD(TAG, "Dropping command that failed authentication");
+        return;
+    }
+    peer->counter = counter;
+
+    int64_t now_us = esp_timer_get_time();
+    for (size_t i = 0; i < sealed_len; i += UDP_COMMAND_SIZE)
+    {
+        Fan_event_t event = {
+            .source       = SOURCE_UDP,
+            .fan          = sealed[i],
+            .id           = (enum Event_id) sealed[i + 1],
+            .arg          = sealed[i + 2],
+            .timestamp_us = now_us,
+        };
+
+        if (!Event_queue_send(&event))
+        {
+            ESP_LOGW(TAG, "Event queue full, dropping event");
+        }
+    }
+}
+
+/**
+ * @brief Receive FreeRTOS task, handles commands and queries.
+ * @param p [in] Required FreeRTOS parameter (UNUSED)
+ */
+static void Udp_rx_task(void *p)
+{
+    uint8_t buf[UDP_RX_BUF_SIZE];
+
+    UNUSED_PARAM(p);
+
+    while (true)
+    {
+        int len = recvfrom(udp_socket, buf, sizeof(buf), 0, NULL, NULL);
+        if (len < (int) sizeof(Udp_header_t))
+        {
+            continue;
+        }
+
+        const Udp_header_t *header = (const Udp_header_t *) buf;
+        if (UDP_MAGIC != header->magic || UDP_VERSION != header->version)
+        {
+            continue;
+        }
+
+        if (UDP_FRAME_COMMAND == header->type)
+        {
+            handle_command(buf, (size_t) len);
+        }
+        else if (UDP_FRAME_QUERY == header->type)
+        {
+            Udp_control_publish();
+        }
+    }
+}
+
+/**
+ * @brief   Publish FreeRTOS task, signs and multicasts the state of every fan.
+ * @details Changes that come in while a frame is being signed, or within
+ *          UDP_PUBLISH_MIN_MS of the last one, go out together in the next.
+ * @param   p [in] Required FreeRTOS parameter (UNUSED)
+ */
+static void Udp_publish_task(void *p)
+{
+    uint8_t    frame[sizeof(Udp_state_header_t) + FAN_NUM_FANS * 4 + HAP_ACC_SIGN_LEN];
+    uint32_t   sequence = 0;
+    TickType_t last     = 0;
+
+    UNUSED_PARAM(p);
+
+    while (true)
+    {
+        (void) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        TickType_t since = xTaskGetTickCount() - last;
+        if (since < pdMS_TO_TICKS(UDP_PUBLISH_MIN_MS))
+        {
+            vTaskDelay(pdMS_TO_TICKS(UDP_PUBLISH_MIN_MS) - since);
+        }
+        last = xTaskGetTickCount();
+        (void) ulTaskNotifyTake(pdTRUE, 0);
+
+        Udp_state_header_t state = {
+            .header   = { .magic = UDP_MAGIC, .version = UDP_VERSION, .type = UDP_FRAME_STATE },
+            .epoch    = epoch,
+            .sequence = ++sequence,
+            .num_fans = FAN_NUM_FANS,
+        };
+        memcpy(frame, &state, sizeof(state));
+
+        uint8_t *fans = frame + sizeof(state);
+        for (int fan = 0; fan < FAN_NUM_FANS; fan++)
+        {
+            Fan_state_t fan_state;
+            Fan_state_snapshot((uint8_t) fan, &fan_state);
+
+            *fans++ = (uint8_t) fan_state.on;
+            *fans++ = (uint8_t) fan_state.oscillate;
+            *fans++ = (uint8_t) fan_state.speed;
+            *fans++ = (uint8_t) fan_state.timer;
+        }
+
+        if (HAP_SUCCESS != hap_acc_sign(frame, fans - frame, fans))
+        {
+            ESP_LOGW(TAG, "Failed to sign the state");
+            continue;
+        }
+
+        /* Fails quietly until the network is up */
+        (void) sendto(udp_socket, frame, sizeof(frame), 0, (struct sockaddr *) &group_addr, sizeof(group_addr));
+    }
+}
+#endif /* CONFIG_FAN_UDP_CONTROL */
+
+/**
+ * @brief   Multicast the state of every fan soon.
+ * @details Cheap enough to call on every change, the signing happens in the
+ *          publish task. Does nothing unless CONFIG_FAN_UDP_CONTROL is set.
+ */
+void Udp_control_publish(void)
+{
+#ifdef CONFIG_FAN_UDP_CONTROL
+    if (NULL != publish_task)
+    {
+        (void) xTaskNotifyGive(publish_task);
+    }
+#endif
+}
+
+/**
+ * @brief Note that a controller was paired, changed or removed.
+ */
+void Udp_control_pairings_changed(void)
+{
+#ifdef CONFIG_FAN_UDP_CONTROL
+    pairing_generation++;
+#endif
+}
+
+/**
+ * @brief   Initializer for the UdpControl component.
+ * @note    Needs the HomeKit keys, so call after HomeKit_init(). Does nothing
+ *          unless CONFIG_FAN_UDP_CONTROL is set.
+ */
+void Udp_control_init(void)
+{
+#ifdef CONFIG_FAN_UDP_CONTROL
+    struct sockaddr_in bind_addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(CONFIG_FAN_UDP_CONTROL_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    uint8_t ttl = 1;
+
+    epoch = esp_random();
+
+    group_addr.sin_family      = AF_INET;
+    group_addr.sin_port        = htons(CONFIG_FAN_UDP_CONTROL_PORT);
+    group_addr.sin_addr.s_addr = inet_addr(CONFIG_FAN_UDP_MULTICAST_GROUP);
+
+    udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_socket < 0 || 0 != bind(udp_socket, (struct sockaddr *) &bind_addr, sizeof(bind_addr)))
+    {
+        ESP_LOGE(TAG, "Failed to open UDP port %d", CONFIG_FAN_UDP_CONTROL_PORT);
+        return;
+    }
+
+    /* State frames stay on the local network */
+    (void) setsockopt(udp_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    (void) xTaskCreate(Udp_publish_task, UDP_PUBLISH_NAME, UDP_PUBLISH_STACKSIZE, NULL,
+                       UDP_PUBLISH_PRIORITY, &publish_task);
+    (void) xTaskCreatePinnedToCore(Udp_rx_task, UDP_RX_NAME, UDP_RX_STACKSIZE, NULL,
+                                   UDP_RX_PRIORITY, NULL, FAN_IO_CORE_ID);
+
+    /* Let controllers learn the epoch */
+    Udp_control_publish();
+
+    ESP_LOGI(TAG, "UdpControl component init!");
+#endif /* CONFIG_FAN_UDP_CONTROL */
+}
+
+/** @} end UdpControl */
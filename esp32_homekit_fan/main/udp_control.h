@@ -0,0 +1,21 @@
+/**
+ * @file udp_control.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component for low-latency local control over UDP.
+ *
+ * @addtogroup UdpControl
+ * @{
+ */
+
+#ifndef UDP_CONTROL_H
+#define UDP_CONTROL_H
+
+/** Public functions for the UdpControl component */
+void Udp_control_publish(void);
+void Udp_control_pairings_changed(void);
+void Udp_control_init(void);
+
+#endif /* UDP_CONTROL_H */
+
+/** @} end UdpControl */
@@ -0,0 +1,231 @@
+/**
+ * @file warm_boot.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bring the fan straight back after a soft reset.
+ *
+ * The saved fan state in NVS is only written once things have been idle for a
+ * while, and bringing up NVS takes a while itself. After a crash or a
+ * watchdog, the motor is still spinning and the user expects it to keep
+ * doing so. So the state of every fan is also mirrored into RTC memory, which
+ * soft resets leave alone, every time it is applied.
+ *
+ * On boot, a reset reason other than power-on together with a valid mirror
+ * makes it a warm boot. The fan is then put back to the mirrored speed
+ * through the usual ramp, before NVS, HomeKit or Wi-Fi are touched. The rest
+ * of the boot carries on as usual, and Wi-Fi reconnects to the cached AP
+ * (CONFIG_APP_WIFI_FAST_RECONNECT).
+ *
+ * Brownouts never count as warm, since the motor's inrush may well be what
+ * caused them. The mirror also counts warm boots in a row, and once that goes
+ * past CONFIG_FAN_WARM_BOOT_MAX_RESUMES the boot is a cold one with the fan
+ * off, so a fault that keeps resetting the fan doesn't also keep switching the
+ * relays. The count starts over once a boot has stayed up for a while.
+ *
+ * Each mirrored state is stored along with its complement, so a mirror that
+ * is half written, or is left over noise from a power cycle, is never used.
+ *
+ * @addtogroup WarmBoot
+ * @{
+ */
+
+#include <stdbool.h>    /* Boolean type */
+#include <stdint.h>     /* Extended integer types */
+
+#include <sdkconfig.h>  /* Project configuration */
+#include <esp_log.h>    /* ESP logging functions */
+
+#ifdef CONFIG_FAN_WARM_BOOT
+#include <esp_attr.h>   /* RTC_NOINIT_ATTR */
+#include <esp_system.h> /* Reset reason */
+#include <esp_timer.h>  /* Uptime after which a warm boot counts as stable */
+#endif
+
+#include "main.h"
+#include "warm_boot.h"
+
+#ifdef CONFIG_FAN_WARM_BOOT
+
+/** Marks a mirror that survived from an earlier boot, changes with the layout */
+#define WARM_BOOT_MAGIC 0x57524D33
+
+/** Uptime (in uSec) after which the run of warm boots is over */
+#define WARM_BOOT_STABLE_US (60 * 1000 * 1000)
+
+/** Layout of a mirrored fan state */
+#define MIRROR_SPEED_MASK  0x0007
+#define MIRROR_OSC_BIT     0x0008
+#define MIRROR_ON_BIT      0x0010
+#define MIRROR_AUTO_BIT    0x0020
+#define MIRROR_TIMER_SHIFT 6
+#define MIRROR_TIMER_MASK  0x0007
+#define MIRROR_PCT_SHIFT   9
+#define MIRROR_PCT_MASK    0x007F
+
+_Static_assert(NUM_TIMER <= MIRROR_TIMER_MASK + 1, "Timer settings must fit in a mirrored state");
+
+/** Mirror of the fan states, as kept in RTC memory */
+typedef struct Warm_boot_mirror_t
+{
+    uint32_t magic;                /** WARM_BOOT_MAGIC once initialized */
+    uint32_t resumes;              /** Warm boots in a row without staying up */
+    uint16_t state[FAN_NUM_FANS];  /** Packed state of each fan */
+    uint16_t check[FAN_NUM_FANS];  /** Complement of each packed state */
+} Warm_boot_mirror_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "WarmBoot";
+
+/** The mirror, left alone by soft resets */
+static RTC_NOINIT_ATTR Warm_boot_mirror_t mirror;
+
+/** Whether this boot is a warm one */
+static bool warm;
+
+/** Timer ending the run of warm boots once this one has stayed up */
+static esp_timer_handle_t stable_timer;
+
+/**
+ * @brief Clears the warm boot count once the fan has stayed up for a while.
+ * @param arg [in] Unused
+ */
+static void stable_callback(void *arg)
+{
+    UNUSED_PARAM(arg);
+
+    mirror.resumes = 0;
+}
+
+/**
+ * @brief Mirror the applied state of a fan.
+ * @param fan   Fan the state is for
+ * @param state [in] State that was applied
+ */
+void Warm_boot_save(uint8_t fan, const Fan_state_t *state)
+{
+    if (fan >= FAN_NUM_FANS)
+    {
+        return;
+    }
+
+    uint16_t packed = (uint16_t) ((state->speed & MIRROR_SPEED_MASK) |
+                                  ((state->oscillate) ? MIRROR_OSC_BIT : 0) |
+                                  ((state->on) ? MIRROR_ON_BIT : 0) |
+                                  ((state->auto_mode) ? MIRROR_AUTO_BIT : 0) |
+                                  ((state->timer & MIRROR_TIMER_MASK) << MIRROR_TIMER_SHIFT) |
+                                  ((state->speed_pct & MIRROR_PCT_MASK) << MIRROR_PCT_SHIFT));
+
+    /* A reset between the two stores leaves a mismatch, which is ignored */
+    mirror.state[fan] = packed;
+    mirror.check[fan] = (uint16_t) ~packed;
+}
+
+/**
+ * @brief   Get the mirrored state of a fan from before a soft reset.
+ * @details Leaves the state untouched unless this is a warm boot and the fan
+ *          has a valid mirror.
+ * @param   fan   Fan to load
+ * @param   state [out] Mirrored fan state
+ * @return  Whether a mirrored state was restored.
+ */
+bool Warm_boot_load(uint8_t fan, Fan_state_t *state)
+{
+    if (!warm || fan >= FAN_NUM_FANS)
+    {
+        return false;
+    }
+
+    uint16_t         packed = mirror.state[fan];
+    enum State_speed speed  = (enum State_speed) (packed & MIRROR_SPEED_MASK);
+    enum State_timer timer  = (enum State_timer) ((packed >> MIRROR_TIMER_SHIFT) & MIRROR_TIMER_MASK);
+    uint8_t          pct    = (uint8_t) ((packed >> MIRROR_PCT_SHIFT) & MIRROR_PCT_MASK);
+
+    if (0xFFFF != (uint16_t) (packed ^ mirror.check[fan]) || speed < SPEED_1 || speed > SPEED_4 || timer >= NUM_TIMER ||
+        Speed_from_pct(pct) != speed)
+    {
+        return false;
+    }
+
+    state->on        = (0 != (packed & MIRROR_ON_BIT));
+    state->oscillate = (0 != (packed & MIRROR_OSC_BIT));
+    state->auto_mode = (0 != (packed & MIRROR_AUTO_BIT));
+    state->speed     = speed;
+    state->speed_pct = pct;
+    state->timer     = timer;
+    state->dirty     = 0;
+
+    return true;
+}
+
+/**
+ * @brief  Check whether this boot is a warm one.
+ * @return Whether the fan states from before the reset are available.
+ */
+bool Warm_boot_is_warm(void)
+{
+    return warm;
+}
+
+/**
+ * @brief   Initializer for the WarmBoot component.
+ * @details Works out whether this is a warm boot. Must be called before
+ *          anything applies a fan state, as that overwrites the mirror.
+ * @return  Whether this boot is a warm one.
+ */
+bool Warm_boot_init(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+
+    /* Not after a brownout, the motor starting up may have caused it */
+    warm = (WARM_BOOT_MAGIC == mirror.magic) &&
+           (ESP_RST_PANIC == reason || ESP_RST_INT_WDT == reason || ESP_RST_TASK_WDT == reason ||
+            ESP_RST_WDT == reason || ESP_RST_SW == reason);
+
+    if (warm && mirror.resumes >= CONFIG_FAN_WARM_BOOT_MAX_RESUMES)
+    {
+        ESP_LOGW(TAG, "%u warm boots in a row, starting cold", (unsigned) mirror.resumes);
+        warm = false;
+    }
+
+    if (warm)
+    {
+        mirror.resumes++;
+
+        esp_timer_create_args_t stable_args = {
+            .callback        = stable_callback,
+            .arg             = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name            = "warm_stable",
+        };
+        if (ESP_OK != esp_timer_create(&stable_args, &stable_timer) ||
+            ESP_OK != esp_timer_start_once(stable_timer, WARM_BOOT_STABLE_US))
+        {
+            ESP_LOGW(TAG, "Couldn't start the stable timer");
+        }
+    }
+    else
+    {
+        /* Invalidate every fan until its first state is applied */
+        for (int fan = 0; fan < FAN_NUM_FANS; fan++)
+        {
+            mirror.state[fan] = 0;
+            mirror.check[fan] = 0;
+        }
+        mirror.resumes = 0;
+        mirror.magic   = WARM_BOOT_MAGIC;
+    }
+
+    ESP_LOGI(TAG, "%s boot (reset reason %d)", (warm) ? "Warm" : "Cold", (int) reason);
+    return warm;
+}
+
+#else /* !CONFIG_FAN_WARM_BOOT */
+
+void Warm_boot_save(uint8_t fan, const Fan_state_t *state) { UNUSED_PARAM(fan); UNUSED_PARAM(state); }
+bool Warm_boot_load(uint8_t fan, Fan_state_t *state) { UNUSED_PARAM(fan); UNUSED_PARAM(state); return false; }
+bool Warm_boot_is_warm(void) { return false; }
+bool Warm_boot_init(void) { return false; }
+
+#endif /* CONFIG_FAN_WARM_BOOT */
+
+/** @} end WarmBoot */
@@ -0,0 +1,27 @@
+/**
+ * @file warm_boot.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to bring the fan straight back after a soft reset.
+ *
+ * @addtogroup WarmBoot
+ * @{
+ */
+
+#ifndef WARM_BOOT_H
+#define WARM_BOOT_H
+
+#include <stdbool.h> /* Boolean type */
+#include <stdint.h>  /* Extended integer types */
+
+#include "main.h"    /* Fan_state_t */
+
+/** Public functions for the WarmBoot component */
+void Warm_boot_save(uint8_t fan, const Fan_state_t *state);
+bool Warm_boot_load(uint8_t fan, Fan_state_t *state);
+bool Warm_boot_is_warm(void);
+bool Warm_boot_init(void);
+
+#endif /* WARM_BOOT_H */
+
+/** @} end WarmBoot */
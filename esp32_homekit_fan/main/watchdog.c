@@ -0,0 +1,285 @@
+/**
+ * @file watchdog.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to catch stalled and hung fan tasks.
+ *
+ * The event handler and IR remote tasks subscribe to the ESP task watchdog
+ * and check in every time they go round their loop. Their waits for new work
+ * are cut to half the watchdog timeout, so an idle task still checks in, and
+ * only a task really stuck somewhere (in NVS, or a full queue) trips it. The
+ * watchdog then panics and the fan reboots into its saved state.
+ *
+ * Each loop iteration is also timed against CONFIG_FAN_LOOP_BUDGET_MS. An
+ * iteration that runs over is logged with what it was handling (the event
+ * source and ID for the event handler, the piece and symbol count for the
+ * remote), long before it would trip the watchdog. Per task counts and the
+ * worst iteration can be fetched with the debug endpoint:
+ *
+ * curl <fan-ip>:<hap-port>/debug/watchdog
+ *
+ * which also shows a task that is stuck in an iteration right now.
+ *
+ * With CONFIG_FAN_WATCHDOG, hap-loop is watched the same way by the HomeKit
+ * core (CONFIG_HAP_LOOP_WATCHDOG).
+ *
+ * @addtogroup Watchdog
+ * @{
+ */
+
+#include <stdbool.h>              /* Boolean type */
+#include <stdio.h>                /* snprintf */
+#include <stdint.h>               /* Extended integer types */
+#include <inttypes.h>             /* Format macros for extended integers */
+
+#include <sdkconfig.h>            /* Project configuration */
+#include <esp_log.h>              /* ESP logging functions */
+#include <freertos/FreeRTOS.h>    /* Basic FreeRTOS functions */
+
+#ifdef CONFIG_FAN_WATCHDOG
+#include <esp_task_wdt.h>         /* ESP task watchdog */
+#include <esp_timer.h>            /* High-resolution timestamps */
+#endif
+
+#ifdef CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT
+#include <esp_http_server.h>      /* HTTP handler registration */
+#include <hap_platform_httpd.h>   /* Handle for the HomeKit HTTP server */
+#endif
+
+#include "main.h"
+#include "watchdog.h"
+
+#ifdef CONFIG_FAN_WATCHDOG
+/** Time conversions */
+#define NUM_MSEC_IN_SEC    1000
+#define NUM_USEC_IN_MSEC   1000
+
+/** Iteration budget, in uSec */
+#define WATCHDOG_BUDGET_US ((int64_t) CONFIG_FAN_LOOP_BUDGET_MS * NUM_USEC_IN_MSEC)
+
+/** Size of the buffer used to format a single task line */
+#define WATCHDOG_LINE_SIZE 160
+
+/** Struct for the state of one watched task */
+typedef struct Watchdog_state_t
+{
+    bool     subscribed;  /** Whether the task watchdog knows the task */
+    int64_t  begin_us;    /** Start of the current iteration, 0 if idle */
+    int      cause;       /** What the current iteration is handling */
+    int      arg;         /** Detail for cause */
+    uint32_t iterations;  /** Iterations timed */
+    uint32_t overruns;    /** Iterations over the budget */
+    int64_t  max_us;      /** Longest iteration */
+    int      last_cause;  /** Cause of the last overrun */
+    int      last_arg;    /** Detail for the last overrun */
+} Watchdog_state_t;
+
+/** Tag used for ESP logging */
+static const char *TAG = "Watchdog";
+
+/** Names used when logging */
+static const char *task_names[NUM_WATCHDOG_TASK] = { "EventHandler", "RemoteHandler" };
+
+/** State of every watched task */
+static Watchdog_state_t states[NUM_WATCHDOG_TASK];
+#endif /* CONFIG_FAN_WATCHDOG */
+
+/**
+ * @brief   Start the ESP task watchdog.
+ * @details Must be called before any task subscribes, which includes
+ *          hap-loop. Does nothing unless CONFIG_FAN_WATCHDOG is set.
+ */
+void Watchdog_init(void)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    const esp_task_wdt_config_t config = {
+        .timeout_ms     = CONFIG_FAN_WATCHDOG_TIMEOUT_S * NUM_MSEC_IN_SEC,
+        .idle_core_mask = 0,
+        .trigger_panic  = true,
+    };
+
+    esp_err_t err = esp_task_wdt_init(&config);
+    if (ESP_ERR_INVALID_STATE == err)
+    {
+        /* Already started by ESP-IDF, use our settings */
+        err = esp_task_wdt_reconfigure(&config);
+    }
+    if (ESP_OK != err)
+    {
+        ESP_LOGE(TAG, "Failed to start the task watchdog: %s", esp_err_to_name(err));
+    }
+#endif /* CONFIG_FAN_WATCHDOG */
+}
+
+/**
+ * @brief Subscribe the calling task to the task watchdog.
+ * @param task Task calling this
+ */
+void Watchdog_subscribe(enum Watchdog_task task)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    states[task].subscribed = (ESP_OK == esp_task_wdt_add(NULL));
+    if (!states[task].subscribed)
+    {
+        ESP_LOGW(TAG, "%s not watched, iterations are only timed", task_names[task]);
+    }
+#else
+    UNUSED_PARAM(task);
+#endif
+}
+
+/**
+ * @brief  Get how long a watched task may block waiting for work.
+ * @return Half the watchdog timeout, or forever without CONFIG_FAN_WATCHDOG.
+ */
+TickType_t Watchdog_wait_ticks(void)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    return pdMS_TO_TICKS(CONFIG_FAN_WATCHDOG_TIMEOUT_S * NUM_MSEC_IN_SEC / 2);
+#else
+    return portMAX_DELAY;
+#endif
+}
+
+/**
+ * @brief Check in with the task watchdog, after waking up with nothing to do.
+ * @param task Task calling this
+ */
+void Watchdog_feed(enum Watchdog_task task)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    if (states[task].subscribed)
+    {
+        (void) esp_task_wdt_reset();
+    }
+#else
+    UNUSED_PARAM(task);
+#endif
+}
+
+/**
+ * @brief Check in and start timing a loop iteration.
+ * @param task  Task calling this
+ * @param cause What the iteration handles, logged if it runs over
+ * @param arg   Detail for cause
+ */
+void Watchdog_begin(enum Watchdog_task task, int cause, int arg)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    Watchdog_feed(task);
+    states[task].cause    = cause;
+    states[task].arg      = arg;
+    states[task].begin_us = esp_timer_get_time();
+#else
+    UNUSED_PARAM(task);
+    UNUSED_PARAM(cause);
+    UNUSED_PARAM(arg);
+#endif
+}
+
+/**
+ * @brief Finish timing a loop iteration, logging it if it ran over budget.
+ * @param task Task calling this
+ */
+void Watchdog_end(enum Watchdog_task task)
+{
+#ifdef CONFIG_FAN_WATCHDOG
+    Watchdog_state_t *state = &states[task];
+    int64_t           took  = esp_timer_get_time() - state->begin_us;
+
+    state->begin_us = 0;
+    state->iterations++;
+    if (took > state->max_us)
+    {
+        state->max_us = took;
+    }
+    if (took > WATCHDOG_BUDGET_US)
+    {
+        state->overruns++;
+        state->last_cause = state->cause;
+        state->last_arg   = state->arg;
+        ESP_LOGW(TAG, "%s stalled for %" PRId64 " ms handling %d/%d (budget %d ms)",
+                 task_names[task], took / NUM_USEC_IN_MSEC, state->cause, state->arg,
+                 CONFIG_FAN_LOOP_BUDGET_MS);
+    }
+    Watchdog_feed(task);
+#else
+    UNUSED_PARAM(task);
+#endif
+}
+
+#ifdef CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT
+/**
+ * @brief  Format the state of one task into a single line of text.
+ * @param  task Task to format
+ * @param  buf  [out] Buffer to write into
+ * @param  size Size of the buffer
+ * @return Number of characters written.
+ */
+static int format_state(int task, char *buf, size_t size)
+{
+    const Watchdog_state_t *state    = &states[task];
+    int64_t                 begin_us = state->begin_us;
+
+    int len = snprintf(buf, size, "%s: n=%" PRIu32 " over=%" PRIu32 " max=%" PRId64 "ms last_over=%d/%d",
+                       task_names[task], state->iterations, state->overruns,
+                       state->max_us / NUM_USEC_IN_MSEC, state->last_cause, state->last_arg);
+    if (begin_us && len < (int) size)
+    {
+        /* In an iteration right now, show for how long */
+        len += snprintf(buf + len, size - len, " busy=%" PRId64 "ms on %d/%d",
+                        (esp_timer_get_time() - begin_us) / NUM_USEC_IN_MSEC, state->cause, state->arg);
+    }
+
+    return (len < (int) size) ? len : (int) size - 1;
+}
+
+/**
+ * @brief  HTTP handler returning the state of every task as plain text.
+ * @param  req [in] HTTP request
+ * @return ESP_OK on success.
+ */
+static esp_err_t watchdog_http_handler(httpd_req_t *req)
+{
+    char line[WATCHDOG_LINE_SIZE];
+
+    httpd_resp_set_type(req, "text/plain");
+    for (int task = 0; task < NUM_WATCHDOG_TASK; task++)
+    {
+        int len = format_state(task, line, sizeof(line) - 1);
+        line[len++] = '\n';
+        httpd_resp_send_chunk(req, line, len);
+    }
+
+    /* Finish off the chunked response */
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+/** URI handler for the watchdog debug endpoint */
+static const httpd_uri_t watchdog_get = {
+    .uri     = "/debug/watchdog",
+    .method  = HTTP_GET,
+    .handler = watchdog_http_handler,
+};
+#endif /* CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT */
+
+/**
+ * @brief   Register the watchdog debug endpoint with the HomeKit HTTP server.
+ * @details Must be called after hap_start(), as that is when the server comes
+ *          up. Does nothing unless CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT is set.
+ */
+void Watchdog_register_http_handler(void)
+{
+#ifdef CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT
+    httpd_handle_t *httpd_handle = hap_platform_httpd_get_handle();
+    if (NULL == httpd_handle)
+    {
+        ESP_LOGW(TAG, "HTTP server not running, watchdog endpoint unavailable");
+        return;
+    }
+
+    httpd_register_uri_handler(*httpd_handle, &watchdog_get);
+#endif /* CONFIG_FAN_WATCHDOG_HTTP_ENDPOINT */
+}
+
+/** @} end Watchdog */
@@ -0,0 +1,37 @@
+/**
+ * @file watchdog.h
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Component to catch stalled and hung fan tasks.
+ *
+ * @addtogroup Watchdog
+ * @{
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdint.h>            /* Extended integer types */
+
+#include <freertos/FreeRTOS.h> /* TickType_t */
+
+/** Enum for the long-lived tasks that are watched */
+enum Watchdog_task
+{
+    WATCHDOG_EVENT_HANDLER = 0, /** Main event handler */
+    WATCHDOG_REMOTE_HANDLER,    /** IR remote decoder */
+    NUM_WATCHDOG_TASK           /** For arithmetic */
+};
+
+/** Public functions for the Watchdog component */
+void Watchdog_init(void);
+void Watchdog_subscribe(enum Watchdog_task task);
+TickType_t Watchdog_wait_ticks(void);
+void Watchdog_feed(enum Watchdog_task task);
+void Watchdog_begin(enum Watchdog_task task, int cause, int arg);
+void Watchdog_end(enum Watchdog_task task);
+void Watchdog_register_http_handler(void);
+
+#endif /* WATCHDOG_H */
+
+/** @} end Watchdog */
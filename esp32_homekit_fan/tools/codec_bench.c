@@ -0,0 +1,642 @@
+/**
+ * @file codec_bench.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Host micro-benchmarks for the HomeKit serialization code.
+ *
+ * Every HomeKit request goes through the same few pieces of serialization:
+ * json_generator for responses and notifications, json_parser (jsmn) for
+ * PUT bodies, the TLV8 helpers in esp_hap_pair_common.c for pairing, and the
+ * byte order helpers in byte_convert.c. This tool runs them on the host over
+ * payloads shaped like the ones the fan actually sees:
+ *
+ * - notify:      event for Active, Rotation Speed and Swing Mode of one fan,
+ * - accessories: /accessories for a bridge of 20 fans, flushed in 1 kB chunks,
+ * - put-parse:   multi-characteristic PUT, parsed in one go from the heap,
+ * - put-stream:  the same PUT fed through json_stream, as the HTTP handler does,
+ * - pv-m1:       pair verify M1 request, read with get_value_from_tlv(),
+ * - pv-m2:       pair verify M2 response, built with add_tlv(),
+ * - pv-m3:       pair verify M3 request, read through a TLV index,
+ * - bytes:       big endian 16/32/64-bit loads and stores.
+ *
+ * Each case reports the time per operation and the number of heap
+ * allocations per operation, so a change to any of these components can be
+ * checked off the device before it goes on a fan. Times are host times, only
+ * compare them between runs on the same machine.
+ *
+ * Allocations are counted by renaming the allocator in every source file, so
+ * build it from esp32_homekit_fan/ with:
+ *
+ *     H=../components/homekit
+ *     cc -O2 -Dmalloc=bench_malloc -Dcalloc=bench_calloc -Drealloc=bench_realloc -Dfree=bench_free \
+ *        -I$H/json_generator/upstream -I$H/json_parser/upstream/include -I$H/json_parser/upstream \
+ *        -I$H/esp_hap_core/src/priv_includes -o codec_bench tools/codec_bench.c \
+ *        $H/json_generator/upstream/json_generator.c $H/json_parser/upstream/src/json_parser.c \
+ *        $H/esp_hap_core/src/esp_hap_pair_common.c $H/esp_hap_core/src/byte_convert.c
+ *
+ * and run it as:
+ *
+ *     ./codec_bench [-n <iterations>] [<case>...]
+ *
+ * Without any case names, every case is run.
+ *
+ * @addtogroup CodecBench
+ * @{
+ */
+
+#include <stdbool.h>        /* Boolean type */
+#include <stdint.h>         /* Extended integer types */
+#include <stdio.h>          /* Console output */
+#include <stdlib.h>         /* Memory allocation, number parsing */
+#include <string.h>         /* String functions */
+#include <time.h>           /* Monotonic clock */
+
+#include <json_generator.h>
+#include <json_parser.h>
+#include <esp_hap_pair_common.h>
+#include <byte_convert.h>
+
+/* The allocator is renamed on the command line (stdlib.h included), the counters below wrap the real one */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *ptr, size_t size);
+void free(void *ptr);
+void *bench_malloc(size_t size);
+void *bench_calloc(size_t nmemb, size_t size);
+void *bench_realloc(void *ptr, size_t size);
+void bench_free(void *ptr);
+
+/** Default number of times every case is run */
+#define DEFAULT_ITERATIONS 100000
+
+/** Number of fans bridged in the /accessories case */
+#define BENCH_NUM_ACCESSORIES 20
+
+/** Size of the chunks /accessories is flushed in, as sent over HTTP */
+#define BENCH_CHUNK_SIZE 1024
+
+/** Same token and buffer sizes the PUT handler uses */
+#define BENCH_PUT_INBUF_SIZE   512
+#define BENCH_PUT_REST_SIZE    128
+#define BENCH_PUT_TOK_BUF_SIZE (32 * 5 * sizeof(int))
+
+/** Struct for one benchmark case */
+typedef struct Bench_case_t
+{
+    const char *name;                      /** Name to select the case with */
+    size_t (*run)(void);                   /** Runs one operation, returns bytes handled */
+} Bench_case_t;
+
+/** Heap allocations made so far */
+static unsigned long num_allocs;
+
+/** Keeps results alive so the compiler can't drop the work */
+static volatile size_t sink;
+
+/** Output of the generator cases */
+static char out_buf[BENCH_CHUNK_SIZE];
+
+/** Multi-characteristic PUT, turning a fan on at 50% with oscillation and notifications */
+static const char put_body[] =
+    "{\"characteristics\":["
+    "{\"aid\":2,\"iid\":10,\"value\":1},"
+    "{\"aid\":2,\"iid\":11,\"value\":50.0},"
+    "{\"aid\":2,\"iid\":12,\"value\":1,\"ev\":true},"
+    "{\"aid\":3,\"iid\":10,\"value\":0}"
+    "],\"pid\":11122333}";
+
+/** Pair verify messages, with the keys, signatures and tags left as zeroes */
+static uint8_t pv_m1[2 + 1 + 2 + CURVE_KEY_LEN];
+static int     pv_m1_len;
+static uint8_t pv_m3[2 + 1 + 2 + 36 + 2 + ED_SIGN_LEN + POLY_AUTHTAG_LEN + 2];
+static int     pv_m3_len;
+
+/**
+ * @brief  Get the monotonic time.
+ * @return Time in nSec.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/** Counting wrappers around the real allocator */
+void *bench_malloc(size_t size)
+{
+    num_allocs++;
+    return malloc(size);
+}
+
+void *bench_calloc(size_t nmemb, size_t size)
+{
+    num_allocs++;
+    return calloc(nmemb, size);
+}
+
+void *bench_realloc(void *ptr, size_t size)
+{
+    num_allocs++;
+    return realloc(ptr, size);
+}
+
+void bench_free(void *ptr)
+{
+    free(ptr);
+}
+
+/**
+ * @brief Flush callback for the generator, counting what would go out.
+ * @param buf  [in] Data to send.
+ * @param priv [in,out] Running byte count.
+ */
+static void count_flush(char *buf, void *priv)
+{
+    *(size_t *) priv += strlen(buf);
+}
+
+/**
+ * @brief  Generate the event notification for one fan.
+ * @return Length of the event.
+ */
+static size_t run_notify(void)
+{
+    json_gen_str_t jstr;
+    size_t         len = 0;
+
+    json_gen_str_start(&jstr, out_buf, sizeof(out_buf), count_flush, &len);
+    json_gen_start_object(&jstr);
+    json_gen_push_array(&jstr, "characteristics");
+
+    json_gen_start_object(&jstr);
+    json_gen_obj_set_int(&jstr, "aid", 2);
+    json_gen_obj_set_int(&jstr, "iid", 10);
+    json_gen_obj_set_int(&jstr, "value", 1);
+    json_gen_end_object(&jstr);
+
+    json_gen_start_object(&jstr);
+    json_gen_obj_set_int(&jstr, "aid", 2);
+    json_gen_obj_set_int(&jstr, "iid", 11);
+    json_gen_obj_set_float(&jstr, "value", 75.0f);
+    json_gen_end_object(&jstr);
+
+    json_gen_start_object(&jstr);
+    json_gen_obj_set_int(&jstr, "aid", 2);
+    json_gen_obj_set_int(&jstr, "iid", 12);
+    json_gen_obj_set_int(&jstr, "value", 0);
+    json_gen_end_object(&jstr);
+
+    json_gen_pop_array(&jstr);
+    json_gen_end_object(&jstr);
+    json_gen_str_end(&jstr);
+
+    return len;
+}
+
+/**
+ * @brief Add one characteristic the way the /accessories handler does.
+ * @param jstr   [in,out] Generator.
+ * @param iid    Instance ID.
+ * @param type   Short UUID of the characteristic.
+ * @param format Format name.
+ * @param perms  Permissions, as a string of p(aired read), w(rite) and e(vents).
+ * @param value  Value, as a string, NULL for none.
+ */
+static void add_char(json_gen_str_t *jstr, int iid, char *type, char *format, const char *perms, char *value)
+{
+    json_gen_start_object(jstr);
+    json_gen_obj_set_int(jstr, "iid", iid);
+    json_gen_obj_set_string(jstr, "type", type);
+    json_gen_obj_set_string(jstr, "format", format);
+
+    json_gen_push_array(jstr, "perms");
+    for (const char *p = perms; *p; p++)
+    {
+        json_gen_arr_set_string(jstr, ('p' == *p) ? "pr" : ('w' == *p) ? "pw" : "ev");
+    }
+    json_gen_pop_array(jstr);
+
+    if (NULL != value)
+    {
+        json_gen_obj_set_string(jstr, "value", value);
+    }
+    json_gen_end_object(jstr);
+}
+
+/**
+ * @brief  Generate /accessories for a bridge of fans.
+ * @return Length of the document.
+ */
+static size_t run_accessories(void)
+{
+    json_gen_str_t jstr;
+    size_t         len = 0;
+
+    json_gen_str_start(&jstr, out_buf, sizeof(out_buf), count_flush, &len);
+    json_gen_start_object(&jstr);
+    json_gen_push_array(&jstr, "accessories");
+
+    for (int aid = 1; aid <= BENCH_NUM_ACCESSORIES; aid++)
+    {
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_int(&jstr, "aid", aid);
+        json_gen_push_array(&jstr, "services");
+
+        /* Accessory Information */
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_int(&jstr, "iid", 1);
+        json_gen_obj_set_string(&jstr, "type", "3E");
+        json_gen_push_array(&jstr, "characteristics");
+        add_char(&jstr, 2, "14", "bool", "w", NULL);
+        add_char(&jstr, 3, "20", "string", "p", "Ryan_Banks");
+        add_char(&jstr, 4, "21", "string", "p", "Lasko_18in_Fan");
+        add_char(&jstr, 5, "23", "string", "p", "Lasko");
+        add_char(&jstr, 6, "30", "string", "p", "1");
+        add_char(&jstr, 7, "52", "string", "p", "0.0.0");
+        json_gen_pop_array(&jstr);
+        json_gen_end_object(&jstr);
+
+        /* Fan */
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_int(&jstr, "iid", 9);
+        json_gen_obj_set_string(&jstr, "type", "B7");
+        json_gen_obj_set_bool(&jstr, "primary", true);
+        json_gen_push_array(&jstr, "characteristics");
+
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_int(&jstr, "iid", 10);
+        json_gen_obj_set_string(&jstr, "type", "B0");
+        json_gen_obj_set_string(&jstr, "format", "uint8");
+        json_gen_push_array(&jstr, "perms");
+        json_gen_arr_set_string(&jstr, "pr");
+        json_gen_arr_set_string(&jstr, "pw");
+        json_gen_arr_set_string(&jstr, "ev");
+        json_gen_pop_array(&jstr);
+        json_gen_obj_set_int(&jstr, "value", 1);
+        json_gen_push_array(&jstr, "valid-values");
+        json_gen_arr_set_int(&jstr, 0);
+        json_gen_arr_set_int(&jstr, 1);
+        json_gen_pop_array(&jstr);
+        json_gen_end_object(&jstr);
+
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_int(&jstr, "iid", 11);
+        json_gen_obj_set_string(&jstr, "type", "29");
+        json_gen_obj_set_string(&jstr, "format", "float");
+        json_gen_push_array(&jstr, "perms");
+        json_gen_arr_set_string(&jstr, "pr");
+        json_gen_arr_set_string(&jstr, "pw");
+        json_gen_arr_set_string(&jstr, "ev");
+        json_gen_pop_array(&jstr);
+        json_gen_obj_set_float(&jstr, "value", 50.0f);
+        json_gen_obj_set_float(&jstr, "minValue", 0.0f);
+        json_gen_obj_set_float(&jstr, "maxValue", 100.0f);
+        json_gen_obj_set_float(&jstr, "minStep", 25.0f);
+        json_gen_obj_set_string(&jstr, "unit", "percentage");
+        json_gen_end_object(&jstr);
+
+        add_char(&jstr, 12, "B6", "uint8", "pwe", NULL);
+        add_char(&jstr, 13, "23", "string", "p", "Fan");
+
+        json_gen_pop_array(&jstr);
+        json_gen_end_object(&jstr);
+
+        json_gen_pop_array(&jstr);
+        json_gen_end_object(&jstr);
+    }
+
+    json_gen_pop_array(&jstr);
+    json_gen_end_object(&jstr);
+    json_gen_str_end(&jstr);
+
+    return len;
+}
+
+/**
+ * @brief  Read the fields of one characteristic write, as the PUT handler does.
+ * @param  jctx [in] Parser positioned on the characteristic object.
+ * @return Sum of the fields, to keep the reads alive.
+ */
+static int read_write_obj(jparse_ctx_t *jctx)
+{
+    int   aid = 0, iid = 0, value = 0;
+    float fvalue = 0;
+    bool  ev = false;
+
+    json_obj_get_int(jctx, "aid", &aid);
+    json_obj_get_int(jctx, "iid", &iid);
+    if (json_obj_get_int(jctx, "value", &value) != OS_SUCCESS)
+    {
+        json_obj_get_float(jctx, "value", &fvalue);
+    }
+    json_obj_get_bool(jctx, "ev", &ev);
+
+    return aid + iid + value + (int) fvalue + ev;
+}
+
+/**
+ * @brief  Parse the PUT body in one go, with heap allocated tokens.
+ * @return Length of the body.
+ */
+static size_t run_put_parse(void)
+{
+    char         body[sizeof(put_body)];
+    jparse_ctx_t jctx;
+    int          num_elem = 0;
+    int          sum      = 0;
+
+    memcpy(body, put_body, sizeof(put_body));
+    if (json_parse_start(&jctx, body, sizeof(put_body) - 1) != OS_SUCCESS)
+    {
+        return 0;
+    }
+
+    if (json_obj_get_array(&jctx, "characteristics", &num_elem) == OS_SUCCESS)
+    {
+        for (int i = 0; i < num_elem; i++)
+        {
+            if (json_arr_get_object(&jctx, i) == OS_SUCCESS)
+            {
+                sum += read_write_obj(&jctx);
+                json_arr_leave_object(&jctx);
+            }
+        }
+        json_obj_leave_array(&jctx);
+    }
+
+    int64_t pid = 0;
+    json_obj_get_int64(&jctx, "pid", &pid);
+    json_parse_end(&jctx);
+
+    sink += (size_t) sum + (size_t) pid;
+    return sizeof(put_body) - 1;
+}
+
+/**
+ * @brief  Stream callback, handed each characteristic object as it completes.
+ * @param  jctx [in] Parser positioned on the characteristic object.
+ * @param  priv [in,out] Running sum of the fields.
+ * @return OS_SUCCESS.
+ */
+static int put_stream_cb(jparse_ctx_t *jctx, void *priv)
+{
+    *(int *) priv += read_write_obj(jctx);
+    return OS_SUCCESS;
+}
+
+/**
+ * @brief  Parse the PUT body through json_stream, in two reads.
+ * @return Length of the body.
+ */
+static size_t run_put_stream(void)
+{
+    char          inbuf[BENCH_PUT_INBUF_SIZE];
+    char          rest[BENCH_PUT_REST_SIZE];
+    uint32_t      tok_buf[BENCH_PUT_TOK_BUF_SIZE / sizeof(uint32_t)];
+    json_stream_t stream;
+    jparse_ctx_t  jctx;
+    int           sum       = 0;
+    int           remaining = sizeof(put_body) - 1;
+    const char   *src       = put_body;
+
+    json_stream_start(&stream, "characteristics", inbuf, sizeof(inbuf), rest, sizeof(rest),
+                      tok_buf, sizeof(tok_buf), put_stream_cb, &sum);
+
+    while (remaining > 0)
+    {
+        char *ptr;
+        int   space = json_stream_get_buf(&stream, &ptr);
+        int   len   = remaining / 2 + 1;
+
+        len = (len < space) ? len : space;
+        memcpy(ptr, src, len);
+        src       += len;
+        remaining -= len;
+        if (json_stream_feed(&stream, len) != OS_SUCCESS)
+        {
+            return 0;
+        }
+    }
+
+    int64_t pid = 0;
+    if (json_stream_end(&stream, &jctx) == OS_SUCCESS)
+    {
+        json_obj_get_int64(&jctx, "pid", &pid);
+    }
+
+    sink += (size_t) sum + (size_t) pid;
+    return sizeof(put_body) - 1;
+}
+
+/**
+ * @brief  Read pair verify M1 the way the pair verify handler does.
+ * @return Length of the message.
+ */
+static size_t run_pv_m1(void)
+{
+    uint8_t state = 0;
+    uint8_t pk[CURVE_KEY_LEN];
+
+    if ((get_value_from_tlv(pv_m1, pv_m1_len, kTLVType_State, &state, sizeof(state)) < 0) ||
+        (get_value_from_tlv(pv_m1, pv_m1_len, kTLVType_PublicKey, pk, sizeof(pk)) != CURVE_KEY_LEN))
+    {
+        return 0;
+    }
+
+    sink += state + pk[0];
+    return pv_m1_len;
+}
+
+/**
+ * @brief  Build pair verify M2, with its encrypted sub-TLV.
+ * @return Length of the message.
+ */
+static size_t run_pv_m2(void)
+{
+    uint8_t        sub[2 + 17 + 2 + ED_SIGN_LEN + POLY_AUTHTAG_LEN];
+    uint8_t        msg[2 + 1 + 2 + CURVE_KEY_LEN + 2 + sizeof(sub)];
+    uint8_t        pk[CURVE_KEY_LEN] = { 0 };
+    uint8_t        sig[ED_SIGN_LEN]  = { 0 };
+    uint8_t        state             = STATE_M2;
+    hap_tlv_data_t sub_tlv, tlv;
+
+    hap_tlv_data_init(&sub_tlv, sub, sizeof(sub));
+    add_tlv(&sub_tlv, kTLVType_Identifier, 17, "AA:BB:CC:DD:EE:FF");
+    add_tlv(&sub_tlv, kTLVType_Signature, sizeof(sig), sig);
+
+    hap_tlv_data_init(&tlv, msg, sizeof(msg));
+    add_tlv(&tlv, kTLVType_State, sizeof(state), &state);
+    add_tlv(&tlv, kTLVType_PublicKey, sizeof(pk), pk);
+    add_tlv(&tlv, kTLVType_EncryptedData, sub_tlv.curlen + POLY_AUTHTAG_LEN, sub);
+
+    sink += msg[tlv.curlen - 1];
+    return tlv.curlen;
+}
+
+/**
+ * @brief  Read pair verify M3 through a TLV index.
+ * @return Length of the message.
+ */
+static size_t run_pv_m3(void)
+{
+    hap_tlv_index_t idx;
+    uint8_t         state = 0;
+    uint8_t        *edata;
+
+    if ((hap_tlv_index_build(&idx, pv_m3, pv_m3_len) < 0) ||
+        (hap_tlv_get_u8(&idx, kTLVType_State, &state) < 0) ||
+        (hap_tlv_get(&idx, kTLVType_EncryptedData, &edata) < 0))
+    {
+        return 0;
+    }
+
+    sink += state + edata[0];
+    return pv_m3_len;
+}
+
+/**
+ * @brief  Store and load a run of big endian values.
+ * @return Number of bytes stored and loaded.
+ */
+static size_t run_bytes(void)
+{
+    uint8_t  buf[64];
+    uint64_t sum = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        put_u16_be(&buf[i * 14], (uint16_t) i);
+        put_u32_be(&buf[i * 14 + 2], (uint32_t) i);
+        put_u64_be(&buf[i * 14 + 6], (uint64_t) i);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        sum += get_u16_be(&buf[i * 14]) + get_u32_be(&buf[i * 14 + 2]) + get_u64_be(&buf[i * 14 + 6]);
+    }
+
+    sink += (size_t) sum;
+    return 2 * 4 * 14;
+}
+
+/** Every case, in the order they're run */
+static const Bench_case_t cases[] = {
+    { "notify",      run_notify      },
+    { "accessories", run_accessories },
+    { "put-parse",   run_put_parse   },
+    { "put-stream",  run_put_stream  },
+    { "pv-m1",       run_pv_m1       },
+    { "pv-m2",       run_pv_m2       },
+    { "pv-m3",       run_pv_m3       },
+    { "bytes",       run_bytes       },
+};
+
+/**
+ * @brief Build the pair verify requests the parsing cases read.
+ */
+static void build_messages(void)
+{
+    uint8_t        pk[CURVE_KEY_LEN] = { 0 };
+    uint8_t        edata[2 + 36 + 2 + ED_SIGN_LEN + POLY_AUTHTAG_LEN] = { 0 };
+    uint8_t        state;
+    hap_tlv_data_t tlv;
+
+    state = STATE_M1;
+    hap_tlv_data_init(&tlv, pv_m1, sizeof(pv_m1));
+    add_tlv(&tlv, kTLVType_State, sizeof(state), &state);
+    add_tlv(&tlv, kTLVType_PublicKey, sizeof(pk), pk);
+    pv_m1_len = tlv.curlen;
+
+    state = STATE_M3;
+    hap_tlv_data_init(&tlv, pv_m3, sizeof(pv_m3));
+    add_tlv(&tlv, kTLVType_State, sizeof(state), &state);
+    add_tlv(&tlv, kTLVType_EncryptedData, sizeof(edata), edata);
+    pv_m3_len = tlv.curlen;
+}
+
+/**
+ * @brief Run one case and print its line of the report.
+ * @param bench      [in] Case to run.
+ * @param iterations Number of operations to time.
+ */
+static void run_case(const Bench_case_t *bench, unsigned long iterations)
+{
+    size_t bytes = bench->run();
+
+    /* One run above to warm up, then count from here */
+    unsigned long allocs = num_allocs;
+    uint64_t      start  = now_ns();
+
+    for (unsigned long it = 0; it < iterations; it++)
+    {
+        sink += bench->run();
+    }
+
+    uint64_t took = now_ns() - start;
+    allocs = num_allocs - allocs;
+
+    printf("%-12s %10.1f ns/op %8.2f allocs/op %8zu bytes/op %8.1f MB/s\n", bench->name,
+           (double) took / iterations, (double) allocs / iterations, bytes,
+           took ? (double) bytes * iterations * 1000.0 / took : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    bool          selected[sizeof(cases) / sizeof(cases[0])] = { false };
+    bool          any = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc))
+        {
+            iterations = strtoul(argv[++i], NULL, 0);
+            continue;
+        }
+
+        size_t c = 0;
+        for (; c < sizeof(cases) / sizeof(cases[0]); c++)
+        {
+            if (0 == strcmp(argv[i], cases[c].name))
+            {
+                selected[c] = true;
+                any = true;
+                break;
+            }
+        }
+        if (c == sizeof(cases) / sizeof(cases[0]))
+        {
+            fprintf(stderr, "usage: %s [-n <iterations>] [<case>...]\ncases:", argv[0]);
+            for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+            {
+                fprintf(stderr, " %s", cases[c].name);
+            }
+            fprintf(stderr, "\n");
+            return 2;
+        }
+    }
+
+    if (0 == iterations)
+    {
+        iterations = 1;
+    }
+
+    build_messages();
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        if (!any || selected[c])
+        {
+            run_case(&cases[c], iterations);
+        }
+    }
+
+    return 0;
+}
+
+/** @} end CodecBench */
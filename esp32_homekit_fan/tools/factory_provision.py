@@ -0,0 +1,350 @@
+#!/usr/bin/env python3
+"""Batch factory provisioning: one factory NVS image per fan.
+
+Every unit gets its own setup code and setup ID. The SRP salt and verifier
+(what hap_set_setup_info() takes) are computed here rather than on the fan, so
+the firmware never holds the setup code and never derives a verifier. The setup
+payload and its encoded QR code go into the image as well, in the namespace
+that app_hap_setup_payload reads its cache from, so the fan prints the label's
+QR code at boot without encoding it.
+
+Units are numbered, and the verifiers, QR codes and NVS images are made in
+parallel, one worker per host core by default:
+
+    # 200 fans, units fan-0001 to fan-0200
+    factory_provision.py generate --count 200 --out batch1
+
+    # The next batch, never reusing a setup code or ID of the first one
+    factory_provision.py generate --count 200 --start 201 --out batch2 \\
+        --exclude batch1/manifest.csv
+
+    # Re-derive every verifier and payload in a batch, before flashing it
+    factory_provision.py check batch1/manifest.csv
+
+    # Flash one unit (factory_nvs offset from partitions_hap.csv)
+    esptool.py -p /dev/ttyUSB0 write_flash 0x340000 batch1/fan-0001.bin
+
+manifest.csv lists each unit's setup code, setup ID and payload, for printing
+the labels. It holds the setup codes, so keep it away from the images.
+
+The NVS images are made with ESP-IDF's NVS partition generator, found through
+IDF_PATH or the esp-idf-nvs-partition-gen package. Without either, use
+--no-image to get just the CSV inputs. QR codes need the 'qrcodegen' package,
+and are left out (the fan then encodes its own once) if it is missing.
+The firmware has to be built without EXAMPLE_USE_HARDCODED_SETUP_CODE.
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import hashlib
+import os
+import secrets
+import string
+import subprocess
+import sys
+
+# SRP-6a group, 3072-bit from RFC 5054, as in mu_srp.c
+SRP_N = int(
+    "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+    "020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+    "4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+    "EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+    "98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+    "9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+    "E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+    "3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+    "A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+    "ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+    "D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+    "08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF", 16)
+SRP_G = 5
+SRP_USERNAME = b"Pair-Setup"
+# Sizes of hap_setup_info_t
+SALT_LEN = 16
+VERIFIER_LEN = 384
+
+# Factory NVS namespaces and keys, as in esp_hap_database.c and app_hap_setup_payload.c
+NS_HAP_SETUP = "hap_setup"
+NS_SETUP_QR = "hap_setup_qr"
+
+# Setup payload flags, as in esp_hap_setup_payload.c
+PAYLOAD_PREFIX = "X-HM://00"
+PAYLOAD_IP = 1 << 28
+PAYLOAD_BLE = 1 << 29
+PAYLOAD_WAC = 1 << 30
+PAYLOAD_CID_SHIFT = 31
+BASE36_DIGITS = string.digits + string.ascii_uppercase
+
+# HAP_CID_FAN, HAP_CID_BRIDGE in hap.h
+CID_FAN = 3
+CID_BRIDGE = 2
+
+# Highest QR Code version that qrcode_display_encoded() takes (QRCODE_MAX_VERSION)
+QR_MAX_VERSION = 5
+
+# Trivial setup codes that HAP does not allow
+INVALID_CODES = {str(d) * 8 for d in range(10)} | {"12345678", "87654321"}
+
+SETUP_ID_CHARS = string.digits + string.ascii_uppercase
+
+MANIFEST_FIELDS = ["unit", "setup_code", "setup_id", "salt", "payload", "image"]
+
+
+def srp_verifier(setup_code, salt):
+    """v = g^x % N, with x = H(salt | H("Pair-Setup:" | code)), as mu_srp_gen_salt_verifier()."""
+    inner = hashlib.sha512(SRP_USERNAME + b":" + setup_code.encode()).digest()
+    x = int.from_bytes(hashlib.sha512(salt + inner).digest(), "big")
+    return pow(SRP_G, x, SRP_N).to_bytes(VERIFIER_LEN, "big")
+
+
+def base36(value):
+    """Base36 without leading zeros, as base36_to_str()."""
+    digits = ""
+    while value:
+        value, d = divmod(value, 36)
+        digits = BASE36_DIGITS[d] + digits
+    return digits or "0"
+
+
+def setup_payload(setup_code, setup_id, cid, wac, ble):
+    """Same string as esp_hap_get_setup_payload(), which the fan looks the cached QR code up with."""
+    payload = int(setup_code.replace("-", "")) | (cid << PAYLOAD_CID_SHIFT) | PAYLOAD_IP
+    if ble:
+        payload |= PAYLOAD_BLE
+    if wac:
+        payload |= PAYLOAD_WAC
+    return PAYLOAD_PREFIX + base36(payload) + setup_id
+
+
+def encode_qr(text, mask):
+    """QR code in the buffer layout of qrcodegen, as qrcode_encode() stores it: the side
+    length, then one bit per module, row by row. None if qrcodegen is not installed.
+    """
+    try:
+        from qrcodegen import QrCode, QrSegment
+    except ImportError:
+        return None
+    qr = QrCode.encode_segments(QrSegment.make_segments(text), QrCode.Ecc.LOW,
+                                1, QR_MAX_VERSION, mask, True)
+    size = qr.get_size()
+    buf = bytearray((size * size + 7) // 8 + 1)
+    buf[0] = size
+    for y in range(size):
+        for x in range(size):
+            if qr.get_module(x, y):
+                index = y * size + x
+                buf[(index >> 3) + 1] |= 1 << (index & 7)
+    return bytes(buf)
+
+
+def random_setup_code(used):
+    while True:
+        digits = f"{secrets.randbelow(10 ** 8):08d}"
+        code = f"{digits[:3]}-{digits[3:5]}-{digits[5:]}"
+        if digits not in INVALID_CODES and code not in used:
+            used.add(code)
+            return code
+
+
+def random_setup_id(used):
+    while True:
+        setup_id = "".join(secrets.choice(SETUP_ID_CHARS) for _ in range(4))
+        if setup_id not in used:
+            used.add(setup_id)
+            return setup_id
+
+
+def nvs_generator():
+    """Command line of ESP-IDF's NVS partition generator, or None if there is none."""
+    idf_path = os.environ.get("IDF_PATH")
+    if idf_path:
+        script = os.path.join(idf_path, "components", "nvs_flash", "nvs_partition_generator",
+                              "nvs_partition_gen.py")
+        if os.path.exists(script):
+            return [sys.executable, script]
+    try:
+        import esp_idf_nvs_partition_gen  # noqa: F401
+    except ImportError:
+        return None
+    return [sys.executable, "-m", "esp_idf_nvs_partition_gen"]
+
+
+def nvs_csv(unit, qrcode):
+    rows = [
+        ("key", "type", "encoding", "value"),
+        (NS_HAP_SETUP, "namespace", "", ""),
+        ("setup_id", "data", "hex2bin", unit["setup_id"].encode().hex()),
+        ("setup_salt", "data", "hex2bin", unit["salt"]),
+        ("setup_verifier", "data", "hex2bin", unit["verifier"]),
+        (NS_SETUP_QR, "namespace", "", ""),
+        ("payload", "data", "string", unit["payload"]),
+    ]
+    if qrcode:
+        rows.append(("qrcode", "data", "hex2bin", qrcode.hex()))
+    return rows
+
+
+def provision_unit(unit, out_dir, generator, size, qr_mask):
+    """Runs in a worker process: the verifier, QR code and NVS image of one unit."""
+    salt = bytes.fromhex(unit["salt"])
+    unit["verifier"] = srp_verifier(unit["setup_code"], salt).hex()
+    qrcode = encode_qr(unit["payload"], qr_mask)
+    csv_path = os.path.join(out_dir, unit["unit"] + ".csv")
+    with open(csv_path, "w", newline="") as f:
+        csv.writer(f).writerows(nvs_csv(unit, qrcode))
+    unit["image"] = ""
+    if generator:
+        bin_path = os.path.join(out_dir, unit["unit"] + ".bin")
+        result = subprocess.run(generator + ["generate", csv_path, bin_path, hex(size)],
+                                stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        if result.returncode != 0:
+            raise RuntimeError(f"{unit['unit']}: NVS generator failed\n{result.stdout}")
+        # The image has everything, so the CSV with the verifier in plain hex can go
+        os.remove(csv_path)
+        unit["image"] = os.path.basename(bin_path)
+    return unit, qrcode is not None
+
+
+def read_manifests(paths):
+    units = []
+    for path in paths:
+        with open(path, newline="") as f:
+            units += list(csv.DictReader(f))
+    return units
+
+
+def cmd_generate(args):
+    generator = None
+    if not args.no_image:
+        generator = nvs_generator()
+        if not generator:
+            print("no NVS partition generator: set IDF_PATH, install esp-idf-nvs-partition-gen "
+                  "or use --no-image", file=sys.stderr)
+            return 1
+    os.makedirs(args.out, exist_ok=True)
+    manifest_path = os.path.join(args.out, "manifest.csv")
+    if os.path.exists(manifest_path):
+        print(f"{manifest_path} exists, not overwriting a batch", file=sys.stderr)
+        return 1
+
+    # Identities are picked here, in one place, so that they are unique across the batch
+    # and the excluded ones. Only the per unit work is spread over the workers.
+    previous = read_manifests(args.exclude)
+    used_codes = {u["setup_code"] for u in previous}
+    used_ids = {u["setup_id"] for u in previous}
+    cid = CID_BRIDGE if args.bridge else CID_FAN
+    units = []
+    width = max(4, len(str(args.start + args.count - 1)))
+    for n in range(args.start, args.start + args.count):
+        code = random_setup_code(used_codes)
+        setup_id = random_setup_id(used_ids)
+        units.append({
+            "unit": f"{args.prefix}-{n:0{width}d}",
+            "setup_code": code,
+            "setup_id": setup_id,
+            "salt": secrets.token_bytes(SALT_LEN).hex(),
+            "payload": setup_payload(code, setup_id, cid, args.wac, args.ble),
+        })
+
+    done = []
+    with_qr = 0
+    with concurrent.futures.ProcessPoolExecutor(max_workers=args.jobs) as pool:
+        futures = [pool.submit(provision_unit, u, args.out, generator, args.size, args.qr_mask)
+                   for u in units]
+        for future in concurrent.futures.as_completed(futures):
+            unit, has_qr = future.result()
+            done.append(unit)
+            with_qr += has_qr
+            if len(done) % 50 == 0:
+                print(f"{len(done)}/{len(units)} units", file=sys.stderr)
+
+    done.sort(key=lambda u: u["unit"])
+    with open(manifest_path, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=MANIFEST_FIELDS, extrasaction="ignore")
+        writer.writeheader()
+        writer.writerows(done)
+    print(f"provisioned {len(done)} units in {args.out} "
+          f"({'NVS images' if generator else 'CSV only'}, {with_qr} with QR codes)")
+    if with_qr < len(done):
+        print("qrcodegen is not installed, the fans will encode their QR codes themselves",
+              file=sys.stderr)
+    return 0
+
+
+def check_unit(unit, out_dir):
+    """Runs in a worker process: re-derives what the image of a unit should hold."""
+    problems = []
+    code = unit["setup_code"]
+    if (len(code) != 10 or code[3] != "-" or code[6] != "-"
+            or not code.replace("-", "").isdigit() or code.replace("-", "") in INVALID_CODES):
+        problems.append(f"bad setup code {code}")
+    if len(unit["setup_id"]) != 4 or any(c not in SETUP_ID_CHARS for c in unit["setup_id"]):
+        problems.append(f"bad setup ID {unit['setup_id']}")
+    if not unit["payload"].endswith(unit["setup_id"]):
+        problems.append("payload does not end with the setup ID")
+    elif int(unit["payload"][len(PAYLOAD_PREFIX):-4], 36) & 0x7ffffff != int(code.replace("-", "")):
+        problems.append("payload does not carry the setup code")
+    if unit["image"]:
+        with open(os.path.join(out_dir, unit["image"]), "rb") as f:
+            image = f.read()
+        verifier = srp_verifier(code, bytes.fromhex(unit["salt"]))
+        # Blobs are split over 32 byte entries with their headers in between, so look
+        # for the first entry's worth of the verifier, and the whole salt
+        if bytes.fromhex(unit["salt"]) not in image or verifier[:32] not in image:
+            problems.append("image does not hold the expected salt and verifier")
+    return unit["unit"], problems
+
+
+def cmd_check(args):
+    units = read_manifests([args.manifest])
+    out_dir = os.path.dirname(args.manifest)
+    failed = 0
+    for field in ("setup_code", "setup_id"):
+        values = [u[field] for u in units]
+        if len(set(values)) != len(values):
+            print(f"duplicate {field} in the batch")
+            failed += 1
+    with concurrent.futures.ProcessPoolExecutor(max_workers=args.jobs) as pool:
+        for name, problems in pool.map(check_unit, units, [out_dir] * len(units)):
+            for problem in problems:
+                print(f"{name}: {problem}")
+            failed += bool(problems)
+    print(f"checked {len(units)} units, {failed} problems")
+    return 1 if failed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    gen = sub.add_parser("generate", help="provision a batch of units")
+    gen.add_argument("--count", type=int, required=True)
+    gen.add_argument("--start", type=int, default=1, help="number of the first unit")
+    gen.add_argument("--prefix", default="fan", help="unit name prefix")
+    gen.add_argument("--out", required=True, help="directory for the images and manifest.csv")
+    gen.add_argument("--exclude", action="append", default=[],
+                     help="manifest of an earlier batch, whose setup codes and IDs are not reused")
+    gen.add_argument("--size", type=lambda s: int(s, 0), default=0x6000,
+                     help="factory_nvs partition size (default 0x6000, as in partitions_hap.csv)")
+    gen.add_argument("--wac", action="store_true",
+                     help="advertise WAC in the payload (APP_WIFI_USE_WAC_PROVISIONING builds)")
+    gen.add_argument("--ble", action="store_true", help="advertise BLE in the payload (HAP_BLE_ENABLE builds)")
+    gen.add_argument("--bridge", action="store_true", help="bridge category (builds with more than one fan)")
+    gen.add_argument("--qr-mask", type=int, default=-1,
+                     help="QR mask pattern, 0-7, or -1 for the best one (as CONFIG_QRCODE_MASK)")
+    gen.add_argument("--no-image", action="store_true", help="only write the NVS CSV files")
+    gen.add_argument("-j", "--jobs", type=int, default=os.cpu_count())
+    gen.set_defaults(func=cmd_generate)
+
+    chk = sub.add_parser("check", help="re-derive and check a provisioned batch")
+    chk.add_argument("manifest")
+    chk.add_argument("-j", "--jobs", type=int, default=os.cpu_count())
+    chk.set_defaults(func=cmd_check)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,581 @@
+#!/usr/bin/env python3
+"""Load generator emulating many HomeKit controllers against one accessory.
+
+Every emulated controller holds its own pairing with the accessory, runs pair
+verify on its own connection, subscribes to events, and then drives a mix of
+GET /characteristics, PUT /characteristics and GET /accessories at a given rate.
+Latency of every request and the lag between a write and the matching event on
+the other sessions are reported as p50/p99 at the end of the run.
+
+Pairings are kept in a JSON file, so the (slow) pair setup is only done once:
+
+    # Pair once as admin, with the setup code of the accessory
+    hap_loadgen.py --host 192.168.1.50 pair --setup-code 111-22-333
+
+    # Add more controllers (HomeKit allows up to 16 pairings)
+    hap_loadgen.py --host 192.168.1.50 add --count 9
+
+    # Hammer the accessory from 10 sessions for a minute
+    hap_loadgen.py --host 192.168.1.50 run --sessions 10 --rate 2 --duration 60
+
+The HAP port is printed by the accessory at startup and is in its _hap._tcp
+mDNS record. Writes go to the Rotation Speed characteristic by default, so the
+fan will actually change speed during a run.
+
+Adding "verify" to the mix makes sessions run extra pair verifies on fresh
+connections, which keeps the accessory busy with Curve25519/Ed25519 work. With
+a few writes mixed in, the fan's /debug/latency histograms then show how well
+relay handling is isolated from pairing crypto:
+
+    hap_loadgen.py --host 192.168.1.50 run --sessions 4 --mix verify=3,put=1 --rate 2
+
+Needs Python 3.8+ and the 'cryptography' package.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import json
+import os
+import random
+import struct
+import sys
+import time
+import uuid
+
+from cryptography.hazmat.primitives import hashes, serialization
+from cryptography.hazmat.primitives.asymmetric.ed25519 import Ed25519PrivateKey, Ed25519PublicKey
+from cryptography.hazmat.primitives.asymmetric.x25519 import X25519PrivateKey, X25519PublicKey
+from cryptography.hazmat.primitives.ciphers.aead import ChaCha20Poly1305
+from cryptography.hazmat.primitives.kdf.hkdf import HKDF
+
+# TLV8 types, as in esp_hap_pair_common.h
+TLV_METHOD = 0x00
+TLV_IDENTIFIER = 0x01
+TLV_SALT = 0x02
+TLV_PUBLIC_KEY = 0x03
+TLV_PROOF = 0x04
+TLV_ENCRYPTED_DATA = 0x05
+TLV_STATE = 0x06
+TLV_ERROR = 0x07
+TLV_SIGNATURE = 0x0A
+TLV_PERMISSIONS = 0x0B
+
+METHOD_PAIR_SETUP = 0x00
+METHOD_ADD_PAIRING = 0x03
+
+# SRP-6a group, 3072-bit from RFC 5054, as in mu_srp.c
+SRP_N = int(
+    "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74"
+    "020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B302B0A6DF25F1437"
+    "4FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+    "EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF05"
+    "98DA48361C55D39A69163FA8FD24CF5F83655D23DCA3AD961C62F356208552BB"
+    "9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+    "E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF695581718"
+    "3995497CEA956AE515D2261898FA051015728E5A8AAAC42DAD33170D04507A33"
+    "A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+    "ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864"
+    "D87602733EC86A64521F2B18177B200CBBE117577A615D6C770988C0BAD946E2"
+    "08E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF", 16)
+SRP_G = 5
+SRP_LEN = 384
+
+# Largest plaintext of one encrypted frame, HAP_MAX_NW_FRAME_SIZE
+FRAME_MAX = 1024
+
+
+def tlv_encode(*items):
+    """Encodes (type, value) pairs, fragmenting values over 255 bytes."""
+    out = bytearray()
+    for tlv_type, value in items:
+        if isinstance(value, int):
+            value = bytes([value])
+        if not value:
+            out += bytes([tlv_type, 0])
+        for i in range(0, len(value), 255):
+            chunk = value[i:i + 255]
+            out += bytes([tlv_type, len(chunk)]) + chunk
+    return bytes(out)
+
+
+def tlv_decode(data):
+    """Decodes TLV8 into a dict, joining the fragments of a value."""
+    items = {}
+    last = None
+    i = 0
+    while i + 2 <= len(data):
+        tlv_type, length = data[i], data[i + 1]
+        value = data[i + 2:i + 2 + length]
+        if tlv_type == last:
+            items[tlv_type] += value
+        else:
+            items[tlv_type] = value
+        last = tlv_type
+        i += 2 + length
+    return items
+
+
+def hkdf_sha512(ikm, salt, info, length=32):
+    return HKDF(algorithm=hashes.SHA512(), length=length, salt=salt, info=info).derive(ikm)
+
+
+def sha512(*parts):
+    h = hashlib.sha512()
+    for part in parts:
+        h.update(part)
+    return h.digest()
+
+
+def int_to_bytes(value, length=None):
+    if length is None:
+        length = max(1, (value.bit_length() + 7) // 8)
+    return value.to_bytes(length, "big")
+
+
+def raw_public(key):
+    return key.public_bytes(serialization.Encoding.Raw, serialization.PublicFormat.Raw)
+
+
+def raw_private(key):
+    return key.private_bytes(serialization.Encoding.Raw, serialization.PrivateFormat.Raw,
+                             serialization.NoEncryption())
+
+
+def nonce(label):
+    return b"\x00\x00\x00\x00" + label
+
+
+def check_error(tlv, step):
+    if TLV_ERROR in tlv:
+        raise RuntimeError("%s failed with error %d" % (step, tlv[TLV_ERROR][0]))
+
+
+class Controller:
+    """A controller identity, its long term keys and the accessory it is paired with."""
+
+    def __init__(self, pairing_id, ltsk, accessory_id=None, accessory_ltpk=None, admin=False):
+        self.pairing_id = pairing_id
+        self.ltsk = ltsk
+        self.accessory_id = accessory_id
+        self.accessory_ltpk = accessory_ltpk
+        self.admin = admin
+
+    @classmethod
+    def generate(cls, admin=False):
+        return cls(str(uuid.uuid4()).upper().encode(), Ed25519PrivateKey.generate(), admin=admin)
+
+    @property
+    def ltpk(self):
+        return raw_public(self.ltsk.public_key())
+
+    def to_json(self):
+        return {"pairing_id": self.pairing_id.decode(), "ltsk": raw_private(self.ltsk).hex(),
+                "accessory_id": self.accessory_id.decode(), "accessory_ltpk": self.accessory_ltpk.hex(),
+                "admin": self.admin}
+
+    @classmethod
+    def from_json(cls, obj):
+        return cls(obj["pairing_id"].encode(), Ed25519PrivateKey.from_private_bytes(bytes.fromhex(obj["ltsk"])),
+                   obj["accessory_id"].encode(), bytes.fromhex(obj["accessory_ltpk"]), obj.get("admin", False))
+
+
+def load_controllers(path):
+    if not os.path.exists(path):
+        return []
+    with open(path) as f:
+        return [Controller.from_json(obj) for obj in json.load(f)]
+
+
+def save_controllers(path, controllers):
+    with open(path, "w") as f:
+        json.dump([c.to_json() for c in controllers], f, indent=2)
+
+
+class Session:
+    """One connection to the accessory, plain until pair verify, then encrypted."""
+
+    def __init__(self, host, port):
+        self.host = host
+        self.port = port
+        self.reader = None
+        self.writer = None
+        self.write_key = None
+        self.read_key = None
+        self.write_count = 0
+        self.read_count = 0
+        self.buf = bytearray()
+        self.responses = asyncio.Queue()
+        self.on_event = None
+        self.pump = None
+
+    async def connect(self):
+        self.reader, self.writer = await asyncio.open_connection(self.host, self.port)
+
+    async def close(self):
+        if self.pump:
+            self.pump.cancel()
+        if self.writer:
+            self.writer.close()
+
+    def _request_bytes(self, method, path, body=b"", content_type=None):
+        head = "%s %s HTTP/1.1\r\nHost: %s\r\n" % (method, path, self.host)
+        if content_type:
+            head += "Content-Type: %s\r\n" % content_type
+        head += "Content-Length: %d\r\n\r\n" % len(body)
+        return head.encode() + body
+
+    def _encrypt(self, data):
+        out = bytearray()
+        for i in range(0, len(data), FRAME_MAX):
+            chunk = data[i:i + FRAME_MAX]
+            aad = struct.pack("<H", len(chunk))
+            n = b"\x00\x00\x00\x00" + struct.pack("<Q", self.write_count)
+            self.write_count += 1
+            out += aad + ChaCha20Poly1305(self.write_key).encrypt(n, chunk, aad)
+        return bytes(out)
+
+    async def _read_plain(self):
+        """Returns more plaintext from the connection."""
+        if not self.read_key:
+            data = await self.reader.read(4096)
+            if not data:
+                raise ConnectionError("connection closed by the accessory")
+            return data
+        aad = await self.reader.readexactly(2)
+        length = struct.unpack("<H", aad)[0]
+        frame = await self.reader.readexactly(length + 16)
+        n = b"\x00\x00\x00\x00" + struct.pack("<Q", self.read_count)
+        self.read_count += 1
+        return ChaCha20Poly1305(self.read_key).decrypt(n, frame, aad)
+
+    async def _read_until(self, marker):
+        """Returns the buffered bytes up to the marker, consuming both."""
+        while marker not in self.buf:
+            self.buf += await self._read_plain()
+        data, _, rest = bytes(self.buf).partition(marker)
+        self.buf = bytearray(rest)
+        return data
+
+    async def _read_exactly(self, length):
+        while len(self.buf) < length:
+            self.buf += await self._read_plain()
+        data = bytes(self.buf[:length])
+        del self.buf[:length]
+        return data
+
+    async def _read_message(self):
+        """Returns (start line, headers, body) of the next HTTP or EVENT message."""
+        lines = (await self._read_until(b"\r\n\r\n")).decode(errors="replace").split("\r\n")
+        headers = {}
+        for line in lines[1:]:
+            key, _, value = line.partition(":")
+            headers[key.strip().lower()] = value.strip()
+        if headers.get("transfer-encoding", "").lower() == "chunked":
+            body = bytearray()
+            while True:
+                size = int((await self._read_until(b"\r\n")).split(b";")[0], 16)
+                body += await self._read_exactly(size)
+                await self._read_exactly(2)
+                if size == 0:
+                    break
+        else:
+            body = await self._read_exactly(int(headers.get("content-length", "0")))
+        return lines[0], headers, bytes(body)
+
+    async def _pump(self):
+        """Routes EVENT messages to on_event, and responses to the request waiting for them."""
+        try:
+            while True:
+                start, headers, body = await self._read_message()
+                if start.startswith("EVENT/"):
+                    if self.on_event:
+                        self.on_event(time.monotonic(), body)
+                else:
+                    await self.responses.put((start, body))
+        except (ConnectionError, asyncio.IncompleteReadError) as err:
+            await self.responses.put((None, str(err).encode()))
+
+    async def request(self, method, path, body=b"", content_type=None):
+        """Sends a request and returns (status, body). Called one at a time per session."""
+        data = self._request_bytes(method, path, body, content_type)
+        self.writer.write(self._encrypt(data) if self.write_key else data)
+        await self.writer.drain()
+        if self.pump:
+            start, body = await self.responses.get()
+            if start is None:
+                raise ConnectionError(body.decode())
+        else:
+            start, _, body = await self._read_message()
+        return int(start.split(" ")[1]), body
+
+    async def tlv_request(self, path, *items):
+        status, body = await self.request("POST", path, tlv_encode(*items), "application/pairing+tlv8")
+        if status != 200:
+            raise RuntimeError("%s returned HTTP %d" % (path, status))
+        return tlv_decode(body)
+
+    async def pair_setup(self, setup_code):
+        """Runs pair setup M1-M6 as a new admin controller, and returns it."""
+        tlv = await self.tlv_request("/pair-setup", (TLV_STATE, 1), (TLV_METHOD, METHOD_PAIR_SETUP))
+        check_error(tlv, "Pair setup M2")
+        salt, b_bytes = tlv[TLV_SALT], tlv[TLV_PUBLIC_KEY]
+        B = int.from_bytes(b_bytes, "big")
+
+        a = int.from_bytes(os.urandom(32), "big")
+        A = pow(SRP_G, a, SRP_N)
+        a_bytes = int_to_bytes(A)
+        k = int.from_bytes(sha512(int_to_bytes(SRP_N), int_to_bytes(SRP_G, SRP_LEN)), "big")
+        u = int.from_bytes(sha512(int_to_bytes(A, SRP_LEN), int_to_bytes(B, SRP_LEN)), "big")
+        x = int.from_bytes(sha512(salt, sha512(b"Pair-Setup:" + setup_code.encode())), "big")
+        S = pow((B - k * pow(SRP_G, x, SRP_N)) % SRP_N, a + u * x, SRP_N)
+        K = sha512(int_to_bytes(S))
+        h_n, h_g = sha512(int_to_bytes(SRP_N)), sha512(int_to_bytes(SRP_G))
+        M1 = sha512(bytes(i ^ j for i, j in zip(h_n, h_g)), sha512(b"Pair-Setup"), salt, a_bytes, b_bytes, K)
+
+        tlv = await self.tlv_request("/pair-setup", (TLV_STATE, 3), (TLV_PUBLIC_KEY, a_bytes), (TLV_PROOF, M1))
+        check_error(tlv, "Pair setup M4")
+        if tlv.get(TLV_PROOF) != sha512(a_bytes, M1, K):
+            raise RuntimeError("Pair setup M4: accessory proof mismatch")
+
+        ctrl = Controller.generate(admin=True)
+        enc_key = hkdf_sha512(K, b"Pair-Setup-Encrypt-Salt", b"Pair-Setup-Encrypt-Info")
+        ctrl_x = hkdf_sha512(K, b"Pair-Setup-Controller-Sign-Salt", b"Pair-Setup-Controller-Sign-Info")
+        signature = ctrl.ltsk.sign(ctrl_x + ctrl.pairing_id + ctrl.ltpk)
+        sub = tlv_encode((TLV_IDENTIFIER, ctrl.pairing_id), (TLV_PUBLIC_KEY, ctrl.ltpk), (TLV_SIGNATURE, signature))
+        edata = ChaCha20Poly1305(enc_key).encrypt(nonce(b"PS-Msg05"), sub, None)
+
+        tlv = await self.tlv_request("/pair-setup", (TLV_STATE, 5), (TLV_ENCRYPTED_DATA, edata))
+        check_error(tlv, "Pair setup M6")
+        sub = tlv_decode(ChaCha20Poly1305(enc_key).decrypt(nonce(b"PS-Msg06"), tlv[TLV_ENCRYPTED_DATA], None))
+        acc_x = hkdf_sha512(K, b"Pair-Setup-Accessory-Sign-Salt", b"Pair-Setup-Accessory-Sign-Info")
+        ctrl.accessory_id, ctrl.accessory_ltpk = sub[TLV_IDENTIFIER], sub[TLV_PUBLIC_KEY]
+        Ed25519PublicKey.from_public_bytes(ctrl.accessory_ltpk).verify(
+            sub[TLV_SIGNATURE], acc_x + ctrl.accessory_id + ctrl.accessory_ltpk)
+        return ctrl
+
+    async def pair_verify(self, ctrl):
+        """Runs pair verify M1-M4, then switches the session to encrypted frames."""
+        eph = X25519PrivateKey.generate()
+        eph_pub = raw_public(eph)
+        tlv = await self.tlv_request("/pair-verify", (TLV_STATE, 1), (TLV_PUBLIC_KEY, eph_pub))
+        check_error(tlv, "Pair verify M2")
+        acc_pub = tlv[TLV_PUBLIC_KEY]
+        shared = eph.exchange(X25519PublicKey.from_public_bytes(acc_pub))
+        key = hkdf_sha512(shared, b"Pair-Verify-Encrypt-Salt", b"Pair-Verify-Encrypt-Info")
+        sub = tlv_decode(ChaCha20Poly1305(key).decrypt(nonce(b"PV-Msg02"), tlv[TLV_ENCRYPTED_DATA], None))
+        Ed25519PublicKey.from_public_bytes(ctrl.accessory_ltpk).verify(
+            sub[TLV_SIGNATURE], acc_pub + sub[TLV_IDENTIFIER] + eph_pub)
+
+        signature = ctrl.ltsk.sign(eph_pub + ctrl.pairing_id + acc_pub)
+        sub = tlv_encode((TLV_IDENTIFIER, ctrl.pairing_id), (TLV_SIGNATURE, signature))
+        edata = ChaCha20Poly1305(key).encrypt(nonce(b"PV-Msg03"), sub, None)
+        tlv = await self.tlv_request("/pair-verify", (TLV_STATE, 3), (TLV_ENCRYPTED_DATA, edata))
+        check_error(tlv, "Pair verify M4")
+
+        self.write_key = hkdf_sha512(shared, b"Control-Salt", b"Control-Write-Encryption-Key")
+        self.read_key = hkdf_sha512(shared, b"Control-Salt", b"Control-Read-Encryption-Key")
+        self.pump = asyncio.ensure_future(self._pump())
+
+    async def add_pairing(self, new_ctrl):
+        tlv = await self.tlv_request("/pairings", (TLV_STATE, 1), (TLV_METHOD, METHOD_ADD_PAIRING),
+                                     (TLV_IDENTIFIER, new_ctrl.pairing_id), (TLV_PUBLIC_KEY, new_ctrl.ltpk),
+                                     (TLV_PERMISSIONS, 1 if new_ctrl.admin else 0))
+        check_error(tlv, "Add pairing")
+
+
+def write_key(aid, iid, value):
+    """Key matching a write to its event, whatever the number formatting of the accessory."""
+    if isinstance(value, (int, float)) and not isinstance(value, bool):
+        value = float(value)
+    return aid, iid, json.dumps(value)
+
+
+def find_char(accessories, short_type):
+    """Returns (aid, iid) of the first characteristic of the given short type, e.g. '29'."""
+    for acc in accessories["accessories"]:
+        for serv in acc["services"]:
+            for char in serv["characteristics"]:
+                if char["type"].upper().lstrip("0").split("-")[0] == short_type.upper():
+                    return acc["aid"], char["iid"]
+    raise RuntimeError("No characteristic of type %s" % short_type)
+
+
+class Stats:
+    def __init__(self):
+        self.samples = {}
+        self.errors = {}
+
+    def add(self, name, value_ms):
+        self.samples.setdefault(name, []).append(value_ms)
+
+    def error(self, name):
+        self.errors[name] = self.errors.get(name, 0) + 1
+
+    @staticmethod
+    def percentile(values, pct):
+        values = sorted(values)
+        index = min(len(values) - 1, int(round(pct / 100.0 * (len(values) - 1))))
+        return values[index]
+
+    def report(self, as_json):
+        rows = []
+        for name in sorted(set(self.samples) | set(self.errors)):
+            values = self.samples.get(name, [])
+            rows.append({"op": name, "count": len(values), "errors": self.errors.get(name, 0),
+                         "p50_ms": round(self.percentile(values, 50), 2) if values else None,
+                         "p99_ms": round(self.percentile(values, 99), 2) if values else None,
+                         "max_ms": round(max(values), 2) if values else None})
+        if as_json:
+            print(json.dumps(rows, indent=2))
+            return
+        print("%-16s %8s %7s %10s %10s %10s" % ("op", "count", "errors", "p50_ms", "p99_ms", "max_ms"))
+        for row in rows:
+            print("%-16s %8d %7d %10s %10s %10s" % (row["op"], row["count"], row["errors"],
+                                                    row["p50_ms"], row["p99_ms"], row["max_ms"]))
+
+
+async def cmd_pair(args):
+    controllers = load_controllers(args.pairings)
+    session = Session(args.host, args.port)
+    await session.connect()
+    ctrl = await session.pair_setup(args.setup_code)
+    await session.close()
+    controllers.append(ctrl)
+    save_controllers(args.pairings, controllers)
+    print("Paired as %s with accessory %s" % (ctrl.pairing_id.decode(), ctrl.accessory_id.decode()))
+
+
+async def cmd_add(args):
+    controllers = load_controllers(args.pairings)
+    admins = [c for c in controllers if c.admin]
+    if not admins:
+        sys.exit("No admin pairing in %s, run 'pair' first" % args.pairings)
+    session = Session(args.host, args.port)
+    await session.connect()
+    await session.pair_verify(admins[0])
+    for _ in range(args.count):
+        ctrl = Controller.generate()
+        ctrl.accessory_id, ctrl.accessory_ltpk = admins[0].accessory_id, admins[0].accessory_ltpk
+        await session.add_pairing(ctrl)
+        controllers.append(ctrl)
+        save_controllers(args.pairings, controllers)
+    await session.close()
+    print("%d pairings in %s" % (len(controllers), args.pairings))
+
+
+async def run_session(index, ctrl, args, stats, writes, deadline):
+    """Drives one controller until the deadline."""
+    session = Session(args.host, args.port)
+    try:
+        start = time.monotonic()
+        await session.connect()
+        await session.pair_verify(ctrl)
+        stats.add("pair_verify", (time.monotonic() - start) * 1000)
+
+        def on_event(now, body):
+            for char in json.loads(body).get("characteristics", []):
+                sent = writes.get(write_key(char["aid"], char["iid"], char.get("value")))
+                if sent is not None and sent[1] != index:
+                    stats.add("event_lag", (now - sent[0]) * 1000)
+        session.on_event = on_event
+
+        status, body = await session.request("GET", "/accessories")
+        aid, iid = find_char(json.loads(body), args.write_type)
+        sub = json.dumps({"characteristics": [{"aid": aid, "iid": iid, "ev": True}]}).encode()
+        status, _ = await session.request("PUT", "/characteristics", sub, "application/hap+json")
+        if status not in (200, 204, 207):
+            stats.error("subscribe")
+
+        ops = [op for op, weight in args.mix for _ in range(weight)]
+        while time.monotonic() < deadline:
+            op = random.choice(ops)
+            start = time.monotonic()
+            try:
+                if op == "get":
+                    status, _ = await session.request("GET", "/characteristics?id=%d.%d" % (aid, iid))
+                elif op == "verify":
+                    # A fresh pair verify on its own connection, for crypto load
+                    extra = Session(args.host, args.port)
+                    try:
+                        await extra.connect()
+                        await extra.pair_verify(ctrl)
+                    finally:
+                        await extra.close()
+                    status = 200
+                elif op == "put":
+                    value = random.choice(args.write_values)
+                    writes[write_key(aid, iid, value)] = (start, index)
+                    body = json.dumps({"characteristics": [{"aid": aid, "iid": iid, "value": value}]})
+                    status, _ = await session.request("PUT", "/characteristics", body.encode(), "application/hap+json")
+                else:
+                    status, _ = await session.request("GET", "/accessories")
+                if status >= 300 and status != 207:
+                    stats.error(op)
+                else:
+                    stats.add(op, (time.monotonic() - start) * 1000)
+            except (RuntimeError, ValueError, OSError):
+                stats.error(op)
+            # Poisson arrivals at the requested rate
+            await asyncio.sleep(random.expovariate(args.rate) if args.rate > 0 else 0)
+    except Exception as err:  # pylint: disable=broad-except
+        stats.error("session")
+        print("Session %d: %s" % (index, err), file=sys.stderr)
+    finally:
+        await session.close()
+
+
+async def cmd_run(args):
+    controllers = load_controllers(args.pairings)
+    if len(controllers) < args.sessions:
+        sys.exit("Only %d pairings in %s, add more with 'add'" % (len(controllers), args.pairings))
+    stats = Stats()
+    writes = {}
+    deadline = time.monotonic() + args.duration
+    await asyncio.gather(*[run_session(i, controllers[i], args, stats, writes, deadline)
+                           for i in range(args.sessions)])
+    stats.report(args.json)
+
+
+def parse_mix(text):
+    mix = []
+    for part in text.split(","):
+        op, _, weight = part.partition("=")
+        if op not in ("get", "put", "acc", "verify"):
+            raise argparse.ArgumentTypeError("unknown op %s" % op)
+        mix.append((op, int(weight or 1)))
+    return mix
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--host", required=True, help="Accessory IP address or hostname")
+    parser.add_argument("--port", type=int, default=80, help="HAP port of the accessory")
+    parser.add_argument("--pairings", default="hap_pairings.json", help="File holding the pairings")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    pair = sub.add_parser("pair", help="Pair setup as a new admin controller")
+    pair.add_argument("--setup-code", required=True, help="Setup code, e.g. 111-22-333")
+
+    add = sub.add_parser("add", help="Add regular controller pairings using the admin one")
+    add.add_argument("--count", type=int, default=1)
+
+    run = sub.add_parser("run", help="Drive parallel sessions and report latencies")
+    run.add_argument("--sessions", type=int, default=8)
+    run.add_argument("--rate", type=float, default=1.0, help="Requests per second per session")
+    run.add_argument("--duration", type=float, default=30.0, help="Length of the run (in seconds)")
+    run.add_argument("--mix", type=parse_mix, default=parse_mix("get=6,put=2,acc=1"),
+                     help="Weights of GET /characteristics, PUT /characteristics, GET /accessories "
+                          "and extra pair verifies (verify)")
+    run.add_argument("--write-type", default="29", help="Short type of the written characteristic")
+    run.add_argument("--write-values", type=lambda s: [json.loads(v) for v in s.split(",")],
+                     default=[25, 50, 75, 100], help="Values written, comma separated JSON")
+    run.add_argument("--json", action="store_true", help="Report as JSON")
+
+    args = parser.parse_args()
+    handler = {"pair": cmd_pair, "add": cmd_add, "run": cmd_run}[args.cmd]
+    asyncio.run(handler(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,14 @@
+/**
+ * @file sdkconfig.h
+ * @brief Stand-in project configuration for building app sources on the host.
+ *
+ * Only what the host tools in tools/ need, the decoder takes its linux-target
+ * paths from this.
+ */
+
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+#define CONFIG_IDF_TARGET_LINUX 1
+
+#endif /* SDKCONFIG_H */
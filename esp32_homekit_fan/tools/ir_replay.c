@@ -0,0 +1,375 @@
+/**
+ * @file ir_replay.c
+ * @author Ryan Banks
+ * @date 2023
+ * @brief Host tool to replay captured IR symbols through the IR decoder.
+ *
+ * With CONFIG_FAN_REMOTE_CAPTURE, the fan prints every piece of an IR capture
+ * as an "irc,<continued>,<count>,<word>,..." line. Save the console output
+ * while pressing one button (or none, to record noise) and this tool feeds it
+ * back through Ir_decode() exactly as the remote task does, then reports:
+ *
+ * - how many captures decoded to the expected code,
+ * - how many frames decoded to anything else (false positives),
+ * - how long decoding takes, per piece and per frame.
+ *
+ * Keep the logs from a few remotes and distances around, and any change to the
+ * decoder's timings can be checked against them before it goes on a fan.
+ *
+ * Build it from esp32_homekit_fan/ with:
+ *
+ *     cc -O2 -Itools/host -Imain -o ir_replay tools/ir_replay.c main/ir_decoder.c
+ *
+ * and run it as:
+ *
+ *     ./ir_replay [-e <protocol>:<code>]... [-e none] [-n <iterations>] [-v] <log>...
+ *
+ * Without -e, every decoded frame counts, which is handy for finding the codes
+ * of a new remote. With "-e none", every frame is a false positive. -v prints
+ * every decoded frame.
+ *
+ * @addtogroup IrReplay
+ * @{
+ */
+
+#include <stdbool.h>    /* Boolean type */
+#include <stdint.h>     /* Extended integer types */
+#include <stdio.h>      /* File and console IO */
+#include <stdlib.h>     /* Memory allocation, number parsing */
+#include <string.h>     /* String functions */
+#include <strings.h>    /* Case-insensitive compares */
+#include <time.h>       /* Monotonic clock */
+
+#include "ir_decoder.h"
+
+/** Most frames the remote task decodes out of a single piece */
+#define MAX_FRAMES_PER_CAPTURE 8
+
+/** Most codes that can be given with -e */
+#define MAX_EXPECTED           16
+
+/** Longest capture line we read, a full piece is well under this */
+#define MAX_LINE               4096
+
+/** Default number of times every piece is decoded for timing */
+#define DEFAULT_ITERATIONS     1000
+
+/** Struct for one piece of a capture, as printed by the remote task */
+typedef struct Replay_chunk_t
+{
+    rmt_symbol_word_t *symbols; /** Symbols in the piece */
+    size_t num_symbols;         /** Number of symbols in the piece */
+    bool continued;             /** Whether this carries on from the last piece */
+} Replay_chunk_t;
+
+/** Struct for a code given with -e */
+typedef struct Replay_expected_t
+{
+    enum Ir_protocol protocol; /** Protocol the code arrives in */
+    uint32_t code;             /** Expected code */
+} Replay_expected_t;
+
+/** Names of the protocols, for parsing -e and printing results */
+static const char *protocol_names[NUM_IR_PROTOCOL] = {
+    [IR_PROTOCOL_LASKO] = "lasko",
+    [IR_PROTOCOL_NEC]   = "nec",
+    [IR_PROTOCOL_RC5]   = "rc5",
+};
+
+/** Every piece read from the logs */
+static Replay_chunk_t *chunks;
+static size_t num_chunks;
+
+/** Codes given with -e, and whether "-e none" was given */
+static Replay_expected_t expected[MAX_EXPECTED];
+static size_t num_expected;
+static bool expect_none;
+
+/** Whether to print every decoded frame (-v) */
+static bool verbose;
+
+/**
+ * @brief  Get the monotonic time.
+ * @return Time in nSec.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @brief  Parse a "<protocol>:<code>" argument to -e.
+ * @param  arg [in] Argument to parse.
+ * @return Whether it was valid.
+ */
+static bool parse_expected(const char *arg)
+{
+    if (0 == strcasecmp(arg, "none"))
+    {
+        expect_none = true;
+        return true;
+    }
+
+    const char *colon = strchr(arg, ':');
+    if ((NULL == colon) || (num_expected >= MAX_EXPECTED))
+    {
+        return false;
+    }
+
+    for (int p = 0; p < NUM_IR_PROTOCOL; p++)
+    {
+        if ((strlen(protocol_names[p]) == (size_t) (colon - arg)) &&
+            (0 == strncasecmp(arg, protocol_names[p], colon - arg)))
+        {
+            char *end;
+            expected[num_expected].protocol = (enum Ir_protocol) p;
+            expected[num_expected].code     = (uint32_t) strtoul(colon + 1, &end, 0);
+            num_expected++;
+            return (end != colon + 1) && ('\0' == *end);
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief  Check a decoded frame against the codes given with -e.
+ * @param  frame [in] Decoded frame.
+ * @return Whether the frame is one we expected.
+ */
+static bool is_expected(const Ir_frame_t *frame)
+{
+    if (expect_none)
+    {
+        return false;
+    }
+    if (0 == num_expected)
+    {
+        return true;
+    }
+
+    for (size_t i = 0; i < num_expected; i++)
+    {
+        if ((expected[i].protocol == frame->protocol) && (expected[i].code == frame->code))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief  Parse one capture line into a new piece.
+ * @param  line [in] Line containing "irc,...", prefixes from the monitor are
+ *              skipped.
+ * @return Whether the line held a valid piece.
+ */
+static bool parse_line(const char *line)
+{
+    const char *p = strstr(line, "irc,");
+    if (NULL == p)
+    {
+        return false;
+    }
+
+    char *end;
+    unsigned long continued = strtoul(p + 4, &end, 10);
+    if (',' != *end)
+    {
+        return false;
+    }
+    unsigned long count = strtoul(end + 1, &end, 10);
+    if (0 == count)
+    {
+        return false;
+    }
+
+    rmt_symbol_word_t *symbols = calloc(count, sizeof(rmt_symbol_word_t));
+    for (unsigned long i = 0; i < count; i++)
+    {
+        if (',' != *end)
+        {
+            /* Truncated line, the console dropped something */
+            free(symbols);
+            return false;
+        }
+        symbols[i].val = (uint32_t) strtoul(end + 1, &end, 16);
+    }
+
+    chunks = realloc(chunks, (num_chunks + 1) * sizeof(Replay_chunk_t));
+    chunks[num_chunks].symbols     = symbols;
+    chunks[num_chunks].num_symbols = count;
+    chunks[num_chunks].continued   = (0 != continued);
+    num_chunks++;
+    return true;
+}
+
+/**
+ * @brief  Read every capture line out of a log.
+ * @param  path [in] Path to the log.
+ * @return Whether the log could be read.
+ */
+static bool read_log(const char *path)
+{
+    static char line[MAX_LINE];
+    FILE *f = fopen(path, "r");
+
+    if (NULL == f)
+    {
+        perror(path);
+        return false;
+    }
+
+    while (NULL != fgets(line, sizeof(line), f))
+    {
+        (void) parse_line(line);
+    }
+
+    fclose(f);
+    return true;
+}
+
+/**
+ * @brief Decode every piece once, the way the remote task would, and count
+ *        captures, frames and false positives.
+ */
+static void report_decode(void)
+{
+    size_t captures = 0, decoded = 0;
+    size_t frames_total = 0, repeats = 0, false_positives = 0;
+    bool   capture_decoded = false;
+
+    for (size_t i = 0; i < num_chunks; i++)
+    {
+        Ir_frame_t frames[MAX_FRAMES_PER_CAPTURE];
+        size_t     num_frames = Ir_decode(chunks[i].symbols, chunks[i].num_symbols, chunks[i].continued,
+                                          frames, MAX_FRAMES_PER_CAPTURE);
+
+        if (!chunks[i].continued)
+        {
+            /* A new capture, close out the last one */
+            decoded += capture_decoded ? 1 : 0;
+            capture_decoded = false;
+            captures++;
+        }
+
+        for (size_t f = 0; f < num_frames; f++)
+        {
+            frames_total++;
+            repeats += frames[f].repeat ? 1 : 0;
+
+            if (is_expected(&frames[f]))
+            {
+                capture_decoded = true;
+            }
+            else
+            {
+                false_positives++;
+            }
+
+            if (verbose)
+            {
+                printf("  %s 0x%lx%s%s\n", protocol_names[frames[f].protocol], (unsigned long) frames[f].code,
+                       frames[f].repeat ? " (repeat)" : "", is_expected(&frames[f]) ? "" : " [unexpected]");
+            }
+        }
+    }
+    decoded += capture_decoded ? 1 : 0;
+
+    printf("pieces:          %zu\n", num_chunks);
+    printf("captures:        %zu\n", captures);
+    if (!expect_none)
+    {
+        printf("decoded:         %zu (%.1f%%)\n", decoded, captures ? 100.0 * decoded / captures : 0.0);
+    }
+    printf("frames:          %zu (%zu repeats)\n", frames_total, repeats);
+    printf("false positives: %zu\n", false_positives);
+}
+
+/**
+ * @brief Decode every piece over and over to time the decoder.
+ * @param iterations Number of passes over all the pieces.
+ */
+static void report_timing(unsigned long iterations)
+{
+    uint64_t total_ns = 0, worst_ns = 0;
+    size_t   frames_total = 0;
+    volatile size_t sink = 0;
+
+    for (unsigned long it = 0; it < iterations; it++)
+    {
+        for (size_t i = 0; i < num_chunks; i++)
+        {
+            Ir_frame_t frames[MAX_FRAMES_PER_CAPTURE];
+            uint64_t   start      = now_ns();
+            size_t     num_frames = Ir_decode(chunks[i].symbols, chunks[i].num_symbols, chunks[i].continued,
+                                              frames, MAX_FRAMES_PER_CAPTURE);
+            uint64_t   took       = now_ns() - start;
+
+            total_ns += took;
+            worst_ns  = (took > worst_ns) ? took : worst_ns;
+            frames_total += num_frames;
+            sink += num_frames;
+        }
+    }
+
+    size_t decodes = num_chunks * iterations;
+    printf("decode time:     %.0f ns/piece (worst %llu ns)", decodes ? (double) total_ns / decodes : 0.0,
+           (unsigned long long) worst_ns);
+    if (frames_total)
+    {
+        printf(", %.0f ns/frame", (double) total_ns / frames_total);
+    }
+    printf(", host time over %lu passes\n", iterations);
+    (void) sink;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if ((0 == strcmp(argv[i], "-e")) && (i + 1 < argc))
+        {
+            if (!parse_expected(argv[++i]))
+            {
+                fprintf(stderr, "bad expected code '%s', use <lasko|nec|rc5>:<code> or none\n", argv[i]);
+                return 2;
+            }
+        }
+        else if (0 == strcmp(argv[i], "-v"))
+        {
+            verbose = true;
+        }
+        else if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc))
+        {
+            iterations = strtoul(argv[++i], NULL, 0);
+        }
+        else if ('-' == argv[i][0])
+        {
+            fprintf(stderr, "usage: %s [-e <protocol>:<code>]... [-e none] [-n <iterations>] [-v] <log>...\n", argv[0]);
+            return 2;
+        }
+        else if (!read_log(argv[i]))
+        {
+            return 1;
+        }
+    }
+
+    if (0 == num_chunks)
+    {
+        fprintf(stderr, "no irc lines found, was CONFIG_FAN_REMOTE_CAPTURE enabled?\n");
+        return 1;
+    }
+
+    report_decode();
+    report_timing(iterations);
+    return 0;
+}
+
+/** @} end IrReplay */
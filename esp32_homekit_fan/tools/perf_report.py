@@ -0,0 +1,345 @@
+#!/usr/bin/env python3
+"""Record firmware size, boot time and heap usage, and compare them across commits.
+
+A report is a small JSON file holding:
+
+- the app image size against the ota_0 slot in partitions_hap.csv,
+- the IRAM/DRAM/flash use of every component, from `idf.py size-components`,
+- the boot timeline the firmware logs (app_main, "HomeKit started" (hap_start),
+  "init done", "WiFi connected", "first controller connected"), with the free
+  heap at each phase,
+- optionally, the hot path timings from a build with sdkconfig.defaults.bench:
+  crypto cycles per operation (/debug/benchmark), event pipeline latency
+  percentiles (/debug/eventbench) and mean input-to-relay latencies
+  (/debug/latency).
+
+Record one per commit, then compare any two of them:
+
+    # After `idf.py build`, with a boot log saved from `idf.py monitor | tee boot.log`
+    perf_report.py record --log boot.log --out report-$(git rev-parse --short HEAD).json
+
+    # Or let the tool reset the board and read the log itself (needs pyserial)
+    perf_report.py record --port /dev/ttyUSB0 --out new.json
+
+    # Add the hot path timings, once the benchmarks have run
+    perf_report.py record --port /dev/ttyUSB0 --url http://<fan-ip>:<hap-port> --out new.json
+
+    # Exits with 1 if anything got worse by more than the tolerances
+    perf_report.py compare base.json new.json
+
+Run it from esp32_homekit_fan/, with the ESP-IDF environment exported.
+"""
+
+import argparse
+import csv
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+import urllib.error
+import urllib.request
+
+# Matches the lines printed by Boot_log_phase() in main.c
+BOOT_PHASE_RE = re.compile(r'Boot phase "([^"]+)" at (\d+) ms \(\+\d+ ms\)(?:, heap free (\d+))?')
+
+# Phase the serial reader stops at, nothing interesting happens after it
+LAST_PHASE = "first controller connected"
+
+# Matches a /debug/latency line, "remote/queue: n=12 mean=85us max=410us | ..."
+LATENCY_RE = re.compile(r"^(\w+/\w+): n=(\d+) mean=(-?\d+)us")
+
+# Component size fields, by the memory region they count against
+REGIONS = ("iram", "dram", "flash")
+
+
+def run_idf_size(build_dir, target):
+    """Run an idf.py size target with JSON output and return the parsed result."""
+    out = subprocess.run(["idf.py", "-B", build_dir, target, "--format", "json"],
+                         check=True, capture_output=True, text=True).stdout
+    # idf.py prints its own chatter before the JSON
+    return json.loads(out[out.index("{"):])
+
+
+def region_of(field):
+    """Map an idf_size field (".iram0.text", "flash_rodata", "dram_bss", ...) onto a region."""
+    field = field.lower()
+    if "iram" in field:
+        return "iram"
+    if "flash" in field:
+        return "flash"
+    if "dram" in field or "bss" in field or "data" in field:
+        return "dram"
+    return None
+
+
+def component_sizes(build_dir):
+    """Per component IRAM/DRAM/flash use, keyed by archive name without lib/.a."""
+    components = {}
+    for archive, fields in run_idf_size(build_dir, "size-components").items():
+        name = re.sub(r"^lib|\.a$", "", archive)
+        sizes = dict.fromkeys(REGIONS, 0)
+        for field, value in fields.items():
+            region = region_of(field)
+            if region and isinstance(value, int) and field != "total":
+                sizes[region] += value
+        components[name] = sizes
+    return components
+
+
+def parse_size(text):
+    """Parse a partition table size, "0x1000", "1600K" or "4M"."""
+    text = text.strip()
+    scale = {"K": 1024, "M": 1024 * 1024}.get(text[-1:].upper(), 1)
+    return int(text[:-1] if scale > 1 else text, 0) * scale
+
+
+def app_slot_size(partitions):
+    """Size of the ota_0 (or factory) app partition."""
+    with open(partitions) as f:
+        rows = [r for r in csv.reader(l for l in f if not l.lstrip().startswith("#"))]
+    for row in rows:
+        row = [c.strip() for c in row]
+        if len(row) >= 5 and row[1] == "app" and row[2] in ("ota_0", "factory"):
+            return parse_size(row[4])
+    raise SystemExit(f"no app partition found in {partitions}")
+
+
+def app_image_size(build_dir):
+    with open(os.path.join(build_dir, "project_description.json")) as f:
+        desc = json.load(f)
+    return os.path.getsize(os.path.join(build_dir, desc["app_bin"]))
+
+
+def read_serial_log(port, baud, timeout):
+    """Reset the board through DTR/RTS and read its log until the last phase or a timeout."""
+    import serial  # Only needed for this mode
+
+    lines = []
+    with serial.Serial(port, baud, timeout=0.5) as ser:
+        ser.dtr = False
+        ser.rts = True
+        time.sleep(0.1)
+        ser.rts = False
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            line = ser.readline().decode(errors="replace")
+            if line:
+                lines.append(line)
+                if LAST_PHASE in line:
+                    break
+    return lines
+
+
+def fetch_lines(url, timeout):
+    """GET a debug endpoint, as a list of lines. None if the build doesn't have it."""
+    try:
+        with urllib.request.urlopen(url, timeout=timeout) as resp:
+            return resp.read().decode(errors="replace").splitlines()
+    except urllib.error.HTTPError as e:
+        if e.code == 404:
+            return None
+        raise
+
+
+def csv_rows(lines, tag):
+    """Rows of a debug CSV as dicts, without the header and any other lines."""
+    rows = list(csv.reader(l for l in lines if l.startswith(tag + ",")))
+    return [dict(zip(rows[0], row)) for row in rows[1:]] if rows else []
+
+
+def hot_paths(url, timeout):
+    """Hot path timings from the debug endpoints, as {name: value}, lower is better.
+
+    The benchmarks run a little while after boot, so endpoints that have no
+    results yet are polled until they do or the timeout runs out.
+    """
+    timings = {}
+    deadline = time.monotonic() + timeout
+    for path, tag in (("/debug/benchmark", "bench"), ("/debug/eventbench", "evbench")):
+        while True:
+            lines = fetch_lines(url + path, timeout)
+            rows = csv_rows(lines or [], tag)
+            if lines is None or rows or time.monotonic() > deadline:
+                break
+            time.sleep(2)
+        for row in rows:
+            if tag == "bench":
+                timings[f"crypto {row['primitive']}/{row['bytes']} cycles/op"] = int(row["cycles_per_op"])
+            else:
+                for pct in ("p50", "p99"):
+                    timings[f"event {row['scenario']} {pct} us"] = int(row[pct + "_us"])
+
+    for line in fetch_lines(url + "/debug/latency", timeout) or []:
+        m = LATENCY_RE.match(line)
+        if m and int(m.group(2)) > 0:
+            timings[f"latency {m.group(1)} mean us"] = int(m.group(3))
+    return timings
+
+
+def boot_phases(lines):
+    """Boot phases from a log, as {phase: {"ms": ..., "heap_free": ...}}."""
+    phases = {}
+    for line in lines:
+        m = BOOT_PHASE_RE.search(line)
+        if m:
+            phases[m.group(1)] = {"ms": int(m.group(2))}
+            if m.group(3) is not None:
+                phases[m.group(1)]["heap_free"] = int(m.group(3))
+    return phases
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], check=True,
+                              capture_output=True, text=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+
+def cmd_record(args):
+    report = {"commit": git_commit()}
+
+    if not args.no_size:
+        image = app_image_size(args.build_dir)
+        slot = app_slot_size(args.partitions)
+        report["image"] = {"size": image, "slot": slot, "free": slot - image}
+        report["components"] = component_sizes(args.build_dir)
+
+    if args.log:
+        with open(args.log, errors="replace") as f:
+            report["boot"] = boot_phases(f)
+    elif args.port:
+        report["boot"] = boot_phases(read_serial_log(args.port, args.baud, args.timeout))
+
+    if args.url:
+        report["hot"] = hot_paths(args.url.rstrip("/"), args.timeout)
+        if not report["hot"]:
+            print("no hot path timings, was the build made with sdkconfig.defaults.bench?",
+                  file=sys.stderr)
+
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    print(f"wrote {args.out} for {report['commit']}")
+    if report.get("image", {}).get("free", 0) < 0:
+        print("app image does not fit its partition!", file=sys.stderr)
+        return 1
+    return 0
+
+
+def flatten(report):
+    """Every comparable number in a report, as {name: (value, worse_if_higher)}."""
+    metrics = {}
+    if "image" in report:
+        metrics["image size"] = (report["image"]["size"], True)
+        metrics["image slot free"] = (report["image"]["free"], False)
+    for name, sizes in report.get("components", {}).items():
+        for region, value in sizes.items():
+            metrics[f"{name} {region}"] = (value, True)
+    for phase, values in report.get("boot", {}).items():
+        metrics[f"boot '{phase}' ms"] = (values["ms"], True)
+        if "heap_free" in values:
+            metrics[f"boot '{phase}' heap free"] = (values["heap_free"], False)
+    for name, value in report.get("hot", {}).items():
+        metrics[name] = (value, True)
+    return metrics
+
+
+def tolerance(name, args):
+    if name.startswith("boot") and name.endswith(" ms"):
+        return args.time_tol
+    if name.startswith(("crypto ", "event ", "latency ")):
+        return args.latency_tol
+    if "heap free" in name or "slot free" in name:
+        return args.heap_tol
+    return args.size_tol
+
+
+def median(values):
+    values = sorted(values)
+    mid = len(values) // 2
+    return values[mid] if len(values) % 2 else (values[mid - 1] + values[mid]) / 2
+
+
+def print_tradeoff(base, new):
+    """One line weighing the image size change against the hot path timing changes."""
+    common = set(base.get("hot", {})) & set(new.get("hot", {}))
+    changes = [100.0 * (new["hot"][n] - base["hot"][n]) / base["hot"][n]
+               for n in common if base["hot"][n] > 0]
+    if "image" not in base or "image" not in new or not changes:
+        return
+    size = 100.0 * (new["image"]["size"] - base["image"]["size"]) / base["image"]["size"]
+    faster = sum(1 for c in changes if c < 0)
+    print(f"  trade-off: image {size:+.1f}%, hot paths median {median(changes):+.1f}% "
+          f"({faster} faster, {len(changes) - faster} not, best {min(changes):+.1f}%, "
+          f"worst {max(changes):+.1f}%)")
+
+
+def cmd_compare(args):
+    with open(args.base) as f:
+        base = json.load(f)
+    with open(args.new) as f:
+        new = json.load(f)
+    base_metrics, new_metrics = flatten(base), flatten(new)
+
+    print(f"{base.get('commit', args.base)} -> {new.get('commit', args.new)}")
+    regressions = 0
+    for name in sorted(set(base_metrics) | set(new_metrics)):
+        old, higher_is_worse = base_metrics.get(name, (0, True))
+        cur, _ = new_metrics.get(name, (0, higher_is_worse))
+        if old == cur:
+            continue
+        delta = cur - old
+        pct = (100.0 * delta / old) if old else float("inf")
+        worse = (delta > 0) == higher_is_worse
+        flag = ""
+        if worse and abs(pct) > tolerance(name, args):
+            flag = "  REGRESSION"
+            regressions += 1
+        if flag or args.verbose or abs(pct) > 0.5:
+            print(f"  {name:40} {old:>10} -> {cur:>10} ({delta:+}, {pct:+.1f}%){flag}")
+
+    if new.get("image", {}).get("free", 0) < 0:
+        print("  app image does not fit its partition!  REGRESSION")
+        regressions += 1
+
+    print_tradeoff(base, new)
+
+    print(f"{regressions} regression(s)")
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    rec = sub.add_parser("record", help="record a report for the current build")
+    rec.add_argument("--build-dir", default="build")
+    rec.add_argument("--partitions", default="partitions_hap.csv")
+    rec.add_argument("--log", help="boot log saved from idf.py monitor")
+    rec.add_argument("--port", help="serial port to reset the board on and read the boot log from")
+    rec.add_argument("--baud", type=int, default=115200)
+    rec.add_argument("--timeout", type=float, default=60,
+                     help="seconds to wait for the boot log, and for the benchmarks to finish")
+    rec.add_argument("--url", help="http://<fan-ip>:<hap-port> to fetch the hot path timings from")
+    rec.add_argument("--no-size", action="store_true", help="skip the size breakdown")
+    rec.add_argument("--out", required=True)
+    rec.set_defaults(func=cmd_record)
+
+    cmp = sub.add_parser("compare", help="compare two reports")
+    cmp.add_argument("base")
+    cmp.add_argument("new")
+    cmp.add_argument("--size-tol", type=float, default=1.0, help="percent growth allowed in sizes")
+    cmp.add_argument("--time-tol", type=float, default=10.0, help="percent growth allowed in boot times")
+    cmp.add_argument("--heap-tol", type=float, default=2.0, help="percent drop allowed in free heap/flash")
+    cmp.add_argument("--latency-tol", type=float, default=5.0, help="percent growth allowed in hot path timings")
+    cmp.add_argument("-v", "--verbose", action="store_true", help="print every change")
+    cmp.set_defaults(func=cmd_compare)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()